@@ -5,6 +5,7 @@
 #pragma once
 
 #include <satorivideo/video_bot.h>
+#include <chrono>
 #include <gsl/span>
 #include "../video_bot.h"
 
@@ -14,8 +15,24 @@ namespace video {
 using multiframe_bot_img_callback_t =
     std::function<void(bot_context &context, const gsl::span<image_frame> &frames)>;
 
+// Frame of a cross-stream batch, along with context of the stream it came from.
+struct stream_frame {
+  bot_context *context;
+  image_frame frame;
+};
+
+using multiframe_bot_batch_callback_t =
+    std::function<void(const gsl::span<stream_frame> &frames)>;
+
+// Tells that asynchronous processing of frames is complete, may be called from any
+// thread, only once.
+using bot_completion_t = std::function<void()>;
+
+using multiframe_bot_async_img_callback_t = std::function<void(
+    bot_context &context, const gsl::span<image_frame> &frames, bot_completion_t done)>;
+
 struct multiframe_bot_descriptor {
-  // Pixel format, like RGB0, BGR, etc.
+  // Pixel format, like RGB0, BGR, GRAY8, YUV420P or NV12.
   image_pixel_format pixel_format;
 
   // Invoked on every received image
@@ -24,8 +41,56 @@ struct multiframe_bot_descriptor {
   // Invoked on every received control command, guaranteed to be invoked during
   // initialization
   bot_ctrl_callback_t ctrl_callback;
+
+  // If true, frames are received with empty plane_data and converted to pixel_format
+  // only by bot_convert_frame, so frames skipped by the bot are never converted.
+  bool lazy_conversion{false};
+
+  // If true, processing of a group of pictures doesn't depend on previous ones, so
+  // batch mode may process parts of input file on several bot instances in
+  // parallel, see --batch-jobs. Instances run on different threads.
+  bool gop_independent{false};
+
+  // If positive, bot receives at most that many frames per second, others are
+  // dropped before conversion and counted in frames_dropped_total. Can be
+  // overridden by --max-fps.
+  double max_fps{0};
+
+  // If true, frames decoded by CUDA stay in device memory, see
+  // bot_descriptor::device_frames. Can't be used together with lazy_conversion.
+  bool device_frames{false};
+
+  // If true, frames carry motion vectors exported by the decoder, see
+  // bot_descriptor::motion_vectors and bot_descriptor::motion_vectors_only.
+  bool motion_vectors{false};
+  bool motion_vectors_only{false};
+
+  // If set, invoked instead of img_callback with frames of all streams hosted by the
+  // process, so a model can run on larger batches than one stream provides.
+  // A batch is started once it has max_batch frames or once its oldest frame waited
+  // for max_batch_wait. Frames of one stream stay in the same batch, in order.
+  // Messages sent with bot_message(*frame.context, ...) go to the channels of
+  // frame's stream, and should pass frame.id. Batches are processed one at a time,
+  // on processing threads of the streams, which wait until their frames are done.
+  multiframe_bot_batch_callback_t batch_callback;
+  size_t max_batch{16};
+  std::chrono::milliseconds max_batch_wait{50};
+
+  // If set, invoked instead of img_callback, and may return before frames are
+  // processed, for example by a GPU or a remote accelerator, so decoding of following
+  // frames overlaps with it. done should be called once processing is complete.
+  // Pixels of frames stay valid until then, but bot_convert_frame should be called
+  // before callback returns. Messages about frames should be sent before done is
+  // called, with ids of their frames. Up to max_in_flight batches are processed at
+  // the same time, their messages are emitted in frame order as they complete.
+  multiframe_bot_async_img_callback_t async_img_callback;
+  size_t max_in_flight{4};
 };
 
+// Fills plane_data of a frame from the current batch if bot uses lazy_conversion.
+// Pixels stay valid until callback returns.
+EXPORT void bot_convert_frame(bot_context &context, image_frame &frame);
+
 // Registers opencv bot.
 // Should be called by bot implementation before starting a bot.
 EXPORT void multiframe_bot_register(const multiframe_bot_descriptor &bot);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <satorivideo/video_bot.h>
+#include <opencv2/core/cuda.hpp>
 #include <opencv2/opencv.hpp>
 
 namespace satori {
@@ -13,6 +14,13 @@ namespace video {
 using opencv_bot_img_callback_t =
     std::function<void(bot_context &context, const cv::Mat &img)>;
 
+// Bot image callback receiving NV12 frame in GPU memory: luma is CV_8UC1 Y plane,
+// chroma is CV_8UC2 interleaved UV plane of half width and height. Like cv::Mat of
+// opencv_bot_img_callback_t, mats don't own frame data and live only during
+// callback execution.
+using opencv_bot_gpu_img_callback_t = std::function<void(
+    bot_context &context, const cv::cuda::GpuMat &luma, const cv::cuda::GpuMat &chroma)>;
+
 struct opencv_bot_descriptor {
   // Invoked on every received image
   opencv_bot_img_callback_t img_callback;
@@ -20,6 +28,11 @@ struct opencv_bot_descriptor {
   // Invoked on every received control command, guaranteed to be invoked during
   // initialization
   bot_ctrl_callback_t ctrl_callback;
+
+  // If set, frames decoded by CUDA (--input-hw-device cuda) stay in GPU memory and
+  // are passed here at decoded size. Other frames, like when decoding falls back to
+  // software, go to img_callback, or are uploaded to GPU if img_callback is not set.
+  opencv_bot_gpu_img_callback_t gpu_img_callback;
 };
 
 // Registers opencv bot.
@@ -14,6 +14,7 @@
 #include <cstdint>
 #include <functional>
 #include <json.hpp>
+#include <string>
 
 #include "base.h"
 
@@ -36,6 +37,20 @@ EXPORT struct frame_id {
 
 constexpr uint8_t max_image_planes = 4;
 
+// Block of a frame predicted from a reference frame, as exported by H.264, MPEG-4
+// and other block-based decoders. Positions are centers of the block in pixels of
+// decoded frame, before cropping and scaling.
+EXPORT struct motion_vector {
+  // negative if the reference is a past frame, positive if it is a future one.
+  int32_t source;
+  uint8_t width;
+  uint8_t height;
+  int16_t src_x;
+  int16_t src_y;
+  int16_t dst_x;
+  int16_t dst_y;
+};
+
 // If an image uses packed pixel format like packed RGB or packed YUV,
 // then it has only a single plane, e.g. all it's data is within plane_data[0].
 // If an image uses planar pixel format like planar YUV or HSV,
@@ -45,9 +60,24 @@ constexpr uint8_t max_image_planes = 4;
 EXPORT struct image_frame {
   frame_id id;
   const uint8_t *plane_data[max_image_planes];
+  // if true, plane_data are CUDA device pointers to NV12 planes, see device_frames.
+  bool on_device{false};
+  // see bot_descriptor::motion_vectors, none for key frames.
+  const motion_vector *motion_vectors{nullptr};
+  size_t motion_vectors_count{0};
+};
+
+// Rectangle of source video frame, in pixels
+EXPORT struct image_region {
+  int16_t x;
+  int16_t y;
+  int16_t width;
+  int16_t height;
 };
 
-// Metadata contains information which is unchangeable for a channel
+// Metadata describes frames of the current batch. It changes when bot crops frames,
+// see bot_set_crop, or when the channel changes resolution or codec, then ctrl_callback
+// gets {"action": "resolution_changed"} before the first frame of new size.
 EXPORT struct image_metadata {
   uint16_t width;
   uint16_t height;
@@ -86,10 +116,14 @@ using bot_img_callback_t =
 using bot_ctrl_callback_t =
     std::function<nlohmann::json(bot_context &context, const nlohmann::json &message)>;
 
-enum class image_pixel_format { RGB0 = 1, BGR = 2 };
+// Packed RGB0 and BGR images have a single plane.
+// GRAY8 has only luma plane, YUV420P has Y, U and V planes, NV12 has Y plane and
+// interleaved UV plane. Chroma planes have half of the image width and height.
+enum class image_pixel_format { RGB0 = 1, BGR = 2, GRAY8 = 3, YUV420P = 4, NV12 = 5 };
 
 struct bot_descriptor {
-  // Pixel format, like RGB0, BGR, etc.
+  // Pixel format, like RGB0, BGR, GRAY8, YUV420P or NV12.
+  // Formats close to decoder output, like YUV420P, save color conversion.
   image_pixel_format pixel_format;
 
   // Invoked on every received image
@@ -98,6 +132,33 @@ struct bot_descriptor {
   // Invoked on every received control command, guaranteed to be invoked during
   // initialization
   bot_ctrl_callback_t ctrl_callback;
+
+  // If true, processing of a group of pictures doesn't depend on previous ones, so
+  // batch mode may process parts of input file on several bot instances in
+  // parallel, see --batch-jobs. Instances run on different threads.
+  bool gop_independent{false};
+
+  // If positive, bot receives at most that many frames per second, others are
+  // dropped before conversion and counted in frames_dropped_total. Can be
+  // overridden by --max-fps.
+  double max_fps{0};
+
+  // If true and frames are decoded by CUDA (--input-hw-device cuda), they are not
+  // downloaded to host memory: bot receives NV12 frames of decoded size with
+  // on_device set, regardless of pixel_format, resolution and crop. Frames which
+  // are not on a CUDA device, like when decoding falls back to software, are
+  // delivered in pixel_format as usual.
+  bool device_frames{false};
+
+  // If true, frames carry motion vectors exported by the decoder, which cost
+  // almost nothing compared to optical flow of decoded pixels. Frames are decoded
+  // in software then.
+  bool motion_vectors{false};
+
+  // If true, frames carry only motion vectors, with null plane_data, and
+  // frame_metadata has decoded size. Pixels are not converted or scaled, and the
+  // decoder skips the deblocking filter. Implies motion_vectors.
+  bool motion_vectors_only{false};
 };
 
 // Used by bot implementation to specify type of output.
@@ -109,6 +170,43 @@ EXPORT enum class bot_message_kind { ANALYSIS = 1, DEBUG = 2, CONTROL = 3 };
 EXPORT void bot_message(bot_context &context, bot_message_kind kind,
                         nlohmann::json &&message, const frame_id &id = frame_id{0, 0});
 
+// Writes a message right into CBOR, for bots sending many messages, which would
+// otherwise spend time building json documents. Maps and arrays have definite
+// length, so their size goes first and is followed by their entries, map entries
+// are written as key() and value.
+class message_writer {
+ public:
+  // message is a map with that many fields.
+  explicit message_writer(size_t fields);
+
+  message_writer &key(const std::string &name);
+  message_writer &begin_map(size_t fields);
+  message_writer &begin_array(size_t size);
+  message_writer &text(const std::string &value);
+  message_writer &integer(int64_t value);
+  message_writer &number(double value);
+  message_writer &boolean(bool value);
+  message_writer &null();
+
+  // encoded message, for bot_message_cbor.
+  std::string release() { return std::move(_buffer); }
+
+ private:
+  std::string _buffer;
+};
+
+// Same as bot_message, but takes a message already encoded as CBOR map, for example
+// by message_writer. Message is published as is, without decoding, only "i" and
+// "from" fields are added, so it shouldn't have them.
+EXPORT void bot_message_cbor(bot_context &context, bot_message_kind kind,
+                             std::string &&cbor_map, const frame_id &id = frame_id{0, 0});
+
+// Restricts frames received by the bot to a region of source video frames,
+// for example when a control command tells which region to analyze.
+// Frames are cropped before scaling, so frame_metadata changes with following frames.
+// Region with zero width or height restores full frames.
+EXPORT void bot_set_crop(bot_context &context, const image_region &region);
+
 // Registers a bot.
 // Should be called by bot implementation before starting a bot.
 EXPORT void bot_register(const bot_descriptor &bot);
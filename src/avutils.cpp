@@ -1,18 +1,32 @@
 #include "avutils.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <gsl/gsl>
 #include <sstream>
 #include <stdexcept>
 
 extern "C" {
 #include <libavdevice/avdevice.h>
 #include <libavfilter/avfilter.h>
+#include <libavutil/hwcontext.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/motion_vector.h>
 #include <libavutil/parseutils.h>
 #include <libavutil/pixdesc.h>
 }
 
+#include "frame_arena.h"
 #include "logging.h"
+#include "metrics.h"
 #include "satorivideo/base.h"
 
 namespace satori {
@@ -21,6 +35,9 @@ namespace avutils {
 
 namespace {
 
+// generic hardware decoding API (avcodec_get_hw_config) appeared in FFmpeg 4.0.
+#define HW_DECODING_SUPPORTED (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 18, 100))
+
 std::string to_av_codec_name(const std::string &codec_name) {
   if (codec_name == "vp9") {
     return "libvpx-vp9";
@@ -85,6 +102,106 @@ void dump_filters() {
   LOG(1) << "available filters: " << filters_buffer.str();
 }
 
+auto &frame_pool_hits = prometheus::BuildCounter()
+                            .Name("frame_pool_hits_total")
+                            .Register(metrics_registry())
+                            .Add({});
+auto &frame_pool_misses = prometheus::BuildCounter()
+                              .Name("frame_pool_misses_total")
+                              .Register(metrics_registry())
+                              .Add({});
+
+// AVBufferPool calls allocator synchronously from av_buffer_pool_get().
+thread_local bool frame_pool_buffer_allocated{false};
+
+void free_frame_buffer(void * /*opaque*/, uint8_t *data) {
+  if (!free_arena_frame_buffer(data)) {
+    free(data);
+  }
+}
+
+// large buffers come from frame arena if there is one.
+AVBufferRef *allocate_frame_buffer(int size) {
+  void *data = allocate_arena_frame_buffer(static_cast<size_t>(size));
+  if (data == nullptr
+      && posix_memalign(&data, frame_buffer_alignment, static_cast<size_t>(size)) != 0) {
+    return nullptr;
+  }
+
+  AVBufferRef *buffer = av_buffer_create(static_cast<uint8_t *>(data), size,
+                                         &free_frame_buffer, nullptr, 0);
+  if (buffer == nullptr) {
+    free_frame_buffer(nullptr, static_cast<uint8_t *>(data));
+  }
+  return buffer;
+}
+
+AVBufferRef *allocate_frame_pool_buffer(int size) {
+  frame_pool_buffer_allocated = true;
+  return allocate_frame_buffer(size);
+}
+
+// backs frame with arena buffer, false if there is no arena buffer for it.
+bool allocate_arena_frame(AVFrame &frame, int align) {
+  const auto pixel_format = static_cast<AVPixelFormat>(frame.format);
+  const int size =
+      av_image_get_buffer_size(pixel_format, frame.width, frame.height, align);
+  if (size <= 0) {
+    return false;
+  }
+  // SIMD code may read a bit past the end of the last plane.
+  const size_t padded_size = static_cast<size_t>(size) + frame_buffer_alignment;
+  uint8_t *data = allocate_arena_frame_buffer(padded_size);
+  if (data == nullptr) {
+    return false;
+  }
+  frame.buf[0] = av_buffer_create(data, static_cast<int>(padded_size),
+                                  &free_frame_buffer, nullptr, 0);
+  if (frame.buf[0] == nullptr) {
+    free_arena_frame_buffer(data);
+    return false;
+  }
+  av_image_fill_arrays(frame.data, frame.linesize, data, pixel_format, frame.width,
+                       frame.height, align);
+  frame.extended_data = frame.data;
+  return true;
+}
+
+#if HW_DECODING_SUPPORTED
+AVPixelFormat hw_pixel_format(const AVCodec *decoder, AVHWDeviceType device_type) {
+  for (int i = 0;; i++) {
+    const AVCodecHWConfig *config = avcodec_get_hw_config(decoder, i);
+    if (config == nullptr) {
+      return AV_PIX_FMT_NONE;
+    }
+    if ((config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) != 0
+        && config->device_type == device_type) {
+      return config->pix_fmt;
+    }
+  }
+}
+
+// Picks hardware pixel format if decoder offers it, otherwise the first software one.
+AVPixelFormat hw_get_format(AVCodecContext *context, const AVPixelFormat *formats) {
+  const auto *device =
+      reinterpret_cast<const AVHWDeviceContext *>(context->hw_device_ctx->data);
+  const AVPixelFormat hw_format = hw_pixel_format(context->codec, device->type);
+
+  for (const AVPixelFormat *f = formats; *f != AV_PIX_FMT_NONE; f++) {
+    if (*f == hw_format) {
+      return *f;
+    }
+  }
+  LOG(WARNING) << "hardware pixel format is not offered, decoding in software";
+  for (const AVPixelFormat *f = formats; *f != AV_PIX_FMT_NONE; f++) {
+    if ((av_pix_fmt_desc_get(*f)->flags & AV_PIX_FMT_FLAG_HWACCEL) == 0) {
+      return *f;
+    }
+  }
+  return AV_PIX_FMT_NONE;
+}
+#endif
+
 }  // namespace
 
 void init() {
@@ -153,6 +270,12 @@ AVPixelFormat to_av_pixel_format(image_pixel_format pixel_format) {
       return AV_PIX_FMT_BGR24;
     case image_pixel_format::RGB0:
       return AV_PIX_FMT_RGB0;
+    case image_pixel_format::GRAY8:
+      return AV_PIX_FMT_GRAY8;
+    case image_pixel_format::YUV420P:
+      return AV_PIX_FMT_YUV420P;
+    case image_pixel_format::NV12:
+      return AV_PIX_FMT_NV12;
     default:
       throw std::runtime_error{"Unsupported pixel format: "
                                + std::to_string((int)pixel_format)};
@@ -165,18 +288,26 @@ image_pixel_format to_image_pixel_format(AVPixelFormat pixel_format) {
       return image_pixel_format::BGR;
     case AV_PIX_FMT_RGB0:
       return image_pixel_format::RGB0;
+    case AV_PIX_FMT_GRAY8:
+      return image_pixel_format::GRAY8;
+    case AV_PIX_FMT_YUV420P:
+      return image_pixel_format::YUV420P;
+    case AV_PIX_FMT_NV12:
+      return image_pixel_format::NV12;
     default:
       throw std::runtime_error{"Unsupported pixel format: "
                                + std::to_string((int)pixel_format)};
   }
 }
 
-std::shared_ptr<AVCodecContext> encoder_context(const AVCodecID codec_id) {
-  const std::string encoder_name = avcodec_get_name(codec_id);
+std::shared_ptr<AVCodecContext> encoder_context(const AVCodecID codec_id,
+                                                const std::string &name) {
+  const std::string encoder_name = name.empty() ? avcodec_get_name(codec_id) : name;
   LOG(1) << "Searching for encoder '" << encoder_name << "'";
 
-  const AVCodec *encoder = avcodec_find_encoder(codec_id);
-  if (encoder == nullptr) {
+  const AVCodec *encoder = name.empty() ? avcodec_find_encoder(codec_id)
+                                        : avcodec_find_encoder_by_name(name.c_str());
+  if (encoder == nullptr || encoder->id != codec_id) {
     LOG(ERROR) << "Encoder '" << encoder_name << "' was not found";
     return nullptr;
   }
@@ -210,8 +341,38 @@ std::shared_ptr<AVCodecContext> encoder_context(const AVCodecID codec_id) {
   });
 }
 
-std::shared_ptr<AVCodecContext> decoder_context(const std::string &codec_name,
-                                                gsl::cstring_span<> extra_data) {
+std::shared_ptr<AVBufferRef> hw_device_context(const std::string &device_type) {
+#if HW_DECODING_SUPPORTED
+  const AVHWDeviceType type = av_hwdevice_find_type_by_name(device_type.c_str());
+  if (type == AV_HWDEVICE_TYPE_NONE) {
+    LOG(ERROR) << "unknown hardware device type '" << device_type << "'";
+    return nullptr;
+  }
+
+  AVBufferRef *device{nullptr};
+  const int err = av_hwdevice_ctx_create(&device, type, nullptr, nullptr, 0);
+  if (err < 0) {
+    LOG(WARNING) << "failed to create hardware device '" << device_type
+                 << "': " << error_msg(err);
+    return nullptr;
+  }
+
+  LOG(INFO) << "created hardware device '" << device_type << "'";
+  return std::shared_ptr<AVBufferRef>(device, [](AVBufferRef *ref) {
+    LOG(1) << "deleting hardware device";
+    av_buffer_unref(&ref);
+  });
+#else
+  LOG(WARNING) << "hardware decoding is not supported by FFmpeg "
+               << av_version_info() << ", ignoring device '" << device_type << "'";
+  return nullptr;
+#endif
+}
+
+std::shared_ptr<AVCodecContext> decoder_context(
+    const std::string &codec_name, gsl::cstring_span<> extra_data, int thread_count,
+    int thread_type, const std::shared_ptr<AVBufferRef> &hw_device, int lowres,
+    bool export_motion_vectors) {
   std::string av_codec_name = to_av_codec_name(codec_name);
   LOG(1) << "searching for decoder '" << av_codec_name << "'";
   const AVCodec *decoder = avcodec_find_decoder_by_name(av_codec_name.c_str());
@@ -240,8 +401,27 @@ std::shared_ptr<AVCodecContext> decoder_context(const std::string &codec_name,
     return nullptr;
   }
 
-  context->thread_count = 4;
-  context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  context->thread_count = thread_count;
+  context->thread_type = thread_type;
+  context->lowres = std::min(lowres, static_cast<int>(decoder->max_lowres));
+  if (export_motion_vectors) {
+    context->flags2 |= AV_CODEC_FLAG2_EXPORT_MVS;
+  }
+
+#if HW_DECODING_SUPPORTED
+  if (hw_device) {
+    const auto *device = reinterpret_cast<const AVHWDeviceContext *>(hw_device->data);
+    if (hw_pixel_format(decoder, device->type) != AV_PIX_FMT_NONE) {
+      context->hw_device_ctx = av_buffer_ref(hw_device.get());
+      context->get_format = hw_get_format;
+      LOG(INFO) << "decoder '" << av_codec_name << "' uses hardware device "
+                << av_hwdevice_get_type_name(device->type);
+    } else {
+      LOG(WARNING) << "decoder '" << av_codec_name << "' doesn't support hardware device "
+                   << av_hwdevice_get_type_name(device->type) << ", decoding in software";
+    }
+  }
+#endif
 
   err = avcodec_open2(context.get(), decoder, nullptr);
   if (err < 0) {
@@ -249,7 +429,9 @@ std::shared_ptr<AVCodecContext> decoder_context(const std::string &codec_name,
     return nullptr;
   }
 
-  LOG(1) << "Allocated context for decoder '" << av_codec_name << "'";
+  LOG(1) << "Allocated context for decoder '" << av_codec_name << "', "
+         << context->thread_count << " threads, thread type " << context->thread_type
+         << ", lowres " << context->lowres;
   return context;
 }
 
@@ -279,6 +461,73 @@ std::shared_ptr<AVFrame> av_frame() {
   return frame;
 }
 
+int download_hw_frame(const AVFrame &hw_frame, AVFrame &frame) {
+  av_frame_unref(&frame);
+  int err = av_hwframe_transfer_data(&frame, &hw_frame, 0);
+  if (err < 0) {
+    LOG(ERROR) << "failed to download hardware frame: " << error_msg(err);
+    return err;
+  }
+  err = av_frame_copy_props(&frame, &hw_frame);
+  if (err < 0) {
+    LOG(ERROR) << "failed to copy frame properties: " << error_msg(err);
+  }
+  return err;
+}
+
+std::shared_ptr<AVBufferRef> hw_frames_context(
+    const std::shared_ptr<AVBufferRef> &hw_device, AVPixelFormat hw_format,
+    AVPixelFormat sw_format, int width, int height) {
+  if (!hw_device) {
+    return nullptr;
+  }
+
+  AVBufferRef *frames = av_hwframe_ctx_alloc(hw_device.get());
+  if (frames == nullptr) {
+    LOG(ERROR) << "failed to allocate hardware frames context";
+    return nullptr;
+  }
+
+  auto *frames_context = reinterpret_cast<AVHWFramesContext *>(frames->data);
+  frames_context->format = hw_format;
+  frames_context->sw_format = sw_format;
+  frames_context->width = width;
+  frames_context->height = height;
+  frames_context->initial_pool_size = 20;
+  const int err = av_hwframe_ctx_init(frames);
+  if (err < 0) {
+    LOG(ERROR) << "failed to initialize hardware frames context: " << error_msg(err);
+    av_buffer_unref(&frames);
+    return nullptr;
+  }
+
+  LOG(INFO) << "created " << width << "x" << height << " hardware frames of "
+            << av_get_pix_fmt_name(hw_format) << "/" << av_get_pix_fmt_name(sw_format);
+  return std::shared_ptr<AVBufferRef>(frames, [](AVBufferRef *ref) {
+    LOG(1) << "deleting hardware frames context";
+    av_buffer_unref(&ref);
+  });
+}
+
+int upload_hw_frame(AVBufferRef &hw_frames, const AVFrame &frame, AVFrame &hw_frame) {
+  av_frame_unref(&hw_frame);
+  int err = av_hwframe_get_buffer(&hw_frames, &hw_frame, 0);
+  if (err < 0) {
+    LOG(ERROR) << "failed to get hardware frame: " << error_msg(err);
+    return err;
+  }
+  err = av_hwframe_transfer_data(&hw_frame, &frame, 0);
+  if (err < 0) {
+    LOG(ERROR) << "failed to upload hardware frame: " << error_msg(err);
+    return err;
+  }
+  err = av_frame_copy_props(&hw_frame, &frame);
+  if (err < 0) {
+    LOG(ERROR) << "failed to copy frame properties: " << error_msg(err);
+  }
+  return err;
+}
+
 std::shared_ptr<AVPacket> av_packet() {
   LOG(1) << "allocating packet";
   std::shared_ptr<AVPacket> packet(av_packet_alloc(), [](AVPacket *f) {
@@ -293,6 +542,18 @@ std::shared_ptr<AVPacket> av_packet() {
   return packet;
 }
 
+shared_bytes packet_data(const AVPacket &packet) {
+  const auto *data = reinterpret_cast<const char *>(packet.data);
+  const auto size = static_cast<size_t>(packet.size);
+  AVBufferRef *buffer = packet.buf != nullptr ? av_buffer_ref(packet.buf) : nullptr;
+  if (buffer == nullptr) {
+    return shared_bytes{data, size};
+  }
+
+  std::shared_ptr<const void> owner(buffer, [](AVBufferRef *b) { av_buffer_unref(&b); });
+  return shared_bytes{std::move(owner), data, size};
+}
+
 std::shared_ptr<AVFrame> av_frame(int width, int height, int align,
                                   AVPixelFormat pixel_format) {
   std::shared_ptr<AVFrame> frame_smart_ptr = av_frame();
@@ -311,6 +572,10 @@ std::shared_ptr<AVFrame> av_frame(int width, int height, int align,
   frame_smart_ptr->format = pixel_format;
 
   LOG(1) << "Allocating data for frame " << frame_description;
+  if (allocate_arena_frame(*frame_smart_ptr, align)) {
+    LOG(1) << "Allocated arena data for frame " << frame_description;
+    return frame_smart_ptr;
+  }
   int ret = av_frame_get_buffer(frame_smart_ptr.get(), align);
   if (ret < 0) {
     LOG(ERROR) << "Failed to allocate data for frame " << frame_description << ": "
@@ -387,14 +652,142 @@ std::shared_ptr<AVFormatContext> output_format_context(
       });
 }
 
-std::shared_ptr<AVFormatContext> open_input_format_context(const std::string &url,
-                                                           AVInputFormat *forced_format,
-                                                           AVDictionary *options) {
+namespace {
+
+// Local input file mapped into memory. FFmpeg reads it through io context of its
+// own, buffer refills are copies from the mapping instead of read() calls of file
+// protocol.
+class mapped_input {
+ public:
+  mapped_input(const uint8_t *data, size_t size) : _data(data), _size(size) {}
+  ~mapped_input() { munmap(const_cast<uint8_t *>(_data), _size); }
+
+  mapped_input(const mapped_input &) = delete;
+  mapped_input &operator=(const mapped_input &) = delete;
+
+  static int read(void *opaque, uint8_t *buf, int buf_size) {
+    auto *input = static_cast<mapped_input *>(opaque);
+    if (input->_position >= input->_size) {
+      return AVERROR_EOF;
+    }
+    const size_t size =
+        std::min(static_cast<size_t>(buf_size), input->_size - input->_position);
+    std::memcpy(buf, input->_data + input->_position, size);
+    input->_position += size;
+    return static_cast<int>(size);
+  }
+
+  static int64_t seek(void *opaque, int64_t offset, int whence) {
+    auto *input = static_cast<mapped_input *>(opaque);
+    const auto size = static_cast<int64_t>(input->_size);
+    int64_t position;
+    switch (whence & ~AVSEEK_FORCE) {
+      case AVSEEK_SIZE:
+        return size;
+      case SEEK_SET:
+        position = offset;
+        break;
+      case SEEK_CUR:
+        position = static_cast<int64_t>(input->_position) + offset;
+        break;
+      case SEEK_END:
+        position = size + offset;
+        break;
+      default:
+        return AVERROR(EINVAL);
+    }
+    if (position < 0 || position > size) {
+      return AVERROR(EINVAL);
+    }
+    input->_position = static_cast<size_t>(position);
+    return position;
+  }
+
+ private:
+  const uint8_t *const _data;
+  const size_t _size;
+  size_t _position{0};
+};
+
+constexpr int mapped_input_buffer_size = 256 * 1024;
+
+// path of url without protocol or with file protocol.
+boost::optional<std::string> local_path(const std::string &url) {
+  const size_t colon = url.find(':');
+  if (colon == std::string::npos) {
+    return url;
+  }
+  if (url.compare(0, colon, "file") == 0) {
+    return url.substr(colon + 1);
+  }
+  // colon is a part of file name.
+  if (url.find('/') < colon) {
+    return url;
+  }
+  return boost::none;
+}
+
+// nullptr if url is not a local regular file or it can't be mapped, then FFmpeg
+// opens it by itself.
+std::shared_ptr<mapped_input> map_input(const std::string &url) {
+  const auto path = local_path(url);
+  if (!path) {
+    return nullptr;
+  }
+  const int fd = ::open(path->c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  // mapping stays valid after descriptor is closed.
+  auto close_fd = gsl::finally([fd]() { ::close(fd); });
+
+  struct stat st {};
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    return nullptr;
+  }
+  const auto size = static_cast<size_t>(st.st_size);
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    LOG(WARNING) << "failed to map " << *path << ": " << std::strerror(errno);
+    return nullptr;
+  }
+  // demuxers mostly read forward, seeks are rare.
+  madvise(data, size, MADV_SEQUENTIAL);
+  return std::make_shared<mapped_input>(static_cast<const uint8_t *>(data), size);
+}
+
+void free_io_context(AVIOContext *io_context) {
+  if (io_context != nullptr) {
+    // FFmpeg may have replaced the buffer.
+    av_freep(&io_context->buffer);
+    avio_context_free(&io_context);
+  }
+}
+
+}  // namespace
+
+std::shared_ptr<AVFormatContext> open_input_format_context(
+    const std::string &url, AVInputFormat *forced_format, AVDictionary *options,
+    const AVIOInterruptCB &interrupt_callback) {
   AVFormatContext *format_context = avformat_alloc_context();
   if (format_context == nullptr) {
     LOG(ERROR) << "failed to allocate format context";
     return nullptr;
   }
+  format_context->interrupt_callback = interrupt_callback;
+
+  // devices are opened with forced formats, they are not files.
+  std::shared_ptr<mapped_input> mapped =
+      forced_format == nullptr ? map_input(url) : nullptr;
+  AVIOContext *io_context = nullptr;
+  if (mapped) {
+    auto buffer = static_cast<uint8_t *>(av_malloc(mapped_input_buffer_size));
+    CHECK(buffer);
+    io_context = avio_alloc_context(buffer, mapped_input_buffer_size, 0, mapped.get(),
+                                    &mapped_input::read, nullptr, &mapped_input::seek);
+    CHECK(io_context) << "failed to allocate io context for " << url;
+    format_context->pb = io_context;
+  }
 
   std::string options_str;
   if (options != nullptr) {
@@ -404,20 +797,23 @@ std::shared_ptr<AVFormatContext> open_input_format_context(const std::string &ur
     free(buffer);
   }
 
-  LOG(1) << "opening url " << url << " " << options_str;
+  LOG(1) << "opening url " << url << " " << options_str << (mapped ? " mapped" : "");
   int ret = avformat_open_input(&format_context, url.c_str(), forced_format, &options);
   if (ret < 0) {
-    // format_context is freed on open error.
+    // format_context is freed on open error, custom io context is not.
     LOG(ERROR) << "failed to open " << url << ": " << error_msg(ret);
+    free_io_context(io_context);
     return nullptr;
   }
   LOG(1) << "opened url " << url;
-  return std::shared_ptr<AVFormatContext>(format_context, [url](AVFormatContext *ctx) {
-    LOG(INFO) << "closing url " << url;
-    avformat_close_input(&ctx);
-    avformat_free_context(ctx);
-    LOG(INFO) << "format context is destroyed for " << url;
-  });
+  return std::shared_ptr<AVFormatContext>(
+      format_context, [url, mapped, io_context](AVFormatContext *ctx) {
+        LOG(INFO) << "closing url " << url;
+        avformat_close_input(&ctx);
+        avformat_free_context(ctx);
+        free_io_context(io_context);
+        LOG(INFO) << "format context is destroyed for " << url;
+      });
 }
 
 void copy_image_to_av_frame(const owned_image_frame &image,
@@ -425,40 +821,181 @@ void copy_image_to_av_frame(const owned_image_frame &image,
   CHECK_EQ(image.width, frame->width) << "Image and frame widhts don't match";
   CHECK_EQ(image.height, frame->height) << "Image and frame heights don't match";
   for (int i = 0; i < max_image_planes; i++) {
-    if (image.plane_strides[i] > 0) {
-      memcpy(frame->data[i], image.plane_data[i].data(), image.plane_data[i].size());
+    const auto stride = static_cast<int>(image.plane_strides[i]);
+    if (stride > 0) {
+      // strides are padded row sizes, so the smaller one covers the pixels.
+      copy_plane(image.plane_data[i].data(), stride, frame->data[i], frame->linesize[i],
+                 std::min(stride, frame->linesize[i]),
+                 static_cast<int>(image.plane_data[i].size() / stride));
     }
   }
 }
 
-owned_image_frame to_image_frame(const AVFrame &frame) {
+std::shared_ptr<AVFrame> image_to_av_frame(const owned_image_frame &image) {
+  std::shared_ptr<AVFrame> frame = av_frame();
+  if (!frame) {
+    return nullptr;
+  }
+
+  frame->width = image.width;
+  frame->height = image.height;
+  frame->format = to_av_pixel_format(image.pixel_format);
+  for (int i = 0; i < max_image_planes; i++) {
+    const image_plane &plane = image.plane_data[i];
+    if (image.plane_strides[i] == 0 || plane.empty()) {
+      continue;
+    }
+    // buffer holds a copy of the plane, which shares its pixels.
+    auto *owner = new image_plane(plane);
+    frame->buf[i] = av_buffer_create(
+        const_cast<uint8_t *>(plane.data()), static_cast<int>(plane.size()),
+        [](void *opaque, uint8_t *) { delete static_cast<image_plane *>(opaque); },
+        owner, AV_BUFFER_FLAG_READONLY);
+    if (frame->buf[i] == nullptr) {
+      delete owner;
+      return nullptr;
+    }
+    frame->data[i] = const_cast<uint8_t *>(plane.data());
+    frame->linesize[i] = static_cast<int>(image.plane_strides[i]);
+  }
+  return frame;
+}
+
+namespace {
+
+// image planes reference planes of the frame, which hold pixels of given format.
+owned_image_frame reference_frame(const AVFrame &frame, AVPixelFormat pixel_format) {
   owned_image_frame image;
 
+  // referenced frame keeps decoder buffers alive while image planes point into them.
+  std::shared_ptr<AVFrame> frame_ref = av_frame();
+  CHECK(frame_ref) << "failed to allocate frame";
+  int ret = av_frame_ref(frame_ref.get(), &frame);
+  CHECK_EQ(ret, 0) << "failed to reference frame: " << error_msg(ret);
+
   image.width = static_cast<uint16_t>(frame.width);
   image.height = static_cast<uint16_t>(frame.height);
-  image.pixel_format = to_image_pixel_format(static_cast<AVPixelFormat>(frame.format));
+  image.pixel_format = to_image_pixel_format(pixel_format);
   image.timestamp =
       std::chrono::system_clock::time_point{std::chrono::milliseconds(frame.pts)};
 
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pixel_format);
   for (uint8_t i = 0; i < max_image_planes; i++) {
-    const auto plane_stride = static_cast<uint32_t>(frame.linesize[i]);
+    const auto plane_stride = static_cast<uint32_t>(frame_ref->linesize[i]);
     image.plane_strides[i] = plane_stride;
     if (plane_stride > 0) {
-      const uint8_t *plane_data = frame.data[i];
-      image.plane_data[i].assign(plane_data, plane_data + (plane_stride * frame.height));
+      // chroma planes of subsampled formats have fewer rows.
+      const bool chroma = (i == 1 || i == 2) && desc != nullptr;
+      const int plane_height =
+          chroma ? -((-frame.height) >> desc->log2_chroma_h) : frame.height;
+      image.plane_data[i] = image_plane{frame_ref, frame_ref->data[i],
+                                        size_t{plane_stride} * plane_height};
     }
   }
 
   return image;
 }
 
+}  // namespace
+
+owned_image_frame to_image_frame(const AVFrame &frame) {
+  return reference_frame(frame, static_cast<AVPixelFormat>(frame.format));
+}
+
+boost::optional<owned_image_frame> to_device_image_frame(const AVFrame &frame) {
+  if (frame.format != AV_PIX_FMT_CUDA || frame.hw_frames_ctx == nullptr) {
+    return boost::none;
+  }
+  const auto *frames_context =
+      reinterpret_cast<const AVHWFramesContext *>(frame.hw_frames_ctx->data);
+  if (frames_context->sw_format != AV_PIX_FMT_NV12) {
+    return boost::none;
+  }
+
+  // CUDA frames keep device pointers in data and pitches in linesize.
+  owned_image_frame image = reference_frame(frame, AV_PIX_FMT_NV12);
+  image.on_device = true;
+  return image;
+}
+
+std::shared_ptr<const std::vector<motion_vector>> motion_vectors(const AVFrame &frame) {
+  const AVFrameSideData *side_data =
+      av_frame_get_side_data(&frame, AV_FRAME_DATA_MOTION_VECTORS);
+  if (side_data == nullptr) {
+    return nullptr;
+  }
+
+  const auto *vectors = reinterpret_cast<const AVMotionVector *>(side_data->data);
+  const size_t count = side_data->size / sizeof(AVMotionVector);
+  auto result = std::make_shared<std::vector<motion_vector>>();
+  result->reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    const AVMotionVector &v = vectors[i];
+    result->push_back(motion_vector{v.source, v.w, v.h, v.src_x, v.src_y, v.dst_x,
+                                    v.dst_y});
+  }
+  return result;
+}
+
+frame_pool::frame_pool(int width, int height, AVPixelFormat pixel_format)
+    : _width(width), _height(height), _pixel_format(pixel_format) {
+  int ret = av_image_fill_linesizes(_linesize, pixel_format, width);
+  CHECK_GE(ret, 0) << "failed to compute linesizes for " << width << "x" << height
+                   << " " << av_get_pix_fmt_name(pixel_format) << ": "
+                   << error_msg(ret);
+
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pixel_format);
+  size_t size = 0;
+  for (int i = 0; i < max_image_planes; i++) {
+    _linesize[i] = FFALIGN(_linesize[i], frame_buffer_alignment);
+    _plane_offset[i] = size;
+    const bool chroma = i == 1 || i == 2;
+    const int plane_height = chroma ? -((-height) >> desc->log2_chroma_h) : height;
+    size += static_cast<size_t>(_linesize[i]) * plane_height;
+  }
+
+  _pool = av_buffer_pool_init(static_cast<int>(size), &allocate_frame_pool_buffer);
+  CHECK(_pool) << "failed to allocate frame pool";
+}
+
+frame_pool::~frame_pool() { av_buffer_pool_uninit(&_pool); }
+
+std::shared_ptr<AVFrame> frame_pool::get() {
+  std::shared_ptr<AVFrame> frame = av_frame();
+  if (frame == nullptr) {
+    return nullptr;
+  }
+
+  frame_pool_buffer_allocated = false;
+  frame->buf[0] = av_buffer_pool_get(_pool);
+  if (frame->buf[0] == nullptr) {
+    LOG(ERROR) << "failed to get buffer from frame pool";
+    return nullptr;
+  }
+  if (frame_pool_buffer_allocated) {
+    frame_pool_misses.Increment();
+  } else {
+    frame_pool_hits.Increment();
+  }
+
+  frame->width = _width;
+  frame->height = _height;
+  frame->format = _pixel_format;
+  for (int i = 0; i < max_image_planes; i++) {
+    frame->linesize[i] = _linesize[i];
+    frame->data[i] = _linesize[i] > 0 ? frame->buf[0]->data + _plane_offset[i] : nullptr;
+  }
+  frame->extended_data = frame->data;
+  return frame;
+}
+
 std::shared_ptr<allocated_image> allocate_image(const image_size &size,
                                                 image_pixel_format pixel_format) {
   uint8_t *data[max_image_planes];
   int linesize[max_image_planes];
 
   int bytes = av_image_alloc(data, linesize, size.width, size.height,
-                             to_av_pixel_format(pixel_format), 1);
+                             to_av_pixel_format(pixel_format), frame_buffer_alignment);
   if (bytes <= 0) {
     LOG(ERROR) << "av_image_alloc failed for " << size
                << " format= " << (int)pixel_format;
@@ -485,6 +1022,18 @@ streams::error_or<image_size> parse_image_size(const std::string &str) {
   return image_size{(int16_t)width, (int16_t)height};
 }
 
+streams::error_or<image_region> parse_image_region(const std::string &str) {
+  int width, height, x, y;
+  char end;
+  if (std::sscanf(str.c_str(), "%dx%d+%d+%d%c", &width, &height, &x, &y, &end) != 4
+      || width <= 0 || height <= 0 || x < 0 || y < 0) {
+    LOG(ERROR) << "couldn't parse image region from " << str;
+    return std::system_category().default_error_condition(EBADMSG);
+  }
+
+  return image_region{(int16_t)x, (int16_t)y, (int16_t)width, (int16_t)height};
+}
+
 int find_best_video_stream(AVFormatContext *context, AVCodec **decoder_out) {
   int ret = avformat_find_stream_info(context, nullptr);
   if (ret < 0) {
@@ -510,6 +1059,9 @@ AVCodecID codec_id(const std::string &codec_name) {
   if (codec_name == "h264") {
     return AV_CODEC_ID_H264;
   }
+  if (codec_name == "mjpeg") {
+    return AV_CODEC_ID_MJPEG;
+  }
   ABORT() << "unsupported codec: " << codec_name;
 }
 
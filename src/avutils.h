@@ -36,24 +36,57 @@ AVPixelFormat to_av_pixel_format(image_pixel_format pixel_format);
 image_pixel_format to_image_pixel_format(AVPixelFormat pixel_format);
 
 // Creates FFmpeg's encoder context for encoder identified by encoder id.
-std::shared_ptr<AVCodecContext> encoder_context(AVCodecID codec_id);
+// If encoder_name is not empty, that implementation of the codec is used,
+// e.g. libx264 rather than a hardware encoder.
+std::shared_ptr<AVCodecContext> encoder_context(AVCodecID codec_id,
+                                                const std::string &encoder_name = "");
+
+// Creates FFmpeg's hardware device context of given type (vaapi, cuda,
+// videotoolbox, ...), returns nullptr if device is not available.
+std::shared_ptr<AVBufferRef> hw_device_context(const std::string &device_type);
 
 // Creates FFmpeg's decoder context for decoder identified by name.
-std::shared_ptr<AVCodecContext> decoder_context(const std::string &codec_name,
-                                                gsl::cstring_span<> extra_data);
+// thread_count of 0 picks it by number of cores, thread_type is FF_THREAD_* mask.
+// If hw_device is set and decoder supports it, frames are decoded into hardware
+// surfaces, see download_hw_frame.
+// lowres reduces decoded frame size 2^lowres times, if decoder supports it.
+std::shared_ptr<AVCodecContext> decoder_context(
+    const std::string &codec_name, gsl::cstring_span<> extra_data,
+    int thread_count = 0, int thread_type = FF_THREAD_SLICE,
+    const std::shared_ptr<AVBufferRef> &hw_device = nullptr, int lowres = 0,
+    bool export_motion_vectors = false);
 
 std::shared_ptr<AVCodecContext> decoder_context(const AVCodec *decoder);
 
-// Creates FFmpeg's AVFrame and allocates necessary fields.
+// Creates FFmpeg's AVFrame and allocates necessary fields. Large frames take their
+// buffer from frame arena if there is one, see init_frame_arena.
 std::shared_ptr<AVFrame> av_frame(int width, int height, int align,
                                   AVPixelFormat pixel_format);
 
 // Creates FFmpeg's AVFrame.
 std::shared_ptr<AVFrame> av_frame();
 
+// Copies hardware surface of decoded frame to software frame, returns negative
+// FFmpeg error code on failure.
+int download_hw_frame(const AVFrame &hw_frame, AVFrame &frame);
+
+// Creates pool of hardware surfaces of hw_format holding sw_format pixels, which
+// hardware encoders take as input. Returns nullptr on failure.
+std::shared_ptr<AVBufferRef> hw_frames_context(
+    const std::shared_ptr<AVBufferRef> &hw_device, AVPixelFormat hw_format,
+    AVPixelFormat sw_format, int width, int height);
+
+// Copies software frame to a surface from hw_frames pool, returns negative FFmpeg
+// error code on failure.
+int upload_hw_frame(AVBufferRef &hw_frames, const AVFrame &frame, AVFrame &hw_frame);
+
 // Creates FFmpeg's AVPacket..
 std::shared_ptr<AVPacket> av_packet();
 
+// Returns packet payload referencing packet's buffer, so it outlives the packet
+// without being copied. Payload of packets without buffer is copied.
+shared_bytes packet_data(const AVPacket &packet);
+
 // Creates FFmpeg's sws context based on source and destination frames.
 // Sws context is used to scale images and convert pixel formats.
 std::shared_ptr<SwsContext> sws_context(const std::shared_ptr<const AVFrame> &src_frame,
@@ -74,18 +107,79 @@ std::shared_ptr<AVFormatContext> output_format_context(
     const std::string &format, const std::string &filename,
     const std::function<void(AVFormatContext *)> &file_cleaner);
 
+// interrupt_callback, if set, can abort blocking calls of the context, opening too.
 std::shared_ptr<AVFormatContext> open_input_format_context(
     const std::string &url, AVInputFormat *forced_format = nullptr,
-    AVDictionary *options = nullptr);
+    AVDictionary *options = nullptr,
+    const AVIOInterruptCB &interrupt_callback = AVIOInterruptCB{nullptr, nullptr});
 int find_best_video_stream(AVFormatContext *context, AVCodec **decoder_out);
 
-// Copies image frame data to AVFrame
+// Copies rows of row_bytes bytes between planes of different strides, at once if
+// strides are equal.
+void copy_plane(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+                int row_bytes, int rows);
+
+// Returns true if swizzle_packed_rgb converts between these formats, which are
+// RGB24 or BGR24 on one side and RGB0 or BGR0 on the other.
+bool can_swizzle_packed_rgb(AVPixelFormat src_format, AVPixelFormat dst_format);
+
+// Reorders channels of packed RGB image without swscale, using AVX2 or NEON when
+// CPU has them. Unused channel of 4 channel formats is zeroed.
+void swizzle_packed_rgb(AVPixelFormat src_format, const uint8_t *src, int src_stride,
+                        AVPixelFormat dst_format, uint8_t *dst, int dst_stride,
+                        int width, int height);
+
+// Sums size bytes, using AVX2 or NEON when CPU has them.
+uint64_t sum_bytes(const uint8_t *data, int size);
+
+// Copies image frame data to AVFrame, strides of image and frame may differ.
 void copy_image_to_av_frame(const owned_image_frame &image,
                             const std::shared_ptr<AVFrame> &frame);
 
+// Makes AVFrame referencing image planes without copying pixels. Frame buffers
+// keep planes alive and are read-only. Returns nullptr on allocation failure.
+std::shared_ptr<AVFrame> image_to_av_frame(const owned_image_frame &image);
+
 // Converts AVFrame to image frame
 owned_image_frame to_image_frame(const AVFrame &frame);
 
+// References NV12 planes of CUDA frame without downloading them, image is marked
+// on_device. Returns none for other frames.
+boost::optional<owned_image_frame> to_device_image_frame(const AVFrame &frame);
+
+// Motion vectors decoder attached to the frame, nullptr if there are none.
+std::shared_ptr<const std::vector<motion_vector>> motion_vectors(const AVFrame &frame);
+
+// Alignment of pooled frame planes and strides, suitable for SIMD loads.
+constexpr int frame_buffer_alignment = 64;
+
+// Recycles data buffers of frames with fixed size and pixel format. A buffer
+// returns to the pool when the last reference to it is released, e.g. when image
+// frames made by to_image_frame are destroyed. Pool may be destroyed before
+// buffers it gave out. Large buffers come from frame arena if there is one.
+class frame_pool {
+ public:
+  frame_pool(int width, int height, AVPixelFormat pixel_format);
+  ~frame_pool();
+
+  frame_pool(const frame_pool &) = delete;
+  frame_pool &operator=(const frame_pool &) = delete;
+
+  // Returns frame backed by pooled buffer or nullptr on allocation failure.
+  std::shared_ptr<AVFrame> get();
+
+  // strides of pooled frames planes.
+  const int *linesize() const { return _linesize; }
+
+ private:
+  const int _width;
+  const int _height;
+  const AVPixelFormat _pixel_format;
+  int _linesize[max_image_planes];
+  size_t _plane_offset[max_image_planes];
+  AVBufferPool *_pool{nullptr};
+};
+
 struct allocated_image {
   uint8_t *data[max_image_planes];
   int linesize[max_image_planes];
@@ -96,6 +190,9 @@ std::shared_ptr<allocated_image> allocate_image(const image_size &size,
 
 streams::error_or<image_size> parse_image_size(const std::string &str);
 
+// parses <width>x<height>+<x>+<y>
+streams::error_or<image_region> parse_image_region(const std::string &str);
+
 AVCodecID codec_id(const std::string &codec_name);
 
 }  // namespace avutils
@@ -0,0 +1,260 @@
+// Plane copies, packed RGB swizzles, which don't need swscale, and byte sums of
+// motion signatures. Vector versions are compiled for AVX2 or NEON and picked at
+// runtime by FFmpeg's cpu flags.
+#include "avutils.h"
+
+#include <cstring>
+
+extern "C" {
+#include <libavutil/cpu.h>
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AVUTILS_KERNELS_AVX2 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define AVUTILS_KERNELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "logging.h"
+
+namespace satori {
+namespace video {
+namespace avutils {
+
+namespace {
+
+// converts a row of pixels, width is in pixels.
+using row_kernel = void (*)(const uint8_t *src, uint8_t *dst, int width);
+
+// 3 channels to 4, Reverse swaps first and third channel, fourth one is zeroed.
+template <bool Reverse>
+void pad_row(const uint8_t *src, uint8_t *dst, int width) {
+  for (int x = 0; x < width; x++, src += 3, dst += 4) {
+    dst[0] = src[Reverse ? 2 : 0];
+    dst[1] = src[1];
+    dst[2] = src[Reverse ? 0 : 2];
+    dst[3] = 0;
+  }
+}
+
+// 4 channels to 3, fourth one is dropped.
+template <bool Reverse>
+void strip_row(const uint8_t *src, uint8_t *dst, int width) {
+  for (int x = 0; x < width; x++, src += 4, dst += 3) {
+    dst[0] = src[Reverse ? 2 : 0];
+    dst[1] = src[1];
+    dst[2] = src[Reverse ? 0 : 2];
+  }
+}
+
+// sums size bytes.
+using sum_kernel = uint64_t (*)(const uint8_t *data, int size);
+
+uint64_t sum_row(const uint8_t *data, int size) {
+  uint64_t sum = 0;
+  for (int i = 0; i < size; i++) {
+    sum += data[i];
+  }
+  return sum;
+}
+
+#if AVUTILS_KERNELS_AVX2
+
+// Each 128-bit lane converts 4 pixels. Loads and stores of 3 channel pixels touch
+// 4 bytes past the 8 pixels of an iteration, so the last pixels of a row are left
+// to scalar code.
+constexpr int avx2_pixels = 8;
+constexpr int avx2_row_margin = 2;
+
+template <bool Reverse>
+__attribute__((target("avx2"))) void pad_row_avx2(const uint8_t *src, uint8_t *dst,
+                                                  int width) {
+  const __m256i shuffle = _mm256_broadcastsi128_si256(
+      Reverse ? _mm_setr_epi8(2, 1, 0, -128, 5, 4, 3, -128, 8, 7, 6, -128, 11, 10, 9,
+                              -128)
+              : _mm_setr_epi8(0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11,
+                              -128));
+  int x = 0;
+  for (; x + avx2_pixels + avx2_row_margin <= width; x += avx2_pixels) {
+    const uint8_t *s = src + x * 3;
+    const __m256i pixels = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(s))),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 12)), 1);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x * 4),
+                        _mm256_shuffle_epi8(pixels, shuffle));
+  }
+  pad_row<Reverse>(src + x * 3, dst + x * 4, width - x);
+}
+
+template <bool Reverse>
+__attribute__((target("avx2"))) void strip_row_avx2(const uint8_t *src, uint8_t *dst,
+                                                    int width) {
+  const __m256i shuffle = _mm256_broadcastsi128_si256(
+      Reverse ? _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -128, -128, -128,
+                              -128)
+              : _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -128, -128, -128,
+                              -128));
+  int x = 0;
+  for (; x + avx2_pixels + avx2_row_margin <= width; x += avx2_pixels) {
+    const __m256i pixels = _mm256_shuffle_epi8(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x * 4)), shuffle);
+    uint8_t *d = dst + x * 3;
+    // the second store overwrites 4 zero bytes of the first one.
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(d), _mm256_castsi256_si128(pixels));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(d + 12),
+                     _mm256_extracti128_si256(pixels, 1));
+  }
+  strip_row<Reverse>(src + x * 4, dst + x * 3, width - x);
+}
+
+// sums of absolute differences against zero add up 8 bytes into each 64-bit lane.
+__attribute__((target("avx2"))) uint64_t sum_row_avx2(const uint8_t *data, int size) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i sums = zero;
+  int i = 0;
+  for (; i + 32 <= size; i += 32) {
+    const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    sums = _mm256_add_epi64(sums, _mm256_sad_epu8(bytes, zero));
+  }
+  alignas(32) uint64_t lanes[4];
+  _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), sums);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sum_row(data + i, size - i);
+}
+
+#endif
+
+#if AVUTILS_KERNELS_NEON
+
+constexpr int neon_pixels = 16;
+
+template <bool Reverse>
+void pad_row_neon(const uint8_t *src, uint8_t *dst, int width) {
+  int x = 0;
+  for (; x + neon_pixels <= width; x += neon_pixels) {
+    const uint8x16x3_t in = vld3q_u8(src + x * 3);
+    uint8x16x4_t out;
+    out.val[0] = in.val[Reverse ? 2 : 0];
+    out.val[1] = in.val[1];
+    out.val[2] = in.val[Reverse ? 0 : 2];
+    out.val[3] = vdupq_n_u8(0);
+    vst4q_u8(dst + x * 4, out);
+  }
+  pad_row<Reverse>(src + x * 3, dst + x * 4, width - x);
+}
+
+template <bool Reverse>
+void strip_row_neon(const uint8_t *src, uint8_t *dst, int width) {
+  int x = 0;
+  for (; x + neon_pixels <= width; x += neon_pixels) {
+    const uint8x16x4_t in = vld4q_u8(src + x * 4);
+    uint8x16x3_t out;
+    out.val[0] = in.val[Reverse ? 2 : 0];
+    out.val[1] = in.val[1];
+    out.val[2] = in.val[Reverse ? 0 : 2];
+    vst3q_u8(dst + x * 3, out);
+  }
+  strip_row<Reverse>(src + x * 4, dst + x * 3, width - x);
+}
+
+uint64_t sum_row_neon(const uint8_t *data, int size) {
+  uint64x2_t sums = vdupq_n_u64(0);
+  int i = 0;
+  for (; i + 16 <= size; i += 16) {
+    sums = vpadalq_u32(sums, vpaddlq_u16(vpaddlq_u8(vld1q_u8(data + i))));
+  }
+  return vgetq_lane_u64(sums, 0) + vgetq_lane_u64(sums, 1)
+         + sum_row(data + i, size - i);
+}
+
+#endif
+
+// vectorized version of pad_row<Reverse> or strip_row<Reverse> if CPU supports it.
+template <bool Pad, bool Reverse>
+row_kernel select_kernel() {
+#if AVUTILS_KERNELS_AVX2
+  if ((av_get_cpu_flags() & AV_CPU_FLAG_AVX2) != 0) {
+    return Pad ? &pad_row_avx2<Reverse> : &strip_row_avx2<Reverse>;
+  }
+#elif AVUTILS_KERNELS_NEON
+  if ((av_get_cpu_flags() & AV_CPU_FLAG_NEON) != 0) {
+    return Pad ? &pad_row_neon<Reverse> : &strip_row_neon<Reverse>;
+  }
+#endif
+  return Pad ? &pad_row<Reverse> : &strip_row<Reverse>;
+}
+
+sum_kernel select_sum_kernel() {
+#if AVUTILS_KERNELS_AVX2
+  if ((av_get_cpu_flags() & AV_CPU_FLAG_AVX2) != 0) {
+    return &sum_row_avx2;
+  }
+#elif AVUTILS_KERNELS_NEON
+  if ((av_get_cpu_flags() & AV_CPU_FLAG_NEON) != 0) {
+    return &sum_row_neon;
+  }
+#endif
+  return &sum_row;
+}
+
+bool is_packed_rgb24(AVPixelFormat format) {
+  return format == AV_PIX_FMT_RGB24 || format == AV_PIX_FMT_BGR24;
+}
+
+bool is_packed_rgb32(AVPixelFormat format) {
+  return format == AV_PIX_FMT_RGB0 || format == AV_PIX_FMT_BGR0;
+}
+
+// red comes first in these formats.
+bool is_rgb_order(AVPixelFormat format) {
+  return format == AV_PIX_FMT_RGB24 || format == AV_PIX_FMT_RGB0;
+}
+
+}  // namespace
+
+void copy_plane(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+                int row_bytes, int rows) {
+  CHECK_LE(row_bytes, src_stride);
+  CHECK_LE(row_bytes, dst_stride);
+  if (rows <= 0) {
+    return;
+  }
+  if (src_stride == dst_stride) {
+    memcpy(dst, src, static_cast<size_t>(src_stride) * (rows - 1) + row_bytes);
+    return;
+  }
+  for (int y = 0; y < rows; y++, src += src_stride, dst += dst_stride) {
+    memcpy(dst, src, static_cast<size_t>(row_bytes));
+  }
+}
+
+bool can_swizzle_packed_rgb(AVPixelFormat src_format, AVPixelFormat dst_format) {
+  return (is_packed_rgb24(src_format) && is_packed_rgb32(dst_format))
+         || (is_packed_rgb32(src_format) && is_packed_rgb24(dst_format));
+}
+
+void swizzle_packed_rgb(AVPixelFormat src_format, const uint8_t *src, int src_stride,
+                        AVPixelFormat dst_format, uint8_t *dst, int dst_stride,
+                        int width, int height) {
+  CHECK(can_swizzle_packed_rgb(src_format, dst_format))
+      << "can't swizzle " << src_format << " to " << dst_format;
+  const bool pad = is_packed_rgb24(src_format);
+  const bool reverse = is_rgb_order(src_format) != is_rgb_order(dst_format);
+  const row_kernel kernel = pad ? (reverse ? select_kernel<true, true>()
+                                           : select_kernel<true, false>())
+                                : (reverse ? select_kernel<false, true>()
+                                           : select_kernel<false, false>());
+  for (int y = 0; y < height; y++, src += src_stride, dst += dst_stride) {
+    kernel(src, dst, width);
+  }
+}
+
+uint64_t sum_bytes(const uint8_t *data, int size) {
+  static const sum_kernel kernel = select_sum_kernel();
+  return kernel(data, size);
+}
+
+}  // namespace avutils
+}  // namespace video
+}  // namespace satori
@@ -1,42 +1,391 @@
 #include "base64.h"
 
-#include <boost/algorithm/string.hpp>
-#include <boost/archive/iterators/base64_from_binary.hpp>
-#include <boost/archive/iterators/binary_from_base64.hpp>
-#include <boost/archive/iterators/transform_width.hpp>
+#include <array>
+#include <cstdint>
+#include <cstring>
 
-#include "logging.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SATORI_BASE64_X86 1
+#endif
 
-namespace it = boost::archive::iterators;
+#include "logging.h"
 
 namespace satori {
 namespace video {
 namespace base64 {
 
-streams::error_or<std::string> decode(const std::string &val) {
-  using iterator_t =
-      it::transform_width<it::binary_from_base64<std::string::const_iterator>, 8, 6>;
-
-  std::string decoded;
-  try {
-    decoded = std::string{iterator_t{std::begin(val)}, iterator_t{std::end(val)}};
-  } catch (const std::exception &e) {
-    LOG(ERROR) << "input is not base64: " << e.what() << ", value: " << val;
+namespace {
+
+constexpr char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+constexpr uint8_t invalid = 0xff;
+
+std::array<uint8_t, 256> build_decode_table() {
+  std::array<uint8_t, 256> table;
+  table.fill(invalid);
+  for (uint8_t i = 0; i < 64; i++) {
+    table[static_cast<uint8_t>(alphabet[i])] = i;
+  }
+  return table;
+}
+
+const std::array<uint8_t, 256> decode_table = build_decode_table();
+
+// Scalar implementations handle input tails and platforms without SIMD.
+
+size_t encode_scalar(const uint8_t *src, size_t size, char *dst) {
+  char *const begin = dst;
+  size_t i = 0;
+  for (; i + 3 <= size; i += 3) {
+    const uint32_t v = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+    *dst++ = alphabet[(v >> 18) & 0x3f];
+    *dst++ = alphabet[(v >> 12) & 0x3f];
+    *dst++ = alphabet[(v >> 6) & 0x3f];
+    *dst++ = alphabet[v & 0x3f];
+  }
+
+  if (i + 1 == size) {
+    const uint32_t v = src[i] << 16;
+    *dst++ = alphabet[(v >> 18) & 0x3f];
+    *dst++ = alphabet[(v >> 12) & 0x3f];
+    *dst++ = '=';
+    *dst++ = '=';
+  } else if (i + 2 == size) {
+    const uint32_t v = (src[i] << 16) | (src[i + 1] << 8);
+    *dst++ = alphabet[(v >> 18) & 0x3f];
+    *dst++ = alphabet[(v >> 12) & 0x3f];
+    *dst++ = alphabet[(v >> 6) & 0x3f];
+    *dst++ = '=';
+  }
+  return dst - begin;
+}
+
+// decodes complete groups of 4 characters without padding, returns false on bad
+// input.
+bool decode_groups_scalar(const uint8_t *src, size_t size, uint8_t *dst) {
+  for (size_t i = 0; i < size; i += 4) {
+    const uint8_t a = decode_table[src[i]];
+    const uint8_t b = decode_table[src[i + 1]];
+    const uint8_t c = decode_table[src[i + 2]];
+    const uint8_t d = decode_table[src[i + 3]];
+    if ((a | b | c | d) == invalid) {
+      return false;
+    }
+    const uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+    *dst++ = static_cast<uint8_t>(v >> 16);
+    *dst++ = static_cast<uint8_t>(v >> 8);
+    *dst++ = static_cast<uint8_t>(v);
+  }
+  return true;
+}
+
+#ifdef SATORI_BASE64_X86
+
+// SIMD versions follow Wojciech Muła's algorithms
+// (http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html and
+// http://0x80.pl/notesen/2016-01-17-sse-base64-decoding.html).
+// Each function processes as many blocks as it can and returns number of consumed
+// input bytes, the rest is handled by scalar code.
+
+// maps 6-bit values to base64 characters.
+__attribute__((target("ssse3"))) inline __m128i encode_lookup(__m128i indices) {
+  __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+  const __m128i shift_lut = _mm_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  result = _mm_shuffle_epi8(shift_lut, result);
+  return _mm_add_epi8(result, indices);
+}
+
+// splits 12 bytes into 16 6-bit values.
+__attribute__((target("ssse3"))) inline __m128i encode_unpack(__m128i in) {
+  in = _mm_shuffle_epi8(
+      in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+  const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3"))) size_t encode_ssse3(const uint8_t *src, size_t size,
+                                                      char *dst) {
+  size_t i = 0;
+  // 16 bytes are loaded for every 12 bytes of input.
+  for (; i + 16 <= size; i += 12) {
+    const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    const __m128i out = encode_lookup(encode_unpack(in));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), out);
+    dst += 16;
+  }
+  return i;
+}
+
+// maps base64 characters to 6-bit values, sets all bits of error lanes
+// with invalid characters.
+__attribute__((target("ssse3"))) inline __m128i decode_lookup(__m128i in,
+                                                               __m128i *error) {
+  const __m128i higher_nibble = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+  const __m128i lower_nibble = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+
+  const __m128i shift_lut =
+      _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_lut =
+      _mm_setr_epi8(char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+                    char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+                    char(0xf0), char(0x54), char(0x50), char(0x50), char(0x50),
+                    char(0x54));
+  const __m128i bitpos_lut = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40,
+                                           char(0x80), 0, 0, 0, 0, 0, 0, 0, 0);
+
+  const __m128i sh = _mm_shuffle_epi8(shift_lut, higher_nibble);
+  // '/' is the only character which doesn't share shift with its higher nibble.
+  const __m128i eq_slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+  const __m128i shift = _mm_or_si128(_mm_andnot_si128(eq_slash, sh),
+                                     _mm_and_si128(eq_slash, _mm_set1_epi8(16)));
+
+  const __m128i m = _mm_shuffle_epi8(mask_lut, lower_nibble);
+  const __m128i bit = _mm_shuffle_epi8(bitpos_lut, higher_nibble);
+  *error = _mm_cmpeq_epi8(_mm_and_si128(m, bit), _mm_setzero_si128());
+
+  return _mm_add_epi8(in, shift);
+}
+
+// packs 16 6-bit values into 12 bytes at the beginning of the register.
+__attribute__((target("ssse3"))) inline __m128i decode_pack(__m128i values) {
+  const __m128i merge_ab_and_bc = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  const __m128i merged = _mm_madd_epi16(merge_ab_and_bc, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(
+      merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3"))) size_t decode_ssse3(const uint8_t *src, size_t size,
+                                                      uint8_t *dst, bool *ok) {
+  size_t i = 0;
+  // 16 bytes are stored for every 12 bytes of output, so keep enough input
+  // behind to make sure extra bytes are overwritten later.
+  for (; i + 24 <= size; i += 16) {
+    const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    __m128i error;
+    const __m128i values = decode_lookup(in, &error);
+    if (_mm_movemask_epi8(error) != 0) {
+      *ok = false;
+      return i;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), decode_pack(values));
+    dst += 12;
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) size_t encode_avx2(const uint8_t *src, size_t size,
+                                                    char *dst) {
+  const __m256i shuffle = _mm256_setr_epi8(
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8,
+      7, 10, 9, 11, 10);
+  const __m256i shift_lut = _mm256_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0, 'a' - 26, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+  size_t i = 0;
+  // each 128-bit lane gets 12 bytes of input, second load reads up to src + i + 28.
+  for (; i + 28 <= size; i += 24) {
+    const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 12));
+    __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+    in = _mm256_shuffle_epi8(in, shuffle);
+    const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    const __m256i indices = _mm256_or_si256(t1, t3);
+
+    __m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    result = _mm256_shuffle_epi8(shift_lut, result);
+    result = _mm256_add_epi8(result, indices);
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), result);
+    dst += 32;
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) size_t decode_avx2(const uint8_t *src, size_t size,
+                                                    uint8_t *dst, bool *ok) {
+  const __m256i shift_lut = _mm256_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0,
+                                             0, 0, 0, 0, 0, 0, 19, 4, -65, -65, -71,
+                                             -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i mask_lut = _mm256_setr_epi8(
+      char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+      char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf0), char(0x54),
+      char(0x50), char(0x50), char(0x50), char(0x54), char(0xa8), char(0xf8),
+      char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+      char(0xf8), char(0xf8), char(0xf0), char(0x54), char(0x50), char(0x50),
+      char(0x50), char(0x54));
+  const __m256i bitpos_lut = _mm256_setr_epi8(
+      0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80), 0, 0, 0, 0, 0, 0, 0, 0,
+      0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80), 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i pack_shuffle =
+      _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0,
+                       6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+  size_t i = 0;
+  // each lane produces 12 bytes stored with 16-byte writes, the last one ends 4
+  // bytes past the output of this block.
+  for (; i + 40 <= size; i += 32) {
+    const __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+
+    const __m256i higher_nibble =
+        _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0f));
+    const __m256i lower_nibble = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+    const __m256i sh = _mm256_shuffle_epi8(shift_lut, higher_nibble);
+    const __m256i eq_slash = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+    const __m256i shift = _mm256_blendv_epi8(sh, _mm256_set1_epi8(16), eq_slash);
+    const __m256i m = _mm256_shuffle_epi8(mask_lut, lower_nibble);
+    const __m256i bit = _mm256_shuffle_epi8(bitpos_lut, higher_nibble);
+    const __m256i error =
+        _mm256_cmpeq_epi8(_mm256_and_si256(m, bit), _mm256_setzero_si256());
+    if (_mm256_movemask_epi8(error) != 0) {
+      *ok = false;
+      return i;
+    }
+
+    const __m256i values = _mm256_add_epi8(in, shift);
+    const __m256i merge_ab_and_bc =
+        _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+    const __m256i merged =
+        _mm256_madd_epi16(merge_ab_and_bc, _mm256_set1_epi32(0x00011000));
+    const __m256i packed = _mm256_shuffle_epi8(merged, pack_shuffle);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm256_castsi256_si128(packed));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 12),
+                     _mm256_extracti128_si256(packed, 1));
+    dst += 24;
+  }
+  return i;
+}
+
+#endif
+
+using encode_fn = size_t (*)(const uint8_t *src, size_t size, char *dst);
+using decode_fn = size_t (*)(const uint8_t *src, size_t size, uint8_t *dst, bool *ok);
+
+size_t encode_none(const uint8_t * /*src*/, size_t /*size*/, char * /*dst*/) {
+  return 0;
+}
+
+size_t decode_none(const uint8_t * /*src*/, size_t /*size*/, uint8_t * /*dst*/,
+                   bool * /*ok*/) {
+  return 0;
+}
+
+struct simd_impl {
+  encode_fn encode{&encode_none};
+  decode_fn decode{&decode_none};
+};
+
+simd_impl select_simd_impl() {
+  simd_impl impl;
+#ifdef SATORI_BASE64_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    LOG(1) << "using avx2 base64 implementation";
+    impl.encode = &encode_avx2;
+    impl.decode = &decode_avx2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    LOG(1) << "using ssse3 base64 implementation";
+    impl.encode = &encode_ssse3;
+    impl.decode = &decode_ssse3;
+  }
+#endif
+  return impl;
+}
+
+const simd_impl &simd() {
+  static const simd_impl impl = select_simd_impl();
+  return impl;
+}
+
+}  // namespace
+
+size_t encoded_size(size_t size) { return (size + 2) / 3 * 4; }
+
+size_t decoded_max_size(size_t size) { return (size + 3) / 4 * 3; }
+
+size_t encode(const char *data, size_t size, char *out) {
+  const auto *src = reinterpret_cast<const uint8_t *>(data);
+  const size_t consumed = simd().encode(src, size, out);
+  const size_t written = consumed / 3 * 4;
+  return written + encode_scalar(src + consumed, size - consumed, out + written);
+}
+
+streams::error_or<size_t> decode(const char *data, size_t size, char *out) {
+  const auto *src = reinterpret_cast<const uint8_t *>(data);
+  auto *dst = reinterpret_cast<uint8_t *>(out);
+
+  if (size == 0) {
+    return size_t{0};
+  }
+  if (size % 4 == 1) {
+    return std::system_category().default_error_condition(EBADMSG);
+  }
+
+  // last group is decoded separately because it might be padded or incomplete,
+  // unpadded input is accepted as well.
+  const size_t groups_size = (size - 1) / 4 * 4;
+  size_t tail_size = size - groups_size;
+  if (tail_size == 4 && data[size - 1] == '=') {
+    tail_size--;
+    if (data[size - 2] == '=') {
+      tail_size--;
+    }
+  }
+
+  bool ok = true;
+  const size_t consumed = simd().decode(src, groups_size, dst, &ok);
+  if (!ok
+      || !decode_groups_scalar(src + consumed, groups_size - consumed,
+                               dst + consumed / 4 * 3)) {
+    return std::system_category().default_error_condition(EBADMSG);
+  }
+
+  uint8_t tail[4] = {'A', 'A', 'A', 'A'};
+  std::memcpy(tail, src + groups_size, tail_size);
+  uint8_t decoded[3];
+  if (!decode_groups_scalar(tail, 4, decoded)) {
     return std::system_category().default_error_condition(EBADMSG);
   }
 
-  const auto padding = val.find('=');
-  if (padding == std::string::npos) {
-    return decoded;
+  const size_t written = groups_size / 4 * 3;
+  const size_t tail_bytes = tail_size * 3 / 4;
+  std::memcpy(dst + written, decoded, tail_bytes);
+  return written + tail_bytes;
+}
+
+streams::error_or<std::string> decode(const std::string &val) {
+  std::string decoded(decoded_max_size(val.size()), '\0');
+  auto size_or_error = decode(val.data(), val.size(), &decoded[0]);
+  if (!size_or_error.ok()) {
+    LOG(ERROR) << "input is not base64, value: " << val;
+    return size_or_error.error_condition();
   }
-  return decoded.substr(0, decoded.size() - (val.size() - padding));
+  decoded.resize(size_or_error.get());
+  return decoded;
 }
 
 std::string encode(const std::string &val) {
-  using iterator_t =
-      it::base64_from_binary<it::transform_width<std::string::const_iterator, 6, 8>>;
-  auto encoded = std::string{iterator_t{std::begin(val)}, iterator_t{std::end(val)}};
-  return encoded.append((3 - val.size() % 3) % 3, '=');
+  std::string encoded(encoded_size(val.size()), '\0');
+  encoded.resize(encode(val.data(), val.size(), &encoded[0]));
+  return encoded;
 }
 
 }  // namespace base64
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
 
 #include "streams/error_or.h"
@@ -13,6 +14,18 @@ constexpr double overhead = 4. / 3.;
 streams::error_or<std::string> decode(const std::string &val);
 std::string encode(const std::string &val);
 
+// Buffer-based versions, they pick SIMD implementation supported by CPU
+// at runtime and never throw.
+
+// out should have room for encoded_size(size) bytes, returns number of bytes written.
+size_t encoded_size(size_t size);
+size_t encode(const char *data, size_t size, char *out);
+
+// out should have room for decoded_max_size(size) bytes, returns number of bytes
+// written or EBADMSG if data is not valid base64. Padding is optional.
+size_t decoded_max_size(size_t size);
+streams::error_or<size_t> decode(const char *data, size_t size, char *out);
+
 }  // namespace base64
 }  // namespace video
 }  // namespace satori
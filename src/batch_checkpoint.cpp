@@ -0,0 +1,143 @@
+#include "batch_checkpoint.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "logging.h"
+
+namespace satori {
+namespace video {
+
+nlohmann::json to_json(const batch_checkpoint &checkpoint) {
+  return nlohmann::json{{"frame_id", {checkpoint.frame.i1, checkpoint.frame.i2}},
+                        {"timestamp", checkpoint.timestamp_millis},
+                        {"analysis_file_offset", checkpoint.analysis_file_offset},
+                        {"debug_file_offset", checkpoint.debug_file_offset},
+                        {"bot_state", checkpoint.bot_state}};
+}
+
+boost::optional<batch_checkpoint> checkpoint_from_json(const nlohmann::json &json) {
+  if (!json.is_object() || json.find("frame_id") == json.end()
+      || !json["frame_id"].is_array() || json["frame_id"].size() != 2
+      || json.find("analysis_file_offset") == json.end()) {
+    return boost::none;
+  }
+
+  batch_checkpoint checkpoint;
+  checkpoint.frame = {json["frame_id"][0].get<int64_t>(),
+                      json["frame_id"][1].get<int64_t>()};
+  checkpoint.analysis_file_offset = json["analysis_file_offset"].get<uint64_t>();
+  if (json.find("timestamp") != json.end()) {
+    checkpoint.timestamp_millis = json["timestamp"].get<int64_t>();
+  }
+  if (json.find("debug_file_offset") != json.end()) {
+    checkpoint.debug_file_offset = json["debug_file_offset"].get<uint64_t>();
+  }
+  if (json.find("bot_state") != json.end()) {
+    checkpoint.bot_state = json["bot_state"];
+  }
+  return checkpoint;
+}
+
+std::string checkpoint_path(const std::string &analysis_file) {
+  return analysis_file + ".checkpoint";
+}
+
+void save_checkpoint(const std::string &path, const batch_checkpoint &checkpoint) {
+  const std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream out{tmp_path, std::ios::trunc};
+    out << to_json(checkpoint).dump() << '\n';
+    out.flush();
+    if (!out.good()) {
+      LOG(ERROR) << "failed to write checkpoint " << tmp_path;
+      return;
+    }
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    LOG(ERROR) << "failed to replace checkpoint " << path;
+  }
+}
+
+boost::optional<batch_checkpoint> load_checkpoint(const std::string &path) {
+  std::ifstream in{path};
+  if (!in) {
+    return boost::none;
+  }
+  std::stringstream ss;
+  ss << in.rdbuf();
+
+  nlohmann::json json;
+  try {
+    json = nlohmann::json::parse(ss.str());
+  } catch (const std::exception &e) {
+    LOG(ERROR) << "can't parse checkpoint " << path << ": " << e.what();
+    return boost::none;
+  }
+  auto checkpoint = checkpoint_from_json(json);
+  if (!checkpoint) {
+    LOG(ERROR) << "bad checkpoint " << path << ": " << json;
+  }
+  return checkpoint;
+}
+
+batch_checkpointer::batch_checkpointer(std::string path,
+                                       std::chrono::milliseconds interval,
+                                       buffered_file_sink *analysis,
+                                       buffered_file_sink *debug,
+                                       std::function<nlohmann::json()> bot_state)
+    : _path(std::move(path)),
+      _interval(interval),
+      _analysis(analysis),
+      _debug(debug),
+      _bot_state(std::move(bot_state)) {
+  CHECK(_analysis) << "checkpoints need analysis file";
+}
+
+void batch_checkpointer::on_frame(const owned_image_frame &frame,
+                                  clock::time_point now) {
+  // batch mode feeds the bot a frame at a time, messages of the previous frame are
+  // in the sinks by now.
+  if (_pending) {
+    save(*_pending);
+    _pending.reset();
+  }
+
+  _last = batch_checkpoint{};
+  _last->frame = frame.id;
+  _last->timestamp_millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                frame.timestamp.time_since_epoch())
+                                .count();
+  if (now >= _saved_at + _interval) {
+    // the bot has just processed the frame and hasn't seen the next one yet.
+    _pending = *_last;
+    if (_bot_state) {
+      _pending->bot_state = _bot_state();
+    }
+    _saved_at = now;
+  }
+}
+
+void batch_checkpointer::finish() {
+  if (!_last) {
+    return;
+  }
+  if (_bot_state) {
+    _last->bot_state = _bot_state();
+  }
+  save(*_last);
+  _pending.reset();
+}
+
+void batch_checkpointer::save(batch_checkpoint checkpoint) {
+  checkpoint.analysis_file_offset = _analysis->flush();
+  if (_debug != nullptr) {
+    checkpoint.debug_file_offset = _debug->flush();
+  }
+  save_checkpoint(_path, checkpoint);
+  LOG(INFO) << "saved checkpoint at frame " << checkpoint.frame.i2 << " to " << _path;
+}
+
+}  // namespace video
+}  // namespace satori
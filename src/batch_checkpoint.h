@@ -0,0 +1,77 @@
+#pragma once
+
+#include <boost/optional.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <json.hpp>
+#include <string>
+
+#include "buffered_file_sink.h"
+#include "data.h"
+
+namespace satori {
+namespace video {
+
+// Progress of a batch run: all messages of frames up to frame_id are in analysis
+// and debug files, which were that long.
+struct batch_checkpoint {
+  frame_id frame;
+  // capture time of the frame, milliseconds since epoch.
+  int64_t timestamp_millis{0};
+  uint64_t analysis_file_offset{0};
+  uint64_t debug_file_offset{0};
+  // state returned by the bot for "checkpoint" control command, null if it wasn't
+  // asked.
+  nlohmann::json bot_state;
+};
+
+nlohmann::json to_json(const batch_checkpoint &checkpoint);
+boost::optional<batch_checkpoint> checkpoint_from_json(const nlohmann::json &json);
+
+// checkpoint of analysis file is kept next to it.
+std::string checkpoint_path(const std::string &analysis_file);
+
+// replaces checkpoint file at once, readers see either old or new one.
+void save_checkpoint(const std::string &path, const batch_checkpoint &checkpoint);
+// none if file doesn't exist or can't be parsed.
+boost::optional<batch_checkpoint> load_checkpoint(const std::string &path);
+
+// Saves checkpoints of a batch run at most once per interval. Bot emits a frame
+// before its messages, so checkpoint of a frame is taken when it comes out of the
+// bot, along with bot state, and saved when the next frame comes out and messages of
+// the frame are in the sinks.
+class batch_checkpointer {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  // debug sink and bot_state are optional.
+  batch_checkpointer(std::string path, std::chrono::milliseconds interval,
+                     buffered_file_sink *analysis, buffered_file_sink *debug,
+                     std::function<nlohmann::json()> bot_state);
+
+  // frame came out of the bot.
+  void on_frame(const owned_image_frame &frame, clock::time_point now = clock::now());
+
+  // all frames are processed, saves the last one.
+  void finish();
+
+ private:
+  // file offsets are taken once sinks are flushed.
+  void save(batch_checkpoint checkpoint);
+
+  const std::string _path;
+  const std::chrono::milliseconds _interval;
+  buffered_file_sink *const _analysis;
+  buffered_file_sink *const _debug;
+  const std::function<nlohmann::json()> _bot_state;
+
+  // the last frame which came out of the bot.
+  boost::optional<batch_checkpoint> _last;
+  // checkpoint waiting for messages of its frame.
+  boost::optional<batch_checkpoint> _pending;
+  clock::time_point _saved_at{clock::now()};
+};
+
+}  // namespace video
+}  // namespace satori
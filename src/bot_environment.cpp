@@ -1,23 +1,35 @@
 #include "bot_environment.h"
 
 #include <algorithm>
+#include <atomic>
 #include <boost/asio.hpp>
 #include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
 #include <fstream>
+#include <glob.h>
 #include <gsl/gsl>
 #include <json.hpp>
+#include <map>
+#include <thread>
 
 #include "avutils.h"
 #include "bot_instance.h"
 #include "bot_instance_builder.h"
+#include "frame_arena.h"
 #include "logging_impl.h"
+#include "message_batcher.h"
+#include "motion_gate.h"
 #include "ostream_sink.h"
 #include "rtm_streams.h"
 #include "signal_utils.h"
+#include "stopwatch.h"
 #include "streams/asio_streams.h"
+#include "streams/breaker.h"
+#include "streams/profile.h"
 #include "streams/signal_breaker.h"
 #include "streams/threaded_worker.h"
 #include "tcmalloc.h"
+#include "threadutils.h"
 
 namespace satori {
 namespace video {
@@ -25,6 +37,15 @@ namespace {
 
 using variables_map = boost::program_options::variables_map;
 
+auto& startup_phase_millis = prometheus::BuildGauge()
+                                 .Name("bot_startup_phase_millis")
+                                 .Register(metrics_registry());
+
+void report_startup_phase(const std::string& phase, uint64_t millis) {
+  LOG(INFO) << "startup phase " << phase << " took " << millis << "ms";
+  startup_phase_millis.Add({{"phase", phase}}).Set(static_cast<double>(millis));
+}
+
 po::options_description bot_custom_options() {
   po::options_description generic("Generic options");
   generic.add_options()("help", "produce help message");
@@ -46,10 +67,101 @@ po::options_description bot_custom_options() {
   bot_execution_options.add_options()(
       "debug-file", po::value<std::string>(),
       "saves debug messages to a file instead of sending to a channel");
+  bot_execution_options.add_options()(
+      "analysis-batch", po::value<std::string>(),
+      "(frame|window) publishes analysis messages as json arrays, one per frame or "
+      "time window, instead of one by one");
+  bot_execution_options.add_options()(
+      "analysis-batch-window", po::value<int>()->default_value(100),
+      "(milliseconds) how long analysis messages wait for a batch at most");
+  bot_execution_options.add_options()(
+      "messages-file-format", po::value<std::string>()->default_value("json"),
+      "(json|cbor) format of analysis and debug files: json lines, or CBOR messages "
+      "prefixed by 4 bytes of their size in network byte order");
+  bot_execution_options.add_options()(
+      "messages-file-flush-interval", po::value<int>()->default_value(1000),
+      "(milliseconds) how often messages are flushed to analysis and debug files");
 
   bot_execution_options.add_options()("max-queued-frames",
                                       po::value<size_t>(),
                                       "limits bot input queue size");
+  bot_execution_options.add_options()(
+      "queue-overflow-policy", po::value<std::string>()->default_value("drop-newest"),
+      "what to drop when input queue is full: drop-newest, drop-oldest, "
+      "coalesce-to-latest. drop-until-key-frame is not supported, bot input "
+      "queue holds decoded images");
+  bot_execution_options.add_options()(
+      "batch-jobs", po::value<size_t>()->default_value(1),
+      "(number) in batch mode, bots independent of previous groups of pictures "
+      "process that many parts of input file in parallel");
+  bot_execution_options.add_options()(
+      "processing-threads", po::value<size_t>(),
+      "(number) runs bot callbacks of all jobs on that many shared threads instead of "
+      "a thread per job, callbacks of each job still run one at a time. Defaults to "
+      "a thread per core when pool capacity is above 1");
+  bot_execution_options.add_options()(
+      "max-fps", po::value<double>(),
+      "(frames per second) bot receives at most that many frames per second, others "
+      "are dropped before conversion. Overrides max_fps of the bot, 0 turns it off");
+  bot_execution_options.add_options()(
+      "motion-threshold", po::value<double>(),
+      "(0-255) frames which differ from the last frame given to bot by at most that, "
+      "as mean difference of brightness of 16x16 cells, are dropped and counted in "
+      "frames_gated_total. 0 turns it off");
+  bot_execution_options.add_options()(
+      "motion-keep-alive", po::value<double>()->default_value(1),
+      "(seconds) with --motion-threshold, bot still gets a frame that often, 0 turns "
+      "it off");
+  bot_execution_options.add_options()(
+      "batch-inputs", po::value<std::string>(),
+      "(glob pattern or @file listing a path per line) in batch mode, processes these "
+      "input video files instead of --input-video-file, each by its own bot instance");
+  bot_execution_options.add_options()(
+      "batch-parallelism", po::value<size_t>(),
+      "(number) how many of --batch-inputs are processed at the same time, defaults "
+      "to number of cores");
+  bot_execution_options.add_options()(
+      "analysis-dir", po::value<std::string>(),
+      "directory where analysis and debug messages of each of --batch-inputs are "
+      "saved, to <name>.<format> and <name>.debug.<format> files");
+  bot_execution_options.add_options()(
+      "frame-trace-sample", po::value<uint32_t>(),
+      "(number) traces every Nth frame from reassembly to analysis publishing, time "
+      "spent in each stage is exported to frame_stage_latency_millis");
+  bot_execution_options.add_options()(
+      "frame-trace-file", po::value<std::string>(),
+      "saves traces of --frame-trace-sample frames to a file, a json per line");
+  bot_execution_options.add_options()(
+      "frame-memory-budget", po::value<size_t>(),
+      "(megabytes) decoded frames waiting in bot queues of all jobs are limited to "
+      "that much memory, frames above it are dropped");
+  bot_execution_options.add_options()(
+      "frame-arena", po::value<size_t>(),
+      "(megabytes) reserves that much memory in 2 MiB huge pages for buffers of "
+      "converted frames of 1 MiB and larger, other buffers stay in heap");
+  bot_execution_options.add_options()(
+      "numa-placement", po::value<std::string>(),
+      "(node number or \"spread\") pins input, decoder and processing threads of "
+      "jobs to cpus of a NUMA node, so their frames are allocated in its memory. A "
+      "node number places all jobs and the asio loop on that node, spread assigns "
+      "jobs to nodes round-robin");
+  bot_execution_options.add_options()(
+      "profile-dir", po::value<std::string>(),
+      "lets control messages with \"profile\" action run gperftools cpu or heap "
+      "profiler, profiles are saved to this directory");
+  bot_execution_options.add_options()(
+      "checkpoint-interval", po::value<int>(),
+      "(seconds) in batch mode, saves last processed frame and analysis and debug "
+      "file sizes to <analysis-file>.checkpoint that often");
+  bot_execution_options.add_options()(
+      "checkpoint-bot-state",
+      "saves bot response to \"checkpoint\" control command with checkpoints, it is "
+      "sent back with \"restore\" command on --resume");
+  bot_execution_options.add_options()(
+      "resume",
+      "in batch mode, continues from the frame after <analysis-file>.checkpoint, "
+      "analysis and debug files are cut to the size they had then. Starts from the "
+      "beginning if there is no checkpoint");
 
   return bot_configuration_options.add(bot_execution_options)
       .add(metrics_options())
@@ -94,32 +206,260 @@ nlohmann::json init_config(const po::variables_map& vm) {
 
   return json_config;
 }
+
+streams::overflow_policy init_overflow_policy(const std::string& policy_string) {
+  auto policy = streams::parse_overflow_policy(policy_string);
+  if (!policy) {
+    std::cerr << "Unsupported queue overflow policy: " << policy_string << std::endl;
+    exit(1);
+  }
+  // decoded images don't depend on each other, so every one of them is a key frame.
+  if (policy.get() == streams::overflow_policy::DROP_UNTIL_KEY_FRAME) {
+    std::cerr << "Queue overflow policy " << policy_string
+              << " is not supported for bot input queue of decoded images, "
+                 "use coalesce-to-latest instead"
+              << std::endl;
+    exit(1);
+  }
+  return policy.get();
+}
+
+buffered_file_sink_options init_messages_file_options(const std::string& format,
+                                                      int flush_interval_ms) {
+  if (format != "json" && format != "cbor") {
+    std::cerr << "Unsupported messages file format: " << format << std::endl;
+    exit(1);
+  }
+  if (flush_interval_ms <= 0) {
+    std::cerr << "Messages file flush interval should be positive" << std::endl;
+    exit(1);
+  }
+  buffered_file_sink_options options;
+  options.binary = format == "cbor";
+  options.flush_interval = std::chrono::milliseconds{flush_interval_ms};
+  return options;
+}
+
+boost::optional<message_batch_options> init_analysis_batch(
+    const boost::optional<std::string>& mode, int window_ms) {
+  if (!mode) {
+    return boost::none;
+  }
+  if (*mode != "frame" && *mode != "window") {
+    std::cerr << "Unsupported analysis batch mode: " << *mode << std::endl;
+    exit(1);
+  }
+  if (window_ms <= 0) {
+    std::cerr << "Analysis batch window should be positive" << std::endl;
+    exit(1);
+  }
+  message_batch_options options;
+  options.per_frame = *mode == "frame";
+  options.window = std::chrono::milliseconds{window_ms};
+  return options;
+}
+
+// expands glob pattern, or reads list file if spec starts with @.
+std::vector<std::string> list_batch_inputs(const std::string& spec) {
+  std::vector<std::string> inputs;
+  if (!spec.empty() && spec[0] == '@') {
+    std::ifstream list_file(spec.substr(1));
+    if (!list_file) {
+      std::cerr << "Can't read batch inputs list: " << spec.substr(1) << std::endl;
+      exit(1);
+    }
+    std::string line;
+    while (std::getline(list_file, line)) {
+      if (!line.empty()) {
+        inputs.push_back(line);
+      }
+    }
+    return inputs;
+  }
+
+  glob_t paths;
+  const int ret = glob(spec.c_str(), 0, nullptr, &paths);
+  if (ret == 0) {
+    inputs.assign(paths.gl_pathv, paths.gl_pathv + paths.gl_pathc);
+  }
+  globfree(&paths);
+  return inputs;
+}
+
+// files of the same name from different directories get a numeric suffix.
+std::vector<std::string> output_names(const std::vector<std::string>& inputs) {
+  std::vector<std::string> names;
+  std::map<std::string, int> used;
+  for (const std::string& input : inputs) {
+    const std::string stem = boost::filesystem::path{input}.stem().string();
+    const int count = used[stem]++;
+    names.push_back(count == 0 ? stem : stem + "_" + std::to_string(count));
+  }
+  return names;
+}
+
+void set_option(variables_map& vm, const std::string& name, const std::string& value) {
+  vm.erase(name);
+  vm.insert(std::make_pair(name, po::variable_value(boost::any(value), false)));
+}
+
+// checkpoints are kept next to analysis files of batch mode.
+void check_checkpoint_options(const variables_map& vm, bool batch) {
+  if (vm.count("checkpoint-interval") == 0 && vm.count("resume") == 0) {
+    return;
+  }
+  if (!batch || vm.count("analysis-file") == 0) {
+    std::cerr << "--checkpoint-interval and --resume need --batch and --analysis-file "
+                 "or --batch-inputs"
+              << std::endl;
+    exit(1);
+  }
+  if (vm.count("checkpoint-interval") > 0 && vm["checkpoint-interval"].as<int>() <= 0) {
+    std::cerr << "Checkpoint interval should be positive" << std::endl;
+    exit(1);
+  }
+  if (vm.count("resume") > 0
+      && (vm.count("start-time") > 0 || vm.count("end-time") > 0)) {
+    std::cerr << "--resume can't be used with --start-time and --end-time, use "
+                 "--start-frame and --end-frame"
+              << std::endl;
+    exit(1);
+  }
+}
+
+boost::optional<batch_checkpoint> init_resume_checkpoint(const variables_map& vm) {
+  if (vm.count("resume") == 0) {
+    return boost::none;
+  }
+  const std::string path = checkpoint_path(vm["analysis-file"].as<std::string>());
+  auto checkpoint = load_checkpoint(path);
+  if (!checkpoint) {
+    LOG(INFO) << "no checkpoint " << path << ", starting from the beginning";
+  }
+  return checkpoint;
+}
+
+// input starts at the frame after the checkpoint, frames are numbered from 1.
+variables_map resumed_options(const variables_map& vm,
+                              const boost::optional<batch_checkpoint>& checkpoint) {
+  if (!checkpoint) {
+    return vm;
+  }
+  variables_map resumed = vm;
+  int64_t start_frame = checkpoint->frame.i2 + 1;
+  if (vm.count("start-frame") > 0) {
+    start_frame = std::max(start_frame, vm["start-frame"].as<int64_t>());
+  }
+  resumed.erase("start-frame");
+  resumed.insert(
+      std::make_pair("start-frame", po::variable_value(boost::any(start_frame), false)));
+  return resumed;
+}
+
+// drops messages written after the checkpoint.
+void truncate_messages_file(const std::string& path, uint64_t size) {
+  boost::system::error_code ec;
+  const uint64_t current = boost::filesystem::file_size(path, ec);
+  if (ec && size == 0) {
+    return;
+  }
+  CHECK(!ec && current >= size) << "can't resume, " << path << " is shorter than "
+                                << size << " bytes of the checkpoint";
+  boost::filesystem::resize_file(path, size);
+}
+
+// bot may change crop region from control callback, including configure command.
+std::shared_ptr<crop_region> initial_crop(const bot_configuration& config) {
+  auto crop = std::make_shared<crop_region>();
+  if (config.video_cfg.crop) {
+    const auto region = avutils::parse_image_region(*config.video_cfg.crop);
+    CHECK(region.ok()) << "bad crop region: " << *config.video_cfg.crop;
+    crop->set(region.get());
+  }
+  return crop;
+}
+
+// frames above max_fps are dropped by decoder, but are counted as dropped by bot.
+void init_decimation(decoder_options& options, const bot_configuration& config,
+                     const multiframe_bot_descriptor& descriptor,
+                     bot_instance& instance) {
+  options.max_fps = config.max_fps.get_value_or(descriptor.max_fps);
+  if (options.max_fps > 0) {
+    prometheus::Counter* dropped = &instance.metrics.frames_dropped_total;
+    options.on_decimated = [dropped]() { dropped->Increment(); };
+  }
+}
 }  // namespace
 
+struct bot_environment::running_bot : boost::static_visitor<void> {
+  void operator()(const owned_image_metadata& /*metadata*/) {}
+
+  void operator()(const owned_image_frame& frame) {
+    if (tracer) {
+      tracer->record(frame.id, frame_stage::PROCESSED);
+    }
+    if (checkpointer) {
+      checkpointer->on_frame(frame);
+    }
+  }
+
+  void operator()(struct bot_message& msg) {
+    switch (msg.kind) {
+      case bot_message_kind::ANALYSIS:
+        analysis_sink->on_next(std::move(msg.data));
+        if (tracer) {
+          tracer->record(msg.id, frame_stage::PUBLISHED);
+        }
+        break;
+      case bot_message_kind::CONTROL:
+        control_sink->on_next(std::move(msg.data));
+        break;
+      case bot_message_kind::DEBUG:
+        debug_sink->on_next(std::move(msg.data));
+        break;
+    }
+  }
+
+  nlohmann::json job;
+  std::unique_ptr<bot_instance> instance;
+  uint64_t multiframes_counter{0};
+  std::atomic<bool> finished{false};
+  // set when job is removed, bot finishes once its queued frames are processed.
+  bool stopping{false};
+  const std::shared_ptr<streams::breaker> breaker{std::make_shared<streams::breaker>()};
+  // control channel never completes by itself, it is stopped once frames end.
+  const std::shared_ptr<streams::breaker> control_breaker{
+      std::make_shared<streams::breaker>()};
+
+  streams::observer<nlohmann::json>* analysis_sink{nullptr};
+  streams::observer<nlohmann::json>* debug_sink{nullptr};
+  streams::observer<nlohmann::json>* control_sink{nullptr};
+
+  // frames waiting for the bot, null in batch mode.
+  std::shared_ptr<streams::queue_depth> processing_queue;
+  // null unless frames are traced.
+  std::shared_ptr<frame_tracer> tracer;
+
+  std::unique_ptr<buffered_file_sink> analysis_file;
+  std::unique_ptr<buffered_file_sink> debug_file;
+  // null unless batch mode progress is saved.
+  std::unique_ptr<batch_checkpointer> checkpointer;
+
+  streams::publisher<nlohmann::json> control_source;
+};
+
 bot_environment& bot_environment::instance() {
   static bot_environment env;
   return env;
 }
 
 void bot_environment::register_bot(const multiframe_bot_descriptor& bot) {
+  CHECK(!bot.device_frames || !bot.lazy_conversion)
+      << "device frames can't be converted lazily";
   _bot_descriptor = bot;
-}
-
-void bot_environment::operator()(const owned_image_metadata& /*metadata*/) {}
-
-void bot_environment::operator()(const owned_image_frame& /*frame*/) {}
-
-void bot_environment::operator()(struct bot_message& msg) {
-  switch (msg.kind) {
-    case bot_message_kind::ANALYSIS:
-      _analysis_sink->on_next(std::move(msg.data));
-      break;
-    case bot_message_kind::CONTROL:
-      _control_sink->on_next(std::move(msg.data));
-      break;
-    case bot_message_kind::DEBUG:
-      _debug_sink->on_next(std::move(msg.data));
-      break;
+  if (bot.batch_callback) {
+    _batcher = std::make_shared<cross_stream_batcher>(bot.batch_callback, bot.max_batch,
+                                                      bot.max_batch_wait);
   }
 }
 
@@ -127,12 +467,121 @@ struct env_configuration : cli_streams::configuration {
   env_configuration(int argc, char* argv[])
       : configuration(argc, argv, bot_cli_cfg(), bot_custom_options()) {}
 
-  bot_configuration bot_config() const { return bot_configuration{_vm}; }
+  bot_configuration bot_config() const {
+    check_checkpoint_options(_vm, is_batch_mode());
+    return bot_configuration{_vm};
+  }
   boost::optional<std::string> pool() const {
     return _vm.count("pool") > 0 ? _vm["pool"].as<std::string>()
                                  : boost::optional<std::string>{};
   }
   std::string id() const { return _vm["id"].as<std::string>(); }
+  size_t pool_capacity() const {
+    return _vm.count("pool-capacity") > 0 ? _vm["pool-capacity"].as<size_t>() : 1;
+  }
+  // none means a dedicated processing thread per job.
+  boost::optional<size_t> processing_threads() const {
+    if (_vm.count("processing-threads") > 0) {
+      return _vm["processing-threads"].as<size_t>();
+    }
+    if (pool() && pool_capacity() > 1) {
+      return std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+    return boost::none;
+  }
+  // cpu sets jobs are assigned to round-robin, empty if threads are not pinned.
+  std::vector<std::vector<int>> numa_placement() const {
+    if (_vm.count("numa-placement") == 0) {
+      return {};
+    }
+    const std::string placement = _vm["numa-placement"].as<std::string>();
+    std::vector<std::vector<int>> result;
+    if (placement == "spread") {
+      for (size_t node = 0; node < threadutils::numa_node_count(); node++) {
+        result.push_back(threadutils::numa_node_cpus(node));
+      }
+    } else {
+      CHECK(!placement.empty()
+            && placement.find_first_not_of("0123456789") == std::string::npos)
+          << "bad --numa-placement " << placement;
+      result.push_back(threadutils::numa_node_cpus(std::stoul(placement)));
+    }
+    for (const auto& cpus : result) {
+      CHECK(!cpus.empty()) << "unknown NUMA node in --numa-placement " << placement;
+    }
+    return result;
+  }
+
+  boost::optional<std::string> profile_dir() const {
+    return _vm.count("profile-dir") > 0 ? _vm["profile-dir"].as<std::string>()
+                                        : boost::optional<std::string>{};
+  }
+
+  // 0 turns frame tracing off.
+  uint32_t frame_trace_sample() const {
+    return _vm.count("frame-trace-sample") > 0 ? _vm["frame-trace-sample"].as<uint32_t>()
+                                               : 0;
+  }
+  boost::optional<std::string> frame_trace_file() const {
+    return _vm.count("frame-trace-file") > 0 ? _vm["frame-trace-file"].as<std::string>()
+                                             : boost::optional<std::string>{};
+  }
+
+  // 0 means there is no limit.
+  size_t frame_memory_budget_bytes() const {
+    return _vm.count("frame-memory-budget") > 0
+               ? _vm["frame-memory-budget"].as<size_t>() * 1024 * 1024
+               : 0;
+  }
+
+  // 0 means there is no arena.
+  size_t frame_arena_bytes() const {
+    return _vm.count("frame-arena") > 0 ? _vm["frame-arena"].as<size_t>() * 1024 * 1024
+                                        : 0;
+  }
+
+  bool has_batch_inputs() const { return _vm.count("batch-inputs") > 0; }
+  size_t batch_parallelism() const {
+    return _vm.count("batch-parallelism") > 0
+               ? _vm["batch-parallelism"].as<size_t>()
+               : std::max<size_t>(1, std::thread::hardware_concurrency());
+  }
+
+  // configuration of every input of --batch-inputs, which differ from command line
+  // only by input video file and messages files.
+  std::vector<bot_configuration> batch_input_configs() const {
+    if (!is_batch_mode() || _vm.count("input-video-file") > 0
+        || _vm.count("analysis-dir") == 0) {
+      std::cerr << "--batch-inputs need --batch and --analysis-dir, and can't be used "
+                   "with --input-video-file"
+                << std::endl;
+      exit(1);
+    }
+    const std::vector<std::string> inputs =
+        list_batch_inputs(_vm["batch-inputs"].as<std::string>());
+    if (inputs.empty()) {
+      std::cerr << "No batch inputs found: " << _vm["batch-inputs"].as<std::string>()
+                << std::endl;
+      exit(1);
+    }
+
+    const boost::filesystem::path dir{_vm["analysis-dir"].as<std::string>()};
+    boost::filesystem::create_directories(dir);
+    const std::string extension = "." + _vm["messages-file-format"].as<std::string>();
+    const std::vector<std::string> names = output_names(inputs);
+
+    std::vector<bot_configuration> configs;
+    configs.reserve(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++) {
+      variables_map vm = _vm;
+      set_option(vm, "input-video-file", inputs[i]);
+      set_option(vm, "analysis-file", (dir / (names[i] + extension)).string());
+      set_option(vm, "debug-file", (dir / (names[i] + ".debug" + extension)).string());
+      check_checkpoint_options(vm, true);
+      configs.emplace_back(vm);
+    }
+    return configs;
+  }
 };
 
 bot_configuration::bot_configuration(const po::variables_map& vm)
@@ -141,11 +590,33 @@ bot_configuration::bot_configuration(const po::variables_map& vm)
                                                   : boost::optional<std::string>{}),
       debug_file(vm.count("debug-file") > 0 ? vm["debug-file"].as<std::string>()
                                             : boost::optional<std::string>{}),
-      video_cfg(vm),
+      messages_file_options(init_messages_file_options(
+          vm["messages-file-format"].as<std::string>(),
+          vm["messages-file-flush-interval"].as<int>())),
+      analysis_batch(init_analysis_batch(
+          vm.count("analysis-batch") > 0 ? vm["analysis-batch"].as<std::string>()
+                                         : boost::optional<std::string>{},
+          vm["analysis-batch-window"].as<int>())),
+      resume_checkpoint(init_resume_checkpoint(vm)),
+      video_cfg(resumed_options(vm, resume_checkpoint)),
       bot_config(init_config(vm)),
       max_queued_frames(vm.count("max-queued-frames") > 0
                             ? vm["max-queued-frames"].as<size_t>()
-                            : boost::optional<size_t>{}) {}
+                            : boost::optional<size_t>{}),
+      queue_overflow_policy(
+          init_overflow_policy(vm["queue-overflow-policy"].as<std::string>())),
+      batch_jobs(vm.count("batch-jobs") > 0 ? vm["batch-jobs"].as<size_t>() : 1),
+      max_fps(vm.count("max-fps") > 0 ? vm["max-fps"].as<double>()
+                                      : boost::optional<double>{}),
+      motion_threshold(vm.count("motion-threshold") > 0
+                           ? vm["motion-threshold"].as<double>()
+                           : 0),
+      motion_keep_alive(vm["motion-keep-alive"].as<double>()),
+      checkpoint_interval(
+          vm.count("checkpoint-interval") > 0
+              ? std::chrono::milliseconds{vm["checkpoint-interval"].as<int>() * 1000}
+              : boost::optional<std::chrono::milliseconds>{}),
+      checkpoint_bot_state(vm.count("checkpoint-bot-state") > 0) {}
 
 bot_configuration::bot_configuration(const nlohmann::json& config)
     : id(config["id"].get<std::string>()),
@@ -155,50 +626,128 @@ bot_configuration::bot_configuration(const nlohmann::json& config)
       debug_file(config.find("debug_file") != config.end()
                      ? config["debug_file"].get<std::string>()
                      : boost::optional<std::string>{}),
+      messages_file_options(init_messages_file_options(
+          config.find("messages_file_format") != config.end()
+              ? config["messages_file_format"].get<std::string>()
+              : "json",
+          config.find("messages_file_flush_interval") != config.end()
+              ? config["messages_file_flush_interval"].get<int>()
+              : 1000)),
+      analysis_batch(init_analysis_batch(
+          config.find("analysis_batch") != config.end()
+              ? config["analysis_batch"].get<std::string>()
+              : boost::optional<std::string>{},
+          config.find("analysis_batch_window") != config.end()
+              ? config["analysis_batch_window"].get<int>()
+              : 100)),
       max_queued_frames(config.find("max-queued-frames") != config.end()
                             ? config["max-queued-frames"].get<size_t>()
                             : boost::optional<size_t>{}),
+      queue_overflow_policy(
+          config.find("queue-overflow-policy") != config.end()
+              ? init_overflow_policy(config["queue-overflow-policy"].get<std::string>())
+              : streams::overflow_policy::DROP_NEWEST),
       video_cfg(config),
       bot_config(config.find("config") != config.end() ? config["config"]
-                                                       : nlohmann::json(nullptr)) {}
+                                                       : nlohmann::json(nullptr)),
+      batch_jobs(config.find("batch-jobs") != config.end()
+                     ? config["batch-jobs"].get<size_t>()
+                     : 1),
+      max_fps(config.find("max_fps") != config.end() ? config["max_fps"].get<double>()
+                                                     : boost::optional<double>{}),
+      motion_threshold(config.find("motion_threshold") != config.end()
+                           ? config["motion_threshold"].get<double>()
+                           : 0),
+      motion_keep_alive(config.find("motion_keep_alive") != config.end()
+                            ? config["motion_keep_alive"].get<double>()
+                            : 1),
+      checkpoint_bot_state(false) {}
 
 int bot_environment::main(int argc, char* argv[]) {
   init_tcmalloc();
   init_logging(argc, argv);
 
+  _started_at = std::chrono::steady_clock::now();
   env_configuration config{argc, argv};
 
   const bool batch = config.is_batch_mode();
   const std::string id = config.id();
+  // before any frame is allocated.
+  init_frame_arena(config.frame_arena_bytes());
 
   boost::asio::ssl::context ssl_context{boost::asio::ssl::context::sslv23};
 
+  _metrics_config = config.metrics();
+  _pool_mode = config.pool().is_initialized();
+  if (auto profile_dir = config.profile_dir()) {
+    _profiler = std::make_shared<profiler>(*profile_dir, id);
+  }
   _rtm_client =
       config.rtm_client(_io_service, std::this_thread::get_id(), ssl_context, *this);
   if (_rtm_client) {
+    // configure callback, which may load a model, runs while rtm client connects.
+    if (!_pool_mode && !batch) {
+      const bot_configuration bot_config = config.bot_config();
+      _prepared_bot = std::async(std::launch::async, [this, bot_config]() {
+        threadutils::set_current_thread_name("bot_configure");
+        stopwatch<std::chrono::steady_clock> s;
+        prepared_bot prepared;
+        prepared.crop = initial_crop(bot_config);
+        prepared.instance = build_bot(bot_config, prepared.crop);
+        report_startup_phase("configure", s.millis());
+        return prepared;
+      });
+    }
+
+    stopwatch<std::chrono::steady_clock> s;
     if (auto ec = _rtm_client->start()) {
       ABORT() << "error starting rtm client: " << ec.message();
     }
+    report_startup_phase("rtm_connect", s.millis());
+  }
+  _frame_trace_sample = config.frame_trace_sample();
+  if (auto trace_file = config.frame_trace_file()) {
+    _frame_trace_file = std::make_unique<buffered_file_sink>(*trace_file);
+  }
+  _frame_memory_budget =
+      std::make_shared<frame_memory_budget>(config.frame_memory_budget_bytes());
+  _pool_capacity = config.pool_capacity();
+  CHECK_GT(_pool_capacity, 0) << "pool capacity should be positive";
+  _placement = config.numa_placement();
+  if (auto threads = config.processing_threads()) {
+    CHECK_GT(*threads, 0) << "processing threads should be positive";
+    if (_placement.empty()) {
+      _processing_executors.push_back(
+          std::make_unique<streams::executor>("processing_worker", *threads));
+    }
+    // threads are split between nodes.
+    for (size_t i = 0; i < _placement.size(); i++) {
+      const size_t node_threads = std::max<size_t>(1, *threads / _placement.size());
+      _processing_executors.push_back(std::make_unique<streams::executor>(
+          "processing_n" + std::to_string(i), node_threads, _placement[i]));
+    }
   }
-  _metrics_config = config.metrics();
-  _pool_mode = config.pool().is_initialized();
 
   auto start = [config, this]() {
-    if (!_pool_mode) {
+    if (!_pool_mode && config.has_batch_inputs()) {
+      run_batch_inputs(config.batch_input_configs(), config.batch_parallelism());
+    } else if (!_pool_mode) {
       start_bot(config.bot_config());
     } else {
       std::string pool = config.pool().get();
       // TODO: could use pool-job-type cli option
       std::string job_type = config.id();
 
-      auto job_controller =
-          new pool_job_controller(_io_service, pool, job_type, 1, _rtm_client, *this);
+      auto job_controller = new pool_job_controller(_io_service, pool, job_type,
+                                                    _pool_capacity, _rtm_client, *this);
+      _pool_controller = job_controller;
 
       // Kubernetes sends SIGTERM, and then SIGKILL after 30 seconds
       // https://kubernetes.io/docs/concepts/workloads/pods/pod/#termination-of-pods
       signal::register_handler(
           {SIGINT, SIGTERM, SIGQUIT}, [this, job_controller](int signal) {
             LOG(INFO) << "Got signal #" << signal << ", shutting down job controller";
+            _pool_controller = nullptr;
             job_controller->shutdown();
             delete job_controller;
 
@@ -210,6 +759,9 @@ int bot_environment::main(int argc, char* argv[]) {
   };
 
   if (!batch) {
+    if (_placement.size() == 1) {
+      threadutils::set_current_thread_affinity(_placement.front());
+    }
     LOG(INFO) << "entering asio loop";
     _io_service.post(start);
     auto n = _io_service.run();
@@ -239,26 +791,161 @@ int bot_environment::main(int argc, char* argv[]) {
   return 0;
 }
 
-void bot_environment::start_bot(const bot_configuration& config) {
-  _metrics_config.push_job = config.id;
-  init_metrics(_metrics_config, _io_service);
-  expose_metrics(_rtm_client.get());
+void bot_environment::start_bot(const bot_configuration& config,
+                                const nlohmann::json& job) {
+  running_bot* bot;
+  {
+    std::lock_guard<std::mutex> lock(_bots_mutex);
+    // metrics are shared by all bots of the process, batch inputs start bots from
+    // several threads.
+    if (!_metrics_started) {
+      _metrics_started = true;
+      _metrics_config.push_job = config.id;
+      init_metrics(_metrics_config, _io_service);
+      expose_metrics(_rtm_client.get());
+    }
+    _bots.push_back(std::make_unique<running_bot>());
+    bot = _bots.back().get();
+  }
+  bot->job = job;
+
+  init_sinks(*bot, config);
+  if (!_pool_mode) {
+    _finished = false;
+  }
 
   const bool batch = config.video_cfg.batch;
-  bot_instance_builder builder =
-      bot_instance_builder{_bot_descriptor}
-          .set_execution_mode(batch ? execution_mode::BATCH : execution_mode::LIVE)
-          .set_bot_id(config.id)
-          .set_config(config.bot_config);
+  if (batch && config.batch_jobs > 1) {
+    if (!_bot_descriptor.gop_independent) {
+      LOG(WARNING) << "bot depends on previous groups of pictures, batch jobs are "
+                      "processed sequentially";
+    } else if (!config.video_cfg.input_video_file || config.video_cfg.time_limit
+               || config.video_cfg.frames_limit || config.video_cfg.start_time
+               || config.video_cfg.end_time || config.video_cfg.start_frame
+               || config.video_cfg.end_frame) {
+      LOG(WARNING) << "parallel batch jobs need whole input video file without time "
+                      "and frames limits, processing sequentially";
+    } else {
+      if (config.checkpoint_interval) {
+        LOG(WARNING) << "parallel batch jobs don't save checkpoints";
+      }
+      run_parallel_batch(*bot, config);
+      return;
+    }
+  }
+
+  std::shared_ptr<crop_region> crop;
+  if (_prepared_bot.valid()) {
+    stopwatch<std::chrono::steady_clock> s;
+    prepared_bot prepared = _prepared_bot.get();
+    report_startup_phase("configure_wait", s.millis());
+    crop = std::move(prepared.crop);
+    bot->instance = std::move(prepared.instance);
+  } else {
+    crop = initial_crop(config);
+    bot->instance = build_bot(config, crop);
+  }
+  if (config.resume_checkpoint && !config.resume_checkpoint->bot_state.is_null()) {
+    bot->instance->restore_state(config.resume_checkpoint->bot_state);
+  }
+  if (batch && config.checkpoint_interval) {
+    std::function<nlohmann::json()> bot_state;
+    if (config.checkpoint_bot_state) {
+      bot_instance* instance = bot->instance.get();
+      bot_state = [instance]() { return instance->checkpoint_state(); };
+    }
+    bot->checkpointer = std::make_unique<batch_checkpointer>(
+        checkpoint_path(*config.analysis_file), *config.checkpoint_interval,
+        bot->analysis_file.get(), bot->debug_file.get(), std::move(bot_state));
+  }
+  // when frames start to pile up in front of the bot, decoder skips some of them
+  // instead of decoding frames which are going to be dropped.
+  auto processing_queue = std::make_shared<streams::queue_depth>(0);
+  decoder_options decoder_opts;
+  decoder_opts.crop = crop;
+  init_decimation(decoder_opts, config, _bot_descriptor, *bot->instance);
+  decoder_opts.keep_hw_frames = _bot_descriptor.device_frames;
+  decoder_opts.export_motion_vectors = _bot_descriptor.motion_vectors;
+  decoder_opts.motion_vectors_only = _bot_descriptor.motion_vectors_only;
+  // job is placed on the next node, batch jobs run on threads of their own.
+  size_t placement = 0;
+  if (!batch && !_placement.empty()) {
+    placement = _next_placement++ % _placement.size();
+    decoder_opts.cpus = _placement[placement];
+  }
+  if (!batch) {
+    bot->processing_queue = processing_queue;
+  }
+  if (!batch && config.max_queued_frames) {
+    decoder_opts.downstream_queue = processing_queue;
+    decoder_opts.skip_threshold = std::max<size_t>(1, *config.max_queued_frames / 2);
+  }
+
+  if (_frame_trace_sample > 0) {
+    const std::string input = config.video_cfg.input_channel.get_value_or(
+        config.video_cfg.input_video_file.get_value_or(""));
+    bot->tracer = std::make_shared<frame_tracer>(input, _frame_trace_sample,
+                                                 _frame_trace_file.get());
+  }
 
-  _bot_instance = builder.build();
   auto single_frame_source = cli_streams::decoded_publisher(
-      _io_service, _rtm_client, config.video_cfg, _bot_descriptor.pixel_format);
+      _io_service, _rtm_client, config.video_cfg, bot->instance->decoder_pixel_format(),
+      decoder_opts, bot->tracer);
+  if (_pool_mode) {
+    // removed job stops decoding, frames already queued are still processed.
+    single_frame_source =
+        std::move(single_frame_source) >> streams::break_on(bot->breaker);
+  }
+  if (config.motion_threshold > 0) {
+    // gated frames are dropped before they take memory and queue slots.
+    auto gate = std::make_shared<motion_gate>(
+        config.id, config.motion_threshold,
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::duration<double>(config.motion_keep_alive)));
+    single_frame_source =
+        std::move(single_frame_source)
+        >> streams::filter_map([gate](owned_image_packet&& pkt) {
+            if (auto* frame = boost::get<owned_image_frame>(&pkt)) {
+              if (!gate->pass(*frame)) {
+                return boost::optional<owned_image_packet>{};
+              }
+            }
+            return boost::optional<owned_image_packet>{std::move(pkt)};
+          });
+  }
   if (!batch) {
-    _source = std::move(single_frame_source)
-              >> streams::threaded_worker("processing_worker", config.max_queued_frames);
+    // frames are charged before they are queued, over the budget they are dropped
+    // whatever queue overflow policy is.
+    auto memory = std::make_shared<frame_memory_account>(
+        _frame_memory_budget, config.video_cfg.input_channel.get_value_or(config.id));
+    prometheus::Counter* dropped = &bot->instance->metrics.frames_dropped_total;
+    single_frame_source =
+        std::move(single_frame_source)
+        >> streams::filter_map([memory, dropped](owned_image_packet&& pkt) {
+            if (auto* frame = boost::get<owned_image_frame>(&pkt)) {
+              if (!memory->charge(*frame)) {
+                dropped->Increment();
+                return boost::optional<owned_image_packet>{};
+              }
+            }
+            return boost::optional<owned_image_packet>{std::move(pkt)};
+          });
+  }
+  streams::publisher<std::queue<owned_image_packet>> source;
+  if (!batch && !_processing_executors.empty()) {
+    const std::string worker_name =
+        "processing_worker_" + config.video_cfg.input_channel.get_value_or("");
+    source = std::move(single_frame_source)
+             >> streams::threaded_worker(*_processing_executors[placement], worker_name,
+                                         config.max_queued_frames,
+                                         config.queue_overflow_policy, processing_queue);
+  } else if (!batch) {
+    source = std::move(single_frame_source)
+             >> streams::threaded_worker("processing_worker", config.max_queued_frames,
+                                         config.queue_overflow_policy, processing_queue,
+                                         decoder_opts.cpus);
   } else {
-    _source =
+    source =
         std::move(single_frame_source) >> streams::map([](owned_image_packet&& pkt) {
           std::queue<owned_image_packet> q;
           q.push(pkt);
@@ -266,105 +953,370 @@ void bot_environment::start_bot(const bot_configuration& config) {
         });
   }
 
+  // signal_breaker can have only one instance, jobs of the pool are stopped with their
+  // own breakers, batch inputs run until their files end.
+  if (!_pool_mode && !_batch_inputs) {
+    source = std::move(source) >> streams::signal_breaker({SIGINT, SIGTERM, SIGQUIT});
+  }
+  // bot is finished when its output completes, which needs control source to
+  // complete too. Control channel delivers messages on asio thread, its breaker is
+  // triggered there.
+  source = std::move(source)
+           >> streams::do_finally([this, control_breaker = bot->control_breaker]() {
+               if (_rtm_client) {
+                 _io_service.post([control_breaker]() { control_breaker->trigger(); });
+               } else {
+                 control_breaker->trigger();
+               }
+             });
+
+  streams::publisher<nlohmann::json> control_source =
+      std::move(bot->control_source) >> streams::break_on(bot->control_breaker);
+  if (_pool_mode) {
+    control_source = std::move(control_source) >> streams::break_on(bot->breaker);
+  }
+
+  // control commands shouldn't wait behind queued frames.
+  auto bot_input_stream = streams::publishers::merge_prioritized<bot_input>(
+      std::move(control_source)
+          >> streams::map([](nlohmann::json&& t) { return bot_input{t}; }),
+      std::move(source)
+          >> (streams::map([ this, bot, &multiframes_counter = bot->multiframes_counter ](
+                               std::queue<owned_image_packet>&& pkt) mutable {
+                multiframes_counter++;
+                if (multiframes_counter == 1 && !_first_frame_reported.exchange(true)) {
+                  report_startup_phase("first_frame", since_start_millis());
+                }
+                if (multiframes_counter == 1 && _pool_mode) {
+                  report_job_ready(bot->job);
+                }
+                if (bot->tracer) {
+                  for (size_t n = pkt.size(); n > 0; n--) {
+                    owned_image_packet p = std::move(pkt.front());
+                    pkt.pop();
+                    if (const owned_image_frame* f = boost::get<owned_image_frame>(&p)) {
+                      bot->tracer->record(f->id, frame_stage::DEQUEUED);
+                    }
+                    pkt.push(std::move(p));
+                  }
+                }
+                constexpr int period = 100;
+                if ((multiframes_counter % period) == 0) {
+                  LOG(INFO) << "Processed " << multiframes_counter << " multiframes";
+                }
+                return pkt;
+              })
+              >> streams::map([](std::queue<owned_image_packet>&& p) {
+                  return bot_input{p};
+                })));
+
+  if (config.video_cfg.profile_stages) {
+    bot_input_stream = std::move(bot_input_stream) >> streams::profile("bot");
+  }
+  auto bot_output_stream = std::move(bot_input_stream) >> bot->instance->run_bot()
+                           >> streams::do_finally([this, bot]() { finish_bot(*bot); });
+
+  bot_output_stream->process([bot](bot_output&& o) { boost::apply_visitor(*bot, o); });
+  if (!batch && !_pipeline_reported.exchange(true)) {
+    // channels are subscribed by now, subscriptions are sent without waiting for
+    // each other's acknowledgements.
+    report_startup_phase("pipeline", since_start_millis());
+  }
+}
+
+uint64_t bot_environment::since_start_millis() const {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - _started_at)
+      .count();
+}
+
+std::unique_ptr<bot_instance> bot_environment::build_bot(
+    const bot_configuration& config, std::shared_ptr<crop_region> crop) const {
+  return bot_instance_builder{_bot_descriptor}
+      .set_execution_mode(config.video_cfg.batch ? execution_mode::BATCH
+                                                 : execution_mode::LIVE)
+      .set_bot_id(config.id)
+      .set_config(config.bot_config)
+      .set_crop_region(std::move(crop))
+      .set_batcher(_batcher)
+      .set_profiler(_profiler)
+      .build();
+}
+
+void bot_environment::init_sinks(running_bot& bot, const bot_configuration& config) {
+  // resumed run continues messages files from the checkpoint.
+  buffered_file_sink_options file_options = config.messages_file_options;
+  if (const auto& checkpoint = config.resume_checkpoint) {
+    truncate_messages_file(*config.analysis_file, checkpoint->analysis_file_offset);
+    if (config.debug_file) {
+      truncate_messages_file(*config.debug_file, checkpoint->debug_file_offset);
+    }
+    file_options.append = true;
+    LOG(INFO) << "resuming after frame " << checkpoint->frame.i2;
+  }
+
   if (config.analysis_file) {
     std::string analysis_file = config.analysis_file.get();
     LOG(INFO) << "saving analysis output to " << analysis_file;
-    _analysis_file = std::make_unique<std::ofstream>(analysis_file.c_str());
-    _analysis_sink = &streams::ostream_sink(*_analysis_file);
+    bot.analysis_file = std::make_unique<buffered_file_sink>(analysis_file, file_options);
+    bot.analysis_sink = bot.analysis_file.get();
   } else if (_rtm_client) {
-    _analysis_sink =
+    bot.analysis_sink =
         &rtm::sink(_rtm_client, _io_service,
                    config.video_cfg.input_channel.get() + analysis_channel_suffix);
+    if (config.analysis_batch) {
+      bot.analysis_sink =
+          &batching_sink(*bot.analysis_sink, _io_service, *config.analysis_batch);
+    }
   } else {
-    _analysis_sink = &streams::ostream_sink(std::cout);
+    bot.analysis_sink = &streams::ostream_sink(std::cout);
   }
 
   if (config.debug_file) {
     std::string debug_file = config.debug_file.get();
     LOG(INFO) << "saving debug output to " << debug_file;
-    _debug_file = std::make_unique<std::ofstream>(debug_file.c_str());
-    _debug_sink = &streams::ostream_sink(*_debug_file);
+    bot.debug_file = std::make_unique<buffered_file_sink>(debug_file, file_options);
+    bot.debug_sink = bot.debug_file.get();
   } else if (_rtm_client) {
-    _debug_sink = &rtm::sink(_rtm_client, _io_service,
+    bot.debug_sink = &rtm::sink(_rtm_client, _io_service,
                              config.video_cfg.input_channel.get() + debug_channel_suffix);
   } else {
-    _debug_sink = &streams::ostream_sink(std::cerr);
+    bot.debug_sink = &streams::ostream_sink(std::cerr);
   }
 
   if (_rtm_client) {
-    _control_sink = &rtm::sink(_rtm_client, _io_service, config.video_cfg.input_channel.get() + control_channel_suffix);
-    _control_source =
-        rtm::channel(_rtm_client, config.video_cfg.input_channel.get() + control_channel_suffix, {})
+    const std::string control_channel =
+        config.video_cfg.input_channel.get() + control_channel_suffix;
+    bot.control_sink = &rtm::sink(_rtm_client, _io_service, control_channel);
+    bot.control_source =
+        rtm::channel(_rtm_client, control_channel, {})
         >> streams::map([](rtm::channel_data&& t) { return std::move(t.payload); });
   } else {
-    _control_sink = &streams::ostream_sink(std::cout);
-    _control_source = streams::publishers::empty<nlohmann::json>();
+    bot.control_sink = &streams::ostream_sink(std::cout);
+    bot.control_source = streams::publishers::empty<nlohmann::json>();
   }
+}
 
-  _finished = false;
-  _multiframes_counter = 0;
+void bot_environment::run_parallel_batch(running_bot& bot,
+                                         const bot_configuration& config) {
+  const std::string& filename = *config.video_cfg.input_video_file;
+  const std::vector<file_range> ranges = split_by_key_frames(filename, config.batch_jobs);
+  CHECK(!ranges.empty()) << "can't read video from " << filename;
+  LOG(INFO) << "processing " << ranges.size() << " parts of " << filename
+            << " in parallel";
 
-  _source = std::move(_source) >> streams::signal_breaker({SIGINT, SIGTERM, SIGQUIT})
-            >> streams::map([& multiframes_counter = _multiframes_counter](
-                                std::queue<owned_image_packet>&& pkt) mutable {
-                multiframes_counter++;
-                constexpr int period = 100;
-                if ((multiframes_counter % period) == 0) {
-                  LOG(INFO) << "Processed " << multiframes_counter << " multiframes";
-                }
-                return pkt;
-              })
-            >> streams::do_finally([this]() {
-                _finished = true;
-
-                _io_service.post([this]() {
-                  LOG(INFO) << "stopping bot metrics";
-                  stop_metrics();
-                });
-
-                if (!_pool_mode && _rtm_client) {
-                  _io_service.post([rtm_client = _rtm_client]() {
-                    LOG(INFO) << "stopping rtm client";
-                    if (auto ec = rtm_client->stop()) {
-                      LOG(ERROR) << "error stopping rtm client: " << ec.message();
-                    } else {
-                      LOG(INFO) << "rtm client was stopped";
-                    }
-                  });
-                }
-              });
+  // decoders share cores between parts.
+  const int decoder_threads = std::max(
+      1, static_cast<int>(std::thread::hardware_concurrency() / ranges.size()));
 
-  auto bot_input_stream = streams::publishers::merge<bot_input>(
-      std::move(_control_source)
-          >> streams::map([](nlohmann::json&& t) { return bot_input{t}; }),
-      std::move(_source) >> streams::map([](std::queue<owned_image_packet>&& p) {
-        return bot_input{p};
-      }));
+  struct range_job {
+    std::unique_ptr<bot_instance> instance;
+    std::vector<struct bot_message> messages;
+    std::thread thread;
+  };
+  std::vector<range_job> jobs(ranges.size());
+  for (size_t i = 0; i < ranges.size(); i++) {
+    range_job& job = jobs[i];
+    auto crop = initial_crop(config);
+    job.instance = build_bot(config, crop);
+
+    decoder_options decoder_opts;
+    decoder_opts.crop = crop;
+    decoder_opts.thread_count = decoder_threads;
+    init_decimation(decoder_opts, config, _bot_descriptor, *job.instance);
+    decoder_opts.keep_hw_frames = _bot_descriptor.device_frames;
+    decoder_opts.export_motion_vectors = _bot_descriptor.motion_vectors;
+    decoder_opts.motion_vectors_only = _bot_descriptor.motion_vectors_only;
+    auto frames =
+        file_range_source(filename, ranges[i], config.video_cfg.read_ahead_bytes)
+        >> cli_streams::decode_input(config.video_cfg,
+                                     job.instance->decoder_pixel_format(), decoder_opts);
+
+    // batch streams are synchronous, process() returns when the part is done.
+    job.thread = std::thread([i, &job, frames = std::move(frames)]() mutable {
+      threadutils::set_current_thread_name("batch_job_" + std::to_string(i));
+      auto input = std::move(frames) >> streams::map([](owned_image_packet&& pkt) {
+                     std::queue<owned_image_packet> q;
+                     q.push(std::move(pkt));
+                     return bot_input{std::move(q)};
+                   });
+      (std::move(input) >> job.instance->run_bot())->process([&job](bot_output&& o) {
+        if (auto* msg = boost::get<struct bot_message>(&o)) {
+          job.messages.push_back(std::move(*msg));
+        }
+      });
+      LOG(INFO) << "batch job " << i << " is done";
+    });
+  }
+
+  // parts follow each other, so sending their messages in order of parts keeps
+  // them ordered by frame id, like in sequential batch mode.
+  for (range_job& job : jobs) {
+    job.thread.join();
+    for (struct bot_message& msg : job.messages) {
+      bot(msg);
+    }
+    job.messages.clear();
+    job.instance.reset();
+  }
+
+  finish_bot(bot);
+}
+
+void bot_environment::run_batch_inputs(const std::vector<bot_configuration>& inputs,
+                                       size_t parallelism) {
+  CHECK_GT(parallelism, 0) << "batch parallelism should be positive";
+  const size_t threads_count = std::min(parallelism, inputs.size());
+  LOG(INFO) << "processing " << inputs.size() << " input files, " << threads_count
+            << " at a time";
+  _batch_inputs = true;
+
+  std::atomic<size_t> next_input{0};
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < threads_count; t++) {
+    threads.emplace_back([this, t, &inputs, &next_input]() {
+      threadutils::set_current_thread_name("batch_input_" + std::to_string(t));
+      for (size_t i = next_input++; i < inputs.size(); i = next_input++) {
+        const bot_configuration& config = inputs[i];
+        const nlohmann::json job = {
+            {"input", i},
+            {"input_video_file", *config.video_cfg.input_video_file},
+            {"analysis_file", *config.analysis_file}};
+        // batch streams are synchronous, without rtm client input is done when
+        // start_bot returns. Control channel is stopped from asio thread otherwise.
+        start_bot(config, job);
+
+        std::lock_guard<std::mutex> lock(_bots_mutex);
+        _bots.remove_if([](const std::unique_ptr<running_bot>& bot) {
+          return bot->finished.load();
+        });
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  _batch_inputs = false;
+  stop_services();
+}
+
+void bot_environment::finish_bot(running_bot& bot) {
+  if (bot.analysis_file) {
+    bot.analysis_file->flush();
+  }
+  if (bot.tracer) {
+    bot.tracer->flush();
+  }
+  if (_frame_trace_file) {
+    _frame_trace_file->flush();
+  }
+  if (bot.debug_file) {
+    bot.debug_file->flush();
+  }
+  if (bot.checkpointer) {
+    bot.checkpointer->finish();
+  }
 
-  auto bot_output_stream = std::move(bot_input_stream) >> _bot_instance->run_bot();
+  // other jobs of the pool keep running, job controller stops on signal. Batch
+  // inputs are followed by the next ones.
+  if (_pool_mode || _batch_inputs) {
+    LOG(INFO) << "job is finished: " << bot.job;
+    bot.finished = true;
+    return;
+  }
+  bot.finished = true;
+  stop_services();
+}
+
+void bot_environment::stop_services() {
+  _finished = true;
 
-  bot_output_stream->process([this](bot_output&& o) { boost::apply_visitor(*this, o); });
+  _io_service.post([this]() {
+    LOG(INFO) << "stopping bot metrics";
+    stop_metrics();
+  });
+
+  if (_rtm_client) {
+    _io_service.post([rtm_client = _rtm_client]() {
+      LOG(INFO) << "stopping rtm client";
+      if (auto ec = rtm_client->stop()) {
+        LOG(ERROR) << "error stopping rtm client: " << ec.message();
+      } else {
+        LOG(INFO) << "rtm client was stopped";
+      }
+    });
+  }
 }
 
 void bot_environment::add_job(const nlohmann::json& job) {
-  CHECK(_job.is_null()) << "Can't subscribe to more than one channel";
-  _job = job;
-  start_bot(bot_configuration{_job});
+  {
+    std::lock_guard<std::mutex> lock(_bots_mutex);
+    // pipelines of finished bots have completed, their outputs were flushed.
+    _bots.remove_if([](const std::unique_ptr<running_bot>& bot) {
+      return bot->finished.load();
+    });
+    if (_bots.size() >= _pool_capacity) {
+      LOG(ERROR) << "Can't run more than " << _pool_capacity
+                 << " jobs, ignoring job: " << job;
+      return;
+    }
+  }
+  start_bot(bot_configuration{job}, job);
 }
 
 void bot_environment::remove_job(const nlohmann::json& job) {
-  LOG(ERROR) << "Requested remove for the following job: " << job;
-  ABORT() << "Removing jobs is not supported";
+  std::shared_ptr<streams::breaker> breaker;
+  {
+    std::lock_guard<std::mutex> lock(_bots_mutex);
+    for (const auto& bot : _bots) {
+      if (!bot->finished && !bot->stopping && bot->job == job) {
+        bot->stopping = true;
+        breaker = bot->breaker;
+        break;
+      }
+    }
+  }
+  if (!breaker) {
+    LOG(ERROR) << "Can't remove unknown job: " << job;
+    return;
+  }
+  LOG(INFO) << "removing job: " << job;
+  // decoder and control channel are subscribed from asio thread, this is it.
+  breaker->trigger();
+}
+
+void bot_environment::report_job_ready(const nlohmann::json& job) {
+  _io_service.post([this, job]() {
+    if (auto controller = _pool_controller.load()) {
+      controller->job_ready(job);
+    }
+  });
 }
 
 nlohmann::json bot_environment::list_jobs() const {
   nlohmann::json jobs = nlohmann::json::array();
-  if (!_job.is_null()) {
-    jobs.emplace_back(_job);
+  std::lock_guard<std::mutex> lock(_bots_mutex);
+  for (const auto& bot : _bots) {
+    if (!bot->finished && !bot->stopping && !bot->job.is_null()) {
+      jobs.emplace_back(bot->job);
+    }
   }
   return jobs;
 }
 
+load_sample bot_environment::sample_load() const {
+  load_sample sample;
+  sample.processing_seconds = bot_instance::processing_seconds_total();
+  std::lock_guard<std::mutex> lock(_bots_mutex);
+  for (const auto& bot : _bots) {
+    if (!bot->finished && bot->processing_queue) {
+      sample.queued_frames += bot->processing_queue->load();
+    }
+  }
+  return sample;
+}
+
 void bot_environment::on_error(std::error_condition ec) {
   ABORT() << "rtm error: " << ec.message();
 }
@@ -1,15 +1,28 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <json.hpp>
 #include <list>
 #include <memory>
+#include <mutex>
+#include <vector>
 
+#include "batch_checkpoint.h"
+#include "buffered_file_sink.h"
 #include "cli_streams.h"
+#include "cross_stream_batcher.h"
 #include "data.h"
+#include "frame_memory.h"
+#include "frame_trace.h"
+#include "message_batcher.h"
 #include "metrics.h"
 #include "pool_controller.h"
+#include "profiler.h"
 #include "rtm_client.h"
 #include "satorivideo/multiframe/bot.h"
+#include "streams/threaded_worker.h"
 #include "video_streams.h"
 
 namespace satori {
@@ -33,14 +46,31 @@ struct bot_configuration {
   const std::string id;
   const boost::optional<std::string> analysis_file;
   const boost::optional<std::string> debug_file;
+  const buffered_file_sink_options messages_file_options;
+  // analysis messages published to channel are packed into arrays.
+  const boost::optional<message_batch_options> analysis_batch;
+  // progress of the run being resumed, its frame is where video_cfg starts. Declared
+  // before video_cfg, which is initialized from it.
+  const boost::optional<batch_checkpoint> resume_checkpoint;
   const cli_streams::input_video_config video_cfg;
   const nlohmann::json bot_config;
   const boost::optional<size_t> max_queued_frames;
+  const streams::overflow_policy queue_overflow_policy;
+  // parts of input file processed in parallel in batch mode.
+  const size_t batch_jobs;
+  // overrides max_fps of bot descriptor.
+  const boost::optional<double> max_fps;
+  // frames changing at most that much are dropped by motion_gate, 0 turns it off.
+  const double motion_threshold;
+  // seconds, see motion_gate.
+  const double motion_keep_alive;
+  // batch mode progress is saved next to analysis file that often.
+  const boost::optional<std::chrono::milliseconds> checkpoint_interval;
+  // bot state is saved with checkpoints by control commands.
+  const bool checkpoint_bot_state;
 };
 
-class bot_environment : public job_controller,
-                        private rtm::error_callbacks,
-                        boost::static_visitor<void> {
+class bot_environment : public job_controller, private rtm::error_callbacks {
  public:
   static bot_environment& instance();
 
@@ -49,38 +79,82 @@ class bot_environment : public job_controller,
 
   rtm::publisher& publisher() { return *_rtm_client; }
 
-  void operator()(const owned_image_metadata& metadata);
-  void operator()(const owned_image_frame& frame);
-  void operator()(struct bot_message& msg);
-
   void add_job(const nlohmann::json& job) override;
   void remove_job(const nlohmann::json& job) override;
   nlohmann::json list_jobs() const override;
+  load_sample sample_load() const override;
 
  private:
-  void start_bot(const bot_configuration& config);
+  // bot instance processing one input, with its own output sinks.
+  struct running_bot;
+
+  // instance configured while rtm client connects, taken by start_bot.
+  struct prepared_bot {
+    std::shared_ptr<crop_region> crop;
+    std::unique_ptr<bot_instance> instance;
+  };
+
+  // job is null outside of pool mode.
+  void start_bot(const bot_configuration& config, const nlohmann::json& job = nullptr);
+  std::unique_ptr<bot_instance> build_bot(const bot_configuration& config,
+                                          std::shared_ptr<crop_region> crop) const;
+  void init_sinks(running_bot& bot, const bot_configuration& config);
+  // processes parts of input file split at key frames on separate bot instances,
+  // for bots which are independent of previous groups of pictures.
+  void run_parallel_batch(running_bot& bot, const bot_configuration& config);
+  // processes input files of --batch-inputs, up to parallelism of them at a time.
+  // Bot instance is built for each input, process state, metrics and warm decoders
+  // are shared.
+  void run_batch_inputs(const std::vector<bot_configuration>& inputs,
+                        size_t parallelism);
+  // flushes bot outputs once it has processed all frames, outside of pool mode and
+  // batch inputs also stops services.
+  void finish_bot(running_bot& bot);
+  // stops metrics and rtm client.
+  void stop_services();
+  // first frame of the job was decoded, pool manager can stop its previous owner.
+  void report_job_ready(const nlohmann::json& job);
+  uint64_t since_start_millis() const;
   void on_error(std::error_condition ec) override;
 
   bool _finished;
-  uint64_t _multiframes_counter{0};
-  nlohmann::json _job;
+  // startup phases are reported to bot_startup_phase_millis once per process.
+  std::chrono::steady_clock::time_point _started_at;
+  std::future<prepared_bot> _prepared_bot;
+  std::atomic<bool> _first_frame_reported{false};
+  std::atomic<bool> _pipeline_reported{false};
+  bool _metrics_started{false};
   metrics_config _metrics_config;
   boost::asio::io_service _io_service;
   multiframe_bot_descriptor _bot_descriptor;
-  std::unique_ptr<bot_instance> _bot_instance;
+  // shared by bot instances of all jobs if bot has batch_callback.
+  std::shared_ptr<cross_stream_batcher> _batcher;
   std::shared_ptr<rtm::client> _rtm_client;
   bool _pool_mode{false};
-
-  streams::observer<nlohmann::json>* _analysis_sink;
-  streams::observer<nlohmann::json>* _debug_sink;
-  streams::observer<nlohmann::json>* _control_sink;
-
-  std::unique_ptr<std::ofstream> _analysis_file;
-  std::unique_ptr<std::ofstream> _debug_file;
-
-  // TODO: maybe make them local variables?
-  streams::publisher<std::queue<owned_image_packet>> _source;
-  streams::publisher<nlohmann::json> _control_source;
+  // reset from signal handler before the controller is deleted.
+  std::atomic<pool_job_controller*> _pool_controller{nullptr};
+  // set while run_batch_inputs is processing inputs.
+  bool _batch_inputs{false};
+  size_t _pool_capacity{1};
+  // runs profiles on request of control messages, if set.
+  std::shared_ptr<profiler> _profiler;
+  // every Nth frame is traced by frame_tracer of its bot, 0 turns tracing off.
+  uint32_t _frame_trace_sample{0};
+  // traces of all bots, if set.
+  std::unique_ptr<buffered_file_sink> _frame_trace_file;
+  // decoded frames queued by all bots.
+  std::shared_ptr<frame_memory_budget> _frame_memory_budget;
+  // cpus of NUMA nodes jobs are pinned to, see --numa-placement.
+  std::vector<std::vector<int>> _placement;
+  // next job goes to that node, modulo number of nodes.
+  std::atomic<size_t> _next_placement{0};
+  // run bot callbacks of all jobs when they don't have threads of their own, an
+  // executor per node of _placement if it is set.
+  std::vector<std::unique_ptr<streams::executor>> _processing_executors;
+
+  // jobs are added from asio thread and finished from processing threads.
+  mutable std::mutex _bots_mutex;
+  std::list<std::unique_ptr<running_bot>> _bots;
 };
 
 }  // namespace video
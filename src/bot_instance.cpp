@@ -1,5 +1,7 @@
 #include "bot_instance.h"
 
+#include <algorithm>
+#include <atomic>
 #include <gsl/gsl>
 
 #include "metrics.h"
@@ -8,6 +10,9 @@
 namespace satori {
 namespace video {
 namespace {
+// feeds load_model of pool mode, see bot_environment::sample_load.
+std::atomic<uint64_t> processing_micros_total{0};
+
 auto& processing_times_millis =
     prometheus::BuildHistogram()
         .Name("frame_batch_processing_times_millis")
@@ -28,6 +33,14 @@ auto& frame_batch_processed_total = prometheus::BuildCounter()
                                         .Name("frame_batch_processed_total")
                                         .Register(metrics_registry())
                                         .Add({});
+auto& frame_batches_in_flight = prometheus::BuildGauge()
+                                    .Name("frame_batches_in_flight")
+                                    .Register(metrics_registry())
+                                    .Add({});
+auto& frame_resolution_changes_total = prometheus::BuildCounter()
+                                          .Name("frame_resolution_changes_total")
+                                          .Register(metrics_registry())
+                                          .Add({});
 auto& messages_sent =
     prometheus::BuildCounter().Name("messages_sent").Register(metrics_registry());
 auto& messages_received =
@@ -40,6 +53,21 @@ nlohmann::json build_configure_command(const nlohmann::json& config) {
   return cmd;
 }
 
+nlohmann::json build_restore_command(const nlohmann::json& state) {
+  nlohmann::json cmd = {{"action", "restore"}};
+  cmd["body"] = state;
+  return cmd;
+}
+
+nlohmann::json build_resolution_command(const image_metadata& previous,
+                                        const image_metadata& current) {
+  nlohmann::json cmd = {{"action", "resolution_changed"}};
+  cmd["body"] = {{"width", current.width},
+                 {"height", current.height},
+                 {"previous", {{"width", previous.width}, {"height", previous.height}}}};
+  return cmd;
+}
+
 nlohmann::json build_shutdown_command() {
   nlohmann::json cmd = {{"action", "shutdown"}};
   return cmd;
@@ -71,7 +99,12 @@ bot_instance::bot_instance(const std::string& bot_id, const execution_mode execm
                                std::vector<double>{0,  1,   2,   5,   10,  15,  20,
                                                    25, 30,  40,  50,  60,  70,  80,
                                                    90, 100, 200, 300, 400, 500, 750}),
-                  }} {}
+                  }} {
+  if (_descriptor.async_img_callback) {
+    CHECK_GT(_descriptor.max_in_flight, 0);
+    _async = std::make_shared<async_state>();
+  }
+}
 
 streams::op<bot_input, bot_output> bot_instance::run_bot() {
   return [this](streams::publisher<bot_input>&& src) {
@@ -84,6 +117,9 @@ streams::op<bot_input, bot_output> bot_instance::run_bot() {
     auto shutdown_stream = streams::generators<bot_output>::stateful(
         [this]() {
           LOG(INFO) << "shutting down bot";
+          if (_async) {
+            finish_async_batches();
+          }
           if (_descriptor.ctrl_callback) {
             nlohmann::json cmd = build_shutdown_command();
             nlohmann::json response = _descriptor.ctrl_callback(*this, std::move(cmd));
@@ -107,7 +143,7 @@ streams::op<bot_input, bot_output> bot_instance::run_bot() {
 
           LOG(INFO) << "sending shutdown";
           struct bot_message msg = std::move(_message_buffer.front());
-          _message_buffer.pop_front();
+          _message_buffer.erase(_message_buffer.begin());
 
           sink.on_next(std::move(msg));
         });
@@ -129,14 +165,188 @@ void bot_instance::queue_message(const bot_message_kind kind, nlohmann::json&& m
   struct bot_message newmsg {
     std::move(message), kind, effective_frame_id
   };
+  if (_async) {
+    // may be called from any thread before batch completion.
+    std::lock_guard<std::mutex> lock(_async->mutex);
+    if (async_batch* batch = find_async_batch(effective_frame_id)) {
+      batch->messages.push_back(std::move(newmsg));
+      return;
+    }
+  }
   _message_buffer.push_back(std::move(newmsg));
 }
 
+bot_instance::async_batch* bot_instance::find_async_batch(const frame_id& id) {
+  if (id.i1 == 0 && id.i2 == 0) {
+    return nullptr;
+  }
+  for (auto& batch : _async->in_flight) {
+    if (!batch->done && id.i1 >= batch->first_frame.i1
+        && id.i1 <= batch->last_frame.i2) {
+      return batch.get();
+    }
+  }
+  return nullptr;
+}
+
+void bot_instance::process_async(bot_outputs& result) {
+  auto batch = std::make_shared<async_batch>();
+  batch->packets = std::move(result);
+  result = bot_outputs{};
+  collect_async_batches(result);
+
+  std::unique_lock<std::mutex> lock(_async->mutex);
+  if (_frames.empty()) {
+    // packets without frames keep their place among batches.
+    batch->done = true;
+    _async->in_flight.push_back(std::move(batch));
+    return;
+  }
+
+  while (_async->in_flight.size() >= _descriptor.max_in_flight) {
+    _async->completed.wait(lock, [this]() { return _async->in_flight.front()->done; });
+    lock.unlock();
+    collect_async_batches(result);
+    lock.lock();
+  }
+  batch->first_frame = _frames.front().id;
+  batch->last_frame = _frames.back().id;
+  _async->in_flight.push_back(batch);
+  frame_batches_in_flight.Set(_async->in_flight.size());
+  lock.unlock();
+
+  bot_completion_t done = [state = _async, batch]() {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    CHECK(!batch->done) << "batch " << batch->first_frame << " is already complete";
+    batch->done = true;
+    state->completed.notify_all();
+  };
+  _descriptor.async_img_callback(*this, gsl::span<image_frame>(_frames), std::move(done));
+  frame_batch_processed_total.Increment();
+  // converted pixels stay valid until completion.
+  batch->converted_frames = std::move(_converted_frames);
+  _converted_frames.clear();
+
+  collect_async_batches(result);
+}
+
+void bot_instance::collect_async_batches(bot_outputs& output) {
+  std::vector<std::shared_ptr<async_batch>> completed;
+  {
+    std::lock_guard<std::mutex> lock(_async->mutex);
+    while (!_async->in_flight.empty() && _async->in_flight.front()->done) {
+      completed.push_back(std::move(_async->in_flight.front()));
+      _async->in_flight.pop_front();
+    }
+    frame_batches_in_flight.Set(_async->in_flight.size());
+  }
+
+  for (auto& batch : completed) {
+    output.insert(output.end(), std::make_move_iterator(batch->packets.begin()),
+                  std::make_move_iterator(batch->packets.end()));
+    for (auto& msg : batch->messages) {
+      _message_buffer.push_back(std::move(msg));
+    }
+    flush_message_buffer(output);
+  }
+}
+
+void bot_instance::finish_async_batches() {
+  std::unique_lock<std::mutex> lock(_async->mutex);
+  _async->completed.wait(lock, [this]() {
+    return std::all_of(_async->in_flight.begin(), _async->in_flight.end(),
+                       [](const std::shared_ptr<async_batch>& b) { return b->done; });
+  });
+  for (auto& batch : _async->in_flight) {
+    for (auto& msg : batch->messages) {
+      _message_buffer.push_back(std::move(msg));
+    }
+  }
+  _async->in_flight.clear();
+  frame_batches_in_flight.Set(0);
+}
+
 void bot_instance::set_current_frame_id(const frame_id& id) { _current_frame_id = id; }
 
-std::vector<image_frame> bot_instance::extract_frames(
-    const std::list<bot_output>& packets) {
-  std::vector<image_frame> result;
+void bot_instance::set_crop_region(std::shared_ptr<crop_region> crop) {
+  _crop = std::move(crop);
+}
+
+void bot_instance::set_batcher(std::shared_ptr<cross_stream_batcher> batcher) {
+  _batcher = std::move(batcher);
+}
+
+void bot_instance::set_profiler(std::shared_ptr<profiler> p) { _profiler = std::move(p); }
+
+void bot_instance::set_crop(const image_region& region) {
+  if (!_crop) {
+    LOG(ERROR) << "frames of this bot can't be cropped";
+    return;
+  }
+  LOG(INFO) << "setting crop region " << region;
+  _crop->set(region);
+}
+
+double bot_instance::processing_seconds_total() {
+  return static_cast<double>(processing_micros_total.load()) / 1e6;
+}
+
+image_pixel_format bot_instance::decoder_pixel_format() const {
+  // most decoders produce YUV420P, so scaling is the only work done for it.
+  return _descriptor.lazy_conversion ? image_pixel_format::YUV420P
+                                     : _descriptor.pixel_format;
+}
+
+void bot_instance::convert_frame(image_frame& frame) {
+  if (decoder_pixel_format() == _descriptor.pixel_format
+      || _descriptor.motion_vectors_only || frame.plane_data[0] != nullptr) {
+    return;
+  }
+
+  // frames selected by the bot may be copies, so they are found by id.
+  auto it = std::find_if(_frames.begin(), _frames.end(),
+                         [&frame](const image_frame& f) { return f.id == frame.id; });
+  CHECK(it != _frames.end()) << "frame " << frame.id << " is not in the current batch";
+
+  if (it->plane_data[0] == nullptr) {
+    const owned_image_frame& decoded = *_decoded_frames[it - _frames.begin()];
+    std::shared_ptr<AVFrame> converted = _frame_pool->get();
+    CHECK(converted) << "failed to allocate converted frame";
+
+    if (_sws_context) {
+      const uint8_t* data[max_image_planes];
+      int strides[max_image_planes];
+      for (int i = 0; i < max_image_planes; ++i) {
+        data[i] = decoded.plane_data[i].data();
+        strides[i] = static_cast<int>(decoded.plane_strides[i]);
+      }
+      ::sws_scale(_sws_context.get(), data, strides, 0, decoded.height, converted->data,
+                  converted->linesize);
+    } else {
+      avutils::swizzle_packed_rgb(avutils::to_av_pixel_format(decoded.pixel_format),
+                                  decoded.plane_data[0].data(),
+                                  static_cast<int>(decoded.plane_strides[0]),
+                                  static_cast<AVPixelFormat>(converted->format),
+                                  converted->data[0], converted->linesize[0],
+                                  decoded.width, decoded.height);
+    }
+
+    for (int i = 0; i < max_image_planes; ++i) {
+      it->plane_data[i] = converted->linesize[i] > 0 ? converted->data[i] : nullptr;
+    }
+    _converted_frames.push_back(std::move(converted));
+  }
+  std::copy(it->plane_data, it->plane_data + max_image_planes, frame.plane_data);
+}
+
+void bot_instance::extract_frames(const bot_outputs& packets) {
+  _frames.clear();
+  _decoded_frames.clear();
+  _converted_frames.clear();
+  // frames of motion vectors have no pixels to convert.
+  const bool lazy = decoder_pixel_format() != _descriptor.pixel_format
+                    && !_descriptor.motion_vectors_only;
+  const image_metadata previous = _image_metadata;
 
   for (const auto& p : packets) {
     auto* frame = boost::get<owned_image_frame>(&p);
@@ -147,80 +357,149 @@ std::vector<image_frame> bot_instance::extract_frames(
 
     if (frame->width != _image_metadata.width
         || frame->height != _image_metadata.height) {
-      CHECK(_image_metadata.width == 0)
-          << "frame resolution has been changed: " << _image_metadata.width << "x"
-          << _image_metadata.height << " -> " << frame->width << "x" << frame->height;
+      if (_image_metadata.width != 0) {
+        LOG(INFO) << "frame resolution has been changed: " << _image_metadata.width
+                  << "x" << _image_metadata.height << " -> " << frame->width << "x"
+                  << frame->height;
+      }
+      if (!_frames.empty()) {
+        // bot gets single metadata per batch, so frames of previous size are dropped.
+        LOG(INFO) << "dropping " << _frames.size() << " frames of previous resolution";
+        metrics.frames_dropped_total.Increment(_frames.size());
+        _frames.clear();
+        _decoded_frames.clear();
+      }
       _image_metadata.width = frame->width;
       _image_metadata.height = frame->height;
-      std::copy(frame->plane_strides, frame->plane_strides + max_image_planes,
-                _image_metadata.plane_strides);
+      if (lazy) {
+        const AVPixelFormat format =
+            avutils::to_av_pixel_format(_descriptor.pixel_format);
+        _frame_pool =
+            std::make_unique<avutils::frame_pool>(frame->width, frame->height, format);
+        const AVPixelFormat decoded_format =
+            avutils::to_av_pixel_format(frame->pixel_format);
+        // packed RGB frames are swizzled, without swscale.
+        _sws_context.reset();
+        if (!avutils::can_swizzle_packed_rgb(decoded_format, format)) {
+          _sws_context = avutils::sws_context(frame->width, frame->height, decoded_format,
+                                              frame->width, frame->height, format);
+          CHECK(_sws_context) << "failed to create converter for " << frame->width << "x"
+                              << frame->height << " frames";
+        }
+        std::copy(_frame_pool->linesize(), _frame_pool->linesize() + max_image_planes,
+                  _image_metadata.plane_strides);
+      } else {
+        std::copy(frame->plane_strides, frame->plane_strides + max_image_planes,
+                  _image_metadata.plane_strides);
+      }
     }
 
     image_frame bframe;
     bframe.id = frame->id;
+    bframe.on_device = frame->on_device;
+    if (frame->motion_vectors) {
+      bframe.motion_vectors = frame->motion_vectors->data();
+      bframe.motion_vectors_count = frame->motion_vectors->size();
+    }
     for (int i = 0; i < max_image_planes; ++i) {
-      if (frame->plane_data[i].empty()) {
+      if (lazy || frame->plane_data[i].empty()) {
         bframe.plane_data[i] = nullptr;
       } else {
-        bframe.plane_data[i] = (const uint8_t*)frame->plane_data[i].data();
+        bframe.plane_data[i] = frame->plane_data[i].data();
+      }
+    }
+    _frames.push_back(std::move(bframe));
+    if (lazy) {
+      _decoded_frames.push_back(frame);
+    }
+  }
+
+  // camera reconfiguration, a new codec or a crop, bot learns of it before the batch.
+  if (previous.width != 0
+      && (previous.width != _image_metadata.width
+          || previous.height != _image_metadata.height)) {
+    frame_resolution_changes_total.Increment();
+    if (_descriptor.ctrl_callback) {
+      nlohmann::json response = _descriptor.ctrl_callback(
+          *this, build_resolution_command(previous, _image_metadata));
+      if (!response.is_null()) {
+        queue_message(bot_message_kind::DEBUG, std::move(response), frame_id{0, 0});
       }
     }
-    result.push_back(std::move(bframe));
   }
-  return result;
 }
 
-std::list<bot_output> bot_instance::operator()(std::queue<owned_image_packet>& pp) {
+void bot_instance::flush_message_buffer(bot_outputs& output) {
+  prepare_message_buffer_for_downstream();
+
+  output.reserve(output.size() + _message_buffer.size());
+  for (auto& msg : _message_buffer) {
+    output.emplace_back(std::move(msg));
+  }
+  _message_buffer.clear();
+}
+
+bot_outputs bot_instance::operator()(std::queue<owned_image_packet>& pp) {
   stopwatch<> s;
-  std::list<bot_output> result;
+  bot_outputs result;
 
   frame_size.Observe(pp.size());
 
+  result.reserve(pp.size());
   while (!pp.empty()) {
-    result.emplace_back(pp.front());
+    result.emplace_back(std::move(pp.front()));
     pp.pop();
   }
 
-  std::vector<image_frame> bframes = extract_frames(result);
+  extract_frames(result);
 
-  if (!bframes.empty()) {
-    LOG(1) << "process " << bframes.size() << " frames " << _image_metadata.width << "x"
+  if (_async && !_batcher) {
+    process_async(result);
+  } else if (!_frames.empty()) {
+    LOG(1) << "process " << _frames.size() << " frames " << _image_metadata.width << "x"
            << _image_metadata.height;
 
-    _descriptor.img_callback(*this, gsl::span<image_frame>(bframes));
+    if (_batcher) {
+      _batcher->process(*this, gsl::span<image_frame>(_frames));
+    } else {
+      _descriptor.img_callback(*this, gsl::span<image_frame>(_frames));
+    }
     frame_batch_processed_total.Increment();
 
-    prepare_message_buffer_for_downstream();
-
-    std::copy(_message_buffer.begin(), _message_buffer.end(), std::back_inserter(result));
-    _message_buffer.clear();
+    flush_message_buffer(result);
   }
 
   processing_times_millis.Observe(s.millis());
+  processing_micros_total += s.micros();
   return result;
 }
 
-std::list<bot_output> bot_instance::operator()(nlohmann::json& msg) {
+bot_outputs bot_instance::operator()(nlohmann::json& msg) {
   messages_received.Add({{"message_type", "control"}}).Increment();
   if (msg.is_array()) {
-    std::list<bot_output> aggregated;
+    bot_outputs aggregated;
     for (auto& el : msg) {
-      aggregated.splice(aggregated.end(), this->operator()(el));
+      bot_outputs outputs = this->operator()(el);
+      aggregated.insert(aggregated.end(), std::make_move_iterator(outputs.begin()),
+                        std::make_move_iterator(outputs.end()));
     }
     return aggregated;
   }
 
   if (!msg.is_object() || msg.find("to") == msg.end()) {
     LOG(ERROR) << "unsupported kind of message: " << msg;
-    return std::list<bot_output>{};
+    return bot_outputs{};
   }
 
   if (_bot_id.empty() || msg["to"] != _bot_id) {
     LOG(INFO) << "message for a different bot: " << msg;
-    return std::list<bot_output>{};
+    return bot_outputs{};
   }
 
-  nlohmann::json response = _descriptor.ctrl_callback(*this, msg);
+  auto action = msg.find("action");
+  nlohmann::json response = action != msg.end() && *action == "profile"
+                                ? profile(msg)
+                                : _descriptor.ctrl_callback(*this, msg);
 
   if (!response.is_null()) {
     CHECK(response.is_object()) << "bot response is not an object: " << response;
@@ -232,13 +511,21 @@ std::list<bot_output> bot_instance::operator()(nlohmann::json& msg) {
     queue_message(bot_message_kind::CONTROL, std::move(response), frame_id{0, 0});
   }
 
-  prepare_message_buffer_for_downstream();
-
-  std::list<bot_output> result{_message_buffer.begin(), _message_buffer.end()};
-  _message_buffer.clear();
+  bot_outputs result;
+  flush_message_buffer(result);
   return result;
 }
 
+nlohmann::json bot_instance::profile(const nlohmann::json& msg) {
+  LOG(INFO) << "profile request: " << msg;
+  nlohmann::json response =
+      _profiler ? _profiler->start(msg.find("body") != msg.end() ? msg["body"]
+                                                                 : nlohmann::json{})
+                : nlohmann::json{{"error", "profiling is not enabled"}};
+  response["action"] = "profile";
+  return response;
+}
+
 void bot_instance::prepare_message_buffer_for_downstream() {
   for (auto&& msg : _message_buffer) {
     switch (msg.kind) {
@@ -283,5 +570,23 @@ void bot_instance::configure(const nlohmann::json& config) {
   }
 }
 
+nlohmann::json bot_instance::checkpoint_state() {
+  if (!_descriptor.ctrl_callback) {
+    return nullptr;
+  }
+  return _descriptor.ctrl_callback(*this, nlohmann::json{{"action", "checkpoint"}});
+}
+
+void bot_instance::restore_state(const nlohmann::json& state) {
+  CHECK(_descriptor.ctrl_callback) << "Bot control handler was not provided but "
+                                      "checkpoint has bot state";
+  LOG(INFO) << "restoring bot state";
+  nlohmann::json response =
+      _descriptor.ctrl_callback(*this, build_restore_command(state));
+  if (!response.is_null()) {
+    queue_message(bot_message_kind::DEBUG, std::move(response), frame_id{0, 0});
+  }
+}
+
 }  // namespace video
 }  // namespace satori
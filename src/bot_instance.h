@@ -1,15 +1,23 @@
 #pragma once
 
+#include <condition_variable>
+#include <deque>
 #include <json.hpp>
-#include <list>
+#include <memory>
+#include <mutex>
 #include <queue>
+#include <vector>
 
+#include "avutils.h"
 #include "bot_environment.h"
+#include "cross_stream_batcher.h"
 #include "data.h"
+#include "profiler.h"
 #include "satorivideo/multiframe/bot.h"
 #include "satorivideo/video_bot.h"
 #include "streams/streams.h"
 #include "variant_utils.h"
+#include "video_streams.h"
 
 namespace satori {
 namespace video {
@@ -20,32 +28,96 @@ using bot_input = boost::variant<owned_image_packets, nlohmann::json>;
 using bot_output =
     variantutils::extend_variant<owned_image_packet, struct bot_message>::type;
 
-class bot_instance : public bot_context, boost::static_visitor<std::list<bot_output>> {
+// Batches are handed over by moving packets, buffers are reused between batches.
+using bot_outputs = std::vector<bot_output>;
+
+class bot_instance : public bot_context, boost::static_visitor<bot_outputs> {
  public:
   bot_instance(const std::string& bot_id, execution_mode execmode,
                const multiframe_bot_descriptor& descriptor);
   ~bot_instance() = default;
 
   void configure(const nlohmann::json& config);
+  // bot state for batch checkpoints is what bot returns for "checkpoint" command,
+  // it is handed back with "restore" command when the run is resumed.
+  nlohmann::json checkpoint_state();
+  void restore_state(const nlohmann::json& state);
 
   streams::op<bot_input, bot_output> run_bot();
 
   void queue_message(bot_message_kind kind, nlohmann::json&& message, const frame_id& id);
   void set_current_frame_id(const frame_id& id);
 
-  std::list<bot_output> operator()(std::queue<owned_image_packet>& pp);
-  std::list<bot_output> operator()(nlohmann::json& msg);
+  // region shared with decoder, frames may change size when it is set.
+  void set_crop_region(std::shared_ptr<crop_region> crop);
+  void set_crop(const image_region& region);
+
+  // frames are processed by batch_callback along with frames of other instances.
+  void set_batcher(std::shared_ptr<cross_stream_batcher> batcher);
+
+  // control messages with "profile" action start it instead of reaching the bot.
+  void set_profiler(std::shared_ptr<profiler> p);
+
+  // with lazy conversion bot receives frames in decoder_pixel_format.
+  image_pixel_format decoder_pixel_format() const;
+  void convert_frame(image_frame& frame);
+
+  bot_outputs operator()(std::queue<owned_image_packet>& pp);
+  bot_outputs operator()(nlohmann::json& msg);
+
+  // time spent processing frame batches by all instances of the process.
+  static double processing_seconds_total();
 
  private:
+  // batch passed to async_img_callback, outputs wait for it and previous batches.
+  struct async_batch {
+    // keeps frames of the batch alive.
+    bot_outputs packets;
+    std::vector<std::shared_ptr<AVFrame>> converted_frames;
+    std::vector<struct bot_message> messages;
+    frame_id first_frame;
+    frame_id last_frame;
+    bool done{false};
+  };
+
+  // shared with completion handlers, which may outlive instance.
+  struct async_state {
+    std::mutex mutex;
+    std::condition_variable completed;
+    std::deque<std::shared_ptr<async_batch>> in_flight;
+  };
+
+  void process_async(bot_outputs& result);
+  // moves outputs of completed batches, which have no incomplete batches before them.
+  void collect_async_batches(bot_outputs& output);
+  // waits for all batches in flight, their frames are not emitted.
+  void finish_async_batches();
+  // has to be called with async mutex locked.
+  async_batch* find_async_batch(const frame_id& id);
   void prepare_message_buffer_for_downstream();
-  std::vector<image_frame> extract_frames(const std::list<bot_output>& packets);
+  // moves buffered messages to the end of output.
+  void flush_message_buffer(bot_outputs& output);
+  void extract_frames(const bot_outputs& packets);
+  nlohmann::json profile(const nlohmann::json& msg);
 
   const std::string _bot_id;
   const multiframe_bot_descriptor _descriptor;
 
-  std::list<struct bot_message> _message_buffer;
+  std::vector<struct bot_message> _message_buffer;
+  std::vector<image_frame> _frames;
   image_metadata _image_metadata{0, 0};
   frame_id _current_frame_id;
+  std::shared_ptr<crop_region> _crop;
+  std::shared_ptr<cross_stream_batcher> _batcher;
+  std::shared_ptr<profiler> _profiler;
+  // set only for bots with async_img_callback.
+  std::shared_ptr<async_state> _async;
+
+  // decoded frames of the current batch and their conversions, for lazy conversion.
+  std::vector<const owned_image_frame*> _decoded_frames;
+  std::vector<std::shared_ptr<AVFrame>> _converted_frames;
+  std::shared_ptr<SwsContext> _sws_context;
+  std::unique_ptr<avutils::frame_pool> _frame_pool;
 };
 
 }  // namespace video
@@ -20,8 +20,28 @@ bot_instance_builder &bot_instance_builder::set_bot_id(std::string id) {
   return *this;
 }
 
+bot_instance_builder &bot_instance_builder::set_crop_region(
+    std::shared_ptr<crop_region> crop) {
+  _crop = std::move(crop);
+  return *this;
+}
+
+bot_instance_builder &bot_instance_builder::set_batcher(
+    std::shared_ptr<cross_stream_batcher> batcher) {
+  _batcher = std::move(batcher);
+  return *this;
+}
+
+bot_instance_builder &bot_instance_builder::set_profiler(std::shared_ptr<profiler> p) {
+  _profiler = std::move(p);
+  return *this;
+}
+
 std::unique_ptr<bot_instance> bot_instance_builder::build() {
   auto instance = std::make_unique<bot_instance>(_id, _mode, _descriptor);
+  instance->set_crop_region(_crop);
+  instance->set_batcher(_batcher);
+  instance->set_profiler(_profiler);
   instance->configure(_config);
   return instance;
 }
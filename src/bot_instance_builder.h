@@ -13,6 +13,9 @@ struct bot_instance_builder {
   bot_instance_builder &set_execution_mode(execution_mode mode);
   bot_instance_builder &set_config(const nlohmann::json &config);
   bot_instance_builder &set_bot_id(std::string id);
+  bot_instance_builder &set_crop_region(std::shared_ptr<crop_region> crop);
+  bot_instance_builder &set_batcher(std::shared_ptr<cross_stream_batcher> batcher);
+  bot_instance_builder &set_profiler(std::shared_ptr<profiler> p);
   std::unique_ptr<bot_instance> build();
 
  private:
@@ -20,6 +23,9 @@ struct bot_instance_builder {
   execution_mode _mode;
   std::string _id;
   nlohmann::json _config;
+  std::shared_ptr<crop_region> _crop;
+  std::shared_ptr<cross_stream_batcher> _batcher;
+  std::shared_ptr<profiler> _profiler;
 };
 }  // namespace video
 }  // namespace satori
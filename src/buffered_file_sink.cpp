@@ -0,0 +1,132 @@
+#include "buffered_file_sink.h"
+
+#include "cbor_json.h"
+#include "logging.h"
+#include "threadutils.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+// writer thread is woken up early when that many messages are queued.
+constexpr size_t wake_up_messages = 256;
+
+}  // namespace
+
+buffered_file_sink::buffered_file_sink(const std::string &filename,
+                                       const buffered_file_sink_options &options)
+    : _filename(filename),
+      _options(options),
+      _out(filename,
+           std::ios::binary | (options.append ? std::ios::app : std::ios::trunc)) {
+  CHECK(_out.good()) << "failed to create " << _filename;
+  if (_options.append) {
+    _out.seekp(0, std::ios::end);
+    _file_size = static_cast<uint64_t>(_out.tellp());
+  }
+  _buffer.reserve(_options.buffer_size);
+  _thread = std::thread([this]() { run(); });
+}
+
+buffered_file_sink::~buffered_file_sink() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _messages_added.notify_one();
+  _thread.join();
+}
+
+uint64_t buffered_file_sink::flush() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  const uint64_t request = ++_flush_requests;
+  _messages_added.notify_one();
+  _flushed.wait(lock, [this, request]() { return _flushes_done >= request; });
+  return _file_size;
+}
+
+void buffered_file_sink::on_next(nlohmann::json &&t) {
+  if (!_options.binary) {
+    decode_encoded_maps(t);
+  }
+  std::lock_guard<std::mutex> lock(_mutex);
+  _messages.push_back(std::move(t));
+  if (_messages.size() == wake_up_messages) {
+    _messages_added.notify_one();
+  }
+}
+
+void buffered_file_sink::on_error(std::error_condition ec) {
+  LOG(ERROR) << "ERROR: " << ec.message();
+  flush();
+}
+
+void buffered_file_sink::on_complete() { flush(); }
+
+void buffered_file_sink::run() {
+  threadutils::set_current_thread_name("file_sink");
+  auto last_write = std::chrono::steady_clock::now();
+  std::deque<nlohmann::json> messages;
+
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (true) {
+    _messages_added.wait_until(lock, last_write + _options.flush_interval, [this]() {
+      return _stopping || _flush_requests > _flushes_done
+             || _messages.size() >= wake_up_messages;
+    });
+    const bool stopping = _stopping;
+    const uint64_t flush_requests = _flush_requests;
+    messages.swap(_messages);
+    lock.unlock();
+
+    for (const nlohmann::json &message : messages) {
+      serialize(message);
+    }
+    messages.clear();
+
+    const auto now = std::chrono::steady_clock::now();
+    uint64_t written = 0;
+    if (stopping || flush_requests > _flushes_done
+        || _buffer.size() >= _options.buffer_size
+        || now >= last_write + _options.flush_interval) {
+      _out.write(_buffer.data(), _buffer.size());
+      _out.flush();
+      if (!_out.good()) {
+        LOG(ERROR) << "failed to write " << _filename;
+      }
+      written = _buffer.size();
+      _buffer.clear();
+      last_write = now;
+    }
+
+    lock.lock();
+    _file_size += written;
+    if (flush_requests > _flushes_done) {
+      _flushes_done = flush_requests;
+      _flushed.notify_all();
+    }
+    if (stopping && _messages.empty()) {
+      return;
+    }
+  }
+}
+
+void buffered_file_sink::serialize(const nlohmann::json &message) {
+  if (!_options.binary) {
+    _buffer += message.dump();
+    _buffer += '\n';
+    return;
+  }
+
+  _message_buffer.clear();
+  json_to_cbor(message, _message_buffer);
+  const auto size = static_cast<uint32_t>(_message_buffer.size());
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    _buffer += static_cast<char>((size >> shift) & 0xff);
+  }
+  _buffer += _message_buffer;
+}
+
+}  // namespace video
+}  // namespace satori
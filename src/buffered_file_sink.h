@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <json.hpp>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "streams/streams.h"
+
+namespace satori {
+namespace video {
+
+struct buffered_file_sink_options {
+  // messages are written as CBOR, each one prefixed by 4 bytes of its size in
+  // network byte order, instead of json lines.
+  bool binary{false};
+  // how often written messages reach the file at least.
+  std::chrono::milliseconds flush_interval{1000};
+  // messages are written to the file in chunks of at least that size.
+  size_t buffer_size{1024 * 1024};
+  // messages are appended to existing file instead of replacing it.
+  bool append{false};
+};
+
+// Writes messages to a file on a thread of its own, so producers never wait for
+// serialization or disk. Messages are queued without limit.
+class buffered_file_sink : public streams::observer<nlohmann::json> {
+ public:
+  explicit buffered_file_sink(
+      const std::string &filename,
+      const buffered_file_sink_options &options = buffered_file_sink_options{});
+
+  // writes all queued messages.
+  ~buffered_file_sink() override;
+
+  buffered_file_sink(const buffered_file_sink &) = delete;
+  buffered_file_sink &operator=(const buffered_file_sink &) = delete;
+
+  // waits until messages queued so far are in the file, returns its size.
+  uint64_t flush();
+
+  void on_next(nlohmann::json &&t) override;
+  void on_error(std::error_condition ec) override;
+  void on_complete() override;
+
+ private:
+  void run();
+  void serialize(const nlohmann::json &message);
+
+  const std::string _filename;
+  const buffered_file_sink_options _options;
+  std::ofstream _out;
+  // used by writer thread only.
+  std::string _buffer;
+  std::string _message_buffer;
+
+  std::mutex _mutex;
+  std::condition_variable _messages_added;
+  std::condition_variable _flushed;
+  std::deque<nlohmann::json> _messages;
+  uint64_t _flush_requests{0};
+  uint64_t _flushes_done{0};
+  uint64_t _file_size{0};
+  bool _stopping{false};
+  std::thread _thread;
+};
+
+}  // namespace video
+}  // namespace satori
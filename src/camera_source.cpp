@@ -11,9 +11,14 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
+#if defined(__linux__)
+#include <linux/videodev2.h>
+#endif
+
 #include "avutils.h"
 #include "satorivideo/base.h"
 #include "streams/asio_streams.h"
+#include "v4l2_capture.h"
 #include "video_error.h"
 #include "video_streams.h"
 
@@ -76,6 +81,12 @@ class camera_source_impl {
       return;
     }
 
+    // previous images may still reference their buffers, so take a fresh one.
+    _converted_av_frame = _frame_pool->get();
+    if (!_converted_av_frame) {
+      observer.on_error(video_error::FRAME_GENERATION_ERROR);
+      return;
+    }
     avutils::sws_scale(_sws_context, _decoded_av_frame, _converted_av_frame);
 
     owned_image_frame frame = avutils::to_image_frame(*_converted_av_frame);
@@ -164,8 +175,9 @@ class camera_source_impl {
     LOG(1) << "Allocating frames...";
     _decoded_av_frame = avutils::av_frame(
         _decoder_context->width, _decoder_context->height, 1, _decoder_context->pix_fmt);
-    _converted_av_frame = avutils::av_frame(
-        _decoder_context->width, _decoder_context->height, 1, AV_PIX_FMT_BGR24);
+    _frame_pool = std::make_unique<avutils::frame_pool>(
+        _decoder_context->width, _decoder_context->height, AV_PIX_FMT_BGR24);
+    _converted_av_frame = _frame_pool->get();
     if (!_decoded_av_frame || !_converted_av_frame) {
       LOG(ERROR) << "Failed to allocate frames";
       return -1;
@@ -201,6 +213,7 @@ class camera_source_impl {
   std::shared_ptr<AVCodecContext> _decoder_context{nullptr};
   AVPacket _av_packet{nullptr};
   std::shared_ptr<AVFrame> _decoded_av_frame{nullptr};
+  std::unique_ptr<avutils::frame_pool> _frame_pool;
   std::shared_ptr<AVFrame> _converted_av_frame{nullptr};  // for pixel format conversion
   std::shared_ptr<SwsContext> _sws_context{nullptr};
 
@@ -209,11 +222,235 @@ class camera_source_impl {
   bool _metadata_sent{false};
 };
 
+#if defined(__linux__)
+namespace {
+
+// capture is considered broken after that long without frames.
+constexpr std::chrono::milliseconds capture_timeout{2000};
+
+std::unique_ptr<v4l2_capture> open_capture(const std::string &device,
+                                           const std::string &resolution, uint8_t fps,
+                                           const std::vector<uint32_t> &fourccs) {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  if (resolution != "original") {
+    const auto size = avutils::parse_image_size(resolution);
+    CHECK(size.ok()) << "bad resolution: " << resolution;
+    width = static_cast<uint32_t>(size.get().width);
+    height = static_cast<uint32_t>(size.get().height);
+  }
+  return v4l2_capture::open(device, fourccs, width, height, fps);
+}
+
+// Image frames point into capture buffers for formats bots can take as they are,
+// other formats are converted to BGR.
+class v4l2_camera_source_impl {
+ public:
+  v4l2_camera_source_impl(const std::string &device, const std::string &resolution,
+                          uint8_t fps)
+      : _device(device), _resolution(resolution), _fps(fps) {}
+
+  void generate_one(streams::observer<owned_image_packet> &observer) {
+    if (!_capture) {
+      _capture = open_capture(_device, _resolution, _fps,
+                              {V4L2_PIX_FMT_BGR24, V4L2_PIX_FMT_YUV420,
+                               V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUYV});
+      if (!_capture) {
+        observer.on_error(video_error::STREAM_INITIALIZATION_ERROR);
+        return;
+      }
+      observer.on_next(owned_image_metadata{});
+      return;
+    }
+
+    auto captured = _capture->next(capture_timeout);
+    if (!captured.ok()) {
+      observer.on_error(captured.error_condition());
+      return;
+    }
+
+    boost::optional<owned_image_frame> image = to_image(captured.get());
+    if (!image) {
+      observer.on_error(video_error::FRAME_GENERATION_ERROR);
+      return;
+    }
+    _frames++;
+    image->id = {_frames, _frames};
+    image->timestamp = std::chrono::system_clock::now();
+    observer.on_next(std::move(*image));
+  }
+
+ private:
+  boost::optional<owned_image_frame> to_image(const v4l2_capture::frame &f) {
+    const uint32_t width = _capture->width();
+    const uint32_t height = _capture->height();
+    const uint32_t stride = _capture->bytes_per_line();
+
+    owned_image_frame image;
+    image.width = static_cast<uint16_t>(width);
+    image.height = static_cast<uint16_t>(height);
+    for (uint8_t i = 0; i < max_image_planes; i++) {
+      image.plane_strides[i] = 0;
+    }
+    const size_t luma_size = size_t{stride} * height;
+    switch (_capture->fourcc()) {
+      case V4L2_PIX_FMT_BGR24:
+        image.pixel_format = image_pixel_format::BGR;
+        image.plane_strides[0] = stride;
+        image.plane_data[0] = image_plane{f.owner, f.data, luma_size};
+        return image;
+      case V4L2_PIX_FMT_NV12:
+        image.pixel_format = image_pixel_format::NV12;
+        image.plane_strides[0] = stride;
+        image.plane_data[0] = image_plane{f.owner, f.data, luma_size};
+        image.plane_strides[1] = stride;
+        image.plane_data[1] =
+            image_plane{f.owner, f.data + luma_size, size_t{stride} * (height / 2)};
+        return image;
+      case V4L2_PIX_FMT_YUV420: {
+        const size_t chroma_size = size_t{stride / 2} * (height / 2);
+        image.pixel_format = image_pixel_format::YUV420P;
+        image.plane_strides[0] = stride;
+        image.plane_data[0] = image_plane{f.owner, f.data, luma_size};
+        image.plane_strides[1] = stride / 2;
+        image.plane_data[1] = image_plane{f.owner, f.data + luma_size, chroma_size};
+        image.plane_strides[2] = stride / 2;
+        image.plane_data[2] =
+            image_plane{f.owner, f.data + luma_size + chroma_size, chroma_size};
+        return image;
+      }
+      default:
+        return convert(f);
+    }
+  }
+
+  boost::optional<owned_image_frame> convert(const v4l2_capture::frame &f) {
+    const int width = static_cast<int>(_capture->width());
+    const int height = static_cast<int>(_capture->height());
+    if (!_sws_context) {
+      _sws_context = avutils::sws_context(width, height, AV_PIX_FMT_YUYV422, width,
+                                          height, AV_PIX_FMT_BGR24);
+      _frame_pool =
+          std::make_unique<avutils::frame_pool>(width, height, AV_PIX_FMT_BGR24);
+      if (!_sws_context) {
+        return boost::none;
+      }
+    }
+
+    // conversion reads capture buffer in place.
+    std::shared_ptr<AVFrame> captured = avutils::av_frame();
+    if (!captured) {
+      return boost::none;
+    }
+    captured->format = AV_PIX_FMT_YUYV422;
+    captured->width = width;
+    captured->height = height;
+    captured->data[0] = const_cast<uint8_t *>(f.data);
+    captured->linesize[0] = static_cast<int>(_capture->bytes_per_line());
+
+    std::shared_ptr<AVFrame> converted = _frame_pool->get();
+    if (!converted) {
+      return boost::none;
+    }
+    avutils::sws_scale(_sws_context, captured, converted);
+    return avutils::to_image_frame(*converted);
+  }
+
+  const std::string _device;
+  const std::string _resolution;
+  const uint8_t _fps;
+  std::unique_ptr<v4l2_capture> _capture;
+  std::shared_ptr<SwsContext> _sws_context;
+  std::unique_ptr<avutils::frame_pool> _frame_pool;
+  int64_t _frames{0};
+};
+
+// UVC drivers don't always flag key frames, so look for parameter sets or IDR slices.
+bool is_h264_key_frame(const uint8_t *data, size_t size) {
+  for (size_t i = 0; i + 3 < size; i++) {
+    if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+      continue;
+    }
+    const uint8_t nal_type = data[i + 3] & 0x1f;
+    if (nal_type == 5 || nal_type == 7) {
+      return true;
+    }
+    if (nal_type == 1) {
+      return false;
+    }
+    i += 3;
+  }
+  return false;
+}
+
+// Packets of cameras encoding on their own, emitted from capture buffers as they are.
+class v4l2_encoded_source_impl {
+ public:
+  v4l2_encoded_source_impl(const std::string &device, const std::string &resolution,
+                           uint8_t fps)
+      : _device(device), _resolution(resolution), _fps(fps) {}
+
+  void generate_one(streams::observer<encoded_packet> &observer) {
+    if (!_capture) {
+      _capture = open_capture(_device, _resolution, _fps,
+                              {V4L2_PIX_FMT_H264, V4L2_PIX_FMT_MJPEG, V4L2_PIX_FMT_JPEG});
+      if (!_capture) {
+        observer.on_error(video_error::STREAM_INITIALIZATION_ERROR);
+        return;
+      }
+      encoded_metadata metadata;
+      metadata.codec_name = _capture->fourcc() == V4L2_PIX_FMT_H264 ? "h264" : "mjpeg";
+      observer.on_next(std::move(metadata));
+      return;
+    }
+
+    auto captured = _capture->next(capture_timeout);
+    if (!captured.ok()) {
+      observer.on_error(captured.error_condition());
+      return;
+    }
+    const v4l2_capture::frame &f = captured.get();
+
+    encoded_frame frame;
+    frame.data = shared_bytes{f.owner, reinterpret_cast<const char *>(f.data), f.size};
+    _frames++;
+    frame.id = {_frames, _frames};
+    frame.timestamp = std::chrono::system_clock::now();
+    frame.creation_time = frame.timestamp;
+    frame.key_frame = _capture->fourcc() != V4L2_PIX_FMT_H264 || f.key_frame
+                      || is_h264_key_frame(f.data, f.size);
+    observer.on_next(std::move(frame));
+  }
+
+ private:
+  const std::string _device;
+  const std::string _resolution;
+  const uint8_t _fps;
+  std::unique_ptr<v4l2_capture> _capture;
+  int64_t _frames{0};
+};
+
+}  // namespace
+#endif
+
 streams::publisher<owned_image_packet> camera_source(boost::asio::io_service &io,
                                                      const std::string &resolution,
-                                                     uint8_t fps) {
+                                                     uint8_t fps,
+                                                     const std::string &device) {
   avutils::init();
 
+#if defined(__linux__)
+  return streams::generators<owned_image_packet>::stateful(
+             [device, resolution, fps]() {
+               return new v4l2_camera_source_impl(device, resolution, fps);
+             },
+             [](v4l2_camera_source_impl *impl,
+                streams::observer<owned_image_packet> &sink) {
+               impl->generate_one(sink);
+             })
+         >> streams::asio::interval<owned_image_packet>(
+                io, std::chrono::milliseconds(1000 / fps));
+#else
   CHECK_LE(fps, system_framerate());
   return streams::generators<owned_image_packet>::stateful(
              [resolution]() { return new camera_source_impl(resolution); },
@@ -222,6 +459,28 @@ streams::publisher<owned_image_packet> camera_source(boost::asio::io_service &io
              })
          >> streams::asio::interval<owned_image_packet>(
                 io, std::chrono::milliseconds(1000 / fps));
+#endif
+}
+
+streams::publisher<encoded_packet> camera_encoded_source(boost::asio::io_service &io,
+                                                         const std::string &resolution,
+                                                         uint8_t fps,
+                                                         const std::string &device) {
+#if defined(__linux__)
+  return streams::generators<encoded_packet>::stateful(
+             [device, resolution, fps]() {
+               return new v4l2_encoded_source_impl(device, resolution, fps);
+             },
+             [](v4l2_encoded_source_impl *impl, streams::observer<encoded_packet> &sink) {
+               impl->generate_one(sink);
+             })
+         >> streams::asio::interval<encoded_packet>(
+                io, std::chrono::milliseconds(1000 / fps))
+         >> repeat_metadata();
+#else
+  ABORT() << "camera passthrough is only supported on Linux, " << device << " "
+          << resolution << "@" << static_cast<int>(fps) << " can't be read";
+#endif
 }
 
 }  // namespace video
@@ -6,102 +6,109 @@
 #include <string>
 
 #include "base64.h"
+#include "cbor_writer.h"
 #include "logging.h"
 
 namespace satori {
 namespace video {
 
 namespace {
-cbor_item_t *json_to_cbor_item(const nlohmann::json &document) {
-  if (document.is_string()) {
-    return cbor_build_string(document.get<std::string>().c_str());
-  }
-  if (document.is_number_integer()) {
-    cbor_item_t *result{nullptr};
-
-    const auto i = document.get<int64_t>();
-    if (i >= 0) {
-      if (i <= std::numeric_limits<uint8_t>::max()) {
-        result = cbor_build_uint8(static_cast<uint8_t>(i));
-      } else if (i <= std::numeric_limits<uint16_t>::max()) {
-        result = cbor_build_uint16(static_cast<uint16_t>(i));
-      } else if (i <= std::numeric_limits<uint32_t>::max()) {
-        result = cbor_build_uint32(static_cast<uint32_t>(i));
-      } else {
-        result = cbor_build_uint64(static_cast<uint64_t>(i));
-      }
-    } else {
-      const auto p = -1 - i;  // https://tools.ietf.org/html/rfc7049#section-2.1
-      if (p <= std::numeric_limits<uint8_t>::max()) {
-        result = cbor_build_negint8(static_cast<uint8_t>(p));
-      } else if (p <= std::numeric_limits<uint16_t>::max()) {
-        result = cbor_build_negint16(static_cast<uint16_t>(p));
-      } else if (p <= std::numeric_limits<uint32_t>::max()) {
-        result = cbor_build_negint32(static_cast<uint32_t>(p));
-      } else {
-        result = cbor_build_negint64(static_cast<uint64_t>(p));
-      }
-    }
 
-    CHECK_NOTNULL(result);
-    return result;
-  }
-  if (document.is_number_unsigned()) {
-    cbor_item_t *result{nullptr};
-
-    const auto i = document.get<uint64_t>();
-    if (i <= std::numeric_limits<uint8_t>::max()) {
-      result = cbor_build_uint8(static_cast<uint8_t>(i));
-    } else if (i <= std::numeric_limits<uint16_t>::max()) {
-      result = cbor_build_uint16(static_cast<uint16_t>(i));
-    } else if (i <= std::numeric_limits<uint32_t>::max()) {
-      result = cbor_build_uint32(static_cast<uint32_t>(i));
-    } else {
-      result = cbor_build_uint64(static_cast<uint64_t>(i));
-    }
+constexpr size_t binary_key_suffix_size = sizeof(binary_key_suffix) - 1;
 
-    CHECK_NOTNULL(result);
-    return result;
-  }
-  if (document.is_number_float()) {
-    return cbor_build_float8(document.get<double>());
-  }
-  if (document.is_array()) {
-    cbor_item_t *message = cbor_new_definite_array(document.size());
-    for (auto &el : document) {
-      cbor_item_t *item = json_to_cbor_item(el);
-      CHECK(cbor_array_push(message, cbor_move(item)));
+bool is_binary_key(const std::string &key) {
+  return key.size() > binary_key_suffix_size
+         && key.compare(key.size() - binary_key_suffix_size, binary_key_suffix_size,
+                        binary_key_suffix)
+                == 0;
+}
+
+// exact size of decoded base64 data, which might be unpadded.
+size_t base64_decoded_size(const std::string &data) {
+  size_t size = data.size() / 4 * 3;
+  if (data.size() % 4 == 0) {
+    if (!data.empty() && data[data.size() - 1] == '=') {
+      size--;
     }
-    return message;
-  }
-  if (document.is_object()) {
-    cbor_item_t *message = cbor_new_definite_map(document.size());
-    for (auto it = document.begin(); it != document.end(); ++it) {
-      cbor_item_t *key = json_to_cbor_item(it.key());
-      cbor_item_t *value{nullptr};
-      // TODO: remove when https://github.com/nlohmann/json/pull/862 is merged
-      if ((it.key() == "b" || it.key() == "codecData") && it.value().is_string()) {
-        const auto decoded = base64::decode(it.value());
-        CHECK(decoded.ok()) << "bad data: " << document;
-        value = cbor_build_bytestring(reinterpret_cast<cbor_data>(decoded.get().data()),
-                                      decoded.get().size());
-      } else {
-        value = json_to_cbor_item(it.value());
-      }
-      CHECK_NOTNULL(value);
-      CHECK(cbor_map_add(message, {cbor_move(key), cbor_move(value)}));
+    if (data.size() > 1 && data[data.size() - 2] == '=') {
+      size--;
     }
-    return message;
+  } else if (data.size() % 4 > 1) {
+    size += data.size() % 4 - 1;
   }
-  if (document.is_boolean()) {
-    return cbor_build_bool(document.get<bool>());
-  }
-  if (document.is_null()) {
-    return cbor_new_null();
+  return size;
+}
+
+// encoded map field is replaced by entries of the map.
+size_t object_size(const nlohmann::json &document) {
+  auto it = document.find(encoded_map_key);
+  if (it == document.end()) {
+    return document.size();
   }
+  CHECK(it->is_string()) << "encoded map is not a string";
+  const auto head = cbor_map_head(it->get_ref<const std::string &>());
+  CHECK(head) << "encoded map is not a definite length CBOR map";
+  return document.size() - 1 + head->first;
+}
 
-  ABORT() << "Unsupported message field: " << document;
-  return cbor_build_bool(false);
+void write_json(const nlohmann::json &document, cbor_writer &writer) {
+  switch (document.type()) {
+    case nlohmann::json::value_t::string:
+      writer.write_text(document.get_ref<const std::string &>());
+      return;
+    case nlohmann::json::value_t::number_integer:
+      writer.write_int(document.get<int64_t>());
+      return;
+    case nlohmann::json::value_t::number_unsigned:
+      writer.write_uint(document.get<uint64_t>());
+      return;
+    case nlohmann::json::value_t::number_float:
+      writer.write_double(document.get<double>());
+      return;
+    case nlohmann::json::value_t::array:
+      writer.write_array(document.size());
+      for (const auto &el : document) {
+        write_json(el, writer);
+      }
+      return;
+    case nlohmann::json::value_t::object:
+      writer.write_map(object_size(document));
+      for (auto it = document.begin(); it != document.end(); ++it) {
+        const std::string &name = it.key();
+        const auto &value = it.value();
+        if (name == encoded_map_key) {
+          const auto &data = value.get_ref<const std::string &>();
+          const size_t head_size = cbor_map_head(data)->second;
+          writer.write_raw(data.data() + head_size, data.size() - head_size);
+        } else if (is_binary_key(name) && value.is_string()) {
+          writer.write_text(name.data(), name.size() - binary_key_suffix_size);
+          const auto &bytes = value.get_ref<const std::string &>();
+          writer.write_bytes(bytes.data(), bytes.size());
+          // TODO: remove when https://github.com/nlohmann/json/pull/862 is merged
+        } else if ((name == "b" || name == "codecData") && value.is_string()) {
+          writer.write_text(name);
+          // decoded right into the output buffer.
+          const auto &base64_data = value.get_ref<const std::string &>();
+          const size_t size = base64_decoded_size(base64_data);
+          char *out = writer.write_bytes_placeholder(size);
+          const auto decoded =
+              base64::decode(base64_data.data(), base64_data.size(), out);
+          CHECK(decoded.ok() && decoded.get() == size) << "bad data: " << document;
+        } else {
+          writer.write_text(name);
+          write_json(value, writer);
+        }
+      }
+      return;
+    case nlohmann::json::value_t::boolean:
+      writer.write_bool(document.get<bool>());
+      return;
+    case nlohmann::json::value_t::null:
+      writer.write_null();
+      return;
+    default:
+      ABORT() << "Unsupported message field: " << document;
+  }
 }
 
 nlohmann::json cbor_item_to_json(const cbor_item_t *item) {
@@ -217,28 +224,77 @@ nlohmann::json cbor_item_to_json(const cbor_item_t *item) {
 
 }  // namespace
 
-std::string json_to_cbor(const nlohmann::json &document) {
-  cbor_item_t *item = json_to_cbor_item(document);
-  CHECK_EQ(1, cbor_refcount(item));
+boost::optional<std::pair<uint64_t, size_t>> cbor_map_head(const std::string &data) {
+  constexpr uint8_t major_map = 5;
+  if (data.empty() || static_cast<uint8_t>(data[0]) >> 5 != major_map) {
+    return boost::none;
+  }
 
-  auto decref_item = gsl::finally([&item]() { cbor_decref(&item); });
+  const uint8_t info = static_cast<uint8_t>(data[0]) & 0x1f;
+  if (info < 24) {
+    return std::make_pair(static_cast<uint64_t>(info), size_t{1});
+  }
+  if (info > 27) {
+    // indefinite length or reserved.
+    return boost::none;
+  }
+  const size_t size = size_t{1} << (info - 24);
+  if (data.size() < size + 1) {
+    return boost::none;
+  }
+  uint64_t entries = 0;
+  for (size_t i = 1; i <= size; i++) {
+    entries = (entries << 8) | static_cast<uint8_t>(data[i]);
+  }
+  return std::make_pair(entries, size + 1);
+}
 
-  uint8_t *buffer{nullptr};
-  size_t buffer_size_ignore{0};
-  const size_t buffer_length = cbor_serialize_alloc(item, &buffer, &buffer_size_ignore);
+void decode_encoded_maps(nlohmann::json &document) {
+  if (document.is_array()) {
+    for (auto &el : document) {
+      decode_encoded_maps(el);
+    }
+    return;
+  }
+  if (!document.is_object()) {
+    return;
+  }
 
-  CHECK_NOTNULL(buffer) << "failed to allocate cbor buffer: null";
-  CHECK_GT(buffer_length, 0) << "failed to allocate cbor buffer: " << buffer_length;
+  auto it = document.find(encoded_map_key);
+  if (it != document.end()) {
+    auto decoded = cbor_to_json(it->get_ref<const std::string &>());
+    CHECK(decoded.ok() && decoded.get().is_object())
+        << "encoded map can't be decoded: " << decoded.error_message();
+    document.erase(it);
+    const nlohmann::json &fields = decoded.get();
+    for (auto field = fields.begin(); field != fields.end(); ++field) {
+      document[field.key()] = field.value();
+    }
+  }
+  for (auto &field : document) {
+    decode_encoded_maps(field);
+  }
+}
 
-  auto free_buffer = gsl::finally([buffer]() { free(buffer); });
+std::string json_to_cbor(const nlohmann::json &document) {
+  std::string result;
+  json_to_cbor(document, result);
+  return result;
+}
 
-  return std::string{buffer, buffer + buffer_length};
+void json_to_cbor(const nlohmann::json &document, std::string &out) {
+  cbor_writer writer{out};
+  write_json(document, writer);
 }
 
 streams::error_or<nlohmann::json> cbor_to_json(const std::string &data) {
+  return cbor_to_json(data.data(), data.size());
+}
+
+streams::error_or<nlohmann::json> cbor_to_json(const char *data, size_t size) {
   cbor_load_result load_result{0};
   cbor_item_t *loaded_item =
-      cbor_load(reinterpret_cast<cbor_data>(data.data()), data.size(), &load_result);
+      cbor_load(reinterpret_cast<cbor_data>(data), size, &load_result);
 
   if (load_result.error.code == CBOR_ERR_NONE) {
     CHECK_NOTNULL(loaded_item);
@@ -1,16 +1,39 @@
 #pragma once
 
+#include <boost/optional.hpp>
 #include <json.hpp>
 #include <string>
+#include <utility>
 
 #include "streams/error_or.h"
 
 namespace satori {
 namespace video {
 
+// nlohmann::json has no binary values, so raw bytes are kept as strings in object
+// fields with this key suffix. json_to_cbor writes them as byte strings under the
+// key without the suffix.
+constexpr char binary_key_suffix[] = "@bytes";
+
+// Object field with this key keeps a string with CBOR encoded map. json_to_cbor
+// writes entries of that map into the object as they are, without decoding them.
+constexpr char encoded_map_key[] = "@cbor";
+
+// number of entries of a definite length CBOR map and size of its head, or none if
+// data doesn't start with such a map.
+boost::optional<std::pair<uint64_t, size_t>> cbor_map_head(const std::string& data);
+
+// replaces encoded map fields by decoded entries, in document and in its nested
+// objects and arrays, for outputs which are not CBOR.
+void decode_encoded_maps(nlohmann::json& document);
+
 std::string json_to_cbor(const nlohmann::json& document);
 
+// appends CBOR representation of document to out, which can be reused.
+void json_to_cbor(const nlohmann::json& document, std::string& out);
+
 streams::error_or<nlohmann::json> cbor_to_json(const std::string& data);
+streams::error_or<nlohmann::json> cbor_to_json(const char* data, size_t size);
 
 }  // namespace video
 }  // namespace satori
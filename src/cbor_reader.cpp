@@ -0,0 +1,219 @@
+#include "cbor_reader.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace satori {
+namespace video {
+
+namespace {
+
+// https://tools.ietf.org/html/rfc7049#section-2.1
+constexpr uint8_t major_uint = 0;
+constexpr uint8_t major_negint = 1;
+constexpr uint8_t major_bytes = 2;
+constexpr uint8_t major_text = 3;
+constexpr uint8_t major_array = 4;
+constexpr uint8_t major_map = 5;
+constexpr uint8_t major_tag = 6;
+constexpr uint8_t major_simple = 7;
+
+constexpr uint64_t simple_false = 20;
+constexpr uint64_t simple_true = 21;
+
+// https://tools.ietf.org/html/rfc7049#appendix-D
+double decode_half(uint16_t half) {
+  const int exp = (half >> 10) & 0x1f;
+  const int mant = half & 0x3ff;
+  double value;
+  if (exp == 0) {
+    value = std::ldexp(mant, -24);
+  } else if (exp != 31) {
+    value = std::ldexp(mant + 1024, exp - 25);
+  } else {
+    value = mant == 0 ? std::numeric_limits<double>::infinity()
+                      : std::numeric_limits<double>::quiet_NaN();
+  }
+  return (half & 0x8000) != 0 ? -value : value;
+}
+
+}  // namespace
+
+cbor_reader::cbor_reader(const char *data, size_t size)
+    : _pos(data), _end(data + size) {}
+
+bool cbor_reader::read_head(uint8_t &major_type, uint64_t &argument) {
+  if (_pos == _end) {
+    return false;
+  }
+  const auto initial = static_cast<uint8_t>(*_pos++);
+  major_type = initial >> 5;
+  const uint8_t info = initial & 0x1f;
+
+  if (info < 24) {
+    argument = info;
+    return true;
+  }
+  if (info > 27) {
+    // indefinite lengths and reserved values.
+    return false;
+  }
+
+  const size_t size = size_t{1} << (info - 24);
+  if (static_cast<size_t>(_end - _pos) < size) {
+    return false;
+  }
+  argument = 0;
+  for (size_t i = 0; i < size; i++) {
+    argument = (argument << 8) | static_cast<uint8_t>(*_pos++);
+  }
+  return true;
+}
+
+bool cbor_reader::read_map(uint64_t &size) {
+  uint8_t major_type;
+  return read_head(major_type, size) && major_type == major_map;
+}
+
+bool cbor_reader::read_array(uint64_t &size) {
+  uint8_t major_type;
+  return read_head(major_type, size) && major_type == major_array;
+}
+
+bool cbor_reader::read_string(uint8_t major_type, boost::string_ref &value) {
+  uint8_t type;
+  uint64_t size;
+  if (!read_head(type, size) || type != major_type
+      || size > static_cast<uint64_t>(_end - _pos)) {
+    return false;
+  }
+  value = boost::string_ref{_pos, static_cast<size_t>(size)};
+  _pos += size;
+  return true;
+}
+
+bool cbor_reader::read_text(boost::string_ref &value) {
+  return read_string(major_text, value);
+}
+
+bool cbor_reader::read_bytes(boost::string_ref &value) {
+  return read_string(major_bytes, value);
+}
+
+bool cbor_reader::read_int(int64_t &value) {
+  uint8_t major_type;
+  uint64_t argument;
+  if (!read_head(major_type, argument)
+      || argument > static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
+    return false;
+  }
+  if (major_type == major_uint) {
+    value = static_cast<int64_t>(argument);
+    return true;
+  }
+  if (major_type == major_negint) {
+    value = -1 - static_cast<int64_t>(argument);
+    return true;
+  }
+  return false;
+}
+
+bool cbor_reader::read_number(double &value) {
+  if (_pos == _end) {
+    return false;
+  }
+  const auto initial = static_cast<uint8_t>(*_pos);
+  if ((initial >> 5) != major_simple) {
+    int64_t i;
+    if (!read_int(i)) {
+      return false;
+    }
+    value = static_cast<double>(i);
+    return true;
+  }
+
+  uint8_t major_type;
+  uint64_t argument;
+  if (!read_head(major_type, argument)) {
+    return false;
+  }
+  switch (initial & 0x1f) {
+    case 25:
+      value = decode_half(static_cast<uint16_t>(argument));
+      return true;
+    case 26: {
+      const auto bits = static_cast<uint32_t>(argument);
+      float f;
+      std::memcpy(&f, &bits, sizeof(f));
+      value = f;
+      return true;
+    }
+    case 27:
+      std::memcpy(&value, &argument, sizeof(value));
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool cbor_reader::read_bool(bool &value) {
+  uint8_t major_type;
+  uint64_t argument;
+  if (!read_head(major_type, argument) || major_type != major_simple
+      || (argument != simple_false && argument != simple_true)) {
+    return false;
+  }
+  value = argument == simple_true;
+  return true;
+}
+
+bool cbor_reader::next_is_bytes() const {
+  return _pos != _end && (static_cast<uint8_t>(*_pos) >> 5) == major_bytes;
+}
+
+bool cbor_reader::skip() {
+  uint64_t pending = 1;
+  while (pending > 0) {
+    pending--;
+
+    uint8_t major_type;
+    uint64_t argument;
+    if (!read_head(major_type, argument)) {
+      return false;
+    }
+
+    // every item takes at least a byte, so sizes are bounded by remaining data.
+    const auto remaining = static_cast<uint64_t>(_end - _pos);
+    switch (major_type) {
+      case major_bytes:
+      case major_text:
+        if (argument > remaining) {
+          return false;
+        }
+        _pos += argument;
+        break;
+      case major_array:
+        if (argument > remaining) {
+          return false;
+        }
+        pending += argument;
+        break;
+      case major_map:
+        if (argument > remaining / 2) {
+          return false;
+        }
+        pending += 2 * argument;
+        break;
+      case major_tag:
+        pending++;
+        break;
+      default:
+        break;
+    }
+  }
+  return true;
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,52 @@
+// Pull parser for CBOR data.
+#pragma once
+
+#include <boost/utility/string_ref.hpp>
+#include <cstddef>
+#include <cstdint>
+
+namespace satori {
+namespace video {
+
+// Reads CBOR items one by one right from the buffer, without building item trees.
+// Only definite length items are supported. All read methods return false if next
+// item has unexpected type or data is malformed, reader position is unspecified
+// after that.
+class cbor_reader {
+ public:
+  cbor_reader(const char *data, size_t size);
+
+  bool at_end() const { return _pos == _end; }
+
+  // current position within the buffer.
+  const char *position() const { return _pos; }
+
+  // reads map or array header, entries follow it.
+  bool read_map(uint64_t &size);
+  bool read_array(uint64_t &size);
+
+  // returned references point into the buffer.
+  bool read_text(boost::string_ref &value);
+  bool read_bytes(boost::string_ref &value);
+
+  bool read_int(int64_t &value);
+  // integer or floating point number.
+  bool read_number(double &value);
+  bool read_bool(bool &value);
+
+  // true if next item is a byte string.
+  bool next_is_bytes() const;
+
+  // skips next item including all nested items.
+  bool skip();
+
+ private:
+  bool read_head(uint8_t &major_type, uint64_t &argument);
+  bool read_string(uint8_t major_type, boost::string_ref &value);
+
+  const char *_pos;
+  const char *_end;
+};
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,108 @@
+#include "cbor_writer.h"
+
+#include <cstring>
+#include <limits>
+
+namespace satori {
+namespace video {
+
+namespace {
+
+// https://tools.ietf.org/html/rfc7049#section-2.1
+constexpr uint8_t major_uint = 0;
+constexpr uint8_t major_negint = 1;
+constexpr uint8_t major_bytes = 2;
+constexpr uint8_t major_text = 3;
+constexpr uint8_t major_array = 4;
+constexpr uint8_t major_map = 5;
+constexpr uint8_t major_simple = 7;
+
+constexpr uint8_t simple_false = 20;
+constexpr uint8_t simple_true = 21;
+constexpr uint8_t simple_null = 22;
+constexpr uint8_t simple_double = 27;
+
+}  // namespace
+
+void cbor_writer::write_head(uint8_t major_type, uint64_t argument) {
+  const auto type = static_cast<char>(major_type << 5);
+  if (argument < 24) {
+    _out.push_back(static_cast<char>(type | argument));
+    return;
+  }
+
+  uint8_t info;
+  size_t size;
+  if (argument <= std::numeric_limits<uint8_t>::max()) {
+    info = 24;
+    size = 1;
+  } else if (argument <= std::numeric_limits<uint16_t>::max()) {
+    info = 25;
+    size = 2;
+  } else if (argument <= std::numeric_limits<uint32_t>::max()) {
+    info = 26;
+    size = 4;
+  } else {
+    info = 27;
+    size = 8;
+  }
+
+  char head[9];
+  head[0] = static_cast<char>(type | info);
+  for (size_t i = 0; i < size; i++) {
+    head[size - i] = static_cast<char>(argument >> (8 * i));
+  }
+  _out.append(head, size + 1);
+}
+
+void cbor_writer::write_map(uint64_t size) { write_head(major_map, size); }
+
+void cbor_writer::write_array(uint64_t size) { write_head(major_array, size); }
+
+void cbor_writer::write_text(const char *data, size_t size) {
+  write_head(major_text, size);
+  _out.append(data, size);
+}
+
+void cbor_writer::write_bytes(const char *data, size_t size) {
+  write_head(major_bytes, size);
+  _out.append(data, size);
+}
+
+char *cbor_writer::write_bytes_placeholder(size_t size) {
+  write_head(major_bytes, size);
+  const size_t offset = _out.size();
+  _out.resize(offset + size);
+  return &_out[offset];
+}
+
+void cbor_writer::write_uint(uint64_t value) { write_head(major_uint, value); }
+
+void cbor_writer::write_int(int64_t value) {
+  if (value >= 0) {
+    write_head(major_uint, static_cast<uint64_t>(value));
+  } else {
+    write_head(major_negint, static_cast<uint64_t>(-1 - value));
+  }
+}
+
+void cbor_writer::write_double(double value) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+
+  char item[9];
+  item[0] = static_cast<char>(major_simple << 5 | simple_double);
+  for (size_t i = 0; i < 8; i++) {
+    item[8 - i] = static_cast<char>(bits >> (8 * i));
+  }
+  _out.append(item, sizeof(item));
+}
+
+void cbor_writer::write_bool(bool value) {
+  write_head(major_simple, value ? simple_true : simple_false);
+}
+
+void cbor_writer::write_null() { write_head(major_simple, simple_null); }
+
+}  // namespace video
+}  // namespace satori
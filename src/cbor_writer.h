@@ -0,0 +1,45 @@
+// Streaming CBOR serializer.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace satori {
+namespace video {
+
+// Appends CBOR items right to the output buffer, without building item trees.
+// Maps and arrays are definite length, so their size has to be written first and
+// followed by entries.
+class cbor_writer {
+ public:
+  explicit cbor_writer(std::string &out) : _out(out) {}
+
+  void write_map(uint64_t size);
+  void write_array(uint64_t size);
+
+  void write_text(const char *data, size_t size);
+  void write_text(const std::string &value) { write_text(value.data(), value.size()); }
+  void write_bytes(const char *data, size_t size);
+
+  // reserves space for byte string of given size and returns pointer to it, caller
+  // should fill it in.
+  char *write_bytes_placeholder(size_t size);
+
+  void write_uint(uint64_t value);
+  void write_int(int64_t value);
+  void write_double(double value);
+  void write_bool(bool value);
+  void write_null();
+
+  // appends already encoded items.
+  void write_raw(const char *data, size_t size) { _out.append(data, size); }
+
+ private:
+  void write_head(uint8_t major_type, uint64_t argument);
+
+  std::string &_out;
+};
+
+}  // namespace video
+}  // namespace satori
@@ -2,7 +2,10 @@
 
 #include "avutils.h"
 #include "cli_streams.h"
+#include "logging.h"
+#include "shm_transport.h"
 #include "streams/asio_streams.h"
+#include "streams/profile.h"
 #include "streams/threaded_worker.h"
 #include "video_metrics.h"
 #include "video_streams.h"
@@ -14,11 +17,78 @@ namespace cli_streams {
 
 namespace {
 
+// pool jobs are not validated up front, so unknown names are not fatal.
+encoder_profile encoder_profile_or_default(const std::string &name) {
+  const boost::optional<encoder_profile> profile = encoder_profile_by_name(name);
+  if (!profile) {
+    LOG(ERROR) << "unknown encoder profile " << name << ", using default";
+    return encoder_profile{};
+  }
+  return *profile;
+}
+
+h264_encoder_profile h264_encoder_profile_or_default(
+    const boost::optional<std::string> &name, const boost::optional<std::string> &encoder,
+    const boost::optional<std::string> &hw_device) {
+  boost::optional<h264_encoder_profile> profile =
+      name ? h264_encoder_profile_by_name(*name) : boost::none;
+  if (!profile) {
+    profile = h264_encoder_profile{};
+  }
+  if (encoder) {
+    profile->encoder = *encoder;
+  }
+  profile->hw_device = hw_device;
+  return *profile;
+}
+
+boost::optional<std::string> optional_string(const po::variables_map &vm,
+                                             const std::string &key) {
+  return vm.count(key) > 0 ? vm[key].as<std::string>() : boost::optional<std::string>{};
+}
+
+boost::optional<std::string> optional_string(const nlohmann::json &config,
+                                             const std::string &key) {
+  return config.find(key) != config.end() ? config[key].get<std::string>()
+                                          : boost::optional<std::string>{};
+}
+
+// like encoder profiles, unknown policies of jobs fall back to default.
+streams::overflow_policy overflow_policy_or_default(const std::string &name) {
+  const boost::optional<streams::overflow_policy> policy =
+      streams::parse_overflow_policy(name);
+  if (!policy) {
+    LOG(ERROR) << "unknown queue overflow policy " << name << ", using "
+               << streams::to_string(default_packets_overflow_policy);
+    return default_packets_overflow_policy;
+  }
+  return *policy;
+}
+
 po::options_description rtm_options() {
   po::options_description online("Satori RTM connection options");
   online.add_options()("endpoint", po::value<std::string>(), "app endpoint");
   online.add_options()("appkey", po::value<std::string>(), "app key");
   online.add_options()("port", po::value<std::string>()->default_value("443"), "port");
+  online.add_options()(
+      "rtm-max-write-batch-bytes",
+      po::value<size_t>()->default_value(rtm::default_max_write_batch_bytes),
+      "max bytes sent to RTM in a single socket write");
+  online.add_options()(
+      "rtm-compression",
+      "offers permessage-deflate compression to RTM, video frames channels go through "
+      "separate uncompressed connections");
+  online.add_options()("rtm-connections", po::value<size_t>()->default_value(1),
+                       "number of RTM connections, channels are spread over them");
+  online.add_options()(
+      "rtm-io-threads", po::value<size_t>()->default_value(0),
+      "number of threads driving RTM connections, 0 keeps a single connection on the "
+      "main loop thread and gives every connection its own thread otherwise");
+  online.add_options()(
+      "shm-transport", po::value<std::string>(),
+      "(name) exchanges channel messages with processes of the same host through "
+      "shared memory rings prefixed with the name instead of RTM, --endpoint and "
+      "--appkey are not needed");
 
   return online;
 }
@@ -29,12 +99,32 @@ po::options_description file_input_options(bool enable_batch_mode) {
                              "input mp4,mkv,webm");
   file_sources.add_options()("input-replay-file", po::value<std::string>(), "input txt");
   file_sources.add_options()("loop", "Is file looped");
+  file_sources.add_options()(
+      "start-time", po::value<double>(),
+      "(seconds) read input video file from that time, decoding starts from the "
+      "closest key frame before it");
+  file_sources.add_options()("end-time", po::value<double>(),
+                             "(seconds) stop reading input video file at that time");
+  file_sources.add_options()(
+      "start-frame", po::value<int64_t>(),
+      "(number) read input video file from that frame, frames are numbered from 1");
+  file_sources.add_options()("end-frame", po::value<int64_t>(),
+                             "(number) last frame of input video file to read");
+  file_sources.add_options()(
+      "replay-speed", po::value<double>(),
+      "(factor) plays input replay file that many times faster than it was recorded, "
+      "0 plays it as fast as it is consumed");
 
   if (enable_batch_mode) {
     file_sources.add_options()(
         "batch",
         "turns on batch analysis mode, where analysis of a single video frame might take "
         "longer than frame duration (file source only).");
+    file_sources.add_options()(
+        "read-ahead-bytes",
+        po::value<size_t>()->default_value(default_read_ahead_bytes),
+        "(bytes) batch mode demuxes input file on a separate thread up to that many "
+        "bytes ahead of decoder, 0 turns it off");
   }
 
   return file_sources;
@@ -43,6 +133,14 @@ po::options_description file_input_options(bool enable_batch_mode) {
 po::options_description camera_input_options() {
   po::options_description camera_options("Camera options");
   camera_options.add_options()("input-camera", "Is camera used as a source");
+  camera_options.add_options()(
+      "input-camera-device",
+      po::value<std::string>()->default_value(default_camera_device),
+      "camera device to capture from on Linux");
+  camera_options.add_options()(
+      "input-camera-passthrough",
+      "take H.264 or MJPEG encoded by camera as it is instead of encoding captured "
+      "frames, Linux only");
 
   return camera_options;
 }
@@ -60,18 +158,68 @@ po::options_description generic_input_options() {
   options.add_options()("keep-proportions", po::value<bool>()->default_value(true),
                         "(bool) tells if original video stream resolution's proportion "
                         "should remain unchanged");
+  options.add_options()("input-hw-device", po::value<std::string>(),
+                        "(vaapi|cuda|videotoolbox|...) decode input video on hardware "
+                        "device, falls back to software if device is not available");
+  options.add_options()("decoder-threads", po::value<int>(),
+                        "(number) input video decoder threads, by default picked by "
+                        "number of cores");
+  options.add_options()("decoder-threading", po::value<std::string>(),
+                        "(frame|slice) frame threading delays each frame by a frame per "
+                        "thread, by default used in batch mode only");
+  options.add_options()("input-crop", po::value<std::string>(),
+                        "(<width>x<height>+<x>+<y>) region of input video to decode, "
+                        "cropped before scaling to input resolution");
+  options.add_options()("input-metrics-sampling", po::value<int>(),
+                        "(number) video health metrics of input channel or replay file "
+                        "observe 1 in that many frames, with jitter estimated by "
+                        "integer math when it is above 1");
+  options.add_options()("input-key-frames-only",
+                        "only key frames of input channel or replay file are "
+                        "reassembled and decoded, chunks of other frames are dropped");
+  options.add_options()(
+      "input-max-queued-packets",
+      po::value<size_t>()->default_value(default_max_queued_packets),
+      "(number) encoded packets of input channel or file queued in front of decoder "
+      "before input-queue-overflow-policy applies");
+  options.add_options()(
+      "input-queue-overflow-policy",
+      po::value<std::string>()->default_value(
+          streams::to_string(default_packets_overflow_policy)),
+      "(drop-newest|drop-oldest|drop-until-key-frame|coalesce-to-latest) what is "
+      "dropped when input-max-queued-packets is reached");
 
   return options;
 }
 
-po::options_description generic_output_options() {
+po::options_description profiling_options() {
+  po::options_description options("Profiling options");
+  options.add_options()("profile-stages",
+                        "exports stream_stage_* metrics of decode, bot and encode "
+                        "stages: elements, credit and time spent in on_next");
+
+  return options;
+}
+
+po::options_description generic_output_options(const std::string &default_resolution) {
   po::options_description options("Generic output options");
   options.add_options()("output-resolution",
-                        po::value<std::string>()->default_value("320x240"),
+                        po::value<std::string>()->default_value(default_resolution),
                         "(<width>x<height>|original) resolution of output video stream");
   options.add_options()("keep-proportions", po::value<bool>()->default_value(true),
                         "(bool) tells if output video stream resolution's proportion "
                         "should remain unchanged");
+  options.add_options()("encoder-profile", po::value<std::string>(),
+                        "(good|realtime) VP9 encoder settings for transcoded "
+                        "streams, realtime has the lowest latency and CPU usage");
+  options.add_options()("output-codec", po::value<std::string>()->default_value("vp9"),
+                        "(vp9|h264) codec of transcoded streams, h264 is cheaper "
+                        "to encode");
+  options.add_options()("output-encoder", po::value<std::string>(),
+                        "FFmpeg h264 encoder, e.g. h264_nvenc, h264_vaapi, h264_qsv "
+                        "or hevc_nvenc for HEVC");
+  options.add_options()("output-hw-device", po::value<std::string>(),
+                        "hardware device type to encode on, e.g. vaapi or qsv");
 
   return options;
 }
@@ -81,6 +229,13 @@ po::options_description url_input_options() {
   url_options.add_options()("input-url", po::value<std::string>(), "Input video URL");
   url_options.add_options()("input-url-parameters", po::value<std::string>(),
                             "Input video URL parameters");
+  url_options.add_options()(
+      "input-url-fast-start",
+      "probe input video URL briefly without buffering and reuse stream parameters "
+      "on reconnects");
+  url_options.add_options()("input-url-shared-demuxer",
+                            "demux input video URL on threads shared by all inputs of "
+                            "the process instead of a thread of its own");
   return url_options;
 }
 
@@ -98,6 +253,20 @@ po::options_description file_output_options() {
   output_file_options.add_options()("segment-duration", po::value<int>(),
                                     "(seconds) Nearly fixed duration of output video "
                                     "file segments");
+  output_file_options.add_options()(
+      "output-format", po::value<std::string>()->default_value("video"),
+      "(video|fmp4|replay) Format of output file: video container picked by file "
+      "extension, fragmented MP4 readable while it is written, or indexed binary "
+      "replay file of the encoded stream");
+  output_file_options.add_options()(
+      "storage-config", po::value<std::string>(),
+      "(json file) credentials of object storage, needed when --output-video-file is "
+      "s3://<bucket>/<key> or gs://<bucket>/<key> url");
+  output_file_options.add_options()(
+      "output-io", po::value<std::string>()->default_value("buffered"),
+      "(buffered|uring|direct) How local video files are written: write() through "
+      "page cache, io_uring in large buffers, or io_uring with O_DIRECT bypassing "
+      "page cache");
 
   return output_file_options;
 }
@@ -111,6 +280,9 @@ po::options_description pool_mode_options() {
       "on RTM channel and waits for job assignments from pool manager");
   pool_mode_options.add_options()("pool-job-type", po::value<std::string>(),
                                   "Pool job type supported by program");
+  pool_mode_options.add_options()(
+      "pool-capacity", po::value<size_t>(),
+      "(number) how many jobs program runs at the same time in pool mode");
 
   return pool_mode_options;
 }
@@ -141,11 +313,12 @@ bool check_pool_mode_args_provided(const po::variables_map &vm) {
 }
 
 bool validate_rtm_args(const cli_options &opts, const po::variables_map &vm) {
-  if (vm.count("endpoint") == 0) {
+  const bool shm = vm.count("shm-transport") > 0;
+  if (!shm && vm.count("endpoint") == 0) {
     std::cerr << "Missing --endpoint argument\n";
     return false;
   }
-  if (vm.count("appkey") == 0) {
+  if (!shm && vm.count("appkey") == 0) {
     std::cerr << "Missing --appkey argument\n";
     return false;
   }
@@ -171,6 +344,48 @@ bool validate_input_file_args(const po::variables_map &vm) {
     return false;
   }
 
+  if (vm.count("replay-speed") > 0) {
+    if (vm.count("input-replay-file") == 0) {
+      std::cerr << "--replay-speed is only supported for --input-replay-file\n";
+      return false;
+    }
+    if (vm["replay-speed"].as<double>() < 0) {
+      std::cerr << "--replay-speed should not be negative\n";
+      return false;
+    }
+  }
+
+  if (vm.count("input-metrics-sampling") > 0
+      && vm["input-metrics-sampling"].as<int>() < 1) {
+    std::cerr << "--input-metrics-sampling should be positive\n";
+    return false;
+  }
+
+  const bool has_time_range = vm.count("start-time") > 0 || vm.count("end-time") > 0;
+  const bool has_frame_range = vm.count("start-frame") > 0 || vm.count("end-frame") > 0;
+  if ((has_time_range || has_frame_range) && vm.count("input-video-file") == 0) {
+    std::cerr << "start and end of input are only supported for --input-video-file\n";
+    return false;
+  }
+  if (has_time_range && has_frame_range) {
+    std::cerr << "time and frame ranges of input are mutually exclusive\n";
+    return false;
+  }
+  if (vm.count("start-time") > 0 && vm.count("end-time") > 0
+      && vm["start-time"].as<double>() >= vm["end-time"].as<double>()) {
+    std::cerr << "--start-time should be less than --end-time\n";
+    return false;
+  }
+  if (vm.count("start-frame") > 0 && vm["start-frame"].as<int64_t>() < 1) {
+    std::cerr << "frames are numbered from 1\n";
+    return false;
+  }
+  if (vm.count("start-frame") > 0 && vm.count("end-frame") > 0
+      && vm["start-frame"].as<int64_t>() > vm["end-frame"].as<int64_t>()) {
+    std::cerr << "--start-frame should not be greater than --end-frame\n";
+    return false;
+  }
+
   return true;
 }
 
@@ -180,6 +395,10 @@ po::options_description to_boost(const cli_options &opts) {
   if (opts.enable_rtm_input) {
     auto rtm = rtm_options();
     rtm.add_options()("input-channel", po::value<std::string>(), "input channel");
+    rtm.add_options()(
+        "input-key-frame-history", po::value<int>(),
+        "(seconds) start from a key frame found in that much of input channel history "
+        "instead of waiting for the next one, should be about GOP duration");
     options.add(rtm);
   }
   if (opts.enable_file_input) {
@@ -195,7 +414,10 @@ po::options_description to_boost(const cli_options &opts) {
     options.add(generic_input_options());
   }
   if (opts.enable_generic_output_options) {
-    options.add(generic_output_options());
+    options.add(generic_output_options(opts.default_output_resolution));
+  }
+  if (opts.enable_generic_input_options || opts.enable_generic_output_options) {
+    options.add(profiling_options());
   }
   if (opts.enable_rtm_output) {
     auto rtm = rtm_options();
@@ -211,17 +433,48 @@ po::options_description to_boost(const cli_options &opts) {
 
   return options;
 }
+
+boost::optional<std::chrono::milliseconds> to_millis(boost::optional<double> seconds) {
+  if (!seconds) {
+    return boost::none;
+  }
+  return std::chrono::milliseconds{static_cast<int64_t>(*seconds * 1000)};
+}
+
+file_segment input_segment(const input_video_config &video_cfg) {
+  if (video_cfg.start_frame || video_cfg.end_frame) {
+    file_segment segment;
+    segment.first_frame = video_cfg.start_frame.value_or(1);
+    segment.last_frame = video_cfg.end_frame;
+    return segment;
+  }
+  return time_segment(video_cfg.input_video_file.get(), to_millis(video_cfg.start_time),
+                      to_millis(video_cfg.end_time));
+}
 }  // namespace
 
 // TODO: add --time-limit here
 streams::publisher<encoded_packet> encoded_publisher(
     boost::asio::io_service &io, const std::shared_ptr<rtm::client> &client,
-    const input_video_config &video_cfg) {
+    const input_video_config &video_cfg, const std::vector<int> &cpus) {
+  video_metrics_options metrics_options;
+  metrics_options.sampling = video_cfg.metrics_sampling;
+  // metrics observe all frames of the stream, skipped ones too.
+  network_decode_options decode_options;
+  decode_options.key_frames_only = video_cfg.key_frames_only;
+
   if (video_cfg.input_channel) {
-    return rtm_source(client, video_cfg.input_channel.get())
-           >> report_video_metrics(video_cfg.input_channel.get())
-           >> decode_network_stream()
-           >> streams::threaded_worker("decoder_" + video_cfg.input_channel.get())
+    rtm_source_options source_options;
+    if (video_cfg.key_frame_history) {
+      source_options.key_frame_history =
+          std::chrono::seconds{video_cfg.key_frame_history.get()};
+    }
+    return rtm_source(client, video_cfg.input_channel.get(), source_options)
+           >> report_video_metrics(video_cfg.input_channel.get(), metrics_options)
+           >> decode_network_stream(decode_options)
+           >> streams::threaded_worker("decoder_" + video_cfg.input_channel.get(),
+                                       video_cfg.max_queued_packets,
+                                       video_cfg.queue_overflow_policy, nullptr, cpus)
            >> streams::flatten();
   }
 
@@ -229,18 +482,24 @@ streams::publisher<encoded_packet> encoded_publisher(
     streams::publisher<encoded_packet> source;
     if (video_cfg.input_video_file) {
       source = file_source(io, video_cfg.input_video_file.get(), video_cfg.loop,
-                           video_cfg.batch);
+                           video_cfg.batch, video_cfg.read_ahead_bytes,
+                           input_segment(video_cfg));
     } else {
       auto replay_file = video_cfg.input_replay_file.get();
-      source = network_replay_source(io, replay_file, video_cfg.batch)
-               >> report_video_metrics(replay_file) >> decode_network_stream();
+      source = network_replay_source(io, replay_file, video_cfg.batch,
+                                     video_cfg.replay_speed)
+               >> report_video_metrics(replay_file, metrics_options)
+               >> decode_network_stream(decode_options);
     }
 
     if (video_cfg.batch) {
       return source;
     }
 
-    return std::move(source) >> streams::threaded_worker("input.encoded_buffer")
+    return std::move(source)
+           >> streams::threaded_worker("input.encoded_buffer",
+                                       video_cfg.max_queued_packets,
+                                       video_cfg.queue_overflow_policy, nullptr, cpus)
            >> streams::flatten();
   }
 
@@ -248,30 +507,97 @@ streams::publisher<encoded_packet> encoded_publisher(
     const uint8_t fps = 25;                // FIXME: hardcoded value
     const uint8_t vp9_lag_in_frames = 25;  // FIXME: hardcoded value
 
-    return camera_source(io, video_cfg.resolution, fps) >> encode_vp9(vp9_lag_in_frames);
+    if (video_cfg.camera_passthrough) {
+      return camera_encoded_source(io, video_cfg.resolution, fps,
+                                   video_cfg.camera_device);
+    }
+    return camera_source(io, video_cfg.resolution, fps, video_cfg.camera_device)
+           >> encode_vp9(vp9_lag_in_frames);
   }
 
   if (video_cfg.input_url) {
-    return url_source(*video_cfg.input_url, video_cfg.input_url_parameters
-                                                ? *video_cfg.input_url_parameters
-                                                : "");
+    url_source_options source_options;
+    if (video_cfg.input_url_parameters) {
+      source_options.parameters = *video_cfg.input_url_parameters;
+    }
+    source_options.fast_start = video_cfg.input_url_fast_start;
+    source_options.shared_demuxer = video_cfg.input_url_shared_demuxer;
+    source_options.cpus = cpus;
+    return url_source(*video_cfg.input_url, source_options);
   }
 
   ABORT() << "Unreachable code in encoded_publisher()";
 }
 
-streams::publisher<owned_image_packet> decoded_publisher(
-    boost::asio::io_service &io, const std::shared_ptr<rtm::client> &client,
-    const input_video_config &video_cfg, image_pixel_format pixel_format) {
+streams::op<encoded_packet, owned_image_packet> decode_input(
+    const input_video_config &video_cfg, image_pixel_format pixel_format,
+    decoder_options decoder_opts) {
   const auto resolution =
       (video_cfg.resolution == "original")
           ? image_size{avutils::original_image_width, avutils::original_image_height}
           : avutils::parse_image_size(video_cfg.resolution);
   CHECK(resolution.ok()) << "bad resolution: " << video_cfg.resolution;
 
+  decoder_opts.hw_device_type = video_cfg.hw_device;
+  if (video_cfg.decoder_threads) {
+    decoder_opts.thread_count = *video_cfg.decoder_threads;
+  }
+  decoder_opts.frame_threading = video_cfg.decoder_threading
+                                     ? *video_cfg.decoder_threading == "frame"
+                                     : video_cfg.batch;
+  if (video_cfg.crop && !decoder_opts.crop) {
+    const auto region = avutils::parse_image_region(*video_cfg.crop);
+    CHECK(region.ok()) << "bad crop region: " << *video_cfg.crop;
+    decoder_opts.crop = std::make_shared<crop_region>();
+    decoder_opts.crop->set(region.get());
+  }
+
+  return decode_image_frames(resolution.get(), pixel_format, video_cfg.keep_aspect_ratio,
+                             decoder_opts);
+}
+
+streams::publisher<owned_image_packet> decoded_publisher(
+    boost::asio::io_service &io, const std::shared_ptr<rtm::client> &client,
+    const input_video_config &video_cfg, image_pixel_format pixel_format,
+    decoder_options decoder_opts, std::shared_ptr<frame_tracer> tracer) {
+  streams::publisher<encoded_packet> encoded =
+      encoded_publisher(io, client, video_cfg, decoder_opts.cpus);
+  if (tracer) {
+    encoded = std::move(encoded) >> streams::map([tracer](encoded_packet &&packet) {
+                if (const encoded_frame *frame = boost::get<encoded_frame>(&packet)) {
+                  tracer->record(frame->id, frame_stage::REASSEMBLED);
+                }
+                return std::move(packet);
+              });
+  }
+  if (video_cfg.profile_stages) {
+    encoded = std::move(encoded) >> streams::profile("decode");
+  }
   streams::publisher<owned_image_packet> source =
-      encoded_publisher(io, client, video_cfg)
-      >> decode_image_frames(resolution.get(), pixel_format, video_cfg.keep_aspect_ratio);
+      std::move(encoded)
+      >> decode_input(video_cfg, pixel_format, std::move(decoder_opts));
+  if (tracer) {
+    source = std::move(source) >> streams::map([tracer](owned_image_packet &&packet) {
+               const owned_image_frame *frame = boost::get<owned_image_frame>(&packet);
+               if (frame != nullptr) {
+                 tracer->record(frame->id, frame_stage::DECODED);
+               }
+               return std::move(packet);
+             });
+  }
+
+  const int64_t first_frame =
+      video_cfg.input_video_file ? input_segment(video_cfg).first_frame : 1;
+  if (first_frame > 1) {
+    // frames between key frame and start of segment were only needed for decoding.
+    source = std::move(source)
+             >> streams::filter_map([first_frame](owned_image_packet &&packet) {
+                  const owned_image_frame *frame = boost::get<owned_image_frame>(&packet);
+                  return frame != nullptr && frame->id.i1 < first_frame
+                             ? boost::optional<owned_image_packet>{}
+                             : boost::make_optional(std::move(packet));
+                });
+  }
 
   if (video_cfg.time_limit) {
     source = std::move(source) >> streams::asio::timer_breaker<owned_image_packet>(
@@ -285,6 +611,38 @@ streams::publisher<owned_image_packet> decoded_publisher(
   return source;
 }
 
+boost::optional<uring_file_options> uring_options(const output_video_config &config) {
+  if (config.output_io == "buffered") {
+    return boost::none;
+  }
+  uring_file_options options;
+  options.direct = config.output_io == "direct";
+  return options;
+}
+
+streams::op<owned_image_packet, encoded_packet> encode_output(
+    const output_video_config &config, boost::optional<int> threads) {
+  streams::op<owned_image_packet, encoded_packet> encode;
+  if (config.codec == "h264") {
+    h264_encoder_profile profile = config.h264_encoder;
+    profile.threads = threads.value_or(profile.threads);
+    encode = encode_h264(profile);
+  } else {
+    if (config.codec != "vp9") {
+      LOG(ERROR) << "unsupported output codec " << config.codec << ", using vp9";
+    }
+    encoder_profile profile = config.encoder;
+    profile.threads = threads.value_or(profile.threads);
+    encode = encode_vp9(profile);
+  }
+  if (!config.profile_stages) {
+    return encode;
+  }
+  return [encode](streams::publisher<owned_image_packet> &&src) {
+    return encode(std::move(src) >> streams::profile("encode"));
+  };
+}
+
 streams::subscriber<encoded_packet> &encoded_subscriber(
     boost::asio::io_service &io, const std::shared_ptr<rtm::client> &client,
     const output_video_config &config) {
@@ -299,8 +657,20 @@ streams::subscriber<encoded_packet> &encoded_subscriber(
           std::to_string(*config.reserved_index_space);
     }
 
+    if (config.output_format == "replay") {
+      return replay_file_sink(*config.output_path);
+    }
+
+    if (is_object_url(config.output_path->string())) {
+      CHECK(config.storage_config) << "object storage output needs storage config";
+      return object_storage_sink(load_object_storage_config(*config.storage_config),
+                                 *config.output_path, config.segment_duration,
+                                 std::move(format_options),
+                                 config.output_format == "fmp4");
+    }
     return video_file_sink(*config.output_path, config.segment_duration,
-                           std::move(format_options));
+                           std::move(format_options), config.output_format == "fmp4",
+                           default_request_window_size, uring_options(config));
   }
 
   ABORT() << "unreachable code in encoded_subscriber()";
@@ -391,12 +761,69 @@ bool configuration::validate() const {
     return false;
   }
 
+  if (has_output_file_args) {
+    const std::string format = _vm["output-format"].as<std::string>();
+    if (format != "video" && format != "fmp4" && format != "replay") {
+      std::cerr << "Unknown output format: " << format << "\n";
+      return false;
+    }
+    if (format == "fmp4" && _vm.count("reserved-index-space") > 0) {
+      std::cerr << "--reserved-index-space is not needed for fmp4 output\n";
+      return false;
+    }
+    if (format == "replay" && _vm.count("segment-duration") > 0) {
+      std::cerr << "--segment-duration is not supported for replay output\n";
+      return false;
+    }
+    const std::string io = _vm["output-io"].as<std::string>();
+    if (io != "buffered" && io != "uring" && io != "direct") {
+      std::cerr << "Unknown output io: " << io << "\n";
+      return false;
+    }
+    const std::string path = _vm["output-video-file"].as<std::string>();
+    if (is_object_url(path)) {
+      if (_vm.count("storage-config") == 0 || format == "replay") {
+        std::cerr << "Object storage output needs --storage-config and video output "
+                     "format\n";
+        return false;
+      }
+      // exits on a bad config.
+      load_object_storage_config(_vm["storage-config"].as<std::string>());
+    }
+  }
+
   if (_cli_options.enable_generic_input_options) {
     const std::string resolution = _vm["input-resolution"].as<std::string>();
     if (resolution != "original" && !avutils::parse_image_size(resolution).ok()) {
       std::cerr << "Unable to parse input resolution: " << resolution << "\n";
       return false;
     }
+
+    if (_vm["input-max-queued-packets"].as<size_t>() == 0) {
+      std::cerr << "--input-max-queued-packets should be positive\n";
+      return false;
+    }
+    const std::string policy = _vm["input-queue-overflow-policy"].as<std::string>();
+    if (!streams::parse_overflow_policy(policy)) {
+      std::cerr << "Unsupported input queue overflow policy: " << policy << "\n";
+      return false;
+    }
+
+    if (_vm.count("decoder-threading") > 0) {
+      const std::string threading = _vm["decoder-threading"].as<std::string>();
+      if (threading != "frame" && threading != "slice") {
+        std::cerr << "Unknown decoder threading: " << threading << "\n";
+        return false;
+      }
+    }
+
+    if (_vm.count("input-crop") > 0) {
+      const std::string crop = _vm["input-crop"].as<std::string>();
+      if (!avutils::parse_image_region(crop).ok()) {
+        std::cerr << "Unable to parse input crop region: " << crop << "\n";
+        return false;
+      }
+    }
   }
 
   if (_cli_options.enable_generic_output_options) {
@@ -405,6 +832,20 @@ bool configuration::validate() const {
       std::cerr << "Unable to parse output resolution: " << resolution << "\n";
       return false;
     }
+
+    const std::string codec = _vm["output-codec"].as<std::string>();
+    if (codec != "vp9" && codec != "h264") {
+      std::cerr << "Unsupported output codec: " << codec << "\n";
+      return false;
+    }
+
+    if (_vm.count("encoder-profile") > 0) {
+      const std::string profile = _vm["encoder-profile"].as<std::string>();
+      if (!encoder_profile_by_name(profile)) {
+        std::cerr << "Unknown encoder profile: " << profile << "\n";
+        return false;
+      }
+    }
   }
 
   return true;
@@ -420,19 +861,58 @@ std::shared_ptr<rtm::client> configuration::rtm_client(
   if (!check_rtm_args_provided(_vm)) {
     return nullptr;
   }
+  if (_vm.count("shm-transport") > 0) {
+    return std::make_shared<rtm::thread_checking_client>(
+        io_service, io_thread_id,
+        rtm::new_shm_client(io_service, io_thread_id,
+                            _vm["shm-transport"].as<std::string>()));
+  }
 
   const std::string endpoint = _vm["endpoint"].as<std::string>();
   const std::string port = _vm["port"].as<std::string>();
   const std::string appkey = _vm["appkey"].as<std::string>();
+  const size_t max_write_batch_bytes = _vm["rtm-max-write-batch-bytes"].as<size_t>();
+  const size_t connections = _vm["rtm-connections"].as<size_t>();
+  const size_t io_threads = _vm["rtm-io-threads"].as<size_t>();
+  const bool compression = _vm.count("rtm-compression") > 0;
+  // reconnects reuse addresses and TLS session of previous connections.
+  const std::shared_ptr<rtm::connection_cache> cache = rtm::new_connection_cache();
+  // compressed and uncompressed connections reconnect together.
+  auto new_client = [endpoint, port, appkey, max_write_batch_bytes, cache, compression,
+                     &ssl_context](boost::asio::io_service &client_io_service, size_t id,
+                                   rtm::error_callbacks &callbacks)
+      -> std::unique_ptr<rtm::client> {
+    if (!compression) {
+      return rtm::new_client(endpoint, port, appkey, client_io_service, ssl_context, id,
+                             callbacks, max_write_batch_bytes, cache);
+    }
+    return std::make_unique<rtm::split_compression_client>(
+        rtm::new_client(endpoint, port, appkey, client_io_service, ssl_context, id,
+                        callbacks, max_write_batch_bytes, cache, true),
+        rtm::new_client(endpoint, port, appkey, client_io_service, ssl_context, id,
+                        callbacks, max_write_batch_bytes, cache, false));
+  };
+
+  // with io threads even a single connection moves its socket, TLS and CBOR work
+  // off the main loop thread.
+  if (connections > 1 || io_threads > 0) {
+    return std::make_shared<rtm::thread_checking_client>(
+        io_service, io_thread_id,
+        std::make_unique<rtm::sharded_client>(
+            io_service, io_thread_id, connections,
+            [new_client](boost::asio::io_service &shard_io_service, size_t shard,
+                         rtm::error_callbacks &callbacks) {
+              return new_client(shard_io_service, shard + 1, callbacks);
+            },
+            rtm_error_callbacks, io_threads));
+  }
 
   return std::make_shared<rtm::thread_checking_client>(
       io_service, io_thread_id,
       std::make_unique<rtm::resilient_client>(
           io_service, io_thread_id,
-          [endpoint, port, appkey, &io_service, &ssl_context,
-           &rtm_error_callbacks](rtm::error_callbacks &callbacks) {
-            return rtm::new_client(endpoint, port, appkey, io_service, ssl_context, 1,
-                                   callbacks);
+          [new_client, &io_service](rtm::error_callbacks &callbacks) {
+            return new_client(io_service, 1, callbacks);
           },
           rtm_error_callbacks));
 }
@@ -478,17 +958,60 @@ input_video_config::input_video_config(const po::variables_map &vm)
       input_replay_file(vm.count("input-replay-file") > 0
                             ? vm["input-replay-file"].as<std::string>()
                             : boost::optional<std::string>{}),
+      replay_speed(vm.count("replay-speed") > 0 ? vm["replay-speed"].as<double>() : 1.0),
       input_url(vm.count("input-url") > 0 ? vm["input-url"].as<std::string>()
                                           : boost::optional<std::string>{}),
       input_url_parameters{vm.count("input-url-parameters") > 0
                                ? vm["input-url-parameters"].as<std::string>()
                                : boost::optional<std::string>{}},
+      input_url_fast_start(vm.count("input-url-fast-start") > 0),
+      input_url_shared_demuxer(vm.count("input-url-shared-demuxer") > 0),
       input_camera(vm.count("input-camera") > 0),
+      camera_device(vm.count("input-camera-device") > 0
+                        ? vm["input-camera-device"].as<std::string>()
+                        : default_camera_device),
+      camera_passthrough(vm.count("input-camera-passthrough") > 0),
       loop(vm.count("loop") > 0),
+      start_time(vm.count("start-time") > 0 ? vm["start-time"].as<double>()
+                                            : boost::optional<double>{}),
+      end_time(vm.count("end-time") > 0 ? vm["end-time"].as<double>()
+                                        : boost::optional<double>{}),
+      start_frame(vm.count("start-frame") > 0 ? vm["start-frame"].as<int64_t>()
+                                              : boost::optional<int64_t>{}),
+      end_frame(vm.count("end-frame") > 0 ? vm["end-frame"].as<int64_t>()
+                                          : boost::optional<int64_t>{}),
       time_limit(vm.count("time-limit") > 0 ? vm["time-limit"].as<int>()
                                             : boost::optional<int>{}),
       frames_limit(vm.count("frames-limit") > 0 ? vm["frames-limit"].as<int>()
-                                                : boost::optional<int>{}) {}
+                                                : boost::optional<int>{}),
+      key_frame_history(vm.count("input-key-frame-history") > 0
+                            ? vm["input-key-frame-history"].as<int>()
+                            : boost::optional<int>{}),
+      hw_device(vm.count("input-hw-device") > 0 ? vm["input-hw-device"].as<std::string>()
+                                                : boost::optional<std::string>{}),
+      decoder_threads(vm.count("decoder-threads") > 0 ? vm["decoder-threads"].as<int>()
+                                                      : boost::optional<int>{}),
+      decoder_threading(vm.count("decoder-threading") > 0
+                            ? vm["decoder-threading"].as<std::string>()
+                            : boost::optional<std::string>{}),
+      crop(vm.count("input-crop") > 0 ? vm["input-crop"].as<std::string>()
+                                      : boost::optional<std::string>{}),
+      read_ahead_bytes(vm.count("read-ahead-bytes") > 0
+                           ? vm["read-ahead-bytes"].as<size_t>()
+                           : default_read_ahead_bytes),
+      metrics_sampling(vm.count("input-metrics-sampling") > 0
+                           ? vm["input-metrics-sampling"].as<int>()
+                           : 1),
+      key_frames_only(vm.count("input-key-frames-only") > 0),
+      max_queued_packets(vm.count("input-max-queued-packets") > 0
+                             ? vm["input-max-queued-packets"].as<size_t>()
+                             : default_max_queued_packets),
+      queue_overflow_policy(
+          vm.count("input-queue-overflow-policy") > 0
+              ? overflow_policy_or_default(
+                    vm["input-queue-overflow-policy"].as<std::string>())
+              : default_packets_overflow_policy),
+      profile_stages(vm.count("profile-stages") > 0) {}
 
 input_video_config::input_video_config(const nlohmann::json &config)
     : input_channel(config.find("channel") != config.end()
@@ -505,20 +1028,70 @@ input_video_config::input_video_config(const nlohmann::json &config)
       input_replay_file(config.find("input_replay_file") != config.end()
                             ? config["input_replay_file"].get<std::string>()
                             : boost::optional<std::string>{}),
+      replay_speed(config.find("replay_speed") != config.end()
+                       ? config["replay_speed"].get<double>()
+                       : 1.0),
       input_url(config.find("input_url") != config.end()
                     ? config["input_url"].get<std::string>()
                     : boost::optional<std::string>{}),
       input_url_parameters{config.find("input_url_parameters") != config.end()
                                ? config["input_url_parameters"].get<std::string>()
                                : boost::optional<std::string>{}},
+      input_url_fast_start(config.find("input_url_fast_start") != config.end()),
+      input_url_shared_demuxer(config.find("input_url_shared_demuxer") != config.end()),
       input_camera(config.find("input_camera") != config.end()),
+      camera_device(config.find("camera_device") != config.end()
+                        ? config["camera_device"].get<std::string>()
+                        : default_camera_device),
+      camera_passthrough(config.find("camera_passthrough") != config.end()),
       loop(config.find("loop") != config.end()),
+      start_time(config.find("start_time") != config.end()
+                     ? config["start_time"].get<double>()
+                     : boost::optional<double>{}),
+      end_time(config.find("end_time") != config.end() ? config["end_time"].get<double>()
+                                                       : boost::optional<double>{}),
+      start_frame(config.find("start_frame") != config.end()
+                      ? config["start_frame"].get<int64_t>()
+                      : boost::optional<int64_t>{}),
+      end_frame(config.find("end_frame") != config.end()
+                    ? config["end_frame"].get<int64_t>()
+                    : boost::optional<int64_t>{}),
       time_limit(config.find("time_limit") != config.end()
                      ? config["time_limit"].get<long>()
                      : boost::optional<long>{}),
       frames_limit(config.find("frames_limit") != config.end()
                        ? config["frames_limit"].get<long>()
-                       : boost::optional<long>{}) {}
+                       : boost::optional<long>{}),
+      key_frame_history(config.find("key_frame_history") != config.end()
+                            ? config["key_frame_history"].get<int>()
+                            : boost::optional<int>{}),
+      hw_device(config.find("hw_device") != config.end()
+                    ? config["hw_device"].get<std::string>()
+                    : boost::optional<std::string>{}),
+      decoder_threads(config.find("decoder_threads") != config.end()
+                          ? config["decoder_threads"].get<int>()
+                          : boost::optional<int>{}),
+      decoder_threading(config.find("decoder_threading") != config.end()
+                            ? config["decoder_threading"].get<std::string>()
+                            : boost::optional<std::string>{}),
+      crop(config.find("crop") != config.end() ? config["crop"].get<std::string>()
+                                               : boost::optional<std::string>{}),
+      read_ahead_bytes(config.find("read_ahead_bytes") != config.end()
+                           ? config["read_ahead_bytes"].get<size_t>()
+                           : default_read_ahead_bytes),
+      metrics_sampling(config.find("metrics_sampling") != config.end()
+                           ? config["metrics_sampling"].get<int>()
+                           : 1),
+      key_frames_only(config.find("key_frames_only") != config.end()),
+      max_queued_packets(config.find("max_queued_packets") != config.end()
+                             ? config["max_queued_packets"].get<size_t>()
+                             : default_max_queued_packets),
+      queue_overflow_policy(
+          config.find("queue_overflow_policy") != config.end()
+              ? overflow_policy_or_default(
+                    config["queue_overflow_policy"].get<std::string>())
+              : default_packets_overflow_policy),
+      profile_stages(config.find("profile_stages") != config.end()) {}
 
 output_video_config::output_video_config(const po::variables_map &vm)
     : output_channel{vm.count("output-channel") > 0
@@ -527,6 +1100,8 @@ output_video_config::output_video_config(const po::variables_map &vm)
       output_path{vm.count("output-video-file") > 0
                       ? vm["output-video-file"].as<std::string>()
                       : boost::optional<std::string>{}},
+      output_format{vm.count("output-format") > 0 ? vm["output-format"].as<std::string>()
+                                                  : "video"},
       segment_duration{
           vm.count("segment-duration") > 0
               ? boost::optional<std::chrono::system_clock::duration>{std::chrono::seconds{
@@ -534,7 +1109,20 @@ output_video_config::output_video_config(const po::variables_map &vm)
               : boost::optional<std::chrono::system_clock::duration>{}},
       reserved_index_space{vm.count("reserved-index-space") > 0
                                ? vm["reserved-index-space"].as<int>()
-                               : boost::optional<int>{}} {}
+                               : boost::optional<int>{}},
+      storage_config{optional_string(vm, "storage-config")},
+      output_io{vm.count("output-io") > 0 ? vm["output-io"].as<std::string>()
+                                          : "buffered"},
+      codec{vm.count("output-codec") > 0 ? vm["output-codec"].as<std::string>()
+                                         : "vp9"},
+      encoder{vm.count("encoder-profile") > 0
+                  ? encoder_profile_or_default(vm["encoder-profile"].as<std::string>())
+                  : encoder_profile{}},
+      h264_encoder{
+          h264_encoder_profile_or_default(optional_string(vm, "encoder-profile"),
+                                          optional_string(vm, "output-encoder"),
+                                          optional_string(vm, "output-hw-device"))},
+      profile_stages(vm.count("profile-stages") > 0) {}
 
 output_video_config::output_video_config(const nlohmann::json &config)
     : output_channel{config.find("output-channel") != config.end()
@@ -543,6 +1131,9 @@ output_video_config::output_video_config(const nlohmann::json &config)
       output_path{config.find("output-video-file") != config.end()
                       ? config["output-video-file"].get<std::string>()
                       : boost::optional<std::string>{}},
+      output_format{config.find("output-format") != config.end()
+                        ? config["output-format"].get<std::string>()
+                        : "video"},
       segment_duration{
           config.find("segment-duration") != config.end()
               ? boost::optional<std::chrono::system_clock::duration>{std::chrono::seconds{
@@ -550,7 +1141,23 @@ output_video_config::output_video_config(const nlohmann::json &config)
               : boost::optional<std::chrono::system_clock::duration>{}},
       reserved_index_space{config.find("reserved-index-space") != config.end()
                                ? config["reserved-index-space"].get<int>()
-                               : boost::optional<int>{}} {}
+                               : boost::optional<int>{}},
+      storage_config{optional_string(config, "storage-config")},
+      output_io{config.find("output-io") != config.end()
+                    ? config["output-io"].get<std::string>()
+                    : "buffered"},
+      codec{config.find("output-codec") != config.end()
+                ? config["output-codec"].get<std::string>()
+                : "vp9"},
+      encoder{config.find("encoder-profile") != config.end()
+                  ? encoder_profile_or_default(
+                        config["encoder-profile"].get<std::string>())
+                  : encoder_profile{}},
+      h264_encoder{
+          h264_encoder_profile_or_default(optional_string(config, "encoder-profile"),
+                                          optional_string(config, "output-encoder"),
+                                          optional_string(config, "output-hw-device"))},
+      profile_stages(config.find("profile_stages") != config.end()) {}
 }  // namespace cli_streams
 }  // namespace video
 }  // namespace satori
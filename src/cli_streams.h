@@ -8,11 +8,17 @@
 #include <memory>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "data.h"
+#include "frame_trace.h"
+#include "h264_encoder.h"
 #include "metrics.h"
 #include "rtm_client.h"
 #include "streams/streams.h"
+#include "streams/threaded_worker.h"
+#include "video_streams.h"
+#include "vp9_encoder.h"
 
 namespace satori {
 namespace video {
@@ -31,8 +37,16 @@ struct cli_options {
   bool enable_file_batch_mode{false};
   bool enable_url_input{false};
   bool enable_pool_mode{false};
+  // "original" keeps encoded stream as it is, without decoding.
+  std::string default_output_resolution{"320x240"};
 };
 
+// encoded packets of network and file inputs queued in front of decoder, once
+// queue is full, frames are dropped until the next key frame.
+constexpr size_t default_max_queued_packets = 512;
+constexpr streams::overflow_policy default_packets_overflow_policy =
+    streams::overflow_policy::DROP_UNTIL_KEY_FRAME;
+
 struct input_video_config {
   explicit input_video_config(const po::variables_map &vm);
   explicit input_video_config(const nlohmann::json &config);
@@ -42,13 +56,47 @@ struct input_video_config {
   const bool keep_aspect_ratio;
   const boost::optional<std::string> input_video_file;
   const boost::optional<std::string> input_replay_file;
+  // 0 replays as fast as possible.
+  const double replay_speed;
   const boost::optional<std::string> input_url;
   const boost::optional<std::string> input_url_parameters;
+  // short probing, codec parameters are reused on reconnects.
+  const bool input_url_fast_start;
+  // demuxed on threads shared by all url inputs of the process.
+  const bool input_url_shared_demuxer;
   const boost::optional<std::string> input_channel;
   const bool input_camera;
+  const std::string camera_device;
+  // camera's own H.264 or MJPEG packets are used without transcoding.
+  const bool camera_passthrough;
   const bool loop;
+  // part of input video file to read, in seconds or frames from the beginning.
+  const boost::optional<double> start_time;
+  const boost::optional<double> end_time;
+  const boost::optional<int64_t> start_frame;
+  const boost::optional<int64_t> end_frame;
   const boost::optional<int> time_limit;
   const boost::optional<int> frames_limit;
+  // seconds of channel history to look for a key frame in.
+  const boost::optional<int> key_frame_history;
+  // FFmpeg hardware device type to decode on.
+  const boost::optional<std::string> hw_device;
+  const boost::optional<int> decoder_threads;
+  // frame or slice, see decoder_options.
+  const boost::optional<std::string> decoder_threading;
+  // <width>x<height>+<x>+<y> region of source frames to decode.
+  const boost::optional<std::string> crop;
+  // how far batch mode demuxes input file ahead of decoder.
+  const size_t read_ahead_bytes;
+  // 1 in that many network frames is observed by video metrics.
+  const int metrics_sampling;
+  // network inputs drop chunks of frames other than key frames.
+  const bool key_frames_only;
+  // bound and overflow policy of encoded packets queued in front of decoder.
+  const size_t max_queued_packets;
+  const streams::overflow_policy queue_overflow_policy;
+  // decode and bot stages are instrumented with streams::profile.
+  const bool profile_stages;
 };
 
 struct output_video_config {
@@ -57,17 +105,51 @@ struct output_video_config {
 
   const boost::optional<std::string> output_channel;
   const boost::optional<boost::filesystem::path> output_path;
+  // video, fmp4 or replay.
+  const std::string output_format;
   const boost::optional<std::chrono::system_clock::duration> segment_duration;
   const boost::optional<int> reserved_index_space;
+  // json file of object storage credentials, used when output path is object url.
+  const boost::optional<std::string> storage_config;
+  // buffered, uring or direct, how local files are written.
+  const std::string output_io;
+  // vp9 or h264, used when stream is transcoded.
+  const std::string codec;
+  // settings of the codec, both are picked by encoder profile name, h264 one
+  // also takes encoder name and hardware device.
+  const encoder_profile encoder;
+  const h264_encoder_profile h264_encoder;
+  // encode stage is instrumented with streams::profile.
+  const bool profile_stages;
 };
 
+// options of uring_file for local output files, none for buffered io.
+boost::optional<uring_file_options> uring_options(const output_video_config &config);
+
+// encodes transcoded stream with codec and profile of config, threads overrides
+// encoder threads of the profile.
+streams::op<owned_image_packet, encoded_packet> encode_output(
+    const output_video_config &config, boost::optional<int> threads = boost::none);
+
+// threads of the input are pinned to cpus if they are set.
 streams::publisher<encoded_packet> encoded_publisher(
     boost::asio::io_service &io, const std::shared_ptr<rtm::client> &client,
-    const input_video_config &video_cfg);
+    const input_video_config &video_cfg, const std::vector<int> &cpus = {});
+
+// decodes packets to frames of video_cfg resolution. decoder_opts settings which are
+// present in video_cfg are taken from it, crop is only applied if decoder_opts has no
+// crop region.
+streams::op<encoded_packet, owned_image_packet> decode_input(
+    const input_video_config &video_cfg, image_pixel_format pixel_format,
+    decoder_options decoder_opts = decoder_options{});
 
+// encoded_publisher decoded by decode_input, limited by time and frames limits.
+// If tracer is set, reassembly and decoding of frames are recorded by it.
 streams::publisher<owned_image_packet> decoded_publisher(
     boost::asio::io_service &io, const std::shared_ptr<rtm::client> &client,
-    const input_video_config &video_cfg, image_pixel_format pixel_format);
+    const input_video_config &video_cfg, image_pixel_format pixel_format,
+    decoder_options decoder_opts = decoder_options{},
+    std::shared_ptr<frame_tracer> tracer = nullptr);
 
 streams::subscriber<encoded_packet> &encoded_subscriber(
     boost::asio::io_service &io, const std::shared_ptr<rtm::client> &client,
@@ -1,6 +1,10 @@
 #include <boost/program_options.hpp>
 #include <gsl/gsl>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include "SDL2/SDL.h"
 
@@ -41,12 +45,31 @@ po::options_description cli_options() {
       ",v", po::value<std::string>(),
       "log verbosity level (INFO, WARNING, ERROR, FATAL, OFF, 1-9)");
 
-  return cli_generic;
+  po::options_description player_options("Player options");
+  player_options.add_options()(
+      "yuv-texture", po::bool_switch()->default_value(false),
+      "decodes to YUV420P and leaves color conversion and scaling to the GPU");
+  player_options.add_options()(
+      "pacing", po::value<std::string>()->default_value("queue"),
+      "(queue|latest) queue shows every decoded frame in order, latest shows the "
+      "newest one and drops frames which are late");
+
+  return player_options.add(cli_generic);
 }
 
 struct player_configuration : cli_streams::configuration {
   player_configuration(int argc, char *argv[])
-      : configuration(argc, argv, cli_configuration(), cli_options()) {}
+      : configuration(argc, argv, cli_configuration(), cli_options()) {
+    const std::string p = pacing();
+    if (p != "queue" && p != "latest") {
+      std::cerr << "Unknown pacing: " << p << "\n";
+      exit(1);
+    }
+  }
+
+  bool yuv_texture() const { return _vm["yuv-texture"].as<bool>(); }
+
+  std::string pacing() const { return _vm["pacing"].as<std::string>(); }
 };
 
 class sdl_window {
@@ -121,10 +144,17 @@ class sdl_renderer {
 
   ~sdl_renderer() {
     LOG(INFO) << "Destroying renderer";
+    destroy_yuv_texture();
     SDL_DestroyRenderer(_ptr);
   }
 
-  void render(sdl_surface &&surface) {
+  void render(const owned_image_frame &frame) {
+    if (frame.pixel_format == image_pixel_format::YUV420P) {
+      render_yuv(frame);
+      return;
+    }
+
+    sdl_surface surface{frame};
     SDL_Texture *texture = SDL_CreateTextureFromSurface(_ptr, surface._ptr);
     CHECK(texture) << "Unable to create texture! SDL Error: " << SDL_GetError();
 
@@ -133,54 +163,109 @@ class sdl_renderer {
       SDL_DestroyTexture(texture);
     });
 
+    present(texture);
+  }
+
+ private:
+  // planes are uploaded to a streaming texture which is kept while frame size stays
+  // the same, GPU converts them to RGB and scales to the window.
+  void render_yuv(const owned_image_frame &frame) {
+    if (_yuv_texture == nullptr || frame.width != _yuv_width
+        || frame.height != _yuv_height) {
+      destroy_yuv_texture();
+      _yuv_texture = SDL_CreateTexture(_ptr, SDL_PIXELFORMAT_IYUV,
+                                       SDL_TEXTUREACCESS_STREAMING, frame.width,
+                                       frame.height);
+      CHECK(_yuv_texture) << "Unable to create texture! SDL Error: " << SDL_GetError();
+      _yuv_width = frame.width;
+      _yuv_height = frame.height;
+    }
+
+    if (SDL_UpdateYUVTexture(_yuv_texture, nullptr, frame.plane_data[0].data(),
+                             frame.plane_strides[0], frame.plane_data[1].data(),
+                             frame.plane_strides[1], frame.plane_data[2].data(),
+                             frame.plane_strides[2])
+        != 0) {
+      LOG(ERROR) << "Unable to update texture! SDL Error: " << SDL_GetError();
+      return;
+    }
+    present(_yuv_texture);
+  }
+
+  void present(SDL_Texture *texture) {
     SDL_RenderClear(_ptr);
     SDL_RenderCopy(_ptr, texture, nullptr, nullptr);
     SDL_RenderPresent(_ptr);
   }
 
- private:
+  void destroy_yuv_texture() {
+    if (_yuv_texture != nullptr) {
+      LOG(5) << "Destroying texture";
+      SDL_DestroyTexture(_yuv_texture);
+      _yuv_texture = nullptr;
+    }
+  }
+
   SDL_Renderer *_ptr{nullptr};
+  SDL_Texture *_yuv_texture{nullptr};
+  uint16_t _yuv_width{0};
+  uint16_t _yuv_height{0};
 };
 
-streams::op<owned_image_packet, sdl_surface> image_to_surface() {
-  struct packet_visitor : public boost::static_visitor<streams::publisher<sdl_surface>> {
-    streams::publisher<sdl_surface> operator()(
-        const owned_image_metadata & /*metadata*/) {
-      return streams::publishers::empty<sdl_surface>();
+// Frames decoded ahead of the window. With latest pacing only the newest frame is
+// kept, frames replaced before they were shown are dropped as late.
+class frame_queue {
+ public:
+  explicit frame_queue(bool latest_only) : _latest_only(latest_only) {}
+
+  void push(owned_image_frame &&frame) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_latest_only && !_frames.empty()) {
+        _frames.clear();
+        _dropped++;
+        if (_dropped % 100 == 0) {
+          LOG(INFO) << "dropped " << _dropped << " late frames";
+        }
+      }
+      _frames.push_back(std::move(frame));
     }
+    _frame_added.notify_one();
+  }
 
-    streams::publisher<sdl_surface> operator()(const owned_image_frame &frame) {
-      std::vector<sdl_surface> result;
-      result.emplace_back(frame);
-      return streams::publishers::of(std::move(result));
+  // waits for a frame at most timeout.
+  boost::optional<owned_image_frame> pop(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!_frame_added.wait_for(lock, timeout, [this]() { return !_frames.empty(); })) {
+      return boost::none;
     }
-  };
+    owned_image_frame frame = std::move(_frames.front());
+    _frames.pop_front();
+    return frame;
+  }
 
-  struct packet_visitor packet_visitor;
+ private:
+  const bool _latest_only;
+  std::mutex _mutex;
+  std::condition_variable _frame_added;
+  std::deque<owned_image_frame> _frames;
+  uint64_t _dropped{0};
+};
 
-  return [&packet_visitor](streams::publisher<owned_image_packet> &&src) {
-    return std::move(src) >> streams::flat_map([&packet_visitor](owned_image_packet &&p) {
-             return boost::apply_visitor(packet_visitor, p);
-           });
-  };
-}
+// window events are polled at least that often while no frames arrive.
+constexpr std::chrono::milliseconds events_poll_interval{10};
 
-void run_sdl_loop(sdl_renderer &renderer, std::queue<sdl_surface> &surfaces,
-                  std::mutex &surfaces_mutex) {
+void run_sdl_loop(sdl_renderer &renderer, frame_queue &frames) {
   while (true) {
     SDL_Event e;
     while (SDL_PollEvent(&e) != 0) {
       if (e.type == SDL_QUIT) {
         return;
       }
-
-      SDL_Delay(5);
     }
 
-    std::lock_guard<std::mutex> lock(surfaces_mutex);
-    if (!surfaces.empty()) {
-      renderer.render(std::move(surfaces.front()));
-      surfaces.pop();
+    if (auto frame = frames.pop(events_poll_interval)) {
+      renderer.render(*frame);
     }
   }
 }
@@ -208,11 +293,12 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  streams::publisher<sdl_surface> source =
-      config.decoded_publisher(io_service, rtm_client, image_pixel_format::BGR)
+  const image_pixel_format pixel_format =
+      config.yuv_texture() ? image_pixel_format::YUV420P : image_pixel_format::BGR;
+  streams::publisher<owned_image_packet> source =
+      config.decoded_publisher(io_service, rtm_client, pixel_format)
       >> streams::threaded_worker("player.image_buffer") >> streams::flatten()
-      >> image_to_surface() >> streams::threaded_worker("player.surface_buffer")
-      >> streams::flatten() >> streams::do_finally([&io_service, &rtm_client]() {
+      >> streams::do_finally([&io_service, &rtm_client]() {
           io_service.post([&rtm_client]() {
             if (rtm_client) {
               if (auto ec = rtm_client->stop()) {
@@ -224,12 +310,12 @@ int main(int argc, char *argv[]) {
           });
         });
 
-  std::queue<sdl_surface> surfaces;
-  std::mutex surfaces_mutex;
+  frame_queue frames{config.pacing() == "latest"};
 
-  auto when_done = source->process([&surfaces, &surfaces_mutex](sdl_surface &&surface) {
-    std::lock_guard<std::mutex> lock(surfaces_mutex);
-    surfaces.push(std::move(surface));
+  auto when_done = source->process([&frames](owned_image_packet &&packet) {
+    if (auto *frame = boost::get<owned_image_frame>(&packet)) {
+      frames.push(std::move(*frame));
+    }
   });
   when_done.on([](std::error_condition ec) {
     if (ec) {
@@ -241,7 +327,7 @@ int main(int argc, char *argv[]) {
     io_service.run();
   })
       .detach();
-  run_sdl_loop(renderer, surfaces, surfaces_mutex);
+  run_sdl_loop(renderer, frames);
   SDL_Quit();
 
   io_service.stop();
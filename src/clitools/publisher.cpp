@@ -1,11 +1,27 @@
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/optional.hpp>
 #include <boost/program_options.hpp>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <vector>
 
+#include "avutils.h"
 #include "cli_streams.h"
+#include "decoded_frame.h"
+#include "encoder_scheduler.h"
+#include "frame_scaler.h"
 #include "logging_impl.h"
 #include "metrics.h"
 #include "rtm_client.h"
 #include "streams/asio_streams.h"
+#include "streams/executor.h"
+#include "streams/fan_out.h"
+#include "streams/threaded_worker.h"
 #include "tcmalloc.h"
 #include "video_streams.h"
 
@@ -38,13 +54,405 @@ po::options_description cli_options() {
       "log verbosity level (INFO, WARNING, ERROR, FATAL, OFF, 1-9)");
 
   po::options_description publisher_options("Publisher options");
+  publisher_options.add_options()(
+      "copies", po::value<int>()->default_value(1),
+      "(number) publishes that many copies of the input, copy i goes to "
+      "<output-channel>-i, i from 0, for load testing");
+  publisher_options.add_options()("copies-stagger", po::value<double>()->default_value(0),
+                                  "(seconds) delay between starts of copies");
+  publisher_options.add_options()(
+      "simulcast", po::value<std::string>(),
+      "(<width>x<height>,...) besides the input, publishes it transcoded to each of "
+      "these resolutions to <output-channel>/<width>x<height>, decoding it once");
 
   return publisher_options.add(cli_generic).add(metrics_options());
 }
 
 struct publisher_configuration : cli_streams::configuration {
   publisher_configuration(int argc, char* argv[])
-      : configuration(argc, argv, cli_configuration(), cli_options()) {}
+      : configuration(argc, argv, cli_configuration(), cli_options()) {
+    if (copies() < 1 || copies_stagger().count() < 0) {
+      std::cerr << "--copies should be positive and --copies-stagger not negative\n";
+      exit(1);
+    }
+    if (_vm.count("simulcast") > 0 && copies() > 1) {
+      std::cerr << "--simulcast can't be used with --copies\n";
+      exit(1);
+    }
+  }
+
+  int copies() const { return _vm["copies"].as<int>(); }
+
+  std::chrono::milliseconds copies_stagger() const {
+    return std::chrono::milliseconds{
+        static_cast<int64_t>(_vm["copies-stagger"].as<double>() * 1000)};
+  }
+
+  std::string output_channel() const { return _vm["output-channel"].as<std::string>(); }
+
+  std::vector<image_size> simulcast() const {
+    std::vector<image_size> result;
+    if (_vm.count("simulcast") == 0) {
+      return result;
+    }
+    std::stringstream renditions{_vm["simulcast"].as<std::string>()};
+    std::string rendition;
+    while (std::getline(renditions, rendition, ',')) {
+      const auto size = avutils::parse_image_size(rendition);
+      if (!size.ok()) {
+        std::cerr << "Unable to parse simulcast resolution: " << rendition << "\n";
+        exit(1);
+      }
+      result.push_back(size.get());
+    }
+    return result;
+  }
+
+  cli_streams::output_video_config output_config() const {
+    return cli_streams::output_video_config{_vm};
+  }
+
+  bool keep_aspect_ratio() const { return _vm["keep-proportions"].as<bool>(); }
+};
+
+// Input goes to output channel as it is, and is decoded once for all renditions.
+// Renditions are scaled on the decoder thread and encoded on encoder_scheduler
+// threads. on_done is called once input and all renditions are over.
+void publish_simulcast(streams::publisher<encoded_packet> &&source,
+                       const std::vector<image_size> &renditions,
+                       const publisher_configuration &config,
+                       boost::asio::io_service &io,
+                       const std::shared_ptr<rtm::client> &client,
+                       std::function<void()> &&on_done) {
+  auto running = std::make_shared<std::atomic<size_t>>(renditions.size() + 1);
+  auto on_stream_done = [running, on_done = std::move(on_done)]() {
+    if (--*running == 0) {
+      on_done();
+    }
+  };
+
+  auto inputs = streams::fan_out(std::move(source), 2);
+  (std::move(inputs[0]) >> streams::do_finally([on_stream_done]() { on_stream_done(); }))
+      ->subscribe(config.encoded_subscriber(io, client));
+
+  auto decoded =
+      streams::fan_out(std::move(inputs[1]) >> decode_frames(decoder_options{}),
+                       renditions.size());
+  const cli_streams::output_video_config output_config = config.output_config();
+  encoder_scheduler &scheduler = encoder_scheduler::shared();
+  for (size_t i = 0; i < renditions.size(); i++) {
+    const image_size &size = renditions[i];
+    const std::string channel = config.output_channel() + "/" + std::to_string(size.width)
+                                + "x" + std::to_string(size.height);
+    LOG(INFO) << "publishing " << size << " rendition to " << channel;
+
+    auto scaler = std::make_shared<frame_scaler>(size, image_pixel_format::RGB0,
+                                                 config.keep_aspect_ratio());
+    streams::publisher<encoded_packet> encoded =
+        std::move(decoded[i])
+        >> streams::filter_map(
+               [scaler](decoded_frame &&frame) -> boost::optional<owned_image_packet> {
+                 boost::optional<owned_image_frame> image = scaler->convert(frame);
+                 if (!image) {
+                   LOG(ERROR) << "failed to scale decoded frame";
+                   return boost::none;
+                 }
+                 return owned_image_packet{std::move(*image)};
+               })
+        >> scheduler.schedule(channel)
+        >> cli_streams::encode_output(output_config, scheduler.encoder_threads())
+        >> streams::threaded_worker(streams::executor::shared(),
+                                    output_config.codec + "_" + channel)
+        >> streams::flatten()
+        >> streams::do_finally([on_stream_done]() { on_stream_done(); });
+    encoded->subscribe(rtm_sink(client, io, channel));
+  }
+}
+
+// copies don't get more packets than that queued from the shared source.
+constexpr size_t copy_window = 64;
+
+constexpr std::chrono::seconds report_interval{10};
+
+// Publishes one source to several sinks, so the input is read and encoded once for
+// all copies, and copies share packet payloads. Copy i gets every packet i * stagger
+// later than it was read, and renumbers frames from its first key frame. Source is
+// asked for more packets while each copy has less than copy_window of them queued,
+// so an unpaced source goes as fast as the slowest copy.
+class broadcast : public streams::subscriber<encoded_packet> {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  broadcast(boost::asio::io_service &io, std::chrono::milliseconds stagger,
+            std::function<void()> &&on_done)
+      : _io(io), _stagger(stagger), _on_done(std::move(on_done)) {}
+
+  // should be called before source is subscribed.
+  void add_copy(streams::subscriber<encoded_packet> &sink) {
+    _copies.emplace_back(new copy(*this, _copies.size(), sink));
+  }
+
+  // frames passed to sinks of all copies so far.
+  uint64_t frames_published() const { return _frames_published; }
+
+  size_t running_copies() const { return _running_copies; }
+
+ private:
+  struct copy : streams::subscription {
+    copy(broadcast &owner, size_t index, streams::subscriber<encoded_packet> &sink)
+        : owner(owner), index(index), sink(&sink), timer(owner._io) {}
+
+    void request(int n) override {
+      requested += n;
+      owner.drain(*this);
+    }
+
+    void cancel() override {
+      LOG(INFO) << "copy " << index << " was cancelled";
+      owner.finish(*this);
+    }
+
+    broadcast &owner;
+    const size_t index;
+    // null once copy is finished.
+    streams::subscriber<encoded_packet> *sink;
+    boost::asio::deadline_timer timer;
+    // packets with times they are due.
+    std::deque<std::pair<clock::time_point, encoded_packet>> queue;
+    int64_t requested{0};
+    bool draining{false};
+    bool timer_armed{false};
+    // packets before the first metadata are skipped, decoders can't start from them.
+    bool started{false};
+    boost::optional<int64_t> first_frame_id;
+  };
+
+  void on_subscribe(streams::subscription &s) override {
+    _source = &s;
+    _running_copies = _copies.size();
+    for (auto &c : _copies) {
+      c->sink->on_subscribe(*c);
+    }
+    request_source();
+  }
+
+  void on_next(encoded_packet &&packet) override {
+    _source_requested = false;
+    const auto now = clock::now();
+    for (auto &c : _copies) {
+      if (c->sink == nullptr) {
+        continue;
+      }
+      if (!c->started) {
+        c->started = boost::get<encoded_metadata>(&packet) != nullptr;
+        if (!c->started) {
+          continue;
+        }
+      }
+      c->queue.emplace_back(now + _stagger * c->index, packet);
+    }
+    for (auto &c : _copies) {
+      drain(*c);
+    }
+  }
+
+  void on_error(std::error_condition ec) override {
+    LOG(ERROR) << "source error: " << ec.message();
+    _source = nullptr;
+    for (auto &c : _copies) {
+      if (auto *sink = c->sink) {
+        finish(*c);
+        sink->on_error(ec);
+      }
+    }
+  }
+
+  void on_complete() override {
+    LOG(INFO) << "source is complete";
+    _source = nullptr;
+    _source_complete = true;
+    for (auto &c : _copies) {
+      drain(*c);
+    }
+  }
+
+  void drain(copy &c) {
+    if (c.draining || c.sink == nullptr) {
+      return;
+    }
+    c.draining = true;
+    while (c.sink != nullptr && c.requested > 0 && !c.queue.empty()) {
+      const auto due = c.queue.front().first;
+      if (due > clock::now()) {
+        arm_timer(c, due);
+        break;
+      }
+      encoded_packet packet = std::move(c.queue.front().second);
+      c.queue.pop_front();
+      c.requested--;
+      if (auto *f = boost::get<encoded_frame>(&packet)) {
+        if (!c.first_frame_id) {
+          c.first_frame_id = f->id.i1;
+        }
+        f->id.i1 -= *c.first_frame_id;
+        f->id.i2 -= *c.first_frame_id;
+        _frames_published++;
+      }
+      c.sink->on_next(std::move(packet));
+    }
+    c.draining = false;
+
+    if (c.sink != nullptr && _source_complete && c.queue.empty()) {
+      auto *sink = c.sink;
+      finish(c);
+      sink->on_complete();
+      return;
+    }
+    request_source();
+  }
+
+  void arm_timer(copy &c, clock::time_point due) {
+    if (c.timer_armed) {
+      return;
+    }
+    c.timer_armed = true;
+    const auto delay =
+        std::chrono::duration_cast<std::chrono::milliseconds>(due - clock::now());
+    c.timer.expires_from_now(boost::posix_time::milliseconds(delay.count() + 1));
+    c.timer.async_wait([this, &c](const boost::system::error_code &ec) {
+      c.timer_armed = false;
+      if (!ec) {
+        drain(c);
+      }
+    });
+  }
+
+  void request_source() {
+    if (_source == nullptr || _source_requested || _running_copies == 0) {
+      return;
+    }
+    for (auto &c : _copies) {
+      if (c->sink != nullptr && c->queue.size() >= copy_window) {
+        return;
+      }
+    }
+    _source_requested = true;
+    _source->request(1);
+  }
+
+  void finish(copy &c) {
+    if (c.sink == nullptr) {
+      return;
+    }
+    c.sink = nullptr;
+    c.queue.clear();
+    c.timer.cancel();
+    if (--_running_copies > 0) {
+      // a finished copy might have been the slowest one.
+      request_source();
+      return;
+    }
+    if (_source != nullptr) {
+      auto *source = _source;
+      _source = nullptr;
+      source->cancel();
+    }
+    _on_done();
+  }
+
+  boost::asio::io_service &_io;
+  const std::chrono::milliseconds _stagger;
+  const std::function<void()> _on_done;
+  std::vector<std::unique_ptr<copy>> _copies;
+  streams::subscription *_source{nullptr};
+  bool _source_requested{false};
+  bool _source_complete{false};
+  size_t _running_copies{0};
+  uint64_t _frames_published{0};
+};
+
+// sample count, sum and cumulative bucket counts of rtm_write_delay_microseconds.
+struct write_delay_snapshot {
+  uint64_t count{0};
+  double sum{0};
+  std::vector<std::pair<double, uint64_t>> buckets;
+
+  static write_delay_snapshot take() {
+    write_delay_snapshot result;
+    for (const auto &family : metrics_registry().Collect()) {
+      if (family.name != "rtm_write_delay_microseconds" || family.metric.empty()) {
+        continue;
+      }
+      const auto &histogram = family.metric[0].histogram;
+      result.count = histogram.sample_count;
+      result.sum = histogram.sample_sum;
+      for (const auto &b : histogram.bucket) {
+        result.buckets.emplace_back(b.upper_bound, b.cumulative_count);
+      }
+    }
+    return result;
+  }
+
+  // upper bound of the bucket with q-th quantile of writes since previous snapshot.
+  double quantile(const write_delay_snapshot &previous, double q) const {
+    const uint64_t n = count - previous.count;
+    for (size_t i = 0; i < buckets.size() && i < previous.buckets.size(); i++) {
+      if (buckets[i].second - previous.buckets[i].second >= q * n) {
+        return buckets[i].first;
+      }
+    }
+    return buckets.empty() ? 0 : buckets.back().first;
+  }
+};
+
+// logs publish rate of all copies and rtm write delays every report_interval.
+class load_reporter {
+ public:
+  load_reporter(boost::asio::io_service &io, const broadcast &b)
+      : _broadcast(b), _timer(io), _last_delays(write_delay_snapshot::take()) {
+    schedule();
+  }
+
+  void stop() {
+    _timer.cancel();
+    report();
+  }
+
+ private:
+  void schedule() {
+    _timer.expires_from_now(boost::posix_time::seconds(report_interval.count()));
+    _timer.async_wait([this](const boost::system::error_code &ec) {
+      if (ec) {
+        return;
+      }
+      report();
+      schedule();
+    });
+  }
+
+  void report() {
+    const auto now = std::chrono::steady_clock::now();
+    const std::chrono::duration<double> elapsed = now - _last_time;
+    const uint64_t frames = _broadcast.frames_published();
+    const write_delay_snapshot delays = write_delay_snapshot::take();
+    const uint64_t writes = delays.count - _last_delays.count;
+
+    LOG(INFO) << "published " << (frames - _last_frames) / elapsed.count()
+              << " frames/s to " << _broadcast.running_copies()
+              << " channels, rtm_write_delay_microseconds mean "
+              << (writes > 0 ? (delays.sum - _last_delays.sum) / writes : 0) << " p99 "
+              << delays.quantile(_last_delays, 0.99);
+
+    _last_time = now;
+    _last_frames = frames;
+    _last_delays = delays;
+  }
+
+  const broadcast &_broadcast;
+  boost::asio::deadline_timer _timer;
+  std::chrono::steady_clock::time_point _last_time{std::chrono::steady_clock::now()};
+  uint64_t _last_frames{0};
+  write_delay_snapshot _last_delays;
 };
 
 }  // namespace
@@ -69,21 +477,46 @@ int main(int argc, char* argv[]) {
   }
   expose_metrics(rtm_client.get());
 
+  auto stop = [&io_service, &rtm_client]() {
+    io_service.post([&rtm_client]() {
+      stop_metrics();
+      if (auto ec = rtm_client->stop()) {
+        LOG(ERROR) << "error stopping rtm client: " << ec.message();
+      } else {
+        LOG(INFO) << "rtm client was stopped";
+      }
+    });
+  };
+
   streams::publisher<satori::video::encoded_packet> source =
-      config.encoded_publisher(io_service, rtm_client);
-
-  source = std::move(source) >> streams::do_finally([&io_service, &rtm_client]() {
-             io_service.post([&rtm_client]() {
-               stop_metrics();
-               if (auto ec = rtm_client->stop()) {
-                 LOG(ERROR) << "error stopping rtm client: " << ec.message();
-               } else {
-                 LOG(INFO) << "rtm client was stopped";
-               }
-             });
-           });
-
-  source->subscribe(config.encoded_subscriber(io_service, rtm_client));
+      config.encoded_publisher(io_service, rtm_client) >> repeat_metadata();
+
+  const int copies = config.copies();
+  if (copies == 1) {
+    const std::vector<image_size> renditions = config.simulcast();
+    if (renditions.empty()) {
+      source = std::move(source) >> streams::do_finally(std::move(stop));
+      source->subscribe(config.encoded_subscriber(io_service, rtm_client));
+    } else {
+      publish_simulcast(std::move(source), renditions, config, io_service, rtm_client,
+                        std::move(stop));
+    }
+    io_service.run();
+    return 0;
+  }
+
+  std::unique_ptr<load_reporter> reporter;
+  auto on_copies_done = [&stop, &reporter]() {
+    reporter->stop();
+    stop();
+  };
+  broadcast copies_broadcast{io_service, config.copies_stagger(), on_copies_done};
+  for (int i = 0; i < copies; i++) {
+    const std::string channel = config.output_channel() + "-" + std::to_string(i);
+    copies_broadcast.add_copy(rtm_sink(rtm_client, io_service, channel));
+  }
+  reporter = std::make_unique<load_reporter>(io_service, copies_broadcast);
+  source->subscribe(copies_broadcast);
 
   io_service.run();
 }
@@ -3,6 +3,8 @@
 #include <boost/filesystem.hpp>
 #include <boost/optional.hpp>
 #include <boost/program_options.hpp>
+#include <chrono>
+#include <deque>
 #include <json.hpp>
 #include <list>
 #include <memory>
@@ -10,9 +12,14 @@
 
 #include "cli_streams.h"
 #include "data.h"
+#include "encoder_scheduler.h"
 #include "logging_impl.h"
+#include "metrics.h"
 #include "pool_controller.h"
 #include "rtm_client.h"
+#include "rtm_streams.h"
+#include "satori_video.h"
+#include "streams/breaker.h"
 #include "streams/signal_breaker.h"
 #include "streams/threaded_worker.h"
 #include "tcmalloc.h"
@@ -31,6 +38,11 @@ namespace {
 
 constexpr int max_streams_capacity = 5;
 
+auto &pending_jobs = prometheus::BuildGauge()
+                         .Name("recorder_pending_jobs")
+                         .Register(metrics_registry())
+                         .Add({});
+
 cli_streams::cli_options cli_configuration() {
   cli_streams::cli_options result;
   result.enable_file_output = true;
@@ -40,6 +52,8 @@ cli_streams::cli_options cli_configuration() {
   result.enable_generic_input_options = true;
   result.enable_generic_output_options = true;
   result.enable_pool_mode = true;
+  // stream copy costs almost no CPU, transcoding is opt-in.
+  result.default_output_resolution = "original";
 
   return result;
 }
@@ -51,7 +65,67 @@ po::options_description cli_options() {
       ",v", po::value<std::string>(),
       "log verbosity level (INFO, WARNING, ERROR, FATAL, OFF, 1-9)");
 
-  return cli_generic;
+  po::options_description event_recording("Event recording options");
+  event_recording.add_options()(
+      "preroll", po::value<double>(),
+      "(seconds) keeps that much of the stream in memory instead of writing it, and "
+      "writes a clip starting with it when {\"action\": \"record\"} message arrives "
+      "on control channel of the input channel");
+  event_recording.add_options()(
+      "postroll", po::value<double>()->default_value(10),
+      "(seconds) clip goes on that long after the last record message, unless the "
+      "message has \"postroll\" field");
+  event_recording.add_options()("preroll-max-megabytes",
+                                po::value<size_t>()->default_value(32),
+                                "(megabytes) memory limit of the preroll of a channel");
+
+  po::options_description pool_admission("Pool admission options");
+  pool_admission.add_options()(
+      "pool-job-start-rate", po::value<double>()->default_value(0),
+      "(jobs per second) assigned jobs are queued and started at that rate, so a burst "
+      "of jobs doesn't open all decoders and files at once, 0 starts them immediately");
+
+  return cli_generic.add(event_recording).add(pool_admission);
+}
+
+// clips are written around record messages instead of writing whole stream.
+struct preroll_config {
+  preroll_options options;
+  std::chrono::milliseconds postroll;
+};
+
+// record messages may come in batches.
+void handle_record_messages(const nlohmann::json &payload, const preroll_config &config,
+                            preroll_trigger &trigger) {
+  if (payload.is_array()) {
+    for (const auto &message : payload) {
+      handle_record_messages(message, config, trigger);
+    }
+    return;
+  }
+  if (!payload.is_object() || payload.value("action", "") != "record") {
+    return;
+  }
+
+  std::chrono::milliseconds postroll = config.postroll;
+  auto it = payload.find("postroll");
+  if (it != payload.end() && it->is_number()) {
+    postroll = std::chrono::milliseconds{static_cast<int64_t>(it->get<double>() * 1000)};
+  }
+  LOG(INFO) << "got record message: " << payload;
+  trigger.trigger(postroll);
+}
+
+// <stem>-<start ms><extension> next to path.
+fs::path clip_path(const fs::path &path, std::chrono::system_clock::time_point start) {
+  const auto start_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(start.time_since_epoch())
+          .count();
+  fs::path result{path.stem()};
+  result += "-";
+  result += std::to_string(start_ms);
+  result += path.extension();
+  return path.parent_path() / result;
 }
 
 std::string escape_slashes(const std::string &s) {
@@ -82,6 +156,19 @@ struct recorder_configuration : cli_streams::configuration {
                                           : "recorder";
   }
 
+  size_t pool_capacity() const {
+    return _vm.count("pool-capacity") > 0 ? _vm["pool-capacity"].as<size_t>()
+                                          : max_streams_capacity;
+  }
+
+  // zero means jobs are started as soon as they are assigned.
+  std::chrono::milliseconds job_start_interval() const {
+    const double rate = _vm["pool-job-start-rate"].as<double>();
+    CHECK_GE(rate, 0) << "pool-job-start-rate can't be negative";
+    return rate > 0 ? std::chrono::milliseconds{static_cast<int64_t>(1000 / rate)}
+                    : std::chrono::milliseconds{0};
+  }
+
   cli_streams::input_video_config as_input_config() const {
     return cli_streams::input_video_config{_vm};
   }
@@ -89,6 +176,20 @@ struct recorder_configuration : cli_streams::configuration {
   cli_streams::output_video_config as_output_config() const {
     return cli_streams::output_video_config{_vm};
   }
+
+  boost::optional<preroll_config> preroll() const {
+    if (_vm.count("preroll") == 0) {
+      return boost::none;
+    }
+    preroll_config result;
+    result.options.duration =
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::duration<double>(_vm["preroll"].as<double>()));
+    result.options.max_bytes = _vm["preroll-max-megabytes"].as<size_t>() * 1024 * 1024;
+    result.postroll = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::duration<double>(_vm["postroll"].as<double>()));
+    return result;
+  }
 };
 
 using stream_done_callback_t = std::function<void(std::error_condition)>;
@@ -98,13 +199,15 @@ class video_stream : private streams::subscriber<encoded_packet> {
   video_stream(asio::io_service &io, std::shared_ptr<rtm::client> &client,
                cli_streams::input_video_config &&input_config,
                cli_streams::output_video_config &&output_config,
-               const nlohmann::json &job, stream_done_callback_t &&done_callback)
+               const nlohmann::json &job, stream_done_callback_t &&done_callback,
+               const boost::optional<preroll_config> &preroll = boost::none)
       : _io{io},
         _client{client},
         _input_config{std::move(input_config)},
         _output_config{std::move(output_config)},
         _job{job},
-        _done_callback{done_callback} {
+        _done_callback{done_callback},
+        _preroll{preroll} {
     connect();
   }
 
@@ -117,6 +220,11 @@ class video_stream : private streams::subscriber<encoded_packet> {
   void stop() {
     LOG(INFO) << "stopping video stream for " << _input_config.input_channel.get();
 
+    if (_record_messages_breaker) {
+      _record_messages_breaker->trigger();
+      _record_messages_breaker.reset();
+    }
+
     if (_subscription.is_initialized()) {
       LOG(INFO) << "canceling subscription for " << _input_config.input_channel.get();
       _subscription->cancel();
@@ -134,15 +242,20 @@ class video_stream : private streams::subscriber<encoded_packet> {
   streams::publisher<encoded_packet> original_encoded_stream(const std::string &channel) {
     LOG(INFO) << "using original encoded stream";
     return cli_streams::encoded_publisher(_io, _client, _input_config)
-           >> streams::threaded_worker("in_" + channel) >> streams::flatten();
+           >> streams::threaded_worker(streams::executor::shared(), "in_" + channel)
+           >> streams::flatten();
   }
 
   streams::publisher<encoded_packet> transcoded_stream(const std::string &channel) {
     LOG(INFO) << "using transcoded stream";
     return cli_streams::decoded_publisher(_io, _client, _input_config,
                                           image_pixel_format::RGB0)
-           >> streams::threaded_worker("in_" + channel) >> streams::flatten()
-           >> encode_vp9(25) >> streams::threaded_worker("vp9_" + channel)
+           // encoders of all channels share a thread per core.
+           >> encoder_scheduler::shared().schedule(channel)
+           >> cli_streams::encode_output(_output_config,
+                                         encoder_scheduler::shared().encoder_threads())
+           >> streams::threaded_worker(streams::executor::shared(),
+                                       _output_config.codec + "_" + channel)
            >> streams::flatten();
   }
 
@@ -158,11 +271,60 @@ class video_stream : private streams::subscriber<encoded_packet> {
                          ? original_encoded_stream(channel)
                          : transcoded_stream(channel);
 
-    _sink = cli_streams::encoded_subscriber(_io, _client, _output_config);
+    _sink = _preroll ? preroll_subscriber(channel)
+                     : cli_streams::encoded_subscriber(_io, _client, _output_config);
 
     publisher->subscribe(*this);
   }
 
+  // file sink is only created for clips, when record messages come.
+  streams::subscriber<encoded_packet> &preroll_subscriber(const std::string &channel) {
+    CHECK(_client) << "record messages need RTM connection";
+    CHECK(_output_config.output_path && _output_config.output_format != "replay")
+        << "clips are only written to video files";
+    LOG(INFO) << "keeping " << channel << " in memory until record messages";
+
+    auto trigger = std::make_shared<preroll_trigger>();
+    _record_messages_breaker = std::make_shared<streams::breaker>();
+    const preroll_config config = *_preroll;
+    (rtm::channel(_client, channel + control_channel_suffix, {})
+     >> streams::break_on(_record_messages_breaker))
+        ->process([config, trigger](rtm::channel_data &&data) {
+          handle_record_messages(data.payload, config, *trigger);
+        });
+
+    const fs::path path = *_output_config.output_path;
+    const bool fragmented = _output_config.output_format == "fmp4";
+    boost::optional<object_storage_config> storage;
+    if (is_object_url(path.string())) {
+      CHECK(_output_config.storage_config)
+          << "object storage output needs storage config";
+      storage = load_object_storage_config(*_output_config.storage_config);
+    }
+    const boost::optional<uring_file_options> uring =
+        cli_streams::uring_options(_output_config);
+    std::unordered_map<std::string, std::string> format_options;
+    if (_output_config.reserved_index_space) {
+      format_options["reserve_index_space"] =
+          std::to_string(*_output_config.reserved_index_space);
+    }
+    return preroll_sink(
+        config.options, trigger,
+        [path, fragmented, format_options, storage,
+         uring](std::chrono::system_clock::time_point start)
+            -> streams::subscriber<encoded_packet> & {
+          const fs::path clip = clip_path(path, start);
+          LOG(INFO) << "writing clip " << clip;
+          auto options = format_options;
+          if (storage) {
+            return object_storage_sink(*storage, clip, boost::none, std::move(options),
+                                       fragmented);
+          }
+          return video_file_sink(clip, boost::none, std::move(options), fragmented, 16,
+                                 uring);
+        });
+  }
+
   void on_next(encoded_packet &&pkt) override {
     CHECK(_subscription.is_initialized());
     CHECK(_sink.is_initialized());
@@ -200,6 +362,8 @@ class video_stream : private streams::subscriber<encoded_packet> {
   const cli_streams::output_video_config _output_config;
   const nlohmann::json _job{nullptr};
   const stream_done_callback_t _done_callback;
+  const boost::optional<preroll_config> _preroll;
+  std::shared_ptr<streams::breaker> _record_messages_breaker;
   boost::optional<streams::subscription &> _subscription;
   boost::optional<streams::subscriber<encoded_packet> &> _sink;
 };
@@ -208,7 +372,18 @@ class recorder_job_controller : public job_controller {
  public:
   recorder_job_controller(asio::io_service &io, std::shared_ptr<rtm::client> &client,
                           const recorder_configuration &config)
-      : _io{io}, _client{client}, _config{config} {}
+      : _io{io},
+        _client{client},
+        _config{config},
+        _start_interval{config.job_start_interval()},
+        _start_timer{io} {}
+
+  // drops jobs which are not started yet, they are reported in the shutdown note.
+  void stop() {
+    _pending.clear();
+    pending_jobs.Set(0);
+    _start_timer.cancel();
+  }
 
  private:
   /**
@@ -217,27 +392,83 @@ class recorder_job_controller : public job_controller {
    *   "channel": <string>,
    *   "segment-duration": <number> [OPTIONAL],
    *   "resolution": <string> [OPTIONAL],
-   *   "reserved-index-space": <number> [OPTIONAL]
+   *   "reserved-index-space": <number> [OPTIONAL],
+   *   "output-format": <string> [OPTIONAL],
+   *   "output-io": <string> [OPTIONAL]
    * }
    */
   void add_job(const nlohmann::json &job) override {
     LOG(INFO) << "got a job: " << job;
     CHECK(job.is_object()) << "job is not an object: " << job;
 
+    if (_start_interval.count() == 0) {
+      start_job(job);
+      return;
+    }
+
+    _pending.push_back(job);
+    pending_jobs.Increment();
+    if (!_starting) {
+      start_next_job();
+    }
+  }
+
+  // Starts one queued job per interval. RTM subscribes are pipelined by rtm client
+  // anyway, the interval spreads decoder, encoder and file creation of a burst of
+  // jobs, e.g. after a failover of another node.
+  void start_next_job() {
+    if (_pending.empty()) {
+      _starting = false;
+      return;
+    }
+
+    _starting = true;
+    const nlohmann::json job = std::move(_pending.front());
+    _pending.pop_front();
+    pending_jobs.Decrement();
+    start_job(job);
+
+    _start_timer.expires_from_now(_start_interval);
+    _start_timer.async_wait([this](const boost::system::error_code &ec) {
+      if (ec == asio::error::operation_aborted) {
+        _starting = false;
+        return;
+      }
+      CHECK(!ec) << "unexpected error: " << ec.message();
+      start_next_job();
+    });
+  }
+
+  void start_job(const nlohmann::json &job) {
     cli_streams::input_video_config input_config{job};
     CHECK(input_config.input_channel);
 
     LOG(INFO) << "channel name: " << escape_slashes(*input_config.input_channel);
+    const cli_streams::output_video_config pool_output_config =
+        _config.as_output_config();
+    nlohmann::json job_copy{job};
+    if (job_copy.find("output-format") == job_copy.end()) {
+      job_copy["output-format"] = pool_output_config.output_format;
+    }
+    if (job_copy.find("output-io") == job_copy.end()) {
+      job_copy["output-io"] = pool_output_config.output_io;
+    }
+    const std::string format = job_copy["output-format"].get<std::string>();
+    const std::string extension =
+        format == "replay" ? ".vreplay" : (format == "fmp4" ? ".mp4" : ".mkv");
     // TODO: ugly hack to make output path to be channel name
-    const fs::path output_path = *_config.as_output_config().output_path
-                                 / (escape_slashes(*input_config.input_channel) + ".mkv");
+    const fs::path output_path =
+        *pool_output_config.output_path
+        / (escape_slashes(*input_config.input_channel) + extension);
     LOG(INFO) << "output path: " << output_path;
-    nlohmann::json job_copy{job};
     job_copy["output-video-file"] = output_path.string();
+    if (pool_output_config.storage_config) {
+      job_copy["storage-config"] = *pool_output_config.storage_config;
+    }
     cli_streams::output_video_config output_config{job_copy};
 
     _streams.emplace_back(_io, _client, std::move(input_config), std::move(output_config),
-                          job, [](std::error_condition) {});
+                          job, [](std::error_condition) {}, _config.preroll());
   }
 
   void remove_job(const nlohmann::json &job) override {
@@ -250,6 +481,10 @@ class recorder_job_controller : public job_controller {
     for (const auto &s : _streams) {
       result.emplace_back(s.job());
     }
+    // queued jobs are assigned to this node already.
+    for (const auto &job : _pending) {
+      result.emplace_back(job);
+    }
 
     return result;
   }
@@ -259,6 +494,10 @@ class recorder_job_controller : public job_controller {
   asio::io_service &_io;
   std::shared_ptr<rtm::client> _client;
   std::list<video_stream> _streams;
+  const std::chrono::milliseconds _start_interval;
+  asio::steady_timer _start_timer;
+  std::deque<nlohmann::json> _pending;
+  bool _starting{false};
 };
 
 void request_rtm_client_stop(asio::io_service &io, std::shared_ptr<rtm::client> &client) {
@@ -289,7 +528,8 @@ void run_standalone(asio::io_service &io, std::shared_ptr<rtm::client> &client,
                                    LOG(INFO) << "stream completed successfully";
                                  }
                                  request_rtm_client_stop(io, client);
-                               }};
+                               },
+                               config.preroll()};
 
   signal::register_handler({SIGINT, SIGTERM, SIGQUIT},
                            [&recorded_stream, &io, &client](int /*signal*/) {
@@ -307,14 +547,18 @@ void run_pool(asio::io_service &io, std::shared_ptr<rtm::client> &client,
               const recorder_configuration &config) {
   recorder_job_controller recorder_controller{io, client, config};
   pool_job_controller job_controller{
-      io,     config.pool().get(), config.pool_job_type(), max_streams_capacity,
+      io,     config.pool().get(), config.pool_job_type(), config.pool_capacity(),
       client, recorder_controller};
 
   // Kubernetes sends SIGTERM, and then SIGKILL after 30 seconds
   // https://kubernetes.io/docs/concepts/workloads/pods/pod/#termination-of-pods
   signal::register_handler({SIGINT, SIGTERM, SIGQUIT},
-                           [&job_controller, &io, &client](int /*signal*/) {
+                           [&job_controller, &recorder_controller, &io,
+                            &client](int /*signal*/) {
                              job_controller.shutdown();
+                             io.post([&recorder_controller]() {
+                               recorder_controller.stop();
+                             });
                              request_rtm_client_stop(io, client);
                            });
 
@@ -0,0 +1,221 @@
+// Stream layer that batches small writes into larger ones.
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/beast/core/bind_handler.hpp>
+#include <boost/beast/websocket/ssl.hpp>
+#include <boost/beast/websocket/teardown.hpp>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "logging.h"
+
+namespace satori {
+namespace video {
+
+// Sits between websocket stream and its transport. While a write to the next layer
+// is in flight, following writes are copied into a buffer and accepted right away,
+// then the buffer is sent by a single write, so several websocket frames go out per
+// syscall. A write is held back only when buffered data reaches max batch size.
+// Accepted data is not on the socket yet, callers learn the outcome of its socket
+// write from on_written(). Failed write fails every buffered write and callback, the
+// stream is not usable after that. Synchronous writes are passed through and must not
+// be mixed with asynchronous ones.
+template <typename NextLayer>
+class coalescing_write_stream {
+ public:
+  using next_layer_type = typename std::remove_reference<NextLayer>::type;
+  using lowest_layer_type = typename next_layer_type::lowest_layer_type;
+  using executor_type = decltype(std::declval<next_layer_type &>().get_executor());
+
+  template <typename... Args>
+  explicit coalescing_write_stream(size_t max_batch_bytes, Args &&... args)
+      : _next_layer(std::forward<Args>(args)...), _max_batch_bytes(max_batch_bytes) {
+    _buffer.reserve(max_batch_bytes);
+  }
+
+  next_layer_type &next_layer() { return _next_layer; }
+  lowest_layer_type &lowest_layer() { return _next_layer.lowest_layer(); }
+  executor_type get_executor() { return _next_layer.get_executor(); }
+
+  template <typename MutableBufferSequence>
+  size_t read_some(const MutableBufferSequence &buffers) {
+    return _next_layer.read_some(buffers);
+  }
+
+  template <typename MutableBufferSequence>
+  size_t read_some(const MutableBufferSequence &buffers, boost::system::error_code &ec) {
+    return _next_layer.read_some(buffers, ec);
+  }
+
+  template <typename MutableBufferSequence, typename ReadHandler>
+  auto async_read_some(const MutableBufferSequence &buffers, ReadHandler &&handler) {
+    return _next_layer.async_read_some(buffers, std::forward<ReadHandler>(handler));
+  }
+
+  template <typename ConstBufferSequence>
+  size_t write_some(const ConstBufferSequence &buffers) {
+    check_no_async_writes();
+    return _next_layer.write_some(buffers);
+  }
+
+  template <typename ConstBufferSequence>
+  size_t write_some(const ConstBufferSequence &buffers, boost::system::error_code &ec) {
+    check_no_async_writes();
+    return _next_layer.write_some(buffers, ec);
+  }
+
+  template <typename ConstBufferSequence, typename WriteHandler>
+  auto async_write_some(const ConstBufferSequence &buffers, WriteHandler &&handler) {
+    using completion =
+        boost::asio::async_completion<WriteHandler,
+                                      void(boost::system::error_code, std::size_t)>;
+    using handler_type = typename completion::completion_handler_type;
+    completion init{handler};
+
+    if (_error) {
+      complete(std::move(init.completion_handler), _error, 0);
+      return init.result.get();
+    }
+
+    const size_t size = boost::asio::buffer_size(buffers);
+    const size_t offset = _buffer.size();
+    _buffer.resize(offset + size);
+    boost::asio::buffer_copy(boost::asio::buffer(&_buffer[offset], size), buffers);
+
+    if (!_flush_in_progress) {
+      flush();
+    }
+
+    if (_buffer.size() < _max_batch_bytes) {
+      complete(std::move(init.completion_handler), {}, size);
+    } else {
+      // callers don't issue concurrent writes, so at most one write waits.
+      CHECK(!_held_write) << "concurrent writes";
+      _held_write = std::make_unique<held_write<handler_type>>(
+          std::move(init.completion_handler), size, get_executor());
+    }
+    return init.result.get();
+  }
+
+  // Callback gets the result of socket write that carries all data accepted so far.
+  // It is invoked from completion of that write, or right away if there is nothing
+  // to wait for.
+  void on_written(std::function<void(boost::system::error_code)> &&callback) {
+    if (_error || (_buffer.empty() && !_flush_in_progress)) {
+      callback(_error);
+    } else if (_buffer.empty()) {
+      _flushing_callbacks.push_back(std::move(callback));
+    } else {
+      _buffer_callbacks.push_back(std::move(callback));
+    }
+  }
+
+ private:
+  struct held_write_base {
+    virtual ~held_write_base() = default;
+    virtual void complete(boost::system::error_code ec) = 0;
+  };
+
+  template <typename Handler>
+  struct held_write : held_write_base {
+    held_write(Handler &&handler, size_t size, executor_type executor)
+        : handler(std::move(handler)), size(size), executor(executor) {}
+
+    void complete(boost::system::error_code ec) override {
+      boost::asio::post(executor, boost::beast::bind_handler(std::move(handler), ec,
+                                                             ec ? 0 : size));
+    }
+
+    Handler handler;
+    const size_t size;
+    executor_type executor;
+  };
+
+  template <typename Handler>
+  void complete(Handler &&handler, boost::system::error_code ec, size_t size) {
+    boost::asio::post(get_executor(), boost::beast::bind_handler(
+                                          std::forward<Handler>(handler), ec, size));
+  }
+
+  void check_no_async_writes() const {
+    CHECK(!_flush_in_progress && _buffer.empty())
+        << "synchronous write during asynchronous one";
+  }
+
+  void flush() {
+    _flush_in_progress = true;
+    _flushing.swap(_buffer);
+    _flushing_callbacks.swap(_buffer_callbacks);
+    boost::asio::async_write(_next_layer, boost::asio::buffer(_flushing),
+                             [this](boost::system::error_code ec, size_t /*bytes*/) {
+                               on_flushed(ec);
+                             });
+  }
+
+  void on_flushed(boost::system::error_code ec) {
+    _flush_in_progress = false;
+    _flushing.clear();
+    std::vector<std::function<void(boost::system::error_code)>> written;
+    written.swap(_flushing_callbacks);
+    if (ec) {
+      LOG(2) << "coalesced write failed: [" << ec << "] " << ec.message();
+      _error = ec;
+      _buffer.clear();
+      std::move(_buffer_callbacks.begin(), _buffer_callbacks.end(),
+                std::back_inserter(written));
+      _buffer_callbacks.clear();
+    } else if (!_buffer.empty()) {
+      flush();
+    }
+
+    if (_held_write) {
+      std::unique_ptr<held_write_base> held = std::move(_held_write);
+      held->complete(_error);
+    }
+    // callbacks may write again, so they go last.
+    for (auto &callback : written) {
+      callback(ec);
+    }
+  }
+
+  NextLayer _next_layer;
+  const size_t _max_batch_bytes;
+  std::string _buffer;
+  std::string _flushing;
+  std::vector<std::function<void(boost::system::error_code)>> _buffer_callbacks;
+  std::vector<std::function<void(boost::system::error_code)>> _flushing_callbacks;
+  bool _flush_in_progress{false};
+  std::unique_ptr<held_write_base> _held_write;
+  boost::system::error_code _error;
+};
+
+// Websocket stream closes connection through these.
+template <typename NextLayer>
+void teardown(boost::beast::websocket::role_type role,
+              coalescing_write_stream<NextLayer> &stream,
+              boost::system::error_code &ec) {
+  using boost::beast::websocket::teardown;
+  teardown(role, stream.next_layer(), ec);
+}
+
+// Buffered frames, e.g. a close frame, are written before connection is closed.
+template <typename NextLayer, typename TeardownHandler>
+void async_teardown(boost::beast::websocket::role_type role,
+                    coalescing_write_stream<NextLayer> &stream,
+                    TeardownHandler &&handler) {
+  auto h = std::make_shared<typename std::decay<TeardownHandler>::type>(
+      std::forward<TeardownHandler>(handler));
+  stream.on_written([role, &stream, h](boost::system::error_code /*ec*/) {
+    using boost::beast::websocket::async_teardown;
+    async_teardown(role, stream.next_layer(), std::move(*h));
+  });
+}
+
+}  // namespace video
+}  // namespace satori
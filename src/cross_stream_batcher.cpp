@@ -0,0 +1,93 @@
+#include "cross_stream_batcher.h"
+
+#include "logging.h"
+#include "metrics.h"
+#include "stopwatch.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+auto &batch_size = prometheus::BuildHistogram()
+                       .Name("cross_stream_batch_size")
+                       .Register(metrics_registry())
+                       .Add({}, std::vector<double>{1, 2, 4, 8, 16, 24, 32, 48, 64, 128});
+
+auto &batch_processing_times_millis =
+    prometheus::BuildHistogram()
+        .Name("cross_stream_batch_processing_times_millis")
+        .Register(metrics_registry())
+        .Add({}, std::vector<double>{0,  1,  2,   5,   10,  15,  20,  25,  30,  40,
+                                     50, 75, 100, 150, 200, 300, 500, 750, 1000});
+
+auto &batch_wait_times_millis =
+    prometheus::BuildHistogram()
+        .Name("cross_stream_batch_wait_times_millis")
+        .Register(metrics_registry())
+        .Add({}, std::vector<double>{0,  1,  2,   5,   10,  15,  20,  25,  30,  40,
+                                     50, 75, 100, 150, 200, 300, 500, 750, 1000});
+
+}  // namespace
+
+cross_stream_batcher::cross_stream_batcher(multiframe_bot_batch_callback_t callback,
+                                           size_t max_batch,
+                                           std::chrono::milliseconds max_wait)
+    : _callback(std::move(callback)), _max_batch(max_batch), _max_wait(max_wait) {
+  CHECK(_callback) << "batch callback is not set";
+  CHECK_GT(_max_batch, 0);
+}
+
+void cross_stream_batcher::process(bot_context &context,
+                                   const gsl::span<image_frame> &frames) {
+  if (frames.empty()) {
+    return;
+  }
+
+  stopwatch<> s;
+  std::unique_lock<std::mutex> lock(_mutex);
+  if (_pending.empty()) {
+    _deadline = std::chrono::steady_clock::now() + _max_wait;
+  }
+  for (const image_frame &frame : frames) {
+    _pending.push_back(stream_frame{&context, frame});
+  }
+  // pending frames go to the batch after the last started one.
+  const uint64_t batch = _batches_started + 1;
+
+  while (_batches_done < batch) {
+    if (_batches_started >= batch || _running) {
+      _batch_done.wait(lock);
+      continue;
+    }
+    if (_pending.size() >= _max_batch
+        || std::chrono::steady_clock::now() >= _deadline) {
+      batch_wait_times_millis.Observe(s.millis());
+      run_batch(lock);
+      continue;
+    }
+    _batch_done.wait_until(lock, _deadline);
+  }
+}
+
+void cross_stream_batcher::run_batch(std::unique_lock<std::mutex> &lock) {
+  std::vector<stream_frame> frames;
+  frames.swap(_pending);
+  const uint64_t batch = ++_batches_started;
+  _running = true;
+  lock.unlock();
+
+  stopwatch<> s;
+  LOG(1) << "process cross-stream batch of " << frames.size() << " frames";
+  _callback(gsl::span<stream_frame>(frames));
+  batch_size.Observe(frames.size());
+  batch_processing_times_millis.Observe(s.millis());
+
+  lock.lock();
+  _running = false;
+  _batches_done = batch;
+  _batch_done.notify_all();
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <gsl/span>
+#include <mutex>
+#include <vector>
+
+#include "satorivideo/multiframe/bot.h"
+
+namespace satori {
+namespace video {
+
+// Collects frames of several bot instances into a single batch callback invocation.
+// Instances submit their frames and wait, the batch is processed on the thread of
+// the instance which fills it, or of the first one whose wait has expired.
+class cross_stream_batcher {
+ public:
+  cross_stream_batcher(multiframe_bot_batch_callback_t callback, size_t max_batch,
+                       std::chrono::milliseconds max_wait);
+
+  // blocks until callback has processed frames.
+  void process(bot_context &context, const gsl::span<image_frame> &frames);
+
+ private:
+  // has to be called with lock held, releases it while callback runs.
+  void run_batch(std::unique_lock<std::mutex> &lock);
+
+  const multiframe_bot_batch_callback_t _callback;
+  const size_t _max_batch;
+  const std::chrono::milliseconds _max_wait;
+
+  std::mutex _mutex;
+  std::condition_variable _batch_done;
+  std::vector<stream_frame> _pending;
+  std::chrono::steady_clock::time_point _deadline;
+  uint64_t _batches_started{0};
+  uint64_t _batches_done{0};
+  bool _running{false};
+};
+
+}  // namespace video
+}  // namespace satori
@@ -1,7 +1,10 @@
+#include <algorithm>
 #include <cmath>
 #include <gsl/gsl>
 
 #include "base64.h"
+#include "cbor_json.h"
+#include "cbor_reader.h"
 #include "data.h"
 #include "logging.h"
 
@@ -18,18 +21,46 @@ double time_point_to_value(std::chrono::system_clock::time_point p) {
   return timestamp;
 }
 
-std::chrono::system_clock::time_point json_to_time_point(const nlohmann::json &item) {
-  std::chrono::duration<double> double_duration(item.get<double>());
+// reads text or byte string into one of the strings.
+bool read_payload(cbor_reader &reader, std::string &base64_data,
+                  std::string &binary_data) {
+  const bool binary = reader.next_is_bytes();
+  boost::string_ref value;
+  if (!(binary ? reader.read_bytes(value) : reader.read_text(value))) {
+    return false;
+  }
+  (binary ? binary_data : base64_data).assign(value.data(), value.size());
+  return true;
+}
+
+const std::string binary_frame_key = std::string{"b"} + binary_key_suffix;
+const std::string binary_codec_data_key = std::string{"codecData"} + binary_key_suffix;
+
+std::chrono::system_clock::time_point value_to_time_point(double value) {
+  std::chrono::duration<double> double_duration(value);
   auto duration =
       std::chrono::duration_cast<std::chrono::system_clock::duration>(double_duration);
   return std::chrono::system_clock::time_point{duration};
 }
 
+std::chrono::system_clock::time_point json_to_time_point(const nlohmann::json &item) {
+  return value_to_time_point(item.get<double>());
+}
+
 }  // namespace
 
-nlohmann::json network_frame::to_json() const {
+nlohmann::json network_frame::to_json() const & {
+  network_frame copy = *this;
+  return std::move(copy).to_json();
+}
+
+nlohmann::json network_frame::to_json() && {
   nlohmann::json result = nlohmann::json::object();
-  result["b"] = base64_data;
+  if (binary_data.empty()) {
+    result["b"] = std::move(base64_data);
+  } else {
+    result[binary_frame_key] = std::move(binary_data);
+  }
   result["i"] = {id.i1, id.i2};
   result["t"] = time_point_to_value(t);
   result["dt"] = time_point_to_value(std::chrono::system_clock::now());
@@ -46,7 +77,11 @@ nlohmann::json network_frame::to_json() const {
 nlohmann::json network_metadata::to_json() const {
   nlohmann::json result = nlohmann::json::object();
   result["codecName"] = codec_name;
-  result["codecData"] = base64_data;
+  if (binary_data.empty()) {
+    result["codecData"] = base64_data;
+  } else {
+    result[binary_codec_data_key] = binary_data;
+  }
 
   if (!additional_data.is_null()) {
     CHECK(additional_data.is_object()) << "not an object: " << additional_data;
@@ -58,30 +93,44 @@ nlohmann::json network_metadata::to_json() const {
   return result;
 }
 
-network_metadata encoded_metadata::to_network() const {
+network_metadata encoded_metadata::to_network(payload_encoding encoding) const {
   network_metadata nm;
 
   nm.codec_name = codec_name;
-  if (!codec_data.empty()) {
-    nm.base64_data = base64::encode(codec_data);
+  if (encoding == payload_encoding::BINARY) {
+    nm.binary_data = codec_data.str();
+  } else if (!codec_data.empty()) {
+    nm.base64_data = base64::encode(codec_data.str());
   }
   nm.additional_data = additional_data;
 
   return nm;
 }
 
-std::vector<network_frame> encoded_frame::to_network() const {
+std::vector<network_frame> encoded_frame::to_network(payload_encoding encoding) const {
   std::vector<network_frame> frames;
 
-  constexpr auto max_chunk_size =
-      static_cast<size_t>(max_payload_size / base64::overhead);
+  const auto max_chunk_size =
+      encoding == payload_encoding::BINARY
+          ? max_payload_size
+          : static_cast<size_t>(max_payload_size / base64::overhead);
 
   const auto chunks =
-      static_cast<size_t>(std::ceil((double)data.length() / max_chunk_size));
+      static_cast<size_t>(std::ceil((double)data.size() / max_chunk_size));
 
+  frames.reserve(chunks);
   for (size_t i = 0; i < chunks; i++) {
+    // chunks are encoded right from frame data.
+    const size_t offset = i * max_chunk_size;
+    const size_t size = std::min(max_chunk_size, data.size() - offset);
+
     network_frame frame;
-    frame.base64_data = base64::encode(data.substr(i * max_chunk_size, max_chunk_size));
+    if (encoding == payload_encoding::BINARY) {
+      frame.binary_data.assign(data.data() + offset, size);
+    } else {
+      frame.base64_data.resize(base64::encoded_size(size));
+      base64::encode(data.data() + offset, size, &frame.base64_data[0]);
+    }
     frame.id = id;
     frame.t = timestamp;
     frame.chunk = static_cast<uint32_t>(i + 1);
@@ -94,15 +143,31 @@ std::vector<network_frame> encoded_frame::to_network() const {
   return frames;
 }
 
+bool is_key_frame(const encoded_packet &packet) {
+  const encoded_frame *frame = boost::get<encoded_frame>(&packet);
+  return frame == nullptr || frame->key_frame;
+}
+
 network_metadata parse_network_metadata(const nlohmann::json &item) {
   CHECK(item.find("codecName") != item.end()) << "bad item: " << item;
-  CHECK(item.find("codecData") != item.end()) << "bad item: " << item;
   auto &name = item["codecName"];
-  auto &base64_data = item["codecData"];
   CHECK(name.is_string()) << "bad item: " << item;
-  CHECK(base64_data.is_string()) << "bad item: " << item;
 
-  return network_metadata{name, base64_data};
+  network_metadata metadata;
+  metadata.codec_name = name;
+
+  auto binary_data = item.find(binary_codec_data_key);
+  if (binary_data != item.end()) {
+    CHECK(binary_data->is_string());
+    metadata.binary_data = *binary_data;
+    return metadata;
+  }
+
+  CHECK(item.find("codecData") != item.end()) << "bad item: " << item;
+  auto &base64_data = item["codecData"];
+  CHECK(base64_data.is_string()) << "bad item: " << item;
+  metadata.base64_data = base64_data;
+  return metadata;
 }
 
 network_frame parse_network_frame(const nlohmann::json &item) {
@@ -152,12 +217,17 @@ network_frame parse_network_frame(const nlohmann::json &item) {
     key_frame = k;
   }
 
-  CHECK(item.find("b") != item.end()) << "bad item: " << item;
-  auto &data = item["b"];
-  CHECK(data.is_string()) << "bad item: " << item;
-
   network_frame frame;
-  frame.base64_data = data;
+  auto binary_data = item.find(binary_frame_key);
+  if (binary_data != item.end()) {
+    CHECK(binary_data->is_string());
+    frame.binary_data = *binary_data;
+  } else {
+    CHECK(item.find("b") != item.end()) << "bad item: " << item;
+    auto &data = item["b"];
+    CHECK(data.is_string()) << "bad item: " << item;
+    frame.base64_data = data;
+  }
   frame.id = {i1, i2};
   frame.t = timestamp;
   frame.dt = departure_time;
@@ -168,6 +238,97 @@ network_frame parse_network_frame(const nlohmann::json &item) {
   return frame;
 }
 
+network_metadata parse_cbor_network_metadata(const std::string &data) {
+  cbor_reader reader{data.data(), data.size()};
+  uint64_t size;
+  CHECK(reader.read_map(size)) << "bad item: " << base64::encode(data);
+
+  network_metadata metadata;
+  bool has_name = false;
+  bool has_data = false;
+  for (uint64_t i = 0; i < size; i++) {
+    boost::string_ref key;
+    CHECK(reader.read_text(key)) << "bad item: " << base64::encode(data);
+
+    bool ok = true;
+    if (key == "codecName") {
+      boost::string_ref name;
+      ok = reader.read_text(name);
+      metadata.codec_name.assign(name.data(), name.size());
+      has_name = true;
+    } else if (key == "codecData") {
+      ok = read_payload(reader, metadata.base64_data, metadata.binary_data);
+      has_data = true;
+    } else {
+      ok = reader.skip();
+    }
+    CHECK(ok) << "bad item field " << key << ": " << base64::encode(data);
+  }
+  CHECK(has_name && has_data) << "bad item: " << base64::encode(data);
+
+  return metadata;
+}
+
+network_frame parse_cbor_network_frame(const std::string &data) {
+  cbor_reader reader{data.data(), data.size()};
+  uint64_t size;
+  CHECK(reader.read_map(size)) << "bad item: " << base64::encode(data);
+
+  network_frame frame;
+  bool has_id = false;
+  bool has_data = false;
+  bool has_timestamp = false;
+  bool has_departure_time = false;
+  for (uint64_t i = 0; i < size; i++) {
+    boost::string_ref key;
+    CHECK(reader.read_text(key)) << "bad item: " << base64::encode(data);
+
+    bool ok = true;
+    double value;
+    uint64_t id_size;
+    if (key == "b") {
+      ok = read_payload(reader, frame.base64_data, frame.binary_data);
+      has_data = true;
+    } else if (key == "i") {
+      ok = reader.read_array(id_size) && id_size == 2 && reader.read_int(frame.id.i1)
+           && reader.read_int(frame.id.i2);
+      has_id = true;
+    } else if (key == "t") {
+      ok = reader.read_number(value);
+      frame.t = value_to_time_point(value);
+      has_timestamp = true;
+    } else if (key == "dt") {
+      ok = reader.read_number(value);
+      frame.dt = value_to_time_point(value);
+      has_departure_time = true;
+    } else if (key == "c") {
+      // numbers might be sent as floating point values, see parse_network_frame.
+      ok = reader.read_number(value);
+      frame.chunk = static_cast<uint32_t>(value);
+    } else if (key == "l") {
+      ok = reader.read_number(value);
+      frame.chunks = static_cast<uint32_t>(value);
+    } else if (key == "k") {
+      ok = reader.read_bool(frame.key_frame);
+    } else {
+      ok = reader.skip();
+    }
+    CHECK(ok) << "bad item field " << key << ": " << base64::encode(data);
+  }
+  CHECK(has_id && has_data) << "bad item: " << base64::encode(data);
+
+  if (!has_timestamp) {
+    LOG(WARNING) << "network frame packet doesn't have timestamp";
+    frame.t = std::chrono::system_clock::now();
+  }
+  if (!has_departure_time) {
+    LOG(WARNING) << "network frame packet doesn't have departure time";
+    frame.dt = std::chrono::system_clock::now();
+  }
+
+  return frame;
+}
+
 }  // namespace video
 }  // namespace satori
 
@@ -187,4 +348,9 @@ std::ostream &operator<<(std::ostream &out,
 std::ostream &operator<<(std::ostream &out, const satori::video::image_size &size) {
   out << size.width << "x" << size.height;
   return out;
-}
\ No newline at end of file
+}
+
+std::ostream &operator<<(std::ostream &out, const satori::video::image_region &region) {
+  out << region.width << "x" << region.height << "+" << region.x << "+" << region.y;
+  return out;
+}
@@ -3,7 +3,9 @@
 #include <boost/optional.hpp>
 #include <boost/variant.hpp>
 #include <chrono>
+#include <cstring>
 #include <json.hpp>
+#include <memory>
 #include <ostream>
 #include <string>
 #include <vector>
@@ -25,22 +27,32 @@ inline std::ostream &operator<<(std::ostream &os, const frame_id &id) {
 
 inline bool operator!=(const frame_id &lhs, const frame_id &rhs) { return !(lhs == rhs); }
 
+inline bool operator<(const frame_id &lhs, const frame_id &rhs) {
+  return lhs.i1 < rhs.i1 || (lhs.i1 == rhs.i1 && lhs.i2 < rhs.i2);
+}
+
 static constexpr size_t max_payload_size = 65000;
 
-// network representation of codec parameters, e.g. in binary data
-// is converted into base64, because RTM supports only text/json data
+// Binary data is converted into base64, because RTM JSON protocol supports only text
+// data. Binary transports (CBOR) carry raw bytes instead.
+enum class payload_encoding { BASE64, BINARY };
+
+// network representation of codec parameters
 struct network_metadata {
   std::string codec_name;
   std::string base64_data;
+  // raw codec data, used instead of base64_data by binary payload encoding.
+  std::string binary_data;
   nlohmann::json additional_data;
 
   nlohmann::json to_json() const;
 };
 
-// network representation of encoded video frame, e.g. binary data
-// is converted into base64, because RTM supports only text/json data
+// network representation of encoded video frame
 struct network_frame {
   std::string base64_data;
+  // raw frame data, used instead of base64_data by binary payload encoding.
+  std::string binary_data;
   frame_id id{0, 0};
   std::chrono::system_clock::time_point t;  // PTS time
   std::chrono::system_clock::time_point dt;
@@ -51,7 +63,9 @@ struct network_frame {
   // time when frame came from source (for example, network, encoder or file)
   std::chrono::system_clock::time_point arrival_time;
 
-  nlohmann::json to_json() const;
+  nlohmann::json to_json() const &;
+  // moves payload into json.
+  nlohmann::json to_json() &&;
 };
 
 // algebraic type to support flow of network data using streams API
@@ -60,25 +74,90 @@ using network_packet = boost::variant<network_metadata, network_frame>;
 network_metadata parse_network_metadata(const nlohmann::json &item);
 network_frame parse_network_frame(const nlohmann::json &item);
 
+// parse packets right from CBOR messages, byte strings go to binary_data.
+network_metadata parse_cbor_network_metadata(const std::string &data);
+network_frame parse_cbor_network_frame(const std::string &data);
+
 // image size
 struct image_size {
   int16_t width;
   int16_t height;
 };
 
+inline bool operator==(const image_region &lhs, const image_region &rhs) {
+  return lhs.x == rhs.x && lhs.y == rhs.y && lhs.width == rhs.width
+         && lhs.height == rhs.height;
+}
+
+inline bool operator!=(const image_region &lhs, const image_region &rhs) {
+  return !(lhs == rhs);
+}
+
+// Immutable ref-counted bytes. Copies share the same buffer, so packets can be
+// passed to several sinks and threads without copying the payload. Bytes may live
+// in a buffer owned by someone else, e.g. a demuxed AVPacket.
+class shared_bytes {
+ public:
+  shared_bytes() = default;
+  shared_bytes(std::string &&data)  // NOLINT : implicit on purpose
+      : shared_bytes(std::make_shared<const std::string>(std::move(data))) {}
+  shared_bytes(const std::string &data)  // NOLINT : implicit on purpose
+      : shared_bytes(std::make_shared<const std::string>(data)) {}
+  shared_bytes(const char *data)  // NOLINT : implicit on purpose
+      : shared_bytes(std::make_shared<const std::string>(data)) {}
+  shared_bytes(const char *data, size_t size)
+      : shared_bytes(std::make_shared<const std::string>(data, size)) {}
+  // references size bytes at data, owner keeps them alive.
+  shared_bytes(std::shared_ptr<const void> owner, const char *data, size_t size)
+      : _owner(std::move(owner)), _data(data), _size(size) {}
+
+  // copies bytes.
+  std::string str() const { return std::string(data(), _size); }
+
+  const char *data() const { return _data != nullptr ? _data : ""; }
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+
+  bool operator==(const shared_bytes &other) const {
+    return _size == other._size
+           && (_data == other._data || std::memcmp(data(), other.data(), _size) == 0);
+  }
+  bool operator!=(const shared_bytes &other) const { return !(*this == other); }
+
+ private:
+  explicit shared_bytes(std::shared_ptr<const std::string> data)
+      : shared_bytes(data, data->data(), data->size()) {}
+
+  std::shared_ptr<const void> _owner;
+  const char *_data{nullptr};
+  size_t _size{0};
+};
+
+inline bool operator==(const shared_bytes &lhs, const std::string &rhs) {
+  return lhs.size() == rhs.size() && std::memcmp(lhs.data(), rhs.data(), rhs.size()) == 0;
+}
+
+inline bool operator==(const std::string &lhs, const shared_bytes &rhs) {
+  return rhs == lhs;
+}
+
+inline std::ostream &operator<<(std::ostream &out, const shared_bytes &bytes) {
+  return out << "<" << bytes.size() << " bytes>";
+}
+
 // codec parameters to decode encoded frames
 struct encoded_metadata {
   std::string codec_name;
-  std::string codec_data;
+  shared_bytes codec_data;
 
   nlohmann::json additional_data;
 
-  network_metadata to_network() const;
+  network_metadata to_network(payload_encoding encoding = payload_encoding::BASE64) const;
 };
 
 // encoded frame
 struct encoded_frame {
-  std::string data;
+  shared_bytes data;
   frame_id id;
 
   // PTS time
@@ -89,15 +168,51 @@ struct encoded_frame {
   // time when frame was generated by source (for example, network, encoder or file)
   std::chrono::system_clock::time_point creation_time;
 
-  std::vector<network_frame> to_network() const;
+  // chunks are larger for binary encoding, since there is no base64 overhead.
+  std::vector<network_frame> to_network(
+      payload_encoding encoding = payload_encoding::BASE64) const;
 };
 
 // algebraic type to support flow of encoded data using streams API
 using encoded_packet = boost::variant<encoded_metadata, encoded_frame>;
 
+// true for metadata and key frames, i.e. packets decoding can be started from.
+bool is_key_frame(const encoded_packet &packet);
+
 // TODO: may contain some data like FPS, etc.
 struct owned_image_metadata {};
 
+// Read-only view of image plane pixels. Keeps owner of the memory alive, so decoded
+// frames can reference decoder buffers instead of copying them.
+class image_plane {
+ public:
+  image_plane() = default;
+  image_plane(std::string &&data)  // NOLINT : implicit on purpose
+      : image_plane(std::make_shared<const std::string>(std::move(data))) {}
+  image_plane(std::shared_ptr<const void> owner, const uint8_t *data, size_t size)
+      : _owner(std::move(owner)), _data(data), _size(size) {}
+
+  // copies given pixels.
+  template <typename Iterator>
+  void assign(Iterator first, Iterator last) {
+    *this = image_plane{std::string(first, last)};
+  }
+
+  const uint8_t *data() const { return _data; }
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+  uint8_t operator[](size_t i) const { return _data[i]; }
+
+ private:
+  explicit image_plane(std::shared_ptr<const std::string> data)
+      : image_plane(data, reinterpret_cast<const uint8_t *>(data->data()),
+                    data->size()) {}
+
+  std::shared_ptr<const void> _owner;
+  const uint8_t *_data{nullptr};
+  size_t _size{0};
+};
+
 // If an image uses packed pixel format like packed RGB or packed YUV,
 // then it has only a single plane, e.g. all it's data is within plane_data[0].
 // If an image uses planar pixel format like planar YUV or HSV,
@@ -114,8 +229,15 @@ struct owned_image_frame {
   // image capture time
   std::chrono::system_clock::time_point timestamp;
 
-  std::string plane_data[max_image_planes];
+  image_plane plane_data[max_image_planes];
   uint32_t plane_strides[max_image_planes];
+
+  // planes are in CUDA device memory and can't be read on host,
+  // see decoder_options::keep_hw_frames.
+  bool on_device{false};
+
+  // exported by decoder, see decoder_options::export_motion_vectors.
+  std::shared_ptr<const std::vector<motion_vector>> motion_vectors;
 };
 
 // algebraic type to support flow of image data using streams API
@@ -131,3 +253,5 @@ std::ostream &operator<<(std::ostream &out,
                          const satori::video::encoded_metadata &metadata);
 
 std::ostream &operator<<(std::ostream &out, const satori::video::image_size &size);
+
+std::ostream &operator<<(std::ostream &out, const satori::video::image_region &region);
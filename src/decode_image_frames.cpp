@@ -1,34 +1,40 @@
 #include "video_streams.h"
 
-#include <sstream>
+#include <algorithm>
+#include <array>
+#include <map>
+#include <mutex>
+#include <tuple>
 
-#include "av_filter.h"
 #include "avutils.h"
+#include "decoded_frame.h"
+#include "frame_scaler.h"
 #include "metrics.h"
 #include "stopwatch.h"
 #include "video_error.h"
+#include "warm_pool.h"
 
 namespace satori {
 namespace video {
 
 namespace {
 
-auto &frames_received = prometheus::BuildCounter()
-                            .Name("decoder_frames_received_total")
-                            .Register(metrics_registry())
-                            .Add({});
-auto &messages_received = prometheus::BuildCounter()
-                              .Name("decoder_messages_received_total")
-                              .Register(metrics_registry())
-                              .Add({});
+sharded_counter frames_received{prometheus::BuildCounter()
+                                    .Name("decoder_frames_received_total")
+                                    .Register(metrics_registry())
+                                    .Add({})};
+sharded_counter messages_received{prometheus::BuildCounter()
+                                      .Name("decoder_messages_received_total")
+                                      .Register(metrics_registry())
+                                      .Add({})};
 auto &messages_dropped = prometheus::BuildCounter()
                              .Name("decoder_messages_dropped_total")
                              .Register(metrics_registry())
                              .Add({});
-auto &bytes_received = prometheus::BuildCounter()
-                           .Name("decoder_bytes_received_total")
-                           .Register(metrics_registry())
-                           .Add({});
+sharded_counter bytes_received{prometheus::BuildCounter()
+                                   .Name("decoder_bytes_received_total")
+                                   .Register(metrics_registry())
+                                   .Add({})};
 
 auto &send_packet_millis =
     prometheus::BuildHistogram()
@@ -43,42 +49,132 @@ auto &receive_frame_millis =
         .Add({}, std::vector<double>{0, 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 1, 2,
                                      5, 10, 20, 50, 100});
 
+auto &decoder_skip_frame = prometheus::BuildGauge()
+                               .Name("decoder_skip_frame")
+                               .Register(metrics_registry())
+                               .Add({});
+
 auto &decoder_errors =
     prometheus::BuildCounter().Name("decoder_errors_total").Register(metrics_registry());
 
-class image_decoder_op {
+auto &decoder_pool_requests = prometheus::BuildCounter()
+                                  .Name("decoder_pool_requests_total")
+                                  .Register(metrics_registry());
+
+// codec name, codec data, thread count, thread type, lowres, hardware device and
+// motion vectors export.
+using context_key =
+    std::tuple<std::string, std::string, int, int, int, const AVBufferRef *, bool>;
+
+warm_pool<context_key, AVCodecContext> &context_pool() {
+  static warm_pool<context_key, AVCodecContext> pool{2};
+  return pool;
+}
+
+// bounding size, pixel format and keep aspect ratio.
+using scaler_key = std::tuple<int16_t, int16_t, image_pixel_format, bool>;
+
+warm_pool<scaler_key, frame_scaler> &scaler_pool() {
+  static warm_pool<scaler_key, frame_scaler> pool{2};
+  return pool;
+}
+
+// devices live as long as process, so pooled contexts may be keyed by them.
+std::shared_ptr<AVBufferRef> shared_hw_device(const std::string &device_type) {
+  static std::mutex mutex;
+  static std::map<std::string, std::shared_ptr<AVBufferRef>> devices;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = devices.find(device_type);
+  if (it == devices.end()) {
+    // missing device is remembered too, it isn't looked up again.
+    it = devices.emplace(device_type, avutils::hw_device_context(device_type)).first;
+  }
+  return it->second;
+}
+
+// scaler is returned to the pool when the last stream using it is gone.
+std::shared_ptr<frame_scaler> take_scaler(const image_size &bounding_size,
+                                          image_pixel_format pixel_format,
+                                          bool keep_aspect_ratio,
+                                          std::shared_ptr<const crop_region> crop) {
+  const scaler_key key{bounding_size.width, bounding_size.height, pixel_format,
+                       keep_aspect_ratio};
+  std::shared_ptr<frame_scaler> scaler = scaler_pool().take(key);
+  decoder_pool_requests.Add({{"kind", "scaler"}, {"result", scaler ? "hit" : "miss"}})
+      .Increment();
+  if (!scaler) {
+    scaler = std::make_shared<frame_scaler>(bounding_size, pixel_format,
+                                            keep_aspect_ratio);
+  }
+  scaler->set_crop(std::move(crop));
+
+  return std::shared_ptr<frame_scaler>(scaler.get(), [key, scaler](frame_scaler *) {
+    scaler->set_crop(nullptr);
+    scaler_pool().put(key, std::shared_ptr<frame_scaler>(scaler));
+  });
+}
+
+// Ids of packets sent to decoder, by sequence numbers which go through decoder as
+// reordered_opaque. Decoded frames get ids of their own packets even when decoder
+// reorders, holds or skips frames. Ids of packets which didn't produce a frame are
+// overwritten, so memory is bounded.
+class packet_ids {
  public:
-  image_decoder_op(const image_size &bounding_size, image_pixel_format pixel_format,
-                   bool keep_aspect_ratio)
-      : _bounding_size{bounding_size},
-        _pixel_format{pixel_format},
-        _keep_aspect_ratio{keep_aspect_ratio} {}
+  void put(int64_t seq, const frame_id &id) {
+    entry &e = _entries[static_cast<uint64_t>(seq) % _entries.size()];
+    e.seq = seq;
+    e.id = id;
+  }
+
+  // returns false if decoder held the packet longer than the ring covers.
+  bool take(int64_t seq, frame_id &id) {
+    entry &e = _entries[static_cast<uint64_t>(seq) % _entries.size()];
+    if (e.seq != seq) {
+      return false;
+    }
+    e.seq = -1;
+    id = e.id;
+    return true;
+  }
+
+ private:
+  struct entry {
+    int64_t seq{-1};
+    frame_id id;
+  };
+
+  // well above the number of frames decoder delays, for threads and reordering.
+  std::array<entry, 256> _entries;
+};
+
+class frame_decoder_op {
+ public:
+  explicit frame_decoder_op(const decoder_options &options) : _options{options} {}
 
   template <typename T>
   class instance : public streams::subscriber<encoded_packet>,
-                   streams::impl::drain_source_impl<owned_image_packet>,
+                   streams::impl::drain_source_impl<decoded_frame>,
                    boost::static_visitor<void> {
     static_assert(std::is_same<T, encoded_packet>::value, "types mismatch");
-    using value_t = owned_image_packet;
+    using value_t = decoded_frame;
 
    public:
-    static streams::publisher<owned_image_packet> apply(
-        streams::publisher<encoded_packet> &&source, image_decoder_op &&op) {
-      return streams::publisher<owned_image_packet>(
-          new streams::impl::op_publisher<T, owned_image_packet, image_decoder_op>(
+    static streams::publisher<decoded_frame> apply(
+        streams::publisher<encoded_packet> &&source, frame_decoder_op &&op) {
+      return streams::publisher<decoded_frame>(
+          new streams::impl::op_publisher<T, decoded_frame, frame_decoder_op>(
               std::move(source), op));
     }
 
-    instance(image_decoder_op &&op, streams::subscriber<owned_image_packet> &sink)
-        : streams::impl::drain_source_impl<owned_image_packet>(sink),
-          _bounding_size{op._bounding_size},
-          _pixel_format{op._pixel_format},
-          _keep_aspect_ratio{op._keep_aspect_ratio} {}
+    instance(frame_decoder_op &&op, streams::subscriber<decoded_frame> &sink)
+        : streams::impl::drain_source_impl<decoded_frame>(sink), _options{op._options} {}
 
     ~instance() override {
       if (_source) {
         _source->cancel();
       }
+      release_context();
     }
 
    private:
@@ -126,24 +222,44 @@ class image_decoder_op {
         return;
       }
 
+      // only codec context is replaced, packet ids, decimation and frame buffers are
+      // kept, scalers downstream reinitialize with the first frame of new size.
+      const bool reconfigured = static_cast<bool>(_context);
+      release_context();
       _current_metadata_frames_counter = 0;
       _metadata = m;
-      _context = avutils::decoder_context(m.codec_name, m.codec_data);
-      _packet = avutils::av_packet();
-      _frame = avutils::av_frame();
-      _filtered_frame = avutils::av_frame();
-      if (!_context || !_packet || !_frame || !_filtered_frame) {
+      _additional_data = std::make_shared<const nlohmann::json>(m.additional_data);
+      if (_options.hw_device_type && !_hw_device_requested) {
+        // missing device is not an error, decoder_context falls back to software.
+        _hw_device_requested = true;
+        _hw_device = shared_hw_device(*_options.hw_device_type);
+      }
+      _lowres = 0;
+      _context = create_context(_lowres);
+      if (_context && _options.motion_vectors_only) {
+        // motion vectors are read from the bitstream, pixels are not used.
+        _context->skip_loop_filter = AVDISCARD_ALL;
+      }
+      _lowres_pending = _context && _options.lowres_size && supports_lowres(*_context);
+      if (!_packet) {
+        _packet = avutils::av_packet();
+      }
+      if (!_frame) {
+        _frame = avutils::av_frame();
+      }
+      if (!_context || !_packet || !_frame) {
         deliver_on_error(video_error::STREAM_INITIALIZATION_ERROR);
         return;
       }
 
-      LOG(INFO) << _metadata.codec_name << " video decoder initialized";
+      LOG(INFO) << _metadata.codec_name << " video decoder "
+                << (reconfigured ? "reconfigured" : "initialized");
     }
 
     void operator()(const encoded_frame &f) {
       LOG(4) << this << " on_image_frame";
-      messages_received.Increment();
-      bytes_received.Increment(f.data.size());
+      messages_received.increment();
+      bytes_received.increment(f.data.size());
 
       if (!_context) {
         LOG(WARNING) << "dropping frame because there is no codec context";
@@ -154,7 +270,6 @@ class image_decoder_op {
       {
         stopwatch<> s;
         av_init_packet(_packet.get());
-        _ids.push(f.id);
         _packet->flags |= f.key_frame ? AV_PKT_FLAG_KEY : 0;
         _packet->data = (uint8_t *)f.data.data();
         _packet->size = static_cast<int>(f.data.size());
@@ -165,11 +280,25 @@ class image_decoder_op {
                 f.timestamp.time_since_epoch())
                 .count();
 
+        // crop region is in source pixels, so cropped frames are decoded in full.
+        const bool cropped = _options.crop && _options.crop->get();
+        if (_lowres > 0 && cropped) {
+          switch_lowres(0);
+          _lowres_pending = true;
+        } else if (_lowres_pending && !cropped) {
+          _lowres_pending = false;
+          switch_lowres(probe_lowres(*_packet));
+        }
+
         if (_current_metadata_frames_counter % 1000 == 0) {
           LOG(INFO) << "CURRENT metadata is " << _metadata
                     << ", frames_counter=" << _current_metadata_frames_counter;
         }
         _current_metadata_frames_counter++;
+        update_input_interval(_packet->pts);
+        update_skip_frame();
+        _packet_ids.put(_next_packet_seq, f.id);
+        _context->reordered_opaque = _next_packet_seq++;
         // TODO: wrap avcodec_send_packet() into C++ function that returns error_condition
         int err = avcodec_send_packet(_context.get(), _packet.get());
         av_packet_unref(_packet.get());
@@ -231,110 +360,346 @@ class image_decoder_op {
         }
       }
       receive_frame_millis.Observe(s.millis());
+      if (decimated(*_frame)) {
+        av_frame_unref(_frame.get());
+        if (_options.on_decimated) {
+          _options.on_decimated();
+        }
+        return {};
+      }
       deliver_frame();
       return {};
     }
 
-    void deliver_frame() {
-      if (!_filter) {
-        init_filter();
+    context_key key_for(int lowres) const {
+      return context_key{_metadata.codec_name,
+                         _metadata.codec_data.str(),
+                         _options.thread_count,
+                         _options.frame_threading ? FF_THREAD_FRAME | FF_THREAD_SLICE
+                                                  : FF_THREAD_SLICE,
+                         lowres,
+                         _hw_device.get(),
+                         _options.export_motion_vectors};
+    }
+
+    // takes warm context left by a finished stream if there is one.
+    std::shared_ptr<AVCodecContext> create_context(int lowres) {
+      const context_key key = key_for(lowres);
+      std::shared_ptr<AVCodecContext> context = context_pool().take(key);
+      decoder_pool_requests
+          .Add({{"kind", "decoder"}, {"result", context ? "hit" : "miss"}})
+          .Increment();
+      if (context) {
+        LOG(INFO) << this << " reusing " << _metadata.codec_name << " decoder context";
+        return context;
       }
+      return avutils::decoder_context(_metadata.codec_name, std::get<1>(key),
+                                      std::get<2>(key), std::get<3>(key), _hw_device,
+                                      lowres, std::get<6>(key));
+    }
 
-      _filter->feed(*_frame);
-      frames_received.Increment();
+    void release_context() {
+      if (!_context) {
+        return;
+      }
+      avcodec_flush_buffers(_context.get());
+      _context->skip_frame = AVDISCARD_DEFAULT;
+      _context->skip_loop_filter = AVDISCARD_DEFAULT;
+      context_pool().put(key_for(_lowres), std::move(_context));
+      _context.reset();
+    }
 
-      while (_filter->try_retrieve(*_filtered_frame)) {
-        owned_image_frame frame = avutils::to_image_frame(*_filtered_frame);
+    void switch_lowres(int lowres) {
+      if (lowres == _lowres) {
+        return;
+      }
+      auto context = create_context(lowres);
+      if (!context) {
+        return;
+      }
+      // frames buffered by old context are lost.
+      release_context();
+      _context = std::move(context);
+      _lowres = lowres;
+    }
 
-        if (!_ids.empty()) {
-          frame.id = _ids.front();
-          _ids.pop();
-        } else {
-          LOG(ERROR) << this << "id queue is empty";
-          frame.id = {_filtered_frame->pkt_pos,
-                      _filtered_frame->pkt_pos + _filtered_frame->pkt_duration};
-        }
+    // lowres is safe to switch on between frames only when every frame is a key frame.
+    static bool supports_lowres(const AVCodecContext &context) {
+      const AVCodecDescriptor *desc = avcodec_descriptor_get(context.codec_id);
+      return context.codec->max_lowres > 0 && desc != nullptr
+             && (desc->props & AV_CODEC_PROP_INTRA_ONLY) != 0;
+    }
 
-        while (_filtered_frame->key_frame != 0 && _filtered_frame->pkt_pos != frame.id.i1
-               && !_ids.empty()) {
-          frame.id = _ids.front();
-          _ids.pop();
+    // decodes first frame by a separate context to find out its size.
+    int probe_lowres(const AVPacket &packet) {
+      const std::string codec_data = _metadata.codec_data.str();
+      auto probe = avutils::decoder_context(_metadata.codec_name, codec_data, 1);
+      auto frame = avutils::av_frame();
+      if (!probe || !frame || avcodec_send_packet(probe.get(), &packet) < 0
+          || avcodec_receive_frame(probe.get(), frame.get()) < 0) {
+        LOG(WARNING) << this << " failed to probe frame size, lowres is not used";
+        return 0;
+      }
+
+      const image_size &size = *_options.lowres_size;
+      int lowres = probe->codec->max_lowres;
+      for (; lowres > 0; lowres--) {
+        const bool fits_width =
+            size.width <= 0 || AV_CEIL_RSHIFT(frame->width, lowres) >= size.width;
+        const bool fits_height =
+            size.height <= 0 || AV_CEIL_RSHIFT(frame->height, lowres) >= size.height;
+        if (fits_width && fits_height) {
+          break;
         }
+      }
+      LOG(INFO) << this << " decoding " << frame->width << "x" << frame->height
+                << " frames with lowres " << lowres << " for " << size;
+      return lowres;
+    }
 
-        av_frame_unref(_filtered_frame.get());
-        deliver_on_next(owned_image_packet{std::move(frame)});
+    // keeps average interval between input frames while max_fps is set.
+    void update_input_interval(int64_t pts) {
+      if (_options.max_fps <= 0) {
+        return;
+      }
+      if (_last_packet_pts != AV_NOPTS_VALUE && pts > _last_packet_pts) {
+        const double interval = static_cast<double>(pts - _last_packet_pts);
+        _input_interval_millis = _input_interval_millis > 0
+                                     ? 0.9 * _input_interval_millis + 0.1 * interval
+                                     : interval;
       }
+      _last_packet_pts = pts;
     }
 
-    void init_filter() {
-      std::ostringstream filter_buffer;
-
-      const auto &additional = _metadata.additional_data;
-      if (additional.is_object()
-          && additional.find("display_rotation") != additional.end()) {
-        const double display_rotation = additional["display_rotation"];
-        LOG(INFO) << "display rotation angle " << display_rotation;
-
-        if (std::abs(display_rotation - 90) < 1.0) {
-          filter_buffer << "transpose=clock";
-        } else if (std::abs(display_rotation - 180) < 1.0) {
-          filter_buffer << "hflip,vflip";
-        } else if (std::abs(display_rotation - 270) < 1.0) {
-          filter_buffer << "transpose=cclock";
-        } else if (std::abs(display_rotation) > 1.0) {
-          // TODO: floating point formatting?
-          filter_buffer << "rotate=" << display_rotation << "*PI/180";
-        }
+    // non-reference frames are not decoded while max_fps is well below input rate.
+    AVDiscard decimation_skip_frame() const {
+      if (_options.max_fps <= 0 || _input_interval_millis <= 0) {
+        return AVDISCARD_DEFAULT;
       }
+      return 1000.0 / _input_interval_millis >= 2 * _options.max_fps ? AVDISCARD_NONREF
+                                                                     : AVDISCARD_DEFAULT;
+    }
 
-      if (filter_buffer.tellp() > 0) {
-        filter_buffer << ",";
+    // drops frames coming sooner than 1/max_fps after the previous delivered one,
+    // delivered frames keep max_fps on average.
+    bool decimated(const AVFrame &frame) {
+      if (_options.max_fps <= 0) {
+        return false;
       }
-      filter_buffer << "scale=";
-      filter_buffer << "w=" << _bounding_size.width << ":h=" << _bounding_size.height;
-      if (_keep_aspect_ratio) {
-        filter_buffer << ":force_original_aspect_ratio=decrease";
+      const int64_t pts =
+          frame.pts != AV_NOPTS_VALUE ? frame.pts : frame.best_effort_timestamp;
+      if (pts == AV_NOPTS_VALUE) {
+        return false;
       }
 
-      CHECK_GT(filter_buffer.tellp(), 0);
-      const std::string filter_string = filter_buffer.str();
-      LOG(INFO) << "got a filter: " << filter_string;
+      const double interval = 1000.0 / _options.max_fps;
+      if (_next_frame_pts != AV_NOPTS_VALUE && pts >= _last_frame_pts
+          && pts < _next_frame_pts) {
+        return true;
+      }
+      // timestamps going back start over, like when input is restarted.
+      _next_frame_pts =
+          _next_frame_pts != AV_NOPTS_VALUE && pts >= _last_frame_pts
+                  && pts < _next_frame_pts + static_cast<int64_t>(interval)
+              ? _next_frame_pts + static_cast<int64_t>(interval)
+              : pts + static_cast<int64_t>(interval);
+      _last_frame_pts = pts;
+      return false;
+    }
+
+    // sheds decoding work while downstream worker falls behind.
+    void update_skip_frame() {
+      const AVDiscard base = decimation_skip_frame();
+      AVDiscard skip = std::max(_context->skip_frame, base);
+      if (_options.downstream_queue && _options.skip_threshold > 0) {
+        const size_t depth = _options.downstream_queue->load(std::memory_order_relaxed);
+        if (depth >= 2 * _options.skip_threshold) {
+          skip = AVDISCARD_NONKEY;
+        } else if (depth >= _options.skip_threshold && skip == base) {
+          skip = std::max(base, AVDISCARD_NONREF);
+        } else if (depth == 0) {
+          skip = base;
+        }
+      } else {
+        skip = base;
+      }
+      if (skip == _context->skip_frame) {
+        return;
+      }
+
+      LOG(INFO) << this << " skip_frame " << _context->skip_frame << " -> " << skip;
+      _context->skip_frame = skip;
+      decoder_skip_frame.Set(skip);
+    }
+
+    void deliver_frame() {
+      const frame_id id = next_id(*_frame);
+      // decoded frame keeps its own reference, so several outputs may convert it.
+      std::shared_ptr<AVFrame> decoded = avutils::av_frame();
+      if (!decoded) {
+        deliver_on_error(video_error::FRAME_GENERATION_ERROR);
+        return;
+      }
+      if (_frame->hw_frames_ctx != nullptr && !_options.keep_hw_frames) {
+        const int err = avutils::download_hw_frame(*_frame, *decoded);
+        av_frame_unref(_frame.get());
+        if (err < 0) {
+          decoder_errors
+              .Add({{"err", std::to_string(err)}, {"call", "av_hwframe_transfer_data"}})
+              .Increment();
+          return;
+        }
+      } else {
+        av_frame_move_ref(decoded.get(), _frame.get());
+      }
+      frames_received.increment();
+
+      decoded_frame frame;
+      frame.id = id;
+      frame.frame = std::move(decoded);
+      frame.time_base = _context->time_base;
+      frame.additional_data = _additional_data;
+      deliver_on_next(std::move(frame));
+    }
 
-      _filter = std::make_unique<av_filter>(filter_string, *_frame, _context->time_base,
-                                            _pixel_format);
+    frame_id next_id(const AVFrame &decoded) {
+      frame_id id;
+      if (!_packet_ids.take(decoded.reordered_opaque, id)) {
+        LOG(WARNING) << this << " no packet id for decoded frame";
+        id = {decoded.pkt_pos, decoded.pkt_pos + decoded.pkt_duration};
+      }
+      return id;
     }
 
-    const image_size _bounding_size;
-    const image_pixel_format _pixel_format;
-    const bool _keep_aspect_ratio;
+    const decoder_options _options;
     streams::subscription *_source{nullptr};
     uint64_t _current_metadata_frames_counter{0};
     encoded_metadata _metadata;
+    std::shared_ptr<const nlohmann::json> _additional_data;
     std::shared_ptr<AVCodecContext> _context;
     std::shared_ptr<AVPacket> _packet;
     std::shared_ptr<AVFrame> _frame;
-    std::shared_ptr<AVFrame> _filtered_frame;
-    std::unique_ptr<av_filter> _filter;
-    std::queue<frame_id> _ids;
+    bool _hw_device_requested{false};
+    std::shared_ptr<AVBufferRef> _hw_device;
+    int _lowres{0};
+    bool _lowres_pending{false};
+    packet_ids _packet_ids;
+    int64_t _next_packet_seq{0};
+
+    // decimation by max_fps, timestamps are in milliseconds.
+    int64_t _last_packet_pts{AV_NOPTS_VALUE};
+    double _input_interval_millis{0};
+    int64_t _last_frame_pts{AV_NOPTS_VALUE};
+    int64_t _next_frame_pts{AV_NOPTS_VALUE};
   };
 
  private:
-  const image_size _bounding_size;
-  const image_pixel_format _pixel_format;
-  const bool _keep_aspect_ratio;
+  const decoder_options _options;
 };
 
+// frames kept on device by keep_hw_frames are delivered as they are, if bots can
+// take them, others are downloaded and scaled.
+boost::optional<owned_image_frame> device_image(const decoded_frame &frame,
+                                                frame_scaler &scaler) {
+  boost::optional<owned_image_frame> image = avutils::to_device_image_frame(*frame.frame);
+  if (image) {
+    image->id = frame.id;
+    return image;
+  }
+
+  std::shared_ptr<AVFrame> downloaded = avutils::av_frame();
+  if (!downloaded) {
+    return boost::none;
+  }
+  const int err = avutils::download_hw_frame(*frame.frame, *downloaded);
+  if (err < 0) {
+    decoder_errors
+        .Add({{"err", std::to_string(err)}, {"call", "av_hwframe_transfer_data"}})
+        .Increment();
+    return boost::none;
+  }
+  decoded_frame host_frame = frame;
+  host_frame.frame = std::move(downloaded);
+  return scaler.convert(host_frame);
+}
+
+// frame without planes, for motion_vectors_only.
+owned_image_frame motion_vectors_image(const decoded_frame &frame,
+                                       image_pixel_format pixel_format) {
+  owned_image_frame image{};
+  image.id = frame.id;
+  image.pixel_format = pixel_format;
+  image.width = static_cast<uint16_t>(frame.frame->width);
+  image.height = static_cast<uint16_t>(frame.frame->height);
+  image.timestamp =
+      std::chrono::system_clock::time_point{std::chrono::milliseconds(frame.frame->pts)};
+  image.motion_vectors = avutils::motion_vectors(*frame.frame);
+  return image;
+}
+
 }  // namespace
 
+streams::op<encoded_packet, decoded_frame> decode_frames(const decoder_options &options) {
+  avutils::init();
+
+  return [options](streams::publisher<encoded_packet> &&src) {
+    return std::move(src) >> frame_decoder_op(options);
+  };
+}
+
 streams::op<encoded_packet, owned_image_packet> decode_image_frames(
     const image_size &bounding_size, image_pixel_format pixel_format,
-    bool keep_aspect_ratio) {
-  avutils::init();
+    bool keep_aspect_ratio, const decoder_options &options) {
+  decoder_options decode_options = options;
+  if (decode_options.motion_vectors_only) {
+    // hardware decoders don't export motion vectors.
+    decode_options.export_motion_vectors = true;
+    decode_options.hw_device_type = boost::none;
+    decode_options.keep_hw_frames = false;
+  } else if (!decode_options.lowres_size
+             && (bounding_size.width > 0 || bounding_size.height > 0)) {
+    decode_options.lowres_size = bounding_size;
+  }
+
+  return [bounding_size, pixel_format, keep_aspect_ratio,
+          options = decode_options](streams::publisher<encoded_packet> &&src)
+             -> streams::publisher<owned_image_packet> {
+    if (options.motion_vectors_only) {
+      return std::move(src) >> decode_frames(options)
+             >> streams::map([pixel_format](decoded_frame &&frame) {
+                 return owned_image_packet{motion_vectors_image(frame, pixel_format)};
+               });
+    }
 
-  return [bounding_size, pixel_format,
-          keep_aspect_ratio](streams::publisher<encoded_packet> &&src) {
-    return std::move(src)
-           >> image_decoder_op(bounding_size, pixel_format, keep_aspect_ratio);
+    const bool export_motion_vectors = options.export_motion_vectors;
+    auto scaler =
+        take_scaler(bounding_size, pixel_format, keep_aspect_ratio, options.crop);
+    return std::move(src) >> decode_frames(options)
+           >> streams::filter_map(
+                  [scaler, export_motion_vectors](
+                      decoded_frame &&frame) -> boost::optional<owned_image_packet> {
+                    if (frame.frame->hw_frames_ctx != nullptr) {
+                      boost::optional<owned_image_frame> image =
+                          device_image(frame, *scaler);
+                      if (!image) {
+                        return boost::none;
+                      }
+                      return owned_image_packet{std::move(*image)};
+                    }
+                    boost::optional<owned_image_frame> image = scaler->convert(frame);
+                    if (!image) {
+                      LOG(ERROR) << "failed to convert decoded frame";
+                      decoder_errors
+                          .Add({{"err", std::to_string(AVERROR(ENOMEM))},
+                                {"call", "frame_scaler"}})
+                          .Increment();
+                      return boost::none;
+                    }
+                    if (export_motion_vectors) {
+                      image->motion_vectors = avutils::motion_vectors(*frame.frame);
+                    }
+                    return owned_image_packet{std::move(*image)};
+                  });
   };
 }
 
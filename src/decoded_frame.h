@@ -0,0 +1,30 @@
+#pragma once
+
+#include <json.hpp>
+#include <memory>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "data.h"
+#include "streams/streams.h"
+#include "video_streams.h"
+
+namespace satori {
+namespace video {
+
+// frame in decoder's own size and pixel format, see frame_scaler.
+struct decoded_frame {
+  std::shared_ptr<const AVFrame> frame;
+  frame_id id;
+  AVRational time_base;
+  // additional_data of stream metadata, shared by all frames decoded with it.
+  std::shared_ptr<const nlohmann::json> additional_data;
+};
+
+// decode_image_frames without scaling, lets several outputs share one decoder.
+streams::op<encoded_packet, decoded_frame> decode_frames(const decoder_options &options);
+
+}  // namespace video
+}  // namespace satori
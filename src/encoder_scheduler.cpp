@@ -0,0 +1,139 @@
+#include "encoder_scheduler.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "logging.h"
+#include "metrics.h"
+#include "streams/executor.h"
+#include "streams/threaded_worker.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+auto &encoder_slot_channels = prometheus::BuildGauge()
+                                  .Name("encoder_slot_channels")
+                                  .Register(metrics_registry());
+
+auto &encoder_slot_queue_depth = prometheus::BuildGauge()
+                                     .Name("encoder_slot_queue_depth")
+                                     .Register(metrics_registry());
+
+}  // namespace
+
+struct encoder_scheduler::slot {
+  explicit slot(size_t index)
+      : name{"encoder_" + std::to_string(index)},
+        executor{name, 1},
+        channels_gauge{encoder_slot_channels.Add({{"slot", std::to_string(index)}})},
+        depth_gauge{encoder_slot_queue_depth.Add({{"slot", std::to_string(index)}})} {}
+
+  // frames queued by all channels of the slot.
+  size_t queue_depth() const {
+    size_t result = 0;
+    for (const auto &d : depths) {
+      result += d->load(std::memory_order_relaxed);
+    }
+    return result;
+  }
+
+  const std::string name;
+  streams::executor executor;
+  prometheus::Gauge &channels_gauge;
+  prometheus::Gauge &depth_gauge;
+  // of every channel in the slot, guarded by scheduler mutex.
+  std::vector<std::shared_ptr<streams::queue_depth>> depths;
+};
+
+struct encoder_scheduler::assignment {
+  std::string channel;
+  std::shared_ptr<slot> assigned_slot;
+  std::shared_ptr<streams::queue_depth> depth;
+};
+
+encoder_scheduler::encoder_scheduler(size_t slots) {
+  CHECK_GT(slots, 0);
+  for (size_t i = 0; i < slots; i++) {
+    _slots.push_back(std::make_shared<slot>(i));
+  }
+}
+
+encoder_scheduler::~encoder_scheduler() = default;
+
+encoder_scheduler &encoder_scheduler::shared() {
+  static encoder_scheduler scheduler{std::max(1u, std::thread::hardware_concurrency())};
+  return scheduler;
+}
+
+int encoder_scheduler::encoder_threads() const {
+  const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+  return static_cast<int>(std::max<size_t>(1, cores / _slots.size()));
+}
+
+std::vector<size_t> encoder_scheduler::slot_channels() const {
+  std::lock_guard<std::mutex> guard(_mutex);
+  std::vector<size_t> result;
+  for (const auto &s : _slots) {
+    result.push_back(s->depths.size());
+  }
+  return result;
+}
+
+std::shared_ptr<encoder_scheduler::assignment> encoder_scheduler::acquire(
+    const std::string &channel) {
+  std::lock_guard<std::mutex> guard(_mutex);
+  auto it = std::min_element(
+      _slots.begin(), _slots.end(),
+      [](const std::shared_ptr<slot> &lhs, const std::shared_ptr<slot> &rhs) {
+        if (lhs->depths.size() != rhs->depths.size()) {
+          return lhs->depths.size() < rhs->depths.size();
+        }
+        return lhs->queue_depth() < rhs->queue_depth();
+      });
+  auto a = std::make_shared<assignment>(
+      assignment{channel, *it, std::make_shared<streams::queue_depth>(0)});
+  a->assigned_slot->depths.push_back(a->depth);
+  a->assigned_slot->channels_gauge.Set(a->assigned_slot->depths.size());
+  LOG(INFO) << "channel " << channel << " is encoded on " << a->assigned_slot->name;
+  return a;
+}
+
+void encoder_scheduler::release(const assignment &a) {
+  std::lock_guard<std::mutex> guard(_mutex);
+  auto &depths = a.assigned_slot->depths;
+  auto it = std::find(depths.begin(), depths.end(), a.depth);
+  CHECK(it != depths.end());
+  depths.erase(it);
+  a.assigned_slot->channels_gauge.Set(depths.size());
+  a.assigned_slot->depth_gauge.Set(a.assigned_slot->queue_depth());
+  LOG(INFO) << "channel " << a.channel << " left " << a.assigned_slot->name;
+}
+
+void encoder_scheduler::update_depth(slot &s) {
+  std::lock_guard<std::mutex> guard(_mutex);
+  s.depth_gauge.Set(s.queue_depth());
+}
+
+streams::op<owned_image_packet, owned_image_packet> encoder_scheduler::schedule(
+    const std::string &channel, size_t max_queued_frames) {
+  return [this, channel,
+          max_queued_frames](streams::publisher<owned_image_packet> &&src) {
+    std::shared_ptr<assignment> a = acquire(channel);
+    slot &s = *a->assigned_slot;
+
+    return std::move(src)
+           >> streams::threaded_worker(s.executor, s.name + "_" + channel,
+                                       max_queued_frames,
+                                       streams::overflow_policy::DROP_NEWEST, a->depth)
+           >> streams::flatten() >> streams::map([this, a](owned_image_packet &&pkt) {
+               update_depth(*a->assigned_slot);
+               return std::move(pkt);
+             })
+           >> streams::do_finally([this, a]() { release(*a); });
+  };
+}
+
+}  // namespace video
+}  // namespace satori
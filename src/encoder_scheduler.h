@@ -0,0 +1,56 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "data.h"
+#include "streams/streams.h"
+
+namespace satori {
+namespace video {
+
+// Bounds the number of threads encoding video in a process. Each slot is a single
+// executor thread, channels are assigned to the slot with the least channels and
+// queued frames, and their encoders run on that thread. With a slot per core and
+// single-threaded encoders, throughput scales with cores instead of collapsing
+// when many channels oversubscribe the machine.
+class encoder_scheduler {
+ public:
+  explicit encoder_scheduler(size_t slots);
+  ~encoder_scheduler();
+
+  encoder_scheduler(const encoder_scheduler &) = delete;
+  encoder_scheduler &operator=(const encoder_scheduler &) = delete;
+
+  // process-wide scheduler with a slot per hardware core.
+  static encoder_scheduler &shared();
+
+  // moves frames to the thread of channel's slot, so the following encoder runs
+  // there. Up to max_queued_frames wait for the slot, newest ones are dropped
+  // after that. Channel leaves the slot when stream is over.
+  streams::op<owned_image_packet, owned_image_packet> schedule(
+      const std::string &channel, size_t max_queued_frames = 25);
+
+  // threads an encoder may use without oversubscribing cores.
+  int encoder_threads() const;
+
+  // number of channels in each slot.
+  std::vector<size_t> slot_channels() const;
+
+ private:
+  struct slot;
+
+  struct assignment;
+
+  std::shared_ptr<assignment> acquire(const std::string &channel);
+  void release(const assignment &a);
+  void update_depth(slot &s);
+
+  std::vector<std::shared_ptr<slot>> _slots;
+  mutable std::mutex _mutex;
+};
+
+}  // namespace video
+}  // namespace satori
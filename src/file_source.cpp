@@ -1,9 +1,18 @@
+#include <cmath>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <gsl/gsl>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 extern "C" {
 #include <libavutil/display.h>
 #include <libavutil/error.h>
@@ -12,6 +21,7 @@ extern "C" {
 #include "avutils.h"
 #include "logging.h"
 #include "streams/asio_streams.h"
+#include "threadutils.h"
 #include "video_error.h"
 #include "video_streams.h"
 
@@ -19,10 +29,22 @@ namespace satori {
 namespace video {
 namespace {
 
+// timestamp demuxer seeks by, decoding timestamp if it is known.
+int64_t packet_timestamp(const AVPacket &packet) {
+  return packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+}
+
 class file_source_impl {
  public:
-  file_source_impl(const std::string &filename, const bool loop)
-      : _filename(filename), _loop(loop), _start(std::chrono::system_clock::now()) {}
+  file_source_impl(const std::string &filename, const bool loop,
+                   const boost::optional<file_range> &range = boost::none,
+                   const file_segment &segment = file_segment{})
+      : _filename(filename),
+        _loop(loop),
+        _range(range),
+        _segment(segment),
+        _seek_to_segment(segment.first_frame > 1),
+        _start(std::chrono::system_clock::now()) {}
 
   std::error_condition init() {
     LOG(1) << "Opening file " << _filename;
@@ -70,6 +92,11 @@ class file_source_impl {
     return {};
   }
 
+  // byte offset of the next read in the file.
+  int64_t position() const {
+    return _fmt_ctx && _fmt_ctx->pb != nullptr ? avio_tell(_fmt_ctx->pb) : 0;
+  }
+
   void generate_one(streams::observer<encoded_packet> &observer) {
     if (_fmt_ctx == nullptr) {
       if (auto err = init()) {
@@ -87,6 +114,32 @@ class file_source_impl {
       return;
     }
 
+    if (_range) {
+      if (_last_pos == 0) {
+        start_range();
+      }
+      if (_last_pos >= _range->first_frame + _range->frames - 1) {
+        LOG(4) << "end of range in " << _filename;
+        observer.on_complete();
+        return;
+      }
+    }
+
+    if (_seek_to_segment) {
+      _seek_to_segment = false;
+      seek_segment();
+    }
+    if (_segment.last_frame && !_number_by_timestamp
+        && _last_pos >= *_segment.last_frame) {
+      if (_loop) {
+        restart();
+        return;
+      }
+      LOG(4) << "end of segment in " << _filename;
+      observer.on_complete();
+      return;
+    }
+
     av_init_packet(&_pkt);
     auto release = gsl::finally([this]() { av_packet_unref(&_pkt); });
 
@@ -94,9 +147,7 @@ class file_source_impl {
     if (ret < 0) {
       if (ret == AVERROR_EOF) {
         if (_loop) {
-          LOG(4) << "restarting " << _filename;
-          av_seek_frame(_fmt_ctx.get(), _stream_idx, _fmt_ctx->start_time,
-                        AVSEEK_FLAG_BACKWARD);
+          restart();
           return;
         }
 
@@ -110,9 +161,18 @@ class file_source_impl {
     }
 
     if (_pkt.stream_index == _stream_idx) {
+      if (!_range_key_frame_found && !is_range_key_frame(_pkt)) {
+        return;
+      }
+      _range_key_frame_found = true;
+      if (_number_by_timestamp) {
+        _number_by_timestamp = false;
+        _last_pos = frame_number(_pkt) - 1;
+        LOG(4) << "reading " << _filename << " from frame " << _last_pos + 1;
+      }
       LOG(4) << "packet from file " << _filename;
       encoded_frame frame;
-      frame.data = std::string{_pkt.data, _pkt.data + _pkt.size};
+      frame.data = avutils::packet_data(_pkt);
       _last_pos++;
       frame.id = {_last_pos, _last_pos};
       auto ts = 1000 * _pkt.pts * _stream->time_base.num / _stream->time_base.den;
@@ -126,8 +186,9 @@ class file_source_impl {
   void send_metadata(streams::observer<encoded_packet> &observer) {
     encoded_metadata metadata;
     metadata.codec_name = _dec->name;
-    metadata.codec_data.assign(_dec_ctx->extradata,
-                               _dec_ctx->extradata + _dec_ctx->extradata_size);
+    metadata.codec_data =
+        shared_bytes{reinterpret_cast<const char *>(_dec_ctx->extradata),
+                     static_cast<size_t>(_dec_ctx->extradata_size)};
     auto display_rotation = get_display_rotation();
     if (display_rotation.is_initialized()) {
       metadata.additional_data = nlohmann::json::object();
@@ -138,6 +199,73 @@ class file_source_impl {
   }
 
  private:
+  void restart() {
+    LOG(4) << "restarting " << _filename;
+    if (_segment.first_frame > 1) {
+      seek_segment();
+      return;
+    }
+    av_seek_frame(_fmt_ctx.get(), _stream_idx, _fmt_ctx->start_time,
+                  AVSEEK_FLAG_BACKWARD);
+    if (_segment.last_frame) {
+      // segment end is found by frame numbers.
+      _last_pos = 0;
+    }
+  }
+
+  int64_t stream_start() const {
+    return _stream->start_time != AV_NOPTS_VALUE ? _stream->start_time : 0;
+  }
+
+  // lands on the closest key frame before the first frame of segment, frames are
+  // numbered again from timestamp of the packet found there.
+  void seek_segment() {
+    const AVRational frame_duration = av_inv_q(_stream->avg_frame_rate);
+    const int64_t timestamp =
+        stream_start()
+        + av_rescale_q(_segment.first_frame - 1, frame_duration, _stream->time_base);
+    int ret = av_seek_frame(_fmt_ctx.get(), _stream_idx, timestamp, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+      LOG(WARNING) << "couldn't seek in " << _filename << ": " << avutils::error_msg(ret);
+      return;
+    }
+    _number_by_timestamp = true;
+  }
+
+  int64_t frame_number(const AVPacket &packet) const {
+    const int64_t timestamp =
+        packet.pts != AV_NOPTS_VALUE ? packet.pts : packet_timestamp(packet);
+    if (timestamp == AV_NOPTS_VALUE || _stream->avg_frame_rate.num == 0) {
+      return _last_pos + 1;
+    }
+    return 1
+           + av_rescale_q(timestamp - stream_start(), _stream->time_base,
+                          av_inv_q(_stream->avg_frame_rate));
+  }
+
+  void start_range() {
+    _last_pos = _range->first_frame - 1;
+    if (_range->first_frame == 1) {
+      return;
+    }
+    _range_key_frame_found = false;
+    // lands on the key frame or before it, packets in front of it are skipped.
+    int ret = av_seek_frame(_fmt_ctx.get(), _stream_idx, _range->key_frame_timestamp,
+                            AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+      LOG(WARNING) << "couldn't seek in " << _filename << ": " << avutils::error_msg(ret);
+    }
+  }
+
+  bool is_range_key_frame(const AVPacket &packet) const {
+    if ((packet.flags & AV_PKT_FLAG_KEY) == 0) {
+      return false;
+    }
+    return _range->key_frame_pos >= 0 ? packet.pos == _range->key_frame_pos
+                                      : packet_timestamp(packet)
+                                            == _range->key_frame_timestamp;
+  }
+
   // based on FFmpeg's get_rotation() function
   boost::optional<double> get_display_rotation() const {
     uint8_t *display_matrix =
@@ -159,6 +287,12 @@ class file_source_impl {
 
   const std::string _filename;
   const bool _loop{false};
+  const boost::optional<file_range> _range;
+  bool _range_key_frame_found{true};
+  const file_segment _segment;
+  bool _seek_to_segment{false};
+  // set after seeking, until the next packet of the stream tells its frame number.
+  bool _number_by_timestamp{false};
 
   std::chrono::system_clock::time_point _start;
   std::shared_ptr<AVFormatContext> _fmt_ctx;
@@ -171,6 +305,147 @@ class file_source_impl {
   bool _metadata_sent{false};
 };
 
+// Demuxes file on a thread of its own ahead of consumer, so reading from slow
+// storage overlaps with decoding. Demuxing pauses while queued packets take more
+// than max_bytes.
+class read_ahead_source : private streams::observer<encoded_packet> {
+ public:
+  read_ahead_source(const std::string &filename, bool loop,
+                    const boost::optional<file_range> &range, size_t max_bytes,
+                    const file_segment &segment = file_segment{})
+      : _impl(filename, loop, range, segment), _max_bytes(max_bytes) {
+#if defined(__linux__)
+    // separate descriptor only tells kernel which pages demuxer needs next.
+    _fd = ::open(filename.c_str(), O_RDONLY);
+#endif
+    _thread = std::thread(&read_ahead_source::demux_loop, this);
+  }
+
+  ~read_ahead_source() override {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopped = true;
+    }
+    _on_change.notify_all();
+    _thread.join();
+#if defined(__linux__)
+    if (_fd >= 0) {
+      ::close(_fd);
+    }
+#endif
+  }
+
+  read_ahead_source(const read_ahead_source &) = delete;
+  read_ahead_source &operator=(const read_ahead_source &) = delete;
+
+  void generate_one(streams::observer<encoded_packet> &observer) {
+    event e;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _on_change.wait(lock, [this]() { return !_events.empty(); });
+      e = std::move(_events.front());
+      _events.pop_front();
+      _queued_bytes -= e.bytes;
+    }
+    _on_change.notify_all();
+
+    if (e.packet) {
+      observer.on_next(std::move(e.packet.get()));
+    } else if (e.ec) {
+      observer.on_error(e.ec);
+    } else {
+      observer.on_complete();
+    }
+  }
+
+ private:
+  // packet, or error or completion if there is no packet.
+  struct event {
+    boost::optional<encoded_packet> packet;
+    std::error_condition ec;
+    size_t bytes{0};
+  };
+
+  void demux_loop() {
+    threadutils::set_current_thread_name("file_read_ahead");
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _on_change.wait(lock,
+                        [this]() { return _stopped || _queued_bytes < _max_bytes; });
+        if (_stopped || _finished) {
+          return;
+        }
+      }
+      _impl.generate_one(*this);
+      advise();
+    }
+  }
+
+  // asks kernel to start reading the next max_bytes of the file into page cache,
+  // demuxer finds them there instead of waiting for storage.
+  void advise() {
+#if defined(__linux__)
+    if (_fd < 0) {
+      return;
+    }
+    const int64_t position = _impl.position();
+    const auto window = static_cast<int64_t>(_max_bytes);
+    // looped file starts over from the beginning.
+    if (position < _advised_from || position + window / 2 >= _advised_until) {
+      posix_fadvise(_fd, position, window, POSIX_FADV_WILLNEED);
+      _advised_from = position;
+      _advised_until = position + window;
+    }
+#endif
+  }
+
+  void push(event &&e) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _queued_bytes += e.bytes;
+      _events.push_back(std::move(e));
+    }
+    _on_change.notify_all();
+  }
+
+  void on_next(encoded_packet &&packet) override {
+    event e;
+    if (const encoded_frame *frame = boost::get<encoded_frame>(&packet)) {
+      e.bytes = frame->data.size();
+    }
+    e.packet = std::move(packet);
+    push(std::move(e));
+  }
+
+  void on_error(std::error_condition ec) override {
+    _finished = true;
+    event e;
+    e.ec = ec;
+    push(std::move(e));
+  }
+
+  void on_complete() override {
+    _finished = true;
+    push(event{});
+  }
+
+  file_source_impl _impl;
+  const size_t _max_bytes;
+  std::thread _thread;
+  // written and read by demux thread only.
+  bool _finished{false};
+  int _fd{-1};
+  int64_t _advised_from{0};
+  int64_t _advised_until{0};
+
+  std::mutex _mutex;
+  std::condition_variable _on_change;
+  std::deque<event> _events;
+  size_t _queued_bytes{0};
+  bool _stopped{false};
+};
+
 double get_fps(const std::string &filename) {
   LOG(INFO) << "Reading fps from " << filename;
 
@@ -194,16 +469,50 @@ double get_fps(const std::string &filename) {
 
 }  // namespace
 
+file_segment time_segment(const std::string &filename,
+                          boost::optional<std::chrono::milliseconds> start,
+                          boost::optional<std::chrono::milliseconds> end) {
+  file_segment segment;
+  if (!start && !end) {
+    return segment;
+  }
+  avutils::init();
+  const double fps = get_fps(filename);
+  // frames starting in [start, end).
+  if (start) {
+    segment.first_frame =
+        1 + static_cast<int64_t>(std::floor(start->count() * fps / 1000));
+  }
+  if (end) {
+    segment.last_frame = static_cast<int64_t>(std::ceil(end->count() * fps / 1000));
+  }
+  return segment;
+}
+
 streams::publisher<encoded_packet> file_source(boost::asio::io_service &io,
                                                const std::string &filename, bool loop,
-                                               bool batch) {
+                                               bool batch, size_t read_ahead_bytes,
+                                               const file_segment &segment) {
   avutils::init();
-  streams::publisher<encoded_packet> result =
-      streams::generators<encoded_packet>::stateful(
-          [filename, loop]() { return new file_source_impl(filename, loop); },
-          [](file_source_impl *impl, streams::observer<encoded_packet> &sink) {
-            impl->generate_one(sink);
-          });
+  streams::publisher<encoded_packet> result;
+  if (batch && read_ahead_bytes > 0) {
+    result = streams::generators<encoded_packet>::stateful(
+        [filename, loop, read_ahead_bytes, segment]() {
+          return new read_ahead_source(filename, loop, boost::none, read_ahead_bytes,
+                                       segment);
+        },
+        [](read_ahead_source *source, streams::observer<encoded_packet> &sink) {
+          source->generate_one(sink);
+        });
+  } else {
+    result = streams::generators<encoded_packet>::stateful(
+        [filename, loop, segment]() {
+          return new file_source_impl(filename, loop, boost::none, segment);
+        },
+        [](file_source_impl *impl, streams::observer<encoded_packet> &sink) {
+          impl->generate_one(sink);
+        });
+  }
 
   if (!batch) {
     const double fps = get_fps(filename);
@@ -215,5 +524,73 @@ streams::publisher<encoded_packet> file_source(boost::asio::io_service &io,
   return std::move(result) >> repeat_metadata();
 }
 
+std::vector<file_range> split_by_key_frames(const std::string &filename,
+                                            size_t max_ranges) {
+  CHECK_GT(max_ranges, 0);
+  avutils::init();
+  std::shared_ptr<AVFormatContext> format_context =
+      avutils::open_input_format_context(filename);
+  if (!format_context) {
+    return {};
+  }
+  const int stream_index = avutils::find_best_video_stream(format_context.get(), nullptr);
+  if (stream_index < 0) {
+    return {};
+  }
+
+  // packets are read without decoding, numbered like file_source numbers them.
+  std::vector<file_range> gops;
+  int64_t frames = 0;
+  AVPacket packet;
+  av_init_packet(&packet);
+  while (av_read_frame(format_context.get(), &packet) >= 0) {
+    auto release = gsl::finally([&packet]() { av_packet_unref(&packet); });
+    if (packet.stream_index != stream_index) {
+      continue;
+    }
+    frames++;
+    if (gops.empty() || (packet.flags & AV_PKT_FLAG_KEY) != 0) {
+      gops.push_back(file_range{frames, 0, packet_timestamp(packet), packet.pos});
+    }
+    gops.back().frames++;
+  }
+  LOG(INFO) << filename << " has " << frames << " frames in " << gops.size()
+            << " groups of pictures";
+
+  // a new range starts once previous ones cover their share of frames.
+  std::vector<file_range> ranges;
+  for (const file_range &gop : gops) {
+    const auto n = static_cast<int64_t>(ranges.size());
+    if (ranges.empty()
+        || (n < static_cast<int64_t>(max_ranges)
+            && gop.first_frame - 1 >= frames * n / static_cast<int64_t>(max_ranges))) {
+      ranges.push_back(gop);
+    } else {
+      ranges.back().frames += gop.frames;
+    }
+  }
+  return ranges;
+}
+
+streams::publisher<encoded_packet> file_range_source(const std::string &filename,
+                                                     const file_range &range,
+                                                     size_t read_ahead_bytes) {
+  avutils::init();
+  if (read_ahead_bytes > 0) {
+    return streams::generators<encoded_packet>::stateful(
+        [filename, range, read_ahead_bytes]() {
+          return new read_ahead_source(filename, false, range, read_ahead_bytes);
+        },
+        [](read_ahead_source *source, streams::observer<encoded_packet> &sink) {
+          source->generate_one(sink);
+        });
+  }
+  return streams::generators<encoded_packet>::stateful(
+      [filename, range]() { return new file_source_impl(filename, false, range); },
+      [](file_source_impl *impl, streams::observer<encoded_packet> &sink) {
+        impl->generate_one(sink);
+      });
+}
+
 }  // namespace video
 }  // namespace satori
@@ -0,0 +1,161 @@
+#include "frame_arena.h"
+
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include "logging.h"
+#include "metrics.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+auto &frame_arena_bytes = prometheus::BuildGauge()
+                              .Name("frame_arena_bytes")
+                              .Register(metrics_registry())
+                              .Add({});
+
+auto &frame_arena_used_bytes = prometheus::BuildGauge()
+                                   .Name("frame_arena_used_bytes")
+                                   .Register(metrics_registry())
+                                   .Add({});
+
+auto &frame_arena_misses_total = prometheus::BuildCounter()
+                                     .Name("frame_arena_misses_total")
+                                     .Register(metrics_registry())
+                                     .Add({});
+
+// smaller buffers stay in heap.
+constexpr size_t min_arena_buffer_size = frame_arena::page_size / 2;
+
+// buffers may outlive everything, so the arena is never destroyed.
+std::atomic<frame_arena *> global_arena{nullptr};
+
+}  // namespace
+
+constexpr size_t frame_arena::page_size;
+
+std::unique_ptr<frame_arena> frame_arena::create(size_t size) {
+  const size_t pages = (size + page_size - 1) / page_size;
+  if (pages == 0) {
+    return nullptr;
+  }
+  const size_t bytes = pages * page_size;
+
+  void *data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (data == MAP_FAILED) {
+    LOG(INFO) << "no reserved huge pages for frame arena (" << std::strerror(errno)
+              << "), using transparent huge pages";
+    // extra page lets the arena start at huge page boundary.
+    void *mapping = mmap(nullptr, bytes + page_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+      LOG(ERROR) << "failed to map frame arena: " << std::strerror(errno);
+      return nullptr;
+    }
+    const auto address = reinterpret_cast<uintptr_t>(mapping);
+    const uintptr_t aligned = (address + page_size - 1) & ~(page_size - 1);
+    if (aligned > address) {
+      munmap(mapping, aligned - address);
+    }
+    const uintptr_t end = address + bytes + page_size;
+    if (end > aligned + bytes) {
+      munmap(reinterpret_cast<void *>(aligned + bytes), end - aligned - bytes);
+    }
+    data = reinterpret_cast<void *>(aligned);
+    if (madvise(data, bytes, MADV_HUGEPAGE) != 0) {
+      LOG(WARNING) << "transparent huge pages are not available: "
+                   << std::strerror(errno);
+    }
+  }
+
+  LOG(INFO) << "frame arena has " << pages << " huge pages";
+  return std::unique_ptr<frame_arena>(
+      new frame_arena(static_cast<uint8_t *>(data), pages));
+}
+
+frame_arena::frame_arena(uint8_t *base, size_t pages)
+    : _base(base), _buffer_pages(pages, 0), _pages(pages, false) {
+  frame_arena_bytes.Increment(static_cast<double>(size()));
+}
+
+frame_arena::~frame_arena() {
+  frame_arena_bytes.Decrement(static_cast<double>(size()));
+  frame_arena_used_bytes.Decrement(static_cast<double>(_used_pages * page_size));
+  munmap(_base, size());
+}
+
+uint8_t *frame_arena::allocate(size_t size) {
+  const size_t pages = std::max<size_t>(1, (size + page_size - 1) / page_size);
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_used_pages + pages > _pages.size()) {
+    return nullptr;
+  }
+
+  // first fit, buffers are allocated on frame pool misses only.
+  size_t run = 0;
+  for (size_t i = 0; i < _pages.size(); i++) {
+    run = _pages[i] ? 0 : run + 1;
+    if (run == pages) {
+      const size_t first = i + 1 - pages;
+      std::fill(_pages.begin() + first, _pages.begin() + i + 1, true);
+      _buffer_pages[first] = static_cast<uint32_t>(pages);
+      _used_pages += pages;
+      frame_arena_used_bytes.Increment(static_cast<double>(pages * page_size));
+      return _base + first * page_size;
+    }
+  }
+  return nullptr;
+}
+
+bool frame_arena::free(uint8_t *buffer) {
+  if (buffer < _base || buffer >= _base + size()) {
+    return false;
+  }
+  const size_t first = static_cast<size_t>(buffer - _base) / page_size;
+  std::lock_guard<std::mutex> lock(_mutex);
+  const size_t pages = _buffer_pages[first];
+  CHECK_GT(pages, 0) << "not an arena buffer";
+  std::fill(_pages.begin() + first, _pages.begin() + first + pages, false);
+  _buffer_pages[first] = 0;
+  _used_pages -= pages;
+  frame_arena_used_bytes.Decrement(static_cast<double>(pages * page_size));
+  return true;
+}
+
+size_t frame_arena::used() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _used_pages * page_size;
+}
+
+void init_frame_arena(size_t size) {
+  CHECK(global_arena.load() == nullptr) << "frame arena is initialized already";
+  if (size > 0) {
+    global_arena = frame_arena::create(size).release();
+  }
+}
+
+uint8_t *allocate_arena_frame_buffer(size_t size) {
+  frame_arena *arena = global_arena.load();
+  if (arena == nullptr || size < min_arena_buffer_size) {
+    return nullptr;
+  }
+  uint8_t *buffer = arena->allocate(size);
+  if (buffer == nullptr) {
+    frame_arena_misses_total.Increment();
+  }
+  return buffer;
+}
+
+bool free_arena_frame_buffer(uint8_t *buffer) {
+  frame_arena *arena = global_arena.load();
+  return arena != nullptr && arena->free(buffer);
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace satori {
+namespace video {
+
+// Memory of large frame buffers in 2 MiB huge pages, which take fewer TLB entries
+// than 4 KiB ones while frames are converted and processed. Arena is reserved at
+// once with MAP_HUGETLB, or with transparent huge pages if there are no reserved
+// huge pages in the system. Buffers take whole huge pages. Occupancy is exported to
+// frame_arena_bytes and frame_arena_used_bytes gauges.
+class frame_arena {
+ public:
+  static constexpr size_t page_size = 2 * 1024 * 1024;
+
+  // size is rounded up to huge pages, nullptr if memory can't be mapped.
+  static std::unique_ptr<frame_arena> create(size_t size);
+  ~frame_arena();
+
+  frame_arena(const frame_arena &) = delete;
+  frame_arena &operator=(const frame_arena &) = delete;
+
+  // buffer aligned to huge page, nullptr if arena has no room for it.
+  uint8_t *allocate(size_t size);
+  // false if buffer is not from this arena.
+  bool free(uint8_t *buffer);
+
+  size_t size() const { return _pages.size() * page_size; }
+  size_t used() const;
+
+ private:
+  frame_arena(uint8_t *base, size_t pages);
+
+  uint8_t *const _base;
+  mutable std::mutex _mutex;
+  // at the first page of a buffer, number of pages it takes, 0 elsewhere.
+  std::vector<uint32_t> _buffer_pages;
+  std::vector<bool> _pages;
+  size_t _used_pages{0};
+};
+
+// Makes frame_pool and avutils::av_frame with given size take buffers of at least
+// half a huge page from an arena of that size, smaller ones would waste most of
+// their pages. 0 keeps all buffers in heap. Should be called once, before frames
+// are allocated.
+void init_frame_arena(size_t size);
+
+// buffer from the arena, nullptr if there is no arena, it's full or size is small,
+// then buffer should be allocated elsewhere.
+uint8_t *allocate_arena_frame_buffer(size_t size);
+
+// false if buffer is not from the arena.
+bool free_arena_frame_buffer(uint8_t *buffer);
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,88 @@
+#include "frame_memory.h"
+
+#include "logging.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+auto &frame_memory_used_bytes = prometheus::BuildGauge()
+                                    .Name("frame_memory_used_bytes")
+                                    .Register(metrics_registry())
+                                    .Add({});
+
+auto &frame_memory_bytes =
+    prometheus::BuildGauge().Name("frame_memory_bytes").Register(metrics_registry());
+
+auto &frame_memory_dropped_total = prometheus::BuildCounter()
+                                       .Name("frame_memory_dropped_total")
+                                       .Register(metrics_registry());
+
+}  // namespace
+
+frame_memory_budget::frame_memory_budget(size_t max_bytes) : _max_bytes(max_bytes) {}
+
+bool frame_memory_budget::try_take(size_t bytes) {
+  size_t used = _used.load();
+  do {
+    if (_max_bytes > 0 && used + bytes > _max_bytes) {
+      return false;
+    }
+  } while (!_used.compare_exchange_weak(used, used + bytes));
+  frame_memory_used_bytes.Increment(bytes);
+  return true;
+}
+
+void frame_memory_budget::give_back(size_t bytes) {
+  _used -= bytes;
+  frame_memory_used_bytes.Decrement(bytes);
+}
+
+frame_memory_account::frame_memory_account(std::shared_ptr<frame_memory_budget> budget,
+                                           const std::string &pipeline)
+    : _state(std::shared_ptr<state>(
+          new state{std::move(budget), {0},
+                    frame_memory_bytes.Add({{"pipeline", pipeline}})})),
+      _dropped(frame_memory_dropped_total.Add({{"pipeline", pipeline}})) {}
+
+bool frame_memory_account::charge(owned_image_frame &frame) {
+  if (frame.on_device) {
+    return true;
+  }
+
+  size_t bytes = 0;
+  for (const image_plane &plane : frame.plane_data) {
+    bytes += plane.size();
+  }
+  if (bytes == 0) {
+    return true;
+  }
+
+  if (!_state->budget->try_take(bytes)) {
+    LOG(2) << "frame memory budget is exceeded, dropping frame " << frame.id;
+    _dropped.Increment();
+    return false;
+  }
+  _state->used += bytes;
+  _state->bytes.Increment(bytes);
+
+  // first plane is replaced by one which gives the charge back when it is released,
+  // it keeps the original plane and its buffer alive.
+  const image_plane &first = frame.plane_data[0];
+  std::shared_ptr<state> s = _state;
+  std::shared_ptr<const image_plane> owner{new image_plane(first),
+                                           [s, bytes](const image_plane *p) {
+                                             s->used -= bytes;
+                                             s->bytes.Decrement(bytes);
+                                             s->budget->give_back(bytes);
+                                             delete p;
+                                           }};
+  frame.plane_data[0] = image_plane{owner, owner->data(), owner->size()};
+  return true;
+}
+
+size_t frame_memory_account::used() const { return _state->used.load(); }
+
+}  // namespace video
+}  // namespace satori
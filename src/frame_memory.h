@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include "data.h"
+#include "metrics.h"
+
+namespace satori {
+namespace video {
+
+// Bytes of decoded frames held by all pipelines of the process. Exported to
+// frame_memory_used_bytes gauge.
+class frame_memory_budget {
+ public:
+  // 0 means there is no limit.
+  explicit frame_memory_budget(size_t max_bytes);
+
+  // false if bytes don't fit into budget, nothing is taken then.
+  bool try_take(size_t bytes);
+  void give_back(size_t bytes);
+
+  size_t used() const { return _used.load(); }
+
+ private:
+  const size_t _max_bytes;
+  std::atomic<size_t> _used{0};
+};
+
+// Frames of one pipeline, e.g. a job. Frames are charged when they enter bot input
+// queue, and charge is given back when the last reference to their pixels is gone,
+// wherever they are dropped. Exported to frame_memory_bytes and
+// frame_memory_dropped_total with pipeline label.
+class frame_memory_account {
+ public:
+  frame_memory_account(std::shared_ptr<frame_memory_budget> budget,
+                       const std::string &pipeline);
+
+  // false if frame doesn't fit into budget, then frame is left as it is and should
+  // be dropped. Frames in device memory are not charged.
+  bool charge(owned_image_frame &frame);
+
+  size_t used() const;
+
+ private:
+  // outlives account while frames hold charge.
+  struct state {
+    std::shared_ptr<frame_memory_budget> budget;
+    std::atomic<size_t> used{0};
+    prometheus::Gauge &bytes;
+  };
+
+  const std::shared_ptr<state> _state;
+  prometheus::Counter &_dropped;
+};
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,220 @@
+#include "frame_scaler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "logging.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+std::string rotation_filter(const nlohmann::json &additional_data) {
+  if (!additional_data.is_object()
+      || additional_data.find("display_rotation") == additional_data.end()) {
+    return "";
+  }
+
+  const double display_rotation = additional_data["display_rotation"];
+  LOG(INFO) << "display rotation angle " << display_rotation;
+
+  std::ostringstream filter_buffer;
+  if (std::abs(display_rotation - 90) < 1.0) {
+    filter_buffer << "transpose=clock";
+  } else if (std::abs(display_rotation - 180) < 1.0) {
+    filter_buffer << "hflip,vflip";
+  } else if (std::abs(display_rotation - 270) < 1.0) {
+    filter_buffer << "transpose=cclock";
+  } else if (std::abs(display_rotation) > 1.0) {
+    // TODO: floating point formatting?
+    filter_buffer << "rotate=" << display_rotation << "*PI/180";
+  }
+  return filter_buffer.str();
+}
+
+}  // namespace
+
+frame_scaler::frame_scaler(const image_size &bounding_size,
+                           image_pixel_format pixel_format, bool keep_aspect_ratio,
+                           std::shared_ptr<const crop_region> crop)
+    : _bounding_size{bounding_size},
+      _pixel_format{pixel_format},
+      _keep_aspect_ratio{keep_aspect_ratio},
+      _crop{std::move(crop)} {}
+
+boost::optional<owned_image_frame> frame_scaler::convert(const decoded_frame &decoded) {
+  const AVFrame &frame = *decoded.frame;
+  if (_crop) {
+    update_region(_crop->get());
+  }
+
+  if (!_filter && !input_matches(frame)) {
+    init(decoded);
+  }
+
+  boost::optional<owned_image_frame> image;
+  if (_passthrough) {
+    image = avutils::to_image_frame(frame);
+  } else if (_swizzle || _sws_context) {
+    // previous images may still reference their buffers, so take a fresh one.
+    std::shared_ptr<AVFrame> scaled = _frame_pool->get();
+    if (!scaled) {
+      return image;
+    }
+    if (_swizzle) {
+      avutils::swizzle_packed_rgb(static_cast<AVPixelFormat>(frame.format), frame.data[0],
+                                  frame.linesize[0],
+                                  static_cast<AVPixelFormat>(scaled->format),
+                                  scaled->data[0], scaled->linesize[0], frame.width,
+                                  frame.height);
+    } else {
+      avutils::sws_scale(_sws_context, decoded.frame, scaled);
+    }
+    image = avutils::to_image_frame(*scaled);
+  } else {
+    _filter->feed(frame);
+    // scale and rotation filters output exactly one frame per input.
+    while (_filter->try_retrieve(*_filtered_frame)) {
+      image = avutils::to_image_frame(*_filtered_frame);
+      av_frame_unref(_filtered_frame.get());
+    }
+  }
+
+  if (image) {
+    image->id = decoded.id;
+  }
+  return image;
+}
+
+void frame_scaler::set_crop(std::shared_ptr<const crop_region> crop) {
+  _crop = std::move(crop);
+  update_region(_crop ? _crop->get() : boost::optional<image_region>{});
+}
+
+void frame_scaler::update_region(const boost::optional<image_region> &region) {
+  if (region == _region) {
+    return;
+  }
+  LOG(INFO) << "crop region changed";
+  _region = region;
+  _filter.reset();
+  _sws_context.reset();
+  _passthrough = false;
+  _swizzle = false;
+}
+
+bool frame_scaler::input_matches(const AVFrame &frame) const {
+  return (_sws_context || _passthrough || _swizzle) && frame.width == _sws_input.width
+         && frame.height == _sws_input.height && frame.format == _sws_input_format;
+}
+
+void frame_scaler::init(const decoded_frame &sample) {
+  const AVFrame &sample_frame = *sample.frame;
+  const std::string rotation =
+      sample.additional_data ? rotation_filter(*sample.additional_data) : "";
+  if (!rotation.empty() || _region) {
+    init_filter(sample, rotation);
+    return;
+  }
+
+  const image_size size = scaled_size(sample_frame.width, sample_frame.height);
+  const AVPixelFormat dst_format = avutils::to_av_pixel_format(_pixel_format);
+  _sws_input = {static_cast<int16_t>(sample_frame.width),
+                static_cast<int16_t>(sample_frame.height)};
+  _sws_input_format = sample_frame.format;
+  _sws_context.reset();
+  const bool same_size =
+      size.width == sample_frame.width && size.height == sample_frame.height;
+  _passthrough = sample_frame.format == dst_format && same_size;
+  if (_passthrough) {
+    // decoder buffers are referenced by images, without copying.
+    LOG(INFO) << "delivering " << size << " frames as decoded";
+    return;
+  }
+
+  _swizzle = same_size
+             && avutils::can_swizzle_packed_rgb(
+                    static_cast<AVPixelFormat>(sample_frame.format), dst_format);
+  if (_swizzle) {
+    LOG(INFO) << "reordering channels of " << size << " frames";
+    _frame_pool =
+        std::make_unique<avutils::frame_pool>(size.width, size.height, dst_format);
+    return;
+  }
+
+  LOG(INFO) << "scaling " << sample_frame.width << "x" << sample_frame.height
+            << " frames to " << size;
+  _sws_context = avutils::sws_context(sample_frame.width, sample_frame.height,
+                                      static_cast<AVPixelFormat>(sample_frame.format),
+                                      size.width, size.height, dst_format);
+  if (!_sws_context) {
+    init_filter(sample, rotation);
+    return;
+  }
+  _frame_pool =
+      std::make_unique<avutils::frame_pool>(size.width, size.height, dst_format);
+}
+
+void frame_scaler::init_filter(const decoded_frame &sample, const std::string &rotation) {
+  std::ostringstream filter_buffer;
+  if (_region) {
+    // region is given in source frame pixels, so it is cropped before rotation.
+    const int width = sample.frame->width;
+    const int height = sample.frame->height;
+    const int x = std::min<int>(_region->x, width - 1);
+    const int y = std::min<int>(_region->y, height - 1);
+    filter_buffer << "crop=w=" << std::min<int>(_region->width, width - x)
+                  << ":h=" << std::min<int>(_region->height, height - y) << ":x=" << x
+                  << ":y=" << y;
+  }
+
+  if (filter_buffer.tellp() > 0 && !rotation.empty()) {
+    filter_buffer << ",";
+  }
+  filter_buffer << rotation;
+
+  if (filter_buffer.tellp() > 0) {
+    filter_buffer << ",";
+  }
+  filter_buffer << "scale=";
+  filter_buffer << "w=" << _bounding_size.width << ":h=" << _bounding_size.height;
+  if (_keep_aspect_ratio) {
+    filter_buffer << ":force_original_aspect_ratio=decrease";
+  }
+
+  CHECK_GT(filter_buffer.tellp(), 0);
+  const std::string filter_string = filter_buffer.str();
+  LOG(INFO) << "got a filter: " << filter_string;
+
+  _filtered_frame = avutils::av_frame();
+  CHECK(_filtered_frame) << "failed to allocate filtered frame";
+  _filter = std::make_unique<av_filter>(filter_string, *sample.frame, sample.time_base,
+                                        _pixel_format);
+}
+
+// same as scale filter with force_original_aspect_ratio=decrease.
+image_size frame_scaler::scaled_size(int width, int height) const {
+  int scaled_width = _bounding_size.width;
+  int scaled_height = _bounding_size.height;
+  if (scaled_width < 0 && scaled_height < 0) {
+    scaled_width = width;
+    scaled_height = height;
+  } else if (scaled_width < 0) {
+    scaled_width = static_cast<int>(av_rescale(scaled_height, width, height));
+  } else if (scaled_height < 0) {
+    scaled_height = static_cast<int>(av_rescale(scaled_width, height, width));
+  }
+
+  if (_keep_aspect_ratio) {
+    const auto fit_width = static_cast<int>(av_rescale(scaled_height, width, height));
+    const auto fit_height = static_cast<int>(av_rescale(scaled_width, height, width));
+    scaled_width = std::min(scaled_width, fit_width);
+    scaled_height = std::min(scaled_height, fit_height);
+  }
+  return {static_cast<int16_t>(scaled_width), static_cast<int16_t>(scaled_height)};
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <boost/optional.hpp>
+#include <memory>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+}
+
+#include "av_filter.h"
+#include "avutils.h"
+#include "data.h"
+#include "decoded_frame.h"
+
+namespace satori {
+namespace video {
+
+// Scales decoded frames to fit bounding size and converts them to requested pixel
+// format. Plain scaling is done by swscale directly, av_filter is used only when
+// frames are cropped or stream metadata asks for display rotation. Frames which
+// already have requested size and format are delivered as decoded, packed RGB
+// frames of requested size are swizzled by avutils.
+class frame_scaler {
+ public:
+  // changes of crop region are picked up with the next frame.
+  frame_scaler(const image_size &bounding_size, image_pixel_format pixel_format,
+               bool keep_aspect_ratio, std::shared_ptr<const crop_region> crop = nullptr);
+
+  // lets idle scaler serve another stream, see decode_image_frames.
+  void set_crop(std::shared_ptr<const crop_region> crop);
+
+  // returns none if converted frame couldn't be allocated.
+  boost::optional<owned_image_frame> convert(const decoded_frame &decoded);
+
+ private:
+  bool input_matches(const AVFrame &frame) const;
+  void update_region(const boost::optional<image_region> &region);
+  void init(const decoded_frame &sample);
+  void init_filter(const decoded_frame &sample, const std::string &rotation);
+  image_size scaled_size(int width, int height) const;
+
+  const image_size _bounding_size;
+  const image_pixel_format _pixel_format;
+  const bool _keep_aspect_ratio;
+  std::shared_ptr<const crop_region> _crop;
+  boost::optional<image_region> _region;
+
+  std::unique_ptr<av_filter> _filter;
+  std::shared_ptr<AVFrame> _filtered_frame;
+
+  bool _passthrough{false};
+  // packed RGB frames of requested size only need their channels reordered.
+  bool _swizzle{false};
+  std::shared_ptr<SwsContext> _sws_context;
+  image_size _sws_input{0, 0};
+  int _sws_input_format{AV_PIX_FMT_NONE};
+  std::unique_ptr<avutils::frame_pool> _frame_pool;
+};
+
+}  // namespace video
+}  // namespace satori
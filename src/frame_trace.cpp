@@ -0,0 +1,135 @@
+#include "frame_trace.h"
+
+#include <vector>
+
+#include "logging.h"
+#include "metrics.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+const std::vector<double> latency_buckets{0,   1,   2,   5,    10,   20,  50,
+                                          100, 200, 500, 1000, 2000, 5000};
+
+auto &frame_stage_latency_millis = prometheus::BuildHistogram()
+                                       .Name("frame_stage_latency_millis")
+                                       .Register(metrics_registry());
+
+auto &frame_latency_millis = prometheus::BuildHistogram()
+                                 .Name("frame_latency_millis")
+                                 .Register(metrics_registry())
+                                 .Add({}, latency_buckets);
+
+double millis(frame_tracer::clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(d).count() / 1000.0;
+}
+
+}  // namespace
+
+const char *to_string(frame_stage stage) {
+  switch (stage) {
+    case frame_stage::REASSEMBLED:
+      return "reassembled";
+    case frame_stage::DECODED:
+      return "decoded";
+    case frame_stage::DEQUEUED:
+      return "dequeued";
+    case frame_stage::PROCESSED:
+      return "processed";
+    case frame_stage::PUBLISHED:
+      return "published";
+  }
+  ABORT() << "unknown frame stage " << static_cast<int>(stage);
+  return "";
+}
+
+frame_tracer::frame_tracer(const std::string &input, uint32_t sample_period,
+                           streams::observer<nlohmann::json> *dump)
+    : _input(input), _sample_period(sample_period), _dump(dump) {
+  CHECK_GT(_sample_period, 0);
+}
+
+frame_tracer::~frame_tracer() { flush(); }
+
+bool frame_tracer::sampled(const frame_id &id) const {
+  return id.i1 % _sample_period == 0;
+}
+
+void frame_tracer::record(const frame_id &id, frame_stage stage,
+                          clock::time_point now) {
+  if (!sampled(id)) {
+    return;
+  }
+  const auto index = static_cast<size_t>(stage);
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto it = _traces.find(id.i1);
+  if (stage == frame_stage::REASSEMBLED) {
+    if (it != _traces.end()) {
+      return;
+    }
+    it = _traces.emplace(id.i1, trace{id, {}}).first;
+    it->second.stages[index] = now;
+    return;
+  }
+  if (it == _traces.end() || it->second.stages[index]) {
+    return;
+  }
+
+  trace &t = it->second;
+  clock::time_point previous = *t.stages[0];
+  for (size_t i = 1; i < index; i++) {
+    if (t.stages[i]) {
+      previous = *t.stages[i];
+    }
+  }
+  t.stages[index] = now;
+  frame_stage_latency_millis.Add({{"stage", to_string(stage)}}, latency_buckets)
+      .Observe(millis(now - previous));
+
+  if (stage == frame_stage::PUBLISHED) {
+    finish(it);
+  } else if (stage == frame_stage::PROCESSED) {
+    // messages of a frame are sent right after it is processed, earlier frames
+    // which are processed and still here had none.
+    for (auto e = _traces.begin(); e != it;) {
+      if (e->second.stages[index]) {
+        finish(e++);
+      } else {
+        ++e;
+      }
+    }
+  }
+}
+
+void frame_tracer::flush() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  while (!_traces.empty()) {
+    finish(_traces.begin());
+  }
+}
+
+void frame_tracer::finish(std::map<int64_t, trace>::iterator it) {
+  const trace &t = it->second;
+  const clock::time_point start = *t.stages[0];
+  clock::time_point last = start;
+  nlohmann::json stages = nlohmann::json::object();
+  for (size_t i = 0; i < number_of_frame_stages; i++) {
+    if (t.stages[i]) {
+      last = *t.stages[i];
+      stages[to_string(static_cast<frame_stage>(i))] = millis(last - start);
+    }
+  }
+  frame_latency_millis.Observe(millis(last - start));
+
+  if (_dump != nullptr) {
+    _dump->on_next(
+        nlohmann::json{{"input", _input}, {"i", {t.id.i1, t.id.i2}}, {"stages", stages}});
+  }
+  _traces.erase(it);
+}
+
+}  // namespace video
+}  // namespace satori
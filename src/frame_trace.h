@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <json.hpp>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "data.h"
+#include "streams/streams.h"
+
+namespace satori {
+namespace video {
+
+// pipeline stages of a frame, in order.
+enum class frame_stage : uint8_t {
+  // encoded frame left network reassembly or demuxer.
+  REASSEMBLED = 0,
+  // frame was decoded and scaled.
+  DECODED = 1,
+  // frame was taken from bot input queue.
+  DEQUEUED = 2,
+  // bot callback returned.
+  PROCESSED = 3,
+  // first analysis message of the frame was sent.
+  PUBLISHED = 4,
+};
+
+constexpr size_t number_of_frame_stages = 5;
+
+const char *to_string(frame_stage stage);
+
+// Follows every sample_period-th frame of an input through pipeline stages. Time
+// between a stage and the previous recorded one is observed by
+// frame_stage_latency_millis histogram with stage label, time from reassembly to the
+// last stage by frame_latency_millis. Finished traces are sent to dump, as objects
+// with millisecond offsets of stages from reassembly. Stages of a frame may be
+// recorded from different threads.
+class frame_tracer {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  frame_tracer(const std::string &input, uint32_t sample_period,
+               streams::observer<nlohmann::json> *dump = nullptr);
+  // finishes traces in flight.
+  ~frame_tracer();
+
+  bool sampled(const frame_id &id) const;
+
+  // stages recorded twice, and stages of frames which weren't reassembled, are
+  // ignored.
+  void record(const frame_id &id, frame_stage stage,
+              clock::time_point now = clock::now());
+
+  // finishes traces in flight.
+  void flush();
+
+ private:
+  struct trace {
+    frame_id id;
+    std::array<boost::optional<clock::time_point>, number_of_frame_stages> stages;
+  };
+
+  // has to be called with mutex locked.
+  void finish(std::map<int64_t, trace>::iterator it);
+
+  const std::string _input;
+  const uint32_t _sample_period;
+  streams::observer<nlohmann::json> *const _dump;
+  std::mutex _mutex;
+  // by first frame number, traces of frames which were not published are finished
+  // when a later frame is processed.
+  std::map<int64_t, trace> _traces;
+};
+
+}  // namespace video
+}  // namespace satori
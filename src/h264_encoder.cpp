@@ -0,0 +1,371 @@
+#include "h264_encoder.h"
+
+#include <map>
+
+extern "C" {
+#include <libavutil/hwcontext.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include "avutils.h"
+#include "logging.h"
+#include "video_error.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+// generic hardware device API (av_hwdevice_find_type_by_name) appeared in FFmpeg 4.0.
+#define HW_ENCODING_SUPPORTED (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 18, 100))
+
+using time_point = std::chrono::system_clock::time_point;
+
+AVPixelFormat hw_pixel_format(const AVCodec &encoder) {
+  for (const AVPixelFormat *f = encoder.pix_fmts; f != nullptr && *f != AV_PIX_FMT_NONE;
+       f++) {
+    if ((av_pix_fmt_desc_get(*f)->flags & AV_PIX_FMT_FLAG_HWACCEL) != 0) {
+      return *f;
+    }
+  }
+  return AV_PIX_FMT_NONE;
+}
+
+bool supports_pixel_format(const AVCodec &encoder, int format) {
+  for (const AVPixelFormat *f = encoder.pix_fmts; f != nullptr && *f != AV_PIX_FMT_NONE;
+       f++) {
+    if (*f == format) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+class h264_encoder {
+ public:
+  explicit h264_encoder(const h264_encoder_profile &profile) : _profile(profile) {}
+
+  streams::publisher<encoded_packet> on_image_frame(const owned_image_frame &f) {
+    // planes are read in place.
+    std::shared_ptr<AVFrame> input = avutils::image_to_av_frame(f);
+    if (!input) {
+      return streams::publishers::error<encoded_packet>(
+          video_error::FRAME_GENERATION_ERROR);
+    }
+    return on_frame(input, f.id, f.timestamp);
+  }
+
+  streams::publisher<encoded_packet> on_decoded_frame(const decoded_frame &f) {
+    return on_frame(f.frame, f.id, time_point{std::chrono::milliseconds(f.frame->pts)});
+  }
+
+ private:
+  streams::publisher<encoded_packet> on_frame(const std::shared_ptr<const AVFrame> &frame,
+                                              const frame_id &id, time_point timestamp) {
+    if (!_encoder_context) {
+      auto metadata = init(*frame);
+      if (!_initialized) {
+        return metadata;
+      }
+      auto frames = encode_frame(frame, id, timestamp);
+      return streams::publishers::concat(std::move(metadata), std::move(frames));
+    }
+
+    return encode_frame(frame, id, timestamp);
+  }
+
+  streams::publisher<encoded_packet> init(const AVFrame &sample) {
+    CHECK(!_encoder_context);
+    LOG(INFO) << "Initializing encoder";
+
+    avutils::init();
+    const AVCodec *requested = avcodec_find_encoder_by_name(_profile.encoder.c_str());
+    if (requested != nullptr) {
+      _encoder_context = avutils::encoder_context(requested->id, _profile.encoder);
+    }
+    if (!_encoder_context) {
+      LOG(WARNING) << _profile.encoder << " is not available, using default h264 encoder";
+      _encoder_context = avutils::encoder_context(AV_CODEC_ID_H264);
+    }
+    if (!_encoder_context) {
+      return streams::publishers::error<encoded_packet>(
+          video_error::STREAM_INITIALIZATION_ERROR);
+    }
+    _encoder_context->width = sample.width;
+    _encoder_context->height = sample.height;
+    // SPS/PPS go to extradata instead of key frames, so they can be sent as metadata.
+    _encoder_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    // B-frames would make decoding order differ from input order.
+    _encoder_context->max_b_frames = 0;
+    _encoder_context->bit_rate = _profile.bitrate ? *_profile.bitrate : 0;
+    if (_profile.keyint) {
+      _encoder_context->gop_size = *_profile.keyint;
+    }
+    _encoder_context->thread_count = _profile.threads;
+    init_hw_frames(sample);
+
+    AVDictionary *codec_options = nullptr;
+    av_dict_set(&codec_options, "preset", _profile.preset.c_str(), 0);
+    if (!_profile.tune.empty()) {
+      av_dict_set(&codec_options, "tune", _profile.tune.c_str(), 0);
+    }
+    if (!_profile.bitrate) {
+      av_dict_set_int(&codec_options, "crf", _profile.crf, 0);
+    }
+
+    int ret = avcodec_open2(_encoder_context.get(), nullptr, &codec_options);
+    av_dict_free(&codec_options);
+    if (ret < 0) {
+      LOG(ERROR) << "failed to open " << _encoder_context->codec->name
+                 << " encoder: " << avutils::error_msg(ret);
+      return streams::publishers::error<encoded_packet>(
+          video_error::STREAM_INITIALIZATION_ERROR);
+    }
+
+    _send_frame = avutils::av_frame();
+    if (!_send_frame) {
+      return streams::publishers::error<encoded_packet>(
+          video_error::STREAM_INITIALIZATION_ERROR);
+    }
+    if (!_passthrough) {
+      const AVPixelFormat sw_format =
+          _hw_frames ? AV_PIX_FMT_NV12 : _encoder_context->pix_fmt;
+      _frame = avutils::av_frame(sample.width, sample.height, 1, sw_format);
+      _downloaded = avutils::av_frame();
+      _hw_frame = avutils::av_frame();
+      if (!_frame || !_downloaded || !_hw_frame) {
+        return streams::publishers::error<encoded_packet>(
+            video_error::STREAM_INITIALIZATION_ERROR);
+      }
+    }
+
+    encoded_metadata m;
+    m.codec_name = avcodec_get_name(_encoder_context->codec_id);
+    m.codec_data =
+        shared_bytes{reinterpret_cast<const char *>(_encoder_context->extradata),
+                     static_cast<size_t>(_encoder_context->extradata_size)};
+
+    _initialized = true;
+    return streams::publishers::of({encoded_packet{m}});
+  }
+
+  // picks how frames get to hardware encoders, software encoders take host frames.
+  void init_hw_frames(const AVFrame &sample) {
+    if (!_profile.hw_device) {
+      return;
+    }
+
+#if HW_ENCODING_SUPPORTED
+    const AVCodec &codec = *_encoder_context->codec;
+    if (sample.hw_frames_ctx != nullptr && supports_pixel_format(codec, sample.format)) {
+      const auto *frames =
+          reinterpret_cast<const AVHWFramesContext *>(sample.hw_frames_ctx->data);
+      if (frames->device_ctx->type
+          == av_hwdevice_find_type_by_name(_profile.hw_device->c_str())) {
+        LOG(INFO) << "encoding frames on decoder's " << *_profile.hw_device << " device";
+        _encoder_context->hw_frames_ctx = av_buffer_ref(sample.hw_frames_ctx);
+        _encoder_context->pix_fmt = static_cast<AVPixelFormat>(sample.format);
+        _passthrough = true;
+        return;
+      }
+    }
+
+    const AVPixelFormat hw_format = hw_pixel_format(codec);
+    if (hw_format == AV_PIX_FMT_NONE) {
+      return;
+    }
+    const auto device = avutils::hw_device_context(*_profile.hw_device);
+    _hw_frames = avutils::hw_frames_context(device, hw_format, AV_PIX_FMT_NV12,
+                                            sample.width, sample.height);
+    if (!_hw_frames) {
+      LOG(WARNING) << "no " << *_profile.hw_device << " frames, encoding host frames";
+      return;
+    }
+    _encoder_context->hw_frames_ctx = av_buffer_ref(_hw_frames.get());
+    _encoder_context->pix_fmt = hw_format;
+#else
+    LOG(WARNING) << "hardware encoding is not supported by FFmpeg " << av_version_info()
+                 << ", encoding host frames";
+#endif
+  }
+
+  // converts frame to what encoder takes: host frame of its pixel format or
+  // hardware surface.
+  std::shared_ptr<const AVFrame> prepare(const std::shared_ptr<const AVFrame> &frame) {
+    if (_passthrough) {
+      return frame;
+    }
+
+    std::shared_ptr<const AVFrame> input = frame;
+    if (frame->hw_frames_ctx != nullptr) {
+      if (avutils::download_hw_frame(*frame, *_downloaded) < 0) {
+        return nullptr;
+      }
+      input = _downloaded;
+    }
+    if (!_hw_frames && input->format == _frame->format) {
+      return input;
+    }
+
+    if (!_sws_context || input->format != _sws_input_format) {
+      _sws_input_format = input->format;
+      _sws_context = avutils::sws_context(
+          input->width, input->height, static_cast<AVPixelFormat>(input->format),
+          _frame->width, _frame->height, static_cast<AVPixelFormat>(_frame->format));
+      if (!_sws_context) {
+        return nullptr;
+      }
+    }
+    // encoder may still reference previous frame.
+    if (av_frame_make_writable(_frame.get()) < 0) {
+      return nullptr;
+    }
+    avutils::sws_scale(_sws_context, input, _frame);
+
+    if (_hw_frames) {
+      if (avutils::upload_hw_frame(*_hw_frames, *_frame, *_hw_frame) < 0) {
+        return nullptr;
+      }
+      return _hw_frame;
+    }
+    return _frame;
+  }
+
+  streams::publisher<encoded_packet> encode_frame(
+      const std::shared_ptr<const AVFrame> &frame, const frame_id &id,
+      time_point timestamp) {
+    std::shared_ptr<const AVFrame> input = prepare(frame);
+    if (!input || av_frame_ref(_send_frame.get(), input.get()) < 0) {
+      return streams::publishers::error<encoded_packet>(
+          video_error::FRAME_GENERATION_ERROR);
+    }
+    // encoder may hold frames for look ahead, pts tells which input packet belongs to.
+    _send_frame->pts = _counter;
+    _pending_frames.emplace(_counter, std::make_pair(id, timestamp));
+    int ret = avcodec_send_frame(_encoder_context.get(), _send_frame.get());
+    av_frame_unref(_send_frame.get());
+    if (ret < 0) {
+      LOG(ERROR) << "avcodec_send_frame error: " << avutils::error_msg(ret);
+      return streams::publishers::error<encoded_packet>(
+          video_error::FRAME_GENERATION_ERROR);
+    }
+
+    std::vector<encoded_packet> packets;
+    while (true) {
+      AVPacket packet;
+      av_init_packet(&packet);
+      ret = avcodec_receive_packet(_encoder_context.get(), &packet);
+      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+        break;
+      }
+
+      if (ret < 0) {
+        return streams::publishers::error<encoded_packet>(
+            video_error::FRAME_GENERATION_ERROR);
+      }
+
+      encoded_frame encoded;
+      encoded.data = shared_bytes{reinterpret_cast<const char *>(packet.data),
+                                  static_cast<size_t>(packet.size)};
+      auto pending = _pending_frames.find(packet.pts);
+      if (pending != _pending_frames.end()) {
+        encoded.id = pending->second.first;
+        encoded.timestamp = pending->second.second;
+        _pending_frames.erase(_pending_frames.begin(), std::next(pending));
+      } else {
+        LOG(WARNING) << "no input frame for packet pts " << packet.pts;
+        encoded.id = id;
+        encoded.timestamp = timestamp;
+      }
+      encoded.creation_time = std::chrono::system_clock::now();
+      encoded.key_frame = static_cast<bool>(packet.flags & AV_PKT_FLAG_KEY);
+      packets.emplace_back(std::move(encoded));
+
+      av_packet_unref(&packet);
+    }
+
+    _counter++;
+    if (_counter % 100 == 0) {
+      LOG(INFO) << "Encoded " << _counter << " frames";
+    }
+    LOG(2) << "Encoded " << _counter << " frames";
+
+    return streams::publishers::of(std::move(packets));
+  }
+
+  const h264_encoder_profile _profile;
+  std::shared_ptr<AVCodecContext> _encoder_context{nullptr};
+  bool _initialized{false};
+  // device frames of decoder are sent as they are.
+  bool _passthrough{false};
+  std::shared_ptr<AVBufferRef> _hw_frames{nullptr};
+  std::shared_ptr<AVFrame> _downloaded{nullptr};  // host copy of device frame
+  std::shared_ptr<AVFrame> _frame{nullptr};       // in encoder's pixel format
+  std::shared_ptr<AVFrame> _hw_frame{nullptr};    // _frame uploaded to device
+  std::shared_ptr<AVFrame> _send_frame{nullptr};
+  std::shared_ptr<SwsContext> _sws_context{nullptr};
+  int _sws_input_format{AV_PIX_FMT_NONE};
+  // input frames held by encoder, by pts.
+  std::map<int64_t, std::pair<frame_id, time_point>> _pending_frames;
+  int64_t _counter{0};
+};
+
+h264_encoder_profile h264_encoder_profile::realtime() {
+  h264_encoder_profile profile;
+  profile.preset = "ultrafast";
+  profile.tune = "zerolatency";
+  return profile;
+}
+
+boost::optional<h264_encoder_profile> h264_encoder_profile_by_name(
+    const std::string &name) {
+  if (name == "good") {
+    return h264_encoder_profile{};
+  }
+  if (name == "realtime") {
+    return h264_encoder_profile::realtime();
+  }
+  return boost::none;
+}
+
+streams::op<owned_image_packet, encoded_packet> encode_h264(
+    const h264_encoder_profile &profile) {
+  return [profile](streams::publisher<owned_image_packet> &&src) {
+    LOG(INFO) << "H264 encoder " << profile.encoder << ", preset " << profile.preset;
+    auto encoder = new h264_encoder(profile);
+
+    return std::move(src) >> streams::flat_map([encoder](owned_image_packet &&packet) {
+             if (const owned_image_frame *frame =
+                     boost::get<owned_image_frame>(&packet)) {
+               return encoder->on_image_frame(*frame);
+             }
+             return streams::publishers::empty<encoded_packet>();
+           })
+           >> streams::do_finally([encoder]() {
+               LOG(INFO) << "Deleting H264 encoder";
+               delete encoder;
+             });
+  };
+}
+
+streams::op<decoded_frame, encoded_packet> encode_h264_frames(
+    const h264_encoder_profile &profile) {
+  return [profile](streams::publisher<decoded_frame> &&src) {
+    LOG(INFO) << "H264 encoder " << profile.encoder << " for decoded frames";
+    auto encoder = new h264_encoder(profile);
+
+    return std::move(src) >> streams::flat_map([encoder](decoded_frame &&frame) {
+             return encoder->on_decoded_frame(frame);
+           })
+           >> streams::do_finally([encoder]() {
+               LOG(INFO) << "Deleting H264 encoder";
+               delete encoder;
+             });
+  };
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <boost/optional.hpp>
+#include <string>
+
+#include "data.h"
+#include "decoded_frame.h"
+#include "streams/streams.h"
+
+namespace satori {
+namespace video {
+
+// libx264 settings, see http://trac.ffmpeg.org/wiki/Encode/H.264
+// Unset values keep encoder defaults.
+struct h264_encoder_profile {
+  // FFmpeg encoder, hardware ones are h264_nvenc, h264_vaapi, h264_qsv and
+  // hevc_* for HEVC output.
+  std::string encoder{"libx264"};
+  // hardware device type for encoders taking frames on device, e.g. vaapi or qsv.
+  // nvenc uploads host frames itself, device is only needed to pass through
+  // frames decoded on cuda.
+  boost::optional<std::string> hw_device;
+  // ultrafast, superfast, veryfast, faster, fast, medium, slow...
+  std::string preset{"veryfast"};
+  // e.g. zerolatency, empty for none.
+  std::string tune;
+  // bits per second, takes precedence over crf.
+  boost::optional<int64_t> bitrate;
+  // 0-51, constant quality mode.
+  int crf{23};
+  // maximum distance between key frames.
+  boost::optional<int> keyint;
+  // 0 lets encoder choose.
+  int threads{0};
+
+  // the cheapest preset without frame delay, for live transcoding.
+  static h264_encoder_profile realtime();
+};
+
+// good or realtime like vp9 profiles, none for other names.
+boost::optional<h264_encoder_profile> h264_encoder_profile_by_name(
+    const std::string &name);
+
+// emits metadata with SPS/PPS as codec data, then frames without B-frames.
+// Profile settings other than bitrate, keyint and threads are libx264 specific,
+// other encoders ignore them. Falls back to default encoder of the codec if
+// requested one is missing.
+streams::op<owned_image_packet, encoded_packet> encode_h264(
+    const h264_encoder_profile &profile = h264_encoder_profile{});
+
+// encodes frames as decoded, see decode_frames. Hardware frames of the same device
+// type as profile's hw_device are encoded without leaving the device.
+streams::op<decoded_frame, encoded_packet> encode_h264_frames(
+    const h264_encoder_profile &profile);
+}  // namespace video
+}  // namespace satori
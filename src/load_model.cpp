@@ -0,0 +1,54 @@
+#include "load_model.h"
+
+#include <algorithm>
+
+#include "logging.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+// weight of the latest sample in smoothed utilization.
+constexpr double smoothing = 0.3;
+
+}  // namespace
+
+load_model::load_model(size_t max_jobs, double cores, double target_utilization)
+    : _max_jobs(max_jobs),
+      _cores(std::max(1.0, cores)),
+      _target_utilization(target_utilization) {
+  CHECK_GT(target_utilization, 0) << "target utilization should be positive";
+}
+
+double load_model::update(const load_sample &sample,
+                          std::chrono::steady_clock::time_point now, size_t jobs) {
+  if (_last_sample && now > _last_time) {
+    const double seconds = std::chrono::duration<double>(now - _last_time).count();
+    const double cpu = (sample.cpu_seconds - _last_sample->cpu_seconds) / seconds;
+    const double processing =
+        (sample.processing_seconds - _last_sample->processing_seconds) / seconds;
+    const double current = std::max(cpu, processing) / _cores;
+    _utilization = smoothing * current + (1 - smoothing) * _utilization;
+  }
+  _last_sample = sample;
+  _last_time = now;
+
+  const double job_slots = static_cast<double>(_max_jobs - std::min(_max_jobs, jobs));
+  if (jobs == 0) {
+    return job_slots;
+  }
+  // frames piling up mean jobs already take more than the process has.
+  if (sample.queued_frames > jobs) {
+    return 0;
+  }
+  const double job_cost = _utilization / static_cast<double>(jobs);
+  if (job_cost <= 0) {
+    return job_slots;
+  }
+  const double available = (_target_utilization - _utilization) / job_cost;
+  return std::max(0.0, std::min(job_slots, available));
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <boost/optional.hpp>
+#include <chrono>
+#include <cstddef>
+
+namespace satori {
+namespace video {
+
+// cumulative signals of how busy the process is.
+struct load_sample {
+  // user and system CPU time of the process.
+  double cpu_seconds{0};
+  // time spent processing frames, e.g. in bot callbacks.
+  double processing_seconds{0};
+  // frames waiting in front of processing right now.
+  size_t queued_frames{0};
+};
+
+// Estimates how many more jobs a process can take from how busy it is instead of
+// from the number of jobs, so a heavy stream takes more capacity than a light one.
+// Utilization is the larger of CPU and processing time per core, smoothed between
+// updates. Cost of a job is the average utilization of running jobs.
+class load_model {
+ public:
+  // utilization is kept below target, which leaves headroom for load spikes.
+  load_model(size_t max_jobs, double cores, double target_utilization = 0.8);
+
+  // takes a sample and returns available capacity in jobs, which may be
+  // fractional. Never exceeds max_jobs - jobs.
+  double update(const load_sample &sample, std::chrono::steady_clock::time_point now,
+                size_t jobs);
+
+  double utilization() const { return _utilization; }
+
+ private:
+  const size_t _max_jobs;
+  const double _cores;
+  const double _target_utilization;
+
+  boost::optional<load_sample> _last_sample;
+  std::chrono::steady_clock::time_point _last_time;
+  double _utilization{0};
+};
+
+}  // namespace video
+}  // namespace satori
@@ -5,6 +5,16 @@
 
 #define ABORT ABORT_S
 
+// Statements more verbose than MAX_LOG_VERBOSITY are dead code, which compiler
+// removes along with evaluation of their arguments. Other statements check
+// verbosity at runtime, their arguments are only evaluated if they are logged.
+#ifdef MAX_LOG_VERBOSITY
+#undef LOG
+#define LOG(verbosity_name)                                                          \
+  (loguru::Verbosity_##verbosity_name > (MAX_LOG_VERBOSITY)) ? (void)0               \
+                                                             : LOG_S(verbosity_name)
+#endif
+
 // Fixes clang-tidy complaints.
 #undef CHECK
 #define CHECK(cond) CHECK_S(cond)
@@ -0,0 +1,123 @@
+#include "message_batcher.h"
+
+#include <memory>
+#include <mutex>
+
+#include "logging.h"
+#include "metrics.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+auto &batched_messages =
+    prometheus::BuildHistogram()
+        .Name("message_batch_size")
+        .Register(metrics_registry())
+        .Add({}, std::vector<double>{1, 2, 5, 10, 20, 50, 100, 200, 500, 1000});
+
+class batching_observer : public streams::observer<nlohmann::json> {
+ public:
+  batching_observer(streams::observer<nlohmann::json> &downstream,
+                    boost::asio::io_service &io, const message_batch_options &options)
+      : _state(std::make_shared<state>(downstream, io, options)) {}
+
+ private:
+  // outlives observer while timer handler uses it.
+  struct state {
+    state(streams::observer<nlohmann::json> &downstream, boost::asio::io_service &io,
+          const message_batch_options &options)
+        : downstream(downstream), timer(io), options(options) {}
+
+    void flush() {
+      if (batch.empty()) {
+        return;
+      }
+      generation++;
+      timer.cancel();
+      batched_messages.Observe(batch.size());
+
+      nlohmann::json result = nlohmann::json::array();
+      result.get_ref<nlohmann::json::array_t &>().swap(batch);
+      downstream.on_next(std::move(result));
+    }
+
+    streams::observer<nlohmann::json> &downstream;
+    boost::asio::deadline_timer timer;
+    const message_batch_options options;
+    std::mutex mutex;
+    nlohmann::json::array_t batch;
+    uint64_t generation{0};
+    bool closed{false};
+  };
+
+  void on_next(nlohmann::json &&t) override {
+    std::lock_guard<std::mutex> lock(_state->mutex);
+    auto &batch = _state->batch;
+    if (_state->options.per_frame && !batch.empty()
+        && frame_of(t) != frame_of(batch.back())) {
+      _state->flush();
+    }
+
+    if (batch.empty()) {
+      std::weak_ptr<state> weak_state = _state;
+      const uint64_t generation = _state->generation;
+      _state->timer.expires_from_now(
+          boost::posix_time::milliseconds(_state->options.window.count()));
+      _state->timer.async_wait(
+          [weak_state, generation](const boost::system::error_code &ec) {
+            auto s = weak_state.lock();
+            if (ec || !s) {
+              return;
+            }
+            std::lock_guard<std::mutex> lock(s->mutex);
+            // batch might have been flushed and started again.
+            if (!s->closed && generation == s->generation) {
+              s->flush();
+            }
+          });
+    }
+    batch.push_back(std::move(t));
+
+    if (batch.size() >= _state->options.max_messages) {
+      _state->flush();
+    }
+  }
+
+  void on_error(std::error_condition ec) override {
+    close();
+    _state->downstream.on_error(ec);
+    delete this;
+  }
+
+  void on_complete() override {
+    close();
+    _state->downstream.on_complete();
+    delete this;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(_state->mutex);
+    _state->flush();
+    _state->closed = true;
+  }
+
+  static nlohmann::json frame_of(const nlohmann::json &message) {
+    auto it = message.find("i");
+    return it != message.end() ? *it : nlohmann::json{};
+  }
+
+  const std::shared_ptr<state> _state;
+};
+
+}  // namespace
+
+streams::observer<nlohmann::json> &batching_sink(
+    streams::observer<nlohmann::json> &downstream, boost::asio::io_service &io,
+    const message_batch_options &options) {
+  return *(new batching_observer(downstream, io, options));
+}
+
+}  // namespace video
+}  // namespace satori
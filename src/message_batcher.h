@@ -0,0 +1,29 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <json.hpp>
+
+#include "streams/streams.h"
+
+namespace satori {
+namespace video {
+
+struct message_batch_options {
+  // batch is closed when a message of another frame comes.
+  bool per_frame{true};
+  // batch is closed that long after its first message at most.
+  std::chrono::milliseconds window{100};
+  size_t max_messages{1000};
+};
+
+// Packs messages into json arrays, so downstream publishes one message per frame or
+// time window instead of one per message. Messages keep their fields, including
+// frame id in "i". Timers run on io_service, downstream may be called from there or
+// from the thread calling on_next. Deletes itself on completion.
+streams::observer<nlohmann::json> &batching_sink(
+    streams::observer<nlohmann::json> &downstream, boost::asio::io_service &io,
+    const message_batch_options &options = message_batch_options{});
+
+}  // namespace video
+}  // namespace satori
@@ -3,14 +3,20 @@
 #include <prometheus/exposer.h>
 #include <prometheus/text_serializer.h>
 #include <boost/timer/timer.hpp>
+#include <algorithm>
 #include <chrono>
 #include <json.hpp>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 #ifdef HAS_GPERFTOOLS
 #include <gperftools/malloc_extension.h>
 #endif
 
+#include "cbor_json.h"
 #include "logging.h"
+#include "metrics_delta.h"
 
 namespace po = boost::program_options;
 
@@ -85,8 +91,20 @@ void report_tcmalloc_metrics() {
 void report_tcmalloc_metrics() {}
 #endif
 
+struct sharded_counters {
+  std::mutex mutex;
+  std::vector<sharded_counter*> counters;
+};
+
+// counters are registered during static initialization of other units.
+sharded_counters& all_sharded_counters() {
+  static sharded_counters counters;
+  return counters;
+}
+
 void report_process_metrics() {
   report_tcmalloc_metrics();
+  flush_sharded_counters();
   static boost::timer::cpu_timer cpu_timer;
 
   // scrape cpu timer
@@ -116,6 +134,10 @@ class metrics {
       CHECK(_io_service);
       CHECK(publisher) << "rtm publisher not provided";
       _publisher = publisher;
+      if (_config.push_full_snapshot_interval) {
+        _delta_encoder.reset(
+            new metrics_delta_encoder(_config.push_full_snapshot_interval.get()));
+      }
       _push_timer = new boost::asio::deadline_timer(*_io_service);
       push_metrics();
     }
@@ -156,13 +178,21 @@ class metrics {
       push_metrics();
     });
 
-    prometheus::TextSerializer serializer;
-    std::string data = serializer.Serialize(metrics_registry().Collect());
-    LOG(1) << "pushing metrics " << data.size() << " bytes";
-
+    flush_sharded_counters();
     nlohmann::json msg = nlohmann::json::object();
-    msg["content-type"] = "text/plain";
-    msg["metrics"] = data;
+    if (_delta_encoder) {
+      std::string data;
+      const size_t series = _delta_encoder->encode(metrics_registry().Collect(), data);
+      LOG(1) << "pushing " << series << " metrics series " << data.size() << " bytes";
+      msg["content-type"] = "application/cbor";
+      msg["metrics"] = {{encoded_map_key, std::move(data)}};
+    } else {
+      prometheus::TextSerializer serializer;
+      std::string data = serializer.Serialize(metrics_registry().Collect());
+      LOG(1) << "pushing metrics " << data.size() << " bytes";
+      msg["content-type"] = "text/plain";
+      msg["metrics"] = data;
+    }
 
     if (_config.push_job) {
       msg["job"] = _config.push_job.get();
@@ -207,6 +237,7 @@ class metrics {
   metrics_config _config;
   boost::asio::io_service* _io_service{nullptr};
   rtm::publisher* _publisher{nullptr};
+  std::unique_ptr<metrics_delta_encoder> _delta_encoder;
 
   boost::asio::deadline_timer* _push_timer{nullptr};
   boost::asio::deadline_timer* _update_process_metrics_timer{nullptr};
@@ -221,6 +252,45 @@ metrics& global_metrics() {
 
 prometheus::Registry& metrics_registry() { return global_metrics().registry(); }
 
+constexpr size_t sharded_counter::number_of_shards;
+
+sharded_counter::sharded_counter(prometheus::Counter& counter) : _counter(counter) {
+  auto& all = all_sharded_counters();
+  std::lock_guard<std::mutex> lock(all.mutex);
+  all.counters.push_back(this);
+}
+
+sharded_counter::~sharded_counter() {
+  auto& all = all_sharded_counters();
+  std::lock_guard<std::mutex> lock(all.mutex);
+  all.counters.erase(std::remove(all.counters.begin(), all.counters.end(), this),
+                     all.counters.end());
+}
+
+void sharded_counter::flush() {
+  uint64_t total = 0;
+  for (auto& s : _shards) {
+    total += s.value.exchange(0, std::memory_order_relaxed);
+  }
+  if (total > 0) {
+    _counter.Increment(static_cast<double>(total));
+  }
+}
+
+size_t sharded_counter::shard_index() {
+  static std::atomic<size_t> next_index{0};
+  thread_local const size_t index = next_index++ % number_of_shards;
+  return index;
+}
+
+void flush_sharded_counters() {
+  auto& all = all_sharded_counters();
+  std::lock_guard<std::mutex> lock(all.mutex);
+  for (sharded_counter* c : all.counters) {
+    c->flush();
+  }
+}
+
 po::options_description metrics_options(bool allow_push) {
   po::options_description options("Monitoring options");
   options.add_options()("metrics-bind-address", po::value<std::string>(),
@@ -232,6 +302,10 @@ po::options_description metrics_options(bool allow_push) {
                           "job value to report while pushing metrics.");
     options.add_options()("metrics-push-instance", po::value<std::string>(),
                           "instance value to report while pushing metrics.");
+    options.add_options()(
+        "metrics-push-full-snapshot-interval", po::value<uint32_t>(),
+        "(number of pushes) pushes only series changed since the previous push, as "
+        "CBOR with interned names, and all series every that many pushes.");
   }
   return options;
 }
@@ -248,7 +322,11 @@ metrics_config::metrics_config(const boost::program_options::variables_map& vm)
                    : boost::optional<std::string>{}),
       push_instance(vm.count("metrics-push-instance") > 0
                         ? vm["metrics-push-instance"].as<std::string>()
-                        : boost::optional<std::string>{}) {}
+                        : boost::optional<std::string>{}),
+      push_full_snapshot_interval(
+          vm.count("metrics-push-full-snapshot-interval") > 0
+              ? vm["metrics-push-full-snapshot-interval"].as<uint32_t>()
+              : boost::optional<uint32_t>{}) {}
 
 void init_metrics(const metrics_config& config, boost::asio::io_service& io_service) {
   global_metrics().init(config, io_service);
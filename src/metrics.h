@@ -2,12 +2,17 @@
 
 #include <prometheus/counter.h>
 #include <prometheus/counter_builder.h>
+#include <prometheus/gauge.h>
+#include <prometheus/gauge_builder.h>
 #include <prometheus/histogram.h>
 #include <prometheus/histogram_builder.h>
 #include <prometheus/registry.h>
 #include <boost/asio.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/options_description.hpp>
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include "rtm_client.h"
 
 namespace satori {
@@ -21,10 +26,46 @@ struct metrics_config {
   boost::optional<std::string> push_channel;
   boost::optional<std::string> push_job;
   boost::optional<std::string> push_instance;
+  // if set, pushes carry only series changed since the previous push, and all of
+  // them every that many pushes, see metrics_delta_encoder.
+  boost::optional<uint32_t> push_full_snapshot_interval;
 };
 
 prometheus::Registry& metrics_registry();
 
+// Counter incremented per packet from several threads. Threads add to their own
+// shards instead of contending for a single atomic, shards are added to the
+// prometheus counter by flush_sharded_counters, when process metrics are updated
+// and before metrics are pushed.
+class sharded_counter {
+ public:
+  explicit sharded_counter(prometheus::Counter& counter);
+  ~sharded_counter();
+
+  void increment(uint64_t value = 1) {
+    _shards[shard_index()].value.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  // moves shard values to prometheus counter.
+  void flush();
+
+ private:
+  static constexpr size_t number_of_shards = 32;
+
+  // each shard takes a cache line of its own.
+  struct alignas(64) shard {
+    std::atomic<uint64_t> value{0};
+  };
+
+  // threads are assigned to shards round robin when they increment first.
+  static size_t shard_index();
+
+  prometheus::Counter& _counter;
+  std::array<shard, number_of_shards> _shards;
+};
+
+void flush_sharded_counters();
+
 boost::program_options::options_description metrics_options(bool allow_push = false);
 
 void init_metrics(const metrics_config& config, boost::asio::io_service& io_service);
@@ -0,0 +1,199 @@
+#include "metrics_delta.h"
+
+#include <cmath>
+#include <iterator>
+
+#include "cbor_writer.h"
+#include "logging.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+const char *type_name(prometheus::MetricType type) {
+  switch (type) {
+    case prometheus::MetricType::Counter:
+      return "counter";
+    case prometheus::MetricType::Gauge:
+      return "gauge";
+    case prometheus::MetricType::Summary:
+      return "summary";
+    case prometheus::MetricType::Histogram:
+      return "histogram";
+    default:
+      return "untyped";
+  }
+}
+
+// counts and most counters are whole numbers, which take fewer bytes as integers.
+void write_number(cbor_writer &writer, double value) {
+  if (value >= 0 && value < 9007199254740992.0 && std::floor(value) == value) {
+    writer.write_uint(static_cast<uint64_t>(value));
+  } else {
+    writer.write_double(value);
+  }
+}
+
+// sample values of a metric: value of counter, gauge or untyped one, sample count,
+// sum and buckets of histogram or quantiles of summary.
+std::vector<double> metric_values(prometheus::MetricType type,
+                                  const prometheus::ClientMetric &metric) {
+  std::vector<double> values;
+  switch (type) {
+    case prometheus::MetricType::Counter:
+      values.push_back(metric.counter.value);
+      break;
+    case prometheus::MetricType::Gauge:
+      values.push_back(metric.gauge.value);
+      break;
+    case prometheus::MetricType::Summary:
+      values.push_back(static_cast<double>(metric.summary.sample_count));
+      values.push_back(metric.summary.sample_sum);
+      for (const auto &q : metric.summary.quantile) {
+        values.push_back(q.value);
+      }
+      break;
+    case prometheus::MetricType::Histogram:
+      values.push_back(static_cast<double>(metric.histogram.sample_count));
+      values.push_back(metric.histogram.sample_sum);
+      for (const auto &b : metric.histogram.bucket) {
+        values.push_back(static_cast<double>(b.cumulative_count));
+      }
+      break;
+    default:
+      values.push_back(metric.untyped.value);
+      break;
+  }
+  return values;
+}
+
+// histogram bucket bounds or summary quantiles, which are sent with series
+// definition.
+std::vector<double> metric_bounds(prometheus::MetricType type,
+                                  const prometheus::ClientMetric &metric) {
+  std::vector<double> bounds;
+  if (type == prometheus::MetricType::Histogram) {
+    for (const auto &b : metric.histogram.bucket) {
+      bounds.push_back(b.upper_bound);
+    }
+  } else if (type == prometheus::MetricType::Summary) {
+    for (const auto &q : metric.summary.quantile) {
+      bounds.push_back(q.quantile);
+    }
+  }
+  return bounds;
+}
+
+}  // namespace
+
+metrics_delta_encoder::metrics_delta_encoder(uint32_t full_snapshot_interval)
+    : _full_snapshot_interval(full_snapshot_interval) {
+  CHECK_GT(full_snapshot_interval, 0);
+}
+
+uint32_t metrics_delta_encoder::intern(const std::string &name,
+                                       std::vector<const std::string *> &new_names) {
+  auto it = _names.find(name);
+  if (it != _names.end()) {
+    return it->second;
+  }
+  const auto index = static_cast<uint32_t>(_names.size());
+  new_names.push_back(&_names.emplace(name, index).first->first);
+  return index;
+}
+
+size_t metrics_delta_encoder::encode(
+    const std::vector<prometheus::MetricFamily> &families, std::string &out) {
+  const uint64_t snapshot = _snapshots++;
+  const bool full = snapshot % _full_snapshot_interval == 0;
+  if (full) {
+    _names.clear();
+    _series.clear();
+    _next_series_id = 0;
+  }
+
+  std::vector<const std::string *> new_names;
+  std::string definitions;
+  cbor_writer definitions_writer{definitions};
+  size_t definitions_count = 0;
+  std::string values;
+  cbor_writer values_writer{values};
+  size_t values_count = 0;
+
+  std::string key;
+  for (const auto &family : families) {
+    for (const auto &metric : family.metric) {
+      key = family.name;
+      for (const auto &label : metric.label) {
+        key.push_back('\0');
+        key.append(label.name);
+        key.push_back('\0');
+        key.append(label.value);
+      }
+
+      std::vector<double> current = metric_values(family.type, metric);
+      auto it = _series.find(key);
+      if (it == _series.end()) {
+        it = _series.emplace(key, series{_next_series_id++, {}, snapshot}).first;
+
+        // [id, name, type, [label name, label value, ...], [bounds]]
+        definitions_writer.write_array(5);
+        definitions_writer.write_uint(it->second.id);
+        definitions_writer.write_uint(intern(family.name, new_names));
+        definitions_writer.write_text(type_name(family.type));
+        definitions_writer.write_array(metric.label.size() * 2);
+        for (const auto &label : metric.label) {
+          definitions_writer.write_uint(intern(label.name, new_names));
+          definitions_writer.write_uint(intern(label.value, new_names));
+        }
+        const std::vector<double> bounds = metric_bounds(family.type, metric);
+        definitions_writer.write_array(bounds.size());
+        for (double bound : bounds) {
+          write_number(definitions_writer, bound);
+        }
+        definitions_count++;
+      } else if (it->second.values == current) {
+        it->second.snapshot = snapshot;
+        continue;
+      }
+
+      // [id, values...]
+      values_writer.write_array(current.size() + 1);
+      values_writer.write_uint(it->second.id);
+      for (double value : current) {
+        write_number(values_writer, value);
+      }
+      values_count++;
+      it->second.values = std::move(current);
+      it->second.snapshot = snapshot;
+    }
+  }
+
+  // series which are gone are defined again if they come back.
+  for (auto it = _series.begin(); it != _series.end();) {
+    it = it->second.snapshot == snapshot ? std::next(it) : _series.erase(it);
+  }
+
+  cbor_writer writer{out};
+  writer.write_map(5);
+  writer.write_text("seq");
+  writer.write_uint(snapshot);
+  writer.write_text("full");
+  writer.write_bool(full);
+  writer.write_text("names");
+  writer.write_array(new_names.size());
+  for (const std::string *name : new_names) {
+    writer.write_text(*name);
+  }
+  writer.write_text("series");
+  writer.write_array(definitions_count);
+  writer.write_raw(definitions.data(), definitions.size());
+  writer.write_text("values");
+  writer.write_array(values_count);
+  writer.write_raw(values.data(), values.size());
+  return values_count;
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,45 @@
+// Compact encoding of pushed metrics, see "Delta metrics push" in docs/reference.md.
+#pragma once
+
+#include <prometheus/metric_family.h>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace satori {
+namespace video {
+
+// Encodes registry snapshots as CBOR maps which carry only series changed since the
+// previous snapshot. Metric names, label names and values are interned, series are
+// sent by their ids once they are defined. Every full_snapshot_interval snapshots
+// all series are sent and interning starts over, so receivers can join at any of
+// these snapshots.
+class metrics_delta_encoder {
+ public:
+  explicit metrics_delta_encoder(uint32_t full_snapshot_interval);
+
+  // appends CBOR map to out, returns number of series in it.
+  size_t encode(const std::vector<prometheus::MetricFamily> &families, std::string &out);
+
+ private:
+  struct series {
+    uint32_t id;
+    std::vector<double> values;
+    // snapshot which had the series last, series that are gone are forgotten.
+    uint64_t snapshot;
+  };
+
+  // index of string in names table, which is appended to new_names if it's not
+  // there yet.
+  uint32_t intern(const std::string &name, std::vector<const std::string *> &new_names);
+
+  const uint32_t _full_snapshot_interval;
+  uint64_t _snapshots{0};
+  std::unordered_map<std::string, uint32_t> _names;
+  std::unordered_map<std::string, series> _series;
+  uint32_t _next_series_id{0};
+};
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,225 @@
+#include "mjpeg_encoder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <tuple>
+
+#include "avutils.h"
+#include "logging.h"
+#include "metrics.h"
+#include "streams/parallel_map.h"
+#include "video_error.h"
+#include "warm_pool.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+auto &encoded_frames = prometheus::BuildCounter()
+                           .Name("mjpeg_encoder_frames_total")
+                           .Register(metrics_registry())
+                           .Add({});
+
+auto &encode_millis =
+    prometheus::BuildHistogram()
+        .Name("mjpeg_encoder_encode_millis")
+        .Register(metrics_registry())
+        .Add({}, std::vector<double>{0, 0.5, 1, 2, 3, 4, 5, 10, 15, 20, 30, 50, 100});
+
+// Encoder context with everything needed to turn image frames of one size and
+// pixel format into JPEG images. Used by one thread at a time.
+struct jpeg_compressor {
+  std::shared_ptr<AVCodecContext> context;
+  // set when image frames need pixel format conversion.
+  std::shared_ptr<SwsContext> sws_context;
+  std::shared_ptr<AVFrame> frame;
+};
+
+// width, height, pixel format, quality and subsampling.
+using compressor_key =
+    std::tuple<uint16_t, uint16_t, image_pixel_format, int, std::string>;
+
+// keeps a compressor per core for each frame size, enough for all encoding threads.
+warm_pool<compressor_key, jpeg_compressor> &compressor_pool() {
+  static warm_pool<compressor_key, jpeg_compressor> pool{
+      std::max(1u, std::thread::hardware_concurrency())};
+  return pool;
+}
+
+boost::optional<AVPixelFormat> jpeg_pixel_format(const std::string &subsampling) {
+  if (subsampling == "420") {
+    return AV_PIX_FMT_YUVJ420P;
+  }
+  if (subsampling == "422") {
+    return AV_PIX_FMT_YUVJ422P;
+  }
+  if (subsampling == "444") {
+    return AV_PIX_FMT_YUVJ444P;
+  }
+  return boost::none;
+}
+
+// maps 1-100 quality to 31-2 quantizer scale of FFmpeg's encoder.
+int qscale(int quality) {
+  quality = std::min(100, std::max(1, quality));
+  return 2 + (100 - quality) * 29 / 99;
+}
+
+std::shared_ptr<jpeg_compressor> create_compressor(const owned_image_frame &f,
+                                                   const mjpeg_encoder_profile &profile) {
+  const boost::optional<AVPixelFormat> jpeg_format =
+      jpeg_pixel_format(profile.subsampling);
+  if (!jpeg_format) {
+    LOG(ERROR) << "unsupported chroma subsampling " << profile.subsampling;
+    return nullptr;
+  }
+
+  auto compressor = std::make_shared<jpeg_compressor>();
+  compressor->context = avutils::encoder_context(AV_CODEC_ID_MJPEG);
+  if (!compressor->context) {
+    return nullptr;
+  }
+  AVCodecContext &context = *compressor->context;
+  context.width = f.width;
+  context.height = f.height;
+  context.pix_fmt = *jpeg_format;
+  context.flags |= AV_CODEC_FLAG_QSCALE;
+  context.global_quality = FF_QP2LAMBDA * qscale(profile.quality);
+  // frames are encoded in parallel by separate contexts instead.
+  context.thread_count = 1;
+
+  int ret = avcodec_open2(compressor->context.get(), nullptr, nullptr);
+  if (ret < 0) {
+    LOG(ERROR) << "couldn't open mjpeg encoder: " << avutils::error_msg(ret);
+    return nullptr;
+  }
+
+  const AVPixelFormat av_pixel_format = avutils::to_av_pixel_format(f.pixel_format);
+  if (av_pixel_format != context.pix_fmt) {
+    compressor->frame = avutils::av_frame(f.width, f.height, 1, context.pix_fmt);
+    compressor->sws_context = avutils::sws_context(f.width, f.height, av_pixel_format,
+                                                   f.width, f.height, context.pix_fmt);
+    if (!compressor->frame || !compressor->sws_context) {
+      return nullptr;
+    }
+  }
+
+  LOG(INFO) << "created mjpeg compressor " << f.width << "x" << f.height
+            << ", quality " << profile.quality << ", subsampling "
+            << profile.subsampling;
+  return compressor;
+}
+
+// thread-safe, compressors are taken from the pool for the time of encoding.
+streams::error_or<encoded_frame> encode_frame(const owned_image_frame &f,
+                                              const mjpeg_encoder_profile &profile) {
+  const auto start = std::chrono::high_resolution_clock::now();
+
+  const compressor_key key{f.width, f.height, f.pixel_format, profile.quality,
+                           profile.subsampling};
+  std::shared_ptr<jpeg_compressor> compressor = compressor_pool().take(key);
+  if (!compressor) {
+    compressor = create_compressor(f, profile);
+    if (!compressor) {
+      return make_error_condition(video_error::STREAM_INITIALIZATION_ERROR);
+    }
+  }
+
+  // planes are read in place unless they need conversion.
+  std::shared_ptr<AVFrame> input = avutils::image_to_av_frame(f);
+  if (!input) {
+    return make_error_condition(video_error::FRAME_GENERATION_ERROR);
+  }
+  if (compressor->sws_context) {
+    if (av_frame_make_writable(compressor->frame.get()) < 0) {
+      return make_error_condition(video_error::FRAME_GENERATION_ERROR);
+    }
+    avutils::sws_scale(compressor->sws_context, input, compressor->frame);
+    input = compressor->frame;
+  }
+  // quantizer is taken from frames in constant quality mode.
+  input->quality = compressor->context->global_quality;
+
+  AVCodecContext *context = compressor->context.get();
+  int ret = avcodec_send_frame(context, input.get());
+  if (ret < 0) {
+    LOG(ERROR) << "couldn't send frame to mjpeg encoder: " << avutils::error_msg(ret);
+    return make_error_condition(video_error::FRAME_GENERATION_ERROR);
+  }
+
+  AVPacket packet;
+  av_init_packet(&packet);
+  packet.data = nullptr;
+  packet.size = 0;
+  ret = avcodec_receive_packet(context, &packet);
+  if (ret < 0) {
+    LOG(ERROR) << "couldn't receive packet from mjpeg encoder: "
+               << avutils::error_msg(ret);
+    return make_error_condition(video_error::FRAME_GENERATION_ERROR);
+  }
+
+  encoded_frame frame;
+  frame.data = shared_bytes{reinterpret_cast<const char *>(packet.data),
+                            static_cast<size_t>(packet.size)};
+  frame.id = f.id;
+  frame.timestamp = f.timestamp;
+  frame.creation_time = std::chrono::system_clock::now();
+  frame.key_frame = true;
+  av_packet_unref(&packet);
+
+  // intra-only encoder keeps no state between frames, the next stream can use it.
+  compressor_pool().put(key, std::move(compressor));
+
+  encoded_frames.Increment();
+  encode_millis.Observe(std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::high_resolution_clock::now() - start)
+                            .count()
+                        / 1000.0);
+  return frame;
+}
+
+}  // namespace
+
+streams::op<owned_image_packet, encoded_packet> encode_as_mjpeg(
+    const mjpeg_encoder_profile &profile) {
+  return [profile](streams::publisher<owned_image_packet> &&src) {
+    LOG(INFO) << "MJPEG encoder quality " << profile.quality << ", subsampling "
+              << profile.subsampling << ", threads " << profile.threads;
+
+    auto frames = std::move(src) >> streams::filter_map([](owned_image_packet &&packet) {
+                    const owned_image_frame *frame =
+                        boost::get<owned_image_frame>(&packet);
+                    return frame != nullptr ? boost::make_optional(*frame)
+                                            : boost::optional<owned_image_frame>{};
+                  });
+
+    auto encode = [profile](owned_image_frame &&f) { return encode_frame(f, profile); };
+    auto encoded = profile.threads > 1
+                       ? std::move(frames) >> streams::parallel_map(profile.threads,
+                                                                    std::move(encode))
+                       : std::move(frames) >> streams::map(std::move(encode));
+
+    auto metadata_sent = std::make_shared<bool>(false);
+    return std::move(encoded)
+           >> streams::flat_map(
+                  [metadata_sent](streams::error_or<encoded_frame> &&frame) {
+                    if (!frame.ok()) {
+                      return streams::publishers::error<encoded_packet>(
+                          frame.error_condition());
+                    }
+                    if (*metadata_sent) {
+                      return streams::publishers::of({encoded_packet{frame.move()}});
+                    }
+                    *metadata_sent = true;
+                    encoded_metadata m;
+                    m.codec_name = "mjpeg";
+                    return streams::publishers::of(
+                        {encoded_packet{m}, encoded_packet{frame.move()}});
+                  });
+  };
+}
+
+}  // namespace video
+}  // namespace satori
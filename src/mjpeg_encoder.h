@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+
+#include "data.h"
+#include "streams/streams.h"
+
+namespace satori {
+namespace video {
+
+// Motion JPEG settings, every frame is a separate JPEG image.
+struct mjpeg_encoder_profile {
+  // 1-100, like libjpeg quality.
+  int quality{80};
+  // chroma subsampling: 420, 422 or 444.
+  std::string subsampling{"420"};
+  // frames are independent, so that many of them are encoded at the same time.
+  // Output order is preserved. 1 encodes on the thread delivering frames.
+  size_t threads{1};
+};
+
+// emits metadata without codec data, then a key frame per image frame.
+// Encoder contexts are pooled and shared by all streams with the same frame size
+// and profile.
+streams::op<owned_image_packet, encoded_packet> encode_as_mjpeg(
+    const mjpeg_encoder_profile &profile = mjpeg_encoder_profile{});
+
+}  // namespace video
+}  // namespace satori
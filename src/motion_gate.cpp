@@ -0,0 +1,110 @@
+#include "motion_gate.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "avutils.h"
+#include "logging.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+auto &frames_gated_total =
+    prometheus::BuildCounter().Name("frames_gated_total").Register(metrics_registry());
+
+// every that many rows are summed into signature.
+constexpr int row_step = 4;
+
+int bytes_per_pixel(image_pixel_format format) {
+  switch (format) {
+    case image_pixel_format::RGB0:
+      return 4;
+    case image_pixel_format::BGR:
+      return 3;
+    default:
+      // luma plane of planar and semi-planar formats.
+      return 1;
+  }
+}
+
+}  // namespace
+
+constexpr int motion_gate::grid_size;
+
+motion_gate::motion_gate(const std::string &id, double threshold,
+                         std::chrono::system_clock::duration keep_alive)
+    : _threshold(threshold),
+      _keep_alive(keep_alive),
+      _gated(frames_gated_total.Add({{"id", id}})) {
+  CHECK_GE(threshold, 0);
+}
+
+bool motion_gate::compute_signature(const owned_image_frame &frame, signature &result) {
+  const image_plane &plane = frame.plane_data[0];
+  const int pixel_bytes = bytes_per_pixel(frame.pixel_format);
+  if (frame.on_device || plane.empty() || frame.width < grid_size
+      || frame.height < grid_size) {
+    return false;
+  }
+  const size_t stride = frame.plane_strides[0];
+  CHECK_LE(stride * (frame.height - 1) + frame.width * pixel_bytes, plane.size())
+      << "plane is smaller than frame";
+
+  result.fill(0);
+  const int cell_width = frame.width / grid_size;
+  const int cell_height = frame.height / grid_size;
+  const int step = std::min(row_step, cell_height);
+  for (int cy = 0; cy < grid_size; cy++) {
+    for (int y = cy * cell_height; y < (cy + 1) * cell_height; y += step) {
+      const uint8_t *row = plane.data() + stride * y;
+      for (int cx = 0; cx < grid_size; cx++) {
+        result[cy * grid_size + cx] += avutils::sum_bytes(
+            row + cx * cell_width * pixel_bytes, cell_width * pixel_bytes);
+      }
+    }
+  }
+
+  // averages keep threshold independent of frame size.
+  const int rows = (cell_height + step - 1) / step;
+  const uint32_t samples = static_cast<uint32_t>(rows * cell_width * pixel_bytes);
+  for (uint32_t &cell : result) {
+    cell /= samples;
+  }
+  return true;
+}
+
+bool motion_gate::pass(const owned_image_frame &frame) {
+  signature current;
+  if (!compute_signature(frame, current)) {
+    return true;
+  }
+
+  if (_has_reference && frame.width == _reference_width
+      && frame.height == _reference_height) {
+    const auto elapsed = frame.timestamp - _reference_timestamp;
+    const bool keep_alive_due = _keep_alive.count() > 0 && elapsed >= _keep_alive;
+    if (!keep_alive_due && elapsed.count() >= 0) {
+      uint64_t difference = 0;
+      for (int i = 0; i < grid_size * grid_size; i++) {
+        difference += static_cast<uint64_t>(
+            std::abs(static_cast<int64_t>(current[i]) - _reference[i]));
+      }
+      if (static_cast<double>(difference) / (grid_size * grid_size) <= _threshold) {
+        _gated.Increment();
+        return false;
+      }
+    }
+  }
+
+  _has_reference = true;
+  _reference = current;
+  _reference_timestamp = frame.timestamp;
+  _reference_width = frame.width;
+  _reference_height = frame.height;
+  return true;
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "data.h"
+#include "metrics.h"
+
+namespace satori {
+namespace video {
+
+// Drops frames which look like the last frame passed to the bot, so bots of static
+// cameras don't run on identical frames. Frames are compared by signatures, average
+// brightness of 16x16 cells of the first plane. Dropped frames are counted in
+// frames_gated_total with id label.
+class motion_gate {
+ public:
+  // threshold is mean absolute difference of cells, 0-255, above which frame passes.
+  // Frames pass at least once per keep_alive anyway, 0 turns keep alive off.
+  motion_gate(const std::string &id, double threshold,
+              std::chrono::system_clock::duration keep_alive);
+
+  // false if frame should be dropped. Frames which can't be read on host always pass.
+  bool pass(const owned_image_frame &frame);
+
+ private:
+  static constexpr int grid_size = 16;
+  using signature = std::array<uint32_t, grid_size * grid_size>;
+
+  static bool compute_signature(const owned_image_frame &frame, signature &result);
+
+  const double _threshold;
+  const std::chrono::system_clock::duration _keep_alive;
+  prometheus::Counter &_gated;
+  // of the last passed frame.
+  bool _has_reference{false};
+  signature _reference;
+  std::chrono::system_clock::time_point _reference_timestamp;
+  uint16_t _reference_width{0};
+  uint16_t _reference_height{0};
+};
+
+}  // namespace video
+}  // namespace satori
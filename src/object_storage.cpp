@@ -0,0 +1,551 @@
+#include "object_storage.h"
+
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <cctype>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <json.hpp>
+
+#include "logging.h"
+#include "metrics.h"
+#include "stopwatch.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+namespace asio = boost::asio;
+namespace http = boost::beast::http;
+
+const std::vector<double> request_millis_buckets{
+    0, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000};
+
+auto &request_millis = prometheus::BuildHistogram()
+                           .Name("object_storage_request_millis")
+                           .Register(metrics_registry());
+
+auto &requests_failed = prometheus::BuildCounter()
+                            .Name("object_storage_requests_failed_total")
+                            .Register(metrics_registry());
+
+auto &uploaded_bytes = prometheus::BuildCounter()
+                           .Name("object_storage_uploaded_bytes_total")
+                           .Register(metrics_registry())
+                           .Add({});
+
+constexpr size_t min_part_size = 5 * 1024 * 1024;
+
+std::string to_hex(const unsigned char *data, size_t size) {
+  static const char digits[] = "0123456789abcdef";
+  std::string result;
+  result.reserve(size * 2);
+  for (size_t i = 0; i < size; i++) {
+    result += digits[data[i] >> 4];
+    result += digits[data[i] & 0xf];
+  }
+  return result;
+}
+
+std::string hmac_sha256(const std::string &key, const std::string &data) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int size = 0;
+  HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()),
+       reinterpret_cast<const unsigned char *>(data.data()), data.size(), digest, &size);
+  return std::string(reinterpret_cast<const char *>(digest), size);
+}
+
+// RFC 3986 encoding of signature version 4, slashes of object keys are kept.
+std::string uri_encode(const std::string &s, bool keep_slash) {
+  static const char digits[] = "0123456789ABCDEF";
+  std::string result;
+  for (const char c : s) {
+    const auto u = static_cast<unsigned char>(c);
+    if (isalnum(u) || c == '-' || c == '_' || c == '.' || c == '~'
+        || (keep_slash && c == '/')) {
+      result += c;
+    } else {
+      result += '%';
+      result += digits[u >> 4];
+      result += digits[u & 0xf];
+    }
+  }
+  return result;
+}
+
+std::string format_time(std::chrono::system_clock::time_point t, const char *format) {
+  const std::time_t time = std::chrono::system_clock::to_time_t(t);
+  std::tm tm{};
+  gmtime_r(&time, &tm);
+  char buffer[32];
+  strftime(buffer, sizeof(buffer), format, &tm);
+  return buffer;
+}
+
+std::string trim(const std::string &s) {
+  const size_t begin = s.find_first_not_of(" \t");
+  if (begin == std::string::npos) {
+    return "";
+  }
+  return s.substr(begin, s.find_last_not_of(" \t") - begin + 1);
+}
+
+std::string canonical_query(const std::map<std::string, std::string> &query) {
+  std::map<std::string, std::string> encoded;
+  for (const auto &kv : query) {
+    encoded[uri_encode(kv.first, false)] = uri_encode(kv.second, false);
+  }
+  std::string result;
+  for (const auto &kv : encoded) {
+    if (!result.empty()) {
+      result += '&';
+    }
+    result += kv.first + "=" + kv.second;
+  }
+  return result;
+}
+
+// text of the first element with that name in xml document.
+std::string xml_element(const std::string &xml, const std::string &name) {
+  const std::string open = "<" + name + ">";
+  const size_t begin = xml.find(open);
+  if (begin == std::string::npos) {
+    return "";
+  }
+  const size_t end = xml.find("</" + name + ">", begin);
+  if (end == std::string::npos) {
+    return "";
+  }
+  return xml.substr(begin + open.size(), end - begin - open.size());
+}
+
+}  // namespace
+
+object_storage_config load_object_storage_config(const std::string &filename) {
+  std::ifstream in{filename};
+  if (!in) {
+    std::cerr << "Can't read storage config: " << filename << std::endl;
+    exit(1);
+  }
+
+  nlohmann::json json;
+  try {
+    in >> json;
+  } catch (const std::exception &e) {
+    std::cerr << "Can't parse storage config " << filename << ": " << e.what()
+              << std::endl;
+    exit(1);
+  }
+  if (!json.is_object() || json.find("access_key") == json.end()
+      || json.find("secret_key") == json.end()) {
+    std::cerr << "Storage config needs access_key and secret_key: " << filename
+              << std::endl;
+    exit(1);
+  }
+
+  object_storage_config config;
+  config.access_key = json["access_key"].get<std::string>();
+  config.secret_key = json["secret_key"].get<std::string>();
+  if (json.find("endpoint") != json.end()) {
+    config.endpoint = json["endpoint"].get<std::string>();
+  }
+  if (json.find("region") != json.end()) {
+    config.region = json["region"].get<std::string>();
+  }
+  if (json.find("tls") != json.end()) {
+    config.tls = json["tls"].get<bool>();
+  }
+  if (json.find("part_size") != json.end()) {
+    config.part_size = json["part_size"].get<size_t>();
+    if (config.part_size < min_part_size) {
+      std::cerr << "Storage part size should be at least " << min_part_size
+                << " bytes" << std::endl;
+      exit(1);
+    }
+  }
+  if (json.find("timeout_ms") != json.end()) {
+    config.timeout = std::chrono::milliseconds{json["timeout_ms"].get<int64_t>()};
+  }
+  return config;
+}
+
+bool is_object_url(const std::string &url) {
+  return url.compare(0, 5, "s3://") == 0 || url.compare(0, 5, "gs://") == 0;
+}
+
+boost::optional<object_url> parse_object_url(const std::string &url) {
+  if (!is_object_url(url)) {
+    return boost::none;
+  }
+  const size_t slash = url.find('/', 5);
+  if (slash == std::string::npos || slash == 5 || slash + 1 == url.size()) {
+    return boost::none;
+  }
+  return object_url{url.substr(0, 2), url.substr(5, slash - 5), url.substr(slash + 1)};
+}
+
+object_storage_config resolve_config(const object_storage_config &config,
+                                     const object_url &url) {
+  object_storage_config result = config;
+  if (result.region.empty()) {
+    result.region = url.scheme == "gs" ? "auto" : "us-east-1";
+  }
+  if (result.endpoint.empty()) {
+    result.endpoint = url.scheme == "gs" ? "storage.googleapis.com"
+                                         : "s3." + result.region + ".amazonaws.com";
+  }
+  return result;
+}
+
+std::string sha256_hex(const void *data, size_t size) {
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256(static_cast<const unsigned char *>(data), size, digest);
+  return to_hex(digest, sizeof(digest));
+}
+
+std::string sign_request(signed_request &request, const object_storage_config &config,
+                         std::chrono::system_clock::time_point now) {
+  const std::string timestamp = format_time(now, "%Y%m%dT%H%M%SZ");
+  const std::string date = timestamp.substr(0, 8);
+  request.headers["x-amz-date"] = timestamp;
+  request.headers["x-amz-content-sha256"] = request.payload_sha256;
+
+  std::string canonical_headers;
+  std::string signed_headers;
+  for (const auto &kv : request.headers) {
+    canonical_headers += kv.first + ":" + trim(kv.second) + "\n";
+    signed_headers += (signed_headers.empty() ? "" : ";") + kv.first;
+  }
+  const std::string canonical_request =
+      request.method + "\n" + request.path + "\n" + canonical_query(request.query) + "\n"
+      + canonical_headers + "\n" + signed_headers + "\n" + request.payload_sha256;
+
+  const std::string scope = date + "/" + config.region + "/s3/aws4_request";
+  const std::string string_to_sign =
+      "AWS4-HMAC-SHA256\n" + timestamp + "\n" + scope + "\n"
+      + sha256_hex(canonical_request.data(), canonical_request.size());
+
+  std::string key = hmac_sha256("AWS4" + config.secret_key, date);
+  key = hmac_sha256(key, config.region);
+  key = hmac_sha256(key, "s3");
+  key = hmac_sha256(key, "aws4_request");
+  const std::string signature = hmac_sha256(key, string_to_sign);
+
+  return "AWS4-HMAC-SHA256 Credential=" + config.access_key + "/" + scope
+         + ",SignedHeaders=" + signed_headers + ",Signature="
+         + to_hex(reinterpret_cast<const unsigned char *>(signature.data()),
+                  signature.size());
+}
+
+// Keep-alive connection to storage endpoint, reconnects after errors. Requests are
+// blocking, but run as asynchronous operations on own io_service to have deadlines.
+class storage_connection {
+ public:
+  explicit storage_connection(const object_storage_config &config) : _config(config) {
+    const size_t colon = _config.endpoint.rfind(':');
+    _host = _config.endpoint.substr(0, colon);
+    _port = colon != std::string::npos ? _config.endpoint.substr(colon + 1)
+                                       : (_config.tls ? "443" : "80");
+    _ssl_context.set_default_verify_paths();
+    _ssl_context.set_verify_mode(asio::ssl::verify_peer);
+  }
+
+  boost::optional<http::response<http::string_body>> send(
+      http::request<http::string_body> &request) {
+    boost::system::error_code ec;
+    if (!_connected) {
+      ec = connect();
+      if (ec) {
+        LOG(ERROR) << "can't connect to " << _config.endpoint << ": " << ec.message();
+        return boost::none;
+      }
+    }
+
+    http::response<http::string_body> response;
+    if (_config.tls) {
+      ec = exchange(*_ssl_stream, request, response);
+    } else {
+      ec = exchange(_socket, request, response);
+    }
+    if (ec) {
+      LOG(ERROR) << "request to " << _config.endpoint << " failed: " << ec.message();
+      close();
+      return boost::none;
+    }
+    if (!response.keep_alive()) {
+      close();
+    }
+    return response;
+  }
+
+ private:
+  template <typename Stream>
+  boost::system::error_code exchange(Stream &stream,
+                                     http::request<http::string_body> &request,
+                                     http::response<http::string_body> &response) {
+    boost::system::error_code ec = with_deadline(
+        [&](auto &&done) { http::async_write(stream, request, std::move(done)); });
+    if (!ec) {
+      boost::beast::flat_buffer buffer;
+      ec = with_deadline([&](auto &&done) {
+        http::async_read(stream, buffer, response, std::move(done));
+      });
+    }
+    return ec;
+  }
+
+  boost::system::error_code connect() {
+    asio::ip::tcp::resolver::results_type endpoints;
+    boost::system::error_code ec = with_deadline([&](auto &&done) {
+      _resolver.async_resolve(
+          _host, _port,
+          [&endpoints, done](boost::system::error_code error,
+                             asio::ip::tcp::resolver::results_type results) {
+            endpoints = results;
+            done(error);
+          });
+    });
+    if (ec) {
+      return ec;
+    }
+    if (!_config.tls) {
+      ec = with_deadline(
+          [&](auto &&done) { asio::async_connect(_socket, endpoints, std::move(done)); });
+      _connected = !ec;
+      return ec;
+    }
+
+    _ssl_stream = std::make_unique<asio::ssl::stream<asio::ip::tcp::socket>>(
+        _io_service, _ssl_context);
+    SSL_set_tlsext_host_name(_ssl_stream->native_handle(), _host.c_str());
+    _ssl_stream->set_verify_callback(asio::ssl::rfc2818_verification(_host));
+    ec = with_deadline([&](auto &&done) {
+      asio::async_connect(_ssl_stream->next_layer(), endpoints, std::move(done));
+    });
+    if (!ec) {
+      ec = with_deadline([&](auto &&done) {
+        _ssl_stream->async_handshake(asio::ssl::stream_base::client, std::move(done));
+      });
+    }
+    _connected = !ec;
+    return ec;
+  }
+
+  // runs operation which start() begins with a completion handler, the socket is
+  // closed if it doesn't complete in time, to cancel it.
+  template <typename Start>
+  boost::system::error_code with_deadline(Start &&start) {
+    boost::system::error_code result = asio::error::would_block;
+    start([&result](boost::system::error_code ec, auto &&...) { result = ec; });
+    _io_service.restart();
+    _io_service.run_for(_config.timeout);
+    if (result == asio::error::would_block) {
+      boost::system::error_code ec;
+      _resolver.cancel();
+      socket().close(ec);
+      // cancelled handlers still refer to the streams, so they are run before
+      // anything is destroyed.
+      _io_service.restart();
+      _io_service.run();
+      result = asio::error::timed_out;
+    }
+    return result;
+  }
+
+  asio::ip::tcp::socket &socket() {
+    return _ssl_stream ? _ssl_stream->next_layer() : _socket;
+  }
+
+  void close() {
+    boost::system::error_code ec;
+    if (_ssl_stream) {
+      _ssl_stream->next_layer().close(ec);
+      _ssl_stream.reset();
+    }
+    _socket.close(ec);
+    _connected = false;
+  }
+
+  const object_storage_config _config;
+  std::string _host;
+  std::string _port;
+  asio::io_service _io_service;
+  asio::ssl::context _ssl_context{asio::ssl::context::sslv23_client};
+  asio::ip::tcp::resolver _resolver{_io_service};
+  asio::ip::tcp::socket _socket{_io_service};
+  std::unique_ptr<asio::ssl::stream<asio::ip::tcp::socket>> _ssl_stream;
+  bool _connected{false};
+};
+
+namespace {
+
+// signs and sends request, repeating it on network and server errors.
+boost::optional<http::response<http::string_body>> send_signed(
+    storage_connection &connection, const object_storage_config &config,
+    const std::string &type, http::verb method, const std::string &path,
+    const std::map<std::string, std::string> &query, std::string &&body) {
+  signed_request to_sign;
+  to_sign.method = std::string{http::to_string(method)};
+  to_sign.path = path;
+  to_sign.query = query;
+  to_sign.headers["host"] = config.endpoint;
+  to_sign.payload_sha256 = sha256_hex(body.data(), body.size());
+
+  http::request<http::string_body> request{method, path, 11};
+  std::string target = path;
+  const std::string query_string = canonical_query(query);
+  if (!query_string.empty()) {
+    target += "?" + query_string;
+  }
+  request.target(target);
+  request.body() = std::move(body);
+  request.prepare_payload();
+
+  for (int attempt = 0; attempt <= config.retries; attempt++) {
+    const std::string authorization =
+        sign_request(to_sign, config, std::chrono::system_clock::now());
+    for (const auto &kv : to_sign.headers) {
+      request.set(kv.first, kv.second);
+    }
+    request.set(http::field::authorization, authorization);
+
+    stopwatch<std::chrono::steady_clock> s;
+    auto response = connection.send(request);
+    request_millis.Add({{"type", type}}, request_millis_buckets).Observe(s.millis());
+    // complete request may fail after 200 status, with an error in body.
+    if (response && response->result_int() / 100 == 2
+        && xml_element(response->body(), "Code").empty()) {
+      return response;
+    }
+
+    requests_failed.Add({{"type", type}}).Increment();
+    if (response) {
+      LOG(ERROR) << type << " request failed with " << response->result_int() << ": "
+                 << response->body();
+      if (response->result_int() < 500) {
+        return boost::none;
+      }
+    }
+  }
+  return boost::none;
+}
+
+}  // namespace
+
+multipart_upload::multipart_upload(const object_storage_config &config,
+                                   const object_url &url)
+    : _config(resolve_config(config, url)),
+      _url(url),
+      _connection(std::make_unique<storage_connection>(_config)) {
+  _part.reserve(_config.part_size);
+}
+
+multipart_upload::~multipart_upload() {
+  if (!_completed && !_upload_id.empty()) {
+    abort();
+  }
+}
+
+bool multipart_upload::write(const uint8_t *data, size_t size) {
+  if (_failed) {
+    return false;
+  }
+  while (size > 0) {
+    const size_t n = std::min(size, _config.part_size - _part.size());
+    _part.append(reinterpret_cast<const char *>(data), n);
+    data += n;
+    size -= n;
+    _size += n;
+    if (_part.size() == _config.part_size && !upload_part()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool multipart_upload::complete() {
+  if (_failed || !upload_part()) {
+    return false;
+  }
+
+  std::string body = "<CompleteMultipartUpload>";
+  for (size_t i = 0; i < _etags.size(); i++) {
+    body += "<Part><PartNumber>" + std::to_string(i + 1) + "</PartNumber><ETag>"
+            + _etags[i] + "</ETag></Part>";
+  }
+  body += "</CompleteMultipartUpload>";
+  if (!send_signed(*_connection, _config, "complete", http::verb::post, object_path(),
+                   {{"uploadId", _upload_id}}, std::move(body))) {
+    abort();
+    return false;
+  }
+  _completed = true;
+  LOG(INFO) << "uploaded " << _size << " bytes to " << _url.scheme << "://"
+            << _url.bucket << "/" << _url.key;
+  return true;
+}
+
+std::string multipart_upload::object_path() const {
+  return "/" + _url.bucket + "/" + uri_encode(_url.key, true);
+}
+
+bool multipart_upload::start() {
+  auto response = send_signed(*_connection, _config, "initiate", http::verb::post,
+                              object_path(), {{"uploads", ""}}, "");
+  if (response) {
+    _upload_id = xml_element(response->body(), "UploadId");
+  }
+  if (_upload_id.empty()) {
+    LOG(ERROR) << "can't start upload of " << _url.key;
+    _failed = true;
+    return false;
+  }
+  return true;
+}
+
+bool multipart_upload::upload_part() {
+  if (_upload_id.empty() && !start()) {
+    return false;
+  }
+  // the last part may be empty only if it is the only one.
+  if (_part.empty() && !_etags.empty()) {
+    return true;
+  }
+
+  const size_t part_bytes = _part.size();
+  auto response =
+      send_signed(*_connection, _config, "part", http::verb::put, object_path(),
+                  {{"partNumber", std::to_string(_etags.size() + 1)},
+                   {"uploadId", _upload_id}},
+                  std::move(_part));
+  _part.clear();
+  _part.reserve(_config.part_size);
+  if (!response || (*response)[http::field::etag].empty()) {
+    LOG(ERROR) << "can't upload part " << _etags.size() + 1 << " of " << _url.key;
+    abort();
+    return false;
+  }
+  _etags.push_back(std::string{(*response)[http::field::etag]});
+  uploaded_bytes.Increment(part_bytes);
+  return true;
+}
+
+void multipart_upload::abort() {
+  _failed = true;
+  if (_upload_id.empty()) {
+    return;
+  }
+  LOG(WARNING) << "aborting upload of " << _url.key;
+  send_signed(*_connection, _config, "abort", http::verb::delete_, object_path(),
+              {{"uploadId", _upload_id}}, "");
+  _upload_id.clear();
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,111 @@
+// Multipart uploads to S3 compatible object storage, like AWS S3 or Google Cloud
+// Storage with HMAC keys. Requests are signed with AWS signature version 4.
+#pragma once
+
+#include <boost/optional.hpp>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace satori {
+namespace video {
+
+struct object_storage_config {
+  // host[:port] of S3 API, empty one is picked by scheme of object url.
+  std::string endpoint;
+  // empty one is picked by scheme of object url.
+  std::string region;
+  std::string access_key;
+  std::string secret_key;
+  // plain http is meant for local storage emulators.
+  bool tls{true};
+  // object is uploaded in parts of that size, storage requires at least 5 MiB for
+  // all parts but the last one.
+  size_t part_size{8 * 1024 * 1024};
+  // failed requests are repeated that many times.
+  int retries{3};
+  // deadline of each step of a request: resolve, connect, handshake, write and read.
+  std::chrono::milliseconds timeout{60000};
+};
+
+// reads access_key and secret_key fields of json file, other fields override
+// endpoint, region and tls. Exits on error.
+object_storage_config load_object_storage_config(const std::string &filename);
+
+// s3://<bucket>/<key> or gs://<bucket>/<key>.
+struct object_url {
+  std::string scheme;
+  std::string bucket;
+  std::string key;
+};
+
+bool is_object_url(const std::string &url);
+boost::optional<object_url> parse_object_url(const std::string &url);
+
+// fills endpoint and region the scheme defaults to.
+object_storage_config resolve_config(const object_storage_config &config,
+                                     const object_url &url);
+
+// Request to be signed, path is URI encoded already.
+struct signed_request {
+  std::string method;
+  std::string path;
+  std::map<std::string, std::string> query;
+  // lowercase names, host is required.
+  std::map<std::string, std::string> headers;
+  std::string payload_sha256;
+};
+
+std::string sha256_hex(const void *data, size_t size);
+
+// adds x-amz-date and x-amz-content-sha256 headers to request, returns value of
+// Authorization header.
+std::string sign_request(signed_request &request, const object_storage_config &config,
+                         std::chrono::system_clock::time_point now);
+
+class storage_connection;
+
+// Streams an object to storage, data is kept in memory up to part size and sent as
+// a part once it is full, on the thread which writes. Object appears in bucket once
+// upload is complete, an upload which is destroyed before is aborted.
+class multipart_upload {
+ public:
+  multipart_upload(const object_storage_config &config, const object_url &url);
+  ~multipart_upload();
+
+  multipart_upload(const multipart_upload &) = delete;
+  multipart_upload &operator=(const multipart_upload &) = delete;
+
+  // returns false if a part couldn't be uploaded, upload is aborted then.
+  bool write(const uint8_t *data, size_t size);
+
+  // uploads the rest of data and makes object visible.
+  bool complete();
+
+  // bytes written so far.
+  uint64_t size() const { return _size; }
+
+ private:
+  // path style url of the object.
+  std::string object_path() const;
+  bool start();
+  bool upload_part();
+  void abort();
+
+  const object_storage_config _config;
+  const object_url _url;
+  std::unique_ptr<storage_connection> _connection;
+  std::string _upload_id;
+  std::string _part;
+  // entity tags of uploaded parts, part numbers start from 1.
+  std::vector<std::string> _etags;
+  uint64_t _size{0};
+  bool _failed{false};
+  bool _completed{false};
+};
+
+}  // namespace video
+}  // namespace satori
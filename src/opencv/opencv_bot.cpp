@@ -14,20 +14,61 @@ cv::Mat get_image(const bot_context &context, const image_frame &frame) {
                  (void *)buffer, line_size);
 }
 
-bot_img_callback_t to_bot_img_callback(const opencv_bot_img_callback_t &callback) {
-  return [callback](bot_context &context, const image_frame &frame) {
-    return callback(context, get_image(context, frame));
+// device frames are wrapped, host frames are uploaded.
+void process_gpu_image(const opencv_bot_gpu_img_callback_t &callback,
+                       bot_context &context, const image_frame &frame) {
+  const image_metadata &metadata = *context.frame_metadata;
+  CHECK(metadata.width != 0);
+  const int chroma_width = (metadata.width + 1) / 2;
+  const int chroma_height = (metadata.height + 1) / 2;
+  if (frame.on_device) {
+    const cv::cuda::GpuMat luma(metadata.height, metadata.width, CV_8UC1,
+                                (void *)frame.plane_data[0], metadata.plane_strides[0]);
+    const cv::cuda::GpuMat chroma(chroma_height, chroma_width, CV_8UC2,
+                                  (void *)frame.plane_data[1], metadata.plane_strides[1]);
+    callback(context, luma, chroma);
+    return;
+  }
+
+  cv::cuda::GpuMat luma;
+  cv::cuda::GpuMat chroma;
+  luma.upload(cv::Mat(metadata.height, metadata.width, CV_8UC1,
+                      (void *)frame.plane_data[0], metadata.plane_strides[0]));
+  chroma.upload(cv::Mat(chroma_height, chroma_width, CV_8UC2,
+                        (void *)frame.plane_data[1], metadata.plane_strides[1]));
+  callback(context, luma, chroma);
+}
+
+bot_img_callback_t to_bot_img_callback(const opencv_bot_descriptor &bot) {
+  if (!bot.gpu_img_callback) {
+    const opencv_bot_img_callback_t callback = bot.img_callback;
+    return [callback](bot_context &context, const image_frame &frame) {
+      return callback(context, get_image(context, frame));
+    };
+  }
+
+  return [bot](bot_context &context, const image_frame &frame) {
+    if (frame.on_device || !bot.img_callback) {
+      process_gpu_image(bot.gpu_img_callback, context, frame);
+    } else {
+      bot.img_callback(context, get_image(context, frame));
+    }
   };
 }
 
 }  // namespace
 
 void opencv_bot_register(const opencv_bot_descriptor &bot) {
-  bot_register({image_pixel_format::BGR, to_bot_img_callback(bot.img_callback),
-                bot.ctrl_callback});
+  // frames uploaded to GPU are requested in the same format as device frames.
+  const image_pixel_format pixel_format = bot.gpu_img_callback && !bot.img_callback
+                                              ? image_pixel_format::NV12
+                                              : image_pixel_format::BGR;
+  bot_descriptor descriptor{pixel_format, to_bot_img_callback(bot), bot.ctrl_callback};
+  descriptor.device_frames = static_cast<bool>(bot.gpu_img_callback);
+  bot_register(descriptor);
 }
 
 int opencv_bot_main(int argc, char **argv) { return bot_main(argc, argv); }
 
 }  // namespace video
-}  // namespace satori
\ No newline at end of file
+}  // namespace satori
@@ -1,5 +1,6 @@
 #include "ostream_sink.h"
 
+#include "cbor_json.h"
 #include "logging.h"
 
 namespace satori {
@@ -12,7 +13,10 @@ class ostream_observer : public streams::observer<nlohmann::json> {
   explicit ostream_observer(std::ostream &out) : _out(out) {}
 
  private:
-  void on_next(nlohmann::json &&t) override { _out << t << "\n"; }
+  void on_next(nlohmann::json &&t) override {
+    decode_encoded_maps(t);
+    _out << t << "\n";
+  }
 
   void on_error(std::error_condition ec) override {
     LOG(ERROR) << "ERROR: " << ec.message();
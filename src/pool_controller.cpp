@@ -1,12 +1,16 @@
 #include "pool_controller.h"
+#include <algorithm>
 #include <gsl/gsl>
 #include <json.hpp>
 #include <random>
+#include <thread>
 
 namespace satori {
 namespace video {
 namespace {
 const auto default_hb_period = boost::posix_time::seconds(1);
+// new owner of a draining job is expected to decode a frame by then.
+constexpr std::chrono::seconds drain_timeout{30};
 std::string make_node_id() {
   static std::default_random_engine init_node_id_rng_device(
       (unsigned)std::chrono::system_clock::now().time_since_epoch().count());
@@ -25,6 +29,7 @@ pool_job_controller::pool_job_controller(boost::asio::io_service &io,
                                          job_controller &streams)
     : _io(io),
       _max_streams_capacity(max_streams_capacity),
+      _load(max_streams_capacity, std::thread::hardware_concurrency()),
       _pool(pool),
       _job_type(job_type),
       _client(rtm_client),
@@ -50,16 +55,45 @@ void pool_job_controller::on_heartbeat(const boost::system::error_code &ec) {
   _hb_timer->expires_from_now(default_hb_period);
   _hb_timer->async_wait([this](const boost::system::error_code &e) { on_heartbeat(e); });
 
+  const auto now = std::chrono::steady_clock::now();
+  for (auto it = _draining.begin(); it != _draining.end();) {
+    if (now < it->deadline) {
+      ++it;
+      continue;
+    }
+    LOG(WARNING) << "new owner didn't take draining job in time, stopping it: "
+                 << it->job;
+    const nlohmann::json job = it->job;
+    it = _draining.erase(it);
+    _streams.remove_job(job);
+  }
+
   const auto jobs = _streams.list_jobs();
   CHECK(jobs.is_array()) << "not an array: " << jobs;
 
+  nlohmann::json active_jobs = nlohmann::json::array();
+  nlohmann::json draining_jobs = nlohmann::json::array();
+  for (const auto &job : jobs) {
+    const bool draining =
+        std::any_of(_draining.begin(), _draining.end(),
+                    [&job](const draining_job &d) { return d.job == job; });
+    (draining ? draining_jobs : active_jobs).push_back(job);
+  }
+
+  load_sample sample = _streams.sample_load();
+  const boost::timer::cpu_times times = _cpu_timer.elapsed();
+  sample.cpu_seconds = static_cast<double>(times.user + times.system) / 1e9;
+  const double capacity = _load.update(sample, now, jobs.size());
+
   nlohmann::json available_capacity = nlohmann::json::object();
-  available_capacity[_job_type] = _max_streams_capacity - jobs.size();
+  available_capacity[_job_type] = capacity;
 
   nlohmann::json hb_message = nlohmann::json::object();
   hb_message["from"] = node_id;
-  hb_message["active_jobs"] = jobs;
+  hb_message["active_jobs"] = active_jobs;
+  hb_message["draining_jobs"] = draining_jobs;
   hb_message["available_capacity"] = available_capacity;
+  hb_message["utilization"] = _load.utilization();
 
   LOG(2) << "sending heartbeat: " << hb_message;
   _client->publish(_pool, std::move(hb_message));
@@ -97,6 +131,8 @@ void pool_job_controller::on_data(const rtm::subscription & /*subscription*/,
     start_job(msg["start_job"]);
   } else if (msg.find("stop_job") != msg.end()) {
     stop_job(msg["stop_job"]);
+  } else if (msg.find("drain_job") != msg.end()) {
+    drain_job(msg["drain_job"]);
   } else {
     LOG(ERROR) << "unknown command: " << msg;
   }
@@ -109,9 +145,26 @@ void pool_job_controller::start_job(const nlohmann::json &job) {
 
 void pool_job_controller::stop_job(const nlohmann::json &job) {
   LOG(INFO) << "stop_job: " << job;
+  _draining.remove_if([&job](const draining_job &d) { return d.job == job; });
   _streams.remove_job(job);
 }
 
+void pool_job_controller::drain_job(const nlohmann::json &job) {
+  LOG(INFO) << "drain_job: " << job;
+  _draining.remove_if([&job](const draining_job &d) { return d.job == job; });
+  _draining.push_back(
+      draining_job{job, std::chrono::steady_clock::now() + drain_timeout});
+}
+
+void pool_job_controller::job_ready(const nlohmann::json &job) {
+  nlohmann::json ready_note = nlohmann::json::object();
+  ready_note["from"] = node_id;
+  ready_note["job_ready"] = job;
+
+  LOG(INFO) << "job is ready: " << job;
+  _client->publish(_pool, std::move(ready_note));
+}
+
 void pool_job_controller::on_error(std::error_condition ec) {
   LOG(ERROR) << "rtm error: " << ec.message();
 }
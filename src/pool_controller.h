@@ -1,8 +1,11 @@
 #pragma once
 
+#include <boost/timer/timer.hpp>
+#include <chrono>
 #include <json.hpp>
 #include <list>
 #include <string>
+#include "load_model.h"
 #include "rtm_client.h"
 
 namespace satori {
@@ -13,6 +16,8 @@ struct job_controller {
   virtual void add_job(const nlohmann::json &job) = 0;
   virtual void remove_job(const nlohmann::json &job) = 0;
   virtual nlohmann::json list_jobs() const = 0;
+  // cumulative load of running jobs, CPU time is sampled by pool_job_controller.
+  virtual load_sample sample_load() const { return load_sample{}; }
 };
 
 class pool_job_controller : rtm::subscription_callbacks {
@@ -23,23 +28,38 @@ class pool_job_controller : rtm::subscription_callbacks {
 
   void start();
   void shutdown();
+  // tells pool manager that the job has decoded its first frame, so the previous
+  // owner can stop it. Should be called from asio thread.
+  void job_ready(const nlohmann::json &job);
 
  private:
+  struct draining_job {
+    nlohmann::json job;
+    std::chrono::steady_clock::time_point deadline;
+  };
+
   void on_heartbeat(const boost::system::error_code &ec);
   void on_data(const rtm::subscription & /*subscription*/,
                rtm::channel_data &&data) override;
   void start_job(const nlohmann::json &job);
   void stop_job(const nlohmann::json &job);
+  // job keeps running until its new owner is ready and the manager sends stop_job.
+  void drain_job(const nlohmann::json &job);
   void on_error(std::error_condition ec) override;
 
   boost::asio::io_service &_io;
   const size_t _max_streams_capacity;
+  // available capacity is reported by measured load rather than by job count.
+  load_model _load;
+  boost::timer::cpu_timer _cpu_timer;
   const std::string _pool;
   const std::string _job_type;
   std::shared_ptr<rtm::client> _client;
   const rtm::subscription _pool_sub{};
   std::unique_ptr<boost::asio::deadline_timer> _hb_timer;
   job_controller &_streams;
+  // jobs handed off to other nodes, they are stopped at the deadline at the latest.
+  std::list<draining_job> _draining;
 };
 }  // namespace video
 }  // namespace satori
@@ -0,0 +1,227 @@
+#include <deque>
+#include <vector>
+
+#include "logging.h"
+#include "metrics.h"
+#include "video_streams.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+auto &preroll_buffered_bytes = prometheus::BuildGauge()
+                                   .Name("preroll_buffered_bytes")
+                                   .Register(metrics_registry())
+                                   .Add({});
+
+auto &preroll_clips_total = prometheus::BuildCounter()
+                                .Name("preroll_clips_total")
+                                .Register(metrics_registry())
+                                .Add({});
+
+// Packets of a clip wait here until its sink requests them.
+class clip : public streams::subscription {
+ public:
+  explicit clip(streams::subscriber<encoded_packet> &sink) : _sink(sink) {
+    _sink.on_subscribe(*this);
+  }
+
+  void push(encoded_packet &&packet) {
+    _pending.push_back(std::move(packet));
+    deliver();
+  }
+
+  // completes sink once pending packets are delivered, returns true if it is done.
+  bool close() {
+    _closing = true;
+    deliver();
+    return _done;
+  }
+
+  bool done() const { return _done; }
+
+ private:
+  void request(int n) override {
+    _requested += n;
+    deliver();
+  }
+
+  void cancel() override {
+    LOG(WARNING) << "clip sink cancelled";
+    _pending.clear();
+    _done = true;
+  }
+
+  // sink requests more from on_next, so delivery isn't reentered.
+  void deliver() {
+    if (_delivering || _done) {
+      return;
+    }
+    _delivering = true;
+    while (_requested > 0 && !_pending.empty() && !_done) {
+      encoded_packet packet = std::move(_pending.front());
+      _pending.pop_front();
+      _requested--;
+      _sink.on_next(std::move(packet));
+    }
+    if (_closing && _pending.empty() && !_done) {
+      _done = true;
+      _sink.on_complete();
+    }
+    _delivering = false;
+  }
+
+  streams::subscriber<encoded_packet> &_sink;
+  std::deque<encoded_packet> _pending;
+  int64_t _requested{0};
+  bool _delivering{false};
+  bool _closing{false};
+  bool _done{false};
+};
+
+struct gop {
+  std::vector<encoded_frame> frames;
+  size_t bytes{0};
+};
+
+class preroll_sink_impl : public streams::subscriber<encoded_packet>,
+                          boost::static_visitor<void> {
+ public:
+  preroll_sink_impl(const preroll_options &options,
+                    const std::shared_ptr<preroll_trigger> &trigger,
+                    std::function<streams::subscriber<encoded_packet> &(
+                        std::chrono::system_clock::time_point start)> &&clip_sink,
+                    int request_window_size)
+      : _options(options),
+        _trigger(trigger),
+        _clip_sink(std::move(clip_sink)),
+        _window(request_window_size) {}
+
+  ~preroll_sink_impl() override { preroll_buffered_bytes.Decrement(_bytes); }
+
+  void operator()(encoded_metadata &metadata) {
+    if (_clip) {
+      _clip->push(encoded_metadata{metadata});
+    }
+    _metadata = std::move(metadata);
+  }
+
+  void operator()(encoded_frame &frame) {
+    if (!_clip && _trigger->active() && _metadata && !_gops.empty()) {
+      start_clip();
+    }
+    if (_clip && !_clip_closing && !_trigger->active()) {
+      LOG(INFO) << "trigger ran out, closing clip";
+      _clip_closing = true;
+      _clip->close();
+    }
+    if (_clip && _clip_closing && _clip->done()) {
+      _clip.reset();
+      _clip_closing = false;
+    }
+
+    if (_clip && !_clip_closing) {
+      _clip->push(std::move(frame));
+      return;
+    }
+    buffer(std::move(frame));
+  }
+
+ private:
+  void buffer(encoded_frame &&frame) {
+    if (frame.key_frame) {
+      _gops.emplace_back();
+    }
+    if (_gops.empty()) {
+      // decoding can't start before the first key frame.
+      return;
+    }
+
+    const size_t size = frame.data.size();
+    const auto timestamp = frame.timestamp;
+    _gops.back().frames.push_back(std::move(frame));
+    _gops.back().bytes += size;
+    _bytes += size;
+    preroll_buffered_bytes.Increment(size);
+
+    // the newest GOP is kept unless it alone is above max bytes.
+    while (!_gops.empty()
+           && (_bytes > _options.max_bytes
+               || (_gops.size() > 1
+                   && timestamp - _gops[1].frames.front().timestamp
+                          >= _options.duration))) {
+      _bytes -= _gops.front().bytes;
+      preroll_buffered_bytes.Decrement(_gops.front().bytes);
+      _gops.pop_front();
+    }
+  }
+
+  void start_clip() {
+    const auto start = _gops.front().frames.front().timestamp;
+    LOG(INFO) << "starting clip with " << _gops.size() << " buffered GOPs, " << _bytes
+              << " bytes";
+    preroll_clips_total.Increment();
+    _clip = std::make_unique<clip>(_clip_sink(start));
+    _clip->push(encoded_metadata{*_metadata});
+    for (gop &g : _gops) {
+      for (encoded_frame &f : g.frames) {
+        _clip->push(std::move(f));
+      }
+    }
+    _gops.clear();
+    preroll_buffered_bytes.Decrement(_bytes);
+    _bytes = 0;
+  }
+
+  void on_next(encoded_packet &&packet) override {
+    boost::apply_visitor(*this, packet);
+    _window.on_consumed();
+  }
+
+  void on_error(std::error_condition ec) override {
+    LOG(ERROR) << "preroll sink got error: " << ec.message();
+    finish();
+  }
+
+  void on_complete() override {
+    LOG(INFO) << "preroll sink got complete";
+    finish();
+  }
+
+  void on_subscribe(streams::subscription &s) override { _window.start(s); }
+
+  void finish() {
+    if (_clip && !_clip->close()) {
+      LOG(WARNING) << "clip sink didn't take all packets";
+    }
+    delete this;
+  }
+
+  const preroll_options _options;
+  const std::shared_ptr<preroll_trigger> _trigger;
+  const std::function<streams::subscriber<encoded_packet> &(
+      std::chrono::system_clock::time_point start)>
+      _clip_sink;
+  streams::request_window _window;
+
+  boost::optional<encoded_metadata> _metadata;
+  std::deque<gop> _gops;
+  size_t _bytes{0};
+  std::unique_ptr<clip> _clip;
+  bool _clip_closing{false};
+};
+
+}  // namespace
+
+streams::subscriber<encoded_packet> &preroll_sink(
+    const preroll_options &options, const std::shared_ptr<preroll_trigger> &trigger,
+    std::function<streams::subscriber<encoded_packet> &(
+        std::chrono::system_clock::time_point start)> &&clip_sink,
+    int request_window_size) {
+  return *(new preroll_sink_impl(options, trigger, std::move(clip_sink),
+                                 request_window_size));
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,136 @@
+#include "profiler.h"
+
+#include <boost/filesystem.hpp>
+
+#ifdef HAS_GPERFTOOLS
+#include <gperftools/heap-profiler.h>
+#include <gperftools/profiler.h>
+#endif
+
+#include "logging.h"
+#include "metrics.h"
+#include "threadutils.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+// longer profiles should be taken in several runs.
+constexpr std::chrono::seconds max_duration{600};
+
+auto &profiler_running = prometheus::BuildGauge()
+                             .Name("profiler_running")
+                             .Register(metrics_registry());
+
+nlohmann::json error(const std::string &message) {
+  return nlohmann::json{{"error", message}};
+}
+
+}  // namespace
+
+profiler::profiler(const std::string &dir, const std::string &prefix)
+    : _dir(dir), _prefix(prefix) {}
+
+profiler::~profiler() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _stopped.notify_all();
+  if (_thread.joinable()) {
+    _thread.join();
+  }
+}
+
+bool profiler::running() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _running;
+}
+
+nlohmann::json profiler::start(const nlohmann::json &request) {
+#ifndef HAS_GPERFTOOLS
+  LOG(ERROR) << "can't profile, built without gperftools: " << request;
+  return error("built without gperftools");
+#else
+  if (!request.is_object() || request.find("type") == request.end()
+      || !request["type"].is_string()) {
+    return error("type is missing");
+  }
+  const std::string type = request["type"];
+  if (type != "cpu" && type != "heap") {
+    return error("unknown profile type " + type);
+  }
+  auto seconds_it = request.find("seconds");
+  const std::chrono::seconds duration{
+      seconds_it != request.end() && seconds_it->is_number_integer()
+          ? seconds_it->get<int64_t>()
+          : 30};
+  if (duration.count() <= 0 || duration > max_duration) {
+    return error("seconds should be between 1 and "
+                 + std::to_string(max_duration.count()));
+  }
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_running) {
+    return error("profile is already running");
+  }
+  if (_thread.joinable()) {
+    _thread.join();
+  }
+
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(_dir, ec);
+  const auto start_time = std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::system_clock::now().time_since_epoch());
+  const std::string file = (boost::filesystem::path{_dir}
+                            / (_prefix + "." + type + "."
+                               + std::to_string(start_time.count()) + ".prof"))
+                               .string();
+
+  if (type == "cpu") {
+    if (ProfilerStart(file.c_str()) == 0) {
+      return error("can't start cpu profiler, writing to " + file);
+    }
+  } else {
+    if (IsHeapProfilerRunning() != 0) {
+      return error("heap profiler is already running");
+    }
+    HeapProfilerStart(file.c_str());
+  }
+
+  LOG(INFO) << "started " << type << " profile for " << duration.count()
+            << " seconds, writing to " << file;
+  _running = true;
+  profiler_running.Add({{"type", type}}).Set(1);
+  _thread = std::thread([this, type, file, duration]() { run(type, file, duration); });
+
+  return nlohmann::json{{"file", file}, {"seconds", duration.count()}};
+#endif
+}
+
+void profiler::run(const std::string &type, const std::string &file,
+                   std::chrono::seconds duration) {
+  threadutils::set_current_thread_name("profiler");
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _stopped.wait_for(lock, duration, [this]() { return _stopping; });
+  }
+
+#ifdef HAS_GPERFTOOLS
+  if (type == "cpu") {
+    ProfilerStop();
+  } else {
+    HeapProfilerDump("end of profile");
+    HeapProfilerStop();
+  }
+#endif
+  LOG(INFO) << type << " profile is written to " << file;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  _running = false;
+  profiler_running.Add({{"type", type}}).Set(0);
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <json.hpp>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace satori {
+namespace video {
+
+// Runs gperftools CPU or heap profiler of a live process for a while, so hot spots
+// can be found under production load without a restart. One profile runs at a time.
+// Without gperftools every request fails.
+class profiler {
+ public:
+  // profiles are written to dir, to files named after prefix and start time.
+  profiler(const std::string &dir, const std::string &prefix);
+  // stops running profile.
+  ~profiler();
+
+  // request is {"type": "cpu"|"heap", "seconds": <number>}. Response has "file" where
+  // profile is going to be, or "error". Heap profiles are dumped to files starting
+  // with "file".
+  nlohmann::json start(const nlohmann::json &request);
+
+  bool running() const;
+
+ private:
+  void run(const std::string &type, const std::string &file,
+           std::chrono::seconds duration);
+
+  const std::string _dir;
+  const std::string _prefix;
+  mutable std::mutex _mutex;
+  std::condition_variable _stopped;
+  bool _running{false};
+  bool _stopping{false};
+  std::thread _thread;
+};
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,296 @@
+#include "replay_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <gsl/gsl>
+
+#include "cbor_json.h"
+#include "logging.h"
+#include "streams/streams.h"
+#include "video_streams.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+constexpr char file_magic[8] = {'S', 'V', 'R', 'E', 'P', 'L', 'A', 'Y'};
+constexpr char index_magic[8] = {'S', 'V', 'R', 'I', 'N', 'D', 'E', 'X'};
+constexpr uint32_t format_version = 1;
+
+struct file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+constexpr uint8_t metadata_record = 0;
+constexpr uint8_t frame_record = 1;
+constexpr uint8_t key_frame_flag = 1;
+
+struct record_header {
+  // of CBOR message following the header.
+  uint32_t size;
+  uint8_t type;
+  uint8_t flags;
+  uint16_t reserved;
+  double timestamp;
+};
+
+struct index_record {
+  uint64_t offset;
+  double timestamp;
+  uint8_t type;
+  uint8_t flags;
+  uint8_t reserved[6];
+};
+
+struct index_trailer {
+  uint64_t index_offset;
+  uint64_t entries;
+  char magic[8];
+};
+
+static_assert(sizeof(file_header) == 16, "unexpected file header padding");
+static_assert(sizeof(record_header) == 16, "unexpected record header padding");
+static_assert(sizeof(index_record) == 24, "unexpected index record padding");
+static_assert(sizeof(index_trailer) == 24, "unexpected index trailer padding");
+
+template <typename T>
+T read_struct(const char *data) {
+  T result;
+  std::memcpy(&result, data, sizeof(T));
+  return result;
+}
+
+template <typename T>
+void append_struct(std::string &out, const T &value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+double to_seconds(std::chrono::system_clock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::duration<double>>(t.time_since_epoch())
+      .count();
+}
+
+replay_index_entry to_entry(uint64_t offset, double timestamp, uint8_t type,
+                            uint8_t flags) {
+  return replay_index_entry{offset, timestamp, type == metadata_record,
+                            (flags & key_frame_flag) != 0};
+}
+
+}  // namespace
+
+bool is_binary_replay_file(const std::string &filename) {
+  std::ifstream in{filename, std::ios::binary};
+  char magic[sizeof(file_magic)];
+  return in.read(magic, sizeof(magic))
+         && std::memcmp(magic, file_magic, sizeof(magic)) == 0;
+}
+
+std::unique_ptr<replay_file_reader> replay_file_reader::open(
+    const std::string &filename) {
+  const int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "failed to open " << filename << ": " << std::strerror(errno);
+    return nullptr;
+  }
+  // mapping stays valid after descriptor is closed.
+  auto close_fd = gsl::finally([fd]() { ::close(fd); });
+
+  struct stat st {};
+  if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(file_header)) {
+    LOG(ERROR) << filename << " is not a binary replay file";
+    return nullptr;
+  }
+  const auto size = static_cast<size_t>(st.st_size);
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    LOG(ERROR) << "failed to map " << filename << ": " << std::strerror(errno);
+    return nullptr;
+  }
+  // records are read one after another.
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  std::unique_ptr<replay_file_reader> reader{
+      new replay_file_reader(static_cast<const char *>(data), size)};
+  const auto header = read_struct<file_header>(reader->_data);
+  if (std::memcmp(header.magic, file_magic, sizeof(file_magic)) != 0
+      || header.version != format_version) {
+    LOG(ERROR) << filename << " is not a binary replay file of version "
+               << format_version;
+    return nullptr;
+  }
+
+  if (!reader->load_index()) {
+    LOG(WARNING) << filename << " has no index, reading records";
+    reader->scan_records();
+  }
+  LOG(INFO) << filename << " has " << reader->_index.size() << " records";
+  return reader;
+}
+
+replay_file_reader::replay_file_reader(const char *data, size_t size)
+    : _data(data), _size(size) {}
+
+replay_file_reader::~replay_file_reader() {
+  munmap(const_cast<char *>(_data), _size);
+}
+
+bool replay_file_reader::load_index() {
+  if (_size < sizeof(file_header) + sizeof(index_trailer)) {
+    return false;
+  }
+  const auto trailer = read_struct<index_trailer>(_data + _size - sizeof(index_trailer));
+  if (std::memcmp(trailer.magic, index_magic, sizeof(index_magic)) != 0
+      || trailer.index_offset < sizeof(file_header)
+      || trailer.index_offset + trailer.entries * sizeof(index_record)
+             != _size - sizeof(index_trailer)) {
+    return false;
+  }
+
+  _index.reserve(trailer.entries);
+  for (uint64_t i = 0; i < trailer.entries; i++) {
+    const auto r = read_struct<index_record>(_data + trailer.index_offset
+                                             + i * sizeof(index_record));
+    if (r.offset + sizeof(record_header) > trailer.index_offset) {
+      _index.clear();
+      return false;
+    }
+    _index.push_back(to_entry(r.offset, r.timestamp, r.type, r.flags));
+  }
+  return true;
+}
+
+void replay_file_reader::scan_records() {
+  uint64_t offset = sizeof(file_header);
+  // incomplete record at the end of interrupted recording is dropped.
+  while (offset + sizeof(record_header) <= _size) {
+    const auto header = read_struct<record_header>(_data + offset);
+    if (header.type > frame_record
+        || offset + sizeof(record_header) + header.size > _size) {
+      break;
+    }
+    _index.push_back(to_entry(offset, header.timestamp, header.type, header.flags));
+    offset += sizeof(record_header) + header.size;
+  }
+}
+
+network_packet replay_file_reader::read(const replay_index_entry &entry) const {
+  const auto header = read_struct<record_header>(_data + entry.offset);
+  const std::string message{_data + entry.offset + sizeof(record_header), header.size};
+  if (header.type == metadata_record) {
+    return parse_cbor_network_metadata(message);
+  }
+  return parse_cbor_network_frame(message);
+}
+
+replay_file_writer::replay_file_writer(const std::string &filename)
+    : _out(filename, std::ios::binary | std::ios::trunc) {
+  CHECK(_out.good()) << "failed to create " << filename;
+  file_header header{};
+  std::memcpy(header.magic, file_magic, sizeof(file_magic));
+  header.version = format_version;
+  _out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  _offset = sizeof(header);
+}
+
+replay_file_writer::~replay_file_writer() {
+  _buffer.clear();
+  for (const replay_index_entry &e : _index) {
+    index_record r{};
+    r.offset = e.offset;
+    r.timestamp = e.timestamp;
+    r.type = e.metadata ? metadata_record : frame_record;
+    r.flags = e.key_frame ? key_frame_flag : 0;
+    append_struct(_buffer, r);
+  }
+  index_trailer trailer{};
+  trailer.index_offset = _offset;
+  trailer.entries = _index.size();
+  std::memcpy(trailer.magic, index_magic, sizeof(index_magic));
+  append_struct(_buffer, trailer);
+  _out.write(_buffer.data(), _buffer.size());
+}
+
+void replay_file_writer::write(const network_metadata &metadata,
+                               std::chrono::system_clock::time_point t) {
+  write_record(true, false, t, metadata.to_json());
+}
+
+void replay_file_writer::write(const network_frame &frame,
+                               std::chrono::system_clock::time_point t) {
+  write_record(false, frame.key_frame && frame.chunk == 1, t, frame.to_json());
+}
+
+void replay_file_writer::write_record(bool metadata, bool key_frame,
+                                      std::chrono::system_clock::time_point t,
+                                      const nlohmann::json &packet) {
+  _buffer.clear();
+  record_header header{};
+  append_struct(_buffer, header);
+  json_to_cbor(packet, _buffer);
+
+  header.size = static_cast<uint32_t>(_buffer.size() - sizeof(header));
+  header.type = metadata ? metadata_record : frame_record;
+  header.flags = key_frame ? key_frame_flag : 0;
+  header.timestamp = to_seconds(t);
+  std::memcpy(&_buffer[0], &header, sizeof(header));
+  _out.write(_buffer.data(), _buffer.size());
+
+  _index.push_back(replay_index_entry{_offset, header.timestamp, metadata, key_frame});
+  _offset += _buffer.size();
+}
+
+namespace {
+
+class replay_file_sink_impl : public streams::subscriber<encoded_packet>,
+                              boost::static_visitor<void> {
+ public:
+  replay_file_sink_impl(const boost::filesystem::path &path, int request_window_size)
+      : _writer{path.string()}, _window{request_window_size} {}
+
+  void operator()(const encoded_metadata &metadata) {
+    _writer.write(metadata.to_network(payload_encoding::BINARY),
+                  std::chrono::system_clock::now());
+  }
+
+  void operator()(const encoded_frame &f) {
+    const auto now = std::chrono::system_clock::now();
+    for (const network_frame &chunk : f.to_network(payload_encoding::BINARY)) {
+      _writer.write(chunk, now);
+    }
+  }
+
+ private:
+  void on_next(encoded_packet &&packet) override {
+    boost::apply_visitor(*this, packet);
+    _window.on_consumed();
+  }
+
+  void on_error(std::error_condition ec) override { ABORT() << ec.message(); }
+
+  void on_complete() override {
+    LOG(INFO) << "got complete";
+    delete this;
+  }
+
+  void on_subscribe(streams::subscription &s) override { _window.start(s); }
+
+  replay_file_writer _writer;
+  streams::request_window _window;
+};
+
+}  // namespace
+
+streams::subscriber<encoded_packet> &replay_file_sink(const boost::filesystem::path &path,
+                                                      int request_window_size) {
+  return *(new replay_file_sink_impl(path, request_window_size));
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,86 @@
+// Binary replay files.
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "data.h"
+
+namespace satori {
+namespace video {
+
+// Binary replay file is a header, records of network packets and an index of
+// records. Record is a fixed size header with packet type, key frame flag and time,
+// followed by the packet as CBOR message, the same one binary RTM streams carry.
+// Index is appended when file is closed, files without it are indexed by reading
+// records. Numbers are in host byte order.
+struct replay_index_entry {
+  // position of the record in file.
+  uint64_t offset;
+  // seconds since epoch when record was written.
+  double timestamp;
+  bool metadata;
+  // first chunk of a key frame.
+  bool key_frame;
+};
+
+// true if file starts with binary replay file header.
+bool is_binary_replay_file(const std::string &filename);
+
+// Reads records of a memory-mapped file, packets are parsed without building json.
+class replay_file_reader {
+ public:
+  // returns nothing if file isn't a binary replay file.
+  static std::unique_ptr<replay_file_reader> open(const std::string &filename);
+
+  ~replay_file_reader();
+
+  replay_file_reader(const replay_file_reader &) = delete;
+  replay_file_reader &operator=(const replay_file_reader &) = delete;
+
+  const std::vector<replay_index_entry> &index() const { return _index; }
+
+  network_packet read(const replay_index_entry &entry) const;
+
+ private:
+  replay_file_reader(const char *data, size_t size);
+
+  bool load_index();
+  void scan_records();
+
+  const char *_data;
+  const size_t _size;
+  std::vector<replay_index_entry> _index;
+};
+
+class replay_file_writer {
+ public:
+  explicit replay_file_writer(const std::string &filename);
+
+  // appends index.
+  ~replay_file_writer();
+
+  replay_file_writer(const replay_file_writer &) = delete;
+  replay_file_writer &operator=(const replay_file_writer &) = delete;
+
+  void write(const network_metadata &metadata, std::chrono::system_clock::time_point t);
+  void write(const network_frame &frame, std::chrono::system_clock::time_point t);
+
+ private:
+  void write_record(bool metadata, bool key_frame,
+                    std::chrono::system_clock::time_point t,
+                    const nlohmann::json &packet);
+
+  std::ofstream _out;
+  uint64_t _offset{0};
+  std::vector<replay_index_entry> _index;
+  // reused between records.
+  std::string _buffer;
+};
+
+}  // namespace video
+}  // namespace satori
@@ -7,6 +7,7 @@
 #include <thread>
 
 #include "logging.h"
+#include "replay_file.h"
 #include "streams/asio_streams.h"
 
 namespace satori {
@@ -81,29 +82,98 @@ static double get_timestamp(const nlohmann::json &item) {
   return t;
 }
 
+// delays items by differences of their timestamps, divided by speed.
+template <typename T, typename Timestamp>
+static streams::publisher<T> paced(streams::publisher<T> &&items,
+                                   boost::asio::io_service &io, double speed,
+                                   Timestamp timestamp) {
+  auto last_time = new double{-1.0};
+  return std::move(items)
+         >> streams::asio::delay(
+                io,
+                [last_time, speed, timestamp](const T &item) {
+                  if (*last_time < 0) {
+                    return std::chrono::milliseconds(0);
+                  }
+
+                  auto delay_ms = (int)((timestamp(item) - *last_time) * 1000 / speed);
+                  return std::chrono::milliseconds(delay_ms);
+                })
+         >> streams::map([last_time, timestamp](T &&item) {
+             *last_time = timestamp(item);
+             return std::move(item);
+           })
+         >> streams::do_finally([last_time]() { delete last_time; });
+}
+
+namespace {
+
+struct replay_record {
+  double timestamp;
+  network_packet packet;
+};
+
+class read_binary_replay_impl {
+ public:
+  explicit read_binary_replay_impl(const std::string &filename)
+      : _filename(filename), _reader(replay_file_reader::open(filename)) {}
+
+  void generate_one(streams::observer<replay_record> &observer) {
+    if (!_reader) {
+      LOG(ERROR) << "can't read replay file: " << _filename;
+      observer.on_error(std::make_error_condition(std::errc::no_such_file_or_directory));
+      return;
+    }
+
+    const auto &index = _reader->index();
+    if (_position == index.size()) {
+      LOG(4) << "end of file";
+      observer.on_complete();
+      return;
+    }
+    const replay_index_entry &entry = index[_position++];
+    observer.on_next(replay_record{entry.timestamp, _reader->read(entry)});
+  }
+
+ private:
+  const std::string _filename;
+  const std::unique_ptr<replay_file_reader> _reader;
+  size_t _position{0};
+};
+
+// binary files keep metadata among frames, so there is no metadata file.
+streams::publisher<network_packet> binary_replay_source(boost::asio::io_service &io,
+                                                        const std::string &filename,
+                                                        bool batch, double speed) {
+  streams::publisher<replay_record> records =
+      streams::generators<replay_record>::stateful(
+          [filename]() { return new read_binary_replay_impl(filename); },
+          [](read_binary_replay_impl *impl, streams::observer<replay_record> &sink) {
+            return impl->generate_one(sink);
+          });
+  if (!batch && speed > 0) {
+    records = paced(std::move(records), io, speed,
+                    [](const replay_record &r) { return r.timestamp; });
+  }
+  return std::move(records)
+         >> streams::map([](replay_record &&r) { return std::move(r.packet); });
+}
+
+}  // namespace
+
 streams::publisher<network_packet> network_replay_source(boost::asio::io_service &io,
                                                          const std::string &filename,
-                                                         bool batch) {
+                                                         bool batch, double speed) {
+  CHECK_GE(speed, 0) << "bad replay speed";
+  if (is_binary_replay_file(filename)) {
+    LOG(INFO) << "reading binary replay file " << filename;
+    return binary_replay_source(io, filename, batch, speed);
+  }
+
   auto metadata = read_metadata(filename + ".metadata");
   streams::publisher<nlohmann::json> items = read_json(filename);
-  if (!batch) {
-    auto last_time = new double{-1.0};
-    items = std::move(items)
-            >> streams::asio::delay(
-                   io,
-                   [last_time](const nlohmann::json &item) {
-                     if (*last_time < 0) {
-                       return std::chrono::milliseconds(0);
-                     }
-
-                     auto delay_ms = (int)((get_timestamp(item) - *last_time) * 1000);
-                     return std::chrono::milliseconds(delay_ms);
-                   })
-            >> streams::map([last_time](nlohmann::json &&item) {
-                *last_time = get_timestamp(item);
-                return std::move(item);
-              })
-            >> streams::do_finally([last_time]() { delete last_time; });
+  if (!batch && speed > 0) {
+    items = paced(std::move(items), io, speed, &get_timestamp);
   }
   auto frames = std::move(items) >> streams::flat_map(&get_messages)
                 >> streams::map([](nlohmann::json &&t) {
@@ -10,13 +10,22 @@
 #include <boost/variant.hpp>
 #include <gsl/gsl>
 #include <json.hpp>
+#include <array>
+#include <atomic>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <queue>
+#include <thread>
 #include <unordered_map>
 
 #include "cbor_json.h"
+#include "cbor_reader.h"
+#include "cbor_writer.h"
+#include "coalescing_write_stream.h"
 #include "logging.h"
 #include "metrics.h"
+#include "rtm_pdu.h"
 #include "threadutils.h"
 
 namespace asio = boost::asio;
@@ -63,6 +72,14 @@ std::error_condition make_error_condition(client_error e) {
   return {static_cast<int>(e), category};
 }
 
+struct connection_cache {
+  std::mutex mutex;
+  std::vector<asio::ip::tcp::endpoint> endpoints;
+  std::chrono::steady_clock::time_point resolve_time;
+  std::unique_ptr<SSL_SESSION, void (*)(SSL_SESSION *)> tls_session{nullptr,
+                                                                     SSL_SESSION_free};
+};
+
 namespace {
 
 constexpr int read_buffer_size = 100000;
@@ -70,6 +87,9 @@ constexpr bool use_cbor = true;
 
 const boost::posix_time::seconds ws_ping_interval{1};
 
+// cached addresses are used for that long, DNS may point elsewhere after a failover.
+constexpr std::chrono::minutes endpoints_cache_ttl{5};
+
 const std::vector<double> latency_buckets{
     0,    1,    2,    3,    4,    5,     6,     7,     8,     9,    10,   15,
     20,   25,   30,   40,   50,   60,    70,    80,    90,    100,  150,  200,
@@ -84,10 +104,38 @@ auto &rtm_client_start = prometheus::BuildCounter()
 auto &rtm_client_error =
     prometheus::BuildCounter().Name("rtm_client_error").Register(metrics_registry());
 
+auto &rtm_tls_handshakes_total = prometheus::BuildCounter()
+                                     .Name("rtm_tls_handshakes_total")
+                                     .Register(metrics_registry());
+
 auto &rtm_actions_received = prometheus::BuildCounter()
                                  .Name("rtm_actions_received_total")
                                  .Register(metrics_registry());
 
+// most received pdus carry subscription data, its handle is looked up only once.
+sharded_counter rtm_subscription_data_received{
+    rtm_actions_received.Add({{"action", "rtm/subscription/data"}})};
+
+std::pair<const char *, prometheus::Counter *> action_counter(const char *action) {
+  return {action, &rtm_actions_received.Add({{"action", action}})};
+}
+
+// handles of other known actions are looked up once too.
+const std::array<std::pair<const char *, prometheus::Counter *>, 7> rtm_known_actions{
+    {action_counter("rtm/publish/ok"), action_counter("rtm/subscribe/ok"),
+     action_counter("rtm/unsubscribe/ok"), action_counter("rtm/publish/error"),
+     action_counter("rtm/subscribe/error"), action_counter("rtm/unsubscribe/error"),
+     action_counter("rtm/subscription/error")}};
+
+prometheus::Counter &rtm_action_received(boost::string_ref action) {
+  for (const auto &known : rtm_known_actions) {
+    if (action == known.first) {
+      return *known.second;
+    }
+  }
+  return rtm_actions_received.Add({{"action", action.to_string()}});
+}
+
 auto &rtm_messages_received = prometheus::BuildCounter()
                                   .Name("rtm_messages_received_total")
                                   .Register(metrics_registry());
@@ -111,15 +159,15 @@ auto &rtm_messages_in_pdu =
         .Add({}, std::vector<double>{1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 20, 30, 40, 50, 60,
                                      70, 80, 90, 100});
 
-auto &rtm_bytes_written = prometheus::BuildCounter()
-                              .Name("rtm_bytes_written_total")
-                              .Register(metrics_registry())
-                              .Add({});
+sharded_counter rtm_bytes_written{prometheus::BuildCounter()
+                                      .Name("rtm_bytes_written_total")
+                                      .Register(metrics_registry())
+                                      .Add({})};
 
-auto &rtm_bytes_read = prometheus::BuildCounter()
-                           .Name("rtm_bytes_read_total")
-                           .Register(metrics_registry())
-                           .Add({});
+sharded_counter rtm_bytes_read{prometheus::BuildCounter()
+                                   .Name("rtm_bytes_read_total")
+                                   .Register(metrics_registry())
+                                   .Add({})};
 
 auto &rtm_pings_sent_total = prometheus::BuildCounter()
                                  .Name("rtm_pings_sent_total")
@@ -130,6 +178,10 @@ auto &rtm_frames_received_total = prometheus::BuildCounter()
                                       .Name("rtm_frames_received_total")
                                       .Register(metrics_registry());
 
+auto &rtm_close_frames_received = rtm_frames_received_total.Add({{"type", "close"}});
+
+auto &rtm_ping_frames_received = rtm_frames_received_total.Add({{"type", "ping"}});
+
 auto &rtm_last_pong_time_seconds = prometheus::BuildGauge()
                                        .Name("rtm_last_pong_time_seconds")
                                        .Register(metrics_registry())
@@ -192,6 +244,7 @@ auto &rtm_unsubscribe_error_total = prometheus::BuildCounter()
 struct subscribe_request {
   const uint64_t id;
   const std::string channel;
+  const uint32_t subscription_id;
   boost::optional<uint64_t> age;
   boost::optional<uint64_t> count;
 
@@ -203,7 +256,7 @@ struct subscribe_request {
     document["id"] = id;
     auto &body = document["body"];
     body["channel"] = channel;
-    body["subscription_id"] = channel;
+    body["subscription_id"] = std::to_string(subscription_id);
 
     if (age || count) {
       nlohmann::json history;
@@ -224,7 +277,7 @@ struct subscribe_request {
 // TODO: convert to function
 struct unsubscribe_request {
   const uint64_t id;
-  const std::string channel;
+  const uint32_t subscription_id;
 
   nlohmann::json to_json() const {
     nlohmann::json document =
@@ -233,7 +286,7 @@ struct unsubscribe_request {
     CHECK(document.is_object());
     document["id"] = id;
     auto &body = document["body"];
-    body["subscription_id"] = channel;
+    body["subscription_id"] = std::to_string(subscription_id);
 
     return document;
   }
@@ -279,38 +332,67 @@ struct get_done_cb_visitor : public boost::static_visitor<const request_done_cb
   }
 };
 
+// shards of sharded_client take ids from several threads.
 uint64_t new_request_id() {
-  static uint64_t request_id{1};
-  return request_id++;
+  static std::atomic<uint64_t> request_id{1};
+  return request_id.fetch_add(1, std::memory_order_relaxed);
 }
 
+// per-channel handles of labeled metrics, family lookups are locked and allocate.
+struct channel_counters {
+  explicit channel_counters(const std::string &channel)
+      : received(rtm_messages_received.Add({{"channel", channel}})),
+        received_bytes(rtm_messages_bytes_received.Add({{"channel", channel}})),
+        sent(rtm_messages_sent.Add({{"channel", channel}})),
+        sent_bytes(rtm_messages_bytes_sent.Add({{"channel", channel}})) {}
+
+  prometheus::Counter &received;
+  prometheus::Counter &received_bytes;
+  prometheus::Counter &sent;
+  prometheus::Counter &sent_bytes;
+};
+
 struct subscription_details {
+  const uint32_t id;
   const std::string channel;
   const subscription &sub;
   subscription_callbacks &callbacks;
+  const bool raw_cbor;
+  channel_counters counters;
 };
 
+// Subscriptions are kept in slots of a vector, slot index is used as RTM
+// subscription_id, so subscription data is routed without hashing channel names.
+// Slots are reused after subscription is deleted, when RTM sends no more data for it.
 class subscriptions_map {
  public:
-  void add(const std::string &channel, const subscription &sub,
-           subscription_callbacks &callbacks) {
+  // returns id of the new subscription.
+  uint32_t add(const std::string &channel, const subscription &sub,
+               subscription_callbacks &callbacks, bool raw_cbor) {
     CHECK_EQ(_channels_map.count(channel), 0) << "already exists for channel " << channel;
     CHECK_EQ(_subs_map.count(&sub), 0) << "already exists for sub " << channel;
 
-    auto it = _sub_infos.emplace(_sub_infos.end(),
-                                 subscription_details{channel, sub, callbacks});
+    uint32_t id;
+    if (!_free_ids.empty()) {
+      id = _free_ids.back();
+      _free_ids.pop_back();
+    } else {
+      id = static_cast<uint32_t>(_sub_infos.size());
+      _sub_infos.emplace_back();
+    }
+    _sub_infos[id].reset(new subscription_details{id, channel, sub, callbacks, raw_cbor,
+                                                  channel_counters{channel}});
 
-    _channels_map.emplace(channel, it);
-    _subs_map.emplace(&sub, it);
+    _channels_map.emplace(channel, id);
+    _subs_map.emplace(&sub, id);
+    return id;
   }
 
-  boost::optional<subscription_details &> find_by_channel(
-      const std::string &channel) const {
-    auto it = _channels_map.find(channel);
-    if (it == _channels_map.end()) {
+  boost::optional<subscription_details &> find_by_id(uint32_t id) const {
+    if (id >= _sub_infos.size() || !_sub_infos[id]) {
       return boost::none;
     }
-    return *(it->second);
+    return *_sub_infos[id];
   }
 
   boost::optional<subscription_details &> find_by_sub(const subscription &sub) const {
@@ -318,7 +400,7 @@ class subscriptions_map {
     if (it == _subs_map.end()) {
       return boost::none;
     }
-    return *(it->second);
+    return *_sub_infos[it->second];
   }
 
   bool delete_by_channel(const std::string &channel) {
@@ -327,10 +409,11 @@ class subscriptions_map {
       return false;
     }
 
-    auto sub_info_it = it->second;
-    _subs_map.erase(&sub_info_it->sub);
-    _channels_map.erase(sub_info_it->channel);
-    _sub_infos.erase(sub_info_it);
+    const uint32_t id = it->second;
+    _subs_map.erase(&_sub_infos[id]->sub);
+    _channels_map.erase(it);
+    _sub_infos[id].reset();
+    _free_ids.push_back(id);
     return true;
   }
 
@@ -338,15 +421,15 @@ class subscriptions_map {
     _channels_map.clear();
     _subs_map.clear();
     _sub_infos.clear();
+    _free_ids.clear();
   }
 
  private:
-  std::list<subscription_details> _sub_infos;
-  std::unordered_map<std::string, std::list<subscription_details>::iterator>
-      _channels_map;
+  std::vector<std::unique_ptr<subscription_details>> _sub_infos;
+  std::vector<uint32_t> _free_ids;
+  std::unordered_map<std::string, uint32_t> _channels_map;
   // TODO: using object addresses may not be reliable
-  std::unordered_map<const subscription *, std::list<subscription_details>::iterator>
-      _subs_map;
+  std::unordered_map<const subscription *, uint32_t> _subs_map;
 };
 
 enum class request_type { PUBLISH = 0, SUBSCRIBE = 1, UNSUBSCRIBE = 2 };
@@ -354,10 +437,11 @@ enum class request_type { PUBLISH = 0, SUBSCRIBE = 1, UNSUBSCRIBE = 2 };
 struct sent_request_info {
   const request_type type;
   const std::string channel;
-  const nlohmann::json pdu;
   const std::chrono::system_clock::time_point time;
   const size_t buffer_size;
   request_callbacks *callbacks;  // TODO: later on convert it to reference
+  // set for publish requests.
+  channel_counters *counters{nullptr};
 };
 
 class secure_client : public client, public boost::static_visitor<> {
@@ -365,28 +449,33 @@ class secure_client : public client, public boost::static_visitor<> {
   explicit secure_client(const std::string &host, const std::string &port,
                          const std::string &appkey, uint64_t client_id,
                          error_callbacks &common_error_callbacks,
-                         asio::io_service &io_service, asio::ssl::context &ssl_ctx)
+                         asio::io_service &io_service, asio::ssl::context &ssl_ctx,
+                         size_t max_write_batch_bytes,
+                         const std::shared_ptr<connection_cache> &cache,
+                         bool compression)
       : _host{host},
         _port{port},
         _appkey{appkey},
         _tcp_resolver{io_service},
-        _ws{io_service, ssl_ctx},
+        _ws{max_write_batch_bytes, io_service, ssl_ctx},
         _client_id{client_id},
         _common_error_callbacks{common_error_callbacks},
-        _ping_timer{io_service} {
+        _ping_timer{io_service},
+        _cache{cache},
+        _compression{compression} {
     _control_callback = [this](boost::beast::websocket::frame_type type,
                                const boost::beast::string_view &payload) {
       switch (type) {
         case boost::beast::websocket::frame_type::close:
-          rtm_frames_received_total.Add({{"type", "close"}}).Increment();
+          rtm_close_frames_received.Increment();
           LOG(2) << "got close frame " << payload;
           break;
         case boost::beast::websocket::frame_type::ping:
-          rtm_frames_received_total.Add({{"type", "ping"}}).Increment();
+          rtm_ping_frames_received.Increment();
           LOG(2) << "got ping frame " << payload;
           break;
         case boost::beast::websocket::frame_type::pong:
-          rtm_frames_received_total.Add({{"type", "ping"}}).Increment();
+          rtm_ping_frames_received.Increment();
           LOG(4) << "got pong frame " << payload;
           on_pong(payload);
           break;
@@ -403,32 +492,61 @@ class secure_client : public client, public boost::static_visitor<> {
 
     boost::system::error_code ec;
 
-    auto endpoints = _tcp_resolver.resolve({_host, _port}, ec);
-    if (ec.value() != 0) {
-      LOG(ERROR) << "can't resolve endpoint: [" << ec << "] " << ec.message();
-      rtm_client_error.Add({{"type", "tcp_resolve_endpoint"}}).Increment();
-      return make_error_condition(client_error::ASIO_ERROR);
+    std::vector<asio::ip::tcp::endpoint> endpoints = cached_endpoints();
+    const bool endpoints_cached = !endpoints.empty();
+    if (!endpoints_cached) {
+      ec = resolve(endpoints);
+      if (ec.value() != 0) {
+        return make_error_condition(client_error::ASIO_ERROR);
+      }
     }
 
     _ws.read_message_max(read_buffer_size);
 
     // tcp connect
-    asio::connect(_ws.next_layer().next_layer(), endpoints, ec);
+    auto &socket = ssl_stream().next_layer();
+    asio::connect(socket, endpoints.begin(), endpoints.end(), ec);
+    if (ec.value() != 0 && endpoints_cached) {
+      LOG(INFO) << "can't connect to cached endpoints, resolving again: [" << ec << "] "
+                << ec.message();
+      boost::system::error_code ignored;
+      socket.close(ignored);
+      ec = resolve(endpoints);
+      if (ec.value() != 0) {
+        return make_error_condition(client_error::ASIO_ERROR);
+      }
+      asio::connect(socket, endpoints.begin(), endpoints.end(), ec);
+    }
     if (ec.value() != 0) {
       LOG(ERROR) << "can't connect: [" << ec << "] " << ec.message();
       rtm_client_error.Add({{"type", "tcp_connect"}}).Increment();
       return make_error_condition(client_error::ASIO_ERROR);
     }
 
-    // ssl handshake
-    _ws.next_layer().handshake(boost::asio::ssl::stream_base::client, ec);
+    // ssl handshake, abbreviated one if cached session is accepted by server.
+    if (_cache) {
+      std::lock_guard<std::mutex> lock{_cache->mutex};
+      if (_cache->tls_session) {
+        SSL_set_session(ssl_stream().native_handle(), _cache->tls_session.get());
+      }
+    }
+    ssl_stream().handshake(boost::asio::ssl::stream_base::client, ec);
     if (ec.value() != 0) {
       LOG(ERROR) << "can't handshake SSL: [" << ec << "] " << ec.message();
       rtm_client_error.Add({{"type", "ssl_handshake"}}).Increment();
       return make_error_condition(client_error::ASIO_ERROR);
     }
+    const bool session_reused = SSL_session_reused(ssl_stream().native_handle()) == 1;
+    LOG(1) << "TLS session reused: " << session_reused;
+    rtm_tls_handshakes_total.Add({{"resumed", session_reused ? "true" : "false"}})
+        .Increment();
 
     // upgrade to ws.
+    if (_compression) {
+      boost::beast::websocket::permessage_deflate deflate;
+      deflate.client_enable = true;
+      _ws.set_option(deflate);
+    }
     boost::beast::websocket::response_type ws_upgrade_response;
     _ws.handshake_ex(ws_upgrade_response, _host + ":" + _port, "/v2?appkey=" + _appkey,
                      [this](boost::beast::websocket::request_type &ws_upgrade_request) {
@@ -448,6 +566,14 @@ class secure_client : public client, public boost::static_visitor<> {
     }
     LOG(INFO) << "websocket open";
     rtm_client_start.Increment();
+    if (_compression) {
+      const auto extensions =
+          ws_upgrade_response[boost::beast::http::field::sec_websocket_extensions];
+      LOG(INFO) << "websocket extensions accepted by server: "
+                << (extensions.empty() ? "none" : extensions.to_string());
+    }
+    // TLS 1.3 session tickets come after handshake, they are read by now.
+    cache_tls_session();
 
     _ws.control_callback(_control_callback);
     if (use_cbor) {
@@ -461,6 +587,50 @@ class secure_client : public client, public boost::static_visitor<> {
     return {};
   }
 
+  std::vector<asio::ip::tcp::endpoint> cached_endpoints() {
+    if (!_cache) {
+      return {};
+    }
+    std::lock_guard<std::mutex> lock{_cache->mutex};
+    if (std::chrono::steady_clock::now() - _cache->resolve_time > endpoints_cache_ttl) {
+      return {};
+    }
+    return _cache->endpoints;
+  }
+
+  boost::system::error_code resolve(std::vector<asio::ip::tcp::endpoint> &endpoints) {
+    boost::system::error_code ec;
+    auto results = _tcp_resolver.resolve({_host, _port}, ec);
+    if (ec.value() != 0) {
+      LOG(ERROR) << "can't resolve endpoint: [" << ec << "] " << ec.message();
+      rtm_client_error.Add({{"type", "tcp_resolve_endpoint"}}).Increment();
+      return ec;
+    }
+
+    endpoints.clear();
+    for (const auto &entry : results) {
+      endpoints.push_back(entry.endpoint());
+    }
+    if (_cache) {
+      std::lock_guard<std::mutex> lock{_cache->mutex};
+      _cache->endpoints = endpoints;
+      _cache->resolve_time = std::chrono::steady_clock::now();
+    }
+    return ec;
+  }
+
+  void cache_tls_session() {
+    if (!_cache) {
+      return;
+    }
+    SSL_SESSION *session = SSL_get1_session(ssl_stream().native_handle());
+    if (session == nullptr) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock{_cache->mutex};
+    _cache->tls_session.reset(session);
+  }
+
   std::error_condition stop() override {
     CHECK_EQ(_client_state, client_state::RUNNING);
     LOG(INFO) << "Stopping secure RTM client";
@@ -474,7 +644,7 @@ class secure_client : public client, public boost::static_visitor<> {
       return make_error_condition(client_error::ASIO_ERROR);
     }
 
-    _ws.next_layer().next_layer().close(ec);
+    ssl_stream().next_layer().close(ec);
     if (ec.value() != 0) {
       LOG(ERROR) << "can't close: [" << ec << "] " << ec.message();
       rtm_client_error.Add({{"type", "close_connection"}}).Increment();
@@ -488,45 +658,62 @@ class secure_client : public client, public boost::static_visitor<> {
   request_done_cb handle_write(
       std::unordered_map<uint64_t, sent_request_info>::const_iterator it) {
     return [this, it](boost::system::error_code ec) {
-      const auto after_write = std::chrono::system_clock::now();
-      const auto &request_info = it->second;
-      rtm_write_delay_microseconds.Observe(
-          std::chrono::duration_cast<std::chrono::microseconds>(after_write
-                                                                - request_info.time)
-              .count());
-
-      if (ec.value() != 0) {
-        LOG(ERROR) << "write request failure: [" << ec << "] " << ec.message()
-                   << ", message " << request_info.pdu;
-        rtm_client_error.Add({{"type", "publish"}}).Increment();
-        if (request_info.callbacks != nullptr) {
-          if (request_info.type == request_type::PUBLISH) {
-            request_info.callbacks->on_error(
-                make_error_condition(client_error::PUBLISH_ERROR));
-          } else if (request_info.type == request_type::SUBSCRIBE) {
-            request_info.callbacks->on_error(
-                make_error_condition(client_error::SUBSCRIBE_ERROR));
-          } else if (request_info.type == request_type::UNSUBSCRIBE) {
-            request_info.callbacks->on_error(
-                make_error_condition(client_error::UNSUBSCRIBE_ERROR));
-          } else {
-            ABORT() << "unreachable";
-          }
-        }
+      if (!on_request_written(it->second, ec)) {
         _sent_request_infos.erase(it);
-      } else {
+      }
+    };
+  }
+
+  // unconfirmed requests are done once written.
+  request_done_cb handle_unconfirmed_write(sent_request_info &&request_info) {
+    return [ this, info = std::move(request_info) ](boost::system::error_code ec) {
+      if (on_request_written(info, ec) && info.callbacks != nullptr) {
+        info.callbacks->on_ok();
+      }
+    };
+  }
+
+  // Returns false if write has failed, request callbacks are notified about the error.
+  bool on_request_written(const sent_request_info &request_info,
+                          boost::system::error_code ec) {
+    const auto after_write = std::chrono::system_clock::now();
+    rtm_write_delay_microseconds.Observe(
+        std::chrono::duration_cast<std::chrono::microseconds>(after_write
+                                                              - request_info.time)
+            .count());
+
+    if (ec.value() != 0) {
+      LOG(ERROR) << "write request failure: [" << ec << "] " << ec.message()
+                 << ", channel " << request_info.channel << ", "
+                 << request_info.buffer_size << " bytes";
+      rtm_client_error.Add({{"type", "publish"}}).Increment();
+      if (request_info.callbacks != nullptr) {
         if (request_info.type == request_type::PUBLISH) {
-          rtm_messages_sent.Add({{"channel", request_info.channel}}).Increment();
-          rtm_messages_bytes_sent.Add({{"channel", request_info.channel}})
-              .Increment(request_info.buffer_size);
+          request_info.callbacks->on_error(
+              make_error_condition(client_error::PUBLISH_ERROR));
+        } else if (request_info.type == request_type::SUBSCRIBE) {
+          request_info.callbacks->on_error(
+              make_error_condition(client_error::SUBSCRIBE_ERROR));
+        } else if (request_info.type == request_type::UNSUBSCRIBE) {
+          request_info.callbacks->on_error(
+              make_error_condition(client_error::UNSUBSCRIBE_ERROR));
+        } else {
+          ABORT() << "unreachable";
         }
-        rtm_bytes_written.Increment(request_info.buffer_size);
       }
-    };
+      return false;
+    }
+
+    if (request_info.counters != nullptr) {
+      request_info.counters->sent.Increment();
+      request_info.counters->sent_bytes.Increment(request_info.buffer_size);
+    }
+    rtm_bytes_written.increment(request_info.buffer_size);
+    return true;
   }
 
   void publish(const std::string &channel, nlohmann::json &&message,
-               request_callbacks *callbacks) override {
+               request_callbacks *callbacks, const publish_options &options) override {
     if (_client_state == client_state::PENDING_STOPPED) {
       LOG(1) << "RTM client is pending stop";
       return;
@@ -534,27 +721,59 @@ class secure_client : public client, public boost::static_visitor<> {
     CHECK_EQ(_client_state, client_state::RUNNING)
         << "RTM client is not running, channel " << channel << ", message " << message;
 
-    nlohmann::json pdu = nlohmann::json::object();
-    pdu["action"] = "rtm/publish";
-    auto &body = pdu["body"];
-    body = nlohmann::json::object();
-    body["channel"] = channel;
-    body["message"] = message;
-    const uint64_t request_id = new_request_id();
-    pdu["id"] = request_id;
+    const uint64_t request_id = options.ack ? new_request_id() : 0;
+    std::string buffer;
+    if (use_cbor) {
+      // pdu envelope is written directly, so message is serialized only once.
+      cbor_writer writer{buffer};
+      writer.write_map(options.ack ? 3 : 2);
+      writer.write_text("action");
+      writer.write_text("rtm/publish");
+      writer.write_text("body");
+      writer.write_map(2);
+      writer.write_text("channel");
+      writer.write_text(channel);
+      writer.write_text("message");
+      json_to_cbor(message, buffer);
+      if (options.ack) {
+        writer.write_text("id");
+        writer.write_uint(request_id);
+      }
+    } else {
+      nlohmann::json pdu = nlohmann::json::object();
+      pdu["action"] = "rtm/publish";
+      auto &body = pdu["body"];
+      body = nlohmann::json::object();
+      body["channel"] = channel;
+      decode_encoded_maps(message);
+      body["message"] = std::move(message);
+      if (options.ack) {
+        pdu["id"] = request_id;
+      }
+      buffer = pdu.dump();
+    }
 
-    std::string buffer = use_cbor ? json_to_cbor(pdu) : pdu.dump();
+    sent_request_info request_info{request_type::PUBLISH,
+                                   channel,
+                                   std::chrono::system_clock::now(),
+                                   buffer.size(),
+                                   callbacks,
+                                   &publish_counters(channel)};
+    if (!options.ack) {
+      write(std::move(buffer), handle_unconfirmed_write(std::move(request_info)));
+      return;
+    }
 
-    const auto insert_result = _sent_request_infos.emplace(
-        request_id,
-        sent_request_info{request_type::PUBLISH, channel, std::move(pdu),
-                          std::chrono::system_clock::now(), buffer.size(), callbacks});
+    const auto insert_result =
+        _sent_request_infos.emplace(request_id, std::move(request_info));
     CHECK(insert_result.second);
     const auto it = insert_result.first;
 
     write(std::move(buffer), handle_write(it));
   }
 
+  bool supports_binary() const override { return use_cbor; }
+
   void subscribe(const std::string &channel, const subscription &sub,
                  subscription_callbacks &data_callbacks, request_callbacks *callbacks,
                  const subscription_options *options) override {
@@ -565,20 +784,21 @@ class secure_client : public client, public boost::static_visitor<> {
     CHECK_EQ(_client_state, client_state::RUNNING) << "RTM client is not running";
 
     const uint64_t request_id = new_request_id();
-    subscribe_request request{request_id, channel};
+    const bool raw_cbor = use_cbor && options != nullptr && options->raw_cbor;
+    const uint32_t subscription_id =
+        _channel_subscriptions.add(channel, sub, data_callbacks, raw_cbor);
+    subscribe_request request{request_id, channel, subscription_id};
     if (options != nullptr) {
       request.age = options->history.age;
       request.count = options->history.count;
     }
 
-    _channel_subscriptions.add(channel, sub, data_callbacks);
-
     nlohmann::json pdu = request.to_json();
     std::string buffer = use_cbor ? json_to_cbor(pdu) : pdu.dump();
 
     const auto insert_result = _sent_request_infos.emplace(
         request_id,
-        sent_request_info{request_type::SUBSCRIBE, channel, std::move(pdu),
+        sent_request_info{request_type::SUBSCRIBE, channel,
                           std::chrono::system_clock::now(), buffer.size(), callbacks});
     CHECK(insert_result.second);
     const auto it = insert_result.first;
@@ -598,14 +818,14 @@ class secure_client : public client, public boost::static_visitor<> {
     CHECK(found) << "didn't find subscription";
 
     const uint64_t request_id = new_request_id();
-    unsubscribe_request request{request_id, found->channel};
+    unsubscribe_request request{request_id, found->id};
 
     nlohmann::json pdu = request.to_json();
     std::string buffer = use_cbor ? json_to_cbor(pdu) : pdu.dump();
 
     const auto insert_result = _sent_request_infos.emplace(
         request_id,
-        sent_request_info{request_type::UNSUBSCRIBE, found->channel, std::move(pdu),
+        sent_request_info{request_type::UNSUBSCRIBE, found->channel,
                           std::chrono::system_clock::now(), buffer.size(), callbacks});
     CHECK(insert_result.second);
     const auto it = insert_result.first;
@@ -614,6 +834,14 @@ class secure_client : public client, public boost::static_visitor<> {
   }
 
  private:
+  channel_counters &publish_counters(const std::string &channel) {
+    auto it = _publish_counters.find(channel);
+    if (it == _publish_counters.end()) {
+      it = _publish_counters.emplace(channel, channel_counters{channel}).first;
+    }
+    return it->second;
+  }
+
   void on_pong(const boost::beast::string_view &payload) {
     const auto now = std::chrono::system_clock::now();
     rtm_last_pong_time_seconds.Set(
@@ -661,36 +889,49 @@ class secure_client : public client, public boost::static_visitor<> {
         return;
       }
 
-      const std::string buffer = boost::beast::buffers_to_string(_read_buffer.data());
-      CHECK_EQ(buffer.size(), _read_buffer.size());
+      const auto buffer = _read_buffer.data();
+      const bool keep_reading = process_read_buffer(
+          static_cast<const char *>(buffer.data()), buffer.size(), arrival_time);
+      // next read may reallocate buffer, so it must be consumed first.
       _read_buffer.consume(_read_buffer.size());
-      rtm_bytes_read.Increment(_read_buffer.size());
+      if (keep_reading) {
+        LOG(9) << this << " async_read asking for read";
+        ask_for_read();
+      }
+    });
+  }
 
-      nlohmann::json document;
+  // Parses pdu right from the read buffer. Returns false if reading should stop.
+  bool process_read_buffer(const char *data, size_t size,
+                           std::chrono::system_clock::time_point arrival_time) {
+    rtm_bytes_read.increment(size);
 
-      if (use_cbor) {
-        auto doc_or_error = cbor_to_json(buffer);
-        if (!doc_or_error.ok()) {
-          LOG(ERROR) << "CBOR message couldn't be processed: "
-                     << doc_or_error.error_message();
-          return;
-        }
-        document = doc_or_error.get();
-      } else {
-        try {
-          document = nlohmann::json::parse(buffer);
-        } catch (const std::exception &e) {
-          LOG(ERROR) << "Bad data: " << e.what() << " " << buffer;
-          return;
-        }
-      }
+    if (use_cbor && process_cbor_pdu(data, size, arrival_time)) {
+      return true;
+    }
 
-      LOG(9) << this << " async_read processing input";
-      process_input(document, buffer.size(), arrival_time);
+    nlohmann::json document;
 
-      LOG(9) << this << " async_read asking for read";
-      ask_for_read();
-    });
+    if (use_cbor) {
+      auto doc_or_error = cbor_to_json(data, size);
+      if (!doc_or_error.ok()) {
+        LOG(ERROR) << "CBOR message couldn't be processed: "
+                   << doc_or_error.error_message();
+        return false;
+      }
+      document = doc_or_error.move();
+    } else {
+      try {
+        document = nlohmann::json::parse(data, data + size);
+      } catch (const std::exception &e) {
+        LOG(ERROR) << "Bad data: " << e.what() << " " << std::string{data, size};
+        return false;
+      }
+    }
+
+    LOG(9) << this << " async_read processing input";
+    process_input(document, size, arrival_time);
+    return true;
   }
 
   void arm_ping_timer() {
@@ -748,13 +989,16 @@ class secure_client : public client, public boost::static_visitor<> {
     });
   }
 
+  static uint64_t request_id(const nlohmann::json &pdu) {
+    CHECK(pdu.find("id") != pdu.end()) << "no id in pdu: " << pdu;
+    return pdu["id"];
+  }
+
   std::unordered_map<uint64_t, sent_request_info>::const_iterator
-  process_request_confirmation(const nlohmann::json &pdu,
+  process_request_confirmation(const uint64_t id,
                                const std::chrono::system_clock::time_point arrival_time) {
-    CHECK(pdu.find("id") != pdu.end()) << "no id in pdu: " << pdu;
-    const uint64_t id = pdu["id"];
     const auto it = _sent_request_infos.find(id);
-    CHECK(it != _sent_request_infos.end()) << "unexpected confirmation: " << pdu;
+    CHECK(it != _sent_request_infos.end()) << "unexpected confirmation of request " << id;
     const auto &request_info = it->second;
     if (request_info.type == request_type::PUBLISH) {
       rtm_publish_ack_latency_millis.Observe(
@@ -766,43 +1010,138 @@ class secure_client : public client, public boost::static_visitor<> {
     return it;
   }
 
-  std::pair<subscription_details &, const nlohmann::json &> process_subscription_pdu(
-      const nlohmann::json &pdu) {
+  // rtm/publish/ok, rtm/subscribe/ok or rtm/unsubscribe/ok.
+  void process_ok(boost::string_ref action, const uint64_t id,
+                  const std::chrono::system_clock::time_point arrival_time) {
+    auto it = process_request_confirmation(id, arrival_time);
+    if (it->second.callbacks != nullptr) {
+      it->second.callbacks->on_ok();
+    }
+    if (action == "rtm/unsubscribe/ok") {
+      CHECK(_channel_subscriptions.delete_by_channel(it->second.channel))
+          << "failed to delete: " << it->second.channel;
+    }
+    _sent_request_infos.erase(it);
+  }
+
+  static bool is_ok_action(boost::string_ref action) {
+    return action == "rtm/publish/ok" || action == "rtm/subscribe/ok"
+           || action == "rtm/unsubscribe/ok";
+  }
+
+  std::pair<subscription_details &, nlohmann::json &> process_subscription_pdu(
+      nlohmann::json &pdu) {
     CHECK(pdu.find("body") != pdu.end()) << "no body in pdu: " << pdu;
-    const auto &body = pdu["body"];
+    auto &body = pdu["body"];
     CHECK(body.find("subscription_id") != body.end())
         << "no subscription_id in body: " << pdu;
-    const std::string channel = body["subscription_id"];
+    const std::string subscription_id = body["subscription_id"];
 
-    const auto found = _channel_subscriptions.find_by_channel(channel);
+    uint32_t id;
+    CHECK(parse_subscription_id(subscription_id, id)) << "bad subscription_id: " << pdu;
+    const auto found = _channel_subscriptions.find_by_id(id);
     CHECK(found) << "no subscription for pdu: " << pdu;
     return {*found, body};
   }
 
-  void process_input(const nlohmann::json &pdu, size_t byte_size,
+  // Processes subscription data and confirmations right from CBOR pdu, without
+  // building pdu tree. Returns false if pdu should be processed as usual, like errors
+  // and malformed pdus.
+  bool process_cbor_pdu(const char *data, size_t data_size,
+                        std::chrono::system_clock::time_point arrival_time) {
+    cbor_pdu pdu;
+    if (!read_cbor_pdu(data, data_size, pdu)) {
+      return false;
+    }
+
+    if (pdu.action == "rtm/subscription/data") {
+      return pdu.body && process_subscription_data(*pdu.body, data_size, arrival_time);
+    }
+    if (pdu.id < 0 || !is_ok_action(pdu.action)) {
+      return false;
+    }
+    rtm_action_received(pdu.action).Increment();
+    process_ok(pdu.action, static_cast<uint64_t>(pdu.id), arrival_time);
+    return true;
+  }
+
+  // Delivers CBOR messages raw if subscription wants them and decodes them one by
+  // one otherwise.
+  bool process_subscription_data(cbor_reader body, size_t data_size,
+                                 std::chrono::system_clock::time_point arrival_time) {
+    // the whole pdu is checked before delivering anything, so it can still be
+    // processed as usual.
+    cbor_subscription_data subscription_data;
+    uint32_t id;
+    if (!read_cbor_subscription_data(body, subscription_data)
+        || !parse_subscription_id(subscription_data.subscription_id, id)) {
+      return false;
+    }
+    const std::vector<boost::string_ref> &items = subscription_data.messages;
+
+    const auto found = _channel_subscriptions.find_by_id(id);
+    if (!found) {
+      return false;
+    }
+    auto &sub_info = *found;
+
+    std::vector<nlohmann::json> payloads;
+    if (!sub_info.raw_cbor) {
+      payloads.reserve(items.size());
+      for (const auto &item : items) {
+        auto payload = cbor_to_json(item.data(), item.size());
+        if (!payload.ok()) {
+          return false;
+        }
+        payloads.push_back(payload.move());
+      }
+    }
+
+    rtm_subscription_data_received.increment();
+    sub_info.counters.received.Increment();
+    sub_info.counters.received_bytes.Increment(data_size);
+    rtm_messages_in_pdu.Observe(items.size());
+
+    for (size_t i = 0; i < items.size(); i++) {
+      channel_data data;
+      if (sub_info.raw_cbor) {
+        data.cbor_payload.assign(items[i].data(), items[i].size());
+      } else {
+        data.payload = std::move(payloads[i]);
+      }
+      data.arrival_time = arrival_time;
+      sub_info.callbacks.on_data(sub_info.sub, std::move(data));
+    }
+    return true;
+  }
+
+  void process_input(nlohmann::json &pdu, size_t byte_size,
                      std::chrono::system_clock::time_point arrival_time) {
     CHECK(pdu.is_object()) << "not an object: " << pdu;
     CHECK(pdu.find("action") != pdu.end()) << "no action in pdu: " << pdu;
     const std::string action = pdu["action"];
-    rtm_actions_received.Add({{"action", action}}).Increment();
+    const bool subscription_data = action == "rtm/subscription/data";
+    if (subscription_data) {
+      rtm_subscription_data_received.increment();
+    } else {
+      rtm_action_received(action).Increment();
+    }
 
-    if (action == "rtm/subscription/data") {
+    if (subscription_data) {
       auto result = process_subscription_pdu(pdu);
       auto &sub_info = result.first;
-      const auto &body = result.second;
+      auto &body = result.second;
 
       CHECK(body.find("messages") != body.end()) << "no messages in body: " << pdu;
-      const auto &messages = body["messages"];
+      auto &messages = body["messages"];
       CHECK(messages.is_array()) << "messages is not an array: " << pdu;
 
-      rtm_messages_received.Add({{"channel", sub_info.channel}}).Increment();
-      rtm_messages_bytes_received.Add({{"channel", sub_info.channel}})
-          .Increment(byte_size);
+      sub_info.counters.received.Increment();
+      sub_info.counters.received_bytes.Increment(byte_size);
       rtm_messages_in_pdu.Observe(messages.size());
 
-      for (const auto &m : messages) {
-        // TODO: avoid copying of m
-        sub_info.callbacks.on_data(sub_info.sub, {m, arrival_time});
+      for (auto &m : messages) {
+        sub_info.callbacks.on_data(sub_info.sub, {std::move(m), arrival_time});
       }
     } else if (action == "rtm/subscription/error") {
       LOG(ERROR) << "subscription error: " << pdu;
@@ -810,30 +1149,24 @@ class secure_client : public client, public boost::static_visitor<> {
       auto result = process_subscription_pdu(pdu);
       auto &sub_info = result.first;
       sub_info.callbacks.on_error(make_error_condition(client_error::SUBSCRIPTION_ERROR));
-    } else if (action == "rtm/publish/ok") {
-      auto it = process_request_confirmation(pdu, arrival_time);
-      if (it->second.callbacks != nullptr) {
-        it->second.callbacks->on_ok();
-      }
-      _sent_request_infos.erase(it);
+    } else if (is_ok_action(action)) {
+      process_ok(action, request_id(pdu), arrival_time);
     } else if (action == "rtm/publish/error") {
       LOG(ERROR) << "got publish error: " << pdu;
       rtm_publish_error_total.Increment();
-      auto it = process_request_confirmation(pdu, arrival_time);
-      if (it->second.callbacks != nullptr) {
-        it->second.callbacks->on_error(make_error_condition(client_error::PUBLISH_ERROR));
+      if (pdu.find("id") == pdu.end()) {
+        // unconfirmed publish, there is nobody to notify.
+        return;
       }
-      _sent_request_infos.erase(it);
-    } else if (action == "rtm/subscribe/ok") {
-      auto it = process_request_confirmation(pdu, arrival_time);
+      auto it = process_request_confirmation(request_id(pdu), arrival_time);
       if (it->second.callbacks != nullptr) {
-        it->second.callbacks->on_ok();
+        it->second.callbacks->on_error(make_error_condition(client_error::PUBLISH_ERROR));
       }
       _sent_request_infos.erase(it);
     } else if (action == "rtm/subscribe/error") {
       LOG(ERROR) << "got subscribe error: " << pdu;
       rtm_subscribe_error_total.Increment();
-      auto it = process_request_confirmation(pdu, arrival_time);
+      auto it = process_request_confirmation(request_id(pdu), arrival_time);
       if (it->second.callbacks != nullptr) {
         it->second.callbacks->on_error(
             make_error_condition(client_error::SUBSCRIBE_ERROR));
@@ -841,18 +1174,10 @@ class secure_client : public client, public boost::static_visitor<> {
       _sent_request_infos.erase(it);
       CHECK(_channel_subscriptions.delete_by_channel(it->second.channel))
           << "failed to delete: " << pdu;
-    } else if (action == "rtm/unsubscribe/ok") {
-      auto it = process_request_confirmation(pdu, arrival_time);
-      if (it->second.callbacks != nullptr) {
-        it->second.callbacks->on_ok();
-      }
-      _sent_request_infos.erase(it);
-      CHECK(_channel_subscriptions.delete_by_channel(it->second.channel))
-          << "failed to delete: " << pdu;
     } else if (action == "rtm/unsubscribe/error") {
       LOG(ERROR) << "got unsubscribe error: " << pdu;
       rtm_unsubscribe_error_total.Increment();
-      auto it = process_request_confirmation(pdu, arrival_time);
+      auto it = process_request_confirmation(request_id(pdu), arrival_time);
       if (it->second.callbacks != nullptr) {
         it->second.callbacks->on_error(
             make_error_condition(client_error::UNSUBSCRIBE_ERROR));
@@ -917,14 +1242,25 @@ class secure_client : public client, public boost::static_visitor<> {
   }
 
  private:
+  // Next request may be framed once websocket has passed this one to coalescing
+  // stream, but the request is done only when its batch reaches the socket.
   void on_request_done(boost::system::error_code ec) {
     const auto &request = _pending_requests.front();
-    boost::apply_visitor(get_done_cb_visitor{}, request)(ec);
+    request_done_cb done_cb = boost::apply_visitor(get_done_cb_visitor{}, request);
+    if (ec.value() != 0) {
+      done_cb(ec);
+    } else {
+      _ws.next_layer().on_written(std::move(done_cb));
+    }
     _pending_requests.pop();
     _request_in_flight = false;
     drain_requests();
   }
 
+  boost::asio::ssl::stream<boost::asio::ip::tcp::socket> &ssl_stream() {
+    return _ws.next_layer().next_layer();
+  }
+
   // TODO: check if can get rid of client state
   std::atomic<client_state> _client_state{client_state::STOPPED};
 
@@ -935,33 +1271,113 @@ class secure_client : public client, public boost::static_visitor<> {
   error_callbacks &_common_error_callbacks;
 
   asio::ip::tcp::resolver _tcp_resolver;
-  boost::beast::websocket::stream<boost::asio::ssl::stream<boost::asio::ip::tcp::socket> >
+  boost::beast::websocket::stream<
+      coalescing_write_stream<boost::asio::ssl::stream<boost::asio::ip::tcp::socket>>>
       _ws;
-  boost::beast::multi_buffer _read_buffer{read_buffer_size};
+  boost::beast::flat_buffer _read_buffer{read_buffer_size};
   subscriptions_map _channel_subscriptions;
   boost::asio::deadline_timer _ping_timer;
+  const std::shared_ptr<connection_cache> _cache;
+  const bool _compression;
   std::unordered_map<uint64_t, std::chrono::system_clock::time_point> _ping_times;
   std::function<void(boost::beast::websocket::frame_type type,
                      boost::beast::string_view payload)>
       _control_callback;
   std::unordered_map<uint64_t, sent_request_info> _sent_request_infos;
+  // std::unordered_map never moves its values, so requests may keep pointers.
+  std::unordered_map<std::string, channel_counters> _publish_counters;
   std::queue<io_request> _pending_requests;
   bool _request_in_flight{false};
 };
 
 }  // namespace
 
+std::shared_ptr<connection_cache> new_connection_cache() {
+  return std::make_shared<connection_cache>();
+}
+
 std::unique_ptr<client> new_client(const std::string &endpoint, const std::string &port,
                                    const std::string &appkey,
                                    asio::io_service &io_service,
                                    asio::ssl::context &ssl_ctx, size_t id,
-                                   error_callbacks &callbacks) {
+                                   error_callbacks &callbacks,
+                                   size_t max_write_batch_bytes,
+                                   const std::shared_ptr<connection_cache> &cache,
+                                   bool compression) {
   LOG(1) << "Creating RTM client for " << endpoint << ":" << port << "?appkey=" << appkey;
   std::unique_ptr<secure_client> client(
-      new secure_client(endpoint, port, appkey, id, callbacks, io_service, ssl_ctx));
+      new secure_client(endpoint, port, appkey, id, callbacks, io_service, ssl_ctx,
+                        max_write_batch_bytes, cache, compression));
   return std::move(client);
 }
 
+split_compression_client::split_compression_client(std::unique_ptr<client> compressed,
+                                                   std::unique_ptr<client> uncompressed)
+    : _compressed(std::move(compressed)), _uncompressed(std::move(uncompressed)) {}
+
+void split_compression_client::publish(const std::string &channel,
+                                       nlohmann::json &&message,
+                                       request_callbacks *callbacks,
+                                       const publish_options &options) {
+  channel_client(channel, options.compress)
+      .publish(channel, std::move(message), callbacks, options);
+}
+
+bool split_compression_client::supports_binary() const {
+  return _compressed->supports_binary() && _uncompressed->supports_binary();
+}
+
+void split_compression_client::subscribe(const std::string &channel,
+                                         const subscription &sub,
+                                         subscription_callbacks &data_callbacks,
+                                         request_callbacks *callbacks,
+                                         const subscription_options *options) {
+  client &c = channel_client(channel, options == nullptr || options->compress);
+  _subscription_clients[&sub] = &c;
+  c.subscribe(channel, sub, data_callbacks, callbacks, options);
+}
+
+void split_compression_client::unsubscribe(const subscription &sub,
+                                           request_callbacks *callbacks) {
+  const auto it = _subscription_clients.find(&sub);
+  CHECK(it != _subscription_clients.end()) << "unknown subscription";
+  client &c = *it->second;
+  _subscription_clients.erase(it);
+  c.unsubscribe(sub, callbacks);
+}
+
+std::error_condition split_compression_client::start() {
+  const auto ec = _compressed->start();
+  if (ec) {
+    return ec;
+  }
+  const auto uncompressed_ec = _uncompressed->start();
+  if (uncompressed_ec) {
+    LOG(ERROR) << "uncompressed connection didn't start: " << uncompressed_ec.message();
+    _compressed->stop();
+  }
+  return uncompressed_ec;
+}
+
+std::error_condition split_compression_client::stop() {
+  const auto compressed_ec = _compressed->stop();
+  const auto uncompressed_ec = _uncompressed->stop();
+  return compressed_ec ? compressed_ec : uncompressed_ec;
+}
+
+client &split_compression_client::channel_client(const std::string &channel,
+                                                 bool compress) {
+  auto it = _channel_clients.find(channel);
+  if (it == _channel_clients.end()) {
+    LOG(1) << "channel " << channel << " goes through "
+           << (compress ? "compressed" : "uncompressed") << " connection";
+    it = _channel_clients
+             .emplace(channel, compress ? _compressed.get() : _uncompressed.get())
+             .first;
+  }
+  return *it->second;
+}
+
 resilient_client::resilient_client(asio::io_service &io_service,
                                    std::thread::id io_thread_id,
                                    resilient_client::client_factory_t &&factory,
@@ -972,11 +1388,16 @@ resilient_client::resilient_client(asio::io_service &io_service,
       _error_callbacks(callbacks) {}
 
 void resilient_client::publish(const std::string &channel, nlohmann::json &&message,
-                               request_callbacks *callbacks) {
+                               request_callbacks *callbacks,
+                               const publish_options &options) {
   CHECK_EQ(std::this_thread::get_id(), _io_thread_id)
       << "Invocation from " << threadutils::get_current_thread_name();
 
-  _client->publish(channel, std::move(message), callbacks);
+  _client->publish(channel, std::move(message), callbacks, options);
+}
+
+bool resilient_client::supports_binary() const {
+  return _client && _client->supports_binary();
 }
 
 void resilient_client::subscribe(const std::string &channel, const subscription &sub,
@@ -996,8 +1417,10 @@ void resilient_client::unsubscribe(const subscription &sub,
       << "Invocation from " << threadutils::get_current_thread_name();
 
   _client->unsubscribe(sub, callbacks);
-  std::remove_if(_subscriptions.begin(), _subscriptions.end(),
-                 [&sub](const subscription_info &si) { return &sub == si.sub; });
+  _subscriptions.erase(
+      std::remove_if(_subscriptions.begin(), _subscriptions.end(),
+                     [&sub](const subscription_info &si) { return &sub == si.sub; }),
+      _subscriptions.end());
 }
 
 std::error_condition resilient_client::start() {
@@ -1047,6 +1470,8 @@ void resilient_client::restart() {
     return;
   }
 
+  // requests go out back to back without waiting for acks, so they share batched
+  // socket writes.
   LOG(1) << "restoring subscriptions";
   for (const auto &sub : _subscriptions) {
     _client->subscribe(sub.channel, *sub.sub, *sub.data_callbacks, sub.callbacks,
@@ -1062,17 +1487,22 @@ thread_checking_client::thread_checking_client(asio::io_service &io,
     : _io(io), _io_thread_id(io_thread_id), _client(std::move(client)) {}
 
 void thread_checking_client::publish(const std::string &channel, nlohmann::json &&message,
-                                     request_callbacks *callbacks) {
+                                     request_callbacks *callbacks,
+                                     const publish_options &options) {
   if (std::this_thread::get_id() != _io_thread_id) {
-    LOG(WARNING) << "Forwarding request from thread "
-                 << threadutils::get_current_thread_name();
-    _io.post([ this, channel, message = std::move(message), callbacks ]() mutable {
-      _client->publish(channel, std::move(message), callbacks);
-    });
+    LOG(5) << "Forwarding request from thread " << threadutils::get_current_thread_name();
+    _io.post(
+        [ this, channel, message = std::move(message), callbacks, options ]() mutable {
+          _client->publish(channel, std::move(message), callbacks, options);
+        });
     return;
   }
 
-  _client->publish(channel, std::move(message), callbacks);
+  _client->publish(channel, std::move(message), callbacks, options);
+}
+
+bool thread_checking_client::supports_binary() const {
+  return _client->supports_binary();
 }
 
 void thread_checking_client::subscribe(const std::string &channel,
@@ -1081,8 +1511,7 @@ void thread_checking_client::subscribe(const std::string &channel,
                                        request_callbacks *callbacks,
                                        const subscription_options *options) {
   if (std::this_thread::get_id() != _io_thread_id) {
-    LOG(WARNING) << "Forwarding request from thread "
-                 << threadutils::get_current_thread_name();
+    LOG(5) << "Forwarding request from thread " << threadutils::get_current_thread_name();
     _io.post([this, channel, &sub, &data_callbacks, callbacks, options]() {
       _client->subscribe(channel, sub, data_callbacks, callbacks, options);
     });
@@ -1117,6 +1546,271 @@ std::error_condition thread_checking_client::stop() {
   return _client->stop();
 }
 
+
+struct sharded_client::io_thread {
+  asio::io_service io;
+  std::unique_ptr<asio::io_service::work> work{new asio::io_service::work{io}};
+  std::thread thread;
+};
+
+// Connection is only touched by the thread of its io_service, which serializes
+// its reads, writes and callbacks like a strand would.
+struct sharded_client::shard {
+  shard(size_t index, asio::io_service &io) : index(index), io(io) {}
+
+  const size_t index;
+  asio::io_service &io;
+  std::unique_ptr<client> connection;
+};
+
+// Callbacks are invoked by shard threads, forwarders pass them to ASIO loop thread.
+struct sharded_client::error_forwarder : error_callbacks {
+  error_forwarder(asio::io_service &io, error_callbacks &target)
+      : io(io), target(target) {}
+
+  void on_error(std::error_condition ec) override {
+    auto &t = target;
+    io.post([&t, ec]() { t.on_error(ec); });
+  }
+
+  asio::io_service &io;
+  error_callbacks &target;
+};
+
+// Completion is passed to target if any, then done is invoked on ASIO loop thread.
+struct sharded_client::request_forwarder : request_callbacks {
+  request_forwarder(asio::io_service &io, request_callbacks *target,
+                    std::function<void()> &&done)
+      : io(io), target(target), done(std::move(done)) {}
+
+  void on_ok() override {
+    io.post([t = target, d = done]() {
+      if (t != nullptr) {
+        t->on_ok();
+      }
+      d();
+    });
+  }
+
+  void on_error(std::error_condition ec) override {
+    io.post([t = target, d = done, ec]() {
+      if (t != nullptr) {
+        t->on_error(ec);
+      }
+      d();
+    });
+  }
+
+  asio::io_service &io;
+  request_callbacks *const target;
+  const std::function<void()> done;
+  // requests in flight, only for forwarders shared by publish requests.
+  size_t pending{0};
+};
+
+struct sharded_client::subscription_forwarder : subscription_callbacks {
+  subscription_forwarder(asio::io_service &io, subscription_callbacks &target)
+      : io(io), target(target) {}
+
+  void on_data(const subscription &sub, channel_data &&data) override {
+    auto &t = target;
+    io.post([&t, &sub, data = std::move(data) ]() mutable {
+      t.on_data(sub, std::move(data));
+    });
+  }
+
+  void on_error(std::error_condition ec) override {
+    auto &t = target;
+    io.post([&t, ec]() { t.on_error(ec); });
+  }
+
+  asio::io_service &io;
+  subscription_callbacks &target;
+};
+
+// Shard uses forwarders of a subscription to restore it, so they live until the
+// subscription is gone from the shard, which is when its unsubscribe request is done.
+struct sharded_client::subscription_info {
+  subscription_info(shard &s, asio::io_service &io,
+                    subscription_callbacks &data_callbacks, request_callbacks *callbacks)
+      : s(s), data(io, data_callbacks), subscribed(io, callbacks, []() {}) {}
+
+  shard &s;
+  subscription_forwarder data;
+  request_forwarder subscribed;
+  std::unique_ptr<request_forwarder> unsubscribed;
+};
+
+sharded_client::sharded_client(asio::io_service &io_service,
+                               std::thread::id io_thread_id, size_t shards,
+                               sharded_client::client_factory_t &&factory,
+                               error_callbacks &callbacks, size_t threads)
+    : _io(io_service),
+      _io_thread_id(io_thread_id),
+      _error_forwarder(new error_forwarder{io_service, callbacks}) {
+  CHECK_GT(shards, 0);
+  if (threads == 0 || threads > shards) {
+    threads = shards;
+  }
+
+  for (size_t i = 0; i < threads; i++) {
+    auto t = std::make_unique<io_thread>();
+    asio::io_service &thread_io = t->io;
+    t->thread = std::thread([&thread_io, i]() {
+      threadutils::set_current_thread_name("rtm-shard-" + std::to_string(i));
+      thread_io.run();
+    });
+    _threads.push_back(std::move(t));
+  }
+
+  const auto shared_factory = std::make_shared<client_factory_t>(std::move(factory));
+  for (size_t i = 0; i < shards; i++) {
+    io_thread &t = *_threads[i % threads];
+    auto s = std::make_unique<shard>(i, t.io);
+    asio::io_service &shard_io = t.io;
+    s->connection = std::make_unique<resilient_client>(
+        shard_io, t.thread.get_id(),
+        [shared_factory, &shard_io, i](error_callbacks &shard_callbacks) {
+          return (*shared_factory)(shard_io, i, shard_callbacks);
+        },
+        *_error_forwarder);
+    _shards.push_back(std::move(s));
+  }
+}
+
+sharded_client::~sharded_client() {
+  for (auto &t : _threads) {
+    t->work.reset();
+    t->io.stop();
+    t->thread.join();
+  }
+}
+
+void sharded_client::publish(const std::string &channel, nlohmann::json &&message,
+                             request_callbacks *callbacks,
+                             const publish_options &options) {
+  CHECK_EQ(std::this_thread::get_id(), _io_thread_id)
+      << "Invocation from " << threadutils::get_current_thread_name();
+
+  shard &s = channel_shard(channel);
+  request_callbacks *shard_callbacks = forwarder(callbacks);
+  s.io.post([
+    &s, channel, message = std::move(message), shard_callbacks, options
+  ]() mutable {
+    s.connection->publish(channel, std::move(message), shard_callbacks, options);
+  });
+}
+
+bool sharded_client::supports_binary() const { return _supports_binary; }
+
+void sharded_client::subscribe(const std::string &channel, const subscription &sub,
+                               subscription_callbacks &data_callbacks,
+                               request_callbacks *callbacks,
+                               const subscription_options *options) {
+  CHECK_EQ(std::this_thread::get_id(), _io_thread_id)
+      << "Invocation from " << threadutils::get_current_thread_name();
+
+  shard &s = channel_shard(channel);
+  auto info = std::make_unique<subscription_info>(s, _io, data_callbacks, callbacks);
+  subscription_callbacks &shard_data_callbacks = info->data;
+  request_callbacks *shard_callbacks = callbacks != nullptr ? &info->subscribed : nullptr;
+  CHECK(_subscriptions.emplace(&sub, std::move(info)).second) << "duplicate subscription";
+  s.io.post([&s, channel, &sub, &shard_data_callbacks, shard_callbacks, options]() {
+    s.connection->subscribe(channel, sub, shard_data_callbacks, shard_callbacks, options);
+  });
+}
+
+void sharded_client::unsubscribe(const subscription &sub, request_callbacks *callbacks) {
+  CHECK_EQ(std::this_thread::get_id(), _io_thread_id)
+      << "Invocation from " << threadutils::get_current_thread_name();
+
+  const auto it = _subscriptions.find(&sub);
+  CHECK(it != _subscriptions.end()) << "unknown subscription";
+  subscription_info *info = it->second.get();
+  _unsubscribing.emplace(info, std::move(it->second));
+  _subscriptions.erase(it);
+
+  info->unsubscribed = std::make_unique<request_forwarder>(
+      _io, callbacks, [this, info]() { _unsubscribing.erase(info); });
+  shard &s = info->s;
+  request_callbacks *shard_callbacks = info->unsubscribed.get();
+  s.io.post(
+      [&s, &sub, shard_callbacks]() { s.connection->unsubscribe(sub, shard_callbacks); });
+}
+
+std::error_condition sharded_client::start() {
+  CHECK_EQ(std::this_thread::get_id(), _io_thread_id)
+      << "Invocation from " << threadutils::get_current_thread_name();
+
+  const auto ec = run_on_shards([](client &c) { return c.start(); });
+  if (ec) {
+    return ec;
+  }
+
+  std::promise<bool> supports_binary;
+  client &first = *_shards.front()->connection;
+  _shards.front()->io.post([&supports_binary, &first]() {
+    supports_binary.set_value(first.supports_binary());
+  });
+  _supports_binary = supports_binary.get_future().get();
+  return {};
+}
+
+std::error_condition sharded_client::stop() {
+  CHECK_EQ(std::this_thread::get_id(), _io_thread_id)
+      << "Invocation from " << threadutils::get_current_thread_name();
+
+  return run_on_shards([](client &c) { return c.stop(); });
+}
+
+sharded_client::shard &sharded_client::channel_shard(const std::string &channel) {
+  return *_shards[std::hash<std::string>{}(channel) % _shards.size()];
+}
+
+request_callbacks *sharded_client::forwarder(request_callbacks *callbacks) {
+  if (callbacks == nullptr) {
+    return nullptr;
+  }
+
+  auto &f = _request_forwarders[callbacks];
+  if (!f) {
+    f = std::make_unique<request_forwarder>(
+        _io, callbacks, [this, callbacks]() { release_forwarder(callbacks); });
+  }
+  f->pending++;
+  return f.get();
+}
+
+void sharded_client::release_forwarder(request_callbacks *callbacks) {
+  const auto it = _request_forwarders.find(callbacks);
+  CHECK(it != _request_forwarders.end());
+  if (--it->second->pending == 0) {
+    _request_forwarders.erase(it);
+  }
+}
+
+std::error_condition sharded_client::run_on_shards(
+    const std::function<std::error_condition(client &)> &fn) {
+  std::vector<std::promise<std::error_condition>> results(_shards.size());
+  for (size_t i = 0; i < _shards.size(); i++) {
+    shard &s = *_shards[i];
+    auto &result = results[i];
+    s.io.post([&s, &result, &fn]() { result.set_value(fn(*s.connection)); });
+  }
+
+  std::error_condition first_error;
+  for (size_t i = 0; i < results.size(); i++) {
+    const auto ec = results[i].get_future().get();
+    if (ec) {
+      LOG(ERROR) << "rtm shard " << i << " failed: " << ec.message();
+      if (!first_error) {
+        first_error = ec;
+      }
+    }
+  }
+  return first_error;
+}
+
 }  // namespace rtm
 }  // namespace video
 }  // namespace satori
@@ -11,6 +11,7 @@
 #include <string>
 #include <system_error>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "logging.h"
@@ -50,11 +51,25 @@ struct request_callbacks : error_callbacks {
   virtual void on_ok() = 0;
 };
 
+struct publish_options {
+  // if false, publish is sent without id and RTM doesn't confirm it. Callbacks get
+  // on_ok() once message is written to the socket and on_error() if write fails.
+  bool ack{true};
+  // false sends channel through uncompressed connection of split_compression_client,
+  // for incompressible payloads like video frames. First request of a channel
+  // decides which connection it goes through.
+  bool compress{true};
+};
+
 struct publisher {
   virtual ~publisher() = default;
 
   virtual void publish(const std::string &channel, nlohmann::json &&message,
-                       request_callbacks *callbacks = nullptr) = 0;
+                       request_callbacks *callbacks = nullptr,
+                       const publish_options &options = publish_options{}) = 0;
+
+  // true if messages may contain raw bytes, see binary_key_suffix in cbor_json.h.
+  virtual bool supports_binary() const { return false; }
 };
 
 // Subscription interface of RTM.
@@ -63,6 +78,8 @@ struct subscription {};
 struct channel_data {
   nlohmann::json payload;
   std::chrono::system_clock::time_point arrival_time;
+  // raw CBOR message, set instead of payload for subscriptions with raw_cbor option.
+  std::string cbor_payload;
 };
 
 struct subscription_callbacks : error_callbacks {
@@ -79,6 +96,11 @@ struct subscription_options {
   bool force{false};
   bool fast_forward{true};
   history_options history;
+  // if transport is CBOR, messages are delivered as raw CBOR without conversion to
+  // json, see channel_data::cbor_payload.
+  bool raw_cbor{false};
+  // see publish_options::compress.
+  bool compress{true};
 };
 
 struct subscriber {
@@ -102,11 +124,62 @@ class client : public publisher, public subscriber {
   virtual std::error_condition stop() __attribute__((warn_unused_result)) = 0;
 };
 
-std::unique_ptr<client> new_client(const std::string &endpoint, const std::string &port,
-                                   const std::string &appkey,
-                                   boost::asio::io_service &io_service,
-                                   boost::asio::ssl::context &ssl_ctx, size_t id,
-                                   error_callbacks &callbacks);
+// Writes queued while another one is in flight are sent together, up to
+// max_write_batch_bytes per socket write.
+constexpr size_t default_max_write_batch_bytes = 256 * 1024;
+
+// Keeps resolved endpoint addresses and TLS session, so clients created later for the
+// same endpoint skip DNS resolution and do abbreviated TLS handshake. Cache may be
+// shared by clients running on different threads.
+struct connection_cache;
+
+std::shared_ptr<connection_cache> new_connection_cache();
+
+// compression offers permessage-deflate websocket extension, messages in both
+// directions are compressed if server accepts it.
+std::unique_ptr<client> new_client(
+    const std::string &endpoint, const std::string &port, const std::string &appkey,
+    boost::asio::io_service &io_service, boost::asio::ssl::context &ssl_ctx, size_t id,
+    error_callbacks &callbacks,
+    size_t max_write_batch_bytes = default_max_write_batch_bytes,
+    const std::shared_ptr<connection_cache> &cache = nullptr, bool compression = false);
+
+// Sends channels through compressed connection, except the ones which opted out with
+// publish_options::compress or subscription_options::compress. Those go through
+// uncompressed connection, so no CPU is spent on deflating video frames. The first
+// publish or subscribe of a channel permanently binds the channel to its connection,
+// compress option of later requests on that channel is ignored, so data of a channel
+// is never reordered across connections. Connections are started and stopped
+// together, if one of them doesn't start, the other one is stopped.
+// It is expected that methods of this client are invoked from ASIO loop thread.
+class split_compression_client : public client {
+ public:
+  split_compression_client(std::unique_ptr<client> compressed,
+                           std::unique_ptr<client> uncompressed);
+
+  void publish(const std::string &channel, nlohmann::json &&message,
+               request_callbacks *callbacks, const publish_options &options) override;
+
+  bool supports_binary() const override;
+
+  void subscribe(const std::string &channel, const subscription &sub,
+                 subscription_callbacks &data_callbacks, request_callbacks *callbacks,
+                 const subscription_options *options) override;
+
+  void unsubscribe(const subscription &sub, request_callbacks *callbacks) override;
+
+  std::error_condition start() override;
+
+  std::error_condition stop() override;
+
+ private:
+  client &channel_client(const std::string &channel, bool compress);
+
+  std::unique_ptr<client> _compressed;
+  std::unique_ptr<client> _uncompressed;
+  std::unordered_map<std::string, client *> _channel_clients;
+  std::unordered_map<const subscription *, client *> _subscription_clients;
+};
 
 // Reconnects on any error.
 // It is expected that methods of this client are invoked from ASIO loop thread.
@@ -120,7 +193,9 @@ class resilient_client : public client, error_callbacks {
                             error_callbacks &callbacks);
 
   void publish(const std::string &channel, nlohmann::json &&message,
-               request_callbacks *callbacks) override;
+               request_callbacks *callbacks, const publish_options &options) override;
+
+  bool supports_binary() const override;
 
   void subscribe(const std::string &channel, const subscription &sub,
                  subscription_callbacks &data_callbacks, request_callbacks *callbacks,
@@ -154,7 +229,9 @@ class resilient_client : public client, error_callbacks {
   std::vector<subscription_info> _subscriptions;
 };
 
-// Forwards requests to ASIO loop thread if necessary.
+// Forwards requests to ASIO loop thread if necessary, so publish, subscribe and
+// unsubscribe may be invoked from any thread. start() and stop() are expected on
+// the loop thread.
 class thread_checking_client : public client {
  public:
   explicit thread_checking_client(boost::asio::io_service &io,
@@ -162,7 +239,9 @@ class thread_checking_client : public client {
                                   std::unique_ptr<client> client);
 
   void publish(const std::string &channel, nlohmann::json &&message,
-               request_callbacks *callbacks) override;
+               request_callbacks *callbacks, const publish_options &options) override;
+
+  bool supports_binary() const override;
 
   void subscribe(const std::string &channel, const subscription &sub,
                  subscription_callbacks &data_callbacks, request_callbacks *callbacks,
@@ -180,6 +259,73 @@ class thread_checking_client : public client {
   std::unique_ptr<client> _client;
 };
 
+// Spreads channels over several connections, which are driven by a pool of threads
+// and reconnect independently like resilient_client. Every connection stays on one
+// thread of the pool, 0 threads means a thread per connection. Channel is always
+// handled by the same connection, so order of messages within a channel is kept.
+// It is expected that methods of this client are invoked from ASIO loop thread, all
+// callbacks are invoked on that thread too.
+class sharded_client : public client {
+ public:
+  using client_factory_t = std::function<std::unique_ptr<client>(
+      boost::asio::io_service &io_service, size_t shard, error_callbacks &callbacks)>;
+
+  explicit sharded_client(boost::asio::io_service &io_service,
+                          std::thread::id io_thread_id, size_t shards,
+                          client_factory_t &&factory, error_callbacks &callbacks,
+                          size_t threads = 0);
+  ~sharded_client() override;
+
+  void publish(const std::string &channel, nlohmann::json &&message,
+               request_callbacks *callbacks, const publish_options &options) override;
+
+  bool supports_binary() const override;
+
+  void subscribe(const std::string &channel, const subscription &sub,
+                 subscription_callbacks &data_callbacks, request_callbacks *callbacks,
+                 const subscription_options *options) override;
+
+  void unsubscribe(const subscription &sub, request_callbacks *callbacks) override;
+
+  std::error_condition start() override;
+
+  std::error_condition stop() override;
+
+ private:
+  struct io_thread;
+  struct shard;
+  struct error_forwarder;
+  struct request_forwarder;
+  struct subscription_forwarder;
+  struct subscription_info;
+
+  shard &channel_shard(const std::string &channel);
+  request_callbacks *forwarder(request_callbacks *callbacks);
+  void release_forwarder(request_callbacks *callbacks);
+
+  // runs function on every shard thread and waits for results.
+  std::error_condition run_on_shards(
+      const std::function<std::error_condition(client &)> &fn);
+
+  boost::asio::io_service &_io;
+  const std::thread::id _io_thread_id;
+  bool _supports_binary{false};
+
+  std::unique_ptr<error_forwarder> _error_forwarder;
+  // publish requests with the same callbacks share a forwarder, it is erased when the
+  // last of them is done.
+  std::unordered_map<request_callbacks *, std::unique_ptr<request_forwarder>>
+      _request_forwarders;
+  std::unordered_map<const subscription *, std::unique_ptr<subscription_info>>
+      _subscriptions;
+  // shard may deliver data until unsubscribe request is done.
+  std::unordered_map<subscription_info *, std::unique_ptr<subscription_info>>
+      _unsubscribing;
+
+  std::vector<std::unique_ptr<io_thread>> _threads;
+  std::vector<std::unique_ptr<shard>> _shards;
+};
+
 }  // namespace rtm
 }  // namespace video
 }  // namespace satori
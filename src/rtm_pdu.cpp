@@ -0,0 +1,101 @@
+#include "rtm_pdu.h"
+
+namespace satori {
+namespace video {
+namespace rtm {
+
+bool read_cbor_pdu(const char *data, size_t size, cbor_pdu &pdu) {
+  cbor_reader reader{data, size};
+  uint64_t fields;
+  if (!reader.read_map(fields)) {
+    return false;
+  }
+
+  for (uint64_t i = 0; i < fields; i++) {
+    boost::string_ref key;
+    if (!reader.read_text(key)) {
+      return false;
+    }
+    if (key == "action") {
+      if (!reader.read_text(pdu.action)) {
+        return false;
+      }
+    } else if (key == "id") {
+      if (!reader.read_int(pdu.id)) {
+        return false;
+      }
+    } else {
+      if (key == "body") {
+        pdu.body = reader;
+      }
+      if (!reader.skip()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool read_cbor_subscription_data(cbor_reader body, cbor_subscription_data &data) {
+  uint64_t fields;
+  if (!body.read_map(fields)) {
+    return false;
+  }
+
+  boost::optional<cbor_reader> messages;
+  for (uint64_t i = 0; i < fields; i++) {
+    boost::string_ref key;
+    if (!body.read_text(key)) {
+      return false;
+    }
+    if (key == "subscription_id") {
+      if (!body.read_text(data.subscription_id)) {
+        return false;
+      }
+    } else {
+      if (key == "messages") {
+        messages = body;
+      }
+      if (!body.skip()) {
+        return false;
+      }
+    }
+  }
+  if (!messages) {
+    return false;
+  }
+
+  uint64_t count;
+  if (!messages->read_array(count)) {
+    return false;
+  }
+  data.messages.clear();
+  for (uint64_t i = 0; i < count; i++) {
+    const char *start = messages->position();
+    if (!messages->skip()) {
+      return false;
+    }
+    data.messages.emplace_back(start, messages->position() - start);
+  }
+  return true;
+}
+
+bool parse_subscription_id(boost::string_ref text, uint32_t &id) {
+  // 9 digits always fit.
+  if (text.empty() || text.size() > 9) {
+    return false;
+  }
+  uint32_t value = 0;
+  for (const char c : text) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    value = value * 10 + static_cast<uint32_t>(c - '0');
+  }
+  id = value;
+  return true;
+}
+
+}  // namespace rtm
+}  // namespace video
+}  // namespace satori
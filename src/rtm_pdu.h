@@ -0,0 +1,44 @@
+// Reads inbound RTM pdus in place, without building json trees.
+#pragma once
+
+#include <boost/optional.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "cbor_reader.h"
+
+namespace satori {
+namespace video {
+namespace rtm {
+
+// Top level fields of CBOR pdu, references point into pdu data.
+struct cbor_pdu {
+  boost::string_ref action;
+  // -1 if pdu has no id.
+  int64_t id{-1};
+  // positioned at body if pdu has one.
+  boost::optional<cbor_reader> body;
+};
+
+// Returns false if data is not a CBOR map of pdu fields.
+bool read_cbor_pdu(const char *data, size_t size, cbor_pdu &pdu);
+
+// Body of rtm/subscription/data pdu, references point into pdu data.
+struct cbor_subscription_data {
+  boost::string_ref subscription_id;
+  // CBOR encoded messages.
+  std::vector<boost::string_ref> messages;
+};
+
+// Whole body is checked, returns false if it is malformed or has no messages.
+bool read_cbor_subscription_data(cbor_reader body, cbor_subscription_data &data);
+
+// Client sends decimal indexes of its subscription slots as subscription ids,
+// returns false for anything else.
+bool parse_subscription_id(boost::string_ref text, uint32_t &id);
+
+}  // namespace rtm
+}  // namespace video
+}  // namespace satori
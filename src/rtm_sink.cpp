@@ -1,8 +1,7 @@
 #include "video_streams.h"
 
 #include <chrono>
-#include <iostream>
-#include <thread>
+#include <queue>
 
 #include "data.h"
 #include "metrics.h"
@@ -25,33 +24,64 @@ auto &frame_publish_delay_milliseconds =
                                      700,  800,  900,  1000, 2000, 3000, 4000, 5000, 6000,
                                      7000, 8000, 9000, 10000});
 
+auto &rtm_sink_frames_dropped_total = prometheus::BuildCounter()
+                                         .Name("rtm_sink_frames_dropped_total")
+                                         .Register(metrics_registry())
+                                         .Add({});
+
+auto &rtm_sink_in_flight_bytes = prometheus::BuildGauge()
+                                     .Name("rtm_sink_in_flight_bytes")
+                                     .Register(metrics_registry())
+                                     .Add({});
+
+auto &rtm_sink_stalls_total = prometheus::BuildCounter()
+                                  .Name("rtm_sink_stalls_total")
+                                  .Register(metrics_registry())
+                                  .Add({});
+
+// Upstream packets, publish acks and timer are expected to come from io_service
+// thread.
 class rtm_sink_impl : public streams::subscriber<encoded_packet>,
                       rtm::request_callbacks,
                       boost::static_visitor<void> {
  public:
   rtm_sink_impl(const std::shared_ptr<rtm::publisher> &client,
-                boost::asio::io_service &io_service, const std::string &rtm_channel)
+                boost::asio::io_service &io_service, const std::string &rtm_channel,
+                int request_window_size, const rtm_sink_options &options)
       : _client{client},
         _io_service{io_service},
         _frames_channel{rtm_channel},
-        _metadata_channel{rtm_channel + metadata_channel_suffix} {}
+        _metadata_channel{rtm_channel + metadata_channel_suffix},
+        _window_size{request_window_size},
+        _options{options},
+        _flush_timer{io_service} {
+    CHECK_GT(_window_size, 0);
+  }
 
   void operator()(const encoded_metadata &m) {
-    nlohmann::json packet = m.to_network().to_json();
+    network_metadata nm = m.to_network(encoding());
+    const size_t size = nm.base64_data.size() + nm.binary_data.size();
+    nlohmann::json packet = nm.to_json();
 
-    _in_flight++;
+    on_publish(size);
     _io_service.post([ this, packet = std::move(packet) ]() mutable {
       _client->publish(_metadata_channel, std::move(packet), this);
     });
   }
 
   void operator()(const encoded_frame &f) {
-    std::vector<network_frame> network_frames = f.to_network();
+    if (is_stale(f)) {
+      rtm_sink_frames_dropped_total.Increment();
+      return;
+    }
+
+    std::vector<network_frame> network_frames = f.to_network(encoding());
 
-    for (const network_frame &nf : network_frames) {
-      nlohmann::json packet = nf.to_json();
+    for (network_frame &nf : network_frames) {
+      const size_t size = nf.base64_data.size() + nf.binary_data.size();
+      nlohmann::json packet = std::move(nf).to_json();
 
-      _in_flight++;
+      on_publish(size);
       _io_service.post([
         this, packet = std::move(packet), creation_time = f.creation_time
       ]() mutable {
@@ -59,7 +89,11 @@ class rtm_sink_impl : public streams::subscriber<encoded_packet>,
             std::chrono::duration_cast<std::chrono::milliseconds>(
                 std::chrono::system_clock::now() - creation_time)
                 .count());
-        _client->publish(_frames_channel, std::move(packet), this);
+        rtm::publish_options publish_options;
+        publish_options.ack = _options.ack_frames;
+        // encoded frames don't compress.
+        publish_options.compress = false;
+        _client->publish(_frames_channel, std::move(packet), this, publish_options);
       });
     }
 
@@ -70,52 +104,141 @@ class rtm_sink_impl : public streams::subscriber<encoded_packet>,
   }
 
  private:
+  // binary payloads avoid base64 overhead if transport allows it.
+  payload_encoding encoding() const {
+    return _client->supports_binary() ? payload_encoding::BINARY
+                                      : payload_encoding::BASE64;
+  }
+
+  // once a frame is dropped, following frames depend on it, so the rest of GOP goes.
+  bool is_stale(const encoded_frame &f) {
+    if (f.key_frame) {
+      _dropping_gop = false;
+    }
+    if (_dropping_gop) {
+      return true;
+    }
+    if (!_options.max_frame_age || f.key_frame) {
+      return false;
+    }
+
+    const auto age = std::chrono::system_clock::now() - f.creation_time;
+    _dropping_gop = age > *_options.max_frame_age;
+    return _dropping_gop;
+  }
+
+  void on_publish(size_t size) {
+    _in_flight_sizes.push(size);
+    _in_flight_bytes += size;
+    rtm_sink_in_flight_bytes.Set(_in_flight_bytes);
+  }
+
+  // keeps up to window size packets requested unless too much data waits for acks.
+  void request_more() {
+    if (_completed || _src == nullptr) {
+      return;
+    }
+    if (_in_flight_bytes >= _options.max_in_flight_bytes) {
+      if (_outstanding == 0 && !_stalled) {
+        LOG(2) << "publishing stalled, in flight " << _in_flight_bytes << " bytes";
+        rtm_sink_stalls_total.Increment();
+        _stalled = true;
+      }
+      return;
+    }
+    _stalled = false;
+
+    if (_outstanding <= _window_size / 2) {
+      const int n = _window_size - _outstanding;
+      _outstanding = _window_size;
+      // might be reentered from request().
+      _src->request(n);
+    }
+  }
+
   void on_next(encoded_packet &&packet) override {
+    CHECK_GT(_outstanding, 0);
+    _outstanding--;
     boost::apply_visitor(*this, packet);
-    _src->request(1);
+    request_more();
   }
 
   void on_error(std::error_condition ec) override { ABORT() << ec.message(); }
 
   void on_complete() override {
-    const std::chrono::seconds time_to_wait{30};
-    const std::chrono::system_clock::time_point begin = std::chrono::system_clock::now();
-    while (_in_flight > 0
-           && std::chrono::duration_cast<std::chrono::seconds>(
-                  std::chrono::system_clock::now() - begin)
-                  < time_to_wait) {
-      LOG(2) << "Waiting for packets to be published: " << _in_flight;
-      std::this_thread::sleep_for(std::chrono::seconds{1});
-    }
-    if (_in_flight > 0) {
-      LOG(ERROR) << "Not all packets were published: " << _in_flight;
-    } else {
+    _completed = true;
+    if (_in_flight_sizes.empty()) {
       LOG(INFO) << "Packets were published";
+      delete this;
+      return;
     }
-    delete this;
+
+    LOG(2) << "Waiting for packets to be published: " << _in_flight_sizes.size();
+    _flush_timer.expires_from_now(
+        boost::posix_time::milliseconds(_options.flush_timeout.count()));
+    // once started, the timer handler deletes the sink unless some packets are still
+    // unacknowledged, because client keeps callbacks of those and the last ack does it.
+    _flush_timer.async_wait([this](const boost::system::error_code &ec) {
+      if (ec != boost::asio::error::operation_aborted && !_in_flight_sizes.empty()) {
+        LOG(ERROR) << "Not all packets were published: " << _in_flight_sizes.size();
+        _flush_timed_out = true;
+        return;
+      }
+      LOG(INFO) << "Packets were published";
+      delete this;
+    });
   }
 
   void on_subscribe(streams::subscription &s) override {
     _src = &s;
-    _src->request(1);
+    request_more();
   }
 
-  void on_ok() override { _in_flight--; }
+  // acks may come out of order across channels, then bytes are accounted
+  // approximately until all of them arrive.
+  void on_ok() override {
+    CHECK(!_in_flight_sizes.empty()) << "unexpected publish ack";
+    _in_flight_bytes -= _in_flight_sizes.front();
+    _in_flight_sizes.pop();
+    rtm_sink_in_flight_bytes.Set(_in_flight_bytes);
+
+    if (!_completed) {
+      request_more();
+    } else if (_in_flight_sizes.empty()) {
+      if (_flush_timed_out) {
+        _io_service.post([this]() { delete this; });
+      } else {
+        // handler runs even if the timer has already expired.
+        _flush_timer.cancel();
+      }
+    }
+  }
 
   const std::shared_ptr<rtm::publisher> _client;
   boost::asio::io_service &_io_service;
   const std::string _frames_channel;
   const std::string _metadata_channel;
-  streams::subscription *_src;
+  const int _window_size;
+  const rtm_sink_options _options;
+  boost::asio::deadline_timer _flush_timer;
+  streams::subscription *_src{nullptr};
+  int _outstanding{0};
+  bool _stalled{false};
+  bool _completed{false};
+  bool _flush_timed_out{false};
+  bool _dropping_gop{false};
   uint64_t _frames_counter{0};
-  std::atomic_uint32_t _in_flight{0};
+  std::queue<size_t> _in_flight_sizes;
+  size_t _in_flight_bytes{0};
 };
 }  // namespace
 
 streams::subscriber<encoded_packet> &rtm_sink(
     const std::shared_ptr<rtm::publisher> &client, boost::asio::io_service &io_service,
-    const std::string &rtm_channel) {
-  return *(new rtm_sink_impl(client, io_service, rtm_channel));
+    const std::string &rtm_channel, int request_window_size,
+    const rtm_sink_options &options) {
+  return *(
+      new rtm_sink_impl(client, io_service, rtm_channel, request_window_size, options));
 }
 
 }  // namespace video
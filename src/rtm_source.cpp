@@ -1,26 +1,58 @@
+#include "metrics.h"
 #include "rtm_streams.h"
 #include "video_streams.h"
 
 namespace satori {
 namespace video {
 
+namespace {
+
+auto &rtm_source_history_chunks_skipped_total =
+    prometheus::BuildCounter()
+        .Name("rtm_source_history_chunks_skipped_total")
+        .Register(metrics_registry())
+        .Add({});
+
+}  // namespace
+
 streams::publisher<network_packet> rtm_source(
-    const std::shared_ptr<rtm::subscriber> &client, const std::string &channel_name) {
+    const std::shared_ptr<rtm::subscriber> &client, const std::string &channel_name,
+    const rtm_source_options &options) {
   rtm::subscription_options metadata_options;
   metadata_options.history.count = 1;
+  metadata_options.raw_cbor = true;
 
   streams::publisher<network_packet> metadata =
       rtm::channel(client, channel_name + metadata_channel_suffix, metadata_options)
       >> streams::map([](rtm::channel_data &&data) {
-          return network_packet{parse_network_metadata(data.payload)};
+          return network_packet{data.cbor_payload.empty()
+                                    ? parse_network_metadata(data.payload)
+                                    : parse_cbor_network_metadata(data.cbor_payload)};
         });
 
+  rtm::subscription_options frames_options;
+  frames_options.raw_cbor = true;
+  // encoded frames don't compress.
+  frames_options.compress = false;
+  if (options.key_frame_history) {
+    frames_options.history.age = options.key_frame_history->count();
+  }
+
+  // history may start in the middle of GOP, such frames can't be decoded.
+  bool key_frame_seen = !options.key_frame_history;
   streams::publisher<network_packet> frames =
-      rtm::channel(client, channel_name, {})
-      >> streams::map([](rtm::channel_data &&data) {
-          network_frame f = parse_network_frame(data.payload);
+      rtm::channel(client, channel_name, frames_options)
+      >> streams::filter_map([key_frame_seen](rtm::channel_data &&data) mutable {
+          network_frame f = data.cbor_payload.empty()
+                                ? parse_network_frame(data.payload)
+                                : parse_cbor_network_frame(data.cbor_payload);
+          key_frame_seen = key_frame_seen || f.key_frame;
+          if (!key_frame_seen) {
+            rtm_source_history_chunks_skipped_total.Increment();
+            return boost::optional<network_packet>{};
+          }
           f.arrival_time = data.arrival_time;
-          return network_packet{f};
+          return boost::optional<network_packet>{network_packet{std::move(f)}};
         });
 
   return streams::publishers::merge(std::move(metadata), std::move(frames));
@@ -0,0 +1,231 @@
+#include "shared_image_decoder.h"
+
+#include <algorithm>
+
+#include "logging.h"
+#include "metrics.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+auto &shared_decoder_consumers = prometheus::BuildGauge()
+                                     .Name("shared_decoder_consumers")
+                                     .Register(metrics_registry())
+                                     .Add({});
+
+auto &shared_decoder_outputs = prometheus::BuildGauge()
+                                   .Name("shared_decoder_outputs")
+                                   .Register(metrics_registry())
+                                   .Add({});
+
+}  // namespace
+
+struct shared_image_decoder::output {
+  output(const image_size &bounding_size, image_pixel_format pixel_format,
+         bool keep_aspect_ratio)
+      : scaler{bounding_size, pixel_format, keep_aspect_ratio} {}
+
+  frame_scaler scaler;
+  // entries of consumers that left during delivery are null.
+  std::vector<consumer *> consumers;
+};
+
+struct shared_image_decoder::consumer {
+  std::shared_ptr<shared_image_decoder> decoder;
+  output_key key;
+  streams::observer<owned_image_packet> *observer;
+};
+
+std::shared_ptr<shared_image_decoder> shared_image_decoder::create(
+    boost::asio::io_service &io, source_factory &&source,
+    const decoder_options &options) {
+  return std::shared_ptr<shared_image_decoder>(
+      new shared_image_decoder(io, std::move(source), options));
+}
+
+shared_image_decoder::shared_image_decoder(boost::asio::io_service &io,
+                                           source_factory &&source,
+                                           const decoder_options &options)
+    : _io{io}, _source_factory{std::move(source)}, _options{options} {}
+
+shared_image_decoder::~shared_image_decoder() {
+  CHECK(_outputs.empty());
+  if (_source != nullptr) {
+    _source->cancel();
+  }
+}
+
+streams::publisher<owned_image_packet> shared_image_decoder::subscribe(
+    const image_size &bounding_size, image_pixel_format pixel_format,
+    bool keep_aspect_ratio) {
+  const output_key key{bounding_size.width, bounding_size.height, pixel_format,
+                       keep_aspect_ratio};
+  auto self = shared_from_this();
+
+  return streams::generators<owned_image_packet>::async<consumer>(
+             [self, key](streams::observer<owned_image_packet> &observer) {
+               return self->add_consumer(key, observer);
+             },
+             [](consumer *c) {
+               if (c == nullptr) {
+                 return;
+               }
+               auto decoder = std::move(c->decoder);
+               decoder->remove_consumer(c);
+             })
+         >> streams::flatten();
+}
+
+shared_image_decoder::consumer *shared_image_decoder::add_consumer(
+    const output_key &key, streams::observer<owned_image_packet> &observer) {
+  auto it = _outputs.find(key);
+  if (it == _outputs.end()) {
+    const image_size bounding_size{std::get<0>(key), std::get<1>(key)};
+    LOG(INFO) << this << " new output " << bounding_size;
+    it = _outputs
+             .emplace(key, std::make_unique<output>(bounding_size, std::get<2>(key),
+                                                    std::get<3>(key)))
+             .first;
+    shared_decoder_outputs.Increment();
+  }
+
+  auto c = new consumer{shared_from_this(), key, &observer};
+  it->second->consumers.push_back(c);
+  shared_decoder_consumers.Increment();
+
+  if (_source == nullptr && !_source_starting) {
+    // lets other consumers subscribe before the first frame.
+    _source_starting = true;
+    _io.post([self = shared_from_this()]() { self->start_source(); });
+  }
+  return c;
+}
+
+void shared_image_decoder::remove_consumer(consumer *c) {
+  if (c->observer == nullptr) {
+    // source is over, consumer was already removed.
+    delete c;
+    return;
+  }
+
+  auto &consumers = _outputs.at(c->key)->consumers;
+  auto it = std::find(consumers.begin(), consumers.end(), c);
+  CHECK(it != consumers.end());
+  *it = nullptr;
+  delete c;
+  shared_decoder_consumers.Decrement();
+
+  if (!_delivering) {
+    remove_stale_outputs();
+  }
+}
+
+void shared_image_decoder::remove_stale_outputs() {
+  for (auto it = _outputs.begin(); it != _outputs.end();) {
+    auto &consumers = it->second->consumers;
+    consumers.erase(std::remove(consumers.begin(), consumers.end(), nullptr),
+                    consumers.end());
+    if (consumers.empty()) {
+      it = _outputs.erase(it);
+      shared_decoder_outputs.Decrement();
+    } else {
+      ++it;
+    }
+  }
+
+  if (_outputs.empty() && _source != nullptr) {
+    LOG(INFO) << this << " no consumers left, cancelling source";
+    auto source = _source;
+    _source = nullptr;
+    source->cancel();
+  }
+}
+
+void shared_image_decoder::start_source() {
+  _source_starting = false;
+  if (_outputs.empty() || _source != nullptr) {
+    return;
+  }
+
+  LOG(INFO) << this << " starting source for " << _outputs.size() << " outputs";
+  auto source = _source_factory() >> decode_frames(_options);
+  source->subscribe(*this);
+}
+
+void shared_image_decoder::on_subscribe(streams::subscription &s) {
+  _source = &s;
+  _source->request(1);
+}
+
+void shared_image_decoder::on_next(decoded_frame &&frame) {
+  // the last consumer may leave during delivery.
+  auto self = shared_from_this();
+  _delivering = true;
+  for (auto &o : _outputs) {
+    auto &consumers = o.second->consumers;
+    if (std::all_of(consumers.begin(), consumers.end(),
+                    [](consumer *c) { return c == nullptr; })) {
+      continue;
+    }
+
+    boost::optional<owned_image_frame> image = o.second->scaler.convert(frame);
+    if (!image) {
+      LOG(ERROR) << this << " failed to convert decoded frame";
+      continue;
+    }
+    // planes are shared, so copies don't copy pixels.
+    for (size_t i = 0; i < consumers.size(); i++) {
+      if (consumers[i] != nullptr) {
+        consumers[i]->observer->on_next(owned_image_packet{*image});
+      }
+    }
+  }
+  _delivering = false;
+
+  remove_stale_outputs();
+  if (_source != nullptr) {
+    _source->request(1);
+  }
+}
+
+void shared_image_decoder::on_error(std::error_condition ec) {
+  LOG(ERROR) << this << " source failed: " << ec.message();
+  finish_consumers(
+      [ec](streams::observer<owned_image_packet> &observer) { observer.on_error(ec); });
+}
+
+void shared_image_decoder::on_complete() {
+  LOG(INFO) << this << " source is complete";
+  finish_consumers(
+      [](streams::observer<owned_image_packet> &observer) { observer.on_complete(); });
+}
+
+void shared_image_decoder::finish_consumers(
+    const std::function<void(streams::observer<owned_image_packet> &)> &fn) {
+  auto self = shared_from_this();
+  _source = nullptr;
+
+  std::vector<consumer *> finished;
+  for (auto &o : _outputs) {
+    for (consumer *c : o.second->consumers) {
+      if (c != nullptr) {
+        finished.push_back(c);
+      }
+    }
+  }
+  shared_decoder_outputs.Decrement(_outputs.size());
+  shared_decoder_consumers.Decrement(finished.size());
+  _outputs.clear();
+
+  for (consumer *c : finished) {
+    // consumer may be deleted by the observer, later consumers start a new source.
+    streams::observer<owned_image_packet> *observer = c->observer;
+    c->observer = nullptr;
+    fn(*observer);
+  }
+}
+
+}  // namespace video
+}  // namespace satori
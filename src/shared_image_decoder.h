@@ -0,0 +1,72 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <functional>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+#include "data.h"
+#include "decoded_frame.h"
+#include "frame_scaler.h"
+#include "streams/streams.h"
+#include "video_streams.h"
+
+namespace satori {
+namespace video {
+
+// Decodes a stream once for several consumers, each one gets frames scaled to its own
+// size and pixel format. Consumers asking for the same size and format share
+// conversion as well. Source is created when the first consumer subscribes and
+// cancelled when the last one leaves. Consumers are not backpressured, each one
+// queues frames like rtm_source does, so it is meant for live streams.
+class shared_image_decoder : public streams::subscriber<decoded_frame>,
+                             public std::enable_shared_from_this<shared_image_decoder> {
+ public:
+  using source_factory = std::function<streams::publisher<encoded_packet>()>;
+
+  static std::shared_ptr<shared_image_decoder> create(
+      boost::asio::io_service &io, source_factory &&source,
+      const decoder_options &options = decoder_options{});
+
+  ~shared_image_decoder() override;
+
+  // consumers joining a running stream start with the next decoded frame.
+  streams::publisher<owned_image_packet> subscribe(const image_size &bounding_size,
+                                                   image_pixel_format pixel_format,
+                                                   bool keep_aspect_ratio);
+
+ private:
+  using output_key = std::tuple<int16_t, int16_t, image_pixel_format, bool>;
+  struct output;
+  struct consumer;
+
+  shared_image_decoder(boost::asio::io_service &io, source_factory &&source,
+                       const decoder_options &options);
+
+  consumer *add_consumer(const output_key &key,
+                         streams::observer<owned_image_packet> &observer);
+  void remove_consumer(consumer *c);
+  void start_source();
+  void remove_stale_outputs();
+  void finish_consumers(
+      const std::function<void(streams::observer<owned_image_packet> &)> &fn);
+
+  void on_subscribe(streams::subscription &s) override;
+  void on_next(decoded_frame &&frame) override;
+  void on_error(std::error_condition ec) override;
+  void on_complete() override;
+
+  boost::asio::io_service &_io;
+  const source_factory _source_factory;
+  const decoder_options _options;
+  std::map<output_key, std::unique_ptr<output>> _outputs;
+  streams::subscription *_source{nullptr};
+  bool _source_starting{false};
+  // consumers leaving while frame is delivered are removed afterwards.
+  bool _delivering{false};
+};
+
+}  // namespace video
+}  // namespace satori
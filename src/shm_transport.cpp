@@ -0,0 +1,553 @@
+#include "shm_transport.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "cbor_json.h"
+#include "logging.h"
+#include "metrics.h"
+#include "threadutils.h"
+
+namespace satori {
+namespace video {
+namespace rtm {
+
+namespace {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "ring positions are shared by processes");
+
+constexpr uint32_t ring_magic = 0x53565232;  // "SVR2"
+// how long opener waits for creator to initialize the ring.
+constexpr std::chrono::seconds ring_init_timeout{1};
+// subscriber thread sleeps that long when there are no new messages.
+constexpr std::chrono::microseconds poll_interval{500};
+// messages read from a ring in one go before other rings are looked at.
+constexpr int max_messages_per_poll = 64;
+// messages posted to ASIO loop but not delivered yet. Once there are that many,
+// rings are not read, so a slow loop makes subscribers skip like slow readers do.
+constexpr size_t max_pending_deliveries = 256;
+
+auto &shm_messages_total = prometheus::BuildCounter()
+                               .Name("rtm_shm_messages_total")
+                               .Register(metrics_registry());
+auto &shm_published_total = shm_messages_total.Add({{"direction", "published"}});
+auto &shm_received_total = shm_messages_total.Add({{"direction", "received"}});
+
+auto &shm_overruns_total = prometheus::BuildCounter()
+                               .Name("rtm_shm_subscriber_overruns_total")
+                               .Register(metrics_registry())
+                               .Add({});
+
+// Positions are offsets in an endless byte stream, data of position p lives at
+// p % capacity. Writers serialize on robust process-shared mutex. Readers don't
+// lock: they copy a message and then check that writers haven't reserved its bytes
+// in the meantime, like seqlock readers do.
+struct ring_header {
+  std::atomic<uint32_t> magic;
+  uint64_t capacity;
+  pthread_mutex_t write_mutex;
+  // guarded by write_mutex. Ring is unlinked when the last user releases it, removed
+  // rings are not attached to anymore.
+  uint32_t users;
+  bool removed;
+  // end of message being written.
+  std::atomic<uint64_t> reserved;
+  // end of the last written message.
+  std::atomic<uint64_t> committed;
+};
+
+class ring {
+ public:
+  enum class read_result { EMPTY, MESSAGE, OVERRUN };
+
+  // creates ring if it doesn't exist, nullptr on failure. Each ring is a user of
+  // shared memory object until it is destroyed.
+  static std::shared_ptr<ring> open(const std::string &name, size_t capacity) {
+    const auto deadline = std::chrono::steady_clock::now() + ring_init_timeout;
+    while (true) {
+      bool removed = false;
+      std::shared_ptr<ring> r = try_open(name, capacity, deadline, removed);
+      if (!removed || std::chrono::steady_clock::now() >= deadline) {
+        return r;
+      }
+      // last user has just unlinked it, so the next attempt creates a new one.
+      LOG(INFO) << "shared memory " << name << " was removed, reopening";
+    }
+  }
+
+  ~ring() {
+    if (_attached) {
+      lock();
+      if (--_header->users == 0) {
+        _header->removed = true;
+        shm_unlink(_name.c_str());
+        LOG(INFO) << "removed shared memory ring " << _name;
+      }
+      pthread_mutex_unlock(&_header->write_mutex);
+    }
+    munmap(_header, _mapped_size);
+    close(_fd);
+  }
+
+  ring(const ring &) = delete;
+  ring &operator=(const ring &) = delete;
+
+  // false if message doesn't fit.
+  bool write(const std::string &message) {
+    const uint64_t capacity = _header->capacity;
+    const uint64_t size = sizeof(uint32_t) + message.size();
+    if (size > capacity / 2) {
+      return false;
+    }
+
+    lock();
+    const uint64_t position = _header->committed.load(std::memory_order_relaxed);
+    _header->reserved.store(position + size, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    const auto message_size = static_cast<uint32_t>(message.size());
+    copy_in(position, reinterpret_cast<const char *>(&message_size),
+            sizeof(message_size));
+    copy_in(position + sizeof(message_size), message.data(), message.size());
+    _header->committed.store(position + size, std::memory_order_release);
+
+    pthread_mutex_unlock(&_header->write_mutex);
+    return true;
+  }
+
+  uint64_t committed() const {
+    return _header->committed.load(std::memory_order_acquire);
+  }
+
+  // reads message at position and moves position past it. If writers have overtaken
+  // the position, it is moved to the end of the last message.
+  read_result read(uint64_t &position, std::string &message) const {
+    const uint64_t capacity = _header->capacity;
+    const uint64_t committed = _header->committed.load(std::memory_order_acquire);
+    if (position == committed) {
+      return read_result::EMPTY;
+    }
+
+    uint32_t size = 0;
+    if (committed - position <= capacity) {
+      copy_out(position, reinterpret_cast<char *>(&size), sizeof(size));
+    }
+    const uint64_t end = position + sizeof(size) + size;
+    if (committed - position > capacity || end > committed) {
+      position = committed;
+      return read_result::OVERRUN;
+    }
+    message.resize(size);
+    copy_out(position + sizeof(size), &message[0], size);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (_header->reserved.load(std::memory_order_relaxed) - position > capacity) {
+      position = _header->committed.load(std::memory_order_acquire);
+      return read_result::OVERRUN;
+    }
+    position = end;
+    return read_result::MESSAGE;
+  }
+
+ private:
+  ring(const std::string &name, int fd, void *memory, size_t mapped_size)
+      : _name(name),
+        _fd(fd),
+        _header(static_cast<ring_header *>(memory)),
+        _data(static_cast<char *>(memory) + sizeof(ring_header)),
+        _mapped_size(mapped_size) {}
+
+  // removed is set if the object was unlinked by its last user after it was opened.
+  static std::shared_ptr<ring> try_open(const std::string &name, size_t capacity,
+                                        std::chrono::steady_clock::time_point deadline,
+                                        bool &removed) {
+    bool created = true;
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+      created = false;
+      fd = shm_open(name.c_str(), O_RDWR, 0600);
+    }
+    if (fd < 0) {
+      LOG(ERROR) << "failed to open shared memory " << name << ": " << strerror(errno);
+      return nullptr;
+    }
+
+    if (created && ftruncate(fd, sizeof(ring_header) + capacity) != 0) {
+      LOG(ERROR) << "failed to size shared memory " << name << ": " << strerror(errno);
+      close(fd);
+      return nullptr;
+    }
+
+    // creator may not have sized the object yet.
+    struct stat st {};
+    while (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) <= sizeof(ring_header)
+           && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+    if (static_cast<size_t>(st.st_size) <= sizeof(ring_header)) {
+      LOG(ERROR) << "shared memory " << name << " is not initialized";
+      close(fd);
+      return nullptr;
+    }
+
+    void *memory = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+      LOG(ERROR) << "failed to map shared memory " << name << ": " << strerror(errno);
+      close(fd);
+      return nullptr;
+    }
+
+    std::shared_ptr<ring> r{new ring(name, fd, memory, st.st_size)};
+    if (created) {
+      r->init(capacity);
+    } else if (!r->wait_for_init(deadline)) {
+      LOG(ERROR) << "shared memory " << name << " is not initialized";
+      return nullptr;
+    }
+    if (r->_header->capacity < min_shm_ring_bytes) {
+      LOG(ERROR) << "shared memory ring " << name << " of " << r->_header->capacity
+                 << " bytes can't take network frames";
+      return nullptr;
+    }
+    if (!r->attach()) {
+      removed = true;
+      return nullptr;
+    }
+    LOG(INFO) << (created ? "created" : "opened") << " shared memory ring " << name
+              << " of " << r->_header->capacity << " bytes";
+    return r;
+  }
+
+  bool attach() {
+    lock();
+    _attached = !_header->removed;
+    if (_attached) {
+      _header->users++;
+    }
+    pthread_mutex_unlock(&_header->write_mutex);
+    return _attached;
+  }
+
+  void lock() {
+    int err = pthread_mutex_lock(&_header->write_mutex);
+#if defined(__linux__)
+    if (err == EOWNERDEAD) {
+      // previous writer died, its message was not committed and is overwritten.
+      LOG(WARNING) << "recovering shared memory ring after dead writer";
+      pthread_mutex_consistent(&_header->write_mutex);
+      err = 0;
+    }
+#endif
+    CHECK(!err) << "failed to lock shared memory ring: " << strerror(err);
+  }
+
+  void init(size_t capacity) {
+    new (_header) ring_header{};
+    _header->capacity = capacity;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#if defined(__linux__)
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+    pthread_mutex_init(&_header->write_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    _header->magic.store(ring_magic, std::memory_order_release);
+  }
+
+  bool wait_for_init(std::chrono::steady_clock::time_point deadline) const {
+    while (_header->magic.load(std::memory_order_acquire) != ring_magic) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+    return sizeof(ring_header) + _header->capacity == _mapped_size;
+  }
+
+  void copy_in(uint64_t position, const char *data, size_t size) {
+    const uint64_t capacity = _header->capacity;
+    const size_t offset = position % capacity;
+    const size_t first = std::min<size_t>(size, capacity - offset);
+    memcpy(_data + offset, data, first);
+    memcpy(_data, data + first, size - first);
+  }
+
+  void copy_out(uint64_t position, char *data, size_t size) const {
+    const uint64_t capacity = _header->capacity;
+    const size_t offset = position % capacity;
+    const size_t first = std::min<size_t>(size, capacity - offset);
+    memcpy(data, _data + offset, first);
+    memcpy(data + first, _data, size - first);
+  }
+
+  const std::string _name;
+  const int _fd;
+  ring_header *const _header;
+  char *const _data;
+  const size_t _mapped_size;
+  bool _attached{false};
+};
+
+class shm_client : public client {
+ public:
+  shm_client(boost::asio::io_service &io, std::thread::id io_thread_id,
+             const std::string &prefix, size_t ring_bytes)
+      : _io(io),
+        _io_thread_id(io_thread_id),
+        _prefix(prefix),
+        _ring_bytes(ring_bytes),
+        _state(std::make_shared<state>()) {}
+
+  ~shm_client() override { stop_polling(); }
+
+  void publish(const std::string &channel, nlohmann::json &&message,
+               request_callbacks *callbacks,
+               const publish_options & /*options*/) override {
+    CHECK_EQ(std::this_thread::get_id(), _io_thread_id)
+        << "Invocation from " << threadutils::get_current_thread_name();
+
+    const std::shared_ptr<ring> r = channel_ring(channel);
+    _buffer.clear();
+    json_to_cbor(message, _buffer);
+    if (!r || !r->write(_buffer)) {
+      LOG(ERROR) << "failed to publish " << _buffer.size() << " bytes to " << channel;
+      reply(callbacks, client_error::PUBLISH_ERROR);
+      return;
+    }
+    shm_published_total.Increment();
+    reply(callbacks, {});
+  }
+
+  bool supports_binary() const override { return true; }
+
+  void subscribe(const std::string &channel, const subscription &sub,
+                 subscription_callbacks &data_callbacks, request_callbacks *callbacks,
+                 const subscription_options *options) override {
+    CHECK_EQ(std::this_thread::get_id(), _io_thread_id)
+        << "Invocation from " << threadutils::get_current_thread_name();
+
+    const std::shared_ptr<ring> r = channel_ring(channel);
+    if (!r) {
+      reply(callbacks, client_error::SUBSCRIBE_ERROR);
+      return;
+    }
+    if (options != nullptr && (options->history.count || options->history.age)) {
+      LOG(WARNING) << "history of " << channel << " is not available in shared memory";
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_state->mutex);
+      _state->subscriptions.push_back(
+          {++_state->last_id, channel, &sub, &data_callbacks, r, r->committed(),
+           options != nullptr && options->raw_cbor});
+    }
+    reply(callbacks, {});
+  }
+
+  void unsubscribe(const subscription &sub, request_callbacks *callbacks) override {
+    CHECK_EQ(std::this_thread::get_id(), _io_thread_id)
+        << "Invocation from " << threadutils::get_current_thread_name();
+
+    bool found = false;
+    {
+      std::lock_guard<std::mutex> lock(_state->mutex);
+      auto &subs = _state->subscriptions;
+      const auto it = std::find_if(subs.begin(), subs.end(),
+                                   [&sub](const entry &e) { return e.sub == &sub; });
+      if (it != subs.end()) {
+        subs.erase(it);
+        found = true;
+      }
+    }
+    reply(callbacks, found ? std::error_condition{} : client_error::UNSUBSCRIBE_ERROR);
+  }
+
+  std::error_condition start() override {
+    CHECK_EQ(std::this_thread::get_id(), _io_thread_id)
+        << "Invocation from " << threadutils::get_current_thread_name();
+    CHECK(!_poll_thread.joinable()) << "client is already started";
+
+    _stopping = false;
+    _poll_thread = std::thread([this]() { poll_loop(); });
+    return {};
+  }
+
+  std::error_condition stop() override {
+    CHECK_EQ(std::this_thread::get_id(), _io_thread_id)
+        << "Invocation from " << threadutils::get_current_thread_name();
+
+    stop_polling();
+    {
+      std::lock_guard<std::mutex> lock(_state->mutex);
+      _state->subscriptions.clear();
+    }
+    // the last client of a ring removes its shared memory object.
+    _rings.clear();
+    return {};
+  }
+
+ private:
+  struct entry {
+    uint64_t id;
+    std::string channel;
+    const subscription *sub;
+    subscription_callbacks *data_callbacks;
+    std::shared_ptr<ring> messages;
+    uint64_t position;
+    bool raw_cbor;
+  };
+
+  // shared with posted deliveries, which may run after the client is gone.
+  struct state {
+    std::mutex mutex;
+    std::vector<entry> subscriptions;
+    uint64_t last_id{0};
+    size_t pending_deliveries{0};
+
+    // returns false if subscription is gone.
+    bool on_delivery(uint64_t id) {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending_deliveries--;
+      return std::any_of(subscriptions.begin(), subscriptions.end(),
+                         [id](const entry &e) { return e.id == id; });
+    }
+  };
+
+  std::shared_ptr<ring> channel_ring(const std::string &channel) {
+    auto &r = _rings[channel];
+    if (!r) {
+      r = ring::open(shm_object_name(_prefix, channel), _ring_bytes);
+    }
+    return r;
+  }
+
+  void reply(request_callbacks *callbacks, std::error_condition ec) {
+    if (callbacks == nullptr) {
+      return;
+    }
+    _io.post([callbacks, ec]() {
+      if (ec) {
+        callbacks->on_error(ec);
+      } else {
+        callbacks->on_ok();
+      }
+    });
+  }
+
+  void stop_polling() {
+    _stopping = true;
+    if (_poll_thread.joinable()) {
+      _poll_thread.join();
+    }
+  }
+
+  void poll_loop() {
+    threadutils::set_current_thread_name("shm_poll");
+    std::string message;
+    while (!_stopping) {
+      bool received = false;
+      {
+        std::lock_guard<std::mutex> lock(_state->mutex);
+        for (entry &e : _state->subscriptions) {
+          received |= poll(e, message);
+        }
+      }
+      if (!received) {
+        std::this_thread::sleep_for(poll_interval);
+      }
+    }
+  }
+
+  // has to be called with state mutex locked.
+  bool poll(entry &e, std::string &message) {
+    bool received = false;
+    for (int i = 0; i < max_messages_per_poll; i++) {
+      if (_state->pending_deliveries >= max_pending_deliveries) {
+        break;
+      }
+      const auto result = e.messages->read(e.position, message);
+      if (result == ring::read_result::EMPTY) {
+        break;
+      }
+      if (result == ring::read_result::OVERRUN) {
+        LOG(WARNING) << "subscriber of " << e.channel << " fell behind, skipping";
+        shm_overruns_total.Increment();
+        continue;
+      }
+
+      channel_data data;
+      data.arrival_time = std::chrono::system_clock::now();
+      if (e.raw_cbor) {
+        data.cbor_payload = message;
+      } else {
+        auto payload = cbor_to_json(message);
+        if (!payload.ok()) {
+          LOG(ERROR) << "bad message in " << e.channel << ": "
+                     << payload.error_message();
+          continue;
+        }
+        data.payload = payload.move();
+      }
+      shm_received_total.Increment();
+      received = true;
+      _state->pending_deliveries++;
+
+      std::weak_ptr<state> weak_state = _state;
+      const uint64_t id = e.id;
+      const subscription *sub = e.sub;
+      subscription_callbacks *callbacks = e.data_callbacks;
+      _io.post([weak_state, id, sub, callbacks, data = std::move(data)]() mutable {
+        auto s = weak_state.lock();
+        // unsubscribed since.
+        if (!s || !s->on_delivery(id)) {
+          return;
+        }
+        callbacks->on_data(*sub, std::move(data));
+      });
+    }
+    return received;
+  }
+
+  boost::asio::io_service &_io;
+  const std::thread::id _io_thread_id;
+  const std::string _prefix;
+  const size_t _ring_bytes;
+  const std::shared_ptr<state> _state;
+  std::unordered_map<std::string, std::shared_ptr<ring>> _rings;
+  std::string _buffer;
+  std::atomic<bool> _stopping{false};
+  std::thread _poll_thread;
+};
+
+}  // namespace
+
+std::string shm_object_name(const std::string &prefix, const std::string &channel) {
+  std::string name = "/" + prefix + "." + channel;
+  std::replace(name.begin() + 1, name.end(), '/', '_');
+  return name;
+}
+
+std::unique_ptr<client> new_shm_client(boost::asio::io_service &io_service,
+                                       std::thread::id io_thread_id,
+                                       const std::string &prefix, size_t ring_bytes) {
+  CHECK_GE(ring_bytes, min_shm_ring_bytes) << "shared memory rings are too small";
+  return std::make_unique<shm_client>(io_service, io_thread_id, prefix, ring_bytes);
+}
+
+}  // namespace rtm
+}  // namespace video
+}  // namespace satori
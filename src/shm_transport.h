@@ -0,0 +1,49 @@
+// RTM client over shared memory, for producers and consumers on the same host.
+#pragma once
+
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "data.h"
+#include "rtm_client.h"
+
+namespace satori {
+namespace video {
+namespace rtm {
+
+constexpr size_t default_shm_ring_bytes = 64 * 1024 * 1024;
+// Rings take messages of up to half of their size. Network frames are chunked at
+// max_payload_size, so rings have to fit two chunks with the rest of their fields.
+constexpr size_t min_shm_ring_bytes = 2 * (max_payload_size + 4096);
+
+// Every channel is a ring of CBOR messages in POSIX shared memory object
+// /<prefix>.<channel>, which is created by the first process publishing to or
+// subscribing to it. Messages are written without base64, as raw bytes, see
+// supports_binary(). Publishers never wait for subscribers: each subscriber reads
+// with its own position and skips to the newest message if it falls more than a ring
+// behind, like RTM fast-forward. Subscriptions get messages published after they
+// are made, history options are not supported.
+// Rings are polled by a thread of the client, data and request callbacks are
+// invoked on ASIO loop thread. Methods are expected to be called from that thread.
+// Rings aren't read while too many messages wait for the loop, then subscribers
+// skip like slow readers do.
+// Clients using a ring are counted in shared memory, the last one to stop or be
+// destroyed unlinks the object. Processes killed before that leave their count
+// behind, then the object stays in /dev/shm and is reused by restarted processes
+// until it is removed by hand.
+// ring_bytes should be at least min_shm_ring_bytes, rings made by other processes
+// with less are not used.
+std::unique_ptr<client> new_shm_client(boost::asio::io_service &io_service,
+                                       std::thread::id io_thread_id,
+                                       const std::string &prefix,
+                                       size_t ring_bytes = default_shm_ring_bytes);
+
+// Name of shared memory object of channel, '/' of channel names is replaced.
+std::string shm_object_name(const std::string &prefix, const std::string &channel);
+
+}  // namespace rtm
+}  // namespace video
+}  // namespace satori
@@ -14,6 +14,20 @@ double std_dev::value() const noexcept {
   return std::sqrt((accum::variance(_accumulator) * n) / n - 1);
 }
 
+void integer_jitter::emplace(int64_t value) noexcept {
+  const int64_t scaled = value * 16;
+  if (_empty) {
+    _empty = false;
+    _mean = scaled;
+    return;
+  }
+  const int64_t deviation = scaled >= _mean ? scaled - _mean : _mean - scaled;
+  _mean += (scaled - _mean) / 16;
+  _deviation += (deviation - _deviation) / 16;
+}
+
+double integer_jitter::value() const noexcept { return _deviation / 16.0; }
+
 }  // namespace statsutils
 }  // namespace video
 }  // namespace satori
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <boost/accumulators/statistics.hpp>
 #include <boost/accumulators/statistics/rolling_window.hpp>
 #include <cstddef>
+#include <cstdint>
 
 namespace satori {
 namespace video {
@@ -24,6 +25,22 @@ struct std_dev {
   accum::accumulator_set<double, accum::stats<accum::tag::variance>> _accumulator;
 };
 
+// Streaming jitter estimate by integer math: mean absolute deviation of values from
+// their mean, both averaged exponentially with gain 1/16 like RTP interarrival jitter.
+// Scale of the estimate is about 0.8 of standard deviation for normal values.
+struct integer_jitter {
+ public:
+  void emplace(int64_t value) noexcept;
+
+  double value() const noexcept;
+
+ private:
+  // fixed point, in 1/16 units.
+  int64_t _mean{0};
+  int64_t _deviation{0};
+  bool _empty{true};
+};
+
 }  // namespace statsutils
 }  // namespace video
 }  // namespace satori
\ No newline at end of file
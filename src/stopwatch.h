@@ -15,6 +15,11 @@ class stopwatch {
     return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
   }
 
+  uint64_t micros() {
+    auto d = Clock::now() - _start;
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+  }
+
  private:
   typename Clock::time_point _start;
 };
@@ -30,6 +30,27 @@ streams::op<T, T> timer_breaker(boost::asio::io_service &io,
 template <typename T>
 inline auto timeout(boost::asio::io_service &io, std::chrono::milliseconds time);
 
+// Groups items into std::queue batches. A batch is sent when it has max_count
+// items or max_wait has passed since its first item, whichever comes first.
+inline auto buffer(boost::asio::io_service &io, size_t max_count,
+                   std::chrono::milliseconds max_wait);
+
+// Rate limiting operators, for analysis or frame streams which are produced faster than
+// consumers need. Items are requested from upstream as fast as it produces them and
+// the ones which aren't sent are dropped. A single timer is used, which isn't restarted
+// by every item. All calls are expected to happen on io thread.
+
+// Sends an item, then drops items for period.
+inline auto throttle(boost::asio::io_service &io, std::chrono::milliseconds period);
+
+// Sends the latest item once period has passed since the first item of the period.
+// The latest item is also sent when upstream is done.
+inline auto sample(boost::asio::io_service &io, std::chrono::milliseconds period);
+
+// Sends an item once no newer item has arrived for quiet time. The latest item is also
+// sent when upstream is done.
+inline auto debounce(boost::asio::io_service &io, std::chrono::milliseconds quiet);
+
 }  // namespace asio
 }  // namespace streams
 }  // namespace video
@@ -1,6 +1,10 @@
 #pragma include once
 
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/optional.hpp>
+#include <chrono>
+#include <climits>
+#include <queue>
 #include "../logging.h"
 #include "stream_error.h"
 
@@ -341,6 +345,423 @@ class timeout_op {
   const std::chrono::milliseconds _time;
 };
 
+class buffer_op {
+ public:
+  buffer_op(boost::asio::io_service &io, size_t max_count,
+            std::chrono::milliseconds max_wait)
+      : _io(io), _max_count(max_count), _max_wait(max_wait) {
+    CHECK_GT(_max_count, 0);
+  }
+
+  // All calls, including timer callbacks, are expected to happen on io thread.
+  template <typename T>
+  class instance : public subscriber<T>, subscription {
+   public:
+    using value_t = std::queue<T>;
+
+    static publisher<value_t> apply(publisher<T> &&src, buffer_op &&op) {
+      return publisher<value_t>(new streams::impl::op_publisher<T, value_t, buffer_op>(
+          std::move(src), std::move(op)));
+    }
+
+    instance(buffer_op &&op, subscriber<value_t> &sink)
+        : _io(op._io), _max_count(op._max_count), _max_wait(op._max_wait), _sink(sink) {
+      LOG(5) << "buffer_op(" << this << ")";
+    }
+
+   private:
+    void on_subscribe(subscription &src) override {
+      LOG(5) << "buffer_op(" << this << ")::on_subscribe";
+      CHECK(!_src);
+      _src = &src;
+      _timer = std::make_unique<boost::asio::deadline_timer>(_io);
+      _sink.on_subscribe(*this);
+    }
+
+    void on_next(T &&t) override {
+      CHECK_GT(_waiting_from_src, 0);
+      _waiting_from_src--;
+      _batch.push(std::move(t));
+      if (_batch.size() == 1) {
+        arm_timer();
+      }
+      flush();
+    }
+
+    void on_error(std::error_condition ec) override {
+      LOG(5) << "buffer_op(" << this << ")::on_error _batch.size()=" << _batch.size();
+      _src = nullptr;
+      _source_done = true;
+      _error = ec;
+      flush();
+    }
+
+    void on_complete() override {
+      LOG(5) << "buffer_op(" << this << ")::on_complete _batch.size()=" << _batch.size();
+      _src = nullptr;
+      _source_done = true;
+      flush();
+    }
+
+    void request(int n) override {
+      CHECK_GT(n, 0);
+      CHECK_LE(n, INT_MAX - _sink_needs);
+      _sink_needs += n;
+      flush();
+    }
+
+    void cancel() override {
+      LOG(5) << "buffer_op(" << this << ")::cancel";
+      if (_src) {
+        _src->cancel();
+        _src = nullptr;
+      }
+      _cancelled = true;
+      if (!_flushing) {
+        delete this;
+      }
+      // otherwise flush() will finish the job.
+    }
+
+    void arm_timer() {
+      const long epoch = ++_timer_epoch;
+      _timer->expires_from_now(to_boost(_max_wait));
+      _timer->async_wait([this, epoch](const boost::system::error_code &ec) {
+        if (ec.value() != 0) {
+          if (ec.value() != boost::system::errc::operation_canceled) {
+            LOG(ERROR) << "ASIO ERROR: " << ec.message();
+          }
+          return;
+        }
+        if (epoch != _timer_epoch) {
+          // batch was sent before the timer fired.
+          return;
+        }
+        LOG(5) << "buffer_op(" << this << ") timer expired";
+        _expired = true;
+        flush();
+      });
+    }
+
+    bool batch_ready() const {
+      return !_batch.empty() && (_batch.size() >= _max_count || _expired || _source_done);
+    }
+
+    // sends out ready batches and keeps upstream requests in line with downstream
+    // demand. Can be reentered from downstream or upstream calls, the outermost
+    // call does the job and terminates the instance if needed.
+    void flush() {
+      if (_flushing) {
+        return;
+      }
+
+      _flushing = true;
+      while (!_cancelled) {
+        if (_sink_needs > 0 && batch_ready()) {
+          value_t batch;
+          std::swap(batch, _batch);
+          _expired = false;
+          _timer_epoch++;
+          _timer->cancel();
+          _sink_needs--;
+          LOG(5) << "buffer_op(" << this << ") sending " << batch.size() << " items";
+          _sink.on_next(std::move(batch));
+          continue;
+        }
+
+        if (!request_upstream()) {
+          break;
+        }
+      }
+      _flushing = false;
+
+      if (_cancelled) {
+        delete this;
+        return;
+      }
+
+      if (_source_done && _batch.empty()) {
+        if (_error) {
+          _sink.on_error(_error);
+        } else {
+          _sink.on_complete();
+        }
+        delete this;
+      }
+    }
+
+    // requests enough items to fill current batch, returns true if request was made.
+    bool request_upstream() {
+      if (!_src || _sink_needs == 0) {
+        return false;
+      }
+      const long n = static_cast<long>(_max_count) - static_cast<long>(_batch.size())
+                     - _waiting_from_src;
+      if (n <= 0) {
+        return false;
+      }
+      _waiting_from_src += n;
+      _src->request(static_cast<int>(n));
+      return true;
+    }
+
+    boost::asio::io_service &_io;
+    const size_t _max_count;
+    const std::chrono::milliseconds _max_wait;
+    subscriber<value_t> &_sink;
+    subscription *_src{nullptr};
+    std::unique_ptr<boost::asio::deadline_timer> _timer;
+
+    value_t _batch;
+    long _timer_epoch{0};
+    long _waiting_from_src{0};
+    int _sink_needs{0};
+    bool _expired{false};
+    bool _flushing{false};
+    bool _source_done{false};
+    bool _cancelled{false};
+    std::error_condition _error{};
+  };
+
+ private:
+  boost::asio::io_service &_io;
+  const size_t _max_count;
+  const std::chrono::milliseconds _max_wait;
+};
+
+enum class rate_limit_mode { THROTTLE, SAMPLE, DEBOUNCE };
+
+class rate_limit_op {
+ public:
+  rate_limit_op(boost::asio::io_service &io, rate_limit_mode mode,
+                std::chrono::milliseconds period)
+      : _io(io), _mode(mode), _period(period) {}
+
+  // All calls, including timer callbacks, are expected to happen on io thread.
+  template <typename T>
+  class instance : public subscriber<T>, subscription {
+   public:
+    using value_t = T;
+    using clock = std::chrono::steady_clock;
+
+    static publisher<T> apply(publisher<T> &&src, rate_limit_op &&op) {
+      return publisher<T>(new streams::impl::op_publisher<T, T, rate_limit_op>(
+          std::move(src), std::move(op)));
+    }
+
+    instance(rate_limit_op &&op, subscriber<T> &sink)
+        : _io(op._io), _mode(op._mode), _period(op._period), _sink(sink) {
+      LOG(5) << "rate_limit_op(" << this << ")";
+    }
+
+   private:
+    void on_subscribe(subscription &src) override {
+      LOG(5) << "rate_limit_op(" << this << ")::on_subscribe";
+      CHECK(!_src);
+      _src = &src;
+      _timer = std::make_unique<boost::asio::deadline_timer>(_io);
+      _sink.on_subscribe(*this);
+    }
+
+    void on_next(T &&t) override {
+      CHECK_GT(_waiting_from_src, 0);
+      _waiting_from_src--;
+      const auto now = clock::now();
+
+      switch (_mode) {
+        case rate_limit_mode::THROTTLE:
+          if (now >= _open_at && _sink_needs > 0 && !_due) {
+            _latest = std::move(t);
+            _due = true;
+            _open_at = now + _period;
+          }
+          break;
+        case rate_limit_mode::SAMPLE:
+          _latest = std::move(t);
+          if (!_timer_armed) {
+            arm_timer(_period);
+          }
+          break;
+        case rate_limit_mode::DEBOUNCE:
+          _latest = std::move(t);
+          _due = false;
+          _last_arrival = now;
+          if (!_timer_armed) {
+            arm_timer(_period);
+          }
+          break;
+      }
+      flush();
+    }
+
+    void on_error(std::error_condition ec) override {
+      LOG(5) << "rate_limit_op(" << this << ")::on_error";
+      _error = ec;
+      on_source_done();
+    }
+
+    void on_complete() override {
+      LOG(5) << "rate_limit_op(" << this << ")::on_complete";
+      on_source_done();
+    }
+
+    void on_source_done() {
+      _src = nullptr;
+      _source_done = true;
+      if (_latest) {
+        _due = true;
+      }
+      flush();
+    }
+
+    void request(int n) override {
+      CHECK_GT(n, 0);
+      CHECK_LE(n, INT_MAX - _sink_needs);
+      _sink_needs += n;
+      _started = true;
+      flush();
+    }
+
+    void cancel() override {
+      LOG(5) << "rate_limit_op(" << this << ")::cancel";
+      if (_src) {
+        _src->cancel();
+        _src = nullptr;
+      }
+      _cancelled = true;
+      if (!_flushing) {
+        terminate();
+      }
+      // otherwise flush() will finish the job.
+    }
+
+    void arm_timer(std::chrono::steady_clock::duration after) {
+      CHECK(!_timer_armed);
+      _timer_armed = true;
+      _timer->expires_from_now(to_boost(after));
+      _timer->async_wait([this](const boost::system::error_code &ec) {
+        _timer_armed = false;
+        if (_terminated) {
+          delete this;
+          return;
+        }
+        if (ec.value() != 0) {
+          LOG(ERROR) << "ASIO ERROR: " << ec.message();
+          return;
+        }
+        on_timer();
+      });
+    }
+
+    void on_timer() {
+      if (!_latest) {
+        return;
+      }
+      if (_mode == rate_limit_mode::DEBOUNCE) {
+        const auto quiet_until = _last_arrival + _period;
+        const auto now = clock::now();
+        if (now < quiet_until) {
+          // items came after the timer was armed.
+          arm_timer(quiet_until - now);
+          return;
+        }
+      }
+      _due = true;
+      flush();
+    }
+
+    // sends out due item and keeps upstream requests going while downstream has
+    // demand. Can be reentered from downstream or upstream calls, the outermost call
+    // does the job and terminates the instance if needed.
+    void flush() {
+      if (_flushing) {
+        return;
+      }
+
+      _flushing = true;
+      while (!_cancelled) {
+        if (_sink_needs > 0 && _due) {
+          value_t t = std::move(*_latest);
+          _latest.reset();
+          _due = false;
+          _sink_needs--;
+          _sink.on_next(std::move(t));
+          continue;
+        }
+
+        if (!request_upstream()) {
+          break;
+        }
+      }
+      _flushing = false;
+
+      if (_cancelled) {
+        terminate();
+        return;
+      }
+
+      if (_source_done && !_due) {
+        if (_error) {
+          _sink.on_error(_error);
+        } else {
+          _sink.on_complete();
+        }
+        terminate();
+      }
+    }
+
+    bool request_upstream() {
+      if (!_src || !_started) {
+        return false;
+      }
+      const int n = _window - _waiting_from_src;
+      if (n <= 0) {
+        return false;
+      }
+      _waiting_from_src += n;
+      _src->request(n);
+      return true;
+    }
+
+    // pending timer callback deletes the instance.
+    void terminate() {
+      if (_timer_armed) {
+        _terminated = true;
+        _timer->cancel();
+      } else {
+        delete this;
+      }
+    }
+
+    boost::asio::io_service &_io;
+    const rate_limit_mode _mode;
+    const std::chrono::milliseconds _period;
+    subscriber<T> &_sink;
+    subscription *_src{nullptr};
+    std::unique_ptr<boost::asio::deadline_timer> _timer;
+
+    const int _window{16};
+    boost::optional<T> _latest;
+    clock::time_point _open_at;
+    clock::time_point _last_arrival;
+    int _waiting_from_src{0};
+    int _sink_needs{0};
+    bool _due{false};
+    bool _started{false};
+    bool _timer_armed{false};
+    bool _flushing{false};
+    bool _source_done{false};
+    bool _cancelled{false};
+    bool _terminated{false};
+    std::error_condition _error{};
+  };
+
+ private:
+  boost::asio::io_service &_io;
+  const rate_limit_mode _mode;
+  const std::chrono::milliseconds _period;
+};
+
 }  // namespace impl
 
 template <typename Fn>
@@ -409,6 +830,23 @@ auto timeout(boost::asio::io_service &io, std::chrono::milliseconds time) {
   return impl::timeout_op(io, time);
 }
 
+inline auto buffer(boost::asio::io_service &io, size_t max_count,
+                   std::chrono::milliseconds max_wait) {
+  return impl::buffer_op(io, max_count, max_wait);
+}
+
+inline auto throttle(boost::asio::io_service &io, std::chrono::milliseconds period) {
+  return impl::rate_limit_op(io, impl::rate_limit_mode::THROTTLE, period);
+}
+
+inline auto sample(boost::asio::io_service &io, std::chrono::milliseconds period) {
+  return impl::rate_limit_op(io, impl::rate_limit_mode::SAMPLE, period);
+}
+
+inline auto debounce(boost::asio::io_service &io, std::chrono::milliseconds quiet) {
+  return impl::rate_limit_op(io, impl::rate_limit_mode::DEBOUNCE, quiet);
+}
+
 }  // namespace asio
 }  // namespace streams
 }  // namespace video
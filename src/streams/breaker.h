@@ -0,0 +1,151 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "streams.h"
+
+namespace satori {
+namespace video {
+namespace streams {
+
+// Stops streams going through it on request, e.g. when a job is removed: their
+// upstream subscriptions are cancelled and their downstreams are completed.
+// trigger() should be called from the thread delivering upstream items.
+class breaker {
+ public:
+  void trigger() {
+    std::map<uint64_t, std::function<void()>> streams;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _triggered = true;
+      streams.swap(_streams);
+    }
+    for (auto &s : streams) {
+      s.second();
+    }
+  }
+
+  bool triggered() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _triggered;
+  }
+
+  // returns 0 if breaker was already triggered.
+  uint64_t attach(std::function<void()> &&stop) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_triggered) {
+      return 0;
+    }
+    const uint64_t id = ++_last_id;
+    _streams.emplace(id, std::move(stop));
+    return id;
+  }
+
+  void detach(uint64_t id) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _streams.erase(id);
+  }
+
+ private:
+  mutable std::mutex _mutex;
+  bool _triggered{false};
+  uint64_t _last_id{0};
+  std::map<uint64_t, std::function<void()>> _streams;
+};
+
+namespace impl {
+
+class breaker_op {
+ public:
+  explicit breaker_op(std::shared_ptr<breaker> b) : _breaker(std::move(b)) {}
+
+  template <typename T>
+  class instance : public subscriber<T>, subscription {
+   public:
+    instance(breaker_op &&op, subscriber<T> &sink)
+        : _breaker(std::move(op._breaker)), _sink(sink) {}
+
+    static publisher<T> apply(publisher<T> &&source, breaker_op &&op) {
+      return publisher<T>(
+          new impl::op_publisher<T, T, breaker_op>(std::move(source), std::move(op)));
+    }
+
+   private:
+    void on_next(T &&t) override { _sink.on_next(std::move(t)); };
+
+    void on_error(std::error_condition ec) override {
+      LOG(5) << "breaker_op(" << this << ") on_error";
+      _breaker->detach(_id);
+      _sink.on_error(ec);
+      delete this;
+    };
+
+    void on_complete() override {
+      LOG(5) << "breaker_op(" << this << ") on_complete";
+      _breaker->detach(_id);
+      _sink.on_complete();
+      delete this;
+    };
+
+    void on_subscribe(subscription &s) override {
+      LOG(5) << "breaker_op(" << this << ") on_subscribe";
+      _id = _breaker->attach([this]() { stop(); });
+      if (_id == 0) {
+        LOG(INFO) << "breaker_op(" << this << ") breaker was already triggered";
+        s.cancel();
+        _sink.on_subscribe(*this);
+        _sink.on_complete();
+        delete this;
+        return;
+      }
+      _source_sub = &s;
+      _sink.on_subscribe(*this);
+    };
+
+    void request(int n) override {
+      LOG(5) << "breaker_op(" << this << ") request " << n;
+      if (_source_sub != nullptr) {
+        _source_sub->request(n);
+      }
+    }
+
+    void cancel() override {
+      LOG(5) << "breaker_op(" << this << ") cancel";
+      _breaker->detach(_id);
+      if (_source_sub != nullptr) {
+        _source_sub->cancel();
+      }
+      delete this;
+    }
+
+    void stop() {
+      LOG(INFO) << "breaker_op(" << this << ") breaking the stream";
+      subscription *source_sub = _source_sub;
+      _source_sub = nullptr;
+      source_sub->cancel();
+      _sink.on_complete();
+      delete this;
+    }
+
+    const std::shared_ptr<breaker> _breaker;
+    subscriber<T> &_sink;
+    subscription *_source_sub{nullptr};
+    uint64_t _id{0};
+  };
+
+ private:
+  std::shared_ptr<breaker> _breaker;
+};
+
+}  // namespace impl
+
+// Stream operator that completes the stream when breaker is triggered.
+inline auto break_on(std::shared_ptr<breaker> b) {
+  return impl::breaker_op(std::move(b));
+}
+
+}  // namespace streams
+}  // namespace video
+}  // namespace satori
@@ -1,51 +1,109 @@
 // go-like channel concurrency synchronization mechanism.
 #pragma once
 
+#include <algorithm>
+#include <boost/optional.hpp>
+#include <chrono>
 #include <condition_variable>
 #include <deque>
 #include <functional>
 #include <mutex>
 #include <utility>
+#include <vector>
 
 namespace satori {
 namespace video {
 
+// Once closed, sends fail and receives return what is left in the buffer, then
+// nothing. Blocked senders and receivers are woken up by close().
 template <typename T>
 class channel {
  public:
   explicit channel(size_t buffer_size) : _buffer_size(buffer_size) {}
 
-  void send(T &&t) {
+  // returns false if channel is closed, t is left untouched then.
+  bool send(T &&t) {
     std::unique_lock<std::mutex> lock(_mutex);
-    while (_buffer.size() >= _buffer_size) {
-      _on_receive.wait(lock);
-    }
-    _buffer.push_back(std::move(t));
-    _on_send.notify_one();
+    _on_receive.wait(lock, [this]() { return _closed || has_room(); });
+    return push(std::move(t));
+  }
+
+  // returns false if channel is closed or the buffer is still full after timeout.
+  template <typename Rep, typename Period>
+  bool send_for(T &&t, const std::chrono::duration<Rep, Period> &timeout) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _on_receive.wait_for(lock, timeout, [this]() { return _closed || has_room(); });
+    return has_room() && push(std::move(t));
   }
 
   bool try_send(T &&t) {
     std::lock_guard<std::mutex> guard(_mutex);
-    if (_buffer.size() >= _buffer_size) {
-      return false;
+    return has_room() && push(std::move(t));
+  }
+
+  // moves as many items as the buffer has room for at once, blocking until all are
+  // sent. Returns the number of items sent, which is less than ts.size() only if
+  // channel was closed.
+  size_t send_all(std::vector<T> &&ts) {
+    size_t sent = 0;
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (sent < ts.size()) {
+      _on_receive.wait(lock, [this]() { return _closed || has_room(); });
+      if (_closed) {
+        break;
+      }
+      const size_t n = std::min(ts.size() - sent, _buffer_size - _buffer.size());
+      for (size_t i = 0; i < n; i++) {
+        _buffer.push_back(std::move(ts[sent + i]));
+      }
+      sent += n;
+      notify(_on_send, n);
     }
+    return sent;
+  }
 
-    _buffer.push_back(std::move(t));
-    _on_send.notify_one();
-    return true;
+  // returns nothing once channel is closed and drained.
+  boost::optional<T> recv() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _on_send.wait(lock, [this]() { return _closed || !_buffer.empty(); });
+    return pop();
   }
 
-  T recv() {
-    // todo: shutdown
+  // returns nothing if channel is drained after timeout.
+  template <typename Rep, typename Period>
+  boost::optional<T> recv_for(const std::chrono::duration<Rep, Period> &timeout) {
     std::unique_lock<std::mutex> lock(_mutex);
-    while (_buffer.empty()) {
-      _on_send.wait(lock);
-    }
+    _on_send.wait_for(lock, timeout, [this]() { return _closed || !_buffer.empty(); });
+    return pop();
+  }
 
-    T t = std::move(_buffer.front());
-    _buffer.pop_front();
-    _on_receive.notify_one();
-    return std::move(t);
+  // waits for at least one item and moves up to max items at once. Returns nothing
+  // once channel is closed and drained.
+  std::vector<T> recv_all(size_t max) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _on_send.wait(lock, [this]() { return _closed || !_buffer.empty(); });
+    return pop_all(max);
+  }
+
+  // returns nothing if channel is drained after timeout.
+  template <typename Rep, typename Period>
+  std::vector<T> recv_all_for(size_t max,
+                              const std::chrono::duration<Rep, Period> &timeout) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _on_send.wait_for(lock, timeout, [this]() { return _closed || !_buffer.empty(); });
+    return pop_all(max);
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> guard(_mutex);
+    _closed = true;
+    _on_send.notify_all();
+    _on_receive.notify_all();
+  }
+
+  bool closed() {
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _closed;
   }
 
   size_t size() {
@@ -56,12 +114,57 @@ class channel {
   void clear() {
     std::lock_guard<std::mutex> guard(_mutex);
     _buffer.clear();
+    _on_receive.notify_all();
   }
 
  private:
+  // following methods have to be called with mutex locked.
+
+  bool has_room() const { return !_closed && _buffer.size() < _buffer_size; }
+
+  bool push(T &&t) {
+    if (_closed) {
+      return false;
+    }
+    _buffer.push_back(std::move(t));
+    _on_send.notify_one();
+    return true;
+  }
+
+  boost::optional<T> pop() {
+    if (_buffer.empty()) {
+      return boost::none;
+    }
+    boost::optional<T> t{std::move(_buffer.front())};
+    _buffer.pop_front();
+    _on_receive.notify_one();
+    return t;
+  }
+
+  std::vector<T> pop_all(size_t max) {
+    const size_t n = std::min(max, _buffer.size());
+    std::vector<T> ts;
+    ts.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+      ts.push_back(std::move(_buffer.front()));
+      _buffer.pop_front();
+    }
+    notify(_on_receive, n);
+    return ts;
+  }
+
+  static void notify(std::condition_variable &cv, size_t n) {
+    if (n == 1) {
+      cv.notify_one();
+    } else if (n > 1) {
+      cv.notify_all();
+    }
+  }
+
   std::mutex _mutex;
   size_t _buffer_size;
   std::deque<T> _buffer;
+  bool _closed{false};
 
   std::condition_variable _on_send;
   std::condition_variable _on_receive;
@@ -0,0 +1,346 @@
+// Coroutine adapters for streams, available to C++20 translation units.
+//
+// Sources can be written as generator coroutines instead of generators<T>::stateful
+// state machines:
+//
+//      streams::co_generator<int> count(int n) {
+//        for (int i = 0; i < n; i++) {
+//          co_yield i;
+//        }
+//      }
+//
+//      publisher<int> p = streams::coroutines::generate([]() { return count(10); });
+//
+// The coroutine is resumed only while subscriber has outstanding requests, so it
+// never runs ahead of demand. co_yield coroutine_error{ec} fails the stream.
+//
+// deferred<T> can be awaited, both in generators and in coroutines returning
+// deferred<U>, which resolve it with co_return:
+//
+//      deferred<int> twice(deferred<int> x) {
+//        error_or<int> value = co_await x;
+//        if (!value.ok()) {
+//          co_return value.error_condition();
+//        }
+//        co_return *value * 2;
+//      }
+//
+// Coroutines are resumed on the thread which resolves the awaited deferred or
+// requests items.
+#pragma once
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <boost/optional.hpp>
+#include <coroutine>
+#include <memory>
+#include <system_error>
+#include <utility>
+
+#include "../logging.h"
+#include "deferred.h"
+#include "streams.h"
+
+namespace satori {
+namespace video {
+namespace streams {
+
+// co_yield it from co_generator to fail the stream.
+struct coroutine_error {
+  std::error_condition ec;
+};
+
+namespace impl {
+
+// gets notified when generator coroutine stops at co_yield or at its end.
+struct coroutine_driver {
+  virtual void on_suspended() = 0;
+
+ protected:
+  ~coroutine_driver() = default;
+};
+
+struct notifying_awaiter {
+  bool await_ready() noexcept { return false; }
+
+  template <typename Promise>
+  void await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+    // driver may destroy the coroutine, nothing is touched afterwards.
+    if (handle.promise().driver != nullptr) {
+      handle.promise().driver->on_suspended();
+    }
+  }
+
+  void await_resume() noexcept {}
+};
+
+}  // namespace impl
+
+template <typename T>
+class co_generator {
+ public:
+  using value_type = T;
+
+  struct promise_type {
+    co_generator get_return_object() {
+      return co_generator{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    impl::notifying_awaiter final_suspend() noexcept { return {}; }
+
+    // value lives in coroutine frame until coroutine is resumed.
+    impl::notifying_awaiter yield_value(T &&t) noexcept {
+      value = std::addressof(t);
+      return {};
+    }
+
+    impl::notifying_awaiter yield_value(const T &t) {
+      copy = t;
+      value = copy.get_ptr();
+      return {};
+    }
+
+    impl::notifying_awaiter yield_value(coroutine_error e) noexcept {
+      error = e.ec;
+      return {};
+    }
+
+    void return_void() noexcept {}
+
+    void unhandled_exception() noexcept { ABORT() << "exception in stream coroutine"; }
+
+    T *value{nullptr};
+    boost::optional<T> copy;
+    std::error_condition error;
+    impl::coroutine_driver *driver{nullptr};
+  };
+
+  co_generator(co_generator &&other) noexcept
+      : _handle(std::exchange(other._handle, nullptr)) {}
+
+  co_generator(const co_generator &) = delete;
+
+  ~co_generator() {
+    if (_handle) {
+      _handle.destroy();
+    }
+  }
+
+  std::coroutine_handle<promise_type> release() {
+    return std::exchange(_handle, nullptr);
+  }
+
+ private:
+  explicit co_generator(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+  std::coroutine_handle<promise_type> _handle;
+};
+
+namespace impl {
+
+template <typename T>
+class coroutine_subscription : public subscription, coroutine_driver {
+ public:
+  using handle_t = std::coroutine_handle<typename co_generator<T>::promise_type>;
+
+  coroutine_subscription(co_generator<T> &&generator, subscriber<T> &sink)
+      : _handle(generator.release()), _sink(sink) {
+    _handle.promise().driver = this;
+  }
+
+  void start() { _sink.on_subscribe(*this); }
+
+ private:
+  void request(int n) override {
+    CHECK_GT(n, 0);
+    _requested += n;
+    drain();
+  }
+
+  void cancel() override {
+    LOG(5) << "coroutine_subscription(" << this << ")::cancel";
+    _cancelled = true;
+    if (!_draining) {
+      destroy();
+    }
+    // otherwise drain() will finish the job.
+  }
+
+  // coroutine was resumed from outside, e.g. by a deferred it awaited.
+  void on_suspended() override {
+    _at_yield = true;
+    drain();
+  }
+
+  // delivers yielded values and resumes the coroutine while there is demand. Can be
+  // reentered from the coroutine or subscriber, the outermost call does the job.
+  void drain() {
+    if (_draining) {
+      return;
+    }
+
+    _draining = true;
+    bool finished = false;
+    while (!_cancelled) {
+      auto &promise = _handle.promise();
+      if (promise.error) {
+        _sink.on_error(promise.error);
+        finished = true;
+        break;
+      }
+      if (promise.value != nullptr) {
+        if (_requested == 0) {
+          break;
+        }
+        T t = std::move(*promise.value);
+        promise.value = nullptr;
+        _requested--;
+        _sink.on_next(std::move(t));
+        continue;
+      }
+      if (_handle.done()) {
+        _sink.on_complete();
+        finished = true;
+        break;
+      }
+      if (!_at_yield || _requested == 0) {
+        // coroutine awaits something else, it calls on_suspended() when it's back.
+        break;
+      }
+      _at_yield = false;
+      _handle.resume();
+    }
+    _draining = false;
+
+    if (finished || _cancelled) {
+      destroy();
+    }
+  }
+
+  void destroy() {
+    _handle.destroy();
+    delete this;
+  }
+
+  handle_t _handle;
+  subscriber<T> &_sink;
+  int _requested{0};
+  // coroutine is stopped at initial suspend point, co_yield or its end.
+  bool _at_yield{true};
+  bool _draining{false};
+  bool _cancelled{false};
+};
+
+template <typename T, typename Fn>
+class coroutine_publisher : public publisher_impl<T> {
+ public:
+  explicit coroutine_publisher(Fn &&fn) : _fn(std::move(fn)) {}
+
+  void subscribe(subscriber<T> &s) override {
+    (new coroutine_subscription<T>(_fn(), s))->start();
+  }
+
+ private:
+  Fn _fn;
+};
+
+template <typename T>
+class deferred_awaiter {
+ public:
+  using value_t = typename deferred<T>::value_t;
+
+  explicit deferred_awaiter(deferred<T> d) : _deferred(std::move(d)) {}
+
+  deferred_awaiter(const deferred_awaiter &) = delete;
+
+  // coroutine might be destroyed while it waits, the callback does nothing then.
+  ~deferred_awaiter() { _state->handle = nullptr; }
+
+  bool await_ready() const { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    _state->handle = handle;
+    _state->in_await_suspend = true;
+    _deferred.on([state = _state](value_t &&value) {
+      state->result = std::move(value);
+      if (!state->in_await_suspend && state->handle) {
+        state->handle.resume();
+      }
+    });
+    _state->in_await_suspend = false;
+    // deferred was already resolved, coroutine goes on without suspending.
+    return !_state->result;
+  }
+
+  value_t await_resume() { return std::move(*_state->result); }
+
+ private:
+  struct state {
+    std::coroutine_handle<> handle;
+    boost::optional<value_t> result;
+    bool in_await_suspend{false};
+  };
+
+  deferred<T> _deferred;
+  std::shared_ptr<state> _state{std::make_shared<state>()};
+};
+
+template <typename T>
+struct deferred_promise_base {
+  deferred<T> get_return_object() { return result; }
+
+  std::suspend_never initial_suspend() noexcept { return {}; }
+
+  std::suspend_never final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() noexcept { ABORT() << "exception in deferred coroutine"; }
+
+  deferred<T> result;
+};
+
+template <typename T>
+struct deferred_promise : deferred_promise_base<T> {
+  void return_value(typename deferred<T>::value_t &&value) {
+    this->result.resolve(std::move(value));
+  }
+};
+
+template <>
+struct deferred_promise<void> : deferred_promise_base<void> {
+  void return_void() { result.resolve(); }
+};
+
+}  // namespace impl
+
+// Value of co_await is error_or<T>, or std::error_condition for deferred<void>.
+template <typename T>
+impl::deferred_awaiter<T> operator co_await(deferred<T> d) {
+  return impl::deferred_awaiter<T>{std::move(d)};
+}
+
+namespace coroutines {
+
+// Stream of values yielded by coroutine returned by fn, fn is called for every
+// subscription.
+// Fn: co_generator<T>()
+template <typename Fn>
+auto generate(Fn &&fn) {
+  using T = typename decltype(fn())::value_type;
+  using fn_t = typename std::decay<Fn>::type;
+  return publisher<T>(new impl::coroutine_publisher<T, fn_t>(fn_t(std::forward<Fn>(fn))));
+}
+
+}  // namespace coroutines
+
+}  // namespace streams
+}  // namespace video
+}  // namespace satori
+
+template <typename T, typename... Args>
+struct std::coroutine_traits<satori::video::streams::deferred<T>, Args...> {
+  using promise_type = satori::video::streams::impl::deferred_promise<T>;
+};
+
+#endif
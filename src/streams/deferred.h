@@ -58,9 +58,15 @@
 // deferred<T>.map & deferred<T>.then perform correct error propagation through the chain
 // of deferred values. Notice that callbacks in map and then won't be called for errors.
 // deferred<T>.on callback is called regardless.
+//
+// deferred values are created for every request and stream, so their state is
+// reference counted intrusively and taken from per-thread pools, and callbacks which
+// fit small_function are kept inline. Chains don't hit allocator once pools are warm.
 
 #pragma once
 
+#include <atomic>
+#include <boost/intrusive_ptr.hpp>
 #include <chrono>
 #include <memory>
 #include <thread>
@@ -68,6 +74,7 @@
 #include <vector>
 
 #include "error_or.h"
+#include "small_function.h"
 
 namespace satori {
 namespace video {
@@ -85,6 +92,9 @@ class deferred_impl;
 template <>
 class deferred_impl<void>;
 
+template <typename T>
+using deferred_impl_ptr = boost::intrusive_ptr<deferred_impl<T>>;
+
 // type computations necessary for defining interface and implementation.
 namespace {
 
@@ -111,7 +121,7 @@ template <typename Fn, typename T>
 struct map_types {
   using result_element_t = typename result_type<Fn, T>::type;
   using return_t = deferred<result_element_t>;
-  using impl_return_t = std::shared_ptr<deferred_impl<result_element_t>>;
+  using impl_return_t = deferred_impl_ptr<result_element_t>;
 };
 
 // Type traits for deferred<T>.then(Fn);
@@ -120,19 +130,19 @@ struct then_types {
   using result_element_t =
       typename unwrap_deferred<typename result_type<Fn, T>::type>::type;
   using return_t = deferred<result_element_t>;
-  using impl_return_t = std::shared_ptr<deferred_impl<result_element_t>>;
+  using impl_return_t = deferred_impl_ptr<result_element_t>;
 };
 
 template <typename T>
 struct impl_types {
   using value_t = error_or<T>;
-  using callback_type = std::function<void(value_t &&)>;
+  using callback_type = small_function<void(value_t &&)>;
   inline static bool ok(const value_t &v) { return v.ok(); }
 };
 template <>
 struct impl_types<void> {
   using value_t = std::error_condition;
-  using callback_type = std::function<void(value_t)>;
+  using callback_type = small_function<void(value_t)>;
   inline static bool ok(const value_t &v) { return !(bool)v; }
 };
 }  // namespace
@@ -174,10 +184,10 @@ class deferred_base {
   }
 
  protected:
-  // deferred is a shared_ptr. This gives it reference semantics.
-  std::shared_ptr<deferred_impl<T>> _impl;
+  // deferred is a reference counted pointer. This gives it reference semantics.
+  deferred_impl_ptr<T> _impl;
 
-  explicit deferred_base(std::shared_ptr<deferred_impl<T>> impl)
+  explicit deferred_base(deferred_impl_ptr<T> impl)
       : _impl(std::move(impl)) {}
 
   template <typename>
@@ -188,24 +198,26 @@ class deferred_base {
 template <typename T>
 class deferred : public deferred_base<T> {
  private:
-  explicit deferred(std::shared_ptr<deferred_impl<T>> impl) : deferred_base<T>(impl) {}
+  explicit deferred(deferred_impl_ptr<T> impl) : deferred_base<T>(std::move(impl)) {}
 
   template <typename>
   friend class deferred_base;
 
  public:
   // create unresolved deferred value
-  deferred() : deferred_base<T>(std::make_shared<deferred_impl<T>>()) {}
+  deferred() : deferred_base<T>(deferred_impl_ptr<T>{new deferred_impl<T>()}) {}
 
   // create already failed deferred value. status must be not ok.
   deferred(std::error_condition ec)
-      : deferred_base<T>(std::make_shared<deferred_impl<T>>(ec)) {}
+      : deferred_base<T>(deferred_impl_ptr<T>{new deferred_impl<T>(ec)}) {}
 
   // create already resolved deferred value.
-  deferred(const T &t) : deferred_base<T>(std::make_shared<deferred_impl<T>>(t)) {}
+  deferred(const T &t)
+      : deferred_base<T>(deferred_impl_ptr<T>{new deferred_impl<T>(t)}) {}
 
   // create already resolved deferred value.
-  deferred(T &&t) : deferred_base<T>(std::make_shared<deferred_impl<T>>(std::move(t))) {}
+  deferred(T &&t)
+      : deferred_base<T>(deferred_impl_ptr<T>{new deferred_impl<T>(std::move(t))}) {}
 
   // ignore return value
   operator deferred<void>();
@@ -218,7 +230,7 @@ class deferred : public deferred_base<T> {
 template <>
 class deferred<void> : public deferred_base<void> {
  private:
-  explicit deferred(std::shared_ptr<deferred_impl<void>> impl)
+  explicit deferred(deferred_impl_ptr<void> impl)
       : deferred_base<void>(std::move(impl)) {}
 
   template <typename>
@@ -226,10 +238,9 @@ class deferred<void> : public deferred_base<void> {
       deferred_base;  // https://gcc.gnu.org/bugzilla/show_bug.cgi?id=52625
 
  public:
-  deferred() : deferred_base<void>(std::make_shared<deferred_impl<void>>()) {}
+  deferred();
 
-  deferred(std::error_condition ec)
-      : deferred_base<void>(std::make_shared<deferred_impl<void>>(ec)) {}
+  deferred(std::error_condition ec);
 
   void resolve() { deferred_base<void>::resolve(std::error_condition{}); }
 };
@@ -241,6 +252,70 @@ deferred<T>::operator deferred<void>() {
 
 // ---------- IMPLEMENTATION DETAILS ----------
 
+// Per-thread free lists of Size bytes blocks. Blocks may be released on a thread other
+// than the one they were taken on.
+template <size_t Size>
+class block_pool {
+ public:
+  static void *allocate() {
+    free_list *list = thread_list();
+    if (list == nullptr || list->head == nullptr) {
+      return ::operator new(Size);
+    }
+    node *n = list->head;
+    list->head = n->next;
+    list->size--;
+    return n;
+  }
+
+  static void deallocate(void *p) {
+    free_list *list = thread_list();
+    if (list == nullptr || list->size >= max_free_blocks) {
+      ::operator delete(p);
+      return;
+    }
+    list->head = new (p) node{list->head};
+    list->size++;
+  }
+
+ private:
+  static constexpr size_t max_free_blocks = 1024;
+
+  struct node {
+    node *next;
+  };
+  static_assert(Size >= sizeof(node), "block is too small");
+
+  struct free_list {
+    ~free_list() {
+      while (head != nullptr) {
+        node *next = head->next;
+        ::operator delete(head);
+        head = next;
+      }
+      thread_exited() = true;
+    }
+
+    node *head{nullptr};
+    size_t size{0};
+  };
+
+  // trivially destructible, so it's still valid while other thread locals are
+  // destroyed.
+  static bool &thread_exited() {
+    static thread_local bool exited{false};
+    return exited;
+  }
+
+  static free_list *thread_list() {
+    if (thread_exited()) {
+      return nullptr;
+    }
+    static thread_local free_list list;
+    return &list;
+  }
+};
+
 template <typename T>
 class deferred_impl_base {
  protected:
@@ -249,6 +324,7 @@ class deferred_impl_base {
   value_t _value;
   bool _resolved{false};
   bool _has_callback{false};
+  std::atomic<int> _references{0};
 
   typename impl_types<T>::callback_type _resolve_cb;
 
@@ -261,6 +337,25 @@ class deferred_impl_base {
  public:
   deferred_impl_base(const deferred_impl_base &) = delete;
 
+  static void *operator new(size_t size) {
+    CHECK_EQ(size, sizeof(deferred_impl<T>));
+    return block_pool<sizeof(deferred_impl<T>)>::allocate();
+  }
+
+  static void operator delete(void *p) {
+    block_pool<sizeof(deferred_impl<T>)>::deallocate(p);
+  }
+
+  friend void intrusive_ptr_add_ref(deferred_impl_base *impl) {
+    impl->_references.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  friend void intrusive_ptr_release(deferred_impl_base *impl) {
+    if (impl->_references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete static_cast<deferred_impl<T> *>(impl);
+    }
+  }
+
   bool resolved() const { return _resolved; }
 
   bool ok() const {
@@ -305,7 +400,7 @@ class deferred_impl_base {
       return;
     }
     _resolve_cb(std::move(_value));
-    _resolve_cb = {};
+    _resolve_cb.reset();
   }
 };
 
@@ -318,7 +413,6 @@ class deferred_impl : public deferred_impl_base<T> {
   friend class deferred_impl;
 
  public:
-  // public for make_shared
   deferred_impl() = default;
 
   deferred_impl(std::error_condition ec) : deferred_impl_base<T>(ec) { CHECK(ec); }
@@ -332,18 +426,23 @@ class deferred_impl<void> : public deferred_impl_base<void> {
   friend class deferred;
 
  public:
-  // public for make_shared
   deferred_impl() = default;
 
   deferred_impl(std::error_condition ec) : deferred_impl_base<void>(ec) {}
 };
 
+inline deferred<void>::deferred()
+    : deferred_base<void>(deferred_impl_ptr<void>{new deferred_impl<void>()}) {}
+
+inline deferred<void>::deferred(std::error_condition ec)
+    : deferred_base<void>(deferred_impl_ptr<void>{new deferred_impl<void>(ec)}) {}
+
 // because void& doesn't exist, various T->U forwarding chains should be specialized.
 namespace {
 // Forward error value from t to p. Implies that !t.ok();
 template <typename T, typename U>
 struct error_fwd {
-  inline static void fwd(const error_or<T> &t, std::shared_ptr<deferred_impl<U>> p) {
+  inline static void fwd(const error_or<T> &t, const deferred_impl_ptr<U> &p) {
     t.check_not_ok();
     p->resolve(t.error_condition());
   }
@@ -353,8 +452,7 @@ template <typename U>
 struct error_fwd<void, U> {
   using T = void;
 
-  inline static void fwd(const std::error_condition &ec,
-                         std::shared_ptr<deferred_impl<U>> p) {
+  inline static void fwd(const std::error_condition &ec, const deferred_impl_ptr<U> &p) {
     CHECK((bool)ec);
     p->resolve(std::error_condition{ec});
   }
@@ -396,7 +494,7 @@ typename map_types<Fn, T>::impl_return_t deferred_impl_base<T>::map(Fn &&f) {
   using U = typename map_types<Fn, T>::result_element_t;
   using u_value_t = typename impl_types<U>::value_t;
 
-  auto result = std::make_shared<deferred_impl<U>>();
+  deferred_impl_ptr<U> result{new deferred_impl<U>()};
   on([ result, f = std::forward<Fn>(f) ](const value_t &value) mutable {
     if (impl_types<T>::ok(value)) {
       u_value_t u = apply_fn<Fn, T, u_value_t>::apply(f, value);
@@ -414,7 +512,7 @@ typename then_types<Fn, T>::impl_return_t deferred_impl_base<T>::then(Fn &&f) {
   using U = typename then_types<Fn, T>::result_element_t;
   using u_value_t = typename impl_types<U>::value_t;
 
-  auto result = std::make_shared<deferred_impl<U>>();
+  deferred_impl_ptr<U> result{new deferred_impl<U>()};
   on([ result, f = std::forward<Fn>(f) ](const value_t &value) mutable {
     if (impl_types<T>::ok(value)) {
       deferred<U> u = apply_fn<Fn, T, deferred<U>>::apply(f, value);
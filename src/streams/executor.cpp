@@ -0,0 +1,111 @@
+#include "executor.h"
+
+#include <algorithm>
+
+#include "../logging.h"
+#include "../threadutils.h"
+
+namespace satori {
+namespace video {
+namespace streams {
+
+namespace {
+// executor and queue index of current thread, if it is an executor thread.
+thread_local const executor *current_executor{nullptr};
+thread_local size_t current_queue{0};
+}  // namespace
+
+executor::executor(const std::string &name, size_t threads, const std::vector<int> &cpus)
+    : _name(name), _cpus(cpus) {
+  CHECK_GT(threads, 0);
+  for (size_t i = 0; i < threads; i++) {
+    _queues.emplace_back(std::make_unique<task_queue>());
+  }
+  for (size_t i = 0; i < threads; i++) {
+    _threads.emplace_back(&executor::worker_loop, this, i);
+  }
+  LOG(INFO) << "started executor " << _name << " with " << threads << " threads";
+}
+
+executor::~executor() {
+  {
+    std::lock_guard<std::mutex> guard(_mutex);
+    _stopped = true;
+    _on_task.notify_all();
+  }
+  for (auto &t : _threads) {
+    t.join();
+  }
+}
+
+executor &executor::shared() {
+  static executor e{"executor", std::max(1u, std::thread::hardware_concurrency())};
+  return e;
+}
+
+void executor::post(task_t &&task) {
+  const size_t index = current_executor == this
+                           ? current_queue
+                           : _next_queue.fetch_add(1) % _queues.size();
+  {
+    std::lock_guard<std::mutex> guard(_queues[index]->mutex);
+    _queues[index]->tasks.push_front(std::move(task));
+  }
+
+  _pending++;
+  std::lock_guard<std::mutex> guard(_mutex);
+  _on_task.notify_one();
+}
+
+bool executor::try_pop(size_t index, task_t &task) {
+  task_queue &q = *_queues[index];
+  std::lock_guard<std::mutex> guard(q.mutex);
+  if (q.tasks.empty()) {
+    return false;
+  }
+  task = std::move(q.tasks.front());
+  q.tasks.pop_front();
+  return true;
+}
+
+bool executor::try_steal(size_t index, task_t &task) {
+  for (size_t i = 1; i < _queues.size(); i++) {
+    task_queue &q = *_queues[(index + i) % _queues.size()];
+    std::lock_guard<std::mutex> guard(q.mutex);
+    if (!q.tasks.empty()) {
+      task = std::move(q.tasks.back());
+      q.tasks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void executor::worker_loop(size_t index) {
+  threadutils::set_current_thread_name(_name + "_" + std::to_string(index));
+  threadutils::set_current_thread_affinity(_cpus);
+  current_executor = this;
+  current_queue = index;
+
+  task_t task;
+  while (true) {
+    if (try_pop(index, task) || try_steal(index, task)) {
+      _pending--;
+      task();
+      task = nullptr;
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_stopped && _pending == 0) {
+      _on_task.wait(lock);
+    }
+    if (_stopped && _pending == 0) {
+      break;
+    }
+  }
+}
+
+}  // namespace streams
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,64 @@
+// Fixed size thread pool with work stealing.
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace satori {
+namespace video {
+namespace streams {
+
+// Every thread has its own task queue. Tasks posted from executor threads go to
+// the queue of current thread, other tasks are distributed round-robin. Idle
+// threads steal tasks from the back of other queues.
+// Tasks have no ordering guarantees, callers should serialize them if needed.
+class executor {
+ public:
+  using task_t = std::function<void()>;
+
+  // if cpus are set, executor threads are pinned to them.
+  executor(const std::string &name, size_t threads, const std::vector<int> &cpus = {});
+  ~executor();
+
+  executor(const executor &) = delete;
+  executor &operator=(const executor &) = delete;
+
+  void post(task_t &&task);
+
+  size_t threads() const { return _threads.size(); }
+
+  // process-wide executor with a thread per hardware core.
+  static executor &shared();
+
+ private:
+  struct task_queue {
+    std::mutex mutex;
+    std::deque<task_t> tasks;
+  };
+
+  bool try_pop(size_t index, task_t &task);
+  bool try_steal(size_t index, task_t &task);
+  void worker_loop(size_t index);
+
+  const std::string _name;
+  const std::vector<int> _cpus;
+  std::vector<std::unique_ptr<task_queue>> _queues;
+  std::vector<std::thread> _threads;
+  std::atomic<size_t> _next_queue{0};
+
+  std::mutex _mutex;
+  std::condition_variable _on_task;
+  std::atomic<long> _pending{0};
+  bool _stopped{false};
+};
+
+}  // namespace streams
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "streams.h"
+
+namespace satori {
+namespace video {
+namespace streams {
+
+namespace impl {
+
+template <typename T>
+class fan_out_state : public subscriber<T> {
+ public:
+  fan_out_state(publisher<T> &&source, size_t n)
+      : _source(std::move(source)), _outputs(n), _running(n) {
+    for (output &o : _outputs) {
+      o.state = this;
+    }
+  }
+
+  void subscribe(size_t i, subscriber<T> &sink, std::shared_ptr<fan_out_state> self) {
+    output &o = _outputs[i];
+    CHECK(o.sink == nullptr && !o.done)
+        << "fan_out stream " << i << " is subscribed twice";
+    o.sink = &sink;
+    sink.on_subscribe(o);
+    if (++_subscribed == _outputs.size()) {
+      LOG(5) << "fan_out(" << this << ") subscribing to source";
+      _self = std::move(self);
+      _source->subscribe(*this);
+    }
+  }
+
+ private:
+  struct output : subscription {
+    void request(int n) override {
+      requested += n;
+      state->request_source();
+    }
+
+    void cancel() override {
+      sink = nullptr;
+      done = true;
+      state->on_output_cancelled();
+    }
+
+    fan_out_state *state{nullptr};
+    subscriber<T> *sink{nullptr};
+    int64_t requested{0};
+    bool done{false};
+  };
+
+  void on_subscribe(subscription &s) override {
+    _source_sub = &s;
+    request_source();
+  }
+
+  void on_next(T &&t) override {
+    _source_requested = false;
+    output *last = nullptr;
+    for (output &o : _outputs) {
+      if (o.sink != nullptr) {
+        last = &o;
+      }
+    }
+    for (output &o : _outputs) {
+      if (o.sink == nullptr) {
+        continue;
+      }
+      o.requested--;
+      if (&o == last) {
+        o.sink->on_next(std::move(t));
+      } else {
+        o.sink->on_next(T(t));
+      }
+    }
+    request_source();
+  }
+
+  void on_error(std::error_condition ec) override {
+    auto self = std::move(_self);
+    _source_sub = nullptr;
+    for (output &o : _outputs) {
+      if (auto *sink = o.sink) {
+        o.sink = nullptr;
+        o.done = true;
+        sink->on_error(ec);
+      }
+    }
+  }
+
+  void on_complete() override {
+    auto self = std::move(_self);
+    _source_sub = nullptr;
+    for (output &o : _outputs) {
+      if (auto *sink = o.sink) {
+        o.sink = nullptr;
+        o.done = true;
+        sink->on_complete();
+      }
+    }
+  }
+
+  // source is asked for the next element when each running output wants one.
+  // Synchronous sources deliver it from request(), it's looped instead of recursing.
+  void request_source() {
+    if (_requesting) {
+      _request_again = true;
+      return;
+    }
+    std::shared_ptr<fan_out_state> keep = _self;
+    _requesting = true;
+    do {
+      _request_again = false;
+      if (_source_sub == nullptr || _source_requested || _running == 0) {
+        break;
+      }
+      bool ready = true;
+      for (const output &o : _outputs) {
+        if (o.sink != nullptr && o.requested <= 0) {
+          ready = false;
+        }
+      }
+      if (ready) {
+        _source_requested = true;
+        _source_sub->request(1);
+      }
+    } while (_request_again);
+    _requesting = false;
+  }
+
+  void on_output_cancelled() {
+    if (--_running > 0) {
+      // cancelled output might have been the slowest one.
+      request_source();
+      return;
+    }
+    LOG(5) << "fan_out(" << this << ") all streams are cancelled";
+    auto self = std::move(_self);
+    if (auto *source_sub = _source_sub) {
+      _source_sub = nullptr;
+      source_sub->cancel();
+    }
+  }
+
+  const publisher<T> _source;
+  std::vector<output> _outputs;
+  size_t _subscribed{0};
+  size_t _running;
+  subscription *_source_sub{nullptr};
+  bool _source_requested{false};
+  bool _requesting{false};
+  bool _request_again{false};
+  // keeps state alive while source is subscribed.
+  std::shared_ptr<fan_out_state> _self;
+};
+
+template <typename T>
+class fan_out_publisher : public publisher_impl<T> {
+ public:
+  fan_out_publisher(std::shared_ptr<fan_out_state<T>> state, size_t index)
+      : _state(std::move(state)), _index(index) {}
+
+  void subscribe(subscriber<T> &s) override { _state->subscribe(_index, s, _state); }
+
+ private:
+  const std::shared_ptr<fan_out_state<T>> _state;
+  const size_t _index;
+};
+
+}  // namespace impl
+
+// Splits source into n streams, each of them gets a copy of every element. Source is
+// subscribed once all streams are subscribed, and its next element is requested when
+// every stream which isn't cancelled wants one, so the slowest stream paces others.
+// Source is cancelled with the last stream. Not thread-safe, streams should request
+// elements from the thread source delivers them on.
+template <typename T>
+std::vector<publisher<T>> fan_out(publisher<T> &&source, size_t n) {
+  CHECK_GT(n, 0);
+  auto state = std::make_shared<impl::fan_out_state<T>>(std::move(source), n);
+  std::vector<publisher<T>> result;
+  for (size_t i = 0; i < n; i++) {
+    result.emplace_back(new impl::fan_out_publisher<T>(state, i));
+  }
+  return result;
+}
+
+}  // namespace streams
+}  // namespace video
+}  // namespace satori
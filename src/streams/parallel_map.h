@@ -0,0 +1,286 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../threadutils.h"
+#include "streams.h"
+
+namespace satori {
+namespace video {
+namespace streams {
+
+namespace impl {
+
+template <typename Fn>
+class parallel_map_op {
+  using T = typename function_traits<std::decay_t<Fn>>::result_type;
+
+ public:
+  parallel_map_op(size_t threads, Fn &&fn)
+      : _threads(threads), _fn(std::forward<Fn>(fn)) {
+    CHECK_GT(_threads, 0);
+  }
+
+  template <typename S>
+  class instance : public subscriber<S>, subscription {
+    // State shared with worker threads, it outlives instance if some threads are
+    // still busy when stream is terminated. Workers only fill results, everything
+    // else happens on threads calling into instance.
+    struct state {
+      explicit state(std::decay_t<Fn> &&fn) : fn(std::move(fn)) {}
+
+      std::decay_t<Fn> fn;
+
+      // guards jobs, results and stopped.
+      std::mutex mutex;
+      std::condition_variable on_job;
+      std::condition_variable on_result;
+      std::deque<std::pair<long, S>> jobs;
+      std::map<long, T> results;
+      bool stopped{false};
+
+      // serializes calls from upstream and downstream and instance lifetime, may be
+      // reentered by them.
+      std::recursive_mutex delivery_mutex;
+    };
+
+   public:
+    using value_t = T;
+
+    static publisher<value_t> apply(publisher<S> &&source, parallel_map_op<Fn> &&op) {
+      return publisher<value_t>(
+          new op_publisher<S, T, parallel_map_op<Fn>>(std::move(source), std::move(op)));
+    }
+
+    instance(parallel_map_op<Fn> &&op, subscriber<T> &sink)
+        : _sink(sink),
+          _max_in_flight(static_cast<long>(2 * op._threads)),
+          _state(std::make_shared<state>(std::move(op._fn))) {
+      for (size_t i = 0; i < op._threads; i++) {
+        _workers.emplace_back(&instance::worker_loop, _state);
+      }
+    }
+
+   private:
+    void on_subscribe(subscription &s) override {
+      auto st = _state;
+      std::lock_guard<std::recursive_mutex> guard(st->delivery_mutex);
+      CHECK(!_source);
+      _source = &s;
+      // downstream might cancel right away, die() has to wait until we are done.
+      _delivering = true;
+      _sink.on_subscribe(*this);
+      _delivering = false;
+      if (_terminated) {
+        die();
+        return;
+      }
+      request_upstream();
+    }
+
+    void on_next(S &&s) override {
+      auto st = _state;
+      std::lock_guard<std::recursive_mutex> guard(st->delivery_mutex);
+      {
+        std::lock_guard<std::mutex> state_guard(st->mutex);
+        st->jobs.emplace_back(_received++, std::move(s));
+        st->on_job.notify_one();
+      }
+      deliver();
+    }
+
+    void on_error(std::error_condition ec) override {
+      auto st = _state;
+      std::lock_guard<std::recursive_mutex> guard(st->delivery_mutex);
+      LOG(5) << "parallel_map_op(" << this << ")::on_error";
+      _source = nullptr;
+      _source_done = true;
+      _ec = ec;
+      deliver();
+    }
+
+    void on_complete() override {
+      auto st = _state;
+      std::lock_guard<std::recursive_mutex> guard(st->delivery_mutex);
+      LOG(5) << "parallel_map_op(" << this << ")::on_complete";
+      _source = nullptr;
+      _source_done = true;
+      deliver();
+    }
+
+    void request(int n) override {
+      CHECK_GT(n, 0);
+      auto st = _state;
+      std::lock_guard<std::recursive_mutex> guard(st->delivery_mutex);
+      _requested += n;
+      deliver();
+    }
+
+    void cancel() override {
+      auto st = _state;
+      std::lock_guard<std::recursive_mutex> guard(st->delivery_mutex);
+      LOG(5) << "parallel_map_op(" << this << ")::cancel";
+      _terminated = true;
+      if (!_delivering) {
+        die();
+      }
+    }
+
+    // has to be called with delivery_mutex locked. Waits for pending results
+    // only when upstream can't call back anymore, either because it has no
+    // credit left or because it is done.
+    void deliver() {
+      if (_delivering) {
+        // reentered from downstream or upstream, outer call will do the job.
+        return;
+      }
+
+      _delivering = true;
+      while (!_terminated && _delivered < _requested) {
+        std::unique_lock<std::mutex> lock(_state->mutex);
+        auto it = _state->results.find(_next);
+        if (it == _state->results.end()) {
+          if (!upstream_stalled()) {
+            break;
+          }
+          _state->on_result.wait(lock);
+          continue;
+        }
+        T t = std::move(it->second);
+        _state->results.erase(it);
+        _next++;
+        lock.unlock();
+
+        request_upstream();
+        _delivered++;
+        _sink.on_next(std::move(t));
+      }
+
+      if (!_terminated && _source_done && _next == _received) {
+        _terminated = true;
+        if (_ec) {
+          _sink.on_error(_ec);
+        } else {
+          _sink.on_complete();
+        }
+      }
+      _delivering = false;
+
+      if (_terminated) {
+        die();
+      }
+    }
+
+    bool upstream_stalled() const {
+      return _next < _received && (_source_done || _received == _requested_upstream);
+    }
+
+    // keeps at most _max_in_flight elements requested from upstream but not yet
+    // delivered downstream.
+    void request_upstream() {
+      if (!_source) {
+        return;
+      }
+      const long n = _max_in_flight - (_requested_upstream - _next);
+      if (n > 0) {
+        _requested_upstream += n;
+        _source->request(static_cast<int>(n));
+      }
+    }
+
+    void die() {
+      LOG(5) << "parallel_map_op(" << this << ")::die";
+      if (_source) {
+        _source->cancel();
+        _source = nullptr;
+      }
+
+      {
+        std::lock_guard<std::mutex> guard(_state->mutex);
+        _state->stopped = true;
+        _state->jobs.clear();
+        _state->results.clear();
+        _state->on_job.notify_all();
+      }
+
+      for (auto &w : _workers) {
+        w.detach();
+      }
+      delete this;
+    }
+
+    static void worker_loop(std::shared_ptr<state> st) {
+      threadutils::set_current_thread_name("parallel_map");
+
+      std::unique_lock<std::mutex> lock(st->mutex);
+      while (true) {
+        while (!st->stopped && st->jobs.empty()) {
+          st->on_job.wait(lock);
+        }
+        if (st->stopped) {
+          return;
+        }
+
+        auto job = std::move(st->jobs.front());
+        st->jobs.pop_front();
+        lock.unlock();
+
+        T result = st->fn(std::move(job.second));
+
+        lock.lock();
+        if (st->stopped) {
+          return;
+        }
+        st->results.emplace(job.first, std::move(result));
+        st->on_result.notify_one();
+      }
+    }
+
+    subscriber<T> &_sink;
+    const long _max_in_flight;
+    std::shared_ptr<state> _state;
+    std::vector<std::thread> _workers;
+    subscription *_source{nullptr};
+
+    // the rest is guarded by delivery_mutex.
+    long _received{0};
+    long _requested{0};
+    long _delivered{0};
+    long _requested_upstream{0};
+    long _next{0};
+    bool _delivering{false};
+    bool _terminated{false};
+    bool _source_done{false};
+    std::error_condition _ec;
+  };
+
+ private:
+  const size_t _threads;
+  std::decay_t<Fn> _fn;
+};
+
+}  // namespace impl
+
+// parallel_map transforms each element of a stream with fn using a pool of
+// n_threads threads. Elements are delivered in the original order, at most
+// 2 * n_threads elements are processed at the same time. fn is called concurrently
+// and should be thread-safe.
+// Worker threads never call upstream or downstream: results are delivered and
+// upstream is requested from the threads calling on_next() and request(). A
+// finished result waits for the next such call unless upstream has used all of
+// its credit or is done, then the calling thread blocks until it is ready.
+template <typename Fn>
+auto parallel_map(size_t n_threads, Fn &&fn) {
+  return impl::parallel_map_op<Fn>(n_threads, std::forward<Fn>(fn));
+}
+
+}  // namespace streams
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,129 @@
+// Opt-in per-stage stream instrumentation.
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "../metrics.h"
+#include "../stopwatch.h"
+#include "streams.h"
+
+namespace satori {
+namespace video {
+namespace streams {
+
+namespace impl {
+
+inline prometheus::Family<prometheus::Counter> &stream_stage_elements_total() {
+  static auto &family = prometheus::BuildCounter()
+                            .Name("stream_stage_elements_total")
+                            .Register(metrics_registry());
+  return family;
+}
+
+inline prometheus::Family<prometheus::Gauge> &stream_stage_requested() {
+  static auto &family = prometheus::BuildGauge()
+                            .Name("stream_stage_requested")
+                            .Register(metrics_registry());
+  return family;
+}
+
+inline prometheus::Family<prometheus::Histogram> &stream_stage_on_next_micros() {
+  static auto &family = prometheus::BuildHistogram()
+                            .Name("stream_stage_on_next_micros")
+                            .Register(metrics_registry());
+  return family;
+}
+
+class profile_op {
+ public:
+  explicit profile_op(const std::string &stage) : _stage(stage) {}
+
+  template <typename T>
+  class instance : public subscriber<T>, private subscription {
+   public:
+    using value_t = T;
+
+    static publisher<T> apply(publisher<T> &&source, profile_op &&op) {
+      return publisher<T>(
+          new op_publisher<T, T, profile_op>(std::move(source), std::move(op)));
+    }
+
+    instance(profile_op &&op, subscriber<T> &sink)
+        : _elements(stream_stage_elements_total().Add({{"stage", op._stage}})),
+          _requested(stream_stage_requested().Add({{"stage", op._stage}})),
+          _on_next_micros(stream_stage_on_next_micros().Add(
+              {{"stage", op._stage}},
+              std::vector<double>{0,     5,     10,     20,     50,     100,
+                                  200,   500,   1000,   2000,   5000,   10000,
+                                  20000, 50000, 100000, 200000, 500000, 1000000})),
+          _sink(sink) {}
+
+    ~instance() override {
+      // credit which will never be delivered.
+      _requested.Decrement(_outstanding);
+    }
+
+   private:
+    void on_next(T &&t) override {
+      _elements.Increment();
+      _outstanding--;
+      _requested.Decrement();
+      // downstream might cancel and destroy this instance from on_next.
+      prometheus::Histogram &on_next_micros = _on_next_micros;
+      stopwatch<std::chrono::steady_clock> s;
+      _sink.on_next(std::move(t));
+      on_next_micros.Observe(s.micros());
+    }
+
+    void on_error(std::error_condition ec) override {
+      _sink.on_error(ec);
+      delete this;
+    }
+
+    void on_complete() override {
+      _sink.on_complete();
+      delete this;
+    }
+
+    void on_subscribe(subscription &s) override {
+      CHECK(!_source);
+      _source = &s;
+      _sink.on_subscribe(*this);
+    }
+
+    void request(int n) override {
+      _outstanding += n;
+      _requested.Increment(n);
+      _source->request(n);
+    }
+
+    void cancel() override {
+      _source->cancel();
+      delete this;
+    }
+
+    prometheus::Counter &_elements;
+    prometheus::Gauge &_requested;
+    prometheus::Histogram &_on_next_micros;
+    long _outstanding{0};
+    subscriber<T> &_sink;
+    subscription *_source{nullptr};
+  };
+
+ private:
+  const std::string _stage;
+};
+
+}  // namespace impl
+
+// profile operation passes elements through unchanged and reports metrics
+// labeled with stage name: number of elements, credit requested from upstream
+// but not delivered yet, and time spent in downstream on_next. The latter includes
+// all synchronous stages after this point, so profiling two points of a pipeline
+// gives the cost of stages between them.
+inline auto profile(const std::string &stage) { return impl::profile_op(stage); }
+
+}  // namespace streams
+}  // namespace video
+}  // namespace satori
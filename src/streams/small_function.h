@@ -0,0 +1,142 @@
+// small_function<R(Args...)> - move-only std::function replacement, which keeps
+// callables of up to Capacity bytes inline instead of allocating them.
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "../logging.h"
+
+namespace satori {
+namespace video {
+namespace streams {
+
+template <typename Signature, size_t Capacity = 64>
+class small_function;
+
+template <typename R, typename... Args, size_t Capacity>
+class small_function<R(Args...), Capacity> {
+ public:
+  small_function() = default;
+
+  template <typename Fn, typename = typename std::enable_if<!std::is_same<
+                             typename std::decay<Fn>::type, small_function>::value>::type>
+  small_function(Fn &&fn) {  // NOLINT
+    emplace(std::forward<Fn>(fn));
+  }
+
+  small_function(small_function &&other) noexcept { move_from(other); }
+
+  small_function &operator=(small_function &&other) noexcept {
+    if (this != &other) {
+      reset();
+      move_from(other);
+    }
+    return *this;
+  }
+
+  small_function(const small_function &) = delete;
+  small_function &operator=(const small_function &) = delete;
+
+  ~small_function() { reset(); }
+
+  explicit operator bool() const { return _ops != nullptr; }
+
+  R operator()(Args... args) {
+    CHECK(_ops);
+    return _ops->invoke(&_storage, std::forward<Args>(args)...);
+  }
+
+  void reset() {
+    if (_ops) {
+      _ops->destroy(&_storage);
+      _ops = nullptr;
+    }
+  }
+
+ private:
+  using storage_t =
+      typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type;
+
+  struct ops {
+    R (*invoke)(void *storage, Args &&... args);
+    // moves callable into uninitialized storage and destroys it in source one.
+    void (*relocate)(void *from, void *to);
+    void (*destroy)(void *storage);
+  };
+
+  template <typename Fn>
+  struct fits_inline {
+    static constexpr bool value = sizeof(Fn) <= Capacity
+                                  && alignof(Fn) <= alignof(std::max_align_t)
+                                  && std::is_nothrow_move_constructible<Fn>::value;
+  };
+
+  template <typename Fn>
+  struct inline_ops {
+    static Fn &get(void *storage) { return *static_cast<Fn *>(storage); }
+
+    static R invoke(void *storage, Args &&... args) {
+      return get(storage)(std::forward<Args>(args)...);
+    }
+
+    static void relocate(void *from, void *to) {
+      new (to) Fn(std::move(get(from)));
+      get(from).~Fn();
+    }
+
+    static void destroy(void *storage) { get(storage).~Fn(); }
+
+    static const ops *table() {
+      static const ops result{&invoke, &relocate, &destroy};
+      return &result;
+    }
+  };
+
+  template <typename Fn>
+  struct heap_ops {
+    static Fn *&get(void *storage) { return *static_cast<Fn **>(storage); }
+
+    static R invoke(void *storage, Args &&... args) {
+      return (*get(storage))(std::forward<Args>(args)...);
+    }
+
+    static void relocate(void *from, void *to) { new (to) Fn *(get(from)); }
+
+    static void destroy(void *storage) { delete get(storage); }
+
+    static const ops *table() {
+      static const ops result{&invoke, &relocate, &destroy};
+      return &result;
+    }
+  };
+
+  template <typename F, typename Fn = typename std::decay<F>::type>
+  typename std::enable_if<fits_inline<Fn>::value>::type emplace(F &&fn) {
+    new (&_storage) Fn(std::forward<F>(fn));
+    _ops = inline_ops<Fn>::table();
+  }
+
+  template <typename F, typename Fn = typename std::decay<F>::type>
+  typename std::enable_if<!fits_inline<Fn>::value>::type emplace(F &&fn) {
+    new (&_storage) Fn *(new Fn(std::forward<F>(fn)));
+    _ops = heap_ops<Fn>::table();
+  }
+
+  void move_from(small_function &other) {
+    if (other._ops) {
+      other._ops->relocate(&other._storage, &_storage);
+      _ops = other._ops;
+      other._ops = nullptr;
+    }
+  }
+
+  storage_t _storage;
+  const ops *_ops{nullptr};
+};
+
+}  // namespace streams
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,112 @@
+// Bounded lock-free single-producer/single-consumer queue.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace satori {
+namespace video {
+namespace streams {
+
+// Fixed capacity ring buffer. try_push() has to be called from a single producer
+// thread, try_pop()/consume_all() - from a single consumer thread.
+template <typename T>
+class spsc_queue {
+ public:
+  explicit spsc_queue(size_t capacity)
+      : _size(capacity + 1), _slots(new slot_t[capacity + 1]) {}
+
+  spsc_queue(const spsc_queue &) = delete;
+  spsc_queue &operator=(const spsc_queue &) = delete;
+
+  ~spsc_queue() {
+    consume_all([](T &&) {});
+  }
+
+  // returns false if queue is full, t is left untouched in this case.
+  bool try_push(T &&t) {
+    const size_t tail = _tail.load(std::memory_order_relaxed);
+    const size_t next = increment(tail);
+    if (next == _head_cache) {
+      _head_cache = _head.load(std::memory_order_acquire);
+      if (next == _head_cache) {
+        return false;
+      }
+    }
+
+    ::new (&_slots[tail]) T(std::move(t));
+    _tail.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // returns false if queue is empty.
+  bool try_pop(T &t) {
+    auto assign = [&t](T &&item) { t = std::move(item); };
+    return consume_one(assign);
+  }
+
+  // moves all available elements into fn, returns number of consumed elements.
+  template <typename Fn>
+  size_t consume_all(Fn &&fn) {
+    size_t n = 0;
+    while (consume_one(fn)) {
+      n++;
+    }
+    return n;
+  }
+
+  bool empty() const {
+    return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+  }
+
+  size_t size() const {
+    const size_t head = _head.load(std::memory_order_acquire);
+    const size_t tail = _tail.load(std::memory_order_acquire);
+    return tail >= head ? tail - head : _size - head + tail;
+  }
+
+  size_t capacity() const { return _size - 1; }
+
+ private:
+  static constexpr size_t cache_line_size = 64;
+  using slot_t = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+  template <typename Fn>
+  bool consume_one(Fn &fn) {
+    const size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail_cache) {
+      _tail_cache = _tail.load(std::memory_order_acquire);
+      if (head == _tail_cache) {
+        return false;
+      }
+    }
+
+    T *item = reinterpret_cast<T *>(&_slots[head]);
+    fn(std::move(*item));
+    item->~T();
+    _head.store(increment(head), std::memory_order_release);
+    return true;
+  }
+
+  size_t increment(size_t i) const { return i + 1 == _size ? 0 : i + 1; }
+
+  const size_t _size;
+  const std::unique_ptr<slot_t[]> _slots;
+
+  // producer and consumer indices are kept on separate cache lines to avoid
+  // false sharing between threads.
+  char _pad0[cache_line_size];
+  std::atomic<size_t> _head{0};
+  size_t _tail_cache{0};  // consumer's copy of _tail
+  char _pad1[cache_line_size];
+  std::atomic<size_t> _tail{0};
+  size_t _head_cache{0};  // producer's copy of _head
+  char _pad2[cache_line_size];
+};
+
+}  // namespace streams
+}  // namespace video
+}  // namespace satori
@@ -38,6 +38,25 @@ struct subscriber : observer<T> {
   virtual void on_subscribe(subscription &s) = 0;
 };
 
+// Helper for subscribers which handle elements one by one: requests elements in
+// windows of given size and replenishes credit once half of it is consumed,
+// instead of paying for request(1) round trip per element.
+class request_window {
+ public:
+  explicit request_window(int size);
+
+  // requests first window.
+  void start(subscription &s);
+
+  // should be called after each received element.
+  void on_consumed();
+
+ private:
+  const int _size;
+  subscription *_src{nullptr};
+  int _outstanding{0};
+};
+
 template <typename T>
 struct publisher_impl {
   using value_t = T;
@@ -113,6 +132,19 @@ struct publishers {
     publishers.push_back(std::move(p2));
     return merge(std::move(publishers));
   }
+
+  // Same as merge, but buffered items of earlier publishers are always delivered
+  // before items of later ones.
+  template <typename T>
+  static publisher<T> merge_prioritized(std::vector<publisher<T>> &&publishers);
+
+  template <typename T>
+  static publisher<T> merge_prioritized(publisher<T> &&high, publisher<T> &&low) {
+    std::vector<publisher<T>> publishers;
+    publishers.push_back(std::move(high));
+    publishers.push_back(std::move(low));
+    return merge_prioritized(std::move(publishers));
+  }
 };
 
 template <typename T>
@@ -149,9 +181,16 @@ template <typename Predicate>
 auto take_while(Predicate &&p);
 
 // map operation transforms each element into immediate value.
+// Consecutive maps can be fused into a single stage at compile time:
+// src >> (map(f) >> map(g)) is equivalent to src >> map(f) >> map(g).
 template <typename Fn>
 auto map(Fn &&fn);
 
+// filter_map operation transforms each element into boost::optional value, empty
+// values are dropped. Cheaper alternative to flat_map for 0-or-1 element results.
+template <typename Fn>
+auto filter_map(Fn &&fn);
+
 // flat_map operation transforms each element a stream and produces element out of them
 // consequently.
 template <typename Fn>
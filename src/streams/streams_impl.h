@@ -1,6 +1,8 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <boost/optional.hpp>
 #include <chrono>
 #include <climits>
 #include <deque>
@@ -20,6 +22,26 @@ namespace video {
 
 namespace streams {
 
+inline request_window::request_window(int size) : _size(size) { CHECK_GT(_size, 0); }
+
+inline void request_window::start(subscription &s) {
+  _src = &s;
+  _outstanding = _size;
+  _src->request(_size);
+}
+
+inline void request_window::on_consumed() {
+  CHECK(_src);
+  CHECK_GT(_outstanding, 0);
+  _outstanding--;
+  if (_outstanding <= _size / 2) {
+    const int n = _size - _outstanding;
+    _outstanding = _size;
+    // might be reentered from request().
+    _src->request(n);
+  }
+}
+
 template <typename T>
 template <typename OnNext>
 deferred<void> publisher_impl<T>::process(OnNext &&on_next) {
@@ -67,6 +89,14 @@ struct strip_publisher<publisher<T>> {
   using type = T;
 };
 
+template <typename T>
+struct strip_optional {};
+
+template <typename T>
+struct strip_optional<boost::optional<T>> {
+  using type = T;
+};
+
 // special type of source that needs to be pull-drained.
 template <typename T>
 class drain_source_impl : public subscription {
@@ -439,8 +469,11 @@ class merge_publisher : public publisher_impl<T> {
   template <typename T1>
   class downstream : public subscription {
    public:
-    downstream(subscriber<T> &sink, size_t expected_number_of_upstreams)
-        : _sink(&sink), _expected_number_of_upstreams(expected_number_of_upstreams) {
+    downstream(subscriber<T> &sink, size_t expected_number_of_upstreams,
+               bool prioritized)
+        : _sink(&sink),
+          _expected_number_of_upstreams(expected_number_of_upstreams),
+          _prioritized(prioritized) {
       LOG(5) << this << " merge_publisher::downstream::ctor";
     }
 
@@ -460,10 +493,10 @@ class merge_publisher : public publisher_impl<T> {
 
       CHECK(_upstreams.find(u->id) != _upstreams.end());
 
-      _items.push_back(std::move(t));
+      push_item(u->id, std::move(t));
 
       while (_items_needed > 0 && !_items.empty()) {
-        T item = std::move(_items.front());
+        T item = std::move(_items.front().second);
         _items.pop_front();
         _items_needed--;
 
@@ -528,7 +561,7 @@ class merge_publisher : public publisher_impl<T> {
       _items_needed += n;
 
       while (_items_needed > 0 && !_items.empty()) {
-        T item = std::move(_items.front());
+        T item = std::move(_items.front().second);
         _items.pop_front();
         _items_needed--;
         n--;
@@ -584,6 +617,19 @@ class merge_publisher : public publisher_impl<T> {
     }
 
    private:
+    // in prioritized mode items of upstreams with lower ids go first, otherwise
+    // items are kept in arrival order.
+    void push_item(upstream_id uid, T &&t) {
+      auto it = _items.end();
+      if (_prioritized) {
+        it = std::find_if(_items.begin(), _items.end(),
+                          [uid](const std::pair<upstream_id, T> &item) {
+                            return item.first > uid;
+                          });
+      }
+      _items.emplace(it, uid, std::move(t));
+    }
+
     bool is_complete() const noexcept {
       if (_upstreams.size() < _expected_number_of_upstreams) {
         return false;
@@ -641,14 +687,15 @@ class merge_publisher : public publisher_impl<T> {
 
     subscriber<T> *_sink{nullptr};
     const size_t _expected_number_of_upstreams{0};
+    const bool _prioritized{false};
     std::map<upstream_id, std::pair<upstream<T> *, subscription *>> _upstreams;
-    std::deque<T> _items;
+    std::deque<std::pair<upstream_id, T>> _items;
     long _items_needed{0};
     int _call_stack_depth{0};
   };
 
-  merge_publisher(std::vector<publisher<T>> &&publishers)
-      : _publishers(std::move(publishers)) {
+  merge_publisher(std::vector<publisher<T>> &&publishers, bool prioritized)
+      : _publishers(std::move(publishers)), _prioritized(prioritized) {
     LOG(5) << this << " merge_publisher::ctor";
   }
 
@@ -658,7 +705,7 @@ class merge_publisher : public publisher_impl<T> {
     CHECK(!_subscribed) << "already subscribed";
     _subscribed = true;
 
-    auto d = new downstream<T>(s, _publishers.size());
+    auto d = new downstream<T>(s, _publishers.size(), _prioritized);
     upstream_id uid{0};
     for (auto &p : _publishers) {
       p->subscribe(*(new upstream<T>(uid++, *d)));
@@ -667,6 +714,7 @@ class merge_publisher : public publisher_impl<T> {
   }
 
   std::vector<publisher<T>> _publishers;
+  const bool _prioritized;
   bool _subscribed{false};
 };
 
@@ -745,6 +793,97 @@ class map_op {
 
   explicit map_op(Fn &&fn) : _fn(fn) {}
 
+ private:
+  template <typename F, typename G>
+  friend auto operator>>(map_op<F> &&first, map_op<G> &&second);
+
+  Fn _fn;
+};
+
+// single function doing the job of two consecutive map stages.
+template <typename F, typename G>
+class fused_map_fn {
+  using arg_t = typename function_traits<F>::template arg<0>::type;
+  using result_t = typename function_traits<G>::result_type;
+
+ public:
+  fused_map_fn(F &&f, G &&g) : _f(std::move(f)), _g(std::move(g)) {}
+
+  result_t operator()(arg_t arg) { return _g(_f(std::forward<arg_t>(arg))); }
+
+ private:
+  F _f;
+  G _g;
+};
+
+// map(f) >> map(g) is the same as map(g(f(x))), but takes one stage in pipeline.
+template <typename F, typename G>
+auto operator>>(map_op<F> &&first, map_op<G> &&second) {
+  using fn_t = fused_map_fn<std::decay_t<F>, std::decay_t<G>>;
+  return map_op<fn_t>{fn_t{std::decay_t<F>(std::forward<F>(first._fn)),
+                           std::decay_t<G>(std::forward<G>(second._fn))}};
+}
+
+template <typename Fn>
+class filter_map_op {
+  using Tx = typename function_traits<std::decay_t<Fn>>::result_type;
+  using T = typename impl::strip_optional<Tx>::type;
+
+ public:
+  template <typename S>
+  class instance : public subscriber<S>, private subscription {
+   public:
+    using value_t = T;
+
+    static publisher<value_t> apply(publisher<S> &&source, filter_map_op<Fn> &&op) {
+      return publisher<value_t>(
+          new op_publisher<S, T, filter_map_op<Fn>>(std::move(source), std::move(op)));
+    }
+
+    instance(filter_map_op<Fn> &&op, subscriber<T> &sink)
+        : _fn(std::move(op._fn)), _sink(sink) {}
+
+   private:
+    void on_next(S &&s) override {
+      Tx t = _fn(std::move(s));
+      if (t) {
+        _sink.on_next(std::move(t.get()));
+      } else {
+        // element was dropped, downstream still waits for it.
+        _source->request(1);
+      }
+    }
+
+    void on_error(std::error_condition ec) override {
+      _sink.on_error(ec);
+      delete this;
+    }
+
+    void on_complete() override {
+      _sink.on_complete();
+      delete this;
+    }
+
+    void on_subscribe(subscription &s) override {
+      CHECK(!_source);
+      _source = &s;
+      _sink.on_subscribe(*this);
+    }
+
+    void request(int n) override { _source->request(n); }
+
+    void cancel() override {
+      _source->cancel();
+      delete this;
+    }
+
+    Fn _fn;
+    subscriber<T> &_sink;
+    subscription *_source{nullptr};
+  };
+
+  explicit filter_map_op(Fn &&fn) : _fn(fn) {}
+
  private:
   Fn _fn;
 };
@@ -1249,7 +1388,12 @@ publisher<T> publishers::concat(std::vector<publisher<T>> &&publishers) {
 
 template <typename T>
 publisher<T> publishers::merge(std::vector<publisher<T>> &&publishers) {
-  return publisher<T>(new impl::merge_publisher<T>(std::move(publishers)));
+  return publisher<T>(new impl::merge_publisher<T>(std::move(publishers), false));
+}
+
+template <typename T>
+publisher<T> publishers::merge_prioritized(std::vector<publisher<T>> &&publishers) {
+  return publisher<T>(new impl::merge_publisher<T>(std::move(publishers), true));
 }
 
 template <typename T, typename Op>
@@ -1267,6 +1411,11 @@ auto map(Fn &&fn) {
   return impl::map_op<Fn>{std::forward<Fn>(fn)};
 }
 
+template <typename Fn>
+auto filter_map(Fn &&fn) {
+  return impl::filter_map_op<Fn>{std::forward<Fn>(fn)};
+}
+
 template <typename Predicate>
 auto take_while(Predicate &&p) {
   return impl::take_while_op<Predicate>{std::forward<Predicate>(p)};
@@ -1,24 +1,222 @@
 #pragma once
 
 #include <boost/variant.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 #include "../metrics.h"
 #include "../threadutils.h"
 
 #include "channel.h"
+#include "executor.h"
+#include "spsc_queue.h"
 #include "streams.h"
 
 namespace satori {
 namespace video {
 namespace streams {
 
+// Defines what threaded worker does when its input queue is full.
+enum class overflow_policy {
+  // incoming element is dropped.
+  DROP_NEWEST,
+  // oldest queued element is dropped to make room for incoming one.
+  DROP_OLDEST,
+  // incoming element and all following elements are dropped until is_key_frame()
+  // returns true. Queued elements are dropped if a key frame doesn't fit.
+  DROP_UNTIL_KEY_FRAME,
+  // all queued elements are dropped and replaced with incoming one.
+  COALESCE_TO_LATEST,
+};
+
+inline const char *to_string(overflow_policy policy) {
+  switch (policy) {
+    case overflow_policy::DROP_NEWEST:
+      return "drop-newest";
+    case overflow_policy::DROP_OLDEST:
+      return "drop-oldest";
+    case overflow_policy::DROP_UNTIL_KEY_FRAME:
+      return "drop-until-key-frame";
+    case overflow_policy::COALESCE_TO_LATEST:
+      return "coalesce-to-latest";
+  }
+  ABORT() << "unreachable code";
+  return "";
+}
+
+inline boost::optional<overflow_policy> parse_overflow_policy(const std::string &str) {
+  for (auto policy :
+       {overflow_policy::DROP_NEWEST, overflow_policy::DROP_OLDEST,
+        overflow_policy::DROP_UNTIL_KEY_FRAME, overflow_policy::COALESCE_TO_LATEST}) {
+    if (str == to_string(policy)) {
+      return policy;
+    }
+  }
+  return {};
+}
+
+// Number of elements queued in front of a threaded worker. Upstream stages may
+// read it from any thread to shed work while the worker falls behind.
+using queue_depth = std::atomic<size_t>;
+
 namespace impl {
 
+// Elements without key frame information are all treated as key frames.
+// Types which have it should provide is_key_frame() overload in their namespace.
+template <typename T>
+bool is_key_frame(const T & /*t*/) {
+  return true;
+}
+
+inline prometheus::Family<prometheus::Counter> &threaded_worker_dropped_total() {
+  static auto &family = prometheus::BuildCounter()
+                            .Name("threaded_worker_dropped_total")
+                            .Register(metrics_registry());
+  return family;
+}
+
+inline prometheus::Family<prometheus::Gauge> &threaded_worker_queue_size() {
+  static auto &family = prometheus::BuildGauge()
+                            .Name("threaded_worker_queue_size")
+                            .Register(metrics_registry());
+  return family;
+}
+
+// Queue which applies overflow policy once it has max_size elements.
+// Not thread-safe.
+template <typename T>
+class overflow_buffer {
+ public:
+  overflow_buffer(const std::string &name, boost::optional<size_t> max_size,
+                  overflow_policy policy, const std::shared_ptr<queue_depth> &depth)
+      : _name(name),
+        _max_size(max_size),
+        _policy(policy),
+        _dropped(threaded_worker_dropped_total().Add(
+            {{"worker", name}, {"policy", to_string(policy)}})),
+        _queue_size(threaded_worker_queue_size().Add({{"worker", name}})),
+        _depth(depth) {}
+
+  // returns false if t was dropped.
+  bool push(T &&t) {
+    if (!make_room(t)) {
+      return false;
+    }
+    _queue.emplace(std::move(t));
+    on_queued(_queue.size());
+    return true;
+  }
+
+  bool empty() const { return _queue.empty(); }
+
+  size_t size() const { return _queue.size(); }
+
+  void swap(std::queue<T> &q) {
+    _queue.swap(q);
+    on_queued(_queue.size());
+  }
+
+  // publishes the number of queued elements, for queues kept outside of buffer.
+  void on_queued(size_t n) {
+    if (_depth) {
+      _depth->store(n, std::memory_order_relaxed);
+    }
+  }
+
+  // logs only the beginning and the end of each overflow period.
+  void on_dropped(size_t n) {
+    if (n == 0) {
+      return;
+    }
+    if (_dropped_in_row == 0) {
+      LOG(ERROR) << _name << " input queue is full, dropping frames ("
+                 << to_string(_policy) << ")";
+    }
+    _dropped_in_row += n;
+    _dropped.Increment(n);
+  }
+
+  // reports how many elements were queued when worker picked them up, can be
+  // called from any thread.
+  void on_drained(size_t n) { _queue_size.Set(n); }
+
+  void on_accepted() {
+    if (_dropped_in_row > 0 && !_waiting_for_key_frame) {
+      LOG(INFO) << _name << " input queue recovered, dropped " << _dropped_in_row
+                << " frames";
+      _dropped_in_row = 0;
+    }
+  }
+
+ private:
+  // applies overflow policy, returns false if t should be dropped.
+  bool make_room(const T &t) {
+    if (_policy == overflow_policy::DROP_UNTIL_KEY_FRAME && _waiting_for_key_frame) {
+      if (!is_key_frame(t)) {
+        on_dropped(1);
+        return false;
+      }
+      _waiting_for_key_frame = false;
+    }
+
+    if (!_max_size || _queue.size() < _max_size.get()) {
+      on_accepted();
+      return true;
+    }
+
+    switch (_policy) {
+      case overflow_policy::DROP_NEWEST:
+        on_dropped(1);
+        return false;
+      case overflow_policy::DROP_OLDEST:
+        _queue.pop();
+        on_dropped(1);
+        return true;
+      case overflow_policy::DROP_UNTIL_KEY_FRAME:
+        if (!is_key_frame(t)) {
+          _waiting_for_key_frame = true;
+          on_dropped(1);
+          return false;
+        }
+        // queued frames are stale, start over from the new key frame.
+        on_dropped(_queue.size());
+        std::queue<T>().swap(_queue);
+        return true;
+      case overflow_policy::COALESCE_TO_LATEST:
+        on_dropped(_queue.size());
+        std::queue<T>().swap(_queue);
+        return true;
+    }
+    ABORT() << "unreachable code";
+    return false;
+  }
+
+  const std::string _name;
+  const boost::optional<size_t> _max_size;
+  const overflow_policy _policy;
+  prometheus::Counter &_dropped;
+  prometheus::Gauge &_queue_size;
+  const std::shared_ptr<queue_depth> _depth;
+  size_t _dropped_in_row{0};
+  bool _waiting_for_key_frame{false};
+  std::queue<T> _queue;
+};
+
 class threaded_worker_op {
  public:
-  explicit threaded_worker_op(const std::string &name, boost::optional<size_t> max_queued_frames)
-      : _name(name), _max_queued_frames(max_queued_frames) {}
+  threaded_worker_op(executor *exec, const std::string &name,
+                     boost::optional<size_t> max_queued_frames, overflow_policy policy,
+                     const std::shared_ptr<queue_depth> &depth,
+                     const std::vector<int> &cpus = {})
+      : _executor(exec),
+        _name(name),
+        _max_queued_frames(max_queued_frames),
+        _policy(policy),
+        _depth(depth),
+        _cpus(cpus) {}
 
   template <typename T>
   class instance : publisher_impl<std::queue<T>> {
@@ -26,15 +224,27 @@ class threaded_worker_op {
 
     class source : drain_source_impl<element_t>, subscriber<T> {
      public:
-      source(const std::string &name, boost::optional<size_t> max_queued_frames, publisher<T> &&src,
+      source(const std::string &name, boost::optional<size_t> max_queued_frames,
+             overflow_policy policy, const std::shared_ptr<queue_depth> &depth,
+             const std::vector<int> &cpus, publisher<T> &&src,
              streams::subscriber<element_t> &sink)
           : _name(name),
+            _cpus(cpus),
             _max_queued_frames(max_queued_frames),
+            _policy(policy),
+            _buffer(name, max_queued_frames, policy, depth),
             drain_source_impl<element_t>(sink) {
+        // only producer can drop elements from lock-free queue.
+        if (_max_queued_frames && _policy == overflow_policy::DROP_NEWEST) {
+          _ring = std::make_unique<spsc_queue<T>>(_max_queued_frames.get());
+        }
         _worker_thread = std::make_unique<std::thread>(&source::worker_thread_loop, this);
 
-        while (!_worker_thread_ready) {
-          std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        {
+          std::unique_lock<std::mutex> lock(_mutex);
+          while (!_worker_thread_ready) {
+            _on_ready.wait(lock);
+          }
         }
         src->subscribe(*this);
       }
@@ -59,14 +269,29 @@ class threaded_worker_op {
       }
 
       void on_next(T &&t) override {
+        if (_ring) {
+          CHECK_NOTNULL(_src) << this << " " << _name;
+          if (!_ring->try_push(std::move(t))) {
+            _buffer.on_dropped(1);
+            return;
+          }
+          _buffer.on_accepted();
+          _buffer.on_queued(_ring->size());
+          // pairs with the fence in wait_for_frames(): either worker sees the new
+          // element or we see that it is parked.
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          if (_parked.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> guard(_mutex);
+            _on_send.notify_one();
+          }
+          return;
+        }
+
         std::lock_guard<std::mutex> guard(_mutex);
         CHECK_NOTNULL(_src) << this << " " << _name;
-        if (_max_queued_frames && _buffer.size() >= _max_queued_frames.get()) {
-          LOG(ERROR) << this << " input queue is full";
-          return;
+        if (_buffer.push(std::move(t))) {
+          _on_send.notify_one();
         }
-        _buffer.emplace(std::move(t));
-        _on_send.notify_one();
       }
 
       void on_error(std::error_condition ec) override {
@@ -91,23 +316,14 @@ class threaded_worker_op {
 
       void worker_thread_loop() noexcept {
         threadutils::set_current_thread_name(_name);
+        threadutils::set_current_thread_affinity(_cpus);
         LOG(INFO) << this << " " << _name << " started worker thread";
         drain_source_impl<element_t>::deliver_on_subscribe();
+        set_ready();
 
-        while (_thread_should_be_active) {
-          {
-            std::unique_lock<std::mutex> lock(_mutex);
-            _worker_thread_ready = true;
-            while (_thread_should_be_active && _buffer.empty()) {
-              LOG(5) << this << " " << _name << " waiting for _on_send";
-              _on_send.wait(lock);
-            }
-
-            if (_buffer.empty() || !(_thread_should_be_active || _complete || _ec)) {
-              break;
-            }
-          }
-
+        // upstream might complete before worker had a chance to drain everything,
+        // so keep going until there are no frames left.
+        while (wait_for_frames()) {
           drain_source_impl<element_t>::drain();
         }
 
@@ -124,7 +340,7 @@ class threaded_worker_op {
         LOG(INFO) << this << " " << _name
                   << " finished worker thread loop: " << finish_reason;
 
-        _worker_thread_ready = true;
+        set_ready();
 
         if (!_cancelled) {
           if (_complete) {
@@ -138,6 +354,43 @@ class threaded_worker_op {
         delete this;
       }
 
+      void set_ready() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (!_worker_thread_ready) {
+          _worker_thread_ready = true;
+          _on_ready.notify_one();
+        }
+      }
+
+      bool has_frames() const { return _ring ? !_ring->empty() : !_buffer.empty(); }
+
+      // blocks until there are frames to deliver, returns false if worker loop
+      // should be finished.
+      bool wait_for_frames() {
+        if (_ring) {
+          // frames usually arrive in bursts, so spin a bit before going to sleep.
+          for (int i = 0;
+               i < spin_iterations && _thread_should_be_active && _ring->empty(); i++) {
+            std::this_thread::yield();
+          }
+          if (_thread_should_be_active && !_cancelled && !_ring->empty()) {
+            return true;
+          }
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _parked.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (_thread_should_be_active && !has_frames()) {
+          LOG(5) << this << " " << _name << " waiting for _on_send";
+          _on_send.wait(lock);
+        }
+        _parked.store(false, std::memory_order_relaxed);
+
+        return has_frames() && !_cancelled
+               && (_thread_should_be_active || _complete || _ec);
+      }
+
       void die() override {
         LOG(INFO) << this << " " << _name << " die() from "
                   << threadutils::get_current_thread_name();
@@ -159,10 +412,15 @@ class threaded_worker_op {
           // drain only on worker thread
           return false;
         }
-        LOG(5) << this << " " << _name << " drain_impl " << _buffer.size();
         std::queue<T> tmp;
 
-        {
+        if (_ring) {
+          _ring->consume_all([&tmp](T &&t) { tmp.emplace(std::move(t)); });
+          if (tmp.empty()) {
+            return false;
+          }
+          _buffer.on_queued(_ring->size());
+        } else {
           std::unique_lock<std::mutex> lock(_mutex);
           if (_buffer.empty()) {
             return false;
@@ -171,56 +429,295 @@ class threaded_worker_op {
         }
 
         LOG(5) << this << " " << _name << " delivering batch: " << tmp.size();
+        _buffer.on_drained(tmp.size());
         drain_source_impl<element_t>::deliver_on_next(std::move(tmp));
         return false;
       }
 
-      std::atomic_bool _worker_thread_ready{false};
+      static constexpr int spin_iterations = 100;
+
+      bool _worker_thread_ready{false};
       const std::string _name;
+      const std::vector<int> _cpus;
       const boost::optional<size_t> _max_queued_frames;
+      const overflow_policy _policy;
       std::mutex _mutex;
       std::condition_variable _on_send;
+      std::condition_variable _on_ready;
+      std::atomic_bool _parked{false};
 
       std::atomic_bool _complete{false};
-      bool _cancelled{false};
+      std::atomic_bool _cancelled{false};
       std::error_condition _ec;
 
-      std::queue<T> _buffer;
+      // bounded lock-free queue is used when max_queued_frames is set and policy is
+      // DROP_NEWEST, mutex-protected _buffer otherwise.
+      std::unique_ptr<spsc_queue<T>> _ring;
+      overflow_buffer<T> _buffer;
       std::unique_ptr<std::thread> _worker_thread;
       std::atomic_bool _thread_should_be_active{true};
       subscription *_src{nullptr};
     };
 
+    // Same as source, but instead of owning a thread, schedules itself on executor.
+    // At most one task per source is scheduled at any time, so elements are
+    // still delivered in order. Like source, it subscribes to upstream on the
+    // calling thread, only delivery to downstream goes through executor.
+    class executor_source : drain_source_impl<element_t>, subscriber<T> {
+     public:
+      executor_source(executor &exec, const std::string &name,
+                      boost::optional<size_t> max_queued_frames, overflow_policy policy,
+                      const std::shared_ptr<queue_depth> &depth, publisher<T> &&src,
+                      streams::subscriber<element_t> &sink)
+          : drain_source_impl<element_t>(sink),
+            _executor(exec),
+            _name(name),
+            _buffer(name, max_queued_frames, policy, depth) {
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          _subscribe_pending = true;
+          _subscribing = true;
+          schedule();
+        }
+        src->subscribe(*this);
+        std::lock_guard<std::mutex> guard(_mutex);
+        _subscribing = false;
+        if (_dead) {
+          // run() has postponed destruction until upstream subscription is done.
+          schedule();
+        }
+      }
+
+     private:
+      void on_subscribe(subscription &s) override {
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          _src = &s;
+        }
+        s.request(INT_MAX);
+      }
+
+      void on_next(T &&t) override {
+        std::lock_guard<std::mutex> guard(_mutex);
+        CHECK_NOTNULL(_src) << this << " " << _name;
+        if (_buffer.push(std::move(t))) {
+          schedule();
+        }
+      }
+
+      void on_error(std::error_condition ec) override {
+        std::lock_guard<std::mutex> guard(_mutex);
+        LOG(5) << this << " " << _name << " on_error: " << ec.message();
+        CHECK_NOTNULL(_src) << this << " " << _name;
+        _src = nullptr;
+        _ec = ec;
+        _upstream_done = true;
+        schedule();
+      }
+
+      void on_complete() override {
+        std::lock_guard<std::mutex> guard(_mutex);
+        LOG(5) << this << " " << _name << " on_complete";
+        CHECK_NOTNULL(_src) << this << " " << _name;
+        _src = nullptr;
+        _upstream_done = true;
+        schedule();
+      }
+
+      void die() override {
+        std::lock_guard<std::mutex> guard(_mutex);
+        LOG(5) << this << " " << _name << " die()";
+        _dead = true;
+        schedule();
+      }
+
+      bool drain_impl() override {
+        if (std::this_thread::get_id() != _run_thread.load()) {
+          // drain only in scheduled task
+          std::lock_guard<std::mutex> guard(_mutex);
+          schedule();
+          return false;
+        }
+
+        std::queue<T> tmp;
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          if (_buffer.empty()) {
+            return false;
+          }
+          _buffer.swap(tmp);
+        }
+        _buffer.on_drained(tmp.size());
+        drain_source_impl<element_t>::deliver_on_next(std::move(tmp));
+        return false;
+      }
+
+      // has to be called with _mutex locked.
+      void schedule() {
+        if (_scheduled) {
+          return;
+        }
+        _scheduled = true;
+        _executor.post([this]() { run(); });
+      }
+
+      // has to be called with _mutex locked.
+      bool has_work() const {
+        return _dead || _subscribe_pending
+               || (!_buffer.empty() && drain_source_impl<element_t>::needs() > 0)
+               || (_upstream_done && _buffer.empty());
+      }
+
+      void run() {
+        _run_thread = std::this_thread::get_id();
+        while (true) {
+          bool subscribe_pending;
+          bool dead;
+          {
+            std::lock_guard<std::mutex> guard(_mutex);
+            subscribe_pending = _subscribe_pending;
+            _subscribe_pending = false;
+            dead = _dead;
+            if (dead && _subscribing) {
+              // constructor is still in upstream subscribe() and reschedules.
+              _run_thread = std::thread::id{};
+              _scheduled = false;
+              return;
+            }
+          }
+
+          if (dead) {
+            break;
+          }
+
+          if (subscribe_pending) {
+            drain_source_impl<element_t>::deliver_on_subscribe();
+            continue;
+          }
+
+          drain_source_impl<element_t>::drain();
+
+          bool finished;
+          {
+            std::lock_guard<std::mutex> guard(_mutex);
+            finished = !_dead && _upstream_done && _buffer.empty();
+          }
+          if (finished) {
+            if (_ec) {
+              drain_source_impl<element_t>::deliver_on_error(_ec);
+            } else {
+              drain_source_impl<element_t>::deliver_on_complete();
+            }
+            continue;
+          }
+
+          std::lock_guard<std::mutex> guard(_mutex);
+          if (!has_work()) {
+            _run_thread = std::thread::id{};
+            _scheduled = false;
+            return;
+          }
+        }
+
+        LOG(5) << this << " " << _name << " destroying executor source";
+        _run_thread = std::thread::id{};
+        if (_src) {
+          _src->cancel();
+          _src = nullptr;
+        }
+        delete this;
+      }
+
+      executor &_executor;
+      const std::string _name;
+      std::atomic<std::thread::id> _run_thread{};
+
+      // guards everything below.
+      std::mutex _mutex;
+      overflow_buffer<T> _buffer;
+      subscription *_src{nullptr};
+      bool _scheduled{false};
+      bool _subscribe_pending{false};
+      bool _subscribing{false};
+      bool _upstream_done{false};
+      bool _dead{false};
+      std::error_condition _ec;
+    };
+
    public:
     static publisher<std::queue<T>> apply(publisher<T> &&src, threaded_worker_op &&op) {
       return publisher<std::queue<T>>(
-          new instance(op._name, op._max_queued_frames, std::move(src)));
+          new instance(op._executor, op._name, op._max_queued_frames, op._policy,
+                       op._depth, op._cpus, std::move(src)));
     }
 
-    instance(const std::string &name, boost::optional<size_t> max_queued_frames, publisher<T> &&src)
-        : _name(name), _max_queued_frames(max_queued_frames), _src(std::move(src)) {}
+    instance(executor *exec, const std::string &name,
+             boost::optional<size_t> max_queued_frames, overflow_policy policy,
+             const std::shared_ptr<queue_depth> &depth, const std::vector<int> &cpus,
+             publisher<T> &&src)
+        : _executor(exec),
+          _name(name),
+          _max_queued_frames(max_queued_frames),
+          _policy(policy),
+          _depth(depth),
+          _cpus(cpus),
+          _src(std::move(src)) {}
 
     void subscribe(subscriber<element_t> &s) override {
-      new source(_name, _max_queued_frames, std::move(_src), s);
+      if (_executor) {
+        new executor_source(*_executor, _name, _max_queued_frames, _policy, _depth,
+                            std::move(_src), s);
+      } else {
+        new source(_name, _max_queued_frames, _policy, _depth, _cpus, std::move(_src),
+                   s);
+      }
     }
 
    private:
+    executor *const _executor;
     const std::string _name;
     const boost::optional<size_t> _max_queued_frames;
+    const overflow_policy _policy;
+    const std::shared_ptr<queue_depth> _depth;
+    const std::vector<int> _cpus;
     publisher<T> _src;
   };
 
  private:
+  executor *const _executor;
   const std::string _name;
   const boost::optional<size_t> _max_queued_frames;
+  const overflow_policy _policy;
+  const std::shared_ptr<queue_depth> _depth;
+  const std::vector<int> _cpus;
 };
 
 }  // namespace impl
 
 // threaded worker transforms publisher<T> into publisher<std::queue<T>> by
 // spawning new thread and performing all element delivery in it.
-inline auto threaded_worker(const std::string &name, boost::optional<size_t> max_queued_frames = {}) {
-  return impl::threaded_worker_op(name, max_queued_frames);
+// If max_queued_frames is set, elements are passed to the worker thread through
+// a queue of that capacity, and policy decides which elements are dropped when
+// worker falls behind. If depth is set, it tracks the number of queued elements.
+// If cpus are set, worker thread is pinned to them, see
+// threadutils::set_current_thread_affinity.
+inline auto threaded_worker(const std::string &name,
+                            boost::optional<size_t> max_queued_frames = {},
+                            overflow_policy policy = overflow_policy::DROP_NEWEST,
+                            const std::shared_ptr<queue_depth> &depth = nullptr,
+                            const std::vector<int> &cpus = {}) {
+  return impl::threaded_worker_op(nullptr, name, max_queued_frames, policy, depth,
+                                  cpus);
+}
+
+// Same as threaded_worker, but elements are delivered by tasks scheduled on a
+// shared executor instead of a dedicated thread. Many mostly idle stages can
+// share a few threads this way.
+inline auto threaded_worker(executor &exec, const std::string &name,
+                            boost::optional<size_t> max_queued_frames = {},
+                            overflow_policy policy = overflow_policy::DROP_NEWEST,
+                            const std::shared_ptr<queue_depth> &depth = nullptr) {
+  return impl::threaded_worker_op(&exec, name, max_queued_frames, policy, depth);
 }
 
 }  // namespace streams
@@ -1,8 +1,15 @@
 #include "threadutils.h"
 
+#include <algorithm>
 #include <cstring>
+#include <fstream>
+#include <sstream>
 #include "logging.h"
 
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
 namespace satori {
 namespace video {
 namespace threadutils {
@@ -36,6 +43,78 @@ std::string get_current_thread_name() {
 #endif
 }
 
+std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  std::istringstream in(list);
+  std::string range;
+  while (std::getline(in, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+    int first, last;
+    char dash;
+    std::istringstream range_in(range);
+    if (!(range_in >> first)) {
+      return {};
+    }
+    last = first;
+    if (range_in >> dash && (dash != '-' || !(range_in >> last))) {
+      return {};
+    }
+    if (first < 0 || last < first) {
+      return {};
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+size_t numa_node_count() {
+  size_t nodes = 0;
+  while (!numa_node_cpus(nodes).empty()) {
+    nodes++;
+  }
+  return std::max<size_t>(nodes, 1);
+}
+
+std::vector<int> numa_node_cpus(size_t node) {
+  std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+  std::string list;
+  if (!std::getline(in, list)) {
+    return {};
+  }
+  return parse_cpu_list(list);
+}
+
+bool set_current_thread_affinity(const std::vector<int> &cpus) {
+  if (cpus.empty()) {
+    return true;
+  }
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu >= CPU_SETSIZE) {
+      LOG(WARNING) << "cpu " << cpu << " is out of range";
+      return false;
+    }
+    CPU_SET(cpu, &set);
+  }
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (err) {
+    LOG(WARNING) << "Unable to set affinity of thread " << get_current_thread_name()
+                 << ": " << strerror(err);
+    return false;
+  }
+  return true;
+#else
+  LOG(WARNING) << "thread affinity is not supported";
+  return false;
+#endif
+}
+
 }  // namespace threadutils
 }  // namespace video
 }  // namespace satori
\ No newline at end of file
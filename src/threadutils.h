@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 namespace satori {
 namespace video {
@@ -10,6 +11,23 @@ void set_current_thread_name(const std::string &original_name);
 
 std::string get_current_thread_name();
 
+// Parses cpu list in sysfs format, e.g. "0-3,8,10-11". Returns empty list if the
+// string is malformed.
+std::vector<int> parse_cpu_list(const std::string &list);
+
+// Number of NUMA nodes of the host, 1 if the system doesn't report them.
+size_t numa_node_count();
+
+// Cpus of NUMA node, empty if node is unknown.
+std::vector<int> numa_node_cpus(size_t node);
+
+// Restricts current thread to given cpus, empty list leaves thread unrestricted.
+// Threads started by the current thread afterwards, e.g. FFmpeg codec threads,
+// inherit the restriction. Memory is placed in the node of the cpu which touches it
+// first, so buffers allocated by a pinned thread stay node-local. Returns false if
+// affinity is not supported or cpus are not available.
+bool set_current_thread_affinity(const std::vector<int> &cpus);
+
 }  // namespace threadutils
 }  // namespace video
-}  // namespace satori
\ No newline at end of file
+}  // namespace satori
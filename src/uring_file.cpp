@@ -0,0 +1,530 @@
+#include "uring_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define IO_URING_SUPPORTED 1
+#endif
+#endif
+#ifndef IO_URING_SUPPORTED
+#define IO_URING_SUPPORTED 0
+#endif
+
+#include "logging.h"
+#include "metrics.h"
+#include "stopwatch.h"
+#include "threadutils.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+auto &wait_millis = prometheus::BuildHistogram()
+                        .Name("uring_file_wait_millis")
+                        .Register(metrics_registry())
+                        .Add({}, std::vector<double>{0, 1, 2, 5, 10, 25, 50, 75, 100,
+                                                     250, 500, 1000, 5000});
+
+uint64_t align_down(uint64_t value) {
+  return value & ~uint64_t{uring_file::block_size - 1};
+}
+
+uint64_t align_up(uint64_t value) {
+  return align_down(value + uring_file::block_size - 1);
+}
+
+uint8_t *allocate_aligned(size_t size) {
+  void *data = nullptr;
+  CHECK_EQ(posix_memalign(&data, uring_file::block_size, size), 0)
+      << "failed to allocate " << size << " bytes";
+  return static_cast<uint8_t *>(data);
+}
+
+// returns 0 or negative errno.
+int write_fully(int fd, const uint8_t *data, size_t size, uint64_t offset) {
+  while (size > 0) {
+    const ssize_t ret = pwrite(fd, data, size, static_cast<off_t>(offset));
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return ret < 0 ? -errno : -EIO;
+    }
+    data += ret;
+    size -= static_cast<size_t>(ret);
+    offset += static_cast<uint64_t>(ret);
+  }
+  return 0;
+}
+
+// bytes past the end of file are zeroed, returns 0 or negative errno.
+int read_fully(int fd, uint8_t *data, size_t size, uint64_t offset) {
+  while (size > 0) {
+    const ssize_t ret = pread(fd, data, size, static_cast<off_t>(offset));
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0) {
+      return -errno;
+    }
+    if (ret == 0) {
+      std::memset(data, 0, size);
+      return 0;
+    }
+    data += ret;
+    size -= static_cast<size_t>(ret);
+    offset += static_cast<uint64_t>(ret);
+  }
+  return 0;
+}
+
+#if IO_URING_SUPPORTED
+
+// io_uring set up by raw syscalls and shared by all files. Writers submit under the
+// mutex, completions are reaped by a thread of its own.
+class ring {
+ public:
+  // nullptr if kernel doesn't support io_uring or it is not allowed.
+  static ring *instance() {
+    // never destroyed, its thread waits for completions until the process exits.
+    static ring *shared = create(256);
+    return shared;
+  }
+
+  // submits writes of buffers by as few io_uring_enter calls as completion entries
+  // allow. Returns number of writes submitted, the rest is left to the caller, or
+  // negative errno if none was.
+  int write(int fd, uring_file::buffer *const *buffers, size_t count) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    size_t submitted = 0;
+    while (submitted < count) {
+      // every write in flight has a completion entry.
+      _entries_freed.wait(lock, [this]() { return _in_flight < _cq_entries; });
+      const unsigned batch = static_cast<unsigned>(
+          std::min<size_t>({count - submitted, _cq_entries - _in_flight, _sq_entries}));
+
+      const unsigned tail = *_sq_tail;
+      for (unsigned i = 0; i < batch; i++) {
+        uring_file::buffer &b = *buffers[submitted + i];
+        const unsigned index = (tail + i) & *_sq_mask;
+        io_uring_sqe &sqe = _sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITEV;
+        sqe.fd = fd;
+        sqe.off = b.offset;
+        sqe.addr = reinterpret_cast<uint64_t>(&b.iov);
+        sqe.len = 1;
+        sqe.user_data = reinterpret_cast<uint64_t>(&b);
+        _sq_array[index] = index;
+      }
+      __atomic_store_n(_sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+      int ret;
+      do {
+        ret = static_cast<int>(
+            syscall(__NR_io_uring_enter, _fd, batch, 0, 0, nullptr, 0));
+      } while (ret < 0 && errno == EINTR);
+      const int error = ret < 0 ? -errno : -EAGAIN;
+      const unsigned consumed = ret > 0 ? static_cast<unsigned>(ret) : 0;
+      _in_flight += consumed;
+      submitted += consumed;
+      if (consumed < batch) {
+        // entries that weren't consumed are taken back.
+        __atomic_store_n(_sq_tail, tail + consumed, __ATOMIC_RELEASE);
+        return submitted > 0 ? static_cast<int>(submitted) : error;
+      }
+    }
+    return static_cast<int>(submitted);
+  }
+
+ private:
+  static ring *create(unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    const int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0) {
+      LOG(WARNING) << "io_uring is not available (" << std::strerror(errno)
+                   << "), files are written by pwrite";
+      return nullptr;
+    }
+
+    const size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const size_t sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void *sq = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    void *cq = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+      LOG(WARNING) << "failed to map io_uring (" << std::strerror(errno)
+                   << "), files are written by pwrite";
+      ::close(fd);
+      return nullptr;
+    }
+
+    LOG(INFO) << "files are written by io_uring of " << params.sq_entries << " entries";
+    return new ring(fd, params, static_cast<uint8_t *>(sq), static_cast<uint8_t *>(cq),
+                    static_cast<io_uring_sqe *>(sqes));
+  }
+
+  ring(int fd, const io_uring_params &params, uint8_t *sq, uint8_t *cq,
+       io_uring_sqe *sqes)
+      : _fd{fd},
+        _sq_tail{reinterpret_cast<unsigned *>(sq + params.sq_off.tail)},
+        _sq_mask{reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask)},
+        _sq_array{reinterpret_cast<unsigned *>(sq + params.sq_off.array)},
+        _sqes{sqes},
+        _cq_head{reinterpret_cast<unsigned *>(cq + params.cq_off.head)},
+        _cq_tail{reinterpret_cast<unsigned *>(cq + params.cq_off.tail)},
+        _cq_mask{reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask)},
+        _cqes{reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes)},
+        _sq_entries{params.sq_entries},
+        _cq_entries{params.cq_entries} {
+    std::thread([this]() { run(); }).detach();
+  }
+
+  void run() {
+    threadutils::set_current_thread_name("uring_file");
+    while (true) {
+      const unsigned head = *_cq_head;
+      if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+        const long ret =
+            syscall(__NR_io_uring_enter, _fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        CHECK(ret >= 0 || errno == EINTR)
+            << "failed to wait for io_uring: " << std::strerror(errno);
+        continue;
+      }
+
+      const io_uring_cqe &cqe = _cqes[head & *_cq_mask];
+      auto *b = reinterpret_cast<uring_file::buffer *>(cqe.user_data);
+      const int result = cqe.res;
+      __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _in_flight--;
+      }
+      _entries_freed.notify_all();
+      b->file->complete(*b, result);
+    }
+  }
+
+  const int _fd;
+  unsigned *const _sq_tail;
+  const unsigned *const _sq_mask;
+  unsigned *const _sq_array;
+  io_uring_sqe *const _sqes;
+  unsigned *const _cq_head;
+  const unsigned *const _cq_tail;
+  const unsigned *const _cq_mask;
+  const io_uring_cqe *const _cqes;
+  const unsigned _sq_entries;
+  const unsigned _cq_entries;
+
+  std::mutex _mutex;
+  std::condition_variable _entries_freed;
+  unsigned _in_flight{0};
+};
+
+#else
+
+class ring {
+ public:
+  static ring *instance() { return nullptr; }
+  int write(int /*fd*/, uring_file::buffer *const * /*buffers*/, size_t /*count*/) {
+    return -ENOSYS;
+  }
+};
+
+#endif
+
+}  // namespace
+
+constexpr size_t uring_file::block_size;
+
+uring_file::uring_file(const std::string &filename, const uring_file_options &options)
+    : _filename{filename}, _options{options} {
+  CHECK(_options.buffer_size > 0 && _options.buffer_size % block_size == 0)
+      << "buffer size should be a multiple of " << block_size;
+  CHECK_GT(_options.queue_depth, 0);
+
+  // direct io patches written blocks, so they are read back.
+  const int flags = O_RDWR | O_CREAT | O_TRUNC;
+  if (_options.direct) {
+    _fd = ::open(_filename.c_str(), flags | O_DIRECT, 0644);
+    if (_fd < 0 && errno == EINVAL) {
+      LOG(WARNING) << "file system doesn't support direct io, " << _filename
+                   << " is written through page cache";
+      _options.direct = false;
+    }
+  }
+  if (_fd < 0) {
+    _fd = ::open(_filename.c_str(), flags, 0644);
+  }
+  CHECK_GE(_fd, 0) << "failed to open file " << _filename << ": "
+                   << std::strerror(errno);
+
+  _buffers.resize(_options.queue_depth);
+  _queued.reserve(_options.queue_depth);
+  for (buffer &b : _buffers) {
+    b.data = allocate_aligned(_options.buffer_size);
+    b.file = this;
+  }
+}
+
+uring_file::~uring_file() {
+  if (_fd >= 0) {
+    close();
+  }
+  for (buffer &b : _buffers) {
+    std::free(b.data);
+  }
+}
+
+int uring_file::write(const uint8_t *data, size_t size) {
+  if (_error != 0) {
+    return _error;
+  }
+
+  if (_position < _buffer_offset) {
+    const size_t behind = std::min<uint64_t>(size, _buffer_offset - _position);
+    if (int err = write_behind(data, behind)) {
+      return fail(err);
+    }
+    data += behind;
+    size -= behind;
+    _position += behind;
+  }
+
+  while (size > 0) {
+    buffer &b = _buffers[_current];
+    const size_t at = _position - _buffer_offset;
+    const size_t n = std::min(size, _options.buffer_size - at);
+    std::memcpy(b.data + at, data, n);
+    data += n;
+    size -= n;
+    _position += n;
+    _size = std::max(_size, _position);
+
+    if (_size - _buffer_offset == _options.buffer_size) {
+      queue(b, _options.buffer_size, _buffer_offset);
+      _buffer_offset += _options.buffer_size;
+      if (int err = next_buffer()) {
+        return fail(err);
+      }
+    }
+  }
+  // buffers filled by this write are submitted together.
+  if (int err = flush()) {
+    return fail(err);
+  }
+  return 0;
+}
+
+int64_t uring_file::seek(int64_t offset, int whence) {
+  int64_t base;
+  switch (whence) {
+    case SEEK_SET:
+      base = 0;
+      break;
+    case SEEK_CUR:
+      base = static_cast<int64_t>(_position);
+      break;
+    case SEEK_END:
+      base = static_cast<int64_t>(_size);
+      break;
+    default:
+      return -EINVAL;
+  }
+
+  const int64_t position = base + offset;
+  if (position < 0 || position > static_cast<int64_t>(_size)) {
+    return -EINVAL;
+  }
+  _position = static_cast<uint64_t>(position);
+  return position;
+}
+
+int uring_file::close() {
+  // buffers in flight are waited for even after an error.
+  int err = wait_all();
+  if (_error != 0) {
+    err = _error;
+  }
+
+  const size_t tail = _size - _buffer_offset;
+  if (err == 0 && tail > 0) {
+    buffer &b = _buffers[_current];
+    // direct io writes whole blocks, padding is truncated.
+    const size_t padded = _options.direct ? align_up(tail) : tail;
+    std::memset(b.data + tail, 0, padded - tail);
+    err = write_fully(_fd, b.data, padded, _buffer_offset);
+    if (err == 0 && padded > tail && ftruncate(_fd, static_cast<off_t>(_size)) < 0) {
+      err = -errno;
+    }
+  }
+  if (err == 0 && fdatasync(_fd) < 0) {
+    err = -errno;
+  }
+  ::close(_fd);
+  _fd = -1;
+
+  if (err != 0 && _error == 0) {
+    LOG(ERROR) << "failed to write " << _filename << ": " << std::strerror(-err);
+  }
+  _error = err;
+  return err;
+}
+
+void uring_file::complete(buffer &b, int result) {
+  // notified under the lock, file may be destroyed as soon as it is released.
+  std::lock_guard<std::mutex> lock(_mutex);
+  b.result = result;
+  b.in_flight = false;
+  _completed.notify_all();
+}
+
+void uring_file::queue(buffer &b, size_t size, uint64_t offset) {
+  b.size = size;
+  b.offset = offset;
+  b.iov.iov_base = b.data;
+  b.iov.iov_len = size;
+  _queued.push_back(&b);
+}
+
+int uring_file::flush() {
+  if (_queued.empty()) {
+    return 0;
+  }
+
+  size_t submitted = 0;
+  ring *r = ring::instance();
+  if (r != nullptr) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      for (buffer *b : _queued) {
+        b->in_flight = true;
+      }
+    }
+    const int ret = r->write(_fd, _queued.data(), _queued.size());
+    submitted = ret > 0 ? static_cast<size_t>(ret) : 0;
+    if (submitted < _queued.size()) {
+      LOG(WARNING) << "failed to submit " << _queued.size() - submitted
+                   << " writes of " << _filename << " ("
+                   << std::strerror(ret < 0 ? -ret : EAGAIN)
+                   << "), writing them by pwrite";
+      std::lock_guard<std::mutex> lock(_mutex);
+      for (size_t i = submitted; i < _queued.size(); i++) {
+        _queued[i]->in_flight = false;
+      }
+    }
+  }
+
+  int result = 0;
+  for (size_t i = submitted; i < _queued.size(); i++) {
+    buffer &b = *_queued[i];
+    const int err = write_fully(_fd, b.data, b.size, b.offset);
+    b.result = err < 0 ? err : static_cast<int>(b.size);
+    if (result == 0) {
+      result = err;
+    }
+  }
+  _queued.clear();
+  return result;
+}
+
+int uring_file::next_buffer() {
+  // the oldest buffer is filled next, once it is written.
+  _current = (_current + 1) % _buffers.size();
+  buffer &b = _buffers[_current];
+  bool busy;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    busy = b.in_flight;
+  }
+  // writer is about to wait, so buffers filled so far are submitted first.
+  if (busy || (!_queued.empty() && _queued.front() == &b)) {
+    if (int err = flush()) {
+      return err;
+    }
+  }
+  return wait(b);
+}
+
+int uring_file::wait(buffer &b) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  if (b.in_flight) {
+    stopwatch<std::chrono::steady_clock> s;
+    _completed.wait(lock, [&b]() { return !b.in_flight; });
+    wait_millis.Observe(s.millis());
+  }
+  const int result = b.result;
+  lock.unlock();
+
+  if (result < 0) {
+    return result;
+  }
+  // short writes are finished synchronously.
+  const auto written = static_cast<size_t>(result);
+  if (written < b.size) {
+    const int err =
+        write_fully(_fd, b.data + written, b.size - written, b.offset + written);
+    b.result = err < 0 ? err : static_cast<int>(b.size);
+    return err;
+  }
+  return 0;
+}
+
+int uring_file::wait_all() {
+  int result = 0;
+  for (buffer &b : _buffers) {
+    const int err = wait(b);
+    if (result == 0) {
+      result = err;
+    }
+  }
+  return result;
+}
+
+int uring_file::write_behind(const uint8_t *data, size_t size) {
+  // blocks behind the buffer are only patched once they are written.
+  if (int err = wait_all()) {
+    return err;
+  }
+  if (!_options.direct) {
+    return write_fully(_fd, data, size, _position);
+  }
+
+  // direct io writes whole blocks, buffer offset is aligned, so they are all there.
+  const uint64_t begin = align_down(_position);
+  const uint64_t end = align_up(_position + size);
+  uint8_t *blocks = allocate_aligned(end - begin);
+  int err = read_fully(_fd, blocks, end - begin, begin);
+  if (err == 0) {
+    std::memcpy(blocks + (_position - begin), data, size);
+    err = write_fully(_fd, blocks, end - begin, begin);
+  }
+  std::free(blocks);
+  return err;
+}
+
+int uring_file::fail(int error) {
+  LOG(ERROR) << "failed to write " << _filename << ": " << std::strerror(-error);
+  _error = error;
+  return error;
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <sys/uio.h>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace satori {
+namespace video {
+
+struct uring_file_options {
+  // file is opened with O_DIRECT and bypasses page cache, so writeback of many
+  // files doesn't stall writers. Falls back to page cache if file system doesn't
+  // support it.
+  bool direct{false};
+  // data is written in buffers of that size, a multiple of block_size.
+  size_t buffer_size{1024 * 1024};
+  // buffers of a file which may be written at the same time.
+  size_t queue_depth{4};
+};
+
+// Sequential file writer for recordings of many channels. Data is gathered in
+// aligned buffers, full buffers are written by io_uring shared by all files of the
+// process, and writer waits only when all buffers of the file are in flight. Buffers
+// filled by one write are submitted by a single io_uring_enter. Writes
+// behind the buffer, like muxer rewriting a header, wait for the file to be written
+// and go to disk directly. Buffers are written by pwrite where io_uring is not
+// available. Data reaches the file in whole buffers until it is closed. Time spent
+// waiting for buffers is exported to uring_file_wait_millis. Not thread safe.
+class uring_file {
+ public:
+  static constexpr size_t block_size = 4096;
+
+  // exits if file can't be opened.
+  uring_file(const std::string &filename, const uring_file_options &options);
+  // closes file if it isn't closed yet.
+  ~uring_file();
+
+  uring_file(const uring_file &) = delete;
+  uring_file &operator=(const uring_file &) = delete;
+
+  // returns 0 or negative errno, the file is broken after an error.
+  int write(const uint8_t *data, size_t size);
+
+  // like lseek, but can't go past the end of file. Returns new position or
+  // negative errno.
+  int64_t seek(int64_t offset, int whence);
+
+  int64_t size() const { return static_cast<int64_t>(_size); }
+
+  // writes the rest of data and syncs it, returns 0 or negative errno.
+  int close();
+
+  // One of buffers, completed by ring thread.
+  struct buffer {
+    uint8_t *data{nullptr};
+    size_t size{0};
+    uint64_t offset{0};
+    // kept until write is complete, kernels before 5.5 may read it late.
+    iovec iov{};
+    bool in_flight{false};
+    // bytes written or negative errno.
+    int result{0};
+    uring_file *file{nullptr};
+  };
+
+  // called by ring thread.
+  void complete(buffer &b, int result);
+
+ private:
+  // full buffer is written by the next flush.
+  void queue(buffer &b, size_t size, uint64_t offset);
+  // submits queued buffers at once, returns 0 or negative errno.
+  int flush();
+  // moves to the next buffer and waits until it is written.
+  int next_buffer();
+  int wait(buffer &b);
+  int wait_all();
+  int write_behind(const uint8_t *data, size_t size);
+  int fail(int error);
+
+  const std::string _filename;
+  uring_file_options _options;
+  int _fd{-1};
+  std::vector<buffer> _buffers;
+  // full buffers not submitted yet, in order of offsets.
+  std::vector<buffer *> _queued;
+  // buffer being filled, it holds data from _buffer_offset to _size.
+  size_t _current{0};
+  uint64_t _buffer_offset{0};
+  uint64_t _position{0};
+  uint64_t _size{0};
+  int _error{0};
+  std::mutex _mutex;
+  std::condition_variable _completed;
+};
+
+}  // namespace video
+}  // namespace satori
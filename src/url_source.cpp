@@ -1,7 +1,13 @@
 #include "video_streams.h"
 
+#include <algorithm>
+#include <condition_variable>
 #include <gsl/gsl>
+#include <map>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -32,69 +38,217 @@ auto &destroyed_total = prometheus::BuildCounter()
 auto &complete_total = prometheus::BuildCounter()
                            .Name("url_source_complete_total")
                            .Register(metrics_registry());
+
+auto &cached_starts_total = prometheus::BuildCounter()
+                                .Name("url_source_cached_starts_total")
+                                .Register(metrics_registry());
+
+auto &start_millis =
+    prometheus::BuildHistogram()
+        .Name("url_source_start_millis")
+        .Register(metrics_registry())
+        .Add({}, std::vector<double>{0,   10,  25,   50,   100,  250, 500,
+                                     750, 1000, 2000, 3000, 5000, 10000});
+
+auto &throttled_total = prometheus::BuildCounter()
+                            .Name("url_source_throttled_total")
+                            .Register(metrics_registry());
+
+auto &demux_pool_sources = prometheus::BuildGauge()
+                               .Name("url_demux_pool_sources")
+                               .Register(metrics_registry())
+                               .Add({});
+
+// shared demuxer reads at most that many packets of a source in a turn.
+constexpr int max_packets_per_turn = 8;
+// pause of shared demuxer before retrying source without data or with consumer
+// behind.
+constexpr std::chrono::milliseconds retry_delay{5};
+
+// fast start reads that much of the stream to find its parameters.
+constexpr const char *fast_start_probesize = "32768";
+constexpr const char *fast_start_analyzeduration = "500000";
+
+std::shared_ptr<AVCodecParameters> copy_parameters(const AVCodecParameters &src) {
+  AVCodecParameters *parameters = avcodec_parameters_alloc();
+  if (parameters == nullptr) {
+    return nullptr;
+  }
+  if (avcodec_parameters_copy(parameters, &src) < 0) {
+    avcodec_parameters_free(&parameters);
+    return nullptr;
+  }
+  return std::shared_ptr<AVCodecParameters>(
+      parameters, [](AVCodecParameters *p) { avcodec_parameters_free(&p); });
+}
+
+// video stream of url as it was found by the last probing.
+struct probed_stream {
+  int index;
+  std::shared_ptr<const AVCodecParameters> parameters;
+};
+
+class probed_streams {
+ public:
+  static probed_streams &instance() {
+    static probed_streams streams;
+    return streams;
+  }
+
+  boost::optional<probed_stream> get(const std::string &url) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _streams.find(url);
+    return it != _streams.end() ? it->second : boost::optional<probed_stream>{};
+  }
+
+  void put(const std::string &url, const probed_stream &stream) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _streams[url] = stream;
+  }
+
+ private:
+  std::mutex _mutex;
+  std::unordered_map<std::string, probed_stream> _streams;
+};
 }  // namespace
 
 class url_source_impl {
  public:
-  url_source_impl(const std::string &url, const std::string &options,
+  url_source_impl(const std::string &url, const url_source_options &options,
+                  std::shared_ptr<std::atomic<size_t>> queued_packets,
                   streams::observer<encoded_packet> &sink)
-      : _url{url}, _sink{sink}, _reader_thread_name{"url " + url} {
+      : _url{url},
+        _options{options},
+        _queued_packets{std::move(queued_packets)},
+        _sink{sink} {
     avutils::init();
     created_total.Add({{"url", _url}}).Increment();
-    std::thread([this, options]() {
-      threadutils::set_current_thread_name(_reader_thread_name);
+  }
 
-      _reader_thread_id = std::this_thread::get_id();
+  ~url_source_impl() {
+    LOG(INFO) << "destroying url source: " << _url;
+    destroyed_total.Add({{"url", _url}}).Increment();
+  }
 
-      auto self_destroyer = gsl::finally([this]() {
-        LOG(INFO) << "delete self: " << _url;
-        delete this;
-      });
+  url_source_impl(const url_source_impl &) = delete;
+  url_source_impl &operator=(const url_source_impl &) = delete;
 
-      const std::error_condition ec = start(options);
-      if (ec) {
-        LOG(ERROR) << "unable to start url source " << _url
-                   << ", error: " << ec.message();
-        _sink.on_error(ec);
+  // consumer may be gone right after, so sink is not used anymore.
+  void stop() {
+    std::lock_guard<std::recursive_mutex> lock(_sink_mutex);
+    LOG(INFO) << "stopping url source";
+    _active = false;
+  }
+
+  // demuxes on a thread of its own until source is over or stopped.
+  static void start_thread(const std::shared_ptr<url_source_impl> &self) {
+    std::thread([self]() {
+      threadutils::set_current_thread_name("url " + self->_url);
+      threadutils::set_current_thread_affinity(self->_options.cpus);
+      if (!self->start()) {
         return;
       }
-
-      read_loop();
+      while (self->_active && self->read_one() != AVERROR_EOF) {
+      }
     })
         .detach();
   }
 
-  ~url_source_impl() {
-    LOG(INFO) << "destroying url source: " << _url;
-    destroyed_total.Add({{"url", _url}}).Increment();
+  // interrupts blocking calls of demuxer right away, unlike stop() it doesn't wait
+  // for sink to be released.
+  void abort() { _active = false; }
+
+  // opens url for demux_turn(), blocks until stream parameters are found.
+  bool start_shared() {
+    if (!start()) {
+      return false;
+    }
+    // demuxers supporting it return EAGAIN instead of waiting for data.
+    _input_context->flags |= AVFMT_FLAG_NONBLOCK;
+    return true;
   }
 
-  void stop() {
-    if (_reader_thread_id != std::this_thread::get_id()) {
-      LOG(ERROR) << "calling url_source stop from thread {"
-                 << threadutils::get_current_thread_name() << ", "
-                 << std::this_thread::get_id() << "} but expected {"
-                 << _reader_thread_name << ", " << _reader_thread_id << "}";
+  // reads packets which don't need waiting for, returns when source should be
+  // demuxed again or nothing if it is over.
+  boost::optional<std::chrono::steady_clock::time_point> demux_turn() {
+    for (int i = 0; i < max_packets_per_turn; i++) {
+      if (!_active) {
+        return boost::none;
+      }
+      if (*_queued_packets >= _options.max_queued_packets) {
+        throttled_total.Add({{"url", _url}}).Increment();
+        return std::chrono::steady_clock::now() + retry_delay;
+      }
+      const int ret = read_one();
+      if (ret == AVERROR_EOF) {
+        return boost::none;
+      }
+      if (ret < 0) {
+        return std::chrono::steady_clock::now() + retry_delay;
+      }
+    }
+    return std::chrono::steady_clock::now();
+  }
+
+ private:
+  static int interrupt(void *opaque) {
+    return static_cast<url_source_impl *>(opaque)->_active ? 0 : 1;
+  }
+
+  template <typename Fn>
+  void deliver(Fn &&fn) {
+    std::lock_guard<std::recursive_mutex> lock(_sink_mutex);
+    if (_active) {
+      fn(_sink);
     }
-    LOG(INFO) << "stopping url source";
-    _active = false;
   }
 
-  std::error_condition start(const std::string &options) {
+  // sends metadata, or error to sink if source can't be opened.
+  bool start() {
+    const std::error_condition ec = open();
+    if (ec) {
+      LOG(ERROR) << "unable to start url source " << _url << ", error: " << ec.message();
+      deliver([ec](streams::observer<encoded_packet> &sink) { sink.on_error(ec); });
+      return false;
+    }
+    return true;
+  }
+
+  std::error_condition open() {
+    const auto start_time = std::chrono::steady_clock::now();
+    const std::string &options = _options.parameters;
     AVDictionary *options_dict{nullptr};
     int err = av_dict_parse_string(&options_dict, options.c_str(), "=", ";", 0);
     if (err < 0) {
       LOG(ERROR) << "can't parse options: " << options;
       return video_error::STREAM_INITIALIZATION_ERROR;
     }
-    _input_context = avutils::open_input_format_context(_url, nullptr, options_dict);
+    if (_options.fast_start) {
+      // options given by user take precedence.
+      av_dict_set(&options_dict, "probesize", fast_start_probesize,
+                  AV_DICT_DONT_OVERWRITE);
+      av_dict_set(&options_dict, "analyzeduration", fast_start_analyzeduration,
+                  AV_DICT_DONT_OVERWRITE);
+      av_dict_set(&options_dict, "fflags", "+nobuffer", AV_DICT_APPEND);
+    }
+    // stopping source aborts blocking network calls.
+    _input_context = avutils::open_input_format_context(
+        _url, nullptr, options_dict, AVIOInterruptCB{&url_source_impl::interrupt, this});
     if (!_input_context) {
       return video_error::STREAM_INITIALIZATION_ERROR;
     }
 
-    _stream_idx = avutils::find_best_video_stream(_input_context.get(), &_decoder);
-    if (_stream_idx < 0) {
-      return video_error::STREAM_INITIALIZATION_ERROR;
+    if (!_options.fast_start || !use_probed_stream()) {
+      _stream_idx = avutils::find_best_video_stream(_input_context.get(), &_decoder);
+      if (_stream_idx < 0) {
+        return video_error::STREAM_INITIALIZATION_ERROR;
+      }
+      if (_options.fast_start) {
+        const AVStream *probed = _input_context->streams[_stream_idx];
+        if (auto parameters = copy_parameters(*probed->codecpar)) {
+          probed_streams::instance().put(_url, probed_stream{_stream_idx, parameters});
+        }
+      }
     }
     AVStream *stream = _input_context->streams[_stream_idx];
     _time_base = stream->time_base;
@@ -120,66 +274,113 @@ class url_source_impl {
       return video_error::STREAM_INITIALIZATION_ERROR;
     }
 
-    _sink.on_next(encoded_metadata{
-        _decoder->name,
-        {_decoder_context->extradata,
-         _decoder_context->extradata + _decoder_context->extradata_size}});
+    encoded_metadata metadata;
+    metadata.codec_name = _decoder->name;
+    metadata.codec_data =
+        shared_bytes{reinterpret_cast<const char *>(_decoder_context->extradata),
+                     static_cast<size_t>(_decoder_context->extradata_size)};
+    deliver([&metadata](streams::observer<encoded_packet> &sink) {
+      sink.on_next(std::move(metadata));
+    });
 
+    start_millis.Observe(std::chrono::duration_cast<std::chrono::milliseconds>(
+                             std::chrono::steady_clock::now() - start_time)
+                             .count());
     return {};
   }
 
- private:
-  void read_loop() {
-    while (_active) {
-      av_init_packet(&_pkt);
-      auto release = gsl::finally([this]() { av_packet_unref(&_pkt); });
+  // takes codec parameters of the stream from the last probing of url instead of
+  // probing it again, if streams of the url are still the same.
+  bool use_probed_stream() {
+    const boost::optional<probed_stream> probed = probed_streams::instance().get(_url);
+    if (!probed) {
+      return false;
+    }
+    if (probed->index >= static_cast<int>(_input_context->nb_streams)) {
+      return false;
+    }
+    AVStream *stream = _input_context->streams[probed->index];
+    if (stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO
+        || stream->codecpar->codec_id != probed->parameters->codec_id) {
+      LOG(INFO) << "streams of " << _url << " have changed, probing again";
+      return false;
+    }
+    _decoder = avcodec_find_decoder(probed->parameters->codec_id);
+    if (_decoder == nullptr) {
+      return false;
+    }
+    if (avcodec_parameters_copy(stream->codecpar, probed->parameters.get()) < 0) {
+      return false;
+    }
+    _stream_idx = probed->index;
+    cached_starts_total.Add({{"url", _url}}).Increment();
+    LOG(INFO) << "using stream parameters of " << _url << " from previous probing";
+    return true;
+  }
 
-      int ret = av_read_frame(_input_context.get(), &_pkt);
-      if (ret == AVERROR_EOF) {
-        LOG(INFO) << "url source is complete: " << _url;
-        complete_total.Add({{"url", _url}}).Increment();
-        _sink.on_complete();
-        return;
-      }
+  // returns av_read_frame result, sink is completed at the end of stream.
+  int read_one() {
+    av_init_packet(&_pkt);
+    auto release = gsl::finally([this]() { av_packet_unref(&_pkt); });
 
-      if (ret < 0) {
+    int ret = av_read_frame(_input_context.get(), &_pkt);
+    if (ret == AVERROR_EOF) {
+      LOG(INFO) << "url source is complete: " << _url;
+      complete_total.Add({{"url", _url}}).Increment();
+      deliver([](streams::observer<encoded_packet> &sink) { sink.on_complete(); });
+      return ret;
+    }
+
+    if (ret == AVERROR(EAGAIN)) {
+      return ret;
+    }
+
+    if (ret < 0) {
+      if (_active) {
         LOG(ERROR) << "error reading packet: " << avutils::error_msg(ret);
-        continue;
       }
+      return ret;
+    }
 
-      if (_pkt.stream_index == _stream_idx) {
-        LOG(4) << "packet from url " << _url;
-        if (_packets == 0) {
-          _start_time = _clock.now();
-        }
-        _packets++;
-        // TODO: check how to measure _pkt.pts jitter
-        int64_t pts = _pkt.pts;
-        if (pts < 0) {
-          pts = 0;
-        }
-        int64_t micro_pts = 1000000 * pts * _time_base.num / _time_base.den;
-        auto packet_time = _start_time + std::chrono::microseconds(micro_pts);
-        encoded_frame frame;
-        frame.data = std::string{_pkt.data, _pkt.data + _pkt.size};
-        frame.id = {_packets, _packets};
-        frame.timestamp = packet_time;
-        frame.creation_time = std::chrono::system_clock::now();
-        frame.key_frame = static_cast<bool>(_pkt.flags & AV_PKT_FLAG_KEY);
-        frames_total.Add({{"url", _url}}).Increment();
-        _sink.on_next(frame);
+    if (_pkt.stream_index == _stream_idx) {
+      LOG(4) << "packet from url " << _url;
+      if (_packets == 0) {
+        _start_time = _clock.now();
+      }
+      _packets++;
+      // TODO: check how to measure _pkt.pts jitter
+      int64_t pts = _pkt.pts;
+      if (pts < 0) {
+        pts = 0;
       }
+      int64_t micro_pts = 1000000 * pts * _time_base.num / _time_base.den;
+      auto packet_time = _start_time + std::chrono::microseconds(micro_pts);
+      encoded_frame frame;
+      frame.data = avutils::packet_data(_pkt);
+      frame.id = {_packets, _packets};
+      frame.timestamp = packet_time;
+      frame.creation_time = std::chrono::system_clock::now();
+      frame.key_frame = static_cast<bool>(_pkt.flags & AV_PKT_FLAG_KEY);
+      frames_total.Add({{"url", _url}}).Increment();
+      (*_queued_packets)++;
+      deliver([&frame](streams::observer<encoded_packet> &sink) {
+        sink.on_next(std::move(frame));
+      });
     }
+    return ret;
   }
 
   const std::string _url;
+  const url_source_options _options;
+  // delivered to sink, but not taken by consumer yet.
+  const std::shared_ptr<std::atomic<size_t>> _queued_packets;
+  // recursive since consumer may stop source while it handles a packet.
+  std::recursive_mutex _sink_mutex;
   streams::observer<encoded_packet> &_sink;
   std::shared_ptr<AVFormatContext> _input_context;
   AVCodec *_decoder{nullptr};
   AVPacket _pkt{nullptr};
   std::shared_ptr<AVCodecContext> _decoder_context;
-  std::thread::id _reader_thread_id;
-  const std::string _reader_thread_name;
   std::atomic<bool> _active{true};
   int _stream_idx{-1};
   int64_t _packets{0};
@@ -188,14 +389,155 @@ class url_source_impl {
   std::chrono::system_clock::time_point _start_time;
 };
 
+namespace {
+
+// Demuxes url sources on a fixed number of threads instead of a thread per source.
+// Sources take turns reading a few packets each, sources without data and sources
+// with too many packets waiting for consumer are retried a bit later. Opening may
+// wait for a slow server, so every source is opened on a thread of its own before it
+// gets turns.
+class url_demux_pool {
+ public:
+  explicit url_demux_pool(size_t threads) {
+    for (size_t i = 0; i < threads; i++) {
+      _threads.emplace_back(&url_demux_pool::run, this, i);
+    }
+  }
+
+  // sources still opened or demuxed may be blocked in network calls, they are
+  // interrupted first.
+  ~url_demux_pool() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _stopped = true;
+    for (const auto &source : _sources) {
+      source->abort();
+    }
+    _wakeup.notify_all();
+    _opened.wait(lock, [this]() { return _opening == 0; });
+    lock.unlock();
+    for (auto &t : _threads) {
+      t.join();
+    }
+  }
+
+  url_demux_pool(const url_demux_pool &) = delete;
+  url_demux_pool &operator=(const url_demux_pool &) = delete;
+
+  // process-wide pool with a thread per hardware core.
+  static url_demux_pool &shared() {
+    static url_demux_pool pool{std::max(1u, std::thread::hardware_concurrency())};
+    return pool;
+  }
+
+  void add(std::shared_ptr<url_source_impl> source) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _sources.insert(source);
+      _opening++;
+    }
+    demux_pool_sources.Increment();
+
+    std::thread([this, source]() {
+      threadutils::set_current_thread_name("url_open");
+      const bool started = source->start_shared();
+
+      // pool may be destroyed right after notification.
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (started && !_stopped) {
+        _turns.emplace(std::chrono::steady_clock::now(), source);
+        _wakeup.notify_one();
+      } else {
+        remove(source);
+      }
+      _opening--;
+      _opened.notify_all();
+    })
+        .detach();
+  }
+
+ private:
+  void run(size_t index) {
+    threadutils::set_current_thread_name("url_demux_" + std::to_string(index));
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_stopped) {
+      if (_turns.empty()) {
+        _wakeup.wait(lock);
+        continue;
+      }
+      auto next = _turns.begin();
+      if (next->first > std::chrono::steady_clock::now()) {
+        _wakeup.wait_until(lock, next->first);
+        continue;
+      }
+      std::shared_ptr<url_source_impl> source = std::move(next->second);
+      _turns.erase(next);
+      lock.unlock();
+
+      const auto next_turn = source->demux_turn();
+
+      lock.lock();
+      if (next_turn) {
+        _turns.emplace(*next_turn, std::move(source));
+        // other threads may wait for a later turn.
+        _wakeup.notify_one();
+      } else {
+        remove(source);
+      }
+    }
+  }
+
+  // expects mutex to be held.
+  void remove(const std::shared_ptr<url_source_impl> &source) {
+    _sources.erase(source);
+    demux_pool_sources.Decrement();
+  }
+
+  std::vector<std::thread> _threads;
+  std::mutex _mutex;
+  std::condition_variable _wakeup;
+  std::condition_variable _opened;
+  // sources by time of their next turn.
+  std::multimap<std::chrono::steady_clock::time_point, std::shared_ptr<url_source_impl>>
+      _turns;
+  // every source of the pool, including ones being opened or demuxed.
+  std::unordered_set<std::shared_ptr<url_source_impl>> _sources;
+  size_t _opening{0};
+  bool _stopped{false};
+};
+
+// keeps source alive while it is demuxed even if consumer is gone.
+struct url_source_handle {
+  std::shared_ptr<url_source_impl> impl;
+};
+
+}  // namespace
+
 streams::publisher<encoded_packet> url_source(const std::string &url,
-                                              const std::string &options) {
-  return streams::generators<encoded_packet>::async<url_source_impl>(
-             [url, options](streams::observer<encoded_packet> &sink) {
-               return new url_source_impl(url, options, sink);
+                                              const url_source_options &options) {
+  auto queued_packets = std::make_shared<std::atomic<size_t>>(0);
+  return streams::generators<encoded_packet>::async<url_source_handle>(
+             [url, options, queued_packets](streams::observer<encoded_packet> &sink) {
+               auto impl =
+                   std::make_shared<url_source_impl>(url, options, queued_packets, sink);
+               if (options.shared_demuxer) {
+                 url_demux_pool::shared().add(impl);
+               } else {
+                 url_source_impl::start_thread(impl);
+               }
+               return new url_source_handle{std::move(impl)};
              },
-             [](url_source_impl *impl) { impl->stop(); })
-         >> streams::flatten() >> repeat_metadata();
+             [](url_source_handle *handle) {
+               handle->impl->stop();
+               delete handle;
+             })
+         >> streams::flatten()
+         >> streams::map([queued_packets](encoded_packet &&packet) {
+             if (boost::get<encoded_frame>(&packet) != nullptr) {
+               (*queued_packets)--;
+             }
+             return std::move(packet);
+           })
+         >> repeat_metadata();
 }
 }  // namespace video
 }  // namespace satori
@@ -0,0 +1,289 @@
+#include "v4l2_capture.h"
+
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "logging.h"
+#include "video_error.h"
+
+namespace satori {
+namespace video {
+
+namespace {
+
+#if defined(__linux__)
+// enough for capture to go on while a few frames are encoded or published.
+constexpr uint32_t capture_buffers = 6;
+
+std::string fourcc_name(uint32_t fourcc) {
+  std::string result(4, ' ');
+  for (size_t i = 0; i < 4; i++) {
+    result[i] = static_cast<char>((fourcc >> (8 * i)) & 0xff);
+  }
+  return result;
+}
+#endif
+
+}  // namespace
+
+// Owns descriptor and buffer mappings, lives while any captured frame references it.
+struct v4l2_capture::device {
+  struct mapping {
+    void *start;
+    size_t length;
+  };
+
+  ~device() {
+#if defined(__linux__)
+    for (const mapping &m : buffers) {
+      munmap(m.start, m.length);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+#endif
+  }
+
+  // retries requests interrupted by signals.
+  int request(unsigned long code, void *arg) {
+    int ret;
+    do {
+      ret = ioctl(fd, code, arg);
+    } while (ret == -1 && errno == EINTR);
+    return ret;
+  }
+
+  // gives buffer back to driver unless capture is over.
+  void enqueue(uint32_t index) {
+#if defined(__linux__)
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!streaming) {
+      return;
+    }
+    v4l2_buffer buffer{};
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    buffer.index = index;
+    if (request(VIDIOC_QBUF, &buffer) < 0) {
+      LOG(ERROR) << "failed to queue buffer " << index << " of " << name << ": "
+                 << std::strerror(errno);
+    }
+#endif
+  }
+
+  std::string name;
+  int fd{-1};
+  ioctl_fn ioctl;
+  std::vector<mapping> buffers;
+  std::mutex mutex;
+  bool streaming{false};
+};
+
+v4l2_capture::v4l2_capture(std::shared_ptr<device> d) : _device(std::move(d)) {}
+
+v4l2_capture::~v4l2_capture() {
+#if defined(__linux__)
+  std::lock_guard<std::mutex> lock(_device->mutex);
+  if (_device->streaming) {
+    v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    _device->request(VIDIOC_STREAMOFF, &type);
+    _device->streaming = false;
+  }
+#endif
+}
+
+std::unique_ptr<v4l2_capture> v4l2_capture::open(const std::string &device_name,
+                                                 const std::vector<uint32_t> &fourccs,
+                                                 uint32_t width, uint32_t height,
+                                                 uint32_t fps) {
+#if defined(__linux__)
+  const int fd = ::open(device_name.c_str(), O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    LOG(ERROR) << "failed to open " << device_name << ": " << std::strerror(errno);
+    return nullptr;
+  }
+  return open(fd, device_name,
+              [](int fd, unsigned long request, void *arg) {
+                return ::ioctl(fd, request, arg);
+              },
+              fourccs, width, height, fps);
+#else
+  LOG(ERROR) << "V4L2 capture is only supported on Linux, can't open " << device_name;
+  return nullptr;
+#endif
+}
+
+std::unique_ptr<v4l2_capture> v4l2_capture::open(int fd, const std::string &device_name,
+                                                 ioctl_fn ioctl,
+                                                 const std::vector<uint32_t> &fourccs,
+                                                 uint32_t width, uint32_t height,
+                                                 uint32_t fps) {
+#if defined(__linux__)
+  auto d = std::make_shared<device>();
+  d->name = device_name;
+  d->fd = fd;
+  d->ioctl = std::move(ioctl);
+
+  v4l2_capability capability{};
+  if (d->request(VIDIOC_QUERYCAP, &capability) < 0
+      || (capability.capabilities & V4L2_CAP_VIDEO_CAPTURE) == 0
+      || (capability.capabilities & V4L2_CAP_STREAMING) == 0) {
+    LOG(ERROR) << device_name << " doesn't support streaming video capture";
+    return nullptr;
+  }
+
+  v4l2_format format{};
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (d->request(VIDIOC_G_FMT, &format) < 0) {
+    LOG(ERROR) << "failed to get format of " << device_name << ": "
+               << std::strerror(errno);
+    return nullptr;
+  }
+  if (width > 0 && height > 0) {
+    format.fmt.pix.width = width;
+    format.fmt.pix.height = height;
+  }
+  format.fmt.pix.field = V4L2_FIELD_ANY;
+
+  // driver picks the closest format it supports, so check what it has picked.
+  bool format_found = false;
+  for (uint32_t fourcc : fourccs) {
+    format.fmt.pix.pixelformat = fourcc;
+    if (d->request(VIDIOC_S_FMT, &format) == 0
+        && format.fmt.pix.pixelformat == fourcc) {
+      format_found = true;
+      break;
+    }
+  }
+  if (!format_found) {
+    LOG(ERROR) << device_name << " doesn't capture any of requested formats";
+    return nullptr;
+  }
+
+  if (fps > 0) {
+    v4l2_streamparm parameters{};
+    parameters.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parameters.parm.capture.timeperframe.numerator = 1;
+    parameters.parm.capture.timeperframe.denominator = fps;
+    if (d->request(VIDIOC_S_PARM, &parameters) < 0) {
+      LOG(WARNING) << "failed to set frame rate of " << device_name << ": "
+                   << std::strerror(errno);
+    }
+  }
+
+  v4l2_requestbuffers request{};
+  request.count = capture_buffers;
+  request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  request.memory = V4L2_MEMORY_MMAP;
+  if (d->request(VIDIOC_REQBUFS, &request) < 0 || request.count == 0) {
+    LOG(ERROR) << device_name << " doesn't support memory mapped buffers";
+    return nullptr;
+  }
+
+  for (uint32_t i = 0; i < request.count; i++) {
+    v4l2_buffer buffer{};
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    buffer.index = i;
+    if (d->request(VIDIOC_QUERYBUF, &buffer) < 0) {
+      LOG(ERROR) << "failed to query buffer of " << device_name << ": "
+                 << std::strerror(errno);
+      return nullptr;
+    }
+    void *start = mmap(nullptr, buffer.length, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd,
+                       buffer.m.offset);
+    if (start == MAP_FAILED) {
+      LOG(ERROR) << "failed to map buffer of " << device_name << ": "
+                 << std::strerror(errno);
+      return nullptr;
+    }
+    d->buffers.push_back(device::mapping{start, buffer.length});
+    if (d->request(VIDIOC_QBUF, &buffer) < 0) {
+      LOG(ERROR) << "failed to queue buffer of " << device_name << ": "
+                 << std::strerror(errno);
+      return nullptr;
+    }
+  }
+
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (d->request(VIDIOC_STREAMON, &type) < 0) {
+    LOG(ERROR) << "failed to start capture of " << device_name << ": "
+               << std::strerror(errno);
+    return nullptr;
+  }
+  d->streaming = true;
+
+  std::unique_ptr<v4l2_capture> capture{new v4l2_capture(std::move(d))};
+  capture->_fourcc = format.fmt.pix.pixelformat;
+  capture->_width = format.fmt.pix.width;
+  capture->_height = format.fmt.pix.height;
+  capture->_bytes_per_line = format.fmt.pix.bytesperline;
+  LOG(INFO) << "capturing " << fourcc_name(capture->_fourcc) << " " << capture->_width
+            << "x" << capture->_height << " from " << device_name << " into "
+            << request.count << " buffers";
+  return capture;
+#else
+  LOG(ERROR) << "V4L2 capture is only supported on Linux, can't open " << device_name;
+  return nullptr;
+#endif
+}
+
+streams::error_or<v4l2_capture::frame> v4l2_capture::next(
+    std::chrono::milliseconds timeout) {
+#if defined(__linux__)
+  while (true) {
+    pollfd descriptor{_device->fd, POLLIN, 0};
+    const int ready = poll(&descriptor, 1, static_cast<int>(timeout.count()));
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ready <= 0) {
+      LOG(ERROR) << "no frames from " << _device->name << " for " << timeout.count()
+                 << "ms";
+      return make_error_condition(video_error::FRAME_GENERATION_ERROR);
+    }
+
+    v4l2_buffer buffer{};
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    if (_device->request(VIDIOC_DQBUF, &buffer) < 0) {
+      if (errno == EAGAIN) {
+        continue;
+      }
+      LOG(ERROR) << "failed to dequeue buffer of " << _device->name << ": "
+                 << std::strerror(errno);
+      return make_error_condition(video_error::FRAME_GENERATION_ERROR);
+    }
+
+    // buffer goes back to driver with the last frame referencing it.
+    std::shared_ptr<device> d = _device;
+    const uint32_t index = buffer.index;
+    frame f;
+    f.owner = std::shared_ptr<const void>(
+        d->buffers[index].start, [d, index](const void *) { d->enqueue(index); });
+    f.data = static_cast<const uint8_t *>(d->buffers[index].start);
+    f.size = buffer.bytesused;
+    f.key_frame = (buffer.flags & V4L2_BUF_FLAG_KEYFRAME) != 0;
+    if ((buffer.flags & V4L2_BUF_FLAG_ERROR) != 0) {
+      LOG(WARNING) << "dropping corrupted frame of " << _device->name;
+      continue;
+    }
+    return f;
+  }
+#else
+  return make_error_condition(video_error::FRAME_GENERATION_ERROR);
+#endif
+}
+
+}  // namespace video
+}  // namespace satori
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "streams/error_or.h"
+
+namespace satori {
+namespace video {
+
+// Camera capture through memory-mapped V4L2 buffers, Linux only. Captured frames
+// point into driver buffers, which go back to the driver once the last reference to
+// the frame is released, so pixels and packets are never copied. Consumers holding
+// all buffers stall the capture.
+class v4l2_capture {
+ public:
+  struct frame {
+    // keeps driver buffer out of the capture queue.
+    std::shared_ptr<const void> owner;
+    const uint8_t *data{nullptr};
+    size_t size{0};
+    bool key_frame{false};
+  };
+
+  // sends V4L2 request to the driver, same contract as ioctl(2).
+  using ioctl_fn = std::function<int(int fd, unsigned long request, void *arg)>;
+
+  // device is like /dev/video0. Formats are tried in the given order, width and
+  // height of 0 keep current size of the device. Returns nothing if device can't
+  // capture any of the formats.
+  static std::unique_ptr<v4l2_capture> open(
+      const std::string &device, const std::vector<uint32_t> &fourccs, uint32_t width,
+      uint32_t height, uint32_t fps);
+
+  // same as above for already opened descriptor, which is closed with the capture.
+  // Requests go through ioctl, so drivers can be emulated.
+  static std::unique_ptr<v4l2_capture> open(
+      int fd, const std::string &name, ioctl_fn ioctl,
+      const std::vector<uint32_t> &fourccs, uint32_t width, uint32_t height,
+      uint32_t fps);
+
+  ~v4l2_capture();
+
+  v4l2_capture(const v4l2_capture &) = delete;
+  v4l2_capture &operator=(const v4l2_capture &) = delete;
+
+  uint32_t fourcc() const { return _fourcc; }
+  uint32_t width() const { return _width; }
+  uint32_t height() const { return _height; }
+  uint32_t bytes_per_line() const { return _bytes_per_line; }
+
+  // waits for the next captured frame.
+  streams::error_or<frame> next(std::chrono::milliseconds timeout);
+
+ private:
+  struct device;
+
+  explicit v4l2_capture(std::shared_ptr<device> d);
+
+  std::shared_ptr<device> _device;
+  uint32_t _fourcc{0};
+  uint32_t _width{0};
+  uint32_t _height{0};
+  uint32_t _bytes_per_line{0};
+};
+
+}  // namespace video
+}  // namespace satori
@@ -1,5 +1,7 @@
 #include "bot_environment.h"
 #include "bot_instance.h"
+#include "cbor_json.h"
+#include "cbor_writer.h"
 #include "metrics.h"
 #include "stopwatch.h"
 
@@ -11,6 +13,61 @@ void bot_message(bot_context& context, const bot_message_kind kind,
   static_cast<bot_instance&>(context).queue_message(kind, std::move(message), id);
 }
 
+void bot_message_cbor(bot_context& context, const bot_message_kind kind,
+                      std::string&& cbor_map, const frame_id& id) {
+  CHECK(cbor_map_head(cbor_map)) << "Message must be a definite length CBOR map";
+  nlohmann::json message = nlohmann::json::object();
+  message[encoded_map_key] = std::move(cbor_map);
+  static_cast<bot_instance&>(context).queue_message(kind, std::move(message), id);
+}
+
+message_writer::message_writer(size_t fields) { cbor_writer{_buffer}.write_map(fields); }
+
+message_writer& message_writer::key(const std::string& name) { return text(name); }
+
+message_writer& message_writer::begin_map(size_t fields) {
+  cbor_writer{_buffer}.write_map(fields);
+  return *this;
+}
+
+message_writer& message_writer::begin_array(size_t size) {
+  cbor_writer{_buffer}.write_array(size);
+  return *this;
+}
+
+message_writer& message_writer::text(const std::string& value) {
+  cbor_writer{_buffer}.write_text(value);
+  return *this;
+}
+
+message_writer& message_writer::integer(int64_t value) {
+  cbor_writer{_buffer}.write_int(value);
+  return *this;
+}
+
+message_writer& message_writer::number(double value) {
+  cbor_writer{_buffer}.write_double(value);
+  return *this;
+}
+
+message_writer& message_writer::boolean(bool value) {
+  cbor_writer{_buffer}.write_bool(value);
+  return *this;
+}
+
+message_writer& message_writer::null() {
+  cbor_writer{_buffer}.write_null();
+  return *this;
+}
+
+void bot_set_crop(bot_context& context, const image_region& region) {
+  static_cast<bot_instance&>(context).set_crop(region);
+}
+
+void bot_convert_frame(bot_context& context, image_frame& frame) {
+  static_cast<bot_instance&>(context).convert_frame(frame);
+}
+
 void multiframe_bot_register(const multiframe_bot_descriptor& bot) {
   bot_environment::instance().register_bot(bot);
 }
@@ -99,7 +156,8 @@ multiframe_bot_img_callback_t to_multiframe_bot_callback(
   return [callback](bot_context& context, const gsl::span<image_frame>& frames) {
     CHECK(!frames.empty());
     auto selected_frames = get_drop_strategy().select_function(frames);
-    for (const auto& f : selected_frames) {
+    for (auto& f : selected_frames) {
+      bot_convert_frame(context, f);
       process_single_frame(context, callback, f);
     }
     context.metrics.frames_dropped_total.Increment(frames.size()
@@ -110,8 +168,15 @@ multiframe_bot_img_callback_t to_multiframe_bot_callback(
 }  // namespace
 
 void bot_register(const bot_descriptor& bot) {
-  multiframe_bot_register({bot.pixel_format, to_multiframe_bot_callback(bot.img_callback),
-                           to_drop_disabling_callback(bot.ctrl_callback)});
+  // dropped frames are not converted.
+  multiframe_bot_descriptor descriptor{
+      bot.pixel_format, to_multiframe_bot_callback(bot.img_callback),
+      to_drop_disabling_callback(bot.ctrl_callback), true, bot.gop_independent};
+  descriptor.max_fps = bot.max_fps;
+  descriptor.device_frames = bot.device_frames;
+  descriptor.motion_vectors = bot.motion_vectors;
+  descriptor.motion_vectors_only = bot.motion_vectors_only;
+  multiframe_bot_register(descriptor);
 }
 
 int bot_main(int argc, char** argv) { return multiframe_bot_main(argc, argv); }
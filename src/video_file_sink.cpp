@@ -1,15 +1,29 @@
 #include "video_streams.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <boost/filesystem.hpp>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include "avutils.h"
 #include "data.h"
 #include "logging.h"
+#include "metrics.h"
+#include "object_storage.h"
+#include "stopwatch.h"
 #include "streams/streams.h"
+#include "threadutils.h"
+#include "uring_file.h"
 
 // TODO: * use AVMEDIA_TYPE_DATA or subtitles for annotations
-// TODO: * maybe use a separate thread for file_writer
 // TODO: * add --segment-frames parameter
 namespace satori {
 namespace video {
@@ -19,6 +33,39 @@ namespace fs = boost::filesystem;
 
 constexpr AVRational milliseconds_time_base = {1, 1000};
 
+// muxer output is written to disk in chunks of that size.
+constexpr int avio_buffer_size = 1024 * 1024;
+// written data is synced to disk every that many bytes and when a file is closed.
+constexpr size_t sync_bytes = 16 * 1024 * 1024;
+// how much of the stream waits for the writer thread before the pipeline is blocked.
+constexpr size_t max_buffered_bytes = 64 * 1024 * 1024;
+
+// CMAF compatible fragment per GOP.
+constexpr const char *fragmented_movflags = "frag_keyframe+empty_moov+default_base_moof";
+
+const std::vector<double> write_millis_buckets{0,  1,   2,   5,   10,   25,  50,
+                                               75, 100, 250, 500, 1000, 5000};
+
+auto &write_millis = prometheus::BuildHistogram()
+                         .Name("video_file_sink_write_millis")
+                         .Register(metrics_registry())
+                         .Add({}, write_millis_buckets);
+
+auto &sync_millis = prometheus::BuildHistogram()
+                        .Name("video_file_sink_sync_millis")
+                        .Register(metrics_registry())
+                        .Add({}, write_millis_buckets);
+
+auto &buffered_bytes = prometheus::BuildGauge()
+                           .Name("video_file_sink_buffered_bytes")
+                           .Register(metrics_registry())
+                           .Add({});
+
+auto &stalled_millis = prometheus::BuildHistogram()
+                           .Name("video_file_sink_stalled_millis")
+                           .Register(metrics_registry())
+                           .Add({}, write_millis_buckets);
+
 fs::path temp_dir(const fs::path &work_path) {
   CHECK(work_path.has_extension());
 
@@ -45,7 +92,8 @@ class stream_decoder {
     avutils::init();
     _packet = avutils::av_packet();
     _frame = avutils::av_frame();
-    _context = avutils::decoder_context(_metadata.codec_name, _metadata.codec_data);
+    const std::string codec_data = _metadata.codec_data.str();
+    _context = avutils::decoder_context(_metadata.codec_name, codec_data);
   }
 
   void feed(const encoded_frame &f) {
@@ -113,22 +161,184 @@ AVStream *create_video_stream(AVFormatContext &format_context,
   return video_stream;
 }
 
+// Destination of muxer output, used on write thread only.
+class segment_output {
+ public:
+  virtual ~segment_output() = default;
+
+  // returns size or AVERROR.
+  virtual int write(const uint8_t *data, int size) = 0;
+  // muxers which can't seek write files which don't need it.
+  virtual bool seekable() const = 0;
+  virtual int64_t seek(int64_t offset, int whence) = 0;
+  // muxer is done, data is where it should be when it returns.
+  virtual void close() = 0;
+};
+
+// Local file, synced to disk every sync_bytes and when closed.
+class file_output : public segment_output {
+ public:
+  explicit file_output(const fs::path &filename) : _filename{filename} {
+    LOG(INFO) << "Opening file " << _filename;
+    _fd = ::open(_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK_GE(_fd, 0) << "failed to open file: " << std::strerror(errno);
+  }
+
+  ~file_output() override {
+    if (_fd >= 0) {
+      close();
+    }
+  }
+
+  int write(const uint8_t *data, int size) override {
+    stopwatch<std::chrono::steady_clock> s;
+    int written = 0;
+    while (written < size) {
+      const ssize_t ret = ::write(_fd, data + written, size - written);
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret < 0) {
+        LOG(ERROR) << "failed to write " << _filename << ": " << std::strerror(errno);
+        return AVERROR(errno);
+      }
+      written += static_cast<int>(ret);
+    }
+    write_millis.Observe(s.millis());
+
+    _unsynced_bytes += size;
+    if (_unsynced_bytes >= sync_bytes) {
+      sync();
+    }
+    return size;
+  }
+
+  bool seekable() const override { return true; }
+
+  int64_t seek(int64_t offset, int whence) override {
+    if (whence == AVSEEK_SIZE) {
+      struct stat st {};
+      return fstat(_fd, &st) < 0 ? AVERROR(errno) : st.st_size;
+    }
+    const off_t ret = lseek(_fd, offset, whence & ~AVSEEK_FORCE);
+    return ret < 0 ? AVERROR(errno) : ret;
+  }
+
+  void close() override {
+    sync();
+    ::close(_fd);
+    _fd = -1;
+  }
+
+ private:
+  void sync() {
+    if (_unsynced_bytes == 0) {
+      return;
+    }
+    stopwatch<std::chrono::steady_clock> s;
+    if (fdatasync(_fd) < 0) {
+      LOG(ERROR) << "failed to sync " << _filename << ": " << std::strerror(errno);
+    }
+    sync_millis.Observe(s.millis());
+    _unsynced_bytes = 0;
+  }
+
+  const fs::path _filename;
+  int _fd{-1};
+  size_t _unsynced_bytes{0};
+};
+
+// Local file written through io_uring in aligned buffers, see uring_file.
+class uring_output : public segment_output {
+ public:
+  uring_output(const fs::path &filename, const uring_file_options &options)
+      : _file{filename.string(), options} {
+    LOG(INFO) << "Opened file " << filename << " for io_uring"
+              << (options.direct ? " with direct io" : "");
+  }
+
+  int write(const uint8_t *data, int size) override {
+    stopwatch<std::chrono::steady_clock> s;
+    const int err = _file.write(data, static_cast<size_t>(size));
+    if (err < 0) {
+      return AVERROR(-err);
+    }
+    write_millis.Observe(s.millis());
+    return size;
+  }
+
+  bool seekable() const override { return true; }
+
+  int64_t seek(int64_t offset, int whence) override {
+    if (whence == AVSEEK_SIZE) {
+      return _file.size();
+    }
+    const int64_t ret = _file.seek(offset, whence & ~AVSEEK_FORCE);
+    return ret < 0 ? AVERROR(-ret) : ret;
+  }
+
+  void close() override {
+    stopwatch<std::chrono::steady_clock> s;
+    _file.close();
+    sync_millis.Observe(s.millis());
+  }
+
+ private:
+  uring_file _file;
+};
+
+// Object in storage, muxer output goes straight to multipart upload, which keeps
+// at most a part in memory. Object appears once it is closed.
+class upload_output : public segment_output {
+ public:
+  upload_output(const object_storage_config &config, const object_url &url)
+      : _upload{config, url} {
+    LOG(INFO) << "Uploading " << url.key << " to bucket " << url.bucket;
+  }
+
+  int write(const uint8_t *data, int size) override {
+    stopwatch<std::chrono::steady_clock> s;
+    if (!_upload.write(data, static_cast<size_t>(size))) {
+      return AVERROR(EIO);
+    }
+    write_millis.Observe(s.millis());
+    return size;
+  }
+
+  bool seekable() const override { return false; }
+
+  int64_t seek(int64_t /*offset*/, int /*whence*/) override { return AVERROR(ENOSYS); }
+
+  void close() override { CHECK(_upload.complete()) << "failed to upload segment"; }
+
+ private:
+  multipart_upload _upload;
+};
+
+// Muxes stream into an output through a large buffer of its own, so the output sees
+// a few big writes instead of many small ones. Fragmented files are MP4 with empty
+// moov and a moof per GOP, every fragment reaches the output once the next GOP
+// starts.
 // TODO: maybe add a check for supported codecs and containers
 class video_file_writer {
  public:
-  video_file_writer(const fs::path &filename, const stream_decoder &decoder,
-                    const std::unordered_map<std::string, std::string> &options)
-      : _filename{filename} {
+  video_file_writer(const fs::path &filename, std::unique_ptr<segment_output> output,
+                    const stream_decoder &decoder,
+                    const std::unordered_map<std::string, std::string> &options,
+                    bool fragmented)
+      : _filename{filename}, _output{std::move(output)}, _fragmented{fragmented} {
     avutils::init();
 
     LOG(INFO) << "Creating format context for file " << _filename;
-    _format_context =
-        avutils::output_format_context("", _filename.string(), [](AVFormatContext *ctx) {
+    _format_context = avutils::output_format_context(
+        _fragmented ? "mp4" : "", _filename.string(), [](AVFormatContext *ctx) {
           if (ctx->pb != nullptr) {
             LOG(INFO) << "Writing trailer section into file " << ctx->filename;
             av_write_trailer(ctx);
             LOG(INFO) << "Closing file " << ctx->filename;
-            avio_closep(&ctx->pb);
+            avio_flush(ctx->pb);
+            av_freep(&ctx->pb->buffer);
+            avio_context_free(&ctx->pb);
           }
         });
     CHECK(_format_context) << "could not allocate format context for " << _filename;
@@ -136,9 +346,13 @@ class video_file_writer {
     LOG(INFO) << "Creating video stream for file " << _filename;
     _video_stream = create_video_stream(*_format_context, decoder);
 
-    LOG(INFO) << "Opening file " << _filename;
-    int ret = avio_open(&_format_context->pb, _filename.c_str(), AVIO_FLAG_WRITE);
-    CHECK_GE(ret, 0) << "failed to open file: " << avutils::error_msg(ret);
+    auto buffer = reinterpret_cast<uint8_t *>(av_malloc(avio_buffer_size));
+    CHECK(buffer);
+    // without seek callback muxers know the output is not seekable.
+    _format_context->pb = avio_alloc_context(
+        buffer, avio_buffer_size, 1, this, nullptr, &video_file_writer::write,
+        _output->seekable() ? &video_file_writer::seek : nullptr);
+    CHECK(_format_context->pb) << "failed to allocate io context for " << _filename;
 
     LOG(INFO) << "Writing header section into file " << _filename;
     AVDictionary *options_dict{nullptr};
@@ -146,17 +360,31 @@ class video_file_writer {
       LOG(2) << "Adding container option: {" << kv.first << "," << kv.second << "}";
       av_dict_set(&options_dict, kv.first.c_str(), kv.second.c_str(), 0);
     }
-    ret = avformat_write_header(_format_context.get(), &options_dict);
+    if (_fragmented) {
+      av_dict_set(&options_dict, "movflags", fragmented_movflags, AV_DICT_DONT_OVERWRITE);
+    }
+    int ret = avformat_write_header(_format_context.get(), &options_dict);
     CHECK_GE(ret, 0) << "failed to write header: " << avutils::error_msg(ret);
     av_dict_free(&options_dict);
+    if (_fragmented) {
+      avio_flush(_format_context->pb);
+    }
   }
 
+  ~video_file_writer() {
+    // writes trailer through the buffer.
+    _format_context.reset();
+    _output->close();
+  }
+
+  video_file_writer(const video_file_writer &) = delete;
+  video_file_writer &operator=(const video_file_writer &) = delete;
+
   void write_frame(const encoded_frame &f) {
     if (!_started_processing) {
       _started_processing = true;
       _start_ts = f.timestamp;
     }
-    _last_ts = f.timestamp;
 
     AVPacket packet{nullptr};
     av_init_packet(&packet);
@@ -174,27 +402,102 @@ class video_file_writer {
     int ret = av_interleaved_write_frame(_format_context.get(), &packet);
     CHECK_GE(ret, 0) << "failed to write packet: " << avutils::error_msg(ret);
     av_packet_unref(&packet);
-  }
 
-  fs::path filename() const { return _filename; }
+    // key frame has closed the previous fragment.
+    if (_fragmented && f.key_frame) {
+      avio_flush(_format_context->pb);
+    }
+  }
 
-  std::chrono::system_clock::time_point start_ts() const {
-    CHECK(_started_processing);
-    return _start_ts;
+ private:
+  static int write(void *opaque, uint8_t *data, int size) {
+    return static_cast<video_file_writer *>(opaque)->_output->write(data, size);
   }
 
-  std::chrono::system_clock::time_point last_ts() const {
-    CHECK(_started_processing);
-    return _last_ts;
+  static int64_t seek(void *opaque, int64_t offset, int whence) {
+    return static_cast<video_file_writer *>(opaque)->_output->seek(offset, whence);
   }
 
- private:
   const fs::path _filename;
+  const std::unique_ptr<segment_output> _output;
+  const bool _fragmented;
   std::shared_ptr<AVFormatContext> _format_context{nullptr};
   AVStream *_video_stream{nullptr};
   bool _started_processing{false};
   std::chrono::system_clock::time_point _start_ts;
-  std::chrono::system_clock::time_point _last_ts;
+};
+
+// Runs file operations of a sink in order on a thread of its own, so slow disk
+// doesn't stall the pipeline until max_buffered_bytes of frames are waiting.
+class write_thread {
+ public:
+  write_thread() : _thread([this]() { run(); }) {}
+
+  // waits for posted operations.
+  ~write_thread() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _tasks_added.notify_one();
+    _thread.join();
+  }
+
+  // bytes is the amount of data task writes, blocks while the buffer is full.
+  void post(size_t bytes, std::function<void()> &&task) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_buffered_bytes > 0 && _buffered_bytes + bytes > max_buffered_bytes) {
+      LOG(WARNING) << "file writer is behind, waiting for it";
+      stopwatch<std::chrono::steady_clock> s;
+      _tasks_done.wait(lock, [this, bytes]() {
+        return _buffered_bytes == 0 || _buffered_bytes + bytes <= max_buffered_bytes;
+      });
+      stalled_millis.Observe(s.millis());
+    }
+    _tasks.emplace_back(bytes, std::move(task));
+    _buffered_bytes += bytes;
+    buffered_bytes.Increment(bytes);
+    _tasks_added.notify_one();
+  }
+
+ private:
+  void run() {
+    threadutils::set_current_thread_name("file_writer");
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+      _tasks_added.wait(lock, [this]() { return _stopping || !_tasks.empty(); });
+      if (_tasks.empty()) {
+        return;
+      }
+      auto task = std::move(_tasks.front());
+      _tasks.pop_front();
+
+      lock.unlock();
+      task.second();
+      lock.lock();
+
+      _buffered_bytes -= task.first;
+      buffered_bytes.Decrement(task.first);
+      _tasks_done.notify_one();
+    }
+  }
+
+  std::mutex _mutex;
+  std::condition_variable _tasks_added;
+  std::condition_variable _tasks_done;
+  std::deque<std::pair<size_t, std::function<void()>>> _tasks;
+  size_t _buffered_bytes{0};
+  bool _stopping{false};
+  std::thread _thread;
+};
+
+// file being written, writer is only used on write thread.
+struct segment {
+  // segment is renamed once complete, unless it was written under its final name.
+  fs::path temp_path;
+  std::chrono::system_clock::time_point start_ts;
+  std::chrono::system_clock::time_point last_ts;
+  std::unique_ptr<video_file_writer> writer;
 };
 
 class video_file_sink_impl : public streams::subscriber<encoded_packet>,
@@ -203,24 +506,45 @@ class video_file_sink_impl : public streams::subscriber<encoded_packet>,
   video_file_sink_impl(
       const fs::path &path,
       const boost::optional<std::chrono::system_clock::duration> &segment_duration,
-      std::unordered_map<std::string, std::string> &&options)
+      std::unordered_map<std::string, std::string> &&options, bool fragmented,
+      int request_window_size,
+      const boost::optional<object_storage_config> &storage = boost::none,
+      const boost::optional<uring_file_options> &uring = boost::none)
       : _path{path},
-        _temp_file_template{temp_file_template(temp_dir(path), path.extension())},
+        _storage{storage},
+        _uring{uring},
+        _temp_file_template{
+            storage ? fs::path{} : temp_file_template(temp_dir(path), path.extension())},
         _segment_duration{segment_duration},
-        _options{std::move(options)} {}
+        _options{std::move(options)},
+        _fragmented{fragmented},
+        _window{request_window_size},
+        _write_thread{std::make_unique<write_thread>()} {}
 
   ~video_file_sink_impl() override {
-    if (_file_writer) {
-      release_writer();
+    if (_segment) {
+      release_segment();
     }
+    // finishes writing.
+    _write_thread.reset();
   }
 
   void operator()(const encoded_metadata &metadata) {
     if (_decoder) {
-      LOG(1) << "ignoring metadata";
-      return;
+      const encoded_metadata &current = _decoder->metadata();
+      if (metadata.codec_name == current.codec_name
+          && metadata.codec_data == current.codec_data) {
+        LOG(1) << "ignoring metadata";
+        return;
+      }
+      // copied packets must match codec data of the file, following frames go to
+      // a new segment starting with a key frame.
+      LOG(INFO) << "stream parameters changed, closing current segment";
+      if (_segment) {
+        release_segment();
+      }
     }
-    _decoder = std::make_unique<stream_decoder>(metadata);
+    _decoder = std::make_shared<stream_decoder>(metadata);
   }
 
   void operator()(const encoded_frame &f) {
@@ -238,35 +562,62 @@ class video_file_sink_impl : public streams::subscriber<encoded_packet>,
       return;
     }
 
+    // segments are cut at the first key frame after segment duration, so every
+    // segment decodes by itself and is a bit longer than segment duration.
     if (f.key_frame) {
-      if (_segment_duration && _file_writer
-          && f.timestamp >= _file_writer->start_ts() + *_segment_duration) {
-        release_writer();
+      if (_segment_duration && _segment
+          && f.timestamp >= _segment->start_ts + *_segment_duration) {
+        release_segment();
       }
 
-      if (!_file_writer) {
-        _file_writer =
-            std::make_unique<video_file_writer>(temp_filename(), *_decoder, _options);
-        LOG(INFO) << "started new file " << _file_writer->filename();
+      if (!_segment) {
+        _segment = std::make_shared<segment>();
+        _segment->start_ts = f.timestamp;
+        // objects can't be renamed, they are named when upload starts.
+        _segment->temp_path =
+            _fragmented || _storage ? in_progress_filename() : temp_filename();
+        LOG(INFO) << "starting new file " << _segment->temp_path;
+        _write_thread->post(0, [s = _segment, decoder = _decoder, options = _options,
+                                fragmented = _fragmented, storage = _storage,
+                                uring = _uring]() {
+          std::unique_ptr<segment_output> output;
+          if (storage) {
+            output = std::make_unique<upload_output>(
+                *storage, *parse_object_url(s->temp_path.string()));
+          } else if (uring) {
+            output = std::make_unique<uring_output>(s->temp_path, *uring);
+          } else {
+            output = std::make_unique<file_output>(s->temp_path);
+          }
+          s->writer = std::make_unique<video_file_writer>(
+              s->temp_path, std::move(output), *decoder, options, fragmented);
+        });
       }
     }
 
-    if (_file_writer) {
-      _file_writer->write_frame(f);
+    if (_segment) {
+      _segment->last_ts = f.timestamp;
+      _write_thread->post(f.data.size(),
+                          [s = _segment, f]() { s->writer->write_frame(f); });
     }
   }
 
  private:
-  void release_writer() {
-    const fs::path old_name = _file_writer->filename();
-    const fs::path new_name = current_filename();
-    _file_writer.reset();
+  void release_segment() {
+    const fs::path new_name = _storage ? _segment->temp_path : current_filename();
+    _write_thread->post(0, [s = std::move(_segment), new_name]() {
+      s->writer.reset();
+      if (s->temp_path == new_name) {
+        return;
+      }
 
-    boost::system::error_code ec;
-    fs::rename(old_name, new_name, ec);
-    CHECK_EQ(ec.value(), 0) << "Failed to rename " << old_name << " to " << new_name
-                            << ": " << ec.message();
-    LOG(INFO) << "Successfully renamed " << old_name << " to " << new_name;
+      boost::system::error_code ec;
+      fs::rename(s->temp_path, new_name, ec);
+      CHECK_EQ(ec.value(), 0) << "Failed to rename " << s->temp_path << " to "
+                              << new_name << ": " << ec.message();
+      LOG(INFO) << "Successfully renamed " << s->temp_path << " to " << new_name;
+    });
+    _segment.reset();
   }
 
   fs::path current_filename() const {
@@ -275,10 +626,10 @@ class video_file_sink_impl : public streams::subscriber<encoded_packet>,
     }
 
     const auto start_epoch_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                                    _file_writer->start_ts().time_since_epoch())
+                                    _segment->start_ts.time_since_epoch())
                                     .count();
     const auto end_epoch_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                                  _file_writer->last_ts().time_since_epoch())
+                                  _segment->last_ts.time_since_epoch())
                                   .count();
     fs::path result{_path.stem()};
     result += "-";
@@ -289,6 +640,23 @@ class video_file_sink_impl : public streams::subscriber<encoded_packet>,
     return _path.parent_path() / result;
   }
 
+  // fragmented files are readable while written, so they get a name without end
+  // time right away.
+  fs::path in_progress_filename() const {
+    if (!_segment_duration) {
+      return _path.string();
+    }
+
+    const auto start_epoch_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                    _segment->start_ts.time_since_epoch())
+                                    .count();
+    fs::path result{_path.stem()};
+    result += "-";
+    result += std::to_string(start_epoch_ms);
+    result += _path.extension();
+    return _path.parent_path() / result;
+  }
+
   fs::path temp_filename() const {
     boost::system::error_code ec;
     auto result = fs::unique_path(_temp_file_template, ec);
@@ -299,7 +667,7 @@ class video_file_sink_impl : public streams::subscriber<encoded_packet>,
   // TODO: propagate error down the stream if encoder is not supported
   void on_next(encoded_packet &&packet) override {
     boost::apply_visitor(*this, packet);
-    _src->request(1);
+    _window.on_consumed();
   }
 
   void on_error(std::error_condition ec) override { ABORT() << ec.message(); }
@@ -309,18 +677,19 @@ class video_file_sink_impl : public streams::subscriber<encoded_packet>,
     delete this;
   }
 
-  void on_subscribe(streams::subscription &s) override {
-    _src = &s;
-    _src->request(1);
-  }
+  void on_subscribe(streams::subscription &s) override { _window.start(s); }
 
   const fs::path _path;
+  const boost::optional<object_storage_config> _storage;
+  const boost::optional<uring_file_options> _uring;
   const fs::path _temp_file_template;
   const boost::optional<std::chrono::system_clock::duration> _segment_duration;
   const std::unordered_map<std::string, std::string> _options;
-  std::unique_ptr<stream_decoder> _decoder{nullptr};
-  std::unique_ptr<video_file_writer> _file_writer{nullptr};
-  streams::subscription *_src{nullptr};
+  const bool _fragmented;
+  std::shared_ptr<stream_decoder> _decoder{nullptr};
+  std::shared_ptr<segment> _segment{nullptr};
+  streams::request_window _window;
+  std::unique_ptr<write_thread> _write_thread;
 };
 
 }  // namespace
@@ -328,8 +697,28 @@ class video_file_sink_impl : public streams::subscriber<encoded_packet>,
 streams::subscriber<encoded_packet> &video_file_sink(
     const fs::path &path,
     const boost::optional<std::chrono::system_clock::duration> &segment_duration,
-    std::unordered_map<std::string, std::string> &&options) {
-  return *(new video_file_sink_impl(path, segment_duration, std::move(options)));
+    std::unordered_map<std::string, std::string> &&options, bool fragmented,
+    int request_window_size, const boost::optional<uring_file_options> &uring) {
+  return *(new video_file_sink_impl(path, segment_duration, std::move(options),
+                                    fragmented, request_window_size, boost::none,
+                                    uring));
+}
+
+streams::subscriber<encoded_packet> &object_storage_sink(
+    const object_storage_config &storage, const fs::path &url,
+    const boost::optional<std::chrono::system_clock::duration> &segment_duration,
+    std::unordered_map<std::string, std::string> &&options, bool fragmented,
+    int request_window_size) {
+  CHECK(parse_object_url(url.string())) << "bad object url " << url;
+  // MP4 moov atom has to be written at the start or rewritten at the end, muxer
+  // can't do either without seeking.
+  const std::string extension = url.extension().string();
+  if (!fragmented && (extension == ".mp4" || extension == ".mov")) {
+    LOG(INFO) << "object storage gets fragmented MP4 for " << url;
+    fragmented = true;
+  }
+  return *(new video_file_sink_impl(url, segment_duration, std::move(options),
+                                    fragmented, request_window_size, storage));
 }
 
 }  // namespace video
@@ -1,4 +1,7 @@
 #include "video_metrics.h"
+
+#include <algorithm>
+
 #include "metrics.h"
 #include "statsutils.h"
 
@@ -53,10 +56,10 @@ auto &frame_delivery_delay_millis_family = prometheus::BuildHistogram()
                                                .Name("frame_delivery_delay_millis")
                                                .Register(metrics_registry());
 
-double observe_time_delta(const std::chrono::system_clock::time_point &t1,
-                          const std::chrono::system_clock::time_point &t2,
-                          prometheus::Histogram &histogram) {
-  const double delta =
+int64_t observe_time_delta(const std::chrono::system_clock::time_point &t1,
+                           const std::chrono::system_clock::time_point &t2,
+                           prometheus::Histogram &histogram) {
+  const int64_t delta =
       std::abs(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t2).count());
   histogram.Observe(delta);
   return delta;
@@ -64,8 +67,10 @@ double observe_time_delta(const std::chrono::system_clock::time_point &t1,
 
 struct network_metrics_collector : boost::static_visitor<void> {
  public:
-  explicit network_metrics_collector(const std::string &channel)
-      : _frame_id_deltas(frame_id_deltas_family.Add(
+  network_metrics_collector(const std::string &channel,
+                            const video_metrics_options &options)
+      : _sampling{std::max(options.sampling, 1)},
+        _frame_id_deltas(frame_id_deltas_family.Add(
             {{"channel", channel}}, std::vector<double>(id_delta_buckets))),
         _frame_time_delta_millis(frame_time_delta_millis_family.Add(
             {{"channel", channel}}, std::vector<double>(time_delta_buckets))),
@@ -85,23 +90,9 @@ struct network_metrics_collector : boost::static_visitor<void> {
   void operator()(const network_frame &f) {
     if (_first_frame) {
       _first_frame = false;
-    } else {
-      _frame_id_deltas.Observe(std::abs(f.id.i1 - _last_id.i1));
-
-      observe_time_delta(f.t, _last_time, _frame_time_delta_millis);
-      const double departure_time_delta = observe_time_delta(
-          f.dt, _last_departure_time, _frame_departure_time_delta_millis);
-      const double arrival_time_delta = observe_time_delta(
-          f.arrival_time, _last_arrival_time, _frame_arrival_time_delta_millis);
-
-      _frame_delivery_delay_millis.Observe(
-          std::abs(departure_time_delta - arrival_time_delta));
-
-      _departure_time_jitter.emplace(departure_time_delta);
-      _arrival_time_jitter.emplace(arrival_time_delta);
-
-      _frame_departure_time_jitter.Observe(_departure_time_jitter.value());
-      _frame_arrival_time_jitter.Observe(_arrival_time_jitter.value());
+    } else if (--_frames_to_sample == 0) {
+      _frames_to_sample = _sampling;
+      observe(f);
     }
 
     _last_id = f.id;
@@ -111,6 +102,35 @@ struct network_metrics_collector : boost::static_visitor<void> {
   }
 
  private:
+  void observe(const network_frame &f) {
+    _frame_id_deltas.Observe(std::abs(f.id.i1 - _last_id.i1));
+
+    observe_time_delta(f.t, _last_time, _frame_time_delta_millis);
+    const int64_t departure_time_delta = observe_time_delta(
+        f.dt, _last_departure_time, _frame_departure_time_delta_millis);
+    const int64_t arrival_time_delta = observe_time_delta(
+        f.arrival_time, _last_arrival_time, _frame_arrival_time_delta_millis);
+
+    _frame_delivery_delay_millis.Observe(
+        std::abs(departure_time_delta - arrival_time_delta));
+
+    if (_sampling > 1) {
+      _departure_time_integer_jitter.emplace(departure_time_delta);
+      _arrival_time_integer_jitter.emplace(arrival_time_delta);
+      _frame_departure_time_jitter.Observe(_departure_time_integer_jitter.value());
+      _frame_arrival_time_jitter.Observe(_arrival_time_integer_jitter.value());
+      return;
+    }
+
+    _departure_time_jitter.emplace(departure_time_delta);
+    _arrival_time_jitter.emplace(arrival_time_delta);
+
+    _frame_departure_time_jitter.Observe(_departure_time_jitter.value());
+    _frame_arrival_time_jitter.Observe(_arrival_time_jitter.value());
+  }
+
+  const int _sampling;
+  int _frames_to_sample{1};
   prometheus::Histogram &_frame_id_deltas;
   prometheus::Histogram &_frame_time_delta_millis;
   prometheus::Histogram &_frame_arrival_time_delta_millis;
@@ -128,13 +148,15 @@ struct network_metrics_collector : boost::static_visitor<void> {
   // TODO: prometheus can probably calculate standard deviation on it's own.
   statsutils::std_dev _departure_time_jitter{1000};
   statsutils::std_dev _arrival_time_jitter{1000};
+  statsutils::integer_jitter _departure_time_integer_jitter;
+  statsutils::integer_jitter _arrival_time_integer_jitter;
 };
 }  // namespace
 
 streams::op<network_packet, network_packet> report_video_metrics(
-    const std::string &channel_name) {
-  return [channel_name](streams::publisher<network_packet> &&src) {
-    network_metrics_collector visitor(channel_name);
+    const std::string &channel_name, const video_metrics_options &options) {
+  return [channel_name, options](streams::publisher<network_packet> &&src) {
+    network_metrics_collector visitor(channel_name, options);
     return std::move(src)
            >> streams::map([visitor = std::move(visitor)](network_packet && p) mutable {
                boost::apply_visitor(visitor, p);
@@ -6,8 +6,14 @@
 namespace satori {
 namespace video {
 
+struct video_metrics_options {
+  // 1 in that many frames is observed, its deltas are still taken to the frame just
+  // before. Sampled streams estimate jitter by integer math, see integer_jitter.
+  int sampling{1};
+};
+
 streams::op<network_packet, network_packet> report_video_metrics(
-    const std::string& channel_name);
+    const std::string& channel_name, const video_metrics_options& options = {});
 
 }  // namespace video
 }  // namespace satori
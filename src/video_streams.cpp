@@ -1,7 +1,9 @@
 #include <boost/accumulators/accumulators.hpp>
 #include <boost/accumulators/statistics.hpp>
 #include <boost/accumulators/statistics/rolling_window.hpp>
+#include <cstring>
 #include <iostream>
+#include <map>
 
 #include "base64.h"
 #include "logging.h"
@@ -19,93 +21,310 @@ auto &frame_chunks_mismatch = prometheus::BuildCounter()
                                   .Register(metrics_registry())
                                   .Add({});
 
+auto &late_chunks = prometheus::BuildCounter()
+                        .Name("network_decoder_late_chunks")
+                        .Register(metrics_registry())
+                        .Add({});
+
+auto &duplicate_chunks = prometheus::BuildCounter()
+                             .Name("network_decoder_duplicate_chunks")
+                             .Register(metrics_registry())
+                             .Add({});
+
+auto &skipped_chunks = prometheus::BuildCounter()
+                           .Name("network_decoder_skipped_chunks")
+                           .Register(metrics_registry())
+                           .Add({});
+
+auto &incomplete_frames = prometheus::BuildCounter()
+                              .Name("network_decoder_incomplete_frames")
+                              .Register(metrics_registry())
+                              .Add({});
+
 auto &frame_chunks =
     prometheus::BuildHistogram()
         .Name("frame_chunks")
         .Register(metrics_registry())
         .Add({}, std::vector<double>{1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 15, 20});
 
+size_t chunk_max_size(const network_frame &nf) {
+  return nf.binary_data.empty() ? base64::decoded_max_size(nf.base64_data.size())
+                                : nf.binary_data.size();
+}
+
+// returns number of bytes written to out.
+size_t decode_chunk(const network_frame &nf, char *out) {
+  if (!nf.binary_data.empty()) {
+    std::memcpy(out, nf.binary_data.data(), nf.binary_data.size());
+    return nf.binary_data.size();
+  }
+  const auto size_or_error =
+      base64::decode(nf.base64_data.data(), nf.base64_data.size(), out);
+  CHECK(size_or_error.ok()) << "bad base64 data: " << nf.base64_data;
+  return size_or_error.get();
+}
+
+// bounds on frames which are still waiting for chunks.
+constexpr size_t max_pending_frames = 8;
+constexpr std::chrono::seconds pending_frame_timeout{2};
+
+// Chunks are decoded right into the frame buffer, chunk i goes to offset
+// i * slot. All chunks but the last one have the same size, so the buffer usually
+// needs no compaction.
+struct pending_frame {
+  explicit pending_frame(const network_frame &nf)
+      : timestamp(nf.t),
+        creation_time(nf.arrival_time),
+        key_frame(nf.key_frame),
+        chunks(nf.chunks),
+        first_seen(std::chrono::steady_clock::now()),
+        sizes(nf.chunks, std::string::npos) {}
+
+  bool has_chunk(uint32_t chunk) const { return sizes[chunk - 1] != std::string::npos; }
+
+  bool complete() const { return received == chunks; }
+
+  // returns false if chunk doesn't fit into frame buffer.
+  bool add_chunk(const network_frame &nf) {
+    const size_t index = nf.chunk - 1;
+    const size_t max_size = chunk_max_size(nf);
+
+    if (slot == 0 && nf.chunk == chunks && chunks > 1) {
+      // slot size is not known until one of the other chunks arrives.
+      last_chunk.resize(max_size);
+      last_chunk.resize(decode_chunk(nf, &last_chunk[0]));
+      sizes[index] = last_chunk.size();
+      received++;
+      return true;
+    }
+
+    if (slot == 0) {
+      slot = max_size;
+      data.resize(chunks * slot);
+    } else if (max_size > slot) {
+      return false;
+    }
+
+    sizes[index] = decode_chunk(nf, &data[index * slot]);
+    received++;
+    return true;
+  }
+
+  encoded_frame to_frame(const frame_id &id) {
+    size_t size = 0;
+    for (size_t i = 0; i < chunks; i++) {
+      if (i == chunks - 1 && !last_chunk.empty()) {
+        data.replace(size, std::string::npos, last_chunk);
+      } else if (size != i * slot) {
+        std::memmove(&data[size], &data[i * slot], sizes[i]);
+      }
+      size += sizes[i];
+    }
+    data.resize(size);
+
+    encoded_frame frame;
+    frame.data = std::move(data);
+    frame.id = id;
+    frame.timestamp = timestamp;
+    frame.creation_time = creation_time;
+    frame.key_frame = key_frame;
+    return frame;
+  }
+
+  const std::chrono::system_clock::time_point timestamp;
+  const std::chrono::system_clock::time_point creation_time;
+  const bool key_frame;
+  const uint32_t chunks;
+  const std::chrono::steady_clock::time_point first_seen;
+
+  // decoded size of each chunk, npos if chunk wasn't received yet.
+  std::vector<size_t> sizes;
+  uint32_t received{0};
+  size_t slot{0};
+  std::string data;
+  std::string last_chunk;
+};
+
 }  // namespace
 
-streams::op<network_packet, encoded_packet> decode_network_stream() {
-  struct packet_visitor : boost::static_visitor<streams::publisher<encoded_packet>> {
+streams::op<network_packet, encoded_packet> decode_network_stream(
+    const network_decode_options &options) {
+  struct packet_visitor : boost::static_visitor<boost::optional<encoded_packet>> {
    public:
-    streams::publisher<encoded_packet> operator()(const network_metadata &nm) {
+    explicit packet_visitor(const network_decode_options &options)
+        : _options(options) {}
+
+    boost::optional<encoded_packet> operator()(const network_metadata &nm) {
       encoded_metadata em;
       em.codec_name = nm.codec_name;
-      const auto data_or_error = base64::decode(nm.base64_data);
-      CHECK(data_or_error.ok()) << "bad base64 data: " << nm.base64_data;
-      em.codec_data = data_or_error.get();
-      return streams::publishers::of({encoded_packet{em}});
+      if (!nm.binary_data.empty()) {
+        em.codec_data = nm.binary_data;
+      } else {
+        const auto data_or_error = base64::decode(nm.base64_data);
+        CHECK(data_or_error.ok()) << "bad base64 data: " << nm.base64_data;
+        em.codec_data = data_or_error.get();
+      }
+      return encoded_packet{em};
     }
 
-    streams::publisher<encoded_packet> operator()(const network_frame &nf) {
-      if (_chunk != nf.chunk) {
-        LOG(ERROR) << "chunk mismatch f.id=" << nf.id << " expected " << _chunk
-                   << ", got " << nf.chunk;
+    boost::optional<encoded_packet> operator()(const network_frame &nf) {
+      const auto now = std::chrono::steady_clock::now();
+      expire(now);
+
+      if (nf.chunks == 0 || nf.chunk == 0 || nf.chunk > nf.chunks) {
+        LOG(ERROR) << "bad chunk f.id=" << nf.id << " " << nf.chunk << "/" << nf.chunks;
         frame_chunks_mismatch.Increment();
-        reset();
-        return streams::publishers::empty<encoded_packet>();
+        return boost::none;
+      }
+      if (_options.key_frames_only && !nf.key_frame) {
+        skipped_chunks.Increment();
+        return boost::none;
       }
 
-      if (nf.chunk == 1) {
-        _id = nf.id;
-        _timestamp = nf.t;
-        _departure_time = nf.dt;
-        _creation_time = nf.arrival_time;
-        _key_frame = nf.key_frame;
+      auto it = _pending.find(nf.id);
+      if (it == _pending.end()) {
+        if (_has_done && !(_last_done < nf.id)) {
+          if (now - _last_done_time < pending_frame_timeout) {
+            LOG(1) << "late chunk f.id=" << nf.id << " " << nf.chunk << "/" << nf.chunks;
+            late_chunks.Increment();
+            return boost::none;
+          }
+          // nothing was delivered for a while, frame ids were probably restarted.
+          LOG(INFO) << "frame id went back from " << _last_done << " to " << nf.id;
+          while (!_pending.empty()) {
+            drop(_pending.begin());
+          }
+          _has_done = false;
+        }
+        if (_pending.size() >= max_pending_frames) {
+          drop(_pending.begin());
+        }
+        it = _pending.emplace(nf.id, pending_frame{nf}).first;
       }
 
-      const auto data_or_error = base64::decode(nf.base64_data);
-      CHECK(data_or_error.ok()) << "bad base64 data: " << nf.base64_data;
-      _aggregated_data.append(data_or_error.get());
+      pending_frame &pf = it->second;
+      if (pf.chunks != nf.chunks) {
+        LOG(ERROR) << "chunk mismatch f.id=" << nf.id << " expected " << pf.chunks
+                   << " chunks, got " << nf.chunks;
+        frame_chunks_mismatch.Increment();
+        return boost::none;
+      }
+      if (pf.has_chunk(nf.chunk)) {
+        duplicate_chunks.Increment();
+        return boost::none;
+      }
+      if (!pf.add_chunk(nf)) {
+        LOG(ERROR) << "chunk size mismatch f.id=" << nf.id << " chunk " << nf.chunk;
+        frame_chunks_mismatch.Increment();
+        drop(it);
+        return boost::none;
+      }
+      if (!pf.complete()) {
+        return boost::none;
+      }
+
+      // older frames can't be delivered anymore.
+      while (_pending.begin() != it) {
+        drop(_pending.begin());
+      }
+      encoded_frame frame = pf.to_frame(nf.id);
+      done(nf.id);
+      _last_done_time = now;
+      _pending.erase(it);
 
-      if (nf.chunk == nf.chunks) {
-        encoded_frame frame;
-        frame.data = _aggregated_data;
-        frame.id = _id;
-        frame.timestamp = _timestamp;
-        frame.creation_time = _creation_time;
-        frame.key_frame = _key_frame;
+      frame_chunks.Observe(nf.chunks);
+      return encoded_packet{std::move(frame)};
+    }
 
-        reset();
+   private:
+    using pending_map = std::map<frame_id, pending_frame>;
 
-        frame_chunks.Observe(nf.chunks);
-        return streams::publishers::of({encoded_packet{frame}});
+    void expire(std::chrono::steady_clock::time_point now) {
+      while (!_pending.empty()
+             && now - _pending.begin()->second.first_seen > pending_frame_timeout) {
+        drop(_pending.begin());
       }
+    }
 
-      _chunk++;
-      return streams::publishers::empty<encoded_packet>();
+    void drop(pending_map::iterator it) {
+      LOG(1) << "dropping incomplete frame f.id=" << it->first << " "
+             << it->second.received << "/" << it->second.chunks;
+      incomplete_frames.Increment();
+      done(it->first);
+      _pending.erase(it);
     }
 
-   private:
-    void reset() {
-      _chunk = 1;
-      _aggregated_data.clear();
+    void done(const frame_id &id) {
+      if (!_has_done || _last_done < id) {
+        _last_done = id;
+      }
+      _has_done = true;
     }
 
-    uint8_t _chunk{1};
-    frame_id _id;
-    std::chrono::system_clock::time_point _timestamp;
-    std::chrono::system_clock::time_point _departure_time;
-    std::chrono::system_clock::time_point _creation_time;
-    std::string _aggregated_data;
-    bool _key_frame;
+    const network_decode_options _options;
+    pending_map _pending;
+    // the newest frame which was either delivered or dropped.
+    frame_id _last_done{0, 0};
+    bool _has_done{false};
+    std::chrono::steady_clock::time_point _last_done_time;
   };
 
-  return [](streams::publisher<network_packet> &&src) {
-    packet_visitor visitor;
-    return std::move(src) >> streams::flat_map([visitor = std::move(visitor)](
+  return [options](streams::publisher<network_packet> &&src) {
+    packet_visitor visitor{options};
+    return std::move(src) >> streams::filter_map([visitor = std::move(visitor)](
                                  const network_packet &data) mutable {
              return boost::apply_visitor(visitor, data);
            });
   };
 }
 
-streams::op<encoded_packet, encoded_packet> repeat_metadata() {
-  return streams::repeat_if<encoded_packet>(6000, [](const encoded_packet &p) {
-    return nullptr != boost::get<encoded_metadata>(&p);
-  });
+streams::op<encoded_packet, encoded_packet> repeat_metadata(
+    uint32_t key_frames_interval) {
+  CHECK_GT(key_frames_interval, 0);
+
+  struct state {
+    boost::optional<encoded_metadata> metadata;
+    // metadata was the previous packet, no need to repeat it.
+    bool metadata_sent{false};
+    uint32_t key_frames{0};
+  };
+
+  return [key_frames_interval](streams::publisher<encoded_packet> &&src) {
+    return std::move(src)
+           >> streams::flat_map([key_frames_interval,
+                                 s = state{}](encoded_packet &&packet) mutable {
+               if (const encoded_metadata *m = boost::get<encoded_metadata>(&packet)) {
+                 s.metadata = *m;
+                 s.metadata_sent = true;
+                 return streams::publishers::of({std::move(packet)});
+               }
+
+               const encoded_frame *f = boost::get<encoded_frame>(&packet);
+               const bool repeat = f != nullptr && f->key_frame
+                                   && s.key_frames++ % key_frames_interval == 0
+                                   && s.metadata && !s.metadata_sent;
+               s.metadata_sent = false;
+               if (repeat) {
+                 return streams::publishers::of(
+                     {encoded_packet{*s.metadata}, std::move(packet)});
+               }
+               return streams::publishers::of({std::move(packet)});
+             });
+  };
+}
+
+void crop_region::set(const image_region &region) {
+  std::lock_guard<std::mutex> guard(_mutex);
+  if (region.width <= 0 || region.height <= 0) {
+    _region.reset();
+  } else {
+    _region = region;
+  }
+}
+
+boost::optional<image_region> crop_region::get() const {
+  std::lock_guard<std::mutex> guard(_mutex);
+  return _region;
 }
 
 }  // namespace video
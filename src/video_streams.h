@@ -3,54 +3,310 @@
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/optional.hpp>
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
 #include "data.h"
+#include "object_storage.h"
 #include "rtm_client.h"
 #include "streams/streams.h"
+#include "uring_file.h"
 
 namespace satori {
 namespace video {
 
-streams::publisher<encoded_packet> file_source(boost::asio::io_service &io,
-                                               const std::string &filename, bool loop,
-                                               bool batch);
+// read-ahead buffer size of file_source in batch mode.
+constexpr size_t default_read_ahead_bytes = 16 * 1024 * 1024;
 
-streams::publisher<owned_image_packet> camera_source(boost::asio::io_service &io,
-                                                     const std::string &resolution,
-                                                     uint8_t fps);
+// Frames of a video file to read, numbered from 1 in the same way file_source numbers
+// them.
+struct file_segment {
+  int64_t first_frame{1};
+  // inclusive, file is read to the end if not set.
+  boost::optional<int64_t> last_frame;
+};
 
-// options are ffmpeg protocol options, 'k1=v1,k2=v2'
-streams::publisher<encoded_packet> url_source(const std::string &url,
-                                              const std::string &options = "");
+// converts times from the beginning of a file to frames by file's average frame rate.
+file_segment time_segment(const std::string &filename,
+                          boost::optional<std::chrono::milliseconds> start,
+                          boost::optional<std::chrono::milliseconds> end);
 
+// batch mode emits packets as fast as consumer takes them instead of pacing them by
+// frame rate. If read_ahead_bytes is not 0, batch mode demuxes on a separate thread
+// up to that many bytes of packets ahead of consumer.
+// Reading of a segment starts by seeking to the closest key frame before its first
+// frame, frames between them are emitted for decoding and have to be dropped after
+// it. Frame ids are numbered by timestamps after seeking.
+streams::publisher<encoded_packet> file_source(
+    boost::asio::io_service &io, const std::string &filename, bool loop, bool batch,
+    size_t read_ahead_bytes = 0, const file_segment &segment = file_segment{});
+
+// Consecutive groups of pictures of a video file, which can be decoded without the
+// rest of the file.
+struct file_range {
+  // frames are numbered from 1, in the same way file_source numbers them.
+  int64_t first_frame;
+  int64_t frames;
+  // decoding timestamp of the first key frame in stream time base, to seek by.
+  int64_t key_frame_timestamp;
+  // byte position of the first key frame, -1 if unknown.
+  int64_t key_frame_pos;
+};
+
+// Reads packets of a file without decoding them and splits the file at key frames
+// into at most max_ranges ranges with similar numbers of frames. Returns nothing if
+// file can't be read.
+std::vector<file_range> split_by_key_frames(const std::string &filename,
+                                            size_t max_ranges);
+
+// Emits metadata and frames of a range in batch mode, frame ids are the same as
+// file_source gives them. Ranges starting with open GOP key frames may have a few
+// undecodable frames at the beginning.
+streams::publisher<encoded_packet> file_range_source(const std::string &filename,
+                                                     const file_range &range,
+                                                     size_t read_ahead_bytes = 0);
+
+// camera device used on Linux.
+constexpr const char *default_camera_device = "/dev/video0";
+
+// On Linux frames are captured through V4L2 and point into capture buffers when
+// camera's pixel format is one of image formats.
+streams::publisher<owned_image_packet> camera_source(
+    boost::asio::io_service &io, const std::string &resolution, uint8_t fps,
+    const std::string &device = default_camera_device);
+
+// Emits H.264 or MJPEG packets of cameras encoding on their own without decoding
+// them, straight from capture buffers. Linux only.
+streams::publisher<encoded_packet> camera_encoded_source(
+    boost::asio::io_service &io, const std::string &resolution, uint8_t fps,
+    const std::string &device = default_camera_device);
+
+struct url_source_options {
+  // ffmpeg protocol options, 'k1=v1;k2=v2'.
+  std::string parameters;
+  // probes stream briefly and without buffering, and reuses codec parameters found
+  // by previous sources of the same url, so reconnects don't wait for probing.
+  bool fast_start{false};
+  // demuxes on a process-wide pool with a thread per core instead of a thread of its
+  // own, for processes reading many urls. Demuxers without non-blocking reads still
+  // hold a pool thread until the next packet arrives.
+  bool shared_demuxer{false};
+  // shared demuxer pauses reading while that many packets wait for consumer.
+  size_t max_queued_packets{100};
+  // reading thread of its own is pinned to these cpus.
+  std::vector<int> cpus;
+};
+
+streams::publisher<encoded_packet> url_source(
+    const std::string &url, const url_source_options &options = url_source_options{});
+
+// reads either newline-delimited json messages with .metadata file next to them, or
+// indexed binary replay file written by replay_file_sink. Unless in batch mode,
+// messages are paced by their timestamps sped up speed times, speed of 0 replays as
+// fast as messages are consumed.
 streams::publisher<network_packet> network_replay_source(boost::asio::io_service &io,
                                                          const std::string &filename,
-                                                         bool batch);
+                                                         bool batch, double speed = 1.0);
+
+struct rtm_source_options {
+  // if set, frames published that long ago are requested from channel history and
+  // chunks before the first key frame among them are skipped, so decoding starts
+  // without waiting for the next key frame. Should be about GOP duration, then
+  // the most recent key frame is usually the only one in history.
+  boost::optional<std::chrono::seconds> key_frame_history;
+};
 
 streams::publisher<network_packet> rtm_source(
-    const std::shared_ptr<rtm::subscriber> &client, const std::string &channel_name);
+    const std::shared_ptr<rtm::subscriber> &client, const std::string &channel_name,
+    const rtm_source_options &options = rtm_source_options{});
+
+struct network_decode_options {
+  // chunks of other frames are dropped before they are decoded or reassembled, for
+  // bots which only need key frames, like indexing or thumbnails. Every chunk is
+  // marked as key frame one or not.
+  bool key_frames_only{false};
+};
+
+// chunks may arrive in any order, frames are delivered in frame id order and
+// older incomplete frames are dropped once a newer frame is complete.
+streams::op<network_packet, encoded_packet> decode_network_stream(
+    const network_decode_options &options = network_decode_options{});
+
+// region of source frames to decode, may be changed by other threads while stream
+// is running.
+class crop_region {
+ public:
+  // region with zero width or height restores full frames.
+  void set(const image_region &region);
+  boost::optional<image_region> get() const;
+
+ private:
+  mutable std::mutex _mutex;
+  boost::optional<image_region> _region;
+};
+
+struct decoder_options {
+  // FFmpeg hardware device type to decode on, e.g. vaapi, cuda or videotoolbox.
+  // Decoded frames are downloaded before scaling. Decoding falls back to software
+  // if device is not present or codec doesn't support it.
+  boost::optional<std::string> hw_device_type;
+
+  // 0 lets FFmpeg pick thread count by number of cores.
+  int thread_count{0};
+  // frame threading parallelizes any stream, but delays each decoded frame by
+  // thread_count frames. Slice threading adds no latency, so it suits live streams.
+  bool frame_threading{false};
+
+  // queue of downstream worker, see streams::queue_depth. While it holds
+  // skip_threshold frames or more, decoder skips non-reference frames, and all
+  // non-key frames past twice the threshold. Full decoding resumes once the queue
+  // is drained.
+  std::shared_ptr<const std::atomic<size_t>> downstream_queue;
+  size_t skip_threshold{0};
+
+  // if set, frames are cropped before scaling to bounding size.
+  std::shared_ptr<crop_region> crop;
 
-streams::op<network_packet, encoded_packet> decode_network_stream();
+  // if positive, frames coming sooner than 1/max_fps seconds after the previous
+  // delivered one are dropped before conversion, and non-reference frames are not
+  // decoded while input frame rate is at least twice as high. on_decimated is
+  // called for every dropped frame.
+  double max_fps{0};
+  std::function<void()> on_decimated;
+
+  // decoded hardware frames are delivered as device surfaces instead of being
+  // downloaded, see encode_h264_frames. frame_scaler can't convert them, so
+  // decode_image_frames delivers CUDA NV12 frames as they are, marked on_device,
+  // and downloads other ones before scaling.
+  bool keep_hw_frames{false};
+
+  // if set, intra-only decoders which support it (jpeg, mjpeg) reduce frame size
+  // by up to 8 times while frames stay at least that large. It is much cheaper than
+  // scaling full frames. Not applied while crop region is set. decode_image_frames
+  // sets it to bounding size.
+  boost::optional<image_size> lowres_size;
+
+  // if set, decoders which support it (h264, mpeg4, mpeg2video and other
+  // block-based codecs) attach motion vectors to frames, see
+  // owned_image_frame::motion_vectors. Hardware decoders don't export them.
+  bool export_motion_vectors{false};
+  // decode_image_frames delivers frames with motion vectors only, without planes,
+  // of decoded size and requested pixel format. Pixels are not converted or scaled,
+  // deblocking is skipped and hardware decoding is not used. Implies
+  // export_motion_vectors.
+  bool motion_vectors_only{false};
+
+  // used by cli_streams::decoded_publisher, threads reading and decoding the input
+  // are pinned to these cpus, frames are then allocated in memory of their NUMA node.
+  std::vector<int> cpus;
+};
 
 streams::op<encoded_packet, owned_image_packet> decode_image_frames(
     const image_size &bounding_size, image_pixel_format pixel_format,
-    bool keep_aspect_ratio);
+    bool keep_aspect_ratio, const decoder_options &options = decoder_options{});
+
+struct rtm_sink_options {
+  // upstream is not asked for more packets while published but not acknowledged
+  // payload exceeds this.
+  size_t max_in_flight_bytes{4 * 1024 * 1024};
+
+  // if set, non-key frames created longer ago than that are dropped together with
+  // the rest of their group of pictures.
+  boost::optional<std::chrono::milliseconds> max_frame_age;
+
+  // if false, frames are published without RTM confirmation and count as in flight
+  // until written to the socket. Metadata is always confirmed.
+  bool ack_frames{true};
+
+  // how long to wait for acknowledgements after upstream is complete. Sink reports
+  // unpublished packets after that, but stays alive until the remaining acks arrive.
+  std::chrono::milliseconds flush_timeout{std::chrono::seconds{30}};
+};
+
+// packets sinks request from upstream at once.
+constexpr int default_request_window_size = 16;
 
+// request_window_size is the number of packets requested from upstream at once.
 streams::subscriber<encoded_packet> &rtm_sink(
     const std::shared_ptr<rtm::publisher> &client, boost::asio::io_service &io_service,
-    const std::string &rtm_channel);
+    const std::string &rtm_channel,
+    int request_window_size = default_request_window_size,
+    const rtm_sink_options &options = rtm_sink_options{});
 
+// fragmented writes MP4 with a fragment per GOP (CMAF) under its final name, so files
+// can be read while they are written. With segment duration, files being written
+// are named <stem>-<start ms>, and get end time in their names once complete.
+// If uring is set, files are written by uring_file instead of write() through page
+// cache, then fragments reach the file in whole buffers.
 streams::subscriber<encoded_packet> &video_file_sink(
     const boost::filesystem::path &path,
     const boost::optional<std::chrono::system_clock::duration> &segment_duration,
-    std::unordered_map<std::string, std::string> &&options);
+    std::unordered_map<std::string, std::string> &&options, bool fragmented = false,
+    int request_window_size = default_request_window_size,
+    const boost::optional<uring_file_options> &uring = boost::none);
 
-streams::op<owned_image_packet, encoded_packet> encode_as_mjpeg();
+// Like video_file_sink, but url is s3://<bucket>/<key> or gs://<bucket>/<key> and
+// files are streamed to object storage by multipart uploads, nothing touches local
+// disk. Segments are named by their start time only, they appear in the bucket once
+// complete. MP4 is always fragmented, as muxer can't seek back in an upload.
+streams::subscriber<encoded_packet> &object_storage_sink(
+    const object_storage_config &storage, const boost::filesystem::path &url,
+    const boost::optional<std::chrono::system_clock::duration> &segment_duration,
+    std::unordered_map<std::string, std::string> &&options, bool fragmented = false,
+    int request_window_size = default_request_window_size);
+
+// Starts and extends clips of preroll_sink, can be used from any thread.
+class preroll_trigger {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  // clip goes on until at least post_roll from now.
+  void trigger(clock::duration post_roll) {
+    const auto until = (clock::now() + post_roll).time_since_epoch().count();
+    auto current = _until.load();
+    while (current < until && !_until.compare_exchange_weak(current, until)) {
+    }
+  }
+
+  bool active(clock::time_point now = clock::now()) const {
+    return now.time_since_epoch().count() < _until.load();
+  }
+
+ private:
+  std::atomic<clock::rep> _until{0};
+};
+
+struct preroll_options {
+  // GOPs kept in memory while there is no clip, oldest GOP is dropped once the
+  // following ones cover duration or the buffer grows above max_bytes.
+  std::chrono::system_clock::duration duration{std::chrono::seconds{10}};
+  size_t max_bytes{32 * 1024 * 1024};
+};
+
+// Keeps the latest GOPs of the stream in memory instead of writing them. When
+// trigger is fired, a clip sink is created by clip_sink with timestamp of the first
+// buffered frame, and gets the latest metadata, buffered GOPs and packets which follow
+// until the trigger runs out. Then clip sink is completed and buffering starts over.
+streams::subscriber<encoded_packet> &preroll_sink(
+    const preroll_options &options, const std::shared_ptr<preroll_trigger> &trigger,
+    std::function<streams::subscriber<encoded_packet> &(
+        std::chrono::system_clock::time_point start)> &&clip_sink,
+    int request_window_size = default_request_window_size);
+
+// writes packets into indexed binary replay file, see replay_file.h.
+streams::subscriber<encoded_packet> &replay_file_sink(
+    const boost::filesystem::path &path,
+    int request_window_size = default_request_window_size);
 
-streams::op<encoded_packet, encoded_packet> repeat_metadata();
+// re-emits the last metadata in front of every key_frames_interval-th key frame,
+// so subscribers joining a stream wait for codec data at most that many GOPs.
+streams::op<encoded_packet, encoded_packet> repeat_metadata(
+    uint32_t key_frames_interval = 1);
 
 }  // namespace video
 }  // namespace satori
@@ -13,7 +13,7 @@ namespace video {
 
 class vp9_encoder {
  public:
-  vp9_encoder(uint8_t lag_in_frames) : _lag_in_frames(lag_in_frames) {}
+  explicit vp9_encoder(const encoder_profile &profile) : _profile(profile) {}
 
   streams::publisher<encoded_packet> init(const owned_image_frame &f) {
     CHECK(!_encoder_context);
@@ -23,39 +23,64 @@ class vp9_encoder {
     _encoder_context = avutils::encoder_context(_encoder_id);
     _encoder_context->width = f.width;
     _encoder_context->height = f.height;
+    if (_profile.bitrate) {
+      _encoder_context->bit_rate = *_profile.bitrate;
+    } else if (_profile.crf) {
+      _encoder_context->bit_rate = 0;
+    }
+    if (_profile.keyint) {
+      _encoder_context->gop_size = *_profile.keyint;
+    }
 
     // http://wiki.webmproject.org/ffmpeg/vp9-encoding-guide
     AVDictionary *codec_options = nullptr;
-    // TODO: pass these parameters as an input, for example, via json file.
-    av_dict_set(&codec_options, "threads", "4", 0);
+    av_dict_set(&codec_options, "deadline", _profile.deadline.c_str(), 0);
+    av_dict_set_int(&codec_options, "threads", _profile.threads, 0);
     av_dict_set(&codec_options, "frame-parallel", "1", 0);
     av_dict_set(&codec_options, "tile-columns", "6", 0);
-    av_dict_set(&codec_options, "auto-alt-ref", "1", 0);
-    av_dict_set(&codec_options, "lag-in-frames", std::to_string(_lag_in_frames).c_str(),
-                0);
+    av_dict_set(&codec_options, "auto-alt-ref", _profile.auto_alt_ref ? "1" : "0", 0);
+    av_dict_set_int(&codec_options, "lag-in-frames", _profile.lag_in_frames, 0);
+    if (_profile.cpu_used) {
+      av_dict_set_int(&codec_options, "cpu-used", *_profile.cpu_used, 0);
+    }
+    if (_profile.row_mt) {
+      av_dict_set(&codec_options, "row-mt", "1", 0);
+    }
+    if (_profile.crf) {
+      av_dict_set_int(&codec_options, "crf", *_profile.crf, 0);
+    }
 
     int ret = avcodec_open2(_encoder_context.get(), nullptr, &codec_options);
+    // older libvpx builds don't know some options, e.g. row-mt.
+    AVDictionaryEntry *unused = nullptr;
+    while ((unused = av_dict_get(codec_options, "", unused, AV_DICT_IGNORE_SUFFIX))
+           != nullptr) {
+      LOG(WARNING) << "encoder ignored option " << unused->key << "=" << unused->value;
+    }
     av_dict_free(&codec_options);
     if (ret < 0) {
       return streams::publishers::error<encoded_packet>(
           video_error::STREAM_INITIALIZATION_ERROR);
     }
 
-    // TODO: make align parameterizable
+    // frames already in encoder's pixel format are encoded as they come.
     const AVPixelFormat av_pixel_format = avutils::to_av_pixel_format(f.pixel_format);
-    _tmp_frame = avutils::av_frame(f.width, f.height, 1, av_pixel_format);
-    _frame = avutils::av_frame(f.width, f.height, 1, _encoder_context->pix_fmt);
-
-    _sws_context = avutils::sws_context(_tmp_frame, _frame);
-    if (_sws_context == nullptr) {
-      return streams::publishers::error<encoded_packet>(
-          video_error::STREAM_INITIALIZATION_ERROR);
+    if (av_pixel_format != _encoder_context->pix_fmt) {
+      // TODO: make align parameterizable
+      _frame = avutils::av_frame(f.width, f.height, 1, _encoder_context->pix_fmt);
+      _sws_context = avutils::sws_context(f.width, f.height, av_pixel_format, f.width,
+                                          f.height, _encoder_context->pix_fmt);
+      if (!_frame || _sws_context == nullptr) {
+        return streams::publishers::error<encoded_packet>(
+            video_error::STREAM_INITIALIZATION_ERROR);
+      }
     }
 
     encoded_metadata m;
     m.codec_name = "vp9";
-    m.codec_data.assign(_encoder_context->extradata,
-                        _encoder_context->extradata + _encoder_context->extradata_size);
+    m.codec_data =
+        shared_bytes{reinterpret_cast<const char *>(_encoder_context->extradata),
+                     static_cast<size_t>(_encoder_context->extradata_size)};
 
     return streams::publishers::of({encoded_packet{m}});
   }
@@ -72,9 +97,21 @@ class vp9_encoder {
 
  private:
   streams::publisher<encoded_packet> encode_frame(const owned_image_frame &f) {
-    avutils::copy_image_to_av_frame(f, _tmp_frame);
-    avutils::sws_scale(_sws_context, _tmp_frame, _frame);
-    avcodec_send_frame(_encoder_context.get(), _frame.get());
+    // planes are read in place, encoder copies frames it keeps.
+    std::shared_ptr<AVFrame> input = avutils::image_to_av_frame(f);
+    if (!input) {
+      return streams::publishers::error<encoded_packet>(
+          video_error::FRAME_GENERATION_ERROR);
+    }
+    if (_sws_context) {
+      if (av_frame_make_writable(_frame.get()) < 0) {
+        return streams::publishers::error<encoded_packet>(
+            video_error::FRAME_GENERATION_ERROR);
+      }
+      avutils::sws_scale(_sws_context, input, _frame);
+      input = _frame;
+    }
+    avcodec_send_frame(_encoder_context.get(), input.get());
 
     std::vector<encoded_packet> packets;
     while (true) {
@@ -91,7 +128,8 @@ class vp9_encoder {
       }
 
       encoded_frame frame;
-      frame.data.assign(packet.data, packet.data + packet.size);
+      frame.data = shared_bytes{reinterpret_cast<const char *>(packet.data),
+                                static_cast<size_t>(packet.size)};
       frame.id = f.id;
       frame.timestamp = f.timestamp;
       frame.creation_time = std::chrono::system_clock::now();
@@ -110,21 +148,46 @@ class vp9_encoder {
     return streams::publishers::of(std::move(packets));
   }
 
-  // https://www.webmproject.org/docs/encoder-parameters/
-  // The --lag-in-frames parameter defines an upper limit on the number of frames into the
-  // future that the encoder can look.
-  const uint8_t _lag_in_frames;
+  const encoder_profile _profile;
   const AVCodecID _encoder_id{AV_CODEC_ID_VP9};
   std::shared_ptr<AVCodecContext> _encoder_context{nullptr};
-  std::shared_ptr<AVFrame> _tmp_frame{nullptr};  // for pixel format conversion
-  std::shared_ptr<AVFrame> _frame{nullptr};
+  std::shared_ptr<AVFrame> _frame{nullptr};  // for pixel format conversion
   std::shared_ptr<SwsContext> _sws_context{nullptr};
   int64_t _counter{0};
 };  // namespace video
 
+encoder_profile encoder_profile::realtime() {
+  encoder_profile profile;
+  profile.deadline = "realtime";
+  profile.cpu_used = 8;
+  profile.row_mt = true;
+  profile.lag_in_frames = 0;
+  profile.auto_alt_ref = false;
+  return profile;
+}
+
+boost::optional<encoder_profile> encoder_profile_by_name(const std::string &name) {
+  if (name == "good") {
+    return encoder_profile{};
+  }
+  if (name == "realtime") {
+    return encoder_profile::realtime();
+  }
+  return boost::none;
+}
+
 streams::op<owned_image_packet, encoded_packet> encode_vp9(uint8_t lag_in_frames) {
-  return [lag_in_frames](streams::publisher<owned_image_packet> &&src) {
-    auto encoder = new vp9_encoder(lag_in_frames);
+  encoder_profile profile;
+  profile.lag_in_frames = lag_in_frames;
+  return encode_vp9(profile);
+}
+
+streams::op<owned_image_packet, encoded_packet> encode_vp9(
+    const encoder_profile &profile) {
+  return [profile](streams::publisher<owned_image_packet> &&src) {
+    LOG(INFO) << "VP9 encoder deadline " << profile.deadline << ", lag "
+              << static_cast<int>(profile.lag_in_frames);
+    auto encoder = new vp9_encoder(profile);
 
     return std::move(src) >> streams::flat_map([encoder](owned_image_packet &&packet) {
              if (const owned_image_frame *frame =
@@ -1,11 +1,46 @@
 #pragma once
 
+#include <boost/optional.hpp>
+#include <string>
+
 #include "data.h"
 #include "streams/streams.h"
 
 namespace satori {
 namespace video {
 
+// libvpx-vp9 settings, see https://www.webmproject.org/docs/encoder-parameters/
+// Unset values keep encoder defaults.
+struct encoder_profile {
+  // good or realtime.
+  std::string deadline{"good"};
+  // speed against quality, 0-8, realtime deadline needs 5 or more to keep up.
+  boost::optional<int> cpu_used;
+  // lets threads encode rows of one tile in parallel.
+  bool row_mt{false};
+  // bits per second, upper bound in constant quality mode.
+  boost::optional<int64_t> bitrate;
+  // 0-63, turns on constant quality mode.
+  boost::optional<int> crf;
+  // maximum distance between key frames.
+  boost::optional<int> keyint;
+  int threads{4};
+  // upper limit on the number of frames into the future that encoder can look.
+  uint8_t lag_in_frames{25};
+  // alternate reference frames need lag_in_frames.
+  bool auto_alt_ref{true};
+
+  // no look ahead and the fastest preset, for live transcoding.
+  static encoder_profile realtime();
+};
+
+// good or realtime, none for other names.
+boost::optional<encoder_profile> encoder_profile_by_name(const std::string &name);
+
+streams::op<owned_image_packet, encoded_packet> encode_vp9(
+    const encoder_profile &profile);
+
+// default profile looking lag_in_frames ahead.
 streams::op<owned_image_packet, encoded_packet> encode_vp9(uint8_t lag_in_frames);
-}
+}  // namespace video
 }  // namespace satori
@@ -0,0 +1,57 @@
+// Keyed cache of idle objects which are expensive to initialize.
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace satori {
+namespace video {
+
+// Keeps objects released by finished streams, so streams started later with the same
+// parameters, e.g. pool mode jobs restarted by controller, skip their initialization.
+// Callers bring objects back to their initial state before putting them.
+template <typename Key, typename T>
+class warm_pool {
+ public:
+  explicit warm_pool(size_t max_idle_per_key) : _max_idle_per_key(max_idle_per_key) {}
+
+  // returns null if there is no idle object for the key.
+  std::shared_ptr<T> take(const Key &key) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _idle.find(key);
+    if (it == _idle.end()) {
+      return nullptr;
+    }
+    std::shared_ptr<T> value = std::move(it->second);
+    _idle.erase(it);
+    return value;
+  }
+
+  // objects above the limit are destroyed.
+  void put(const Key &key, std::shared_ptr<T> &&value) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_idle.count(key) >= _max_idle_per_key) {
+      return;
+    }
+    _idle.emplace(key, std::move(value));
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _idle.clear();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _idle.size();
+  }
+
+ private:
+  const size_t _max_idle_per_key;
+  mutable std::mutex _mutex;
+  std::multimap<Key, std::shared_ptr<T>> _idle;
+};
+
+}  // namespace video
+}  // namespace satori
@@ -3,6 +3,10 @@
 #define BOOST_TEST_ALTERNATIVE_INIT_API
 #include <boost/test/included/unit_test.hpp>
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
 #include "avutils.h"
 #include "logging_impl.h"
 
@@ -19,6 +23,15 @@ BOOST_AUTO_TEST_CASE(av_pixel_format) {
 
   BOOST_CHECK_EQUAL(AV_PIX_FMT_RGB0,
                     avutils::to_av_pixel_format(image_pixel_format::RGB0));
+
+  BOOST_CHECK_EQUAL(AV_PIX_FMT_GRAY8,
+                    avutils::to_av_pixel_format(image_pixel_format::GRAY8));
+
+  BOOST_CHECK_EQUAL(AV_PIX_FMT_YUV420P,
+                    avutils::to_av_pixel_format(image_pixel_format::YUV420P));
+
+  BOOST_CHECK_EQUAL(AV_PIX_FMT_NV12,
+                    avutils::to_av_pixel_format(image_pixel_format::NV12));
 }
 
 BOOST_AUTO_TEST_CASE(pixel_image_format) {
@@ -27,6 +40,15 @@ BOOST_AUTO_TEST_CASE(pixel_image_format) {
 
   BOOST_CHECK_EQUAL((int)image_pixel_format::RGB0,
                     (int)avutils::to_image_pixel_format(AV_PIX_FMT_RGB0));
+
+  BOOST_CHECK_EQUAL((int)image_pixel_format::GRAY8,
+                    (int)avutils::to_image_pixel_format(AV_PIX_FMT_GRAY8));
+
+  BOOST_CHECK_EQUAL((int)image_pixel_format::YUV420P,
+                    (int)avutils::to_image_pixel_format(AV_PIX_FMT_YUV420P));
+
+  BOOST_CHECK_EQUAL((int)image_pixel_format::NV12,
+                    (int)avutils::to_image_pixel_format(AV_PIX_FMT_NV12));
 }
 
 BOOST_AUTO_TEST_CASE(encoder_context) {
@@ -97,6 +119,30 @@ BOOST_AUTO_TEST_CASE(format_context) {
   BOOST_CHECK_EQUAL("Matroska", ctx->oformat->long_name);
 }
 
+BOOST_AUTO_TEST_CASE(mapped_input_format_context) {
+  for (const std::string url : {"test_data/test.mp4", "file:test_data/test.mp4"}) {
+    std::shared_ptr<AVFormatContext> ctx = avutils::open_input_format_context(url);
+    BOOST_REQUIRE(ctx);
+    BOOST_CHECK(ctx->flags & AVFMT_FLAG_CUSTOM_IO);
+    BOOST_CHECK_EQUAL(0, avformat_find_stream_info(ctx.get(), nullptr));
+    BOOST_CHECK_GT(ctx->duration, 0);
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    int packets = 0;
+    while (av_read_frame(ctx.get(), &packet) == 0) {
+      av_packet_unref(&packet);
+      packets++;
+    }
+    BOOST_CHECK_GT(packets, 0);
+    BOOST_CHECK_GE(av_seek_frame(ctx.get(), -1, 0, AVSEEK_FLAG_BACKWARD), 0);
+    BOOST_CHECK_EQUAL(0, av_read_frame(ctx.get(), &packet));
+    av_packet_unref(&packet);
+  }
+
+  BOOST_CHECK(!avutils::open_input_format_context("test_data/missing.mp4"));
+}
+
 BOOST_AUTO_TEST_CASE(copy_image_to_av_frame) {
   uint16_t width = 100;
   uint16_t height = 100;
@@ -109,17 +155,96 @@ BOOST_AUTO_TEST_CASE(copy_image_to_av_frame) {
   image.pixel_format = image_pixel_format::RGB0;
   image.width = width;
   image.height = height;
-  unsigned int data_size = width * height * 3u;
+  unsigned int data_size = width * height * 4u;
   std::unique_ptr<uint8_t[]> data = std::make_unique<uint8_t[]>(data_size);
   for (size_t i = 0; i < data_size; i++) {
     data[i] = static_cast<uint8_t>((i * i) % 256);
   }
   image.plane_data[0].assign(data.get(), data.get() + data_size);
-  image.plane_strides[0] = width * 3u;
+  image.plane_strides[0] = width * 4u;
 
   avutils::copy_image_to_av_frame(image, frame);
 
   BOOST_TEST(!memcmp(data.get(), frame->data[0], data_size));
+
+  // rows are repacked to frame strides.
+  std::shared_ptr<AVFrame> padded = avutils::av_frame(width, height, 64, av_pixel_format);
+  BOOST_TEST_REQUIRE(padded->linesize[0] > static_cast<int>(width * 4u));
+  avutils::copy_image_to_av_frame(image, padded);
+  for (int y = 0; y < height; y++) {
+    BOOST_TEST_REQUIRE(!memcmp(data.get() + y * width * 4u,
+                               padded->data[0] + y * padded->linesize[0], width * 4u));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(image_to_av_frame) {
+  owned_image_frame image;
+  image.pixel_format = image_pixel_format::YUV420P;
+  image.width = 4;
+  image.height = 2;
+  image.plane_data[0] = std::string(8, 'y');
+  image.plane_strides[0] = 4;
+  image.plane_data[1] = std::string(2, 'u');
+  image.plane_strides[1] = 2;
+  image.plane_data[2] = std::string(2, 'v');
+  image.plane_strides[2] = 2;
+
+  std::shared_ptr<AVFrame> frame = avutils::image_to_av_frame(image);
+  BOOST_TEST_REQUIRE(frame);
+  BOOST_TEST(frame->format == AV_PIX_FMT_YUV420P);
+  BOOST_TEST(frame->width == 4);
+  BOOST_TEST(frame->height == 2);
+  for (int i = 0; i < 3; i++) {
+    // pixels are not copied.
+    BOOST_TEST(frame->data[i] == image.plane_data[i].data());
+    BOOST_TEST(frame->linesize[i] == static_cast<int>(image.plane_strides[i]));
+    BOOST_TEST(frame->buf[i] != nullptr);
+  }
+  BOOST_TEST(frame->buf[3] == nullptr);
+
+  // frame keeps planes alive.
+  const uint8_t *y = frame->data[0];
+  image = owned_image_frame{};
+  BOOST_TEST(y[7] == 'y');
+}
+
+BOOST_AUTO_TEST_CASE(frame_pool_recycles_buffers) {
+  avutils::frame_pool pool{100, 50, AV_PIX_FMT_YUV420P};
+
+  std::shared_ptr<AVFrame> frame = pool.get();
+  BOOST_TEST_REQUIRE(frame);
+  BOOST_CHECK_EQUAL(100, frame->width);
+  BOOST_CHECK_EQUAL(50, frame->height);
+  for (int i = 0; i < 3; i++) {
+    BOOST_TEST(frame->linesize[i] % avutils::frame_buffer_alignment == 0);
+    BOOST_TEST(reinterpret_cast<uintptr_t>(frame->data[i])
+                   % avutils::frame_buffer_alignment
+               == 0);
+  }
+
+  owned_image_frame image = avutils::to_image_frame(*frame);
+  const uint8_t *data = frame->data[0];
+  frame.reset();
+
+  // image still holds the buffer
+  BOOST_TEST(pool.get()->data[0] != data);
+
+  image = owned_image_frame{};
+  BOOST_TEST(pool.get()->data[0] == data);
+}
+
+BOOST_AUTO_TEST_CASE(packet_data_references_buffer) {
+  std::shared_ptr<AVPacket> packet = avutils::av_packet();
+  BOOST_REQUIRE(av_new_packet(packet.get(), 16) == 0);
+  std::memset(packet->data, 0x5a, 16);
+
+  const shared_bytes data = avutils::packet_data(*packet);
+  BOOST_TEST(data.data() == reinterpret_cast<const char *>(packet->data));
+  BOOST_TEST(data.size() == 16);
+
+  // payload outlives the packet.
+  packet.reset();
+  BOOST_TEST(data == std::string(16, 0x5a));
 }
 
 BOOST_AUTO_TEST_CASE(parse_image_size) {
@@ -132,6 +257,19 @@ BOOST_AUTO_TEST_CASE(parse_image_size) {
   BOOST_CHECK_EQUAL(245, s.get().height);
 }
 
+BOOST_AUTO_TEST_CASE(parse_image_region) {
+  BOOST_TEST(!avutils::parse_image_region("137x245").ok());
+  BOOST_TEST(!avutils::parse_image_region("137x245+1+2x").ok());
+  BOOST_TEST(!avutils::parse_image_region("0x245+1+2").ok());
+
+  streams::error_or<image_region> r = avutils::parse_image_region("137x245+10+20");
+  BOOST_TEST(r.ok());
+  BOOST_CHECK_EQUAL(10, r.get().x);
+  BOOST_CHECK_EQUAL(20, r.get().y);
+  BOOST_CHECK_EQUAL(137, r.get().width);
+  BOOST_CHECK_EQUAL(245, r.get().height);
+}
+
 BOOST_AUTO_TEST_CASE(av_frame_to_image) {
   uint16_t width = 32;
   uint16_t height = 32;
@@ -164,10 +302,86 @@ BOOST_AUTO_TEST_CASE(av_frame_to_image) {
   BOOST_CHECK_EQUAL(0, frame.plane_data[2].size());
   BOOST_CHECK_EQUAL(0, frame.plane_data[3].size());
 
+  BOOST_TEST(frame.plane_data[0].data() == av_frame->data[0]);
   BOOST_CHECK_EQUAL(0xab, (uint8_t)frame.plane_data[0][0]);
   BOOST_CHECK_EQUAL(0xcd, (uint8_t)frame.plane_data[0][data_size - 1]);
 }
 
+BOOST_AUTO_TEST_CASE(copy_plane_between_strides) {
+  const std::vector<uint8_t> src = {1, 2, 3, 0, 4, 5, 6, 0};
+  std::vector<uint8_t> dst(15, 9);
+  avutils::copy_plane(src.data(), 4, dst.data(), 5, 3, 2);
+  BOOST_TEST(dst == (std::vector<uint8_t>{1, 2, 3, 9, 9, 4, 5, 6, 9, 9, 9, 9, 9, 9, 9}));
+
+  std::vector<uint8_t> same(8, 9);
+  avutils::copy_plane(src.data(), 4, same.data(), 4, 3, 2);
+  BOOST_TEST(same == (std::vector<uint8_t>{1, 2, 3, 0, 4, 5, 6, 9}));
+}
+
+BOOST_AUTO_TEST_CASE(swizzle_packed_rgb) {
+  BOOST_TEST(avutils::can_swizzle_packed_rgb(AV_PIX_FMT_BGR24, AV_PIX_FMT_RGB0));
+  BOOST_TEST(avutils::can_swizzle_packed_rgb(AV_PIX_FMT_RGB0, AV_PIX_FMT_BGR24));
+  BOOST_TEST(!avutils::can_swizzle_packed_rgb(AV_PIX_FMT_BGR24, AV_PIX_FMT_RGB24));
+  BOOST_TEST(!avutils::can_swizzle_packed_rgb(AV_PIX_FMT_YUV420P, AV_PIX_FMT_RGB0));
+
+  // widths cover vector loops and their scalar tails, rows are padded.
+  for (int width = 1; width <= 70; width++) {
+    const int height = 3;
+    const int bgr_stride = width * 3 + 5;
+    const int rgb0_stride = width * 4 + 7;
+    std::vector<uint8_t> bgr(bgr_stride * height);
+    for (size_t i = 0; i < bgr.size(); i++) {
+      bgr[i] = static_cast<uint8_t>(i * 7 + 1);
+    }
+
+    std::vector<uint8_t> rgb0(rgb0_stride * height, 0xff);
+    avutils::swizzle_packed_rgb(AV_PIX_FMT_BGR24, bgr.data(), bgr_stride,
+                                AV_PIX_FMT_RGB0, rgb0.data(), rgb0_stride, width,
+                                height);
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        const uint8_t *s = &bgr[y * bgr_stride + x * 3];
+        const uint8_t *d = &rgb0[y * rgb0_stride + x * 4];
+        BOOST_TEST_REQUIRE(d[0] == s[2]);
+        BOOST_TEST_REQUIRE(d[1] == s[1]);
+        BOOST_TEST_REQUIRE(d[2] == s[0]);
+        BOOST_TEST_REQUIRE(d[3] == 0);
+      }
+      // padding is left alone.
+      BOOST_TEST_REQUIRE(rgb0[y * rgb0_stride + width * 4] == 0xff);
+    }
+
+    std::vector<uint8_t> back(bgr_stride * height, 0);
+    avutils::swizzle_packed_rgb(AV_PIX_FMT_RGB0, rgb0.data(), rgb0_stride,
+                                AV_PIX_FMT_BGR24, back.data(), bgr_stride, width,
+                                height);
+    for (int y = 0; y < height; y++) {
+      BOOST_TEST_REQUIRE(std::equal(back.begin() + y * bgr_stride,
+                                    back.begin() + y * bgr_stride + width * 3,
+                                    bgr.begin() + y * bgr_stride));
+      BOOST_TEST_REQUIRE(back[y * bgr_stride + width * 3] == 0);
+    }
+
+    std::vector<uint8_t> bgr0(rgb0_stride * height);
+    avutils::swizzle_packed_rgb(AV_PIX_FMT_BGR24, bgr.data(), bgr_stride,
+                                AV_PIX_FMT_BGR0, bgr0.data(), rgb0_stride, width,
+                                height);
+    for (int x = 0; x < width; x++) {
+      BOOST_TEST_REQUIRE(bgr0[x * 4] == bgr[x * 3]);
+      BOOST_TEST_REQUIRE(bgr0[x * 4 + 2] == bgr[x * 3 + 2]);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(device_image_frame_of_host_frame) {
+  avutils::frame_pool pool{16, 16, AV_PIX_FMT_NV12};
+  std::shared_ptr<AVFrame> frame = pool.get();
+  BOOST_TEST_REQUIRE(frame);
+
+  BOOST_TEST(!avutils::to_device_image_frame(*frame));
+  BOOST_TEST(!avutils::to_image_frame(*frame).on_device);
+}
+
 }  // namespace video
 }  // namespace satori
 
@@ -0,0 +1,87 @@
+#define BOOST_TEST_MODULE BatchCheckpointTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <boost/filesystem.hpp>
+
+#include "batch_checkpoint.h"
+
+namespace sv = satori::video;
+namespace fs = boost::filesystem;
+
+namespace {
+
+sv::owned_image_frame frame(int64_t n) {
+  sv::owned_image_frame f;
+  f.id = {n, n};
+  f.timestamp = std::chrono::system_clock::time_point{std::chrono::milliseconds{n * 40}};
+  return f;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(save_and_load) {
+  const fs::path path = fs::temp_directory_path() / fs::unique_path("%%%%%%.checkpoint");
+  BOOST_CHECK(!sv::load_checkpoint(path.string()));
+
+  sv::batch_checkpoint checkpoint;
+  checkpoint.frame = {10, 11};
+  checkpoint.timestamp_millis = 440;
+  checkpoint.analysis_file_offset = 1234;
+  checkpoint.debug_file_offset = 56;
+  checkpoint.bot_state = {{"tracks", {1, 2}}};
+  sv::save_checkpoint(path.string(), checkpoint);
+
+  auto loaded = sv::load_checkpoint(path.string());
+  BOOST_REQUIRE(loaded);
+  BOOST_CHECK_EQUAL(10, loaded->frame.i1);
+  BOOST_CHECK_EQUAL(11, loaded->frame.i2);
+  BOOST_CHECK_EQUAL(440, loaded->timestamp_millis);
+  BOOST_CHECK_EQUAL(1234, loaded->analysis_file_offset);
+  BOOST_CHECK_EQUAL(56, loaded->debug_file_offset);
+  BOOST_CHECK_EQUAL(checkpoint.bot_state, loaded->bot_state);
+  BOOST_CHECK(!fs::exists(path.string() + ".tmp"));
+  fs::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(bad_checkpoint) {
+  BOOST_CHECK(!sv::checkpoint_from_json(nlohmann::json{{"frame_id", 5}}));
+  BOOST_CHECK(!sv::checkpoint_from_json(nlohmann::json{{"frame_id", {1, 1}}}));
+  BOOST_CHECK(!sv::checkpoint_from_json(nullptr));
+}
+
+BOOST_AUTO_TEST_CASE(checkpoint_waits_for_frame_messages) {
+  const fs::path dir = fs::temp_directory_path() / fs::unique_path();
+  fs::create_directories(dir);
+  const std::string analysis_path = (dir / "analysis.json").string();
+  const std::string path = sv::checkpoint_path(analysis_path);
+
+  sv::buffered_file_sink analysis{analysis_path};
+  int states = 0;
+  sv::batch_checkpointer checkpointer{path, std::chrono::seconds{10}, &analysis,
+                                      nullptr, [&states]() { return ++states; }};
+  const auto start = sv::batch_checkpointer::clock::now();
+
+  checkpointer.on_frame(frame(1), start);
+  analysis.on_next(nlohmann::json(1));
+  // interval has passed, but messages of frame 2 are not there yet.
+  checkpointer.on_frame(frame(2), start + std::chrono::seconds{11});
+  BOOST_CHECK(!sv::load_checkpoint(path));
+  analysis.on_next(nlohmann::json(2));
+  checkpointer.on_frame(frame(3), start + std::chrono::seconds{12});
+  analysis.on_next(nlohmann::json(3));
+
+  auto checkpoint = sv::load_checkpoint(path);
+  BOOST_REQUIRE(checkpoint);
+  BOOST_CHECK_EQUAL(2, checkpoint->frame.i2);
+  BOOST_CHECK_EQUAL(80, checkpoint->timestamp_millis);
+  BOOST_CHECK_EQUAL(4, checkpoint->analysis_file_offset);
+  BOOST_CHECK_EQUAL(1, checkpoint->bot_state.get<int>());
+
+  checkpointer.finish();
+  checkpoint = sv::load_checkpoint(path);
+  BOOST_REQUIRE(checkpoint);
+  BOOST_CHECK_EQUAL(3, checkpoint->frame.i2);
+  BOOST_CHECK_EQUAL(6, checkpoint->analysis_file_offset);
+  BOOST_CHECK_EQUAL(2, checkpoint->bot_state.get<int>());
+  fs::remove_all(dir);
+}
@@ -0,0 +1,235 @@
+#include <benchmark/benchmark.h>
+
+#include <fstream>
+#include <thread>
+
+#include "avutils.h"
+#include "base64.h"
+#include "cbor_json.h"
+#include "data.h"
+#include "logging_impl.h"
+#include "streams/streams.h"
+#include "streams/threaded_worker.h"
+#include "video_streams.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+std::string random_bytes(size_t size) {
+  std::string data;
+  data.reserve(size);
+  for (size_t i = 0; i < size; i++) {
+    data.push_back(static_cast<char>(i * 31 + 7));
+  }
+  return data;
+}
+
+// looks like a typical analysis message.
+nlohmann::json analysis_message(int objects) {
+  nlohmann::json detected = nlohmann::json::array();
+  for (int i = 0; i < objects; i++) {
+    detected.push_back({{"id", i},
+                        {"label", "person"},
+                        {"confidence", 0.5 + i * 0.01},
+                        {"rect", {0.1 * i, 0.2, 0.3, 0.4}}});
+  }
+  return {{"i", {1000, 1001}}, {"from", "bot"}, {"detected_objects", detected}};
+}
+
+sv::encoded_frame encoded_frame(size_t size) {
+  sv::encoded_frame frame;
+  frame.data = random_bytes(size);
+  frame.id = {1, 1};
+  frame.key_frame = true;
+  return frame;
+}
+
+template <typename T>
+void wait(const sv::streams::deferred<T> &d) {
+  while (!d.resolved()) {
+    std::this_thread::yield();
+  }
+}
+
+// encoded packets of test_data/<name>.frame, base64 line per frame.
+std::vector<sv::encoded_packet> read_test_frames(const std::string &name,
+                                                 const std::string &codec_name) {
+  std::vector<sv::encoded_packet> packets;
+  std::string codec_data;
+  std::ifstream metadata_file("test_data/" + name + ".metadata");
+  if (metadata_file) {
+    std::string base64_metadata;
+    metadata_file >> base64_metadata;
+    codec_data = sv::base64::decode(base64_metadata).get();
+  }
+  packets.emplace_back(sv::encoded_metadata{codec_name, codec_data});
+
+  std::ifstream frames_file("test_data/" + name + ".frame");
+  CHECK(frames_file) << "test_data/" << name << ".frame is not found";
+  std::string line;
+  for (int64_t id = 1; std::getline(frames_file, line); id++) {
+    sv::encoded_frame f;
+    f.data = sv::base64::decode(line).get();
+    f.id = {id, id};
+    packets.emplace_back(std::move(f));
+  }
+  return packets;
+}
+
+void base64_encode(benchmark::State &state) {
+  const std::string data = random_bytes(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(sv::base64::encode(data));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(base64_encode)->Arg(1024)->Arg(64 * 1024)->Arg(1024 * 1024);
+
+void base64_decode(benchmark::State &state) {
+  const std::string encoded = sv::base64::encode(random_bytes(state.range(0)));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(sv::base64::decode(encoded));
+  }
+  state.SetBytesProcessed(state.iterations() * encoded.size());
+}
+BENCHMARK(base64_decode)->Arg(1024)->Arg(64 * 1024)->Arg(1024 * 1024);
+
+void json_to_cbor(benchmark::State &state) {
+  const nlohmann::json message = analysis_message(state.range(0));
+  std::string out;
+  for (auto _ : state) {
+    out.clear();
+    sv::json_to_cbor(message, out);
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(json_to_cbor)->Arg(1)->Arg(10)->Arg(100);
+
+void cbor_to_json(benchmark::State &state) {
+  const std::string cbor = sv::json_to_cbor(analysis_message(state.range(0)));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(sv::cbor_to_json(cbor));
+  }
+  state.SetBytesProcessed(state.iterations() * cbor.size());
+}
+BENCHMARK(cbor_to_json)->Arg(1)->Arg(10)->Arg(100);
+
+// frame is split into network chunks and reassembled again.
+void network_round_trip(benchmark::State &state) {
+  const sv::encoded_frame frame = encoded_frame(state.range(0));
+  const auto encoding = static_cast<sv::payload_encoding>(state.range(1));
+  for (auto _ : state) {
+    std::vector<sv::network_packet> packets;
+    for (auto &nf : frame.to_network(encoding)) {
+      packets.emplace_back(std::move(nf));
+    }
+    auto p = sv::streams::publishers::of(std::move(packets))
+             >> sv::decode_network_stream();
+    p->process([](sv::encoded_packet &&packet) { benchmark::DoNotOptimize(packet); });
+  }
+  state.SetBytesProcessed(state.iterations() * frame.data.size());
+}
+BENCHMARK(network_round_trip)
+    ->Args({16 * 1024, static_cast<int>(sv::payload_encoding::BASE64)})
+    ->Args({256 * 1024, static_cast<int>(sv::payload_encoding::BASE64)})
+    ->Args({256 * 1024, static_cast<int>(sv::payload_encoding::BINARY)});
+
+constexpr int stream_elements = 100000;
+
+void streams_map(benchmark::State &state) {
+  for (auto _ : state) {
+    auto p = sv::streams::publishers::range(0, stream_elements)
+             >> sv::streams::map([](int i) { return i + 1; })
+             >> sv::streams::map([](int i) { return i * 2; });
+    p->process([](int i) { benchmark::DoNotOptimize(i); });
+  }
+  state.SetItemsProcessed(state.iterations() * stream_elements);
+}
+BENCHMARK(streams_map);
+
+void streams_flat_map(benchmark::State &state) {
+  for (auto _ : state) {
+    auto p = sv::streams::publishers::range(0, stream_elements / 2)
+             >> sv::streams::flat_map(
+                    [](int i) { return sv::streams::publishers::of({i, i}); });
+    p->process([](int i) { benchmark::DoNotOptimize(i); });
+  }
+  state.SetItemsProcessed(state.iterations() * stream_elements);
+}
+BENCHMARK(streams_flat_map);
+
+void streams_merge(benchmark::State &state) {
+  for (auto _ : state) {
+    auto p = sv::streams::publishers::merge(
+        sv::streams::publishers::range(0, stream_elements / 2),
+        sv::streams::publishers::range(0, stream_elements / 2));
+    p->process([](int i) { benchmark::DoNotOptimize(i); });
+  }
+  state.SetItemsProcessed(state.iterations() * stream_elements);
+}
+BENCHMARK(streams_merge);
+
+// consumes elements with windowed requests instead of request(1) per element.
+struct window_sink : sv::streams::subscriber<int> {
+  explicit window_sink(int window_size) : window(window_size) {}
+
+  void on_next(int &&t) override {
+    benchmark::DoNotOptimize(t);
+    window.on_consumed();
+  }
+  void on_error(std::error_condition /*ec*/) override {}
+  void on_complete() override {}
+  void on_subscribe(sv::streams::subscription &s) override { window.start(s); }
+
+  sv::streams::request_window window;
+};
+
+void streams_request_window(benchmark::State &state) {
+  for (auto _ : state) {
+    auto p = sv::streams::publishers::range(0, stream_elements)
+             >> sv::streams::map([](int i) { return i + 1; });
+    window_sink sink{static_cast<int>(state.range(0))};
+    p->subscribe(sink);
+  }
+  state.SetItemsProcessed(state.iterations() * stream_elements);
+}
+BENCHMARK(streams_request_window)->Arg(1)->Arg(64);
+
+void streams_threaded_worker(benchmark::State &state) {
+  for (auto _ : state) {
+    auto p = sv::streams::publishers::range(0, stream_elements)
+             >> sv::streams::threaded_worker("benchmark_worker")
+             >> sv::streams::flatten();
+    wait(p->process([](int i) { benchmark::DoNotOptimize(i); }));
+  }
+  state.SetItemsProcessed(state.iterations() * stream_elements);
+}
+BENCHMARK(streams_threaded_worker)->UseRealTime();
+
+void decode_image_frames(benchmark::State &state, const std::string &name,
+                         const std::string &codec_name) {
+  const auto packets = read_test_frames(name, codec_name);
+  for (auto _ : state) {
+    auto p = sv::streams::publishers::of(std::vector<sv::encoded_packet>{packets})
+             >> sv::decode_image_frames({-1, -1}, sv::image_pixel_format::BGR, true);
+    p->process([](sv::owned_image_packet &&pkt) { benchmark::DoNotOptimize(pkt); });
+  }
+  state.SetItemsProcessed(state.iterations() * (packets.size() - 1));
+}
+BENCHMARK_CAPTURE(decode_image_frames, h264, "h264_320x180", "h264");
+BENCHMARK_CAPTURE(decode_image_frames, vp9, "vp9_320x180", "vp9");
+BENCHMARK_CAPTURE(decode_image_frames, mjpeg, "mjpeg_320x180", "mjpeg");
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  benchmark::Initialize(&argc, argv);
+  sv::init_logging(argc, argv);
+  // logging shouldn't be measured.
+  loguru::g_stderr_verbosity = loguru::Verbosity_WARNING;
+  sv::avutils::init();
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
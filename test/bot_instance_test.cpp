@@ -1,8 +1,12 @@
 #define BOOST_TEST_MODULE BotInstanceTest
 #include <boost/test/included/unit_test.hpp>
 
+#include <chrono>
+#include <cstring>
 #include <json.hpp>
+#include <thread>
 
+#include "avutils.h"
 #include "bot_instance.h"
 #include "streams/streams.h"
 
@@ -100,3 +104,174 @@ BOOST_AUTO_TEST_CASE(basic) {
     BOOST_TEST("dummy-shutdown-value", m.data["dummy-shutdown-key"]);
   }
 }
+
+BOOST_AUTO_TEST_CASE(profile_command) {
+  sv::multiframe_bot_descriptor descriptor;
+  descriptor.pixel_format = sv::image_pixel_format::RGB0;
+  descriptor.ctrl_callback = &::process_command;
+  descriptor.img_callback = &::process_image;
+
+  sv::bot_instance bot_instance{"dummy-bot-id", sv::execution_mode::LIVE, descriptor};
+  nlohmann::json msg = {{"to", "dummy-bot-id"},
+                        {"action", "profile"},
+                        {"body", {{"type", "cpu"}}},
+                        {"request_id", 7}};
+
+  sv::bot_outputs outputs = bot_instance(msg);
+  BOOST_REQUIRE_EQUAL(1, outputs.size());
+  const struct sv::bot_message *m = boost::get<struct sv::bot_message>(&outputs[0]);
+  BOOST_REQUIRE(m != nullptr);
+  BOOST_CHECK_EQUAL((int)sv::bot_message_kind::CONTROL, (int)m->kind);
+  BOOST_CHECK_EQUAL("profile", m->data["action"]);
+  BOOST_CHECK_EQUAL(7, m->data["request_id"]);
+  BOOST_CHECK_EQUAL("profiling is not enabled", m->data["error"]);
+
+  bot_instance.set_profiler(std::make_shared<sv::profiler>("/tmp", "dummy-bot-id"));
+  msg["body"]["type"] = "unknown";
+  outputs = bot_instance(msg);
+  BOOST_REQUIRE_EQUAL(1, outputs.size());
+  m = boost::get<struct sv::bot_message>(&outputs[0]);
+  BOOST_REQUIRE(m != nullptr);
+  BOOST_CHECK(m->data.find("error") != m->data.end());
+}
+
+BOOST_AUTO_TEST_CASE(lazy_conversion) {
+  sv::multiframe_bot_descriptor descriptor;
+  descriptor.pixel_format = sv::image_pixel_format::BGR;
+  descriptor.lazy_conversion = true;
+  int converted_frames{0};
+  descriptor.img_callback = [&converted_frames](
+                                sv::bot_context &context,
+                                const gsl::span<sv::image_frame> &frames) {
+    BOOST_TEST(frames.size() == 3);
+    BOOST_TEST(context.frame_metadata->plane_strides[0] >= 16 * 3);
+    for (const auto &f : frames) {
+      BOOST_TEST(f.plane_data[0] == nullptr);
+    }
+
+    sv::image_frame last = frames[frames.size() - 1];
+    sv::bot_convert_frame(context, last);
+    BOOST_TEST(last.plane_data[0] != nullptr);
+    BOOST_TEST(last.plane_data[1] == nullptr);
+    // black YUV frame is black in BGR as well.
+    BOOST_TEST(last.plane_data[0][0] == 0);
+    converted_frames++;
+  };
+
+  sv::bot_instance bot_instance{"", sv::execution_mode::BATCH, descriptor};
+  BOOST_TEST((bot_instance.decoder_pixel_format() == sv::image_pixel_format::YUV420P));
+
+  sv::avutils::frame_pool pool{16, 16, AV_PIX_FMT_YUV420P};
+  sv::owned_image_packets frames;
+  for (int i = 0; i < 3; i++) {
+    std::shared_ptr<AVFrame> frame = pool.get();
+    memset(frame->data[0], 16, static_cast<size_t>(frame->linesize[0]) * 16);
+    memset(frame->data[1], 128, static_cast<size_t>(frame->linesize[1]) * 8);
+    memset(frame->data[2], 128, static_cast<size_t>(frame->linesize[2]) * 8);
+    sv::owned_image_frame image = sv::avutils::to_image_frame(*frame);
+    image.id = {i, i};
+    frames.push(std::move(image));
+  }
+
+  std::vector<sv::bot_input> bot_input;
+  bot_input.emplace_back(std::move(frames));
+  (sv::streams::publishers::of(std::move(bot_input)) >> bot_instance.run_bot())
+      ->process([](sv::bot_output && /*o*/) {});
+
+  BOOST_TEST(converted_frames == 1);
+}
+
+BOOST_AUTO_TEST_CASE(async_callback) {
+  sv::multiframe_bot_descriptor descriptor;
+  descriptor.pixel_format = sv::image_pixel_format::RGB0;
+  descriptor.max_in_flight = 2;
+  std::vector<std::thread> workers;
+  // later frames complete sooner.
+  descriptor.async_img_callback = [&workers](sv::bot_context &context,
+                                             const gsl::span<sv::image_frame> &frames,
+                                             sv::bot_completion_t done) {
+    const sv::frame_id id = frames[0].id;
+    workers.emplace_back([&context, id, done]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds{(5 - id.i1) * 10});
+      sv::bot_message(context, sv::bot_message_kind::ANALYSIS, {{"frame", id.i1}}, id);
+      done();
+    });
+  };
+
+  sv::bot_instance bot_instance{"", sv::execution_mode::BATCH, descriptor};
+
+  std::vector<sv::bot_input> bot_input;
+  for (int i = 1; i <= 4; i++) {
+    sv::owned_image_packets frames;
+    sv::owned_image_frame frame{};
+    frame.id = {i, i};
+    frames.push(std::move(frame));
+    bot_input.emplace_back(std::move(frames));
+  }
+
+  std::vector<int64_t> analysis_frames;
+  (sv::streams::publishers::of(std::move(bot_input)) >> bot_instance.run_bot())
+      ->process([&analysis_frames](sv::bot_output &&o) {
+        if (auto *msg = boost::get<struct sv::bot_message>(&o)) {
+          analysis_frames.push_back(msg->data["frame"].get<int64_t>());
+        }
+      });
+  for (auto &w : workers) {
+    w.join();
+  }
+
+  const std::vector<int64_t> expected{1, 2, 3, 4};
+  BOOST_CHECK_EQUAL_COLLECTIONS(analysis_frames.begin(), analysis_frames.end(),
+                                expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE(resolution_change) {
+  sv::multiframe_bot_descriptor descriptor;
+  descriptor.pixel_format = sv::image_pixel_format::RGB0;
+  std::vector<std::pair<int, int>> batch_sizes;
+  descriptor.img_callback = [&batch_sizes](sv::bot_context &context,
+                                           const gsl::span<sv::image_frame> &frames) {
+    for (size_t i = 0; i < frames.size(); i++) {
+      batch_sizes.emplace_back(context.frame_metadata->width,
+                               context.frame_metadata->height);
+    }
+  };
+  std::vector<nlohmann::json> commands;
+  descriptor.ctrl_callback = [&commands](sv::bot_context & /*context*/,
+                                         const nlohmann::json &command) {
+    commands.push_back(command);
+    return nlohmann::json(nullptr);
+  };
+
+  sv::bot_instance bot_instance{"", sv::execution_mode::LIVE, descriptor};
+  auto batch = [](std::vector<std::pair<uint16_t, uint16_t>> sizes) {
+    sv::owned_image_packets frames;
+    for (const auto &size : sizes) {
+      sv::owned_image_frame frame{};
+      frame.width = size.first;
+      frame.height = size.second;
+      frames.push(std::move(frame));
+    }
+    return frames;
+  };
+
+  auto frames = batch({{16, 16}});
+  bot_instance(frames);
+  BOOST_CHECK(commands.empty());
+
+  // frames of previous resolution in the same batch are dropped.
+  frames = batch({{16, 16}, {32, 24}, {32, 24}});
+  bot_instance(frames);
+  BOOST_REQUIRE_EQUAL(1, commands.size());
+  BOOST_CHECK_EQUAL(
+      R"({"action":"resolution_changed","body":{"height":24,"previous":{"height":16,)"
+      R"("width":16},"width":32}})"_json,
+      commands[0]);
+
+  frames = batch({{32, 24}});
+  bot_instance(frames);
+  BOOST_CHECK_EQUAL(1, commands.size());
+
+  const std::vector<std::pair<int, int>> expected{{16, 16}, {32, 24}, {32, 24}, {32, 24}};
+  BOOST_CHECK(batch_sizes == expected);
+}
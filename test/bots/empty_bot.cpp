@@ -19,7 +19,8 @@ void process_image(sv::bot_context &context, const sv::image_frame & /*frame*/)
 }  // namespace empty_bot
 
 int main(int argc, char *argv[]) {
-  sv::bot_register(
-      sv::bot_descriptor{sv::image_pixel_format::BGR, &empty_bot::process_image});
+  sv::bot_descriptor descriptor{sv::image_pixel_format::BGR, &empty_bot::process_image};
+  descriptor.gop_independent = true;
+  sv::bot_register(descriptor);
   return sv::bot_main(argc, argv);
 }
@@ -0,0 +1,227 @@
+// Runs the bot pipeline in batch mode with a stub bot and reports throughput as
+// json. Takes usual bot options plus:
+//   --stub=noop|memcpy|sleep:<millis>  what bot does with each frame, noop by default
+//   --report-file=<path>               where the report goes, stdout by default
+#include <satorivideo/video_bot.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <json.hpp>
+
+#ifdef HAS_GPERFTOOLS
+#include <gperftools/malloc_hook.h>
+#else
+#include <new>
+#endif
+
+namespace sv = satori::video;
+
+namespace throughput_bot {
+
+std::atomic<uint64_t> allocations{0};
+std::atomic<uint64_t> frames{0};
+
+#ifdef HAS_GPERFTOOLS
+void count_allocation(const void * /*ptr*/, size_t /*size*/) { allocations++; }
+#endif
+
+enum class stub_kind { NOOP, MEMCPY, SLEEP };
+
+stub_kind stub{stub_kind::NOOP};
+std::chrono::milliseconds sleep_time{0};
+std::vector<uint8_t> copy_buffer;
+
+void process_image(sv::bot_context &context, const sv::image_frame &frame) {
+  frames++;
+  switch (stub) {
+    case stub_kind::NOOP:
+      break;
+    case stub_kind::MEMCPY: {
+      const size_t size =
+          context.frame_metadata->plane_strides[0] * context.frame_metadata->height;
+      copy_buffer.resize(size);
+      std::memcpy(copy_buffer.data(), frame.plane_data[0], size);
+      break;
+    }
+    case stub_kind::SLEEP:
+      std::this_thread::sleep_for(sleep_time);
+      break;
+  }
+}
+
+void parse_stub(const std::string &value) {
+  if (value == "noop") {
+    stub = stub_kind::NOOP;
+  } else if (value == "memcpy") {
+    stub = stub_kind::MEMCPY;
+  } else if (value.compare(0, 6, "sleep:") == 0) {
+    stub = stub_kind::SLEEP;
+    sleep_time = std::chrono::milliseconds{std::stoi(value.substr(6))};
+  } else {
+    std::cerr << "unknown stub " << value
+              << ", expected noop, memcpy or sleep:<millis>\n";
+    exit(1);
+  }
+}
+
+bool has_option(const std::vector<std::string> &args, const std::string &name) {
+  return std::any_of(args.begin(), args.end(), [&name](const std::string &arg) {
+    return arg.compare(0, name.size(), name) == 0;
+  });
+}
+
+double percentile(std::vector<double> &values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  const size_t i = std::min(values.size() - 1, static_cast<size_t>(p * values.size()));
+  return values[i];
+}
+
+// latency of each stage since the previous one, from frame traces.
+nlohmann::json stage_latencies(const std::string &trace_filename) {
+  static const std::vector<std::string> stages = {"reassembled", "decoded", "dequeued",
+                                                  "processed", "published"};
+  std::map<std::string, std::vector<double>> latencies;
+  std::ifstream trace_file(trace_filename);
+  std::string line;
+  while (std::getline(trace_file, line)) {
+    const nlohmann::json offsets = nlohmann::json::parse(line)["stages"];
+    double previous = 0;
+    for (const std::string &stage : stages) {
+      auto it = offsets.find(stage);
+      if (it == offsets.end()) {
+        continue;
+      }
+      const double offset = it->get<double>();
+      latencies[stage].push_back(offset - previous);
+      previous = offset;
+    }
+  }
+
+  nlohmann::json result = nlohmann::json::object();
+  for (auto &l : latencies) {
+    result[l.first] = {{"p50", percentile(l.second, 0.5)},
+                       {"p90", percentile(l.second, 0.9)},
+                       {"p99", percentile(l.second, 0.99)},
+                       {"max", percentile(l.second, 1)}};
+  }
+  return result;
+}
+
+uint64_t peak_rss_bytes() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return usage.ru_maxrss * 1024;
+#endif
+}
+
+}  // namespace throughput_bot
+
+#ifndef HAS_GPERFTOOLS
+// tcmalloc has its own operator new, so allocations are counted by its hook then.
+void *operator new(size_t size) {
+  throughput_bot::allocations++;
+  if (void *p = std::malloc(size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+#endif
+
+int main(int argc, char *argv[]) {
+  namespace tb = throughput_bot;
+
+  std::string stub = "noop";
+  std::string report_filename;
+  std::vector<std::string> args;
+  for (int i = 0; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg.compare(0, 7, "--stub=") == 0) {
+      stub = arg.substr(7);
+    } else if (arg.compare(0, 14, "--report-file=") == 0) {
+      report_filename = arg.substr(14);
+    } else {
+      args.push_back(arg);
+    }
+  }
+  tb::parse_stub(stub);
+
+  if (!tb::has_option(args, "--batch")) {
+    args.emplace_back("--batch");
+  }
+  if (!tb::has_option(args, "--frame-trace-sample")) {
+    args.emplace_back("--frame-trace-sample=1");
+  }
+  std::string trace_filename;
+  bool own_trace_file = false;
+  for (const std::string &arg : args) {
+    if (arg.compare(0, 19, "--frame-trace-file=") == 0) {
+      trace_filename = arg.substr(19);
+    }
+  }
+  if (trace_filename.empty()) {
+    trace_filename = "/tmp/throughput_bot." + std::to_string(getpid()) + ".trace";
+    own_trace_file = true;
+    args.push_back("--frame-trace-file=" + trace_filename);
+  }
+
+  std::vector<char *> bot_argv;
+  for (std::string &arg : args) {
+    bot_argv.push_back(&arg[0]);
+  }
+  bot_argv.push_back(nullptr);
+
+  sv::bot_descriptor descriptor{sv::image_pixel_format::BGR, &tb::process_image};
+  descriptor.gop_independent = true;
+  sv::bot_register(descriptor);
+
+#ifdef HAS_GPERFTOOLS
+  MallocHook::AddNewHook(&tb::count_allocation);
+#endif
+  const uint64_t allocations_before = tb::allocations;
+  const auto start = std::chrono::steady_clock::now();
+  const int result = sv::bot_main(static_cast<int>(args.size()), bot_argv.data());
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  const uint64_t allocations = tb::allocations - allocations_before;
+  const uint64_t frames = tb::frames;
+
+  nlohmann::json report = {
+      {"stub", stub},
+      {"frames", frames},
+      {"seconds", elapsed.count()},
+      {"frames_per_second", elapsed.count() > 0 ? frames / elapsed.count() : 0},
+      {"stage_latency_millis", tb::stage_latencies(trace_filename)},
+      {"peak_rss_bytes", tb::peak_rss_bytes()},
+      {"allocations_per_frame",
+       frames > 0 ? static_cast<double>(allocations) / frames : 0}};
+  if (own_trace_file) {
+    std::remove(trace_filename.c_str());
+  }
+
+  if (report_filename.empty()) {
+    std::cout << report.dump(2) << "\n";
+  } else {
+    std::ofstream(report_filename) << report.dump(2) << "\n";
+  }
+  return result;
+}
@@ -0,0 +1,104 @@
+#define BOOST_TEST_MODULE BufferedFileSinkTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <sstream>
+
+#include "buffered_file_sink.h"
+#include "cbor_json.h"
+
+namespace sv = satori::video;
+namespace fs = boost::filesystem;
+
+namespace {
+
+std::string read_file(const fs::path &path) {
+  std::ifstream in{path.string(), std::ios::binary};
+  std::stringstream ss;
+  ss << in.rdbuf();
+  return ss.str();
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(json_lines) {
+  const fs::path path = fs::temp_directory_path() / fs::unique_path("%%%%%%.json");
+  {
+    sv::buffered_file_sink sink{path.string()};
+    sink.on_next(nlohmann::json("one"));
+    sink.on_next(nlohmann::json("two"));
+    sink.on_next(nlohmann::json("three"));
+  }
+
+  BOOST_CHECK_EQUAL("\"one\"\n\"two\"\n\"three\"\n", read_file(path));
+  fs::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(flush) {
+  const fs::path path = fs::temp_directory_path() / fs::unique_path("%%%%%%.json");
+  sv::buffered_file_sink_options options;
+  options.flush_interval = std::chrono::hours{1};
+  sv::buffered_file_sink sink{path.string(), options};
+
+  sink.on_next(nlohmann::json({{"a", 1}}));
+  sink.flush();
+  BOOST_CHECK_EQUAL("{\"a\":1}\n", read_file(path));
+
+  sink.on_next(nlohmann::json({{"b", 2}}));
+  sink.on_complete();
+  BOOST_CHECK_EQUAL("{\"a\":1}\n{\"b\":2}\n", read_file(path));
+  fs::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(binary) {
+  const fs::path path = fs::temp_directory_path() / fs::unique_path("%%%%%%.cbor");
+  const nlohmann::json first = {{"detections", {1, 2, 3}}};
+  const nlohmann::json second = {{"frame", 5}};
+  {
+    sv::buffered_file_sink_options options;
+    options.binary = true;
+    sv::buffered_file_sink sink{path.string(), options};
+    sink.on_next(nlohmann::json(first));
+    sink.on_next(nlohmann::json(second));
+  }
+
+  const std::string data = read_file(path);
+  std::vector<nlohmann::json> messages;
+  size_t offset = 0;
+  while (offset + 4 <= data.size()) {
+    size_t size = 0;
+    for (size_t i = 0; i < 4; i++) {
+      size = (size << 8) | static_cast<uint8_t>(data[offset + i]);
+    }
+    offset += 4;
+    BOOST_REQUIRE_LE(offset + size, data.size());
+    auto message = sv::cbor_to_json(data.data() + offset, size);
+    BOOST_REQUIRE(message.ok());
+    messages.push_back(message.get());
+    offset += size;
+  }
+
+  BOOST_REQUIRE_EQUAL(2u, messages.size());
+  BOOST_CHECK_EQUAL(first, messages[0]);
+  BOOST_CHECK_EQUAL(second, messages[1]);
+  fs::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(append) {
+  const fs::path path = fs::temp_directory_path() / fs::unique_path("%%%%%%.json");
+  {
+    sv::buffered_file_sink sink{path.string()};
+    sink.on_next(nlohmann::json(1));
+    BOOST_CHECK_EQUAL(2, sink.flush());
+  }
+
+  sv::buffered_file_sink_options options;
+  options.append = true;
+  sv::buffered_file_sink sink{path.string(), options};
+  BOOST_CHECK_EQUAL(2, sink.flush());
+  sink.on_next(nlohmann::json(22));
+  BOOST_CHECK_EQUAL(5, sink.flush());
+  BOOST_CHECK_EQUAL("1\n22\n", read_file(path));
+  fs::remove(path);
+}
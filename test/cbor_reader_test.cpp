@@ -0,0 +1,181 @@
+#define BOOST_TEST_MODULE CborReaderTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <string>
+
+#include "cbor_reader.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+sv::cbor_reader make_reader(const std::string &data) {
+  return sv::cbor_reader{data.data(), data.size()};
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(int_test) {
+  const uint8_t data[]{
+      0b00010111 /* Major type 0, value 23 */,
+      0b00011001 /* Major type 0, uint16_t follows */,
+      0x01,
+      0x00,
+      0b00100000 /* Major type 1, value 0 = -1 */,
+      0b00111000 /* Major type 1, uint8_t follows */,
+      0xff,
+  };
+  const std::string buffer{data, data + sizeof(data)};
+  auto reader = make_reader(buffer);
+
+  int64_t value;
+  BOOST_TEST(reader.read_int(value));
+  BOOST_TEST(value == 23);
+  BOOST_TEST(reader.read_int(value));
+  BOOST_TEST(value == 256);
+  BOOST_TEST(reader.read_int(value));
+  BOOST_TEST(value == -1);
+  BOOST_TEST(reader.read_int(value));
+  BOOST_TEST(value == -256);
+  BOOST_TEST(reader.at_end());
+  BOOST_TEST(!reader.read_int(value));
+}
+
+BOOST_AUTO_TEST_CASE(number_test) {
+  const uint8_t data[]{
+      0b11111001 /* Major type 7, half float */,
+      0x3e,
+      0x00,
+      0b11111010 /* Major type 7, float */,
+      0xbf,
+      0xc0,
+      0x00,
+      0x00,
+      0b11111011 /* Major type 7, double */,
+      0x3f,
+      0xf1,
+      0x99,
+      0x99,
+      0x99,
+      0x99,
+      0x99,
+      0x9a,
+      0b00000101 /* Major type 0, value 5 */,
+  };
+  const std::string buffer{data, data + sizeof(data)};
+  auto reader = make_reader(buffer);
+
+  double value;
+  BOOST_TEST(reader.read_number(value));
+  BOOST_TEST(value == 1.5);
+  BOOST_TEST(reader.read_number(value));
+  BOOST_TEST(value == -1.5);
+  BOOST_TEST(reader.read_number(value));
+  BOOST_TEST(value == 1.1);
+  BOOST_TEST(reader.read_number(value));
+  BOOST_TEST(value == 5);
+  BOOST_TEST(reader.at_end());
+}
+
+BOOST_AUTO_TEST_CASE(strings_test) {
+  const uint8_t data[]{
+      0b01100010 /* Major type 3, text of size 2 */,
+      'a',
+      'b',
+      0b01000011 /* Major type 2, bytestring of size 3 */,
+      0,
+      1,
+      2,
+      0b11110101 /* true */,
+  };
+  const std::string buffer{data, data + sizeof(data)};
+  auto reader = make_reader(buffer);
+
+  boost::string_ref value;
+  BOOST_TEST(!reader.next_is_bytes());
+  BOOST_TEST(reader.read_text(value));
+  BOOST_TEST(value == "ab");
+  BOOST_TEST(reader.next_is_bytes());
+  BOOST_TEST(reader.read_bytes(value));
+  BOOST_TEST(value == std::string(data + 4, data + 7));
+
+  bool b;
+  BOOST_TEST(reader.read_bool(b));
+  BOOST_TEST(b);
+  BOOST_TEST(reader.at_end());
+}
+
+BOOST_AUTO_TEST_CASE(skip_test) {
+  const uint8_t data[]{
+      0b10100010 /* Major type 5, map with 2 entries */,
+      0b01100001 /* text of size 1 */,
+      'a',
+      0b10000010 /* Major type 4, array of size 2 */,
+      0b00000001,
+      0b10100000 /* empty map */,
+      0b01100001 /* text of size 1 */,
+      'b',
+      0b11110110 /* null */,
+      0b00000111 /* Major type 0, value 7 */,
+  };
+  const std::string buffer{data, data + sizeof(data)};
+  auto reader = make_reader(buffer);
+
+  BOOST_TEST(reader.skip());
+  int64_t value;
+  BOOST_TEST(reader.read_int(value));
+  BOOST_TEST(value == 7);
+  BOOST_TEST(reader.at_end());
+}
+
+BOOST_AUTO_TEST_CASE(map_test) {
+  const uint8_t data[]{
+      0b10100001 /* Major type 5, map with 1 entry */,
+      0b01100001 /* text of size 1 */,
+      'i',
+      0b10000010 /* Major type 4, array of size 2 */,
+      0b00000001,
+      0b00000010,
+  };
+  const std::string buffer{data, data + sizeof(data)};
+  auto reader = make_reader(buffer);
+
+  uint64_t size;
+  BOOST_TEST(!make_reader(buffer).read_array(size));
+  BOOST_TEST(reader.read_map(size));
+  BOOST_TEST(size == 1);
+  boost::string_ref key;
+  BOOST_TEST(reader.read_text(key));
+  BOOST_TEST(key == "i");
+  BOOST_TEST(reader.read_array(size));
+  BOOST_TEST(size == 2);
+}
+
+BOOST_AUTO_TEST_CASE(malformed_test) {
+  {
+    const uint8_t data[]{
+        0b01100011 /* text of size 3 */, 'a', 'b',
+    };
+    const std::string buffer{data, data + sizeof(data)};
+    boost::string_ref value;
+    BOOST_TEST(!make_reader(buffer).read_text(value));
+    BOOST_TEST(!make_reader(buffer).skip());
+  }
+  {
+    const uint8_t data[]{
+        0b10011111 /* indefinite array */, 0b00000001, 0b11111111 /* break */,
+    };
+    const std::string buffer{data, data + sizeof(data)};
+    uint64_t size;
+    BOOST_TEST(!make_reader(buffer).read_array(size));
+    BOOST_TEST(!make_reader(buffer).skip());
+  }
+  {
+    const uint8_t data[]{
+        0b10011011 /* array with uint64_t size */, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff,
+    };
+    const std::string buffer{data, data + sizeof(data)};
+    BOOST_TEST(!make_reader(buffer).skip());
+  }
+}
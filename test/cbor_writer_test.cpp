@@ -0,0 +1,101 @@
+#define BOOST_TEST_MODULE CborWriterTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <string>
+#include <vector>
+
+#include "cbor_reader.h"
+#include "cbor_writer.h"
+
+namespace sv = satori::video;
+
+BOOST_AUTO_TEST_CASE(int_head_test) {
+  std::string buffer;
+  sv::cbor_writer writer{buffer};
+  writer.write_uint(23);
+  writer.write_uint(24);
+  writer.write_int(-256);
+  writer.write_uint(65536);
+
+  const uint8_t data[]{
+      0b00010111 /* Major type 0, value 23 */,
+      0b00011000 /* Major type 0, uint8_t follows */,
+      24,
+      0b00111000 /* Major type 1, uint8_t follows */,
+      0xff,
+      0b00011010 /* Major type 0, uint32_t follows */,
+      0x00,
+      0x01,
+      0x00,
+      0x00,
+  };
+  BOOST_TEST(buffer == std::string(data, data + sizeof(data)));
+}
+
+BOOST_AUTO_TEST_CASE(round_trip_test) {
+  const std::vector<int64_t> ints{0,         -1,          255,       256,
+                                  -65537,    1LL << 32,   -(1LL << 40),
+                                  INT64_MAX, INT64_MIN};
+  const std::string bytes{'\0', '\xff', 'x'};
+
+  std::string buffer{"prefix"};
+  sv::cbor_writer writer{buffer};
+  writer.write_map(2);
+  writer.write_text("ints");
+  writer.write_array(ints.size());
+  for (int64_t i : ints) {
+    writer.write_int(i);
+  }
+  writer.write_text("values");
+  writer.write_array(4);
+  writer.write_bytes(bytes.data(), bytes.size());
+  writer.write_double(-0.25);
+  writer.write_bool(false);
+  writer.write_null();
+
+  BOOST_TEST(buffer.compare(0, 6, "prefix") == 0);
+  sv::cbor_reader reader{buffer.data() + 6, buffer.size() - 6};
+  uint64_t size;
+  boost::string_ref text;
+  BOOST_TEST_REQUIRE(reader.read_map(size));
+  BOOST_TEST(size == 2);
+  BOOST_TEST_REQUIRE(reader.read_text(text));
+  BOOST_TEST(text == "ints");
+  BOOST_TEST_REQUIRE(reader.read_array(size));
+  BOOST_TEST(size == ints.size());
+  for (int64_t expected : ints) {
+    int64_t i;
+    BOOST_TEST_REQUIRE(reader.read_int(i));
+    BOOST_TEST(i == expected);
+  }
+
+  BOOST_TEST_REQUIRE(reader.read_text(text));
+  BOOST_TEST(text == "values");
+  BOOST_TEST_REQUIRE(reader.read_array(size));
+  BOOST_TEST_REQUIRE(reader.read_bytes(text));
+  BOOST_TEST(text == bytes);
+  double d;
+  BOOST_TEST_REQUIRE(reader.read_number(d));
+  BOOST_TEST(d == -0.25);
+  bool b;
+  BOOST_TEST_REQUIRE(reader.read_bool(b));
+  BOOST_TEST(!b);
+  BOOST_TEST(reader.skip());
+  BOOST_TEST(reader.at_end());
+}
+
+BOOST_AUTO_TEST_CASE(bytes_placeholder_test) {
+  std::string buffer;
+  sv::cbor_writer writer{buffer};
+  char *out = writer.write_bytes_placeholder(300);
+  for (int i = 0; i < 300; i++) {
+    out[i] = static_cast<char>(i);
+  }
+
+  sv::cbor_reader reader{buffer.data(), buffer.size()};
+  boost::string_ref value;
+  BOOST_TEST_REQUIRE(reader.read_bytes(value));
+  BOOST_TEST(value.size() == 300);
+  BOOST_TEST(value[299] == static_cast<char>(299));
+  BOOST_TEST(reader.at_end());
+}
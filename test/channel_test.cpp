@@ -0,0 +1,87 @@
+#define BOOST_TEST_MODULE ChannelTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "streams/channel.h"
+
+using namespace satori::video;
+using namespace std::chrono_literals;
+
+BOOST_AUTO_TEST_CASE(send_recv) {
+  channel<int> c{2};
+  BOOST_TEST(c.send(1));
+  BOOST_TEST(c.try_send(2));
+  BOOST_TEST(!c.try_send(3));
+  BOOST_TEST(*c.recv() == 1);
+  BOOST_TEST(*c.recv() == 2);
+  BOOST_TEST(c.size() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(timeouts) {
+  channel<int> c{1};
+  BOOST_TEST(!c.recv_for(10ms));
+  BOOST_TEST(c.recv_all_for(10, 10ms).empty());
+  BOOST_TEST(c.send_for(1, 10ms));
+  BOOST_TEST(!c.send_for(2, 10ms));
+  BOOST_TEST(*c.recv_for(10ms) == 1);
+}
+
+BOOST_AUTO_TEST_CASE(batches) {
+  channel<int> c{10};
+  BOOST_TEST(c.send_all({1, 2, 3, 4, 5}) == 5);
+  BOOST_TEST(c.recv_all(3) == std::vector<int>({1, 2, 3}));
+  BOOST_TEST(c.recv_all(10) == std::vector<int>({4, 5}));
+}
+
+BOOST_AUTO_TEST_CASE(send_all_waits_for_room) {
+  channel<int> c{3};
+  std::vector<int> items;
+  for (int i = 0; i < 100; i++) {
+    items.push_back(i);
+  }
+  std::thread sender([&c, &items]() { BOOST_TEST(c.send_all(std::move(items)) == 100); });
+
+  std::vector<int> received;
+  while (received.size() < 100) {
+    for (int i : c.recv_all(2)) {
+      received.push_back(i);
+    }
+  }
+  sender.join();
+  for (int i = 0; i < 100; i++) {
+    BOOST_TEST(received[i] == i);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(close_drains_and_wakes_receivers) {
+  channel<int> c{10};
+  c.send(1);
+  std::thread receiver([&c]() {
+    BOOST_TEST(*c.recv() == 1);
+    BOOST_TEST(!c.recv());
+    BOOST_TEST(c.recv_all(10).empty());
+  });
+  std::this_thread::sleep_for(10ms);
+  c.close();
+  receiver.join();
+  BOOST_TEST(c.closed());
+  BOOST_TEST(!c.send(2));
+  BOOST_TEST(!c.try_send(2));
+}
+
+BOOST_AUTO_TEST_CASE(close_wakes_senders) {
+  channel<int> c{1};
+  c.send(1);
+  std::thread sender([&c]() {
+    BOOST_TEST(!c.send(2));
+    BOOST_TEST(c.send_all({3, 4}) == 0);
+  });
+  std::this_thread::sleep_for(10ms);
+  c.close();
+  sender.join();
+  BOOST_TEST(*c.recv() == 1);
+  BOOST_TEST(!c.recv());
+}
@@ -0,0 +1,142 @@
+#define BOOST_TEST_MODULE CoalescingWriteStreamTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <boost/asio.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "coalescing_write_stream.h"
+
+namespace sv = satori::video;
+namespace asio = boost::asio;
+using socket_t = asio::local::stream_protocol::socket;
+
+namespace {
+
+// writes numbers one after another, next write starts when previous completes.
+std::string write_numbers(sv::coalescing_write_stream<socket_t> &stream, int count,
+                          int &completed) {
+  std::string expected;
+  for (int i = 0; i < count; i++) {
+    expected += std::to_string(i) + ",";
+  }
+
+  auto write_next = std::make_shared<std::function<void(int)>>();
+  *write_next = [&stream, &completed, count, write_next](int i) {
+    if (i == count) {
+      *write_next = nullptr;
+      return;
+    }
+    auto data = std::make_shared<std::string>(std::to_string(i) + ",");
+    asio::async_write(stream, asio::buffer(*data),
+                      [&completed, data, i, write_next](boost::system::error_code ec,
+                                                        size_t bytes) {
+                        BOOST_TEST(!ec);
+                        BOOST_TEST(bytes == data->size());
+                        completed++;
+                        (*write_next)(i + 1);
+                      });
+  };
+  (*write_next)(0);
+  return expected;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(writes_are_delivered_in_order) {
+  for (size_t max_batch_bytes : {1, 16, 1024}) {
+    asio::io_service io;
+    sv::coalescing_write_stream<socket_t> writer{max_batch_bytes, io};
+    socket_t reader{io};
+    asio::local::connect_pair(writer.next_layer(), reader);
+
+    int completed{0};
+    const std::string expected = write_numbers(writer, 100, completed);
+    io.run();
+    BOOST_TEST(completed == 100);
+
+    std::string received(expected.size(), '\0');
+    asio::read(reader, asio::buffer(&received[0], received.size()));
+    BOOST_TEST(received == expected);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(sync_writes_pass_through) {
+  asio::io_service io;
+  sv::coalescing_write_stream<socket_t> writer{16, io};
+  socket_t reader{io};
+  asio::local::connect_pair(writer.next_layer(), reader);
+
+  const std::string data{"hello"};
+  asio::write(writer, asio::buffer(data));
+
+  std::string received(data.size(), '\0');
+  asio::read(reader, asio::buffer(&received[0], received.size()));
+  BOOST_TEST(received == data);
+}
+
+BOOST_AUTO_TEST_CASE(written_callbacks_follow_socket_write) {
+  asio::io_service io;
+  sv::coalescing_write_stream<socket_t> writer{1024, io};
+  socket_t reader{io};
+  asio::local::connect_pair(writer.next_layer(), reader);
+
+  const std::string data{"frame"};
+  std::vector<size_t> available;
+  for (int i = 0; i < 3; i++) {
+    writer.async_write_some(asio::buffer(data),
+                            [](boost::system::error_code ec, size_t /*bytes*/) {
+                              BOOST_TEST(!ec);
+                            });
+    writer.on_written([&reader, &available](boost::system::error_code ec) {
+      BOOST_TEST(!ec);
+      available.push_back(reader.available());
+    });
+  }
+  BOOST_TEST(available.empty());
+  io.run();
+  // every callback finds its own and all earlier data on the socket.
+  BOOST_TEST_REQUIRE(available.size() == 3);
+  for (size_t i = 0; i < available.size(); i++) {
+    BOOST_TEST(available[i] >= (i + 1) * data.size());
+  }
+
+  bool written{false};
+  writer.on_written([&written](boost::system::error_code ec) {
+    BOOST_TEST(!ec);
+    written = true;
+  });
+  BOOST_TEST(written);
+}
+
+BOOST_AUTO_TEST_CASE(write_error_fails_every_coalesced_write) {
+  asio::io_service io;
+  sv::coalescing_write_stream<socket_t> writer{1024, io};
+  socket_t reader{io};
+  asio::local::connect_pair(writer.next_layer(), reader);
+  reader.close();
+
+  const std::string data{"frame"};
+  int failed{0};
+  for (int i = 0; i < 3; i++) {
+    writer.async_write_some(asio::buffer(data),
+                            [](boost::system::error_code /*ec*/, size_t /*bytes*/) {});
+    writer.on_written([&failed](boost::system::error_code ec) {
+      BOOST_TEST(!!ec);
+      failed++;
+    });
+  }
+  io.run();
+  BOOST_TEST(failed == 3);
+
+  boost::system::error_code write_ec;
+  writer.async_write_some(asio::buffer(data),
+                          [&write_ec](boost::system::error_code ec, size_t /*bytes*/) {
+                            write_ec = ec;
+                          });
+  io.restart();
+  io.run();
+  BOOST_TEST(!!write_ec);
+}
@@ -0,0 +1,148 @@
+#define BOOST_TEST_MODULE CoroutineTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <string>
+#include <vector>
+
+#include "streams/coroutine.h"
+
+// CMake builds this test only when compiler supports coroutines.
+#if !defined(__cpp_impl_coroutine) || !__has_include(<coroutine>)
+#error "coroutine_test needs compiler support of coroutines"
+#endif
+
+using namespace satori::video::streams;
+
+namespace {
+
+co_generator<int> count(int n) {
+  for (int i = 0; i < n; i++) {
+    co_yield i;
+  }
+}
+
+co_generator<std::string> fail_after(int n) {
+  for (int i = 0; i < n; i++) {
+    co_yield std::to_string(i);
+  }
+  co_yield coroutine_error{stream_error::NOT_INITIALIZED};
+}
+
+// yields every value of deferreds once it is resolved.
+co_generator<int> await_all(std::vector<deferred<int>> values) {
+  for (auto &d : values) {
+    error_or<int> value = co_await d;
+    co_yield *value;
+  }
+}
+
+deferred<int> twice(deferred<int> x) {
+  error_or<int> value = co_await x;
+  if (!value.ok()) {
+    co_return value.error_condition();
+  }
+  co_return *value * 2;
+}
+
+deferred<void> wait(deferred<void> x) {
+  std::error_condition ec = co_await x;
+  BOOST_TEST(!ec);
+}
+
+// requests one item at a time, when told to.
+struct manual_sink : subscriber<int> {
+  void on_next(int &&i) override { items.push_back(i); }
+  void on_error(std::error_condition /*ec*/) override { error = true; }
+  void on_complete() override { complete = true; }
+  void on_subscribe(subscription &s) override { src = &s; }
+
+  subscription *src{nullptr};
+  std::vector<int> items;
+  bool error{false};
+  bool complete{false};
+};
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(generate_all) {
+  std::vector<int> items;
+  auto done = coroutines::generate([]() { return count(5); })->process([&items](int &&i) {
+    items.push_back(i);
+  });
+  BOOST_TEST(done.resolved());
+  BOOST_TEST(done.ok());
+  BOOST_TEST(items == std::vector<int>({0, 1, 2, 3, 4}));
+}
+
+BOOST_AUTO_TEST_CASE(generate_honors_requests) {
+  manual_sink sink;
+  coroutines::generate([]() { return count(3); })->subscribe(sink);
+  BOOST_TEST(sink.items.empty());
+  sink.src->request(2);
+  BOOST_TEST(sink.items == std::vector<int>({0, 1}));
+  sink.src->request(2);
+  BOOST_TEST(sink.items == std::vector<int>({0, 1, 2}));
+  BOOST_TEST(sink.complete);
+}
+
+BOOST_AUTO_TEST_CASE(generate_cancel) {
+  auto p = coroutines::generate([]() { return count(1000000); }) >> take(3);
+  std::vector<int> items;
+  auto done = p->process([&items](int &&i) { items.push_back(i); });
+  BOOST_TEST(done.ok());
+  BOOST_TEST(items == std::vector<int>({0, 1, 2}));
+}
+
+BOOST_AUTO_TEST_CASE(generate_error) {
+  std::vector<std::string> items;
+  auto done = coroutines::generate([]() { return fail_after(2); })
+                  ->process([&items](std::string &&s) { items.push_back(s); });
+  BOOST_TEST(done.resolved());
+  BOOST_TEST(!done.ok());
+  BOOST_TEST(items == std::vector<std::string>({"0", "1"}));
+}
+
+BOOST_AUTO_TEST_CASE(generate_awaiting_deferred) {
+  std::vector<deferred<int>> values(3);
+  values[0].resolve(10);
+  manual_sink sink;
+  coroutines::generate([values]() { return await_all(values); })->subscribe(sink);
+  sink.src->request(10);
+  BOOST_TEST(sink.items == std::vector<int>({10}));
+  values[1].resolve(11);
+  BOOST_TEST(sink.items == std::vector<int>({10, 11}));
+  values[2].resolve(12);
+  BOOST_TEST(sink.items == std::vector<int>({10, 11, 12}));
+  BOOST_TEST(sink.complete);
+}
+
+BOOST_AUTO_TEST_CASE(generate_cancel_while_awaiting) {
+  std::vector<deferred<int>> values(2);
+  manual_sink sink;
+  coroutines::generate([values]() { return await_all(values); })->subscribe(sink);
+  sink.src->request(10);
+  sink.src->cancel();
+  values[0].resolve(10);
+  BOOST_TEST(sink.items.empty());
+}
+
+BOOST_AUTO_TEST_CASE(deferred_coroutine) {
+  deferred<int> x;
+  deferred<int> result = twice(x);
+  BOOST_TEST(!result.resolved());
+  x.resolve(21);
+  BOOST_TEST(result.resolved());
+  int value = 0;
+  result.on([&value](error_or<int> v) { value = *v; });
+  BOOST_TEST(value == 42);
+
+  deferred<int> failed = twice(deferred<int>{stream_error::NOT_INITIALIZED});
+  BOOST_TEST(failed.resolved());
+  BOOST_TEST(!failed.ok());
+
+  deferred<void> v;
+  deferred<void> waited = wait(v);
+  BOOST_TEST(!waited.resolved());
+  v.resolve();
+  BOOST_TEST(waited.ok());
+}
@@ -0,0 +1,74 @@
+#define BOOST_TEST_MODULE CrossStreamBatcherTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <set>
+#include <thread>
+
+#include "bot_instance.h"
+#include "cross_stream_batcher.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+std::unique_ptr<sv::bot_instance> make_instance(const std::string &id) {
+  sv::multiframe_bot_descriptor descriptor;
+  descriptor.pixel_format = sv::image_pixel_format::RGB0;
+  return std::make_unique<sv::bot_instance>(id, sv::execution_mode::LIVE, descriptor);
+}
+
+sv::image_frame make_frame(int64_t i) {
+  sv::image_frame frame{};
+  frame.id = {i, i};
+  return frame;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(full_batch) {
+  std::vector<std::vector<sv::stream_frame>> batches;
+  sv::cross_stream_batcher batcher{
+      [&batches](const gsl::span<sv::stream_frame> &frames) {
+        batches.emplace_back(frames.begin(), frames.end());
+      },
+      4, std::chrono::hours{1}};
+
+  auto first = make_instance("first");
+  auto second = make_instance("second");
+  std::vector<sv::image_frame> first_frames{make_frame(1), make_frame(2)};
+  std::vector<sv::image_frame> second_frames{make_frame(3), make_frame(4)};
+
+  std::thread t{[&]() {
+    batcher.process(*first, gsl::span<sv::image_frame>(first_frames));
+  }};
+  // waits until the batch is filled by the second stream.
+  batcher.process(*second, gsl::span<sv::image_frame>(second_frames));
+  t.join();
+
+  BOOST_REQUIRE_EQUAL(1, batches.size());
+  BOOST_REQUIRE_EQUAL(4, batches[0].size());
+  std::set<sv::bot_context *> contexts;
+  for (const sv::stream_frame &f : batches[0]) {
+    contexts.insert(f.context);
+    BOOST_CHECK_EQUAL(f.frame.id.i1 <= 2 ? first.get() : second.get(), f.context);
+  }
+  BOOST_CHECK_EQUAL(2, contexts.size());
+}
+
+BOOST_AUTO_TEST_CASE(max_wait) {
+  std::vector<size_t> batches;
+  sv::cross_stream_batcher batcher{
+      [&batches](const gsl::span<sv::stream_frame> &frames) {
+        batches.push_back(frames.size());
+      },
+      16, std::chrono::milliseconds{10}};
+
+  auto instance = make_instance("bot");
+  std::vector<sv::image_frame> frames{make_frame(1)};
+  batcher.process(*instance, gsl::span<sv::image_frame>(frames));
+  batcher.process(*instance, gsl::span<sv::image_frame>(frames));
+
+  BOOST_REQUIRE_EQUAL(2, batches.size());
+  BOOST_CHECK_EQUAL(1, batches[0]);
+  BOOST_CHECK_EQUAL(1, batches[1]);
+}
@@ -74,4 +74,152 @@ BOOST_AUTO_TEST_CASE(parse_network_frame_b) {
   const sv::frame_id expected_id{0, 0};
   BOOST_CHECK_EQUAL(expected_id, f.id);
   BOOST_CHECK_EQUAL("dummy", f.base64_data);
-}
\ No newline at end of file
+}
+BOOST_AUTO_TEST_CASE(encoded_frame_to_network_binary) {
+  sv::encoded_frame f;
+  f.data = std::string(sv::max_payload_size * 2 + 10, '\xff');
+  f.id = {1, 2};
+
+  const auto frames = f.to_network(sv::payload_encoding::BINARY);
+  BOOST_TEST_REQUIRE(frames.size() == 3);
+  std::string data;
+  for (const auto& nf : frames) {
+    BOOST_TEST(nf.base64_data.empty());
+    BOOST_TEST(nf.binary_data.size() <= sv::max_payload_size);
+    data += nf.binary_data;
+  }
+  BOOST_TEST(data == f.data);
+}
+
+BOOST_AUTO_TEST_CASE(parse_network_frame_binary) {
+  sv::network_frame nf;
+  nf.binary_data = std::string{'\0', '\xff', 'c'};
+  nf.id = {3, 4};
+
+  const sv::network_frame f = sv::parse_network_frame(nf.to_json());
+  const sv::frame_id expected_id{3, 4};
+  BOOST_CHECK_EQUAL(expected_id, f.id);
+  BOOST_TEST(f.base64_data.empty());
+  BOOST_TEST(f.binary_data == nf.binary_data);
+}
+
+BOOST_AUTO_TEST_CASE(parse_network_metadata_binary) {
+  sv::encoded_metadata em;
+  em.codec_name = "dummy-codec";
+  em.codec_data = "dummy-codec-data";
+
+  const sv::network_metadata nm =
+      sv::parse_network_metadata(em.to_network(sv::payload_encoding::BINARY).to_json());
+  BOOST_CHECK_EQUAL("dummy-codec", nm.codec_name);
+  BOOST_CHECK_EQUAL("dummy-codec-data", nm.binary_data);
+  BOOST_TEST(nm.base64_data.empty());
+}
+
+BOOST_AUTO_TEST_CASE(parse_cbor_network_frame_test) {
+  const uint8_t data[]{
+      0b10100101 /* Major type 5, map with 5 entries */,
+      0b01100001 /* text of size 1 */,
+      'i',
+      0b10000010 /* array of size 2 */,
+      0b00000001,
+      0b00000010,
+      0b01100001 /* text of size 1 */,
+      'b',
+      0b01000010 /* bytestring of size 2 */,
+      0,
+      0xff,
+      0b01100001 /* text of size 1 */,
+      'c',
+      0b11111001 /* half float 2.0 */,
+      0x40,
+      0x00,
+      0b01100001 /* text of size 1 */,
+      'l',
+      0b00000011,
+      0b01100001 /* text of size 1 */,
+      'k',
+      0b11110101 /* true */,
+  };
+  const sv::network_frame f =
+      sv::parse_cbor_network_frame(std::string{data, data + sizeof(data)});
+  const sv::frame_id expected_id{1, 2};
+  BOOST_CHECK_EQUAL(expected_id, f.id);
+  BOOST_TEST(f.binary_data == std::string(data + 9, data + 11));
+  BOOST_TEST(f.base64_data.empty());
+  BOOST_TEST(f.chunk == 2);
+  BOOST_TEST(f.chunks == 3);
+  BOOST_TEST(f.key_frame);
+}
+
+BOOST_AUTO_TEST_CASE(parse_cbor_network_metadata_test) {
+  const uint8_t data[]{
+      0b10100011 /* Major type 5, map with 3 entries */,
+      0b01100001 /* text of size 1 */,
+      'x',
+      0b11110110 /* null */,
+      0b01101001 /* text of size 9 */,
+      'c',
+      'o',
+      'd',
+      'e',
+      'c',
+      'N',
+      'a',
+      'm',
+      'e',
+      0b01100001 /* text of size 1 */,
+      'v',
+      0b01101001 /* text of size 9 */,
+      'c',
+      'o',
+      'd',
+      'e',
+      'c',
+      'D',
+      'a',
+      't',
+      'a',
+      0b01100100 /* text of size 4 */,
+      'Y',
+      'W',
+      'I',
+      '=',
+  };
+  const sv::network_metadata nm =
+      sv::parse_cbor_network_metadata(std::string{data, data + sizeof(data)});
+  BOOST_CHECK_EQUAL("v", nm.codec_name);
+  BOOST_CHECK_EQUAL("YWI=", nm.base64_data);
+  BOOST_TEST(nm.binary_data.empty());
+}
+
+BOOST_AUTO_TEST_CASE(network_frame_to_json_move) {
+  sv::encoded_frame f;
+  f.data = std::string(100000, 'x');
+  f.key_frame = true;
+
+  for (auto& nf : f.to_network()) {
+    const nlohmann::json copied = nf.to_json();
+    nlohmann::json moved = std::move(nf).to_json();
+    moved.erase("dt");
+    BOOST_TEST(copied.at("b") == moved.at("b"));
+    BOOST_TEST(copied.at("c") == moved.at("c"));
+    BOOST_TEST(moved.at("k").get<bool>());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(shared_bytes_copies_share_data) {
+  sv::encoded_frame f;
+  f.data = std::string(1000, 'x');
+  const sv::encoded_packet packet{f};
+  const sv::encoded_packet copy = packet;
+
+  const auto& data = boost::get<sv::encoded_frame>(copy).data;
+  BOOST_TEST(static_cast<const void*>(data.data()) == f.data.data());
+  BOOST_TEST(data == f.data);
+  BOOST_TEST(data.str() == std::string(1000, 'x'));
+
+  const sv::shared_bytes empty;
+  BOOST_TEST(empty.empty());
+  BOOST_TEST(empty.str().empty());
+  BOOST_TEST(empty == sv::shared_bytes{std::string{}});
+}
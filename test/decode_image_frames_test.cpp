@@ -7,7 +7,9 @@
 #include "avutils.h"
 #include "base64.h"
 #include "data.h"
+#include "decoded_frame.h"
 #include "logging_impl.h"
+#include "shared_image_decoder.h"
 #include "video_streams.h"
 
 namespace sv = satori::video;
@@ -152,6 +154,44 @@ BOOST_AUTO_TEST_CASE(mjpeg) {
   run_decode_image_frames_test(test);
 }
 
+BOOST_AUTO_TEST_CASE(mjpeg_lowres) {
+  test_definition test;
+  test.metadata_filename = "";
+  test.frames_filename = "test_data/mjpeg_320x180.frame";
+  test.codec_name = "mjpeg";
+
+  sv::decoder_options options;
+  options.lowres_size = sv::image_size{100, 50};
+
+  std::vector<sv::image_size> decoded_sizes;
+  auto decoded = (test_stream(test) >> sv::decode_frames(options))
+                     ->process([&decoded_sizes](sv::decoded_frame &&f) {
+                       decoded_sizes.push_back({static_cast<int16_t>(f.frame->width),
+                                                static_cast<int16_t>(f.frame->height)});
+                     });
+  BOOST_TEST(decoded.ok());
+  BOOST_TEST(decoded_sizes.size() == 1);
+  // 80x45 would be smaller than requested size.
+  BOOST_TEST(decoded_sizes[0].width == 160);
+  BOOST_TEST(decoded_sizes[0].height == 90);
+
+  std::vector<sv::image_size> sizes;
+  auto scaled =
+      (test_stream(test)
+       >> sv::decode_image_frames({100, 50}, sv::image_pixel_format::RGB0, false))
+          ->process([&sizes](sv::owned_image_packet &&pkt) {
+            if (const sv::owned_image_frame *f =
+                    boost::get<sv::owned_image_frame>(&pkt)) {
+              sizes.push_back({static_cast<int16_t>(f->width),
+                               static_cast<int16_t>(f->height)});
+            }
+          });
+  BOOST_TEST(scaled.ok());
+  BOOST_TEST(sizes.size() == 1);
+  BOOST_TEST(sizes[0].width == 100);
+  BOOST_TEST(sizes[0].height == 50);
+}
+
 BOOST_AUTO_TEST_CASE(id_test) {
   LOG_SCOPE_FUNCTION(INFO);
 
@@ -177,6 +217,236 @@ BOOST_AUTO_TEST_CASE(id_test) {
   BOOST_TEST(ids[5] == id(6, 6));
 }
 
+BOOST_AUTO_TEST_CASE(planar_pixel_formats) {
+  test_definition test;
+  test.metadata_filename = "test_data/h264_320x180.metadata";
+  test.frames_filename = "test_data/h264_320x180.frame";
+  test.codec_name = "h264";
+
+  for (sv::image_pixel_format format :
+       {sv::image_pixel_format::GRAY8, sv::image_pixel_format::YUV420P,
+        sv::image_pixel_format::NV12}) {
+    for (sv::image_size size : {sv::image_size{-1, -1}, sv::image_size{160, 90}}) {
+      int frames_count{0};
+      auto when_done =
+          (test_stream(test) >> sv::decode_image_frames(size, format, true))
+              ->process([&frames_count, format](sv::owned_image_packet &&pkt) {
+                const auto &f = boost::get<sv::owned_image_frame>(pkt);
+                BOOST_TEST((f.pixel_format == format));
+                BOOST_TEST(f.plane_data[0].size() >= f.plane_strides[0] * f.height);
+                const int chroma_planes = format == sv::image_pixel_format::GRAY8
+                                              ? 0
+                                              : format == sv::image_pixel_format::NV12
+                                                    ? 1
+                                                    : 2;
+                for (int i = 1; i <= chroma_planes; i++) {
+                  BOOST_TEST(!f.plane_data[i].empty());
+                }
+                frames_count++;
+              });
+      BOOST_TEST(when_done.ok());
+      BOOST_TEST(frames_count == 6);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(restarted_stream_reuses_decoder) {
+  test_definition test;
+  test.metadata_filename = "test_data/h264_320x180.metadata";
+  test.frames_filename = "test_data/h264_320x180.frame";
+  test.codec_name = "h264";
+
+  // second stream gets decoder context and scaler flushed by the first one.
+  for (int i = 0; i < 2; i++) {
+    int frames_count{0};
+    auto when_done =
+        (test_stream(test)
+         >> sv::decode_image_frames({160, 90}, sv::image_pixel_format::BGR, true))
+            ->process([&frames_count](sv::owned_image_packet &&pkt) {
+              if (const sv::owned_image_frame *f =
+                      boost::get<sv::owned_image_frame>(&pkt)) {
+                BOOST_TEST(f->width == 160);
+                BOOST_TEST(f->height == 90);
+                frames_count++;
+              }
+            });
+    BOOST_TEST(when_done.ok());
+    BOOST_TEST(frames_count == 6);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(crop) {
+  test_definition test;
+  test.metadata_filename = "test_data/h264_320x180.metadata";
+  test.frames_filename = "test_data/h264_320x180.frame";
+  test.codec_name = "h264";
+
+  sv::decoder_options options;
+  options.crop = std::make_shared<sv::crop_region>();
+  options.crop->set(sv::image_region{100, 50, 200, 100});
+
+  std::vector<sv::image_size> sizes;
+  auto when_done =
+      (test_stream(test)
+       >> sv::decode_image_frames({-1, -1}, sv::image_pixel_format::RGB0, true, options))
+          ->process([&sizes, &options](sv::owned_image_packet &&pkt) {
+            if (const sv::owned_image_frame *f =
+                    boost::get<sv::owned_image_frame>(&pkt)) {
+              sizes.push_back({static_cast<int16_t>(f->width),
+                               static_cast<int16_t>(f->height)});
+              if (sizes.size() == 3) {
+                // exceeds frame, so is clamped to 20x130.
+                options.crop->set(sv::image_region{300, 50, 100, 200});
+              }
+            }
+          });
+  BOOST_TEST(when_done.ok());
+
+  BOOST_TEST(sizes.size() == 6);
+  for (size_t i = 0; i < sizes.size(); i++) {
+    BOOST_TEST(sizes[i].width == (i < 3 ? 200 : 20));
+    BOOST_TEST(sizes[i].height == (i < 3 ? 100 : 130));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(max_fps) {
+  test_definition test;
+  test.metadata_filename = "test_data/h264_320x180.metadata";
+  test.frames_filename = "test_data/h264_320x180.frame";
+  test.codec_name = "h264";
+
+  sv::decoder_options options;
+  // below half of input rate non-reference frames would not be decoded at all.
+  options.max_fps = 15;
+  int decimated{0};
+  options.on_decimated = [&decimated]() { decimated++; };
+
+  // 25 frames per second.
+  int n{0};
+  auto stream = test_stream(test) >> sv::streams::map([&n](sv::encoded_packet &&pkt) {
+                  if (auto *f = boost::get<sv::encoded_frame>(&pkt)) {
+                    f->timestamp = std::chrono::system_clock::time_point{
+                        std::chrono::milliseconds{40 * ++n}};
+                  }
+                  return std::move(pkt);
+                });
+
+  int frames_count{0};
+  auto when_done =
+      (std::move(stream)
+       >> sv::decode_image_frames({-1, -1}, sv::image_pixel_format::RGB0, true, options))
+          ->process([&frames_count](sv::owned_image_packet &&pkt) {
+            if (boost::get<sv::owned_image_frame>(&pkt) != nullptr) {
+              frames_count++;
+            }
+          });
+  BOOST_TEST(when_done.ok());
+
+  BOOST_TEST(frames_count < 6);
+  BOOST_TEST(frames_count + decimated == 6);
+}
+
+BOOST_AUTO_TEST_CASE(motion_vectors) {
+  test_definition test;
+  test.metadata_filename = "test_data/h264_320x180.metadata";
+  test.frames_filename = "test_data/h264_320x180.frame";
+  test.codec_name = "h264";
+
+  for (bool only : {false, true}) {
+    sv::decoder_options options;
+    options.export_motion_vectors = true;
+    options.motion_vectors_only = only;
+
+    int frames_count{0};
+    int frames_with_vectors{0};
+    auto frames = test_stream(test)
+                  >> sv::decode_image_frames({160, 90}, sv::image_pixel_format::BGR,
+                                             true, options);
+    auto when_done = frames->process([&frames_count, &frames_with_vectors,
+                                      only](sv::owned_image_packet &&pkt) {
+      const auto &f = boost::get<sv::owned_image_frame>(pkt);
+      // vectors are in decoded pixels, frames of vectors only are not scaled.
+      BOOST_TEST(f.width == (only ? 320 : 160));
+      BOOST_TEST(f.plane_data[0].empty() == only);
+      if (f.motion_vectors && !f.motion_vectors->empty()) {
+        frames_with_vectors++;
+        for (const sv::motion_vector &v : *f.motion_vectors) {
+          BOOST_TEST(v.source != 0);
+          BOOST_TEST(v.dst_x >= 0);
+          BOOST_TEST(v.dst_x < 320);
+        }
+      }
+      frames_count++;
+    });
+    BOOST_TEST(when_done.ok());
+    BOOST_TEST(frames_count == 6);
+    // the first frame is a key frame.
+    BOOST_TEST(frames_with_vectors > 0);
+    BOOST_TEST(frames_with_vectors < 6);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(shared_decoder_outputs) {
+  LOG_SCOPE_FUNCTION(INFO);
+
+  test_definition test;
+  test.metadata_filename = "test_data/h264_320x180.metadata";
+  test.frames_filename = "test_data/h264_320x180.frame";
+  test.codec_name = "h264";
+
+  boost::asio::io_service io;
+  int sources_count{0};
+  auto decoder = sv::shared_image_decoder::create(io, [&test, &sources_count]() {
+    sources_count++;
+    return test_stream(test);
+  });
+
+  struct output {
+    int frames_count{0};
+    int width{0};
+    int height{0};
+    sv::image_pixel_format pixel_format;
+  };
+  output original;
+  output small;
+  output small_too;
+
+  auto process = [&decoder](const sv::image_size &size, sv::image_pixel_format format,
+                            output &out) {
+    return decoder->subscribe(size, format, true)
+           ->process([&out](sv::owned_image_packet &&pkt) {
+             if (const sv::owned_image_frame *f =
+                     boost::get<sv::owned_image_frame>(&pkt)) {
+               out.frames_count++;
+               out.width = f->width;
+               out.height = f->height;
+               out.pixel_format = f->pixel_format;
+             }
+           });
+  };
+  auto original_done = process({-1, -1}, sv::image_pixel_format::BGR, original);
+  auto small_done = process({160, 160}, sv::image_pixel_format::RGB0, small);
+  auto small_too_done = process({160, 160}, sv::image_pixel_format::RGB0, small_too);
+  decoder.reset();
+  io.run();
+
+  BOOST_TEST(sources_count == 1);
+  BOOST_TEST(original_done.ok());
+  BOOST_TEST(small_done.ok());
+  BOOST_TEST(small_too_done.ok());
+
+  BOOST_TEST(original.frames_count == 6);
+  BOOST_TEST(original.width == 320);
+  BOOST_TEST(original.height == 180);
+  BOOST_TEST((original.pixel_format == sv::image_pixel_format::BGR));
+
+  BOOST_TEST(small.frames_count == 6);
+  BOOST_TEST(small.width == 160);
+  BOOST_TEST(small.height == 90);
+  BOOST_TEST((small.pixel_format == sv::image_pixel_format::RGB0));
+  BOOST_TEST(small_too.frames_count == 6);
+}
+
 int main(int argc, char *argv[]) {
   sv::init_logging(argc, argv);
   return boost::unit_test::unit_test_main(init_unit_test, argc, argv);
@@ -1,6 +1,11 @@
 #define BOOST_TEST_MODULE DeferredTest
 #include <boost/test/included/unit_test.hpp>
 
+#include <array>
+#include <memory>
+#include <thread>
+#include <vector>
+
 #include "streams/deferred.h"
 
 using namespace satori::video::streams;
@@ -301,3 +306,54 @@ BOOST_AUTO_TEST_CASE(deferred_then_void_error) {
   v.fail(stream_error::NOT_INITIALIZED);
   BOOST_TEST(value.find("not initialized") != std::string::npos);
 }
+
+BOOST_AUTO_TEST_CASE(deferred_released_on_other_thread) {
+  std::vector<deferred<int>> values(100);
+  int sum = 0;
+  for (auto &v : values) {
+    v.on([&sum](error_or<int> i1) { sum += *i1; });
+  }
+  std::thread resolver([values = std::move(values)]() mutable {
+    for (auto &v : values) {
+      v.resolve(1);
+    }
+    values.clear();
+  });
+  resolver.join();
+  BOOST_TEST(sum == 100);
+
+  // states released by the other thread went to its pool.
+  deferred<int> i;
+  i.resolve(1);
+  BOOST_TEST(i.resolved());
+}
+
+BOOST_AUTO_TEST_CASE(deferred_large_callback) {
+  deferred<int> i;
+  std::array<int64_t, 32> large{};
+  large[31] = 7;
+  int value = 0;
+  deferred<int> s = i.map([large](int i1) { return i1 + static_cast<int>(large[31]); });
+  s.on([&value](error_or<int> s1) { value = *s1; });
+  i.resolve(1);
+  BOOST_TEST(value == 8);
+}
+
+BOOST_AUTO_TEST_CASE(small_function_inline_and_heap) {
+  auto counter = std::make_shared<int>(0);
+  small_function<int(int), 32> small = [counter](int x) { return ++*counter + x; };
+  std::array<char, 64> padding{};
+  small_function<int(int), 32> large = [counter, padding](int x) {
+    return ++*counter + x + padding[0];
+  };
+  BOOST_TEST(counter.use_count() == 3);
+
+  small_function<int(int), 32> moved = std::move(small);
+  BOOST_TEST(!small);
+  BOOST_TEST(moved(10) == 11);
+  large = std::move(moved);
+  BOOST_TEST(large(10) == 12);
+  BOOST_TEST(counter.use_count() == 2);
+  large.reset();
+  BOOST_TEST(counter.use_count() == 1);
+}
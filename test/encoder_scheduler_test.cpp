@@ -0,0 +1,57 @@
+#define BOOST_TEST_MODULE EncoderSchedulerTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <chrono>
+#include <thread>
+
+#include "encoder_scheduler.h"
+#include "logging_impl.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+sv::streams::publisher<sv::owned_image_packet> frames(int count) {
+  return sv::streams::publishers::range(0, count) >> sv::streams::map([](int i) {
+           sv::owned_image_frame f;
+           f.id = {i, i};
+           return sv::owned_image_packet{f};
+         });
+}
+
+std::vector<int64_t> run(sv::streams::publisher<sv::owned_image_packet> &&p) {
+  std::vector<int64_t> ids;
+  auto when_done = p->process([&ids](sv::owned_image_packet &&pkt) {
+    ids.push_back(boost::get<sv::owned_image_frame>(pkt).id.i1);
+  });
+  while (!when_done.resolved()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  BOOST_TEST(when_done.ok());
+  return ids;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(channels_are_spread_over_slots) {
+  sv::encoder_scheduler scheduler{2};
+
+  auto p1 = frames(5) >> scheduler.schedule("a");
+  auto p2 = frames(5) >> scheduler.schedule("b");
+  auto p3 = frames(5) >> scheduler.schedule("c");
+  const std::vector<size_t> channels = scheduler.slot_channels();
+  BOOST_TEST(channels.size() == 2);
+  BOOST_TEST(std::max(channels[0], channels[1]) == 2);
+  BOOST_TEST(std::min(channels[0], channels[1]) == 1);
+
+  for (auto *p : {&p1, &p2, &p3}) {
+    BOOST_TEST(run(std::move(*p)) == std::vector<int64_t>({0, 1, 2, 3, 4}));
+  }
+  // finished channels leave their slots.
+  BOOST_TEST(scheduler.slot_channels() == std::vector<size_t>({0, 0}));
+}
+
+BOOST_AUTO_TEST_CASE(encoder_threads) {
+  sv::encoder_scheduler scheduler{std::max(1u, std::thread::hardware_concurrency())};
+  BOOST_TEST(scheduler.encoder_threads() == 1);
+}
@@ -1,6 +1,7 @@
 #define BOOST_TEST_MODULE EncodingTest
 #include <boost/test/included/unit_test.hpp>
 #include <gsl/gsl>
+#include <random>
 
 #include "base64.h"
 
@@ -37,3 +38,66 @@ BOOST_AUTO_TEST_CASE(base64_encode_decode) {
   BOOST_CHECK_EQUAL("abcde", sv::base64::decode(sv::base64::encode("abcde")).get());
   BOOST_CHECK_EQUAL("abcdef", sv::base64::decode(sv::base64::encode("abcdef")).get());
 }
+
+namespace {
+
+// straightforward implementation to compare against.
+std::string reference_encode(const std::string &s) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string result;
+  for (size_t i = 0; i < s.size(); i += 3) {
+    uint32_t v = static_cast<uint8_t>(s[i]) << 16;
+    if (i + 1 < s.size()) v |= static_cast<uint8_t>(s[i + 1]) << 8;
+    if (i + 2 < s.size()) v |= static_cast<uint8_t>(s[i + 2]);
+    result += alphabet[(v >> 18) & 0x3f];
+    result += alphabet[(v >> 12) & 0x3f];
+    result += i + 1 < s.size() ? alphabet[(v >> 6) & 0x3f] : '=';
+    result += i + 2 < s.size() ? alphabet[v & 0x3f] : '=';
+  }
+  return result;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(base64_random) {
+  std::mt19937 gen{42};
+  std::uniform_int_distribution<int> byte{0, 255};
+  for (size_t size = 0; size < 300; size++) {
+    std::string s;
+    for (size_t i = 0; i < size; i++) {
+      s += static_cast<char>(byte(gen));
+    }
+    const std::string encoded = sv::base64::encode(s);
+    BOOST_CHECK_EQUAL(reference_encode(s), encoded);
+    const auto decoded = sv::base64::decode(encoded);
+    BOOST_REQUIRE(decoded.ok());
+    BOOST_CHECK(s == decoded.get());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(base64_decode_invalid_char) {
+  const std::string encoded = sv::base64::encode(std::string(200, 'x'));
+  for (size_t pos = 0; pos < encoded.size() - 2; pos++) {
+    for (char c : {'*', '-', '_', ' ', '\n', '\x80', '\xff', '=', '\0'}) {
+      std::string bad = encoded;
+      bad[pos] = c;
+      BOOST_CHECK(!sv::base64::decode(bad).ok());
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(base64_decode_unpadded) {
+  BOOST_CHECK_EQUAL("a", sv::base64::decode("YQ").get());
+  BOOST_CHECK_EQUAL("ab", sv::base64::decode("YWI").get());
+  BOOST_CHECK(!sv::base64::decode("YWJjZ").ok());
+}
+
+BOOST_AUTO_TEST_CASE(base64_decode_buffer) {
+  const std::string encoded = sv::base64::encode("abcdef");
+  std::string out(sv::base64::decoded_max_size(encoded.size()), '\0');
+  const auto size = sv::base64::decode(encoded.data(), encoded.size(), &out[0]);
+  BOOST_REQUIRE(size.ok());
+  BOOST_CHECK_EQUAL(6, size.get());
+  BOOST_CHECK_EQUAL("abcdef", out.substr(0, size.get()));
+}
@@ -35,6 +35,82 @@ BOOST_AUTO_TEST_CASE(test_frame_ids) {
   BOOST_TEST(ids[5] == id(6, 6));
 }
 
+BOOST_AUTO_TEST_CASE(read_ahead) {
+  boost::asio::io_service io;
+
+  // tiny budget makes demux thread wait for consumer after every packet.
+  for (size_t read_ahead_bytes : {size_t{1}, default_read_ahead_bytes}) {
+    size_t metadata_count = 0;
+    std::vector<frame_id> ids;
+    auto when_done =
+        file_source(io, "test_data/test.mp4", false, true, read_ahead_bytes)
+            ->process([&metadata_count, &ids](encoded_packet &&pkt) {
+              if (const encoded_frame *f = boost::get<encoded_frame>(&pkt)) {
+                ids.push_back(f->id);
+              } else {
+                metadata_count++;
+              }
+            });
+    BOOST_TEST(when_done.ok());
+
+    BOOST_TEST(metadata_count == 1);
+    BOOST_TEST(ids.size() == 6);
+    for (size_t i = 0; i < ids.size(); i++) {
+      BOOST_TEST(ids[i] == id(i + 1, i + 1));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(segment) {
+  boost::asio::io_service io;
+  file_segment segment;
+  segment.first_frame = 3;
+  segment.last_frame = 5;
+
+  std::vector<frame_id> ids;
+  auto when_done = file_source(io, "test_data/test.mp4", false, true, 0, segment)
+                       ->process([&ids](encoded_packet &&pkt) {
+                         if (const encoded_frame *f = boost::get<encoded_frame>(&pkt)) {
+                           ids.push_back(f->id);
+                         }
+                       });
+  BOOST_TEST(when_done.ok());
+
+  // decoding starts from a key frame, which may be in front of the segment.
+  BOOST_TEST(!ids.empty());
+  BOOST_TEST(ids.front().i1 <= 3);
+  BOOST_TEST(ids.back() == id(5, 5));
+  for (size_t i = 1; i < ids.size(); i++) {
+    BOOST_TEST(ids[i].i1 == ids[i - 1].i1 + 1);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(file_ranges) {
+  const std::vector<file_range> ranges = split_by_key_frames("test_data/test.mp4", 3);
+  BOOST_TEST(!ranges.empty());
+  BOOST_TEST(ranges.size() <= 3);
+
+  // ranges cover all frames one after another and keep their ids.
+  int64_t next_frame = 1;
+  for (const file_range &range : ranges) {
+    BOOST_TEST(range.first_frame == next_frame);
+    std::vector<frame_id> ids;
+    auto when_done = file_range_source("test_data/test.mp4", range)
+                         ->process([&ids](encoded_packet &&pkt) {
+                           if (const encoded_frame *f = boost::get<encoded_frame>(&pkt)) {
+                             ids.push_back(f->id);
+                           }
+                         });
+    BOOST_TEST(when_done.ok());
+    BOOST_TEST(static_cast<int64_t>(ids.size()) == range.frames);
+    for (const frame_id &i : ids) {
+      BOOST_TEST(i == id(next_frame, next_frame));
+      next_frame++;
+    }
+  }
+  BOOST_TEST(next_frame == 7);
+}
+
 BOOST_AUTO_TEST_CASE(test_repeat_metadata) {
   boost::asio::io_service io;
   size_t metadata_count = 0;
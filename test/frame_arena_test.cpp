@@ -0,0 +1,65 @@
+#define BOOST_TEST_MODULE FrameArenaTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <cstring>
+
+#include "frame_arena.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+constexpr size_t page = sv::frame_arena::page_size;
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(buffers_take_whole_pages) {
+  auto arena = sv::frame_arena::create(3 * page + 1);
+  BOOST_REQUIRE(arena);
+  BOOST_CHECK_EQUAL(4 * page, arena->size());
+
+  uint8_t *a = arena->allocate(page + 1);
+  BOOST_REQUIRE(a != nullptr);
+  BOOST_CHECK_EQUAL(0u, reinterpret_cast<uintptr_t>(a) % page);
+  BOOST_CHECK_EQUAL(2 * page, arena->used());
+  std::memset(a, 1, page + 1);
+
+  uint8_t *b = arena->allocate(page);
+  BOOST_REQUIRE(b != nullptr);
+  BOOST_CHECK_EQUAL(3 * page, arena->used());
+  BOOST_CHECK(arena->allocate(2 * page) == nullptr);
+
+  BOOST_CHECK(arena->free(a));
+  BOOST_CHECK_EQUAL(page, arena->used());
+  // freed pages are reused.
+  BOOST_CHECK_EQUAL(a, arena->allocate(2 * page));
+
+  uint8_t outside = 0;
+  BOOST_CHECK(!arena->free(&outside));
+}
+
+BOOST_AUTO_TEST_CASE(fragmented_arena) {
+  auto arena = sv::frame_arena::create(3 * page);
+  BOOST_REQUIRE(arena);
+  uint8_t *a = arena->allocate(page);
+  uint8_t *b = arena->allocate(page);
+  uint8_t *c = arena->allocate(page);
+  BOOST_REQUIRE(a != nullptr && b != nullptr && c != nullptr);
+  arena->free(a);
+  arena->free(c);
+  // two free pages, but not adjacent ones.
+  BOOST_CHECK(arena->allocate(2 * page) == nullptr);
+  arena->free(b);
+  BOOST_CHECK_EQUAL(a, arena->allocate(3 * page));
+}
+
+BOOST_AUTO_TEST_CASE(small_buffers_stay_in_heap) {
+  sv::init_frame_arena(4 * page);
+  BOOST_CHECK(sv::allocate_arena_frame_buffer(1000) == nullptr);
+  uint8_t *buffer = sv::allocate_arena_frame_buffer(1920 * 1080 * 3);
+  BOOST_REQUIRE(buffer != nullptr);
+  BOOST_CHECK(sv::free_arena_frame_buffer(buffer));
+
+  uint8_t heap = 0;
+  BOOST_CHECK(!sv::free_arena_frame_buffer(&heap));
+}
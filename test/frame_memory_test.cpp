@@ -0,0 +1,68 @@
+#define BOOST_TEST_MODULE FrameMemoryTest
+#include <boost/test/included/unit_test.hpp>
+
+#include "frame_memory.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+sv::owned_image_frame frame(size_t size) {
+  sv::owned_image_frame f;
+  f.plane_data[0] = std::string(size, 'x');
+  return f;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(released_with_last_reference) {
+  auto budget = std::make_shared<sv::frame_memory_budget>(0);
+  sv::frame_memory_account account(budget, "test");
+
+  auto f = frame(100);
+  const uint8_t *data = f.plane_data[0].data();
+  BOOST_CHECK(account.charge(f));
+  BOOST_CHECK_EQUAL(data, f.plane_data[0].data());
+  BOOST_CHECK_EQUAL(100u, f.plane_data[0].size());
+  BOOST_CHECK_EQUAL(100u, account.used());
+  BOOST_CHECK_EQUAL(100u, budget->used());
+
+  auto copy = f;
+  f = sv::owned_image_frame{};
+  BOOST_CHECK_EQUAL(100u, budget->used());
+  BOOST_CHECK_EQUAL('x', copy.plane_data[0][99]);
+
+  copy = sv::owned_image_frame{};
+  BOOST_CHECK_EQUAL(0u, account.used());
+  BOOST_CHECK_EQUAL(0u, budget->used());
+}
+
+BOOST_AUTO_TEST_CASE(shared_budget) {
+  auto budget = std::make_shared<sv::frame_memory_budget>(250);
+  sv::frame_memory_account first(budget, "first");
+  sv::frame_memory_account second(budget, "second");
+
+  auto f1 = frame(100);
+  auto f2 = frame(100);
+  auto f3 = frame(100);
+  BOOST_CHECK(first.charge(f1));
+  BOOST_CHECK(second.charge(f2));
+  BOOST_CHECK(!second.charge(f3));
+  BOOST_CHECK_EQUAL(100u, second.used());
+  BOOST_CHECK_EQUAL(200u, budget->used());
+
+  f1 = sv::owned_image_frame{};
+  BOOST_CHECK(second.charge(f3));
+  BOOST_CHECK_EQUAL(0u, first.used());
+  BOOST_CHECK_EQUAL(200u, second.used());
+}
+
+BOOST_AUTO_TEST_CASE(device_frames_are_not_charged) {
+  auto budget = std::make_shared<sv::frame_memory_budget>(10);
+  sv::frame_memory_account account(budget, "test");
+
+  auto f = frame(100);
+  f.on_device = true;
+  BOOST_CHECK(account.charge(f));
+  BOOST_CHECK_EQUAL(0u, budget->used());
+}
@@ -0,0 +1,91 @@
+#define BOOST_TEST_MODULE FrameTraceTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <vector>
+
+#include "frame_trace.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+using steady = sv::frame_tracer::clock;
+
+struct collecting_observer : sv::streams::observer<nlohmann::json> {
+  void on_next(nlohmann::json &&t) override { traces.push_back(std::move(t)); }
+  void on_error(std::error_condition) override {}
+  void on_complete() override {}
+
+  std::vector<nlohmann::json> traces;
+};
+
+sv::frame_id frame(int64_t i) { return sv::frame_id{i, i}; }
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(sampling) {
+  sv::frame_tracer tracer{"input", 10};
+  BOOST_CHECK(tracer.sampled(frame(0)));
+  BOOST_CHECK(!tracer.sampled(frame(5)));
+  BOOST_CHECK(tracer.sampled(frame(20)));
+}
+
+BOOST_AUTO_TEST_CASE(published_trace) {
+  collecting_observer dump;
+  sv::frame_tracer tracer{"input", 1, &dump};
+  const steady::time_point t0 = steady::now();
+
+  tracer.record(frame(1), sv::frame_stage::REASSEMBLED, t0);
+  tracer.record(frame(1), sv::frame_stage::DECODED, t0 + std::chrono::milliseconds{5});
+  tracer.record(frame(1), sv::frame_stage::DEQUEUED, t0 + std::chrono::milliseconds{7});
+  tracer.record(frame(1), sv::frame_stage::PROCESSED,
+                t0 + std::chrono::milliseconds{17});
+  BOOST_CHECK(dump.traces.empty());
+
+  tracer.record(frame(1), sv::frame_stage::PUBLISHED, t0 + std::chrono::milliseconds{20});
+  BOOST_REQUIRE_EQUAL(1u, dump.traces.size());
+  BOOST_CHECK_EQUAL("input", dump.traces[0]["input"]);
+  BOOST_CHECK_EQUAL(nlohmann::json({1, 1}), dump.traces[0]["i"]);
+  const nlohmann::json &stages = dump.traces[0]["stages"];
+  BOOST_CHECK_EQUAL(0.0, stages["reassembled"].get<double>());
+  BOOST_CHECK_EQUAL(5.0, stages["decoded"].get<double>());
+  BOOST_CHECK_EQUAL(7.0, stages["dequeued"].get<double>());
+  BOOST_CHECK_EQUAL(17.0, stages["processed"].get<double>());
+  BOOST_CHECK_EQUAL(20.0, stages["published"].get<double>());
+
+  // published twice, trace is already finished.
+  tracer.record(frame(1), sv::frame_stage::PUBLISHED, t0 + std::chrono::milliseconds{30});
+  BOOST_CHECK_EQUAL(1u, dump.traces.size());
+}
+
+BOOST_AUTO_TEST_CASE(unpublished_trace) {
+  collecting_observer dump;
+  sv::frame_tracer tracer{"input", 1, &dump};
+  const steady::time_point t0 = steady::now();
+
+  tracer.record(frame(1), sv::frame_stage::REASSEMBLED, t0);
+  tracer.record(frame(2), sv::frame_stage::REASSEMBLED, t0);
+  tracer.record(frame(1), sv::frame_stage::PROCESSED, t0 + std::chrono::milliseconds{3});
+  BOOST_CHECK(dump.traces.empty());
+
+  // frame 1 had no messages.
+  tracer.record(frame(2), sv::frame_stage::PROCESSED, t0 + std::chrono::milliseconds{4});
+  BOOST_REQUIRE_EQUAL(1u, dump.traces.size());
+  BOOST_CHECK_EQUAL(nlohmann::json({1, 1}), dump.traces[0]["i"]);
+  BOOST_CHECK(dump.traces[0]["stages"].find("published")
+              == dump.traces[0]["stages"].end());
+
+  tracer.flush();
+  BOOST_REQUIRE_EQUAL(2u, dump.traces.size());
+  BOOST_CHECK_EQUAL(nlohmann::json({2, 2}), dump.traces[1]["i"]);
+}
+
+BOOST_AUTO_TEST_CASE(not_reassembled) {
+  collecting_observer dump;
+  {
+    sv::frame_tracer tracer{"input", 1, &dump};
+    tracer.record(frame(3), sv::frame_stage::DECODED);
+    tracer.record(frame(3), sv::frame_stage::PUBLISHED);
+  }
+  BOOST_CHECK(dump.traces.empty());
+}
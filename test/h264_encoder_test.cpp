@@ -0,0 +1,73 @@
+#define BOOST_TEST_MODULE H264EncoderTest
+#include <boost/test/included/unit_test.hpp>
+
+#include "avutils.h"
+#include "h264_encoder.h"
+#include "logging.h"
+#include "video_streams.h"
+
+using namespace satori::video;
+
+namespace {
+
+streams::publisher<owned_image_packet> test_frames(int count) {
+  return streams::publishers::range(0, count) >> streams::map([](int i) {
+           owned_image_frame f;
+           f.id = {i, i};
+           f.pixel_format = image_pixel_format::BGR;
+           f.width = 64;
+           f.height = 48;
+           f.plane_data[0] = std::string(64 * 48 * 3, static_cast<char>(i * 10));
+           f.plane_strides[0] = 64 * 3;
+           return owned_image_packet{f};
+         });
+}
+
+bool h264_encoder_available() {
+  avutils::init();
+  return avcodec_find_encoder(AV_CODEC_ID_H264) != nullptr;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(h264_encoder_roundtrip) {
+  if (!h264_encoder_available()) {
+    LOG(WARNING) << "h264 encoder is not available, skipping";
+    return;
+  }
+
+  h264_encoder_profile profile = h264_encoder_profile::realtime();
+  profile.keyint = 5;
+
+  int metadata_count{0};
+  int key_frames_count{0};
+  std::vector<frame_id> decoded_ids;
+  auto when_done =
+      (test_frames(20) >> encode_h264(profile) >> streams::map([&](encoded_packet &&p) {
+         if (const encoded_metadata *m = boost::get<encoded_metadata>(&p)) {
+           BOOST_TEST(m->codec_name == "h264");
+           BOOST_TEST(m->codec_data.size() > 0);
+           metadata_count++;
+         } else if (const encoded_frame *f = boost::get<encoded_frame>(&p)) {
+           key_frames_count += f->key_frame ? 1 : 0;
+         }
+         return std::move(p);
+       })
+       >> decode_image_frames({-1, -1}, image_pixel_format::BGR, true))
+          ->process([&decoded_ids](owned_image_packet &&pkt) {
+            if (const owned_image_frame *f = boost::get<owned_image_frame>(&pkt)) {
+              BOOST_TEST(f->width == 64);
+              BOOST_TEST(f->height == 48);
+              decoded_ids.push_back(f->id);
+            }
+          });
+  BOOST_TEST(when_done.ok());
+
+  BOOST_TEST(metadata_count == 1);
+  BOOST_TEST(key_frames_count >= 4);
+  // zerolatency doesn't hold frames back, so all of them are encoded in order.
+  BOOST_TEST(decoded_ids.size() == 20);
+  for (size_t i = 0; i < decoded_ids.size(); i++) {
+    BOOST_TEST(decoded_ids[i].i1 == static_cast<int64_t>(i));
+  }
+}
@@ -276,6 +276,52 @@ BOOST_AUTO_TEST_CASE(bytestring_test) {
   BOOST_CHECK_EQUAL(expected, sv::json_to_cbor({{"b", value}}));
 }
 
+BOOST_AUTO_TEST_CASE(unpadded_bytestring_test) {
+  const uint8_t data[]{
+      0b10100001 /* Major type 5, value 4 = map with 1 entry */,
+      0b01101001 /* string of size 9 */,
+      'c',
+      'o',
+      'd',
+      'e',
+      'c',
+      'D',
+      'a',
+      't',
+      'a',
+      0b01000010 /* Major type 2, definite-length bytestring of size 2 */,
+      'a',
+      'b',
+  };
+  const std::string expected{data, data + sizeof(data)};
+  BOOST_CHECK_EQUAL(expected, sv::json_to_cbor({{"codecData", "YWI"}}));
+}
+
+BOOST_AUTO_TEST_CASE(append_test) {
+  std::string buffer{"abc"};
+  sv::json_to_cbor(nullptr, buffer);
+  sv::json_to_cbor(true, buffer);
+  BOOST_CHECK_EQUAL("abc\xf6\xf5", buffer);
+}
+
+BOOST_AUTO_TEST_CASE(binary_key_test) {
+  const uint8_t data[]{
+      0b10100001 /* Major type 5, value 4 = map with 1 entry */,
+      0b01100011 /* string of size 3 */,
+      'r',
+      'a',
+      'w',
+      0b01000011 /* Major type 2, definite-length bytestring of size 3 */,
+      0,
+      0xff,
+      'c',
+  };
+  const std::string expected{data, data + sizeof(data)};
+  const std::string key = std::string{"raw"} + sv::binary_key_suffix;
+  const std::string value{'\0', '\xff', 'c'};
+  BOOST_CHECK_EQUAL(expected, sv::json_to_cbor({{key, value}}));
+}
+
 BOOST_AUTO_TEST_CASE(string_test) {
   const uint8_t data[]{
       0b01100100 /* Major type 3, definite-length string of size 4 */, 'a', 'b', 'c', 'd',
@@ -322,4 +368,32 @@ BOOST_AUTO_TEST_CASE(object_test) {
   BOOST_CHECK_EQUAL(
       expected,
       sv::json_to_cbor({{"b", true}, {"l", {0, 1}}, {"n", nullptr}, {"s", "ab"}}));
-}
\ No newline at end of file
+}
+BOOST_AUTO_TEST_CASE(encoded_map_test) {
+  const std::string encoded = sv::json_to_cbor({{"a", 1}, {"l", {0, 1}}});
+  const nlohmann::json document = {{sv::encoded_map_key, encoded}, {"i", {5, 6}}};
+
+  const auto decoded = sv::cbor_to_json(sv::json_to_cbor(document));
+  BOOST_REQUIRE(decoded.ok());
+  BOOST_CHECK_EQUAL(nlohmann::json({{"a", 1}, {"i", {5, 6}}, {"l", {0, 1}}}),
+                    decoded.get());
+
+  nlohmann::json expanded = nlohmann::json::array({document});
+  sv::decode_encoded_maps(expanded);
+  BOOST_CHECK_EQUAL(nlohmann::json::array({decoded.get()}), expanded);
+}
+
+BOOST_AUTO_TEST_CASE(cbor_map_head_test) {
+  BOOST_CHECK(!sv::cbor_map_head(""));
+  BOOST_CHECK(!sv::cbor_map_head(sv::json_to_cbor({1, 2})));
+  BOOST_CHECK(!sv::cbor_map_head(std::string{'\xbf'}));
+
+  nlohmann::json large = nlohmann::json::object();
+  for (int i = 0; i < 300; i++) {
+    large[std::to_string(i)] = i;
+  }
+  const auto head = sv::cbor_map_head(sv::json_to_cbor(large));
+  BOOST_REQUIRE(head);
+  BOOST_CHECK_EQUAL(300, head->first);
+  BOOST_CHECK_EQUAL(3, head->second);
+}
@@ -0,0 +1,71 @@
+#define BOOST_TEST_MODULE LoadModelTest
+#include <boost/test/included/unit_test.hpp>
+
+#include "load_model.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+using steady = std::chrono::steady_clock;
+
+sv::load_sample cpu_sample(double cpu_seconds) {
+  sv::load_sample sample;
+  sample.cpu_seconds = cpu_seconds;
+  return sample;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(idle_process_has_all_slots) {
+  sv::load_model model{10, 4};
+  const auto start = steady::now();
+
+  BOOST_CHECK_EQUAL(10, model.update(cpu_sample(0), start, 0));
+  BOOST_CHECK_EQUAL(8, model.update(cpu_sample(0), start + std::chrono::seconds{1}, 2));
+}
+
+BOOST_AUTO_TEST_CASE(heavy_jobs_take_more_capacity) {
+  sv::load_model model{10, 1, 0.8};
+  auto now = steady::now();
+  double cpu = 0;
+  model.update(cpu_sample(cpu), now, 2);
+
+  // two jobs keep the only core 40% busy, so each of them takes 20%.
+  for (int i = 0; i < 50; i++) {
+    now += std::chrono::seconds{1};
+    cpu += 0.4;
+    model.update(cpu_sample(cpu), now, 2);
+  }
+  BOOST_CHECK_CLOSE(0.4, model.utilization(), 1);
+
+  now += std::chrono::seconds{1};
+  cpu += 0.4;
+  BOOST_CHECK_CLOSE(2, model.update(cpu_sample(cpu), now, 2), 1);
+}
+
+BOOST_AUTO_TEST_CASE(queued_frames_leave_no_capacity) {
+  sv::load_model model{10, 4};
+  const auto start = steady::now();
+  model.update(cpu_sample(0), start, 2);
+
+  sv::load_sample sample = cpu_sample(0.1);
+  sample.queued_frames = 5;
+  BOOST_CHECK_EQUAL(0, model.update(sample, start + std::chrono::seconds{1}, 2));
+}
+
+BOOST_AUTO_TEST_CASE(processing_time_counts_when_above_cpu) {
+  sv::load_model model{10, 1, 0.8};
+  auto now = steady::now();
+  model.update(sv::load_sample{}, now, 1);
+
+  // bot waiting for accelerator uses little CPU, but keeps processing thread busy.
+  sv::load_sample sample;
+  for (int i = 1; i <= 50; i++) {
+    now += std::chrono::seconds{1};
+    sample.cpu_seconds = 0.05 * i;
+    sample.processing_seconds = 0.4 * i;
+    model.update(sample, now, 1);
+  }
+  BOOST_CHECK_CLOSE(0.4, model.utilization(), 1);
+}
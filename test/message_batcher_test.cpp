@@ -0,0 +1,81 @@
+#define BOOST_TEST_MODULE MessageBatcherTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <vector>
+
+#include "message_batcher.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+struct collecting_observer : sv::streams::observer<nlohmann::json> {
+  void on_next(nlohmann::json &&t) override { messages.push_back(std::move(t)); }
+  void on_error(std::error_condition) override {}
+  void on_complete() override { complete = true; }
+
+  std::vector<nlohmann::json> messages;
+  bool complete{false};
+};
+
+nlohmann::json message(int frame, int value) {
+  return {{"i", {frame, frame}}, {"value", value}};
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(per_frame) {
+  boost::asio::io_service io;
+  collecting_observer downstream;
+  auto &sink = sv::batching_sink(downstream, io);
+
+  sink.on_next(message(1, 1));
+  sink.on_next(message(1, 2));
+  sink.on_next(message(2, 3));
+  BOOST_REQUIRE_EQUAL(1u, downstream.messages.size());
+  BOOST_CHECK_EQUAL(nlohmann::json({message(1, 1), message(1, 2)}),
+                    downstream.messages[0]);
+
+  sink.on_complete();
+  BOOST_REQUIRE_EQUAL(2u, downstream.messages.size());
+  BOOST_CHECK_EQUAL(nlohmann::json({message(2, 3)}), downstream.messages[1]);
+  BOOST_CHECK(downstream.complete);
+}
+
+BOOST_AUTO_TEST_CASE(window) {
+  boost::asio::io_service io;
+  collecting_observer downstream;
+  sv::message_batch_options options;
+  options.per_frame = false;
+  options.window = std::chrono::milliseconds{10};
+  auto &sink = sv::batching_sink(downstream, io, options);
+
+  sink.on_next(message(1, 1));
+  sink.on_next(message(2, 2));
+  BOOST_CHECK(downstream.messages.empty());
+
+  io.run();
+  BOOST_REQUIRE_EQUAL(1u, downstream.messages.size());
+  BOOST_CHECK_EQUAL(nlohmann::json({message(1, 1), message(2, 2)}),
+                    downstream.messages[0]);
+
+  sink.on_complete();
+  BOOST_CHECK_EQUAL(1u, downstream.messages.size());
+}
+
+BOOST_AUTO_TEST_CASE(max_messages) {
+  boost::asio::io_service io;
+  collecting_observer downstream;
+  sv::message_batch_options options;
+  options.max_messages = 2;
+  auto &sink = sv::batching_sink(downstream, io, options);
+
+  for (int i = 0; i < 5; i++) {
+    sink.on_next(message(1, i));
+  }
+  BOOST_CHECK_EQUAL(2u, downstream.messages.size());
+
+  sink.on_complete();
+  BOOST_REQUIRE_EQUAL(3u, downstream.messages.size());
+  BOOST_CHECK_EQUAL(1u, downstream.messages[2].size());
+}
@@ -0,0 +1,88 @@
+#define BOOST_TEST_MODULE MetricsDeltaTest
+#include <boost/test/included/unit_test.hpp>
+
+#include "cbor_json.h"
+#include "metrics_delta.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+prometheus::MetricFamily counter_family(double a, double b) {
+  prometheus::MetricFamily family;
+  family.name = "frames_total";
+  family.type = prometheus::MetricType::Counter;
+  family.metric.resize(2);
+  family.metric[0].label = {{"id", "a"}};
+  family.metric[0].counter.value = a;
+  family.metric[1].label = {{"id", "b"}};
+  family.metric[1].counter.value = b;
+  return family;
+}
+
+prometheus::MetricFamily histogram_family(uint64_t count) {
+  prometheus::MetricFamily family;
+  family.name = "latency";
+  family.type = prometheus::MetricType::Histogram;
+  family.metric.resize(1);
+  auto &histogram = family.metric[0].histogram;
+  histogram.sample_count = count;
+  histogram.sample_sum = 1.5 * count;
+  histogram.bucket.resize(2);
+  histogram.bucket[0].upper_bound = 1;
+  histogram.bucket[0].cumulative_count = count / 2;
+  histogram.bucket[1].upper_bound = 10;
+  histogram.bucket[1].cumulative_count = count;
+  return family;
+}
+
+nlohmann::json encode(sv::metrics_delta_encoder &encoder,
+                      const std::vector<prometheus::MetricFamily> &families) {
+  std::string data;
+  encoder.encode(families, data);
+  auto decoded = sv::cbor_to_json(data);
+  BOOST_REQUIRE(decoded.ok());
+  return decoded.get();
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(full_snapshot) {
+  sv::metrics_delta_encoder encoder{10};
+  const nlohmann::json snapshot =
+      encode(encoder, {counter_family(1, 2), histogram_family(4)});
+
+  BOOST_CHECK_EQUAL(0, snapshot["seq"]);
+  BOOST_CHECK(snapshot["full"].get<bool>());
+  BOOST_CHECK_EQUAL(R"(["frames_total","id","a","b","latency"])",
+                    snapshot["names"].dump());
+  BOOST_CHECK_EQUAL(R"([[0,0,"counter",[1,2],[]],[1,0,"counter",[1,3],[]],)"
+                    R"([2,4,"histogram",[],[1,10]]])",
+                    snapshot["series"].dump());
+  BOOST_CHECK_EQUAL("[[0,1],[1,2],[2,4,6,2,4]]", snapshot["values"].dump());
+}
+
+BOOST_AUTO_TEST_CASE(only_changed_series) {
+  sv::metrics_delta_encoder encoder{3};
+  encode(encoder, {counter_family(1, 2), histogram_family(4)});
+
+  nlohmann::json delta = encode(encoder, {counter_family(1, 5), histogram_family(4)});
+  BOOST_CHECK_EQUAL(1, delta["seq"]);
+  BOOST_CHECK(!delta["full"].get<bool>());
+  BOOST_CHECK(delta["names"].empty());
+  BOOST_CHECK(delta["series"].empty());
+  BOOST_CHECK_EQUAL("[[1,5]]", delta["values"].dump());
+
+  // new label value is interned after the names sent before.
+  prometheus::MetricFamily counters = counter_family(1, 5);
+  counters.metric[0].label[0].value = "c";
+  delta = encode(encoder, {counters, histogram_family(4)});
+  BOOST_CHECK_EQUAL(R"(["c"])", delta["names"].dump());
+  BOOST_CHECK_EQUAL(R"([[3,0,"counter",[1,5],[]]])", delta["series"].dump());
+  BOOST_CHECK_EQUAL("[[3,1]]", delta["values"].dump());
+
+  const nlohmann::json snapshot = encode(encoder, {counters, histogram_family(4)});
+  BOOST_CHECK(snapshot["full"].get<bool>());
+  BOOST_CHECK_EQUAL(3, snapshot["series"].size());
+  BOOST_CHECK_EQUAL(3, snapshot["values"].size());
+}
@@ -0,0 +1,54 @@
+#define BOOST_TEST_MODULE MetricsTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+auto &test_family = prometheus::BuildCounter()
+                         .Name("sharded_counter_test")
+                         .Register(sv::metrics_registry());
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(sharded_counter_flush) {
+  prometheus::Counter &counter = test_family.Add({{"case", "flush"}});
+  sv::sharded_counter sharded{counter};
+
+  sharded.increment();
+  sharded.increment(10);
+  BOOST_CHECK_EQUAL(0, counter.Value());
+
+  sv::flush_sharded_counters();
+  BOOST_CHECK_EQUAL(11, counter.Value());
+
+  sv::flush_sharded_counters();
+  BOOST_CHECK_EQUAL(11, counter.Value());
+}
+
+BOOST_AUTO_TEST_CASE(sharded_counter_threads) {
+  prometheus::Counter &counter = test_family.Add({{"case", "threads"}});
+  sv::sharded_counter sharded{counter};
+
+  constexpr int threads = 8;
+  constexpr int increments = 100000;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&sharded]() {
+      for (int i = 0; i < increments; i++) {
+        sharded.increment();
+      }
+    });
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+
+  sharded.flush();
+  BOOST_CHECK_EQUAL(threads * increments, counter.Value());
+}
@@ -0,0 +1,92 @@
+#define BOOST_TEST_MODULE MJPEGEncoderTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <chrono>
+#include <thread>
+
+#include "logging_impl.h"
+#include "mjpeg_encoder.h"
+
+using namespace satori::video;
+
+namespace {
+
+streams::publisher<owned_image_packet> rgb_frames(int count) {
+  return streams::publishers::range(0, count) >> streams::map([](int i) {
+           owned_image_frame f;
+           f.id = {i, i};
+           f.pixel_format = image_pixel_format::RGB0;
+           f.width = 32;
+           f.height = 16;
+           f.plane_data[0] = std::string(32 * 16 * 4, static_cast<char>(i));
+           f.plane_strides[0] = 32 * 4;
+           return owned_image_packet{f};
+         });
+}
+
+struct encoded_stream {
+  int metadata_count{0};
+  std::vector<int64_t> frame_ids;
+  bool all_key_frames{true};
+  bool jpeg_markers{true};
+};
+
+encoded_stream encode(streams::publisher<owned_image_packet> &&frames,
+                      const mjpeg_encoder_profile &profile) {
+  encoded_stream result;
+  auto when_done =
+      (std::move(frames) >> encode_as_mjpeg(profile))
+          ->process([&result](encoded_packet &&packet) {
+            if (const auto *m = boost::get<encoded_metadata>(&packet)) {
+              BOOST_TEST(m->codec_name == "mjpeg");
+              result.metadata_count++;
+            } else if (const auto *f = boost::get<encoded_frame>(&packet)) {
+              result.frame_ids.push_back(f->id.i1);
+              result.all_key_frames &= f->key_frame;
+              // starts with SOI marker
+              result.jpeg_markers &= f->data.str().compare(0, 2, "\xff\xd8") == 0;
+            }
+          });
+  while (!when_done.resolved()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  BOOST_TEST(when_done.ok());
+  return result;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(mjpeg_encoder) {
+  const encoded_stream result = encode(rgb_frames(10), mjpeg_encoder_profile{});
+
+  BOOST_TEST(result.metadata_count == 1);
+  BOOST_TEST(result.frame_ids.size() == 10);
+  BOOST_TEST(result.all_key_frames);
+  BOOST_TEST(result.jpeg_markers);
+}
+
+BOOST_AUTO_TEST_CASE(mjpeg_encoder_parallel_keeps_order) {
+  mjpeg_encoder_profile profile;
+  profile.threads = 4;
+  profile.quality = 95;
+  profile.subsampling = "444";
+  const encoded_stream result = encode(rgb_frames(100), profile);
+
+  BOOST_TEST(result.metadata_count == 1);
+  BOOST_TEST(result.frame_ids.size() == 100);
+  for (size_t i = 0; i < result.frame_ids.size(); i++) {
+    BOOST_TEST(result.frame_ids[i] == static_cast<int64_t>(i));
+  }
+  BOOST_TEST(result.jpeg_markers);
+}
+
+BOOST_AUTO_TEST_CASE(mjpeg_encoder_bad_subsampling) {
+  mjpeg_encoder_profile profile;
+  profile.subsampling = "411";
+  auto when_done =
+      (rgb_frames(1) >> encode_as_mjpeg(profile))->process([](encoded_packet &&) {});
+  while (!when_done.resolved()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  BOOST_TEST(!when_done.ok());
+}
@@ -0,0 +1,78 @@
+#define BOOST_TEST_MODULE MotionGateTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <algorithm>
+
+#include "motion_gate.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+sv::owned_image_frame gray_frame(uint8_t value, int64_t millis) {
+  sv::owned_image_frame frame;
+  frame.pixel_format = sv::image_pixel_format::GRAY8;
+  frame.width = 64;
+  frame.height = 48;
+  frame.timestamp =
+      std::chrono::system_clock::time_point{std::chrono::milliseconds(millis)};
+  frame.plane_data[0] = std::string(64 * 48, static_cast<char>(value));
+  frame.plane_strides[0] = 64;
+  return frame;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(same_frames_are_gated) {
+  sv::motion_gate gate{"test", 2, std::chrono::seconds(0)};
+  BOOST_CHECK(gate.pass(gray_frame(100, 0)));
+  BOOST_CHECK(!gate.pass(gray_frame(100, 40)));
+  BOOST_CHECK(!gate.pass(gray_frame(101, 80)));
+  BOOST_CHECK(gate.pass(gray_frame(110, 120)));
+  BOOST_CHECK(!gate.pass(gray_frame(110, 160)));
+}
+
+BOOST_AUTO_TEST_CASE(changes_are_compared_to_passed_frame) {
+  sv::motion_gate gate{"test", 2, std::chrono::seconds(0)};
+  BOOST_CHECK(gate.pass(gray_frame(100, 0)));
+  BOOST_CHECK(!gate.pass(gray_frame(102, 40)));
+  // slow drift passes once it is above threshold from the last passed frame.
+  BOOST_CHECK(gate.pass(gray_frame(104, 80)));
+}
+
+BOOST_AUTO_TEST_CASE(local_change_passes) {
+  sv::motion_gate gate{"test", 2, std::chrono::seconds(0)};
+  BOOST_CHECK(gate.pass(gray_frame(0, 0)));
+
+  sv::owned_image_frame frame = gray_frame(0, 40);
+  // a quarter of the frame lights up.
+  std::string pixels(64 * 48, 0);
+  for (int y = 0; y < 24; y++) {
+    std::fill(pixels.begin() + y * 64, pixels.begin() + y * 64 + 32, '\x40');
+  }
+  frame.plane_data[0] = std::move(pixels);
+  BOOST_CHECK(gate.pass(frame));
+}
+
+BOOST_AUTO_TEST_CASE(keep_alive) {
+  sv::motion_gate gate{"test", 2, std::chrono::seconds(1)};
+  BOOST_CHECK(gate.pass(gray_frame(100, 0)));
+  BOOST_CHECK(!gate.pass(gray_frame(100, 500)));
+  BOOST_CHECK(gate.pass(gray_frame(100, 1000)));
+  BOOST_CHECK(!gate.pass(gray_frame(100, 1500)));
+  // timestamps going back, e.g. after input restart.
+  BOOST_CHECK(gate.pass(gray_frame(100, 0)));
+}
+
+BOOST_AUTO_TEST_CASE(unreadable_frames_pass) {
+  sv::motion_gate gate{"test", 2, std::chrono::seconds(0)};
+  BOOST_CHECK(gate.pass(gray_frame(100, 0)));
+
+  sv::owned_image_frame frame = gray_frame(100, 40);
+  frame.on_device = true;
+  BOOST_CHECK(gate.pass(frame));
+
+  frame = gray_frame(100, 80);
+  frame.width = 8;
+  BOOST_CHECK(gate.pass(frame));
+}
@@ -0,0 +1,123 @@
+#define BOOST_TEST_MODULE PrerollSinkTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <chrono>
+#include <climits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "data.h"
+#include "video_streams.h"
+
+namespace sv = satori::video;
+namespace streams = satori::video::streams;
+
+namespace {
+
+// frames are 10 bytes, 100ms apart, with a key frame every 4 frames.
+std::vector<sv::encoded_packet> make_packets(int64_t frames) {
+  std::vector<sv::encoded_packet> packets;
+  sv::encoded_metadata metadata;
+  metadata.codec_name = "vp9";
+  packets.emplace_back(std::move(metadata));
+  for (int64_t id = 0; id < frames; id++) {
+    sv::encoded_frame frame;
+    frame.data = std::string(10, 'x');
+    frame.id = {id, id};
+    frame.timestamp =
+        std::chrono::system_clock::time_point{} + std::chrono::milliseconds{id * 100};
+    frame.key_frame = id % 4 == 0;
+    packets.emplace_back(std::move(frame));
+  }
+  return packets;
+}
+
+int64_t frame_id(const sv::encoded_packet &packet) {
+  return boost::get<sv::encoded_frame>(packet).id.i1;
+}
+
+struct collecting_sink : streams::subscriber<sv::encoded_packet> {
+  void on_next(sv::encoded_packet &&packet) override {
+    packets.push_back(std::move(packet));
+  }
+  void on_error(std::error_condition /*ec*/) override { BOOST_FAIL("unexpected error"); }
+  void on_complete() override { completed = true; }
+  void on_subscribe(streams::subscription &s) override { s.request(INT_MAX); }
+
+  std::vector<sv::encoded_packet> packets;
+  bool completed{false};
+};
+
+// fires trigger before frame trigger_at, and lets it run out before frame stop_at.
+void run(const sv::preroll_options &options, int64_t trigger_at, int64_t stop_at,
+         std::vector<collecting_sink> &clips,
+         std::vector<std::chrono::system_clock::time_point> &starts) {
+  auto trigger = std::make_shared<sv::preroll_trigger>();
+  clips.reserve(10);
+  streams::publisher<sv::encoded_packet> packets =
+      streams::publishers::of(make_packets(20))
+      >> streams::map([trigger, trigger_at, stop_at](sv::encoded_packet &&p) {
+          if (p.type() == typeid(sv::encoded_frame)) {
+            if (frame_id(p) == trigger_at) {
+              trigger->trigger(std::chrono::milliseconds{50});
+            } else if (frame_id(p) == stop_at) {
+              std::this_thread::sleep_for(std::chrono::milliseconds{100});
+            }
+          }
+          return std::move(p);
+        });
+  packets->subscribe(sv::preroll_sink(
+      options, trigger,
+      [&clips, &starts](std::chrono::system_clock::time_point start)
+          -> streams::subscriber<sv::encoded_packet> & {
+        starts.push_back(start);
+        clips.emplace_back();
+        return clips.back();
+      }));
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(clip_starts_with_buffered_gops) {
+  sv::preroll_options options;
+  options.duration = std::chrono::milliseconds{500};
+  std::vector<collecting_sink> clips;
+  std::vector<std::chrono::system_clock::time_point> starts;
+  run(options, 12, 16, clips, starts);
+
+  BOOST_TEST_REQUIRE(clips.size() == 1);
+  const auto &packets = clips[0].packets;
+  BOOST_TEST(clips[0].completed);
+  BOOST_TEST_REQUIRE(packets.size() == 13);
+  BOOST_TEST((packets[0].type() == typeid(sv::encoded_metadata)));
+  BOOST_TEST(boost::get<sv::encoded_metadata>(packets[0]).codec_name == "vp9");
+  // GOP of frames 0-3 is older than 500ms when frame 9 arrives.
+  for (size_t i = 1; i < packets.size(); i++) {
+    BOOST_TEST(frame_id(packets[i]) == static_cast<int64_t>(i) + 3);
+  }
+  BOOST_TEST((starts[0] == boost::get<sv::encoded_frame>(packets[1]).timestamp));
+}
+
+BOOST_AUTO_TEST_CASE(buffer_is_bounded_by_bytes) {
+  sv::preroll_options options;
+  options.max_bytes = 45;
+  std::vector<collecting_sink> clips;
+  std::vector<std::chrono::system_clock::time_point> starts;
+  run(options, 12, 14, clips, starts);
+
+  BOOST_TEST_REQUIRE(clips.size() == 1);
+  const auto &packets = clips[0].packets;
+  BOOST_TEST(clips[0].completed);
+  BOOST_TEST_REQUIRE(packets.size() == 7);
+  for (size_t i = 1; i < packets.size(); i++) {
+    BOOST_TEST(frame_id(packets[i]) == static_cast<int64_t>(i) + 7);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(no_clip_without_trigger) {
+  std::vector<collecting_sink> clips;
+  std::vector<std::chrono::system_clock::time_point> starts;
+  run(sv::preroll_options{}, -1, -1, clips, starts);
+  BOOST_TEST(clips.empty());
+}
@@ -0,0 +1,85 @@
+#define BOOST_TEST_MODULE ReplayFileTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+
+#include "replay_file.h"
+
+namespace sv = satori::video;
+namespace fs = boost::filesystem;
+
+namespace {
+
+std::string write_test_file() {
+  const fs::path path = fs::temp_directory_path() / fs::unique_path("%%%%%%.vreplay");
+  const auto t0 = std::chrono::system_clock::time_point{std::chrono::seconds{1000}};
+
+  sv::replay_file_writer writer{path.string()};
+  sv::network_metadata nm;
+  nm.codec_name = "h264";
+  nm.binary_data = std::string{"\x00\x01\x02", 3};
+  writer.write(nm, t0);
+
+  for (int i = 1; i <= 4; i++) {
+    sv::network_frame nf;
+    nf.binary_data = "frame" + std::to_string(i);
+    nf.id = {i, i};
+    nf.key_frame = i == 1 || i == 3;
+    writer.write(nf, t0 + std::chrono::milliseconds{100 * i});
+  }
+  return path.string();
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(write_and_read) {
+  const std::string filename = write_test_file();
+  BOOST_CHECK(sv::is_binary_replay_file(filename));
+
+  auto reader = sv::replay_file_reader::open(filename);
+  BOOST_REQUIRE(reader);
+  const auto &index = reader->index();
+  BOOST_REQUIRE_EQUAL(5u, index.size());
+  BOOST_CHECK(index[0].metadata);
+  BOOST_CHECK(index[1].key_frame);
+  BOOST_CHECK(!index[2].key_frame);
+  BOOST_CHECK(index[3].key_frame);
+  BOOST_CHECK_CLOSE(1000.2, index[2].timestamp, 0.0001);
+
+  const auto nm = boost::get<sv::network_metadata>(reader->read(index[0]));
+  BOOST_CHECK_EQUAL("h264", nm.codec_name);
+  BOOST_CHECK_EQUAL(std::string("\x00\x01\x02", 3), nm.binary_data);
+
+  const auto nf = boost::get<sv::network_frame>(reader->read(index[4]));
+  BOOST_CHECK_EQUAL("frame4", nf.binary_data);
+  BOOST_CHECK_EQUAL(4, nf.id.i1);
+
+  fs::remove(filename);
+}
+
+BOOST_AUTO_TEST_CASE(read_without_index) {
+  const std::string filename = write_test_file();
+  const auto size = fs::file_size(filename);
+  // like recording interrupted in the middle of the last frame, index of 5 records
+  // and trailer take 144 bytes.
+  fs::resize_file(filename, size - 144 - 3);
+
+  auto reader = sv::replay_file_reader::open(filename);
+  BOOST_REQUIRE(reader);
+  BOOST_REQUIRE_EQUAL(4u, reader->index().size());
+  const auto nf = boost::get<sv::network_frame>(reader->read(reader->index()[3]));
+  BOOST_CHECK_EQUAL("frame3", nf.binary_data);
+
+  fs::remove(filename);
+}
+
+BOOST_AUTO_TEST_CASE(text_replay_file) {
+  const fs::path path = fs::temp_directory_path() / fs::unique_path("%%%%%%.replay");
+  std::ofstream{path.string()} << "{\"messages\":[]}\n";
+
+  BOOST_CHECK(!sv::is_binary_replay_file(path.string()));
+  BOOST_CHECK(!sv::replay_file_reader::open(path.string()));
+
+  fs::remove(path);
+}
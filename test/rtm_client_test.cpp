@@ -0,0 +1,347 @@
+#define BOOST_TEST_MODULE RtmClientTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rtm_client.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+struct published_message {
+  size_t shard;
+  std::thread::id thread_id;
+  std::string channel;
+  nlohmann::json message;
+};
+
+struct shared_log {
+  std::mutex mutex;
+  std::vector<published_message> messages;
+};
+
+// confirms every request right away from the thread it was invoked from.
+struct fake_client : sv::rtm::client {
+  fake_client(size_t shard, shared_log &log) : shard(shard), log(log) {}
+
+  void publish(const std::string &channel, nlohmann::json &&message,
+               sv::rtm::request_callbacks *callbacks,
+               const sv::rtm::publish_options & /*options*/) override {
+    {
+      std::lock_guard<std::mutex> lock{log.mutex};
+      log.messages.push_back(
+          {shard, std::this_thread::get_id(), channel, std::move(message)});
+    }
+    if (callbacks != nullptr) {
+      callbacks->on_ok();
+    }
+  }
+
+  void subscribe(const std::string & /*channel*/, const sv::rtm::subscription &sub,
+                 sv::rtm::subscription_callbacks &data_callbacks,
+                 sv::rtm::request_callbacks *callbacks,
+                 const sv::rtm::subscription_options * /*options*/) override {
+    if (callbacks != nullptr) {
+      callbacks->on_ok();
+    }
+    sv::rtm::channel_data data;
+    data.payload = shard;
+    data_callbacks.on_data(sub, std::move(data));
+  }
+
+  void unsubscribe(const sv::rtm::subscription & /*sub*/,
+                   sv::rtm::request_callbacks *callbacks) override {
+    if (callbacks != nullptr) {
+      callbacks->on_ok();
+    }
+  }
+
+  std::error_condition start() override { return start_result; }
+
+  std::error_condition stop() override {
+    stopped = true;
+    return {};
+  }
+
+  const size_t shard;
+  shared_log &log;
+  std::error_condition start_result;
+  bool stopped{false};
+};
+
+struct counting_callbacks : sv::rtm::request_callbacks,
+                            sv::rtm::subscription_callbacks {
+  void on_ok() override {
+    BOOST_TEST((std::this_thread::get_id() == thread_id));
+    oks++;
+  }
+
+  void on_error(std::error_condition /*ec*/) override { errors++; }
+
+  void on_data(const sv::rtm::subscription & /*sub*/,
+               sv::rtm::channel_data &&data) override {
+    BOOST_TEST((std::this_thread::get_id() == thread_id));
+    payloads.push_back(std::move(data.payload));
+  }
+
+  const std::thread::id thread_id{std::this_thread::get_id()};
+  int oks{0};
+  int errors{0};
+  std::vector<nlohmann::json> payloads;
+};
+
+struct failing_error_callbacks : sv::rtm::error_callbacks {
+  void on_error(std::error_condition ec) override { BOOST_FAIL(ec.message()); }
+};
+
+sv::rtm::sharded_client::client_factory_t fake_factory(shared_log &log) {
+  return [&log](boost::asio::io_service & /*io*/, size_t shard,
+                sv::rtm::error_callbacks & /*callbacks*/) {
+    return std::make_unique<fake_client>(shard, log);
+  };
+}
+
+// runs loop until condition is met, shard threads deliver callbacks concurrently.
+template <typename Condition>
+void run_until(boost::asio::io_service &io, Condition &&condition) {
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{10};
+  while (!condition() && std::chrono::steady_clock::now() < deadline) {
+    io.restart();
+    io.poll();
+    std::this_thread::sleep_for(std::chrono::milliseconds{1});
+  }
+  BOOST_TEST_REQUIRE(condition());
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(sharded_client_keeps_channel_on_one_shard) {
+  boost::asio::io_service io;
+  shared_log log;
+  counting_callbacks callbacks;
+  failing_error_callbacks error_callbacks;
+  sv::rtm::sharded_client client{io, std::this_thread::get_id(), 4, fake_factory(log),
+                                 error_callbacks};
+  BOOST_TEST(!client.start());
+
+  for (int i = 0; i < 100; i++) {
+    client.publish("channel-" + std::to_string(i % 10), i, &callbacks,
+                   sv::rtm::publish_options{});
+  }
+  run_until(io, [&callbacks]() { return callbacks.oks == 100; });
+  BOOST_TEST(callbacks.errors == 0);
+
+  std::lock_guard<std::mutex> lock{log.mutex};
+  BOOST_TEST_REQUIRE(log.messages.size() == 100);
+  std::map<std::string, size_t> channel_shards;
+  std::map<std::string, int> last_message;
+  std::set<size_t> used_shards;
+  for (const auto &m : log.messages) {
+    BOOST_TEST((m.thread_id != std::this_thread::get_id()));
+    const auto it = channel_shards.emplace(m.channel, m.shard).first;
+    BOOST_TEST(it->second == m.shard);
+    used_shards.insert(m.shard);
+
+    const int value = m.message;
+    const auto last = last_message.find(m.channel);
+    if (last != last_message.end()) {
+      BOOST_TEST(value > last->second);
+    }
+    last_message[m.channel] = value;
+  }
+  BOOST_TEST(used_shards.size() > 1);
+
+  BOOST_TEST(!client.stop());
+}
+
+BOOST_AUTO_TEST_CASE(sharded_client_delivers_data_on_loop_thread) {
+  boost::asio::io_service io;
+  shared_log log;
+  counting_callbacks callbacks;
+  failing_error_callbacks error_callbacks;
+  sv::rtm::sharded_client client{io, std::this_thread::get_id(), 2, fake_factory(log),
+                                 error_callbacks};
+  BOOST_TEST(!client.start());
+
+  sv::rtm::subscription sub1;
+  sv::rtm::subscription sub2;
+  client.subscribe("a", sub1, callbacks, &callbacks, nullptr);
+  client.subscribe("b", sub2, callbacks, &callbacks, nullptr);
+  run_until(io, [&callbacks]() { return callbacks.payloads.size() == 2; });
+
+  client.unsubscribe(sub1, &callbacks);
+  client.unsubscribe(sub2, &callbacks);
+  run_until(io, [&callbacks]() { return callbacks.oks == 4; });
+
+  BOOST_TEST(!client.stop());
+}
+
+BOOST_AUTO_TEST_CASE(sharded_client_shares_io_threads) {
+  boost::asio::io_service io;
+  shared_log log;
+  counting_callbacks callbacks;
+  failing_error_callbacks error_callbacks;
+  sv::rtm::sharded_client client{io, std::this_thread::get_id(), 4, fake_factory(log),
+                                 error_callbacks, 1};
+  BOOST_TEST(!client.start());
+
+  for (int i = 0; i < 20; i++) {
+    client.publish("channel-" + std::to_string(i), i, &callbacks,
+                   sv::rtm::publish_options{});
+  }
+  run_until(io, [&callbacks]() { return callbacks.oks == 20; });
+
+  std::lock_guard<std::mutex> lock{log.mutex};
+  std::set<std::thread::id> threads;
+  std::set<size_t> used_shards;
+  for (const auto &m : log.messages) {
+    threads.insert(m.thread_id);
+    used_shards.insert(m.shard);
+  }
+  BOOST_TEST(threads.size() == 1);
+  BOOST_TEST((*threads.begin() != std::this_thread::get_id()));
+  BOOST_TEST(used_shards.size() > 1);
+
+  BOOST_TEST(!client.stop());
+}
+
+BOOST_AUTO_TEST_CASE(sharded_client_restores_only_current_subscriptions) {
+  boost::asio::io_service io;
+  shared_log log;
+  counting_callbacks callbacks;
+  failing_error_callbacks error_callbacks;
+  std::atomic<boost::asio::io_service *> shard_io{nullptr};
+  std::atomic<sv::rtm::error_callbacks *> shard_errors{nullptr};
+  sv::rtm::sharded_client client{
+      io, std::this_thread::get_id(), 1,
+      [&log, &shard_io, &shard_errors](boost::asio::io_service &io, size_t shard,
+                                       sv::rtm::error_callbacks &callbacks) {
+        shard_io = &io;
+        shard_errors = &callbacks;
+        return std::make_unique<fake_client>(shard, log);
+      },
+      error_callbacks};
+  BOOST_TEST(!client.start());
+
+  sv::rtm::subscription sub1;
+  sv::rtm::subscription sub2;
+  client.subscribe("a", sub1, callbacks, &callbacks, nullptr);
+  client.subscribe("b", sub2, callbacks, &callbacks, nullptr);
+  client.unsubscribe(sub1, &callbacks);
+  run_until(io, [&callbacks]() { return callbacks.oks == 3; });
+
+  // connection is replaced and only the remaining subscription is restored.
+  (*shard_io).post([&shard_errors]() {
+    (*shard_errors).on_error(std::make_error_condition(std::errc::connection_reset));
+  });
+  run_until(io, [&callbacks]() { return callbacks.payloads.size() == 3; });
+  std::this_thread::sleep_for(std::chrono::milliseconds{50});
+  io.restart();
+  io.poll();
+  BOOST_TEST(callbacks.oks == 4);
+  BOOST_TEST(callbacks.payloads.size() == 3);
+
+  client.unsubscribe(sub2, nullptr);
+  BOOST_TEST(!client.stop());
+}
+
+BOOST_AUTO_TEST_CASE(resilient_client_resubscribes_without_waiting_for_acks) {
+  // keeps subscribe requests unconfirmed.
+  struct silent_client : fake_client {
+    using fake_client::fake_client;
+
+    void subscribe(const std::string &channel, const sv::rtm::subscription & /*sub*/,
+                   sv::rtm::subscription_callbacks & /*data_callbacks*/,
+                   sv::rtm::request_callbacks * /*callbacks*/,
+                   const sv::rtm::subscription_options * /*options*/) override {
+      channels.push_back(channel);
+    }
+
+    std::vector<std::string> channels;
+  };
+
+  boost::asio::io_service io;
+  shared_log log;
+  counting_callbacks callbacks;
+  failing_error_callbacks error_callbacks;
+  std::vector<silent_client *> connections;
+  sv::rtm::error_callbacks *connection_errors{nullptr};
+  sv::rtm::resilient_client client{
+      io, std::this_thread::get_id(),
+      [&log, &connections, &connection_errors](sv::rtm::error_callbacks &callbacks) {
+        connection_errors = &callbacks;
+        auto c = std::make_unique<silent_client>(connections.size(), log);
+        connections.push_back(c.get());
+        return c;
+      },
+      error_callbacks};
+  BOOST_TEST(!client.start());
+
+  sv::rtm::subscription subs[3];
+  client.subscribe("a", subs[0], callbacks, &callbacks, nullptr);
+  client.subscribe("b", subs[1], callbacks, &callbacks, nullptr);
+  client.subscribe("c", subs[2], callbacks, &callbacks, nullptr);
+
+  connection_errors->on_error(std::make_error_condition(std::errc::connection_reset));
+  BOOST_TEST_REQUIRE(connections.size() == 2);
+  BOOST_TEST(connections[1]->channels == (std::vector<std::string>{"a", "b", "c"}));
+  BOOST_TEST(callbacks.oks == 0);
+
+  BOOST_TEST(!client.stop());
+}
+
+BOOST_AUTO_TEST_CASE(split_compression_client_keeps_opted_out_channels_apart) {
+  shared_log log;
+  counting_callbacks callbacks;
+  sv::rtm::split_compression_client client{std::make_unique<fake_client>(0, log),
+                                           std::make_unique<fake_client>(1, log)};
+  BOOST_TEST(!client.start());
+
+  sv::rtm::publish_options uncompressed;
+  uncompressed.compress = false;
+  client.publish("frames", 1, &callbacks, uncompressed);
+  client.publish("analysis", 2, &callbacks, sv::rtm::publish_options{});
+  // channel stays on connection chosen by its first request.
+  client.publish("frames", 3, &callbacks, sv::rtm::publish_options{});
+  client.publish("analysis", 4, &callbacks, uncompressed);
+
+  sv::rtm::subscription sub1;
+  sv::rtm::subscription sub2;
+  sv::rtm::subscription_options frames_options;
+  frames_options.compress = false;
+  client.subscribe("input", sub1, callbacks, &callbacks, &frames_options);
+  client.subscribe("input/control", sub2, callbacks, &callbacks, nullptr);
+  client.unsubscribe(sub1, &callbacks);
+  client.unsubscribe(sub2, &callbacks);
+  BOOST_TEST(callbacks.oks == 8);
+
+  BOOST_TEST_REQUIRE(log.messages.size() == 4);
+  BOOST_TEST(log.messages[0].shard == 1);
+  BOOST_TEST(log.messages[1].shard == 0);
+  BOOST_TEST(log.messages[2].shard == 1);
+  BOOST_TEST(log.messages[3].shard == 0);
+  BOOST_TEST(callbacks.payloads == (std::vector<nlohmann::json>{1, 0}));
+
+  BOOST_TEST(!client.stop());
+}
+
+BOOST_AUTO_TEST_CASE(split_compression_client_stops_compressed_on_failed_start) {
+  shared_log log;
+  auto compressed = std::make_unique<fake_client>(0, log);
+  auto uncompressed = std::make_unique<fake_client>(1, log);
+  const fake_client &compressed_client = *compressed;
+  uncompressed->start_result = std::make_error_condition(std::errc::connection_refused);
+  sv::rtm::split_compression_client client{std::move(compressed),
+                                           std::move(uncompressed)};
+
+  BOOST_TEST((client.start() == std::errc::connection_refused));
+  BOOST_TEST(compressed_client.stopped);
+}
@@ -0,0 +1,118 @@
+#define BOOST_TEST_MODULE RtmPduTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <string>
+
+#include "cbor_json.h"
+#include "rtm_pdu.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+sv::rtm::cbor_subscription_data read_subscription_data(const std::string &pdu_data) {
+  sv::rtm::cbor_pdu pdu;
+  BOOST_TEST_REQUIRE(sv::rtm::read_cbor_pdu(pdu_data.data(), pdu_data.size(), pdu));
+  BOOST_TEST_REQUIRE(pdu.action == "rtm/subscription/data");
+  BOOST_TEST_REQUIRE(pdu.body.is_initialized());
+
+  sv::rtm::cbor_subscription_data data;
+  BOOST_TEST_REQUIRE(sv::rtm::read_cbor_subscription_data(*pdu.body, data));
+  return data;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(read_confirmation) {
+  const std::string data = sv::json_to_cbor(
+      R"({"action":"rtm/publish/ok", "id":42, "body":{"position":"1:0"}})"_json);
+
+  sv::rtm::cbor_pdu pdu;
+  BOOST_TEST_REQUIRE(sv::rtm::read_cbor_pdu(data.data(), data.size(), pdu));
+  BOOST_TEST(pdu.action == "rtm/publish/ok");
+  BOOST_TEST(pdu.id == 42);
+  BOOST_TEST(pdu.body.is_initialized());
+}
+
+BOOST_AUTO_TEST_CASE(read_pdu_without_id) {
+  const std::string data =
+      sv::json_to_cbor(R"({"action":"rtm/subscription/error", "body":{}})"_json);
+
+  sv::rtm::cbor_pdu pdu;
+  BOOST_TEST_REQUIRE(sv::rtm::read_cbor_pdu(data.data(), data.size(), pdu));
+  BOOST_TEST(pdu.action == "rtm/subscription/error");
+  BOOST_TEST(pdu.id == -1);
+}
+
+BOOST_AUTO_TEST_CASE(read_malformed_pdu) {
+  sv::rtm::cbor_pdu pdu;
+  const std::string array = sv::json_to_cbor(R"(["rtm/publish/ok", 42])"_json);
+  BOOST_TEST(!sv::rtm::read_cbor_pdu(array.data(), array.size(), pdu));
+
+  const std::string data =
+      sv::json_to_cbor(R"({"action":"rtm/publish/ok", "id":42})"_json);
+  BOOST_TEST(!sv::rtm::read_cbor_pdu(data.data(), data.size() - 1, pdu));
+
+  const std::string bad_id =
+      sv::json_to_cbor(R"({"action":"rtm/publish/ok", "id":"42"})"_json);
+  BOOST_TEST(!sv::rtm::read_cbor_pdu(bad_id.data(), bad_id.size(), pdu));
+}
+
+BOOST_AUTO_TEST_CASE(read_subscription_messages) {
+  const nlohmann::json messages = R"([{"i":[1, 2]}, "text", 5])"_json;
+  nlohmann::json pdu = R"({"action":"rtm/subscription/data"})"_json;
+  pdu["body"] = {{"subscription_id", "3"}, {"position", "1:2"}, {"messages", messages}};
+
+  const auto data = read_subscription_data(sv::json_to_cbor(pdu));
+  BOOST_TEST(data.subscription_id == "3");
+  BOOST_TEST_REQUIRE(data.messages.size() == 3);
+  for (size_t i = 0; i < messages.size(); i++) {
+    auto message = sv::cbor_to_json(data.messages[i].data(), data.messages[i].size());
+    BOOST_TEST_REQUIRE(message.ok());
+    BOOST_TEST(message.get() == messages[i]);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(read_malformed_subscription_data) {
+  const std::string no_messages = sv::json_to_cbor(
+      R"({"action":"rtm/subscription/data", "body":{"subscription_id":"3"}})"_json);
+  sv::rtm::cbor_pdu pdu;
+  BOOST_TEST_REQUIRE(
+      sv::rtm::read_cbor_pdu(no_messages.data(), no_messages.size(), pdu));
+  BOOST_TEST_REQUIRE(pdu.body.is_initialized());
+  sv::rtm::cbor_subscription_data data;
+  BOOST_TEST(!sv::rtm::read_cbor_subscription_data(*pdu.body, data));
+
+  const std::string not_array = sv::json_to_cbor(
+      R"({"action":"rtm/subscription/data",
+          "body":{"subscription_id":"3", "messages":{"a":1}}})"_json);
+  BOOST_TEST_REQUIRE(sv::rtm::read_cbor_pdu(not_array.data(), not_array.size(), pdu));
+  BOOST_TEST_REQUIRE(pdu.body.is_initialized());
+  BOOST_TEST(!sv::rtm::read_cbor_subscription_data(*pdu.body, data));
+}
+
+BOOST_AUTO_TEST_CASE(parse_subscription_ids) {
+  uint32_t id = 0;
+  BOOST_TEST(sv::rtm::parse_subscription_id("0", id));
+  BOOST_TEST(id == 0);
+  BOOST_TEST(sv::rtm::parse_subscription_id("17", id));
+  BOOST_TEST(id == 17);
+  BOOST_TEST(sv::rtm::parse_subscription_id("999999999", id));
+  BOOST_TEST(id == 999999999);
+
+  for (const char *bad : {"", "-1", "1a", " 1", "0x1", "1234567890", "channel"}) {
+    id = 5;
+    BOOST_TEST(!sv::rtm::parse_subscription_id(bad, id), bad);
+    BOOST_TEST(id == 5);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(route_subscription_data_by_id) {
+  nlohmann::json pdu = R"({"action":"rtm/subscription/data"})"_json;
+  pdu["body"] = {{"subscription_id", "12"}, {"messages", {1}}};
+
+  const auto data = read_subscription_data(sv::json_to_cbor(pdu));
+  uint32_t id;
+  BOOST_TEST_REQUIRE(sv::rtm::parse_subscription_id(data.subscription_id, id));
+  BOOST_TEST(id == 12);
+}
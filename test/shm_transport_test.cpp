@@ -0,0 +1,248 @@
+#define BOOST_TEST_MODULE ShmTransportTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "shm_transport.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+struct collecting_callbacks : sv::rtm::request_callbacks,
+                              sv::rtm::subscription_callbacks {
+  void on_ok() override { oks++; }
+
+  void on_error(std::error_condition /*ec*/) override { errors++; }
+
+  void on_data(const sv::rtm::subscription & /*sub*/,
+               sv::rtm::channel_data &&data) override {
+    payloads.push_back(std::move(data.payload));
+    cbor_payloads.push_back(std::move(data.cbor_payload));
+  }
+
+  int oks{0};
+  int errors{0};
+  std::vector<nlohmann::json> payloads;
+  std::vector<std::string> cbor_payloads;
+};
+
+// shared memory objects are unique per test run and removed afterwards.
+struct test_prefix {
+  explicit test_prefix(const std::string &name)
+      : prefix("shm_transport_test_" + name + "_" + std::to_string(getpid())) {}
+  ~test_prefix() {
+    for (const auto &channel : channels) {
+      shm_unlink(sv::rtm::shm_object_name(prefix, channel).c_str());
+    }
+  }
+
+  const std::string prefix;
+  std::vector<std::string> channels;
+};
+
+template <typename Condition>
+void run_until(boost::asio::io_service &io, Condition &&condition) {
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{10};
+  while (!condition() && std::chrono::steady_clock::now() < deadline) {
+    io.restart();
+    io.poll();
+    std::this_thread::sleep_for(std::chrono::milliseconds{1});
+  }
+  BOOST_TEST_REQUIRE(condition());
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(object_name) {
+  BOOST_TEST(sv::rtm::shm_object_name("p", "a/b/c") == "/p.a_b_c");
+}
+
+BOOST_AUTO_TEST_CASE(publish_subscribe) {
+  test_prefix prefix{"pubsub"};
+  prefix.channels = {"frames", "metadata"};
+  boost::asio::io_service io;
+  auto publisher = sv::rtm::new_shm_client(io, std::this_thread::get_id(),
+                                           prefix.prefix, 1024 * 1024);
+  auto subscriber = sv::rtm::new_shm_client(io, std::this_thread::get_id(),
+                                            prefix.prefix, 1024 * 1024);
+  BOOST_TEST(!publisher->start());
+  BOOST_TEST(!subscriber->start());
+  BOOST_TEST(publisher->supports_binary());
+
+  collecting_callbacks frames;
+  collecting_callbacks metadata;
+  sv::rtm::subscription frames_sub;
+  sv::rtm::subscription metadata_sub;
+  sv::rtm::subscription_options raw;
+  raw.raw_cbor = true;
+  subscriber->subscribe("frames", frames_sub, frames, &frames, nullptr);
+  subscriber->subscribe("metadata", metadata_sub, metadata, &metadata, &raw);
+  run_until(io, [&]() { return frames.oks == 1 && metadata.oks == 1; });
+
+  collecting_callbacks published;
+  for (int i = 0; i < 1000; i++) {
+    publisher->publish("frames", {{"i", i}, {"d@bytes", std::string(100, 'x')}},
+                       &published, sv::rtm::publish_options{});
+  }
+  publisher->publish("metadata", {{"codec", "vp9"}}, &published,
+                     sv::rtm::publish_options{});
+  run_until(io, [&]() { return frames.payloads.size() == 1000; });
+  run_until(io, [&]() { return metadata.cbor_payloads.size() == 1; });
+
+  BOOST_TEST(published.oks == 1001);
+  for (int i = 0; i < 1000; i++) {
+    BOOST_TEST(frames.payloads[i]["i"] == i);
+  }
+  BOOST_TEST(!metadata.cbor_payloads[0].empty());
+  BOOST_TEST(metadata.payloads[0].is_null());
+
+  subscriber->unsubscribe(frames_sub, &frames);
+  run_until(io, [&]() { return frames.oks == 2; });
+  publisher->publish("frames", {{"i", 1000}}, nullptr, sv::rtm::publish_options{});
+  std::this_thread::sleep_for(std::chrono::milliseconds{20});
+  io.restart();
+  io.poll();
+  BOOST_TEST(frames.payloads.size() == 1000);
+
+  BOOST_TEST(!subscriber->stop());
+  BOOST_TEST(!publisher->stop());
+}
+
+BOOST_AUTO_TEST_CASE(too_large_message) {
+  test_prefix prefix{"large"};
+  prefix.channels = {"c"};
+  boost::asio::io_service io;
+  auto client = sv::rtm::new_shm_client(io, std::this_thread::get_id(), prefix.prefix,
+                                        sv::rtm::min_shm_ring_bytes);
+  BOOST_TEST(!client->start());
+
+  collecting_callbacks callbacks;
+  client->publish("c", std::string(sv::rtm::min_shm_ring_bytes / 2, 'x'), &callbacks,
+                  sv::rtm::publish_options{});
+  run_until(io, [&]() { return callbacks.errors == 1; });
+  BOOST_TEST(callbacks.oks == 0);
+  BOOST_TEST(!client->stop());
+}
+
+BOOST_AUTO_TEST_CASE(network_frame_fits_smallest_ring) {
+  test_prefix prefix{"frame"};
+  prefix.channels = {"c"};
+  boost::asio::io_service io;
+  auto client = sv::rtm::new_shm_client(io, std::this_thread::get_id(), prefix.prefix,
+                                        sv::rtm::min_shm_ring_bytes);
+  BOOST_TEST(!client->start());
+
+  sv::encoded_frame frame;
+  frame.data = std::string(3 * sv::max_payload_size, 'x');
+  frame.key_frame = true;
+  collecting_callbacks callbacks;
+  for (auto &nf : frame.to_network(sv::payload_encoding::BINARY)) {
+    client->publish("c", std::move(nf).to_json(), &callbacks, sv::rtm::publish_options{});
+  }
+  run_until(io, [&]() { return callbacks.oks == 3; });
+  BOOST_TEST(callbacks.errors == 0);
+  BOOST_TEST(!client->stop());
+}
+
+BOOST_AUTO_TEST_CASE(last_client_removes_ring) {
+  test_prefix prefix{"remove"};
+  prefix.channels = {"c"};
+  const std::string name = sv::rtm::shm_object_name(prefix.prefix, "c");
+  auto exists = [&name]() {
+    const int fd = shm_open(name.c_str(), O_RDONLY, 0600);
+    if (fd < 0) {
+      return false;
+    }
+    close(fd);
+    return true;
+  };
+
+  boost::asio::io_service io;
+  auto publisher = sv::rtm::new_shm_client(io, std::this_thread::get_id(), prefix.prefix,
+                                           sv::rtm::min_shm_ring_bytes);
+  auto subscriber = sv::rtm::new_shm_client(io, std::this_thread::get_id(),
+                                            prefix.prefix, sv::rtm::min_shm_ring_bytes);
+  BOOST_TEST(!publisher->start());
+  BOOST_TEST(!subscriber->start());
+
+  collecting_callbacks callbacks;
+  sv::rtm::subscription sub;
+  subscriber->subscribe("c", sub, callbacks, nullptr, nullptr);
+  publisher->publish("c", {{"i", 1}}, nullptr, sv::rtm::publish_options{});
+  run_until(io, [&]() { return callbacks.payloads.size() == 1; });
+  BOOST_TEST(exists());
+
+  BOOST_TEST(!publisher->stop());
+  BOOST_TEST(exists());
+  BOOST_TEST(!subscriber->stop());
+  BOOST_TEST(!exists());
+
+  // the next client starts over with a new ring.
+  BOOST_TEST(!publisher->start());
+  publisher->publish("c", {{"i", 2}}, nullptr, sv::rtm::publish_options{});
+  BOOST_TEST(exists());
+  publisher.reset();
+  BOOST_TEST(!exists());
+}
+
+BOOST_AUTO_TEST_CASE(deliveries_are_bounded) {
+  test_prefix prefix{"bounded"};
+  prefix.channels = {"c"};
+  boost::asio::io_service io;
+  auto publisher = sv::rtm::new_shm_client(io, std::this_thread::get_id(), prefix.prefix,
+                                           sv::rtm::min_shm_ring_bytes);
+  auto subscriber = sv::rtm::new_shm_client(io, std::this_thread::get_id(),
+                                            prefix.prefix, sv::rtm::min_shm_ring_bytes);
+  BOOST_TEST(!subscriber->start());
+
+  collecting_callbacks callbacks;
+  sv::rtm::subscription sub;
+  subscriber->subscribe("c", sub, callbacks, nullptr, nullptr);
+  for (int i = 0; i < 1000; i++) {
+    publisher->publish("c", {{"i", i}}, nullptr, sv::rtm::publish_options{});
+  }
+
+  // loop isn't running, so the poll thread stops once enough messages are posted.
+  std::this_thread::sleep_for(std::chrono::milliseconds{50});
+  io.restart();
+  BOOST_TEST(io.poll() <= 256);
+  run_until(io, [&]() { return callbacks.payloads.size() == 1000; });
+  BOOST_TEST(callbacks.payloads.back()["i"] == 999);
+
+  BOOST_TEST(!subscriber->stop());
+}
+
+BOOST_AUTO_TEST_CASE(slow_subscriber_skips_to_newest) {
+  test_prefix prefix{"overrun"};
+  prefix.channels = {"c"};
+  boost::asio::io_service io;
+  auto publisher = sv::rtm::new_shm_client(io, std::this_thread::get_id(), prefix.prefix,
+                                           sv::rtm::min_shm_ring_bytes);
+  auto subscriber = sv::rtm::new_shm_client(io, std::this_thread::get_id(),
+                                            prefix.prefix, sv::rtm::min_shm_ring_bytes);
+
+  // subscriber isn't polling yet, so the ring wraps over its position.
+  collecting_callbacks callbacks;
+  sv::rtm::subscription sub;
+  subscriber->subscribe("c", sub, callbacks, nullptr, nullptr);
+  for (int i = 0; i < 1000; i++) {
+    publisher->publish("c", {{"i", i}, {"d", std::string(1000, 'x')}}, nullptr,
+                       sv::rtm::publish_options{});
+  }
+  BOOST_TEST(!subscriber->start());
+  // messages published before subscriber skips are skipped too, so keep publishing.
+  run_until(io, [&]() {
+    publisher->publish("c", {{"i", 1000}}, nullptr, sv::rtm::publish_options{});
+    return !callbacks.payloads.empty() && callbacks.payloads.back()["i"] == 1000;
+  });
+  BOOST_TEST(callbacks.payloads.size() < 1000);
+
+  BOOST_TEST(!subscriber->stop());
+}
@@ -3,15 +3,22 @@
 #define BOOST_TEST_ALTERNATIVE_INIT_API
 #include <boost/test/included/unit_test.hpp>
 
+#include <atomic>
 #include <chrono>
 #include <limits>
 #include <memory>
+#include <queue>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "logging_impl.h"
 #include "streams/asio_streams.h"
+#include "streams/breaker.h"
+#include "streams/fan_out.h"
+#include "streams/parallel_map.h"
+#include "streams/profile.h"
+#include "streams/spsc_queue.h"
 #include "streams/streams.h"
 #include "streams/threaded_worker.h"
 
@@ -106,6 +113,98 @@ BOOST_AUTO_TEST_CASE(map) {
   BOOST_TEST(events(std::move(p)) == strings({"4", "9", "16", "."}));
 }
 
+// metrics of profiled stage, families return existing series for the same labels.
+struct stage_metrics {
+  explicit stage_metrics(const std::string &stage)
+      : elements(streams::impl::stream_stage_elements_total().Add({{"stage", stage}})),
+        requested(streams::impl::stream_stage_requested().Add({{"stage", stage}})),
+        on_next_micros(streams::impl::stream_stage_on_next_micros().Add(
+            {{"stage", stage}}, std::vector<double>{})) {}
+
+  uint64_t on_next_calls() const {
+    return on_next_micros.Collect().histogram.sample_count;
+  }
+
+  prometheus::Counter &elements;
+  prometheus::Gauge &requested;
+  prometheus::Histogram &on_next_micros;
+};
+
+BOOST_AUTO_TEST_CASE(profile) {
+  auto p = streams::publishers::range(1, 4) >> streams::profile("profile");
+  BOOST_TEST(events(std::move(p)) == strings({"1", "2", "3", "."}));
+
+  stage_metrics metrics{"profile"};
+  BOOST_TEST(metrics.elements.Value() == 3);
+  BOOST_TEST(metrics.on_next_calls() == 3);
+  BOOST_TEST(metrics.requested.Value() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(profile_cancel) {
+  auto p = streams::publishers::range(1, 300000000) >> streams::profile("profile_cancel")
+           >> streams::take(2);
+  BOOST_TEST(events(std::move(p)) == strings({"1", "2", "."}));
+
+  stage_metrics metrics{"profile_cancel"};
+  BOOST_TEST(metrics.elements.Value() == 2);
+  BOOST_TEST(metrics.on_next_calls() == 2);
+  // credit that was never delivered is given back on cancel.
+  BOOST_TEST(metrics.requested.Value() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(profile_waits_for_credit) {
+  struct lazy_sink : streams::subscriber<int> {
+    void on_subscribe(streams::subscription &s) override { src = &s; }
+    void on_next(int && /*i*/) override {}
+    void on_error(std::error_condition /*ec*/) override {}
+    void on_complete() override { done = true; }
+
+    streams::subscription *src{nullptr};
+    bool done{false};
+  };
+
+  stage_metrics metrics{"profile_credit"};
+  lazy_sink sink;
+  auto p = streams::publishers::range(0, 10) >> streams::profile("profile_credit");
+  p->subscribe(sink);
+  BOOST_TEST_REQUIRE(sink.src);
+  BOOST_TEST(metrics.requested.Value() == 0);
+
+  sink.src->request(4);
+  BOOST_TEST(metrics.elements.Value() == 4);
+  BOOST_TEST(metrics.on_next_calls() == 4);
+  BOOST_TEST(metrics.requested.Value() == 0);
+
+  sink.src->request(100);
+  BOOST_TEST(sink.done);
+  BOOST_TEST(metrics.elements.Value() == 10);
+  BOOST_TEST(metrics.on_next_calls() == 10);
+}
+
+BOOST_AUTO_TEST_CASE(fused_map) {
+  auto square = [](int i) { return i * i; };
+  auto p = streams::publishers::range(2, 5)
+           >> (streams::map(square) >> streams::map([](int i) { return i + 1; })
+               >> streams::map([n = 0](int i) mutable { return i + n++; }));
+  BOOST_TEST(events(std::move(p)) == strings({"5", "11", "19", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(filter_map) {
+  auto p = streams::publishers::range(1, 8) >> streams::filter_map([](int i) {
+             return i % 3 == 0 ? boost::none : boost::make_optional(i * i);
+           });
+  BOOST_TEST(events(std::move(p)) == strings({"1", "4", "16", "25", "49", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(filter_map_take) {
+  auto p = streams::publishers::range(1, 300000000)
+           >> streams::filter_map([](int i) {
+               return i % 2 == 0 ? boost::make_optional(i) : boost::none;
+             })
+           >> streams::take(3);
+  BOOST_TEST(events(std::move(p)) == strings({"2", "4", "6", "."}));
+}
+
 BOOST_AUTO_TEST_CASE(flat_map) {
   LOG_SCOPE_FUNCTION(ERROR);
   auto idx = streams::publishers::range(1, 4);
@@ -225,6 +324,301 @@ BOOST_AUTO_TEST_CASE(threaded_worker_cancel) {
   BOOST_TEST(events(std::move(p)) == strings({"1", "2", "3", "."}));
 }
 
+BOOST_AUTO_TEST_CASE(executor_tasks) {
+  std::atomic<int> counter{0};
+  {
+    streams::executor exec{"test_exec", 3};
+    for (int i = 0; i < 1000; i++) {
+      exec.post([&counter, &exec]() {
+        counter++;
+        // tasks posted from executor threads
+        exec.post([&counter]() { counter++; });
+      });
+    }
+  }
+  BOOST_TEST(counter == 2000);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_worker_executor) {
+  streams::executor exec{"test_exec", 2};
+  auto p = streams::publishers::range(1, 5) >> streams::threaded_worker(exec, "test")
+           >> streams::flatten();
+  BOOST_TEST(events(std::move(p)) == strings({"1", "2", "3", "4", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(threaded_worker_executor_cancel) {
+  streams::executor exec{"test_exec", 2};
+  auto p = streams::publishers::range(1, 5) >> streams::threaded_worker(exec, "test")
+           >> streams::flatten() >> streams::take(3);
+  BOOST_TEST(events(std::move(p)) == strings({"1", "2", "3", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(threaded_worker_executor_chain) {
+  // more stages than executor threads
+  streams::executor exec{"test_exec", 2};
+  auto p = streams::publishers::range(1, 5);
+  for (int i = 0; i < 5; i++) {
+    p = std::move(p) >> streams::threaded_worker(exec, "test") >> streams::flatten();
+  }
+  BOOST_TEST(events(std::move(p)) == strings({"1", "2", "3", "4", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(threaded_worker_executor_subscribes_on_calling_thread) {
+  streams::executor exec{"test_exec", 2};
+  std::thread::id subscribe_thread;
+  auto p = streams::generators<int>::stateful(
+               [&subscribe_thread]() {
+                 subscribe_thread = std::this_thread::get_id();
+                 return new int{1};
+               },
+               [](int *i, streams::observer<int> &sink) {
+                 if (*i == 3) {
+                   sink.on_complete();
+                   return false;
+                 }
+                 sink.on_next((*i)++);
+                 return true;
+               })
+           >> streams::threaded_worker(exec, "test") >> streams::flatten();
+  BOOST_TEST(events(std::move(p)) == strings({"1", "2", "."}));
+  BOOST_TEST((subscribe_thread == std::this_thread::get_id()));
+}
+
+BOOST_AUTO_TEST_CASE(threaded_worker_bounded) {
+  LOG_SCOPE_FUNCTION(0);
+  auto p = streams::publishers::range(1, 5) >> streams::threaded_worker("test", 10)
+           >> streams::flatten();
+  BOOST_TEST(events(std::move(p)) == strings({"1", "2", "3", "4", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(threaded_worker_bounded_cancel) {
+  LOG_SCOPE_FUNCTION(0);
+  auto p = streams::publishers::range(1, 5) >> streams::threaded_worker("test", 10)
+           >> streams::flatten() >> streams::take(3);
+  BOOST_TEST(events(std::move(p)) == strings({"1", "2", "3", "."}));
+}
+
+// requests elements only after upstream has finished, so overflow policy
+// decides what is left in worker queue.
+template <typename T>
+std::vector<T> overflow_events(
+    streams::publisher<T> &&src, size_t max_queued_frames,
+    streams::overflow_policy policy,
+    const std::shared_ptr<streams::queue_depth> &depth = nullptr) {
+  struct lazy_sink : streams::subscriber<std::queue<T>> {
+    void on_subscribe(streams::subscription &s) override { src = &s; }
+
+    void on_next(std::queue<T> &&q) override {
+      while (!q.empty()) {
+        items.push_back(q.front());
+        q.pop();
+      }
+      src->request(1);
+    }
+
+    void on_error(std::error_condition /*ec*/) override { done = true; }
+
+    void on_complete() override { done = true; }
+
+    streams::subscription *src{nullptr};
+    std::vector<T> items;
+    std::atomic_bool done{false};
+  };
+
+  lazy_sink sink;
+  auto p = std::move(src)
+           >> streams::threaded_worker("test", max_queued_frames, policy, depth);
+  p->subscribe(sink);
+  BOOST_REQUIRE(sink.src);
+  if (depth) {
+    // nothing was requested yet, so queue is full.
+    BOOST_TEST(depth->load() == max_queued_frames);
+  }
+  sink.src->request(1);
+  while (!sink.done) {
+    std::this_thread::sleep_for(1ms);
+  }
+  if (depth) {
+    BOOST_TEST(depth->load() == 0);
+  }
+  return sink.items;
+}
+
+struct test_frame {
+  int i;
+  bool key;
+};
+
+bool is_key_frame(const test_frame &f) { return f.key; }
+
+BOOST_AUTO_TEST_CASE(threaded_worker_drop_newest) {
+  auto items = overflow_events(streams::publishers::range(1, 10), 3,
+                               streams::overflow_policy::DROP_NEWEST);
+  BOOST_TEST(items == std::vector<int>({1, 2, 3}));
+}
+
+BOOST_AUTO_TEST_CASE(threaded_worker_drop_oldest) {
+  auto items = overflow_events(streams::publishers::range(1, 10), 3,
+                               streams::overflow_policy::DROP_OLDEST);
+  BOOST_TEST(items == std::vector<int>({7, 8, 9}));
+}
+
+BOOST_AUTO_TEST_CASE(threaded_worker_queue_depth) {
+  for (auto policy :
+       {streams::overflow_policy::DROP_NEWEST, streams::overflow_policy::DROP_OLDEST}) {
+    auto depth = std::make_shared<streams::queue_depth>(0);
+    auto items = overflow_events(streams::publishers::range(1, 10), 3, policy, depth);
+    BOOST_TEST(items.size() == 3);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(threaded_worker_coalesce_to_latest) {
+  auto items = overflow_events(streams::publishers::range(1, 10), 3,
+                               streams::overflow_policy::COALESCE_TO_LATEST);
+  BOOST_TEST(items == std::vector<int>({7, 8, 9}));
+  items = overflow_events(streams::publishers::range(1, 9), 3,
+                          streams::overflow_policy::COALESCE_TO_LATEST);
+  BOOST_TEST(items == std::vector<int>({7, 8}));
+}
+
+BOOST_AUTO_TEST_CASE(threaded_worker_drop_until_key_frame) {
+  std::vector<test_frame> frames{{1, true},  {2, false}, {3, false}, {4, false},
+                                 {5, false}, {6, true},  {7, false}, {8, false}};
+  auto items = overflow_events(streams::publishers::of(std::move(frames)), 3,
+                               streams::overflow_policy::DROP_UNTIL_KEY_FRAME);
+  std::vector<int> ids;
+  for (const auto &f : items) {
+    ids.push_back(f.i);
+  }
+  BOOST_TEST(ids == std::vector<int>({6, 7, 8}));
+}
+
+BOOST_AUTO_TEST_CASE(overflow_policy_names) {
+  for (auto policy : {streams::overflow_policy::DROP_NEWEST,
+                      streams::overflow_policy::DROP_OLDEST,
+                      streams::overflow_policy::DROP_UNTIL_KEY_FRAME,
+                      streams::overflow_policy::COALESCE_TO_LATEST}) {
+    BOOST_TEST((streams::parse_overflow_policy(streams::to_string(policy)) == policy));
+  }
+  BOOST_TEST(!streams::parse_overflow_policy("drop-everything"));
+}
+
+BOOST_AUTO_TEST_CASE(spsc_queue_full) {
+  streams::spsc_queue<std::string> q(2);
+  BOOST_TEST(q.empty());
+  BOOST_TEST(q.try_push("a"));
+  BOOST_TEST(q.try_push("b"));
+  BOOST_TEST(!q.try_push("c"));
+  BOOST_TEST(q.size() == 2);
+
+  std::string s;
+  BOOST_TEST(q.try_pop(s));
+  BOOST_TEST(s == "a");
+  BOOST_TEST(q.try_push("d"));
+
+  std::vector<std::string> rest;
+  BOOST_TEST(q.consume_all([&rest](std::string &&s) { rest.push_back(s); }) == 2);
+  BOOST_TEST(rest == strings({"b", "d"}));
+  BOOST_TEST(!q.try_pop(s));
+}
+
+BOOST_AUTO_TEST_CASE(spsc_queue_threads) {
+  constexpr int n = 100000;
+  streams::spsc_queue<int> q(16);
+  std::thread producer{[&q]() {
+    for (int i = 0; i < n; i++) {
+      while (!q.try_push(int{i})) {
+        std::this_thread::yield();
+      }
+    }
+  }};
+
+  int expected = 0;
+  while (expected < n) {
+    int i;
+    if (q.try_pop(i)) {
+      BOOST_REQUIRE(i == expected);
+      expected++;
+    }
+  }
+  producer.join();
+  BOOST_TEST(q.empty());
+}
+
+BOOST_AUTO_TEST_CASE(parallel_map) {
+  auto p = streams::publishers::range(0, 100) >> streams::parallel_map(4, [](int i) {
+             // make later elements finish earlier
+             std::this_thread::sleep_for(std::chrono::microseconds(100 * (10 - i % 10)));
+             return i * i;
+           });
+
+  std::vector<std::string> expected;
+  for (int i = 0; i < 100; i++) {
+    expected.push_back(std::to_string(i * i));
+  }
+  expected.emplace_back(".");
+  BOOST_TEST(events(std::move(p)) == expected);
+}
+
+BOOST_AUTO_TEST_CASE(parallel_map_cancel) {
+  auto p = streams::publishers::range(1, 300000000)
+           >> streams::parallel_map(3, [](int i) { return i * 2; }) >> streams::take(3);
+  BOOST_TEST(events(std::move(p)) == strings({"2", "4", "6", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(parallel_map_empty) {
+  auto p = streams::publishers::empty<int>()
+           >> streams::parallel_map(2, [](int i) { return i; });
+  BOOST_TEST(events(std::move(p)) == strings({"."}));
+}
+
+BOOST_AUTO_TEST_CASE(parallel_map_error) {
+  auto p = streams::publishers::error<int>(std::errc::not_supported)
+           >> streams::parallel_map(2, [](int i) { return i; });
+  BOOST_TEST(events(std::move(p)) == strings({"error:Operation not supported"}));
+}
+
+BOOST_AUTO_TEST_CASE(parallel_map_delivers_on_calling_thread) {
+  const std::thread::id caller = std::this_thread::get_id();
+  std::atomic<int> foreign_calls{0};
+  auto check_thread = [caller, &foreign_calls]() {
+    if (std::this_thread::get_id() != caller) {
+      foreign_calls++;
+    }
+  };
+
+  auto p = streams::publishers::range(0, 50) >> streams::map([check_thread](int i) {
+             check_thread();
+             return i;
+           })
+           >> streams::parallel_map(3,
+                                    [](int i) {
+                                      std::this_thread::sleep_for(
+                                          std::chrono::microseconds(50 * (i % 7)));
+                                      return i + 1;
+                                    })
+           >> streams::map([check_thread](int i) {
+               check_thread();
+               return i;
+             });
+
+  std::vector<std::string> expected;
+  for (int i = 1; i <= 50; i++) {
+    expected.push_back(std::to_string(i));
+  }
+  expected.emplace_back(".");
+  BOOST_TEST(events(std::move(p)) == expected);
+  BOOST_TEST(foreign_calls == 0);
+}
+
+BOOST_AUTO_TEST_CASE(parallel_map_non_const_functor) {
+  struct doubler {
+    int operator()(int i) { return i * 2; }
+  };
+  auto p = streams::publishers::range(0, 3) >> streams::parallel_map(2, doubler{});
+  BOOST_TEST(events(std::move(p)) == strings({"0", "2", "4", "."}));
+}
+
 BOOST_AUTO_TEST_CASE(async_cancel) {
   LOG_SCOPE_FUNCTION(0);
   struct async_source {
@@ -316,6 +710,59 @@ BOOST_AUTO_TEST_CASE(collector_asio) {
   BOOST_TEST(terminated);
 }
 
+BOOST_AUTO_TEST_CASE(breaker_trigger) {
+  boost::asio::io_service io_service;
+  auto b = std::make_shared<streams::breaker>();
+  bool terminated = false;
+  std::vector<int> items;
+  auto p = streams::publishers::range(1, 300000000)
+           >> streams::asio::interval<int>(io_service, 5ms) >> streams::break_on(b)
+           >> streams::do_finally([&terminated]() { terminated = true; });
+  auto when_done = p->process([&io_service, &items, b](int &&i) {
+    items.push_back(i);
+    if (i == 3) {
+      io_service.post([b]() { b->trigger(); });
+    }
+  });
+
+  run_wait(io_service, when_done);
+  BOOST_TEST(items == std::vector<int>({1, 2, 3}));
+  BOOST_TEST(b->triggered());
+  BOOST_TEST(terminated);
+}
+
+BOOST_AUTO_TEST_CASE(fan_out) {
+  auto streams = streams::fan_out(streams::publishers::range(1, 4), 2);
+  std::vector<int> first;
+  std::vector<int> second;
+  auto second_done = streams[1]->process([&second](int &&i) { second.push_back(i); });
+  BOOST_TEST(second.empty());
+  auto first_done = streams[0]->process([&first](int &&i) { first.push_back(i); });
+  BOOST_TEST(first_done.ok());
+  BOOST_TEST(second_done.ok());
+  BOOST_TEST(first == std::vector<int>({1, 2, 3}));
+  BOOST_TEST(second == std::vector<int>({1, 2, 3}));
+}
+
+BOOST_AUTO_TEST_CASE(fan_out_cancel) {
+  bool source_done = false;
+  auto streams = streams::fan_out(
+      streams::publishers::range(1, 10)
+          >> streams::do_finally([&source_done]() { source_done = true; }),
+      2);
+  std::vector<int> first;
+  std::vector<int> second;
+  auto first_done = (std::move(streams[0]) >> streams::take(2))
+                        ->process([&first](int &&i) { first.push_back(i); });
+  auto second_done = (std::move(streams[1]) >> streams::take(4))
+                         ->process([&second](int &&i) { second.push_back(i); });
+  BOOST_TEST(first_done.ok());
+  BOOST_TEST(second_done.ok());
+  BOOST_TEST(first == std::vector<int>({1, 2}));
+  BOOST_TEST(second == std::vector<int>({1, 2, 3, 4}));
+  BOOST_TEST(source_done);
+}
+
 BOOST_AUTO_TEST_CASE(merge) {
   auto p1 = streams::publishers::range(1, 3);
   auto p2 = streams::publishers::range(3, 6);
@@ -356,6 +803,136 @@ BOOST_AUTO_TEST_CASE(merge_with_both_empty) {
   BOOST_TEST(e == strings({"."}));
 }
 
+namespace {
+// publisher which ignores requests and lets the test push elements directly.
+struct manual_source : streams::publisher_impl<int>, streams::subscription {
+  void subscribe(streams::subscriber<int> &s) override {
+    sink = &s;
+    s.on_subscribe(*this);
+  }
+  void request(int /*n*/) override {}
+  void cancel() override {}
+
+  streams::subscriber<int> *sink{nullptr};
+};
+
+struct manual_sink : streams::subscriber<int> {
+  void on_next(int &&t) override { items.push_back(t); }
+  void on_error(std::error_condition /*ec*/) override {}
+  void on_complete() override { complete = true; }
+  void on_subscribe(streams::subscription &s) override { src = &s; }
+
+  streams::subscription *src{nullptr};
+  std::vector<int> items;
+  bool complete{false};
+};
+
+std::vector<int> merge_buffered(bool prioritized) {
+  auto high = new manual_source();
+  auto low = new manual_source();
+  auto p = prioritized ? streams::publishers::merge_prioritized(
+                             streams::publisher<int>(high), streams::publisher<int>(low))
+                       : streams::publishers::merge(streams::publisher<int>(high),
+                                                    streams::publisher<int>(low));
+  manual_sink sink;
+  p->subscribe(sink);
+
+  low->sink->on_next(1);
+  low->sink->on_next(2);
+  high->sink->on_next(10);
+  low->sink->on_next(3);
+  high->sink->on_next(11);
+  sink.src->request(5);
+
+  high->sink->on_complete();
+  low->sink->on_complete();
+  BOOST_TEST(sink.complete);
+  return sink.items;
+}
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(merge_buffered_order) {
+  std::vector<int> expected{1, 2, 10, 3, 11};
+  BOOST_TEST(merge_buffered(false) == expected);
+}
+
+BOOST_AUTO_TEST_CASE(merge_prioritized_order) {
+  std::vector<int> expected{10, 11, 1, 2, 3};
+  BOOST_TEST(merge_buffered(true) == expected);
+}
+
+BOOST_AUTO_TEST_CASE(merge_prioritized_sync) {
+  auto p = streams::publishers::merge_prioritized(streams::publishers::range(1, 3),
+                                                  streams::publishers::range(3, 6));
+  auto e = events(std::move(p));
+  std::sort(e.begin(), e.end());
+  BOOST_TEST(e == strings({".", "1", "2", "3", "4", "5"}));
+}
+
+// like bot control channel, which never completes and is broken once frames end.
+BOOST_AUTO_TEST_CASE(merge_prioritized_breaks_endless_source) {
+  auto control = new manual_source();
+  auto b = std::make_shared<streams::breaker>();
+  bool finished = false;
+  auto p = streams::publishers::merge_prioritized(
+               streams::publisher<int>(control) >> streams::break_on(b),
+               streams::publishers::range(1, 4)
+                   >> streams::do_finally([b]() { b->trigger(); }))
+           >> streams::do_finally([&finished]() { finished = true; });
+
+  BOOST_TEST(events(std::move(p)) == strings({"1", "2", "3", "."}));
+  BOOST_TEST(b->triggered());
+  BOOST_TEST(finished);
+}
+
+BOOST_AUTO_TEST_CASE(request_window_credit) {
+  struct recording_subscription : streams::subscription {
+    void request(int n) override { requests.push_back(n); }
+    void cancel() override {}
+    std::vector<int> requests;
+  };
+
+  recording_subscription s;
+  streams::request_window w{8};
+  w.start(s);
+  for (int i = 0; i < 3; i++) {
+    w.on_consumed();
+  }
+  BOOST_TEST(s.requests == std::vector<int>({8}));
+  w.on_consumed();
+  BOOST_TEST(s.requests == std::vector<int>({8, 4}));
+}
+
+namespace {
+struct window_sink : streams::subscriber<int> {
+  explicit window_sink(int window_size) : window(window_size) {}
+
+  void on_next(int && /*t*/) override {
+    count++;
+    window.on_consumed();
+  }
+  void on_error(std::error_condition /*ec*/) override {}
+  void on_complete() override { complete = true; }
+  void on_subscribe(streams::subscription &s) override { window.start(s); }
+
+  streams::request_window window;
+  long count{0};
+  bool complete{false};
+};
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(request_window_delivers_all) {
+  constexpr int n = 1000;
+  for (int window_size : {1, 3, 64}) {
+    auto p =
+        streams::publishers::range(0, n) >> streams::map([](int i) { return i + 1; });
+    window_sink sink{window_size};
+    p->subscribe(sink);
+    BOOST_TEST(sink.complete);
+    BOOST_TEST(sink.count == n);
+  }
+}
+
 BOOST_AUTO_TEST_CASE(timeout_ok) {
   LOG_SCOPE_FUNCTION(INFO);
   boost::asio::io_service io_service;
@@ -375,6 +952,108 @@ BOOST_AUTO_TEST_CASE(timeout_err) {
   BOOST_TEST(e == strings({"1", "error:timeout"}));
 }
 
+namespace {
+// folds batch digits into a single number to make batches visible in events.
+int digits(std::queue<int> &&batch) {
+  int result = 0;
+  for (; !batch.empty(); batch.pop()) {
+    result = result * 10 + batch.front();
+  }
+  return result;
+}
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(buffer_by_count) {
+  boost::asio::io_service io_service;
+  auto p = streams::publishers::range(1, 8) >> streams::asio::buffer(io_service, 3, 1h)
+           >> streams::map(&digits);
+  auto e = events(std::move(p), &io_service);
+  BOOST_TEST(e == strings({"123", "456", "7", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(buffer_by_time) {
+  boost::asio::io_service io_service;
+  auto p = streams::publishers::range(1, 4)
+           >> streams::asio::interval<int>(io_service, 50ms)
+           >> streams::asio::buffer(io_service, 10, 10ms) >> streams::map(&digits);
+  auto e = events(std::move(p), &io_service);
+  BOOST_TEST(e == strings({"1", "2", "3", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(buffer_cancel) {
+  boost::asio::io_service io_service;
+  auto p = streams::publishers::range(1, 300000000)
+           >> streams::asio::buffer(io_service, 4, 1h) >> streams::map(&digits)
+           >> streams::take(2);
+  auto e = events(std::move(p), &io_service);
+  BOOST_TEST(e == strings({"1234", "5678", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(buffer_empty) {
+  boost::asio::io_service io_service;
+  auto p = streams::publishers::empty<int>() >> streams::asio::buffer(io_service, 4, 1h)
+           >> streams::map(&digits);
+  auto e = events(std::move(p), &io_service);
+  BOOST_TEST(e == strings({"."}));
+}
+
+BOOST_AUTO_TEST_CASE(buffer_error) {
+  boost::asio::io_service io_service;
+  auto p = streams::publishers::concat(
+               streams::publishers::range(1, 3),
+               streams::publishers::error<int>(std::errc::not_supported))
+           >> streams::asio::buffer(io_service, 4, 1h) >> streams::map(&digits);
+  auto e = events(std::move(p), &io_service);
+  BOOST_TEST(e == strings({"12", "error:Operation not supported"}));
+}
+
+BOOST_AUTO_TEST_CASE(throttle) {
+  boost::asio::io_service io_service;
+  auto p = streams::publishers::range(1, 11)
+           >> streams::asio::interval<int>(io_service, 20ms)
+           >> streams::asio::throttle(io_service, 50ms);
+  auto e = events(std::move(p), &io_service);
+  BOOST_TEST(e == strings({"1", "4", "7", "10", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(throttle_cancel) {
+  boost::asio::io_service io_service;
+  auto p = streams::publishers::range(1, 300000000)
+           >> streams::asio::interval<int>(io_service, 20ms)
+           >> streams::asio::throttle(io_service, 50ms) >> streams::take(2);
+  auto e = events(std::move(p), &io_service);
+  BOOST_TEST(e == strings({"1", "4", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(sample) {
+  boost::asio::io_service io_service;
+  auto p = streams::publishers::range(1, 11)
+           >> streams::asio::interval<int>(io_service, 20ms)
+           >> streams::asio::sample(io_service, 50ms);
+  auto e = events(std::move(p), &io_service);
+  BOOST_TEST(e == strings({"3", "6", "9", "10", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(debounce) {
+  boost::asio::io_service io_service;
+  auto p = streams::publishers::range(1, 6)
+           >> streams::asio::delay(io_service,
+                                   [](const int &i) { return i == 4 ? 100ms : 10ms; })
+           >> streams::asio::debounce(io_service, 50ms);
+  auto e = events(std::move(p), &io_service);
+  BOOST_TEST(e == strings({"3", "5", "."}));
+}
+
+BOOST_AUTO_TEST_CASE(debounce_error) {
+  boost::asio::io_service io_service;
+  auto p = streams::publishers::concat(
+               streams::publishers::range(1, 3),
+               streams::publishers::error<int>(std::errc::not_supported))
+           >> streams::asio::debounce(io_service, 1h);
+  auto e = events(std::move(p), &io_service);
+  BOOST_TEST(e == strings({"2", "error:Operation not supported"}));
+}
+
 int main(int argc, char *argv[]) {
   init_logging(argc, argv);
   return boost::unit_test::unit_test_main(init_unit_test, argc, argv);
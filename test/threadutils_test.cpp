@@ -1,6 +1,9 @@
 #define BOOST_TEST_MODULE ThreadUtilsTest
 #include <boost/test/included/unit_test.hpp>
 
+#include <thread>
+#include <vector>
+
 #include "threadutils.h"
 
 namespace sv = satori::video;
@@ -17,3 +20,24 @@ BOOST_AUTO_TEST_CASE(long_name) {
   sv::threadutils::set_current_thread_name("asdfasdfasdfasdf");
   BOOST_CHECK_EQUAL("asdfasdfasdfasd", sv::threadutils::get_current_thread_name());
 }
+
+BOOST_AUTO_TEST_CASE(parse_cpu_list) {
+  BOOST_CHECK((std::vector<int>{0, 1, 2, 3, 8, 10, 11})
+              == sv::threadutils::parse_cpu_list("0-3,8,10-11"));
+  BOOST_CHECK((std::vector<int>{5}) == sv::threadutils::parse_cpu_list("5"));
+  BOOST_CHECK(sv::threadutils::parse_cpu_list("3-1").empty());
+  BOOST_CHECK(sv::threadutils::parse_cpu_list("1-").empty());
+  BOOST_CHECK(sv::threadutils::parse_cpu_list("a,b").empty());
+}
+
+BOOST_AUTO_TEST_CASE(affinity) {
+  BOOST_CHECK(sv::threadutils::numa_node_count() >= 1);
+  BOOST_CHECK(sv::threadutils::set_current_thread_affinity({}));
+#if defined(__linux__)
+  bool pinned = false;
+  std::thread t(
+      [&pinned]() { pinned = sv::threadutils::set_current_thread_affinity({0}); });
+  t.join();
+  BOOST_CHECK(pinned);
+#endif
+}
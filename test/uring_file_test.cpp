@@ -0,0 +1,111 @@
+#define BOOST_TEST_MODULE UringFileTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include "uring_file.h"
+
+namespace sv = satori::video;
+namespace fs = boost::filesystem;
+
+namespace {
+
+std::string read_file(const fs::path &path) {
+  std::ifstream in(path.string(), std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+int write(sv::uring_file &file, const std::string &data) {
+  return file.write(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+}
+
+// pattern which differs between blocks, so misplaced blocks are caught.
+std::string pattern(size_t size) {
+  std::string result(size, 0);
+  for (size_t i = 0; i < size; i++) {
+    result[i] = static_cast<char>('a' + (i / 1000 + i) % 26);
+  }
+  return result;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(sequential_writes) {
+  for (bool direct : {false, true}) {
+    const fs::path path = fs::unique_path("uring-file-%%%%-%%%%.bin");
+    sv::uring_file_options options;
+    options.direct = direct;
+    options.buffer_size = 2 * sv::uring_file::block_size;
+    options.queue_depth = 2;
+
+    const std::string data = pattern(10 * options.buffer_size + 123);
+    {
+      sv::uring_file file{path.string(), options};
+      // writes of odd sizes cross buffers.
+      for (size_t i = 0; i < data.size(); i += 3001) {
+        BOOST_CHECK_EQUAL(0, write(file, data.substr(i, 3001)));
+      }
+      BOOST_CHECK_EQUAL(data.size(), file.size());
+      BOOST_CHECK_EQUAL(0, file.close());
+    }
+
+    BOOST_CHECK(data == read_file(path));
+    fs::remove(path);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(patches_behind_buffer) {
+  for (bool direct : {false, true}) {
+    const fs::path path = fs::unique_path("uring-file-%%%%-%%%%.bin");
+    sv::uring_file_options options;
+    options.direct = direct;
+    options.buffer_size = sv::uring_file::block_size;
+    options.queue_depth = 3;
+
+    std::string expected = pattern(5 * options.buffer_size + 10);
+    {
+      sv::uring_file file{path.string(), options};
+      BOOST_CHECK_EQUAL(0, write(file, expected));
+
+      // like a muxer rewriting a header, then the tail, then going on.
+      BOOST_CHECK_EQUAL(100, file.seek(100, SEEK_SET));
+      BOOST_CHECK_EQUAL(0, write(file, std::string(5000, 'H')));
+      expected.replace(100, 5000, std::string(5000, 'H'));
+      BOOST_CHECK_EQUAL(expected.size() - 4, file.seek(-4, SEEK_END));
+      BOOST_CHECK_EQUAL(0, write(file, "tail and more"));
+      expected.replace(expected.size() - 4, 4, "tail and more");
+
+      BOOST_CHECK(file.seek(1, SEEK_END) < 0);
+      BOOST_CHECK_EQUAL(expected.size(), file.size());
+    }
+
+    BOOST_CHECK(expected == read_file(path));
+    fs::remove(path);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(write_of_many_buffers) {
+  for (bool direct : {false, true}) {
+    const fs::path path = fs::unique_path("uring-file-%%%%-%%%%.bin");
+    sv::uring_file_options options;
+    options.direct = direct;
+    options.buffer_size = sv::uring_file::block_size;
+    options.queue_depth = 4;
+
+    // first write fills every buffer in one batch, second one wraps around them.
+    const std::string data = pattern(15 * options.buffer_size + 7);
+    {
+      sv::uring_file file{path.string(), options};
+      BOOST_CHECK_EQUAL(0, write(file, data.substr(0, 4 * options.buffer_size)));
+      BOOST_CHECK_EQUAL(0, write(file, data.substr(4 * options.buffer_size)));
+      BOOST_CHECK_EQUAL(0, file.close());
+    }
+
+    BOOST_CHECK(data == read_file(path));
+    fs::remove(path);
+  }
+}
@@ -0,0 +1,239 @@
+#define BOOST_TEST_MODULE V4l2CaptureTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <linux/videodev2.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "v4l2_capture.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+constexpr uint32_t max_buffers = 4;
+constexpr uint32_t buffer_size = 4096;
+
+// Emulates capture driver, buffers are backed by a temporary file, so capture can
+// map them like driver memory.
+struct fake_driver {
+  fake_driver() {
+    char path[] = "/tmp/v4l2-capture-XXXXXX";
+    fd = mkstemp(path);
+    BOOST_TEST_REQUIRE(fd >= 0);
+    unlink(path);
+    BOOST_TEST_REQUIRE(ftruncate(fd, max_buffers * buffer_size) == 0);
+  }
+
+  sv::v4l2_capture::ioctl_fn ioctl() {
+    return [this](int /*fd*/, unsigned long request, void *arg) {
+      return handle(request, arg);
+    };
+  }
+
+  // driver fills the next queued buffer with data.
+  void capture(const std::string &data, uint32_t flags = 0) {
+    BOOST_TEST_REQUIRE(!queued.empty());
+    const uint32_t index = *queued.begin();
+    queued.erase(queued.begin());
+    BOOST_TEST_REQUIRE(pwrite(fd, data.data(), data.size(), index * buffer_size)
+                       == static_cast<ssize_t>(data.size()));
+    v4l2_buffer buffer{};
+    buffer.index = index;
+    buffer.bytesused = static_cast<uint32_t>(data.size());
+    buffer.flags = flags;
+    done.push_back(buffer);
+  }
+
+  int handle(unsigned long request, void *arg) {
+    switch (request) {
+      case VIDIOC_QUERYCAP: {
+        auto *capability = static_cast<v4l2_capability *>(arg);
+        capability->capabilities = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+        return 0;
+      }
+      case VIDIOC_G_FMT: {
+        auto *format = static_cast<v4l2_format *>(arg);
+        format->fmt.pix.width = width;
+        format->fmt.pix.height = height;
+        format->fmt.pix.pixelformat = fourccs.front();
+        return 0;
+      }
+      case VIDIOC_S_FMT: {
+        // like real drivers, picks something supported instead of failing.
+        auto *format = static_cast<v4l2_format *>(arg);
+        tried_fourccs.push_back(format->fmt.pix.pixelformat);
+        if (std::find(fourccs.begin(), fourccs.end(), format->fmt.pix.pixelformat)
+            == fourccs.end()) {
+          format->fmt.pix.pixelformat = fourccs.front();
+        }
+        width = format->fmt.pix.width;
+        height = format->fmt.pix.height;
+        format->fmt.pix.bytesperline = width * 2;
+        return 0;
+      }
+      case VIDIOC_S_PARM: {
+        auto *parameters = static_cast<v4l2_streamparm *>(arg);
+        fps = parameters->parm.capture.timeperframe.denominator;
+        return 0;
+      }
+      case VIDIOC_REQBUFS: {
+        auto *request_buffers = static_cast<v4l2_requestbuffers *>(arg);
+        request_buffers->count = std::min(request_buffers->count, max_buffers);
+        return 0;
+      }
+      case VIDIOC_QUERYBUF: {
+        auto *buffer = static_cast<v4l2_buffer *>(arg);
+        buffer->length = buffer_size;
+        buffer->m.offset = buffer->index * buffer_size;
+        return 0;
+      }
+      case VIDIOC_QBUF: {
+        auto *buffer = static_cast<v4l2_buffer *>(arg);
+        BOOST_TEST(queued.insert(buffer->index).second);
+        return 0;
+      }
+      case VIDIOC_DQBUF: {
+        if (done.empty()) {
+          errno = EAGAIN;
+          return -1;
+        }
+        auto *buffer = static_cast<v4l2_buffer *>(arg);
+        *buffer = done.front();
+        done.pop_front();
+        return 0;
+      }
+      case VIDIOC_STREAMON:
+        streaming = true;
+        return 0;
+      case VIDIOC_STREAMOFF:
+        streaming = false;
+        return 0;
+      default:
+        errno = EINVAL;
+        return -1;
+    }
+  }
+
+  int fd{-1};
+  std::vector<uint32_t> fourccs{V4L2_PIX_FMT_YUYV};
+  uint32_t width{640};
+  uint32_t height{480};
+  uint32_t fps{0};
+  bool streaming{false};
+  std::vector<uint32_t> tried_fourccs;
+  std::set<uint32_t> queued;
+  std::deque<v4l2_buffer> done;
+};
+
+std::unique_ptr<sv::v4l2_capture> open(fake_driver &driver,
+                                       const std::vector<uint32_t> &fourccs,
+                                       uint32_t width = 0, uint32_t height = 0,
+                                       uint32_t fps = 0) {
+  return sv::v4l2_capture::open(driver.fd, "fake", driver.ioctl(), fourccs, width,
+                                height, fps);
+}
+
+sv::v4l2_capture::frame next(sv::v4l2_capture &capture) {
+  auto f = capture.next(std::chrono::milliseconds{100});
+  BOOST_TEST_REQUIRE(f.ok());
+  return f.move();
+}
+
+std::string frame_data(const sv::v4l2_capture::frame &f) {
+  return std::string{reinterpret_cast<const char *>(f.data), f.size};
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(negotiates_first_supported_format) {
+  fake_driver driver;
+  auto capture = open(driver, {V4L2_PIX_FMT_BGR24, V4L2_PIX_FMT_YUYV}, 320, 240, 15);
+  BOOST_TEST_REQUIRE((capture != nullptr));
+
+  BOOST_TEST(driver.tried_fourccs
+             == (std::vector<uint32_t>{V4L2_PIX_FMT_BGR24, V4L2_PIX_FMT_YUYV}));
+  BOOST_TEST(capture->fourcc() == V4L2_PIX_FMT_YUYV);
+  BOOST_TEST(capture->width() == 320);
+  BOOST_TEST(capture->height() == 240);
+  BOOST_TEST(capture->bytes_per_line() == 640);
+  BOOST_TEST(driver.fps == 15);
+  BOOST_TEST(driver.streaming);
+}
+
+BOOST_AUTO_TEST_CASE(keeps_device_size) {
+  fake_driver driver;
+  auto capture = open(driver, {V4L2_PIX_FMT_YUYV});
+  BOOST_TEST_REQUIRE((capture != nullptr));
+  BOOST_TEST(capture->width() == 640);
+  BOOST_TEST(capture->height() == 480);
+  BOOST_TEST(driver.fps == 0);
+}
+
+BOOST_AUTO_TEST_CASE(rejects_unsupported_formats) {
+  fake_driver driver;
+  auto capture = open(driver, {V4L2_PIX_FMT_BGR24, V4L2_PIX_FMT_NV12});
+  BOOST_TEST((capture == nullptr));
+  BOOST_TEST(!driver.streaming);
+}
+
+BOOST_AUTO_TEST_CASE(returns_buffers_once_frames_are_released) {
+  fake_driver driver;
+  auto capture = open(driver, {V4L2_PIX_FMT_YUYV});
+  BOOST_TEST_REQUIRE((capture != nullptr));
+  BOOST_TEST(driver.queued.size() == max_buffers);
+
+  driver.capture("key", V4L2_BUF_FLAG_KEYFRAME);
+  driver.capture("delta");
+  sv::v4l2_capture::frame first = next(*capture);
+  sv::v4l2_capture::frame second = next(*capture);
+  BOOST_TEST(frame_data(first) == "key");
+  BOOST_TEST(first.key_frame);
+  BOOST_TEST(frame_data(second) == "delta");
+  BOOST_TEST(!second.key_frame);
+  BOOST_TEST(driver.queued.size() == max_buffers - 2);
+
+  // copies share the buffer.
+  sv::v4l2_capture::frame copy = first;
+  first = {};
+  BOOST_TEST(driver.queued.size() == max_buffers - 2);
+  copy = {};
+  BOOST_TEST(driver.queued.size() == max_buffers - 1);
+  second = {};
+  BOOST_TEST(driver.queued.size() == max_buffers);
+}
+
+BOOST_AUTO_TEST_CASE(drops_corrupted_frames) {
+  fake_driver driver;
+  auto capture = open(driver, {V4L2_PIX_FMT_YUYV});
+  BOOST_TEST_REQUIRE((capture != nullptr));
+
+  driver.capture("corrupted", V4L2_BUF_FLAG_ERROR);
+  driver.capture("good");
+  sv::v4l2_capture::frame f = next(*capture);
+  BOOST_TEST(frame_data(f) == "good");
+  BOOST_TEST(driver.queued.size() == max_buffers - 1);
+}
+
+BOOST_AUTO_TEST_CASE(frames_outlive_capture) {
+  fake_driver driver;
+  auto capture = open(driver, {V4L2_PIX_FMT_YUYV});
+  BOOST_TEST_REQUIRE((capture != nullptr));
+
+  driver.capture("frame");
+  sv::v4l2_capture::frame f = next(*capture);
+  capture.reset();
+  BOOST_TEST(!driver.streaming);
+
+  // mapping stays while the frame is referenced, buffer isn't queued after stop.
+  BOOST_TEST(frame_data(f) == "frame");
+  f = {};
+  BOOST_TEST(driver.queued.size() == max_buffers - 1);
+}
@@ -0,0 +1,537 @@
+#define BOOST_TEST_MODULE VideoStreamsTest
+#include <boost/test/included/unit_test.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "data.h"
+#include "metrics.h"
+#include "streams/threaded_worker.h"
+#include "video_streams.h"
+
+namespace sv = satori::video;
+
+namespace {
+
+sv::encoded_frame make_frame(size_t size, int64_t id) {
+  std::string data;
+  for (size_t i = 0; i < size; i++) {
+    data.push_back(static_cast<char>(i * 31 + id));
+  }
+  sv::encoded_frame frame;
+  frame.data = std::move(data);
+  frame.id = {id, id};
+  frame.key_frame = id % 2 == 0;
+  return frame;
+}
+
+// keeps publish callbacks, so test decides when to acknowledge.
+struct fake_publisher : sv::rtm::publisher {
+  void publish(const std::string & /*channel*/, nlohmann::json &&message,
+               sv::rtm::request_callbacks *callbacks,
+               const sv::rtm::publish_options &options) override {
+    messages.push_back(std::move(message));
+    pending.push_back(callbacks);
+    acks.push_back(options.ack);
+  }
+
+  void ack_one() {
+    auto *callbacks = pending.front();
+    pending.erase(pending.begin());
+    callbacks->on_ok();
+  }
+
+  std::vector<nlohmann::json> messages;
+  std::vector<sv::rtm::request_callbacks *> pending;
+  std::vector<bool> acks;
+};
+
+// keeps subscriptions, so test decides what data is delivered.
+struct fake_subscriber : sv::rtm::subscriber {
+  void subscribe(const std::string &channel, const sv::rtm::subscription &sub,
+                 sv::rtm::subscription_callbacks &data_callbacks,
+                 sv::rtm::request_callbacks * /*callbacks*/,
+                 const sv::rtm::subscription_options *options) override {
+    subscriptions[channel] = {&sub, &data_callbacks, *options};
+  }
+
+  void unsubscribe(const sv::rtm::subscription & /*sub*/,
+                   sv::rtm::request_callbacks * /*callbacks*/) override {}
+
+  void deliver(const std::string &channel, nlohmann::json &&payload) {
+    auto &s = subscriptions.at(channel);
+    sv::rtm::channel_data data;
+    data.payload = std::move(payload);
+    s.callbacks->on_data(*s.sub, std::move(data));
+  }
+
+  struct subscription_info {
+    const sv::rtm::subscription *sub;
+    sv::rtm::subscription_callbacks *callbacks;
+    sv::rtm::subscription_options options;
+  };
+  std::map<std::string, subscription_info> subscriptions;
+};
+
+// io_service stops once it runs out of handlers.
+void poll(boost::asio::io_service &io) {
+  io.restart();
+  io.poll();
+}
+
+std::vector<sv::encoded_frame> decode(
+    std::vector<sv::network_frame> &&network_frames,
+    const sv::network_decode_options &options = sv::network_decode_options{}) {
+  std::vector<sv::network_packet> packets;
+  for (auto &nf : network_frames) {
+    packets.emplace_back(std::move(nf));
+  }
+
+  std::vector<sv::encoded_frame> frames;
+  auto p = sv::streams::publishers::of(std::move(packets))
+           >> sv::decode_network_stream(options);
+  p->process([&frames](sv::encoded_packet &&packet) {
+    frames.push_back(boost::get<sv::encoded_frame>(packet));
+  });
+  return frames;
+}
+
+// takes packets only when test requests them, from shared demuxer threads.
+struct manual_subscriber : sv::streams::subscriber<sv::encoded_packet> {
+  void on_subscribe(sv::streams::subscription &s) override { src = &s; }
+
+  void on_next(sv::encoded_packet &&packet) override {
+    if (boost::get<sv::encoded_frame>(&packet) != nullptr) {
+      frames++;
+    }
+  }
+
+  void on_error(std::error_condition /*ec*/) override { done = true; }
+
+  void on_complete() override { done = true; }
+
+  sv::streams::subscription *src{nullptr};
+  std::atomic<int> frames{0};
+  std::atomic_bool done{false};
+};
+
+// packets read from url so far, as counted by url source metric.
+double frames_read(const std::string &url) {
+  for (const auto &family : sv::metrics_registry().Collect()) {
+    if (family.name != "url_source_frames_total") {
+      continue;
+    }
+    for (const auto &metric : family.metric) {
+      for (const auto &label : metric.label) {
+        if (label.name == "url" && label.value == url) {
+          return metric.counter.value;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+template <typename Condition>
+void wait_until(Condition &&condition) {
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{10};
+  while (!condition() && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds{1});
+  }
+  BOOST_TEST_REQUIRE(condition());
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(decode_chunked_frames) {
+  const auto f1 = make_frame(100000, 2);
+  const auto f2 = make_frame(10, 3);
+  auto network_frames = f1.to_network();
+  BOOST_TEST(network_frames.size() > 1);
+  for (auto &nf : f2.to_network()) {
+    network_frames.push_back(std::move(nf));
+  }
+
+  const auto frames = decode(std::move(network_frames));
+  BOOST_TEST_REQUIRE(frames.size() == 2);
+  BOOST_TEST(frames[0].data == f1.data);
+  BOOST_TEST(frames[0].id == f1.id);
+  BOOST_TEST(frames[0].key_frame);
+  BOOST_TEST(frames[1].data == f2.data);
+  BOOST_TEST(!frames[1].key_frame);
+}
+
+BOOST_AUTO_TEST_CASE(decode_reordered_chunks) {
+  const auto f1 = make_frame(200000, 2);
+  auto network_frames = f1.to_network();
+  BOOST_TEST_REQUIRE(network_frames.size() > 2);
+  std::reverse(network_frames.begin(), network_frames.end());
+
+  const auto frames = decode(std::move(network_frames));
+  BOOST_TEST_REQUIRE(frames.size() == 1);
+  BOOST_TEST(frames[0].data == f1.data);
+  BOOST_TEST(frames[0].id == f1.id);
+}
+
+BOOST_AUTO_TEST_CASE(decode_interleaved_chunks) {
+  const auto f1 = make_frame(150000, 2);
+  const auto f2 = make_frame(150000, 3);
+  auto chunks1 = f1.to_network();
+  auto chunks2 = f2.to_network();
+  BOOST_TEST_REQUIRE(chunks1.size() == chunks2.size());
+
+  std::vector<sv::network_frame> network_frames;
+  for (size_t i = 0; i < chunks1.size(); i++) {
+    network_frames.push_back(std::move(chunks1[i]));
+    network_frames.push_back(std::move(chunks2[i]));
+  }
+
+  const auto frames = decode(std::move(network_frames));
+  BOOST_TEST_REQUIRE(frames.size() == 2);
+  BOOST_TEST(frames[0].data == f1.data);
+  BOOST_TEST(frames[1].data == f2.data);
+}
+
+BOOST_AUTO_TEST_CASE(decode_duplicate_and_late_chunks) {
+  const auto f1 = make_frame(100000, 2);
+  const auto f2 = make_frame(10, 3);
+  auto chunks1 = f1.to_network();
+
+  std::vector<sv::network_frame> network_frames;
+  network_frames.push_back(chunks1[0]);
+  network_frames.push_back(chunks1[0]);
+  for (auto &nf : chunks1) {
+    network_frames.push_back(nf);
+  }
+  for (auto &nf : f2.to_network()) {
+    network_frames.push_back(std::move(nf));
+  }
+  network_frames.push_back(chunks1[0]);
+
+  const auto frames = decode(std::move(network_frames));
+  BOOST_TEST_REQUIRE(frames.size() == 2);
+  BOOST_TEST(frames[0].data == f1.data);
+  BOOST_TEST(frames[1].data == f2.data);
+}
+
+BOOST_AUTO_TEST_CASE(decode_lost_chunk) {
+  const auto f1 = make_frame(100000, 2);
+  const auto f2 = make_frame(100000, 3);
+  auto chunks1 = f1.to_network();
+  auto chunks2 = f2.to_network();
+
+  std::vector<sv::network_frame> network_frames;
+  for (size_t i = 1; i < chunks1.size(); i++) {
+    network_frames.push_back(std::move(chunks1[i]));
+  }
+  for (auto &nf : chunks2) {
+    network_frames.push_back(std::move(nf));
+  }
+  // frame 2 is already given up.
+  network_frames.push_back(std::move(chunks1[0]));
+
+  const auto frames = decode(std::move(network_frames));
+  BOOST_TEST_REQUIRE(frames.size() == 1);
+  BOOST_TEST(frames[0].data == f2.data);
+  BOOST_TEST(frames[0].id == f2.id);
+}
+
+BOOST_AUTO_TEST_CASE(decode_binary_chunks) {
+  const auto f1 = make_frame(200000, 2);
+  auto network_frames = f1.to_network(sv::payload_encoding::BINARY);
+  BOOST_TEST_REQUIRE(network_frames.size() > 2);
+  std::swap(network_frames.front(), network_frames.back());
+
+  const auto frames = decode(std::move(network_frames));
+  BOOST_TEST_REQUIRE(frames.size() == 1);
+  BOOST_TEST(frames[0].data == f1.data);
+}
+
+BOOST_AUTO_TEST_CASE(decode_key_frames_only) {
+  const auto f1 = make_frame(100000, 2);
+  const auto f2 = make_frame(100000, 3);
+  const auto f3 = make_frame(10, 4);
+  std::vector<sv::network_frame> network_frames;
+  for (const auto *f : {&f1, &f2, &f3}) {
+    for (auto &nf : f->to_network()) {
+      network_frames.push_back(std::move(nf));
+    }
+  }
+
+  sv::network_decode_options options;
+  options.key_frames_only = true;
+  const auto frames = decode(std::move(network_frames), options);
+  BOOST_TEST_REQUIRE(frames.size() == 2);
+  BOOST_TEST(frames[0].data == f1.data);
+  BOOST_TEST(frames[1].data == f3.data);
+}
+
+BOOST_AUTO_TEST_CASE(encoded_packets_drop_until_key_frame) {
+  // requests packets only after upstream has finished, so worker queue overflows.
+  struct lazy_sink : sv::streams::subscriber<std::queue<sv::encoded_packet>> {
+    void on_subscribe(sv::streams::subscription &s) override { src = &s; }
+
+    void on_next(std::queue<sv::encoded_packet> &&q) override {
+      for (; !q.empty(); q.pop()) {
+        const auto *frame = boost::get<sv::encoded_frame>(&q.front());
+        ids.push_back(frame != nullptr ? frame->id.i1 : -1);
+      }
+      src->request(1);
+    }
+
+    void on_error(std::error_condition /*ec*/) override { done = true; }
+
+    void on_complete() override { done = true; }
+
+    sv::streams::subscription *src{nullptr};
+    std::vector<int64_t> ids;
+    std::atomic_bool done{false};
+  };
+
+  auto frame = [](int64_t id, bool key_frame) {
+    sv::encoded_frame f;
+    f.id = {id, id};
+    f.key_frame = key_frame;
+    return sv::encoded_packet{f};
+  };
+  std::vector<sv::encoded_packet> packets{
+      sv::encoded_metadata{"vp9"}, frame(1, true),  frame(2, false),
+      frame(3, false),             frame(4, false), sv::encoded_metadata{"vp9"},
+      frame(5, true),              frame(6, false)};
+
+  lazy_sink sink;
+  auto p = sv::streams::publishers::of(std::move(packets))
+           >> sv::streams::threaded_worker(
+                  "test", 3, sv::streams::overflow_policy::DROP_UNTIL_KEY_FRAME);
+  p->subscribe(sink);
+  BOOST_TEST_REQUIRE(sink.src);
+  sink.src->request(1);
+  while (!sink.done) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  // frame 3 doesn't fit, so frames are dropped until metadata, which also replaces
+  // stale queued packets.
+  BOOST_TEST(sink.ids == std::vector<int64_t>({-1, 5, 6}));
+}
+
+BOOST_AUTO_TEST_CASE(rtm_sink_waits_for_acks) {
+  boost::asio::io_service io;
+  auto client = std::make_shared<fake_publisher>();
+  std::vector<sv::encoded_packet> packets;
+  for (int i = 0; i < 10; i++) {
+    packets.emplace_back(make_frame(1000, i));
+  }
+
+  sv::rtm_sink_options options;
+  options.max_in_flight_bytes = 3000;
+  sv::streams::publishers::of(std::move(packets))
+      ->subscribe(sv::rtm_sink(client, io, "test", 1, options));
+  poll(io);
+  // base64 payload of each frame is larger than 1000 bytes.
+  BOOST_TEST(client->messages.size() == 3);
+
+  client->ack_one();
+  poll(io);
+  BOOST_TEST(client->messages.size() == 4);
+
+  while (!client->pending.empty()) {
+    client->ack_one();
+    poll(io);
+  }
+  BOOST_TEST(client->messages.size() == 10);
+}
+
+BOOST_AUTO_TEST_CASE(rtm_sink_publishes_unconfirmed_frames) {
+  boost::asio::io_service io;
+  auto client = std::make_shared<fake_publisher>();
+  std::vector<sv::encoded_packet> packets;
+  packets.emplace_back(make_frame(10, 0));
+  packets.emplace_back(make_frame(10, 1));
+
+  sv::rtm_sink_options options;
+  options.ack_frames = false;
+  sv::streams::publishers::of(std::move(packets))
+      ->subscribe(sv::rtm_sink(client, io, "test", 16, options));
+  poll(io);
+
+  BOOST_TEST_REQUIRE(client->acks.size() == 2);
+  BOOST_TEST(!client->acks[0]);
+  BOOST_TEST(!client->acks[1]);
+  while (!client->pending.empty()) {
+    client->ack_one();
+  }
+  poll(io);
+}
+
+BOOST_AUTO_TEST_CASE(rtm_sink_drops_stale_frames) {
+  boost::asio::io_service io;
+  auto client = std::make_shared<fake_publisher>();
+  const auto now = std::chrono::system_clock::now();
+  const auto old = now - std::chrono::seconds{1};
+  std::vector<sv::encoded_packet> packets;
+  for (const auto &t : {std::make_pair(true, old), std::make_pair(false, old),
+                        std::make_pair(false, now), std::make_pair(true, now),
+                        std::make_pair(false, now)}) {
+    sv::encoded_frame f = make_frame(10, packets.size());
+    f.key_frame = t.first;
+    f.creation_time = t.second;
+    packets.emplace_back(std::move(f));
+  }
+
+  sv::rtm_sink_options options;
+  options.max_frame_age = std::chrono::milliseconds{100};
+  sv::streams::publishers::of(std::move(packets))
+      ->subscribe(sv::rtm_sink(client, io, "test", 16, options));
+  poll(io);
+
+  BOOST_TEST_REQUIRE(client->messages.size() == 3);
+  BOOST_TEST(client->messages[0]["i"][0] == 0);
+  BOOST_TEST(client->messages[1]["i"][0] == 3);
+  BOOST_TEST(client->messages[2]["i"][0] == 4);
+  while (!client->pending.empty()) {
+    client->ack_one();
+  }
+  poll(io);
+}
+
+BOOST_AUTO_TEST_CASE(rtm_sink_acked_after_flush_timeout) {
+  boost::asio::io_service io;
+  auto client = std::make_shared<fake_publisher>();
+  std::vector<sv::encoded_packet> packets;
+  packets.emplace_back(make_frame(10, 0));
+
+  sv::rtm_sink_options options;
+  options.flush_timeout = std::chrono::milliseconds{1};
+  sv::streams::publishers::of(std::move(packets))
+      ->subscribe(sv::rtm_sink(client, io, "test", 16, options));
+  poll(io);
+  BOOST_TEST_REQUIRE(client->pending.size() == 1);
+
+  // the ack and the expired flush timer are handled in the same poll.
+  std::this_thread::sleep_for(std::chrono::milliseconds{10});
+  io.post([client]() { client->ack_one(); });
+  poll(io);
+  BOOST_TEST(client->pending.empty());
+}
+
+BOOST_AUTO_TEST_CASE(rtm_source_starts_from_history_key_frame) {
+  auto client = std::make_shared<fake_subscriber>();
+  sv::rtm_source_options options;
+  options.key_frame_history = std::chrono::seconds{10};
+
+  std::vector<sv::network_frame> frames;
+  auto source = sv::rtm_source(client, "test", options);
+  source->process([&frames](sv::network_packet &&packet) {
+    frames.push_back(boost::get<sv::network_frame>(packet));
+  });
+
+  const auto &frames_sub = client->subscriptions.at("test");
+  BOOST_TEST(frames_sub.options.history.age.get() == 10);
+  BOOST_TEST(!client->subscriptions.at("test/metadata").options.history.age);
+
+  for (int64_t id = 1; id <= 4; id++) {
+    sv::encoded_frame f = make_frame(10, id);
+    f.key_frame = id == 3;
+    client->deliver("test", f.to_network()[0].to_json());
+  }
+
+  BOOST_TEST_REQUIRE(frames.size() == 2);
+  BOOST_TEST(frames[0].id.i1 == 3);
+  BOOST_TEST(frames[0].key_frame);
+  BOOST_TEST(frames[1].id.i1 == 4);
+}
+
+BOOST_AUTO_TEST_CASE(repeat_metadata_before_key_frames) {
+  sv::encoded_metadata metadata;
+  metadata.codec_name = "test";
+  std::vector<sv::encoded_packet> packets;
+  packets.emplace_back(metadata);
+  // make_frame marks frames with even ids as key frames.
+  for (int64_t id = 0; id < 6; id++) {
+    packets.emplace_back(make_frame(10, id));
+  }
+
+  std::vector<std::string> kinds;
+  auto when_done = (sv::streams::publishers::of(std::move(packets))
+                    >> sv::repeat_metadata(2))
+                       ->process([&kinds](sv::encoded_packet &&packet) {
+                         const auto *f = boost::get<sv::encoded_frame>(&packet);
+                         kinds.push_back(f == nullptr ? "m" : std::to_string(f->id.i1));
+                       });
+  BOOST_TEST(when_done.ok());
+
+  // metadata is not duplicated in front of the first key frame.
+  const std::vector<std::string> expected{"m", "0", "1", "2", "3", "m", "4", "5"};
+  BOOST_TEST(kinds == expected, boost::test_tools::per_element());
+}
+
+BOOST_AUTO_TEST_CASE(url_source_shared_demuxer_waits_for_consumer) {
+  const std::string url = "test_data/test.mp4";
+  sv::url_source_options options;
+  options.shared_demuxer = true;
+  options.max_queued_packets = 1;
+
+  manual_subscriber consumer;
+  auto source = sv::url_source(url, options);
+  source->subscribe(consumer);
+  BOOST_TEST_REQUIRE(consumer.src);
+  // metadata and the first frame.
+  consumer.src->request(2);
+  wait_until([&consumer]() { return consumer.frames == 1; });
+
+  // a packet taken by stages in between, one queued, and then reading pauses.
+  std::this_thread::sleep_for(std::chrono::milliseconds{200});
+  BOOST_TEST(consumer.frames == 1);
+  BOOST_TEST(frames_read(url) <= 3);
+
+  consumer.src->request(100);
+  wait_until([&consumer]() { return consumer.done.load(); });
+  BOOST_TEST(consumer.frames == 6);
+  BOOST_TEST(frames_read(url) == 6);
+}
+
+BOOST_AUTO_TEST_CASE(url_source_shared_demuxer_takes_turns) {
+  sv::url_source_options options;
+  options.shared_demuxer = true;
+  options.max_queued_packets = 1;
+
+  // more paused sources than pool threads, they give their turns away.
+  const size_t paused_count = std::thread::hardware_concurrency() + 1;
+  std::vector<std::string> paused_urls;
+  std::vector<std::unique_ptr<manual_subscriber>> paused;
+  for (size_t i = 0; i < paused_count; i++) {
+    std::string url = "test_data/test.mp4";
+    for (size_t j = 0; j <= i; j++) {
+      url = "./" + url;
+    }
+    paused.push_back(std::make_unique<manual_subscriber>());
+    sv::url_source(url, options)->subscribe(*paused.back());
+    BOOST_TEST_REQUIRE(paused.back()->src);
+    paused.back()->src->request(2);
+    paused_urls.push_back(std::move(url));
+  }
+  for (size_t i = 0; i < paused_count; i++) {
+    wait_until([&paused, i]() { return paused[i]->frames == 1; });
+  }
+
+  manual_subscriber consumer;
+  sv::url_source("test_data/../test_data/test.mp4", options)->subscribe(consumer);
+  BOOST_TEST_REQUIRE(consumer.src);
+  consumer.src->request(100);
+  wait_until([&consumer]() { return consumer.done.load(); });
+  BOOST_TEST(consumer.frames == 6);
+
+  for (size_t i = 0; i < paused_count; i++) {
+    BOOST_TEST(!paused[i]->done);
+    BOOST_TEST(frames_read(paused_urls[i]) <= 3);
+    paused[i]->src->cancel();
+  }
+}
@@ -52,3 +52,75 @@ BOOST_AUTO_TEST_CASE(vp9_encoder) {
             << ", key_frames_count = " << key_frames_count;
   BOOST_TEST(min_key_frames_count <= key_frames_count);
 }
+
+BOOST_AUTO_TEST_CASE(vp9_encoder_realtime_profile) {
+  encoder_profile profile = encoder_profile::realtime();
+  profile.keyint = 5;
+  profile.bitrate = 100000;
+
+  auto frames = streams::publishers::range(0, 20) >> streams::map([](int i) {
+    uint8_t pixel_data[] = {0xff, 0x88, 0x11};
+    owned_image_frame f;
+    f.id = {i, i};
+    f.pixel_format = image_pixel_format::RGB0;
+    f.width = 1;
+    f.height = 1;
+    f.plane_data[0] = std::string{pixel_data, pixel_data + sizeof(pixel_data)};
+    f.plane_strides[0] = 3;
+    return owned_image_packet{f};
+  });
+
+  std::vector<int64_t> frame_ids;
+  int key_frames_count{0};
+  auto encoded_stream = std::move(frames) >> encode_vp9(profile);
+  auto when_done =
+      encoded_stream->process([&frame_ids, &key_frames_count](encoded_packet &&packet) {
+        if (const encoded_frame *f = boost::get<encoded_frame>(&packet)) {
+          frame_ids.push_back(f->id.i1);
+          key_frames_count += f->key_frame ? 1 : 0;
+        }
+      });
+  BOOST_CHECK(when_done.ok());
+
+  // without look ahead every frame is encoded as soon as it comes.
+  BOOST_TEST(frame_ids.size() == 20);
+  for (size_t i = 0; i < frame_ids.size(); i++) {
+    BOOST_TEST(frame_ids[i] == static_cast<int64_t>(i));
+  }
+  BOOST_TEST(key_frames_count >= 4);
+}
+
+BOOST_AUTO_TEST_CASE(encoder_profile_names) {
+  BOOST_TEST(encoder_profile_by_name("good")->deadline == "good");
+  BOOST_TEST(encoder_profile_by_name("realtime")->deadline == "realtime");
+  BOOST_TEST(encoder_profile_by_name("realtime")->lag_in_frames == 0);
+  BOOST_TEST(!encoder_profile_by_name("fast"));
+}
+
+BOOST_AUTO_TEST_CASE(vp9_encoder_yuv_input) {
+  // encoder's own pixel format skips conversion.
+  auto frames = streams::publishers::range(0, 10) >> streams::map([](int i) {
+                  owned_image_frame f;
+                  f.id = {i, i};
+                  f.pixel_format = image_pixel_format::YUV420P;
+                  f.width = 16;
+                  f.height = 16;
+                  f.plane_data[0] = std::string(16 * 16, static_cast<char>(i * 20));
+                  f.plane_strides[0] = 16;
+                  f.plane_data[1] = std::string(8 * 8, 0x40);
+                  f.plane_strides[1] = 8;
+                  f.plane_data[2] = std::string(8 * 8, 0x60);
+                  f.plane_strides[2] = 8;
+                  return owned_image_packet{f};
+                });
+
+  int frames_count{0};
+  auto when_done = (std::move(frames) >> encode_vp9(encoder_profile::realtime()))
+                       ->process([&frames_count](encoded_packet &&packet) {
+                         if (boost::get<encoded_frame>(&packet) != nullptr) {
+                           frames_count++;
+                         }
+                       });
+  BOOST_CHECK(when_done.ok());
+  BOOST_TEST(frames_count == 10);
+}